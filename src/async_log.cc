@@ -0,0 +1,231 @@
+#include "async_log.h"
+
+#include "platform.h"
+#include "timer.h"
+
+#include <doctest/doctest.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Messages each thread buffers before it starts dropping its oldest ones.
+const size_t kRingSize = 8192;
+// The writer wakes up this often, or once a ring is half full.
+const int kWriteIntervalMs = 200;
+
+long long GetCurrentTimeInMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             Timer::Clock::now().time_since_epoch())
+      .count();
+}
+
+struct LogLine {
+  // Orders the lines of all threads.
+  uint64_t sequence;
+  std::string text;
+};
+
+struct ThreadRing {
+  std::mutex mutex;
+  // Guarded by |mutex|. |lines| holds up to kRingSize lines, the oldest at
+  // |begin|.
+  std::vector<LogLine> lines;
+  size_t begin = 0;
+  size_t dropped = 0;
+
+  // Appends |line|, and returns true once the writer should be woken up.
+  bool Push(LogLine line) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (lines.size() < kRingSize) {
+      lines.push_back(std::move(line));
+      return lines.size() == kRingSize / 2;
+    }
+    lines[begin] = std::move(line);
+    begin = (begin + 1) % kRingSize;
+    dropped++;
+    return false;
+  }
+
+  // Moves the lines out, oldest first, and returns how many were dropped.
+  size_t Take(std::vector<LogLine>* out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < lines.size(); i++)
+      out->push_back(std::move(lines[(begin + i) % lines.size()]));
+    lines.clear();
+    begin = 0;
+    size_t result = dropped;
+    dropped = 0;
+    return result;
+  }
+};
+
+class AsyncLog {
+ public:
+  static AsyncLog* Get() {
+    static AsyncLog* log = new AsyncLog();
+    return log;
+  }
+
+  bool Open(const std::string& path, loguru::Verbosity verbosity) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (file_)
+      return true;
+    file_ = fopen(path.c_str(), "w");
+    if (!file_)
+      return false;
+    loguru::add_callback("async_log", &AsyncLog::OnMessage, this, verbosity,
+                         &AsyncLog::OnClose);
+    std::thread([this]() {
+      SetCurrentThreadName("log");
+      WriterMain();
+    }).detach();
+    atexit([]() { AsyncLog::Get()->Flush(); });
+    return true;
+  }
+
+  // Writes the lines of every thread in the order they were logged.
+  void Flush() {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (!file_)
+      return;
+    std::vector<std::shared_ptr<ThreadRing>> rings;
+    {
+      std::lock_guard<std::mutex> rings_lock(rings_mutex_);
+      rings = rings_;
+    }
+    std::vector<LogLine> lines;
+    size_t dropped = 0;
+    for (const std::shared_ptr<ThreadRing>& ring : rings)
+      dropped += ring->Take(&lines);
+    if (lines.empty() && dropped == 0)
+      return;
+    std::sort(lines.begin(), lines.end(),
+              [](const LogLine& a, const LogLine& b) {
+                return a.sequence < b.sequence;
+              });
+    if (dropped > 0) {
+      fprintf(file_, "[async_log] Dropped %zu messages logged faster than "
+              "they could be written\n", dropped);
+    }
+    for (const LogLine& line : lines)
+      fwrite(line.text.data(), 1, line.text.size(), file_);
+    fflush(file_);
+  }
+
+ private:
+  static void OnMessage(void* user_data, const loguru::Message& message) {
+    auto* log = static_cast<AsyncLog*>(user_data);
+    LogLine line;
+    line.sequence = log->next_sequence_++;
+    line.text.reserve(256);
+    line.text += message.preamble;
+    line.text += message.indentation;
+    line.text += message.prefix;
+    line.text += message.message;
+    line.text += '\n';
+    if (log->GetThreadRing()->Push(std::move(line)))
+      log->wake_up_.notify_one();
+    // The process aborts after a fatal message.
+    if (message.verbosity == loguru::Verbosity_FATAL)
+      log->Flush();
+  }
+
+  static void OnClose(void* user_data) {
+    static_cast<AsyncLog*>(user_data)->Flush();
+  }
+
+  ThreadRing* GetThreadRing() {
+    // The rings outlive their threads until their lines are written.
+    thread_local std::shared_ptr<ThreadRing> ring;
+    if (!ring) {
+      ring = std::make_shared<ThreadRing>();
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      rings_.push_back(ring);
+    }
+    return ring.get();
+  }
+
+  void WriterMain() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(wake_up_mutex_);
+        wake_up_.wait_for(lock, std::chrono::milliseconds(kWriteIntervalMs));
+      }
+      Flush();
+      // Forget the rings of threads which exited once they are written.
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                  [](const std::shared_ptr<ThreadRing>& ring) {
+                                    return ring.use_count() == 1;
+                                  }),
+                   rings_.end());
+    }
+  }
+
+  std::atomic<uint64_t> next_sequence_{0};
+
+  std::mutex rings_mutex_;
+  std::vector<std::shared_ptr<ThreadRing>> rings_;
+
+  // Held while writing to |file_|.
+  std::mutex write_mutex_;
+  FILE* file_ = nullptr;
+
+  std::mutex wake_up_mutex_;
+  std::condition_variable wake_up_;
+};
+
+}  // namespace
+
+bool AddAsyncLogFile(const std::string& path, loguru::Verbosity verbosity) {
+  return AsyncLog::Get()->Open(path, verbosity);
+}
+
+void FlushAsyncLog() {
+  AsyncLog::Get()->Flush();
+}
+
+LogRateLimiter::LogRateLimiter(const char* file, int line, int max_per_second)
+    : file_(file), line_(line), max_per_second_(max_per_second) {}
+
+bool LogRateLimiter::Allow() {
+  long long now = GetCurrentTimeInMilliseconds();
+  int suppressed = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (now - window_start_ms_ >= 1000) {
+      window_start_ms_ = now;
+      allowed_ = 0;
+      suppressed = suppressed_;
+      suppressed_ = 0;
+    }
+    if (allowed_ >= max_per_second_) {
+      suppressed_++;
+      return false;
+    }
+    allowed_++;
+  }
+  if (suppressed > 0) {
+    LOG_S(INFO) << "Suppressed " << suppressed << " messages from " << file_
+                << ":" << line_;
+  }
+  return true;
+}
+
+TEST_SUITE("AsyncLog") {
+  TEST_CASE("rate limit") {
+    LogRateLimiter limiter(__FILE__, __LINE__, 2);
+    REQUIRE(limiter.Allow());
+    REQUIRE(limiter.Allow());
+    REQUIRE(!limiter.Allow());
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <loguru.hpp>
+
+#include <mutex>
+#include <string>
+
+// Writes the messages of at most |verbosity| to the file |path| on a
+// background thread, like loguru::add_file but without blocking the logging
+// thread on the disk. Each thread appends its messages to a ring buffer of its
+// own; if a thread logs faster than the messages are written, its oldest
+// messages are dropped and counted in the log. Fatal messages are written
+// right away. Returns false if |path| cannot be opened.
+bool AddAsyncLogFile(const std::string& path, loguru::Verbosity verbosity);
+
+// Writes every message logged so far. Runs at exit.
+void FlushAsyncLog();
+
+// Lets through at most |max_per_second| messages per second from one call
+// site, and logs how many it suppressed once messages are let through again.
+class LogRateLimiter {
+ public:
+  LogRateLimiter(const char* file, int line, int max_per_second);
+
+  bool Allow();
+
+ private:
+  const char* file_;
+  int line_;
+  int max_per_second_;
+
+  std::mutex mutex_;
+  // Guarded by |mutex_|.
+  long long window_start_ms_ = 0;
+  int allowed_ = 0;
+  int suppressed_ = 0;
+};
+
+// Like LOG_S(verbosity_name), for messages which may be logged for every file
+// or update: at most |max_per_second| messages per second are logged from the
+// call site. Like with LOG_S, the message is only built if it is logged.
+#define LOG_RATE_LIMITED_S(verbosity_name, max_per_second)                 \
+  LOG_IF_S(verbosity_name, []() -> bool {                                 \
+    static LogRateLimiter limiter(__FILE__, __LINE__, (max_per_second));  \
+    return limiter.Allow();                                               \
+  }())
@@ -0,0 +1,374 @@
+// Microbenchmarks of the querydb and matching hot paths. Builds synthetic
+// indexes of several sizes, so the results do not depend on libclang or on a
+// checkout of some project, and reports the time and the number of heap
+// allocations per operation.
+//
+// Usage: cquery_benchmark [--symbols=10000,100000,1000000] [--filter=<name>]
+
+#include "fuzzy_match.h"
+#include "indexer.h"
+#include "options.h"
+#include "query.h"
+#include "query_utils.h"
+#include "serializer.h"
+#include "timer.h"
+#include "utils.h"
+#include "working_files.h"
+
+#include <loguru.hpp>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Defined by command_line.cc in the cquery binary.
+std::string g_init_options;
+bool g_debug;
+
+namespace {
+
+std::atomic<long long> g_num_allocations{0};
+
+}  // namespace
+
+// Every allocation of the process goes through these, including the ones of
+// the standard library.
+void* operator new(size_t size) {
+  g_num_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+namespace {
+
+// Symbols per synthetic file, about the size of a large translation unit.
+const int kSymbolsPerFile = 1000;
+// Every this many symbols of a file is declared in a header which all files
+// share; the others belong to the file.
+const int kSharedSymbolInterval = 10;
+const int kUsesPerSymbol = 4;
+
+const char* kNameWords[] = {"index", "query", "file",   "symbol",
+                            "cache", "update", "range", "name",
+                            "type",  "func",  "var",    "location"};
+const int kNumNameWords = sizeof(kNameWords) / sizeof(kNameWords[0]);
+
+// Returns a camelCase name of three words, derived from |seed|.
+std::string MakeName(uint64_t seed) {
+  std::string name;
+  for (int i = 0; i < 3; i++) {
+    std::string word = kNameWords[seed % kNumNameWords];
+    seed /= kNumNameWords;
+    if (i > 0)
+      word[0] = char(toupper(word[0]));
+    name += word;
+  }
+  return name;
+}
+
+// Sets the names of |def| to |short_name| between |prefix| and |suffix|.
+template <typename TDef>
+void SetNames(TDef* def,
+              const std::string& prefix,
+              const std::string& short_name,
+              const std::string& suffix) {
+  def->detailed_name = prefix + short_name + suffix;
+  def->short_name_offset = int16_t(prefix.size());
+  def->short_name_size = int16_t(short_name.size());
+}
+
+// Builds the index of file |file_index| of a synthetic project, with
+// |num_symbols| types, functions and variables. Every use of a symbol is on a
+// line of its own; |line_shift| moves all of them, like an edit at the top of
+// the file does.
+std::unique_ptr<IndexFile> MakeIndexFile(int file_index,
+                                         int num_symbols,
+                                         int line_shift) {
+  std::string path = "/synthetic/file" + std::to_string(file_index) + ".cc";
+  auto file = MakeUnique<IndexFile>(path, "");
+  file->language = LanguageId::Cpp;
+  std::string ns = "ns" + std::to_string(file_index % 16) + "::";
+  int line = line_shift;
+  for (int i = 0; i < num_symbols; i++) {
+    bool shared = i % kSharedSymbolInterval == 0;
+    std::string usr_name =
+        shared ? "shared@" + std::to_string(i) : path + "@" + std::to_string(i);
+    Usr usr = HashUsr(usr_name);
+    std::string name = MakeName(HashUsr(usr_name + "#name"));
+    // Only the first file defines the shared symbols.
+    bool defines = !shared || file_index == 0;
+    Range spelling(Position(line, 2), Position(line, 2 + int(name.size())));
+    line++;
+    std::vector<Range> uses;
+    for (int j = 0; j < kUsesPerSymbol; j++, line++)
+      uses.push_back(Range(Position(line, 4), Position(line, 4 + 8)));
+
+    switch (i % 3) {
+      case 0: {
+        IndexType* type = file->Resolve(file->ToTypeId(usr));
+        name[0] = char(toupper(name[0]));
+        SetNames(&type->def, "class " + ns, name, "");
+        if (defines) {
+          type->def.definition_spelling = spelling;
+          type->def.definition_extent = spelling;
+        }
+        type->uses = uses;
+        break;
+      }
+      case 1: {
+        IndexFunc* func = file->Resolve(file->ToFuncId(usr));
+        SetNames(&func->def, "void " + ns, name, "(int)");
+        if (defines) {
+          func->def.definition_spelling = spelling;
+          func->def.definition_extent = spelling;
+        }
+        for (const Range& use : uses)
+          func->callers.push_back(IndexFuncRef(use, false /*is_implicit*/));
+        break;
+      }
+      case 2: {
+        IndexVar* var = file->Resolve(file->ToVarId(usr));
+        SetNames(&var->def, "int " + ns, name, "");
+        if (defines) {
+          var->def.definition_spelling = spelling;
+          var->def.definition_extent = spelling;
+        }
+        var->uses = uses;
+        break;
+      }
+    }
+  }
+  return file;
+}
+
+// Returns |num_lines| lines of source, the index contents of the line mapping
+// benchmark.
+std::string MakeFileContents(int num_lines) {
+  std::string contents;
+  for (int i = 0; i < num_lines; i++) {
+    contents += "  int " + MakeName(HashUsr(std::to_string(i))) + " = " +
+                std::to_string(i) + ";\n";
+  }
+  return contents;
+}
+
+// Returns |contents| with a line inserted after every |interval| lines, like
+// the buffer of a file which was edited since it was indexed.
+std::string InsertLines(const std::string& contents, int interval) {
+  std::string result;
+  int line = 0;
+  for (char c : contents) {
+    result += c;
+    if (c == '\n' && ++line % interval == 0)
+      result += "  // edited\n";
+  }
+  return result;
+}
+
+struct BenchmarkRunner {
+  std::string filter;
+  int num_symbols = 0;
+
+  // Runs |fn|, which performs |num_ops| operations, and prints the time and
+  // the allocations per operation. Setup belongs outside of |fn|.
+  void Run(const std::string& name,
+           size_t num_ops,
+           const std::function<void()>& fn) {
+    if (!filter.empty() && name.find(filter) == std::string::npos)
+      return;
+    long long allocations = g_num_allocations.load();
+    Timer::Clock::time_point start = Timer::Clock::now();
+    fn();
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       Timer::Clock::now() - start)
+                       .count();
+    allocations = g_num_allocations.load() - allocations;
+    if (num_ops == 0)
+      num_ops = 1;
+    printf("%-28s %9d %9zu %14.1f %11.1f\n", name.c_str(), num_symbols,
+           num_ops, double(ns) / num_ops, double(allocations) / num_ops);
+    fflush(stdout);
+  }
+};
+
+void RunBenchmarks(BenchmarkRunner* runner) {
+  int num_symbols = runner->num_symbols;
+  int num_files = std::max(1, num_symbols / kSymbolsPerFile);
+  int symbols_per_file = std::min(num_symbols, kSymbolsPerFile);
+
+  std::vector<std::unique_ptr<IndexFile>> files;
+  for (int i = 0; i < num_files; i++)
+    files.push_back(MakeIndexFile(i, symbols_per_file, 0));
+
+  QueryDatabase db;
+  std::vector<std::unique_ptr<IdMap>> id_maps(files.size());
+  runner->Run("IdMap (new file)", files.size(), [&]() {
+    for (size_t i = 0; i < files.size(); i++)
+      id_maps[i] = MakeUnique<IdMap>(&db, files[i]->id_cache);
+  });
+
+  std::vector<IndexUpdate> updates;
+  updates.reserve(files.size());
+  runner->Run("CreateDelta (new file)", files.size(), [&]() {
+    for (size_t i = 0; i < files.size(); i++) {
+      updates.push_back(IndexUpdate::CreateDelta(nullptr, id_maps[i].get(),
+                                                 nullptr, files[i].get()));
+    }
+  });
+
+  runner->Run("ApplyIndexUpdate (new file)", updates.size(), [&]() {
+    for (IndexUpdate& update : updates)
+      db.ApplyIndexUpdate(&update);
+  });
+  updates.clear();
+
+  // Re-index a sample of the files after an edit which moved every symbol.
+  size_t num_changed = std::min(files.size(), size_t(100));
+  std::vector<std::unique_ptr<IndexFile>> changed;
+  for (size_t i = 0; i < num_changed; i++)
+    changed.push_back(MakeIndexFile(int(i), symbols_per_file, 1));
+  std::vector<std::unique_ptr<IdMap>> changed_maps(num_changed);
+  runner->Run("IdMap (known file)", num_changed, [&]() {
+    for (size_t i = 0; i < num_changed; i++)
+      changed_maps[i] = MakeUnique<IdMap>(&db, changed[i]->id_cache);
+  });
+  runner->Run("CreateDelta (edited file)", num_changed, [&]() {
+    for (size_t i = 0; i < num_changed; i++) {
+      updates.push_back(IndexUpdate::CreateDelta(
+          id_maps[i].get(), changed_maps[i].get(), files[i].get(),
+          changed[i].get()));
+    }
+  });
+  runner->Run("ApplyIndexUpdate (edited)", updates.size(), [&]() {
+    for (IndexUpdate& update : updates)
+      db.ApplyIndexUpdate(&update);
+  });
+  updates.clear();
+
+  // References of every type, function and variable, as find references
+  // looks them up.
+  std::vector<SymbolIdx> symbols;
+  for (const SymbolIdx& symbol : db.symbols) {
+    if (symbol.kind != SymbolKind::File)
+      symbols.push_back(symbol);
+  }
+  size_t num_uses = 0;
+  runner->Run("GetUsesOfSymbol", symbols.size(), [&]() {
+    for (const SymbolIdx& symbol : symbols)
+      num_uses += GetUsesOfSymbol(&db, symbol, true /*include_decl*/).size();
+  });
+
+  // Score every symbol name like workspace/symbol does for each candidate.
+  std::vector<int> score, dp;
+  long long total_score = 0;
+  runner->Run("FuzzyEvaluate", db.symbols.size(), [&]() {
+    for (size_t i = 0; i < db.symbols.size(); i++) {
+      std::string_view name = db.GetSymbolShortName(RawId(i));
+      if (score.size() < name.size()) {
+        score.resize(name.size());
+        dp.resize(name.size());
+      }
+      total_score += FuzzyEvaluate("qUpdRange", name, score, dp);
+    }
+  });
+
+  // One line per ten symbols, with an edit every 50 lines.
+  std::string index_contents =
+      MakeFileContents(std::max(1000, num_symbols / 10));
+  WorkingFile working_file("/synthetic/file0.cc",
+                           InsertLines(index_contents, 50));
+  const int kLineMappingOps = 10;
+  runner->Run("ComputeLineMapping", kLineMappingOps, [&]() {
+    for (int i = 0; i < kLineMappingOps; i++) {
+      working_file.SetIndexContent(index_contents, 0);
+      working_file.GetBufferPosFromIndexPos(1, nullptr, false);
+    }
+  });
+
+  struct Format {
+    const char* name;
+    SerializeFormat format;
+  };
+  Format formats[] = {{"json", SerializeFormat::Json},
+                      {"msgpack", SerializeFormat::MessagePack},
+                      {"binary", SerializeFormat::Binary}};
+  size_t num_serialized = std::min(files.size(), size_t(20));
+  for (const Format& format : formats) {
+    std::vector<std::string> serialized(num_serialized);
+    runner->Run(std::string("Serialize (") + format.name + ")",
+                num_serialized, [&]() {
+                  for (size_t i = 0; i < num_serialized; i++)
+                    serialized[i] = Serialize(format.format, *files[i]);
+                });
+    runner->Run(std::string("Deserialize (") + format.name + ")",
+                num_serialized, [&]() {
+                  for (size_t i = 0; i < num_serialized; i++) {
+                    if (!Deserialize(format.format, files[i]->path,
+                                     serialized[i], "",
+                                     IndexFile::kMajorVersion)) {
+                      LOG_S(ERROR) << "Failed to deserialize "
+                                   << files[i]->path;
+                    }
+                  }
+                });
+  }
+
+  // Keep the results alive so the compiler cannot drop the work.
+  if (num_uses == 0 && total_score == 0)
+    printf("no results\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::unordered_map<std::string, std::string> options =
+      ParseOptions(argc, argv);
+  if (HasOption(options, "-h") || HasOption(options, "--help")) {
+    printf(
+        "Usage: cquery_benchmark [--symbols=<n>[,<n>...]] "
+        "[--filter=<name>]\n\n"
+        "Runs the microbenchmarks on synthetic indexes of each given number\n"
+        "of symbols (default 10000,100000,1000000; up to a few million fit\n"
+        "in memory). --filter runs only the benchmarks whose name contains\n"
+        "<name>.\n");
+    return 0;
+  }
+  loguru::g_stderr_verbosity = loguru::Verbosity_WARNING;
+  loguru::init(argc, argv);
+
+  std::vector<int> scales = {10000, 100000, 1000000};
+  if (HasOption(options, "--symbols")) {
+    scales.clear();
+    std::stringstream stream(options["--symbols"]);
+    std::string scale;
+    while (std::getline(stream, scale, ',')) {
+      if (atoi(scale.c_str()) > 0)
+        scales.push_back(atoi(scale.c_str()));
+    }
+  }
+
+  BenchmarkRunner runner;
+  runner.filter = options["--filter"];
+  printf("%-28s %9s %9s %14s %11s\n", "benchmark", "symbols", "ops", "ns/op",
+         "allocs/op");
+  for (int scale : scales) {
+    runner.num_symbols = scale;
+    RunBenchmarks(&runner);
+  }
+  return 0;
+}
@@ -0,0 +1,277 @@
+#include "cache_collector.h"
+
+#include "cache_compression.h"
+#include "cache_manager.h"
+#include "config.h"
+#include "platform.h"
+#include "timer.h"
+#include "timestamp_manager.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Entries used within this many seconds are never removed. Files which are
+// indexed right now are not in the include graph yet, and other cquery
+// instances may be writing to the same cache directory.
+const int64_t kGracePeriodSeconds = 60 * 60;
+
+// Length of the names of the blobs in ICacheManager::kContentsBlobDirectory.
+const size_t kBlobNameLength = 16;
+
+// The files stored under one cache entry name: the name of the blob with the
+// file contents, and the index in each cache format.
+struct CacheEntry {
+  std::vector<std::string> files;
+  // Blob holding the contents of the file, if known.
+  std::string blob;
+  int64_t bytes = 0;
+  // The latest access or modification time of the files. Most file systems
+  // only update access times about once a day, which is still fine to tell
+  // entries used this week from entries unused for months.
+  int64_t last_used = 0;
+  // Set if the entry belongs to a file of the project or included by it.
+  optional<std::string> used_by;
+};
+
+bool IsSpecialDirectory(const std::string& name) {
+  return name == ICacheManager::kContentsBlobDirectory ||
+         name == ICacheManager::kPackedCacheDirectory ||
+         name == ICacheManager::kProfileDirectory ||
+         name == CacheCompressor::kDictionaryDirectory;
+}
+
+// Returns the name of the entry |file| of |files| belongs to: |file| itself
+// for the blob name, or |file| without extension for an index.
+std::string GetEntryName(const std::string& file,
+                         const std::unordered_set<std::string>& files) {
+  for (const char* extension : {".json", ".mpack", ".bin"}) {
+    if (EndsWith(file, extension)) {
+      std::string entry = file.substr(0, file.size() - strlen(extension));
+      if (files.count(entry))
+        return entry;
+    }
+  }
+  return file;
+}
+
+// Reads the entries of the project directory |directory| of the cache at
+// |cache_directory|. Counts the references to each blob in |blob_references|.
+void ReadCacheEntries(const std::string& cache_directory,
+                      const std::string& directory,
+                      std::unordered_map<std::string, CacheEntry>* entries,
+                      std::unordered_map<std::string, int>* blob_references) {
+  std::vector<DirectoryEntry> listing;
+  if (!ListDirectory(cache_directory + directory, &listing))
+    return;
+  std::unordered_set<std::string> files;
+  for (const DirectoryEntry& item : listing) {
+    if (!item.is_dir)
+      files.insert(item.name);
+  }
+
+  for (const std::string& file : files) {
+    std::string path = cache_directory + directory + '/' + file;
+    optional<FileInfo> info = GetFileInfo(path);
+    if (!info)
+      continue;
+    std::string name = GetEntryName(file, files);
+    CacheEntry& entry = (*entries)[directory + '/' + name];
+    entry.files.push_back(path);
+    entry.bytes += info->size;
+    // The collector reads the blob names itself, so only their modification
+    // time tells when they were used.
+    entry.last_used = std::max(entry.last_used, info->last_modification_time);
+    if (name != file)
+      entry.last_used = std::max(entry.last_used, info->last_access_time);
+    if (name == file && info->size == kBlobNameLength) {
+      optional<std::string> blob = ReadContent(path);
+      if (blob) {
+        entry.blob = *blob;
+        (*blob_references)[entry.blob]++;
+      }
+    }
+  }
+}
+
+void RemoveCacheEntry(const CacheEntry& entry) {
+  for (const std::string& file : entry.files)
+    remove(file.c_str());
+}
+
+}  // namespace
+
+void CollectCacheGarbage(Config* config,
+                         TimestampManager* timestamp_manager,
+                         const std::vector<std::string>& project_files) {
+  if (config->cacheShardCount > 0)
+    return;
+  Timer timer;
+  const std::string& cache_directory = config->cacheDirectory;
+  int64_t now = time(nullptr);
+
+  // The files which use an entry, by entry name.
+  std::unordered_map<std::string, std::string> used;
+  std::vector<std::string> without_dependencies;
+  for (const std::string& file : project_files) {
+    std::string name = ICacheManager::GetCacheEntryName(config, file);
+    used[name] = file;
+    optional<std::vector<std::string>> dependencies =
+        timestamp_manager->GetDependencies(file);
+    if (!dependencies) {
+      without_dependencies.push_back(name);
+      continue;
+    }
+    for (const std::string& dependency : *dependencies)
+      used[ICacheManager::GetCacheEntryName(config, dependency)] = dependency;
+  }
+
+  // Read the entries of this project, and the blob references of every
+  // project sharing the cache directory.
+  std::string project_directory =
+      ICacheManager::GetProjectDirectoryName(config);
+  std::unordered_map<std::string, CacheEntry> entries;
+  std::unordered_map<std::string, int> blob_references;
+  std::vector<DirectoryEntry> directories;
+  ListDirectory(cache_directory, &directories);
+  for (const DirectoryEntry& directory : directories) {
+    if (!directory.is_dir || IsSpecialDirectory(directory.name))
+      continue;
+    if (directory.name == project_directory ||
+        directory.name == '@' + project_directory) {
+      ReadCacheEntries(cache_directory, directory.name, &entries,
+                       &blob_references);
+    } else {
+      std::unordered_map<std::string, CacheEntry> other_entries;
+      ReadCacheEntries(cache_directory, directory.name, &other_entries,
+                       &blob_references);
+    }
+  }
+
+  size_t removed_entries = 0;
+  int64_t removed_bytes = 0;
+  auto remove_entry = [&](const CacheEntry& entry) {
+    RemoveCacheEntry(entry);
+    removed_entries++;
+    removed_bytes += entry.bytes;
+    if (!entry.blob.empty())
+      blob_references[entry.blob]--;
+    if (entry.used_by)
+      timestamp_manager->ForgetCachedFile(*entry.used_by);
+  };
+
+  // If the include graph of a cached translation unit is unknown, ie,
+  // because it was cached by an older cquery, unused entries cannot be told
+  // apart from its dependencies. Other checkouts sharing the entries under
+  // projectCacheKey may have other files, so unused entries are only removed
+  // if the project owns them.
+  size_t unknown_dependencies = 0;
+  for (const std::string& name : without_dependencies)
+    unknown_dependencies += entries.count(name);
+  bool remove_unused =
+      config->projectCacheKey.empty() && unknown_dependencies == 0;
+  std::vector<CacheEntry*> kept;
+  for (auto& pair : entries) {
+    CacheEntry& entry = pair.second;
+    auto it = used.find(pair.first);
+    if (it != used.end())
+      entry.used_by = it->second;
+    bool is_recent = now - entry.last_used < kGracePeriodSeconds;
+    if (remove_unused && !entry.used_by && !is_recent)
+      remove_entry(entry);
+    else
+      kept.push_back(&entry);
+  }
+  if (!remove_unused && config->projectCacheKey.empty()) {
+    LOG_S(INFO) << "Keeping unused cache entries since the includes of "
+                << unknown_dependencies << " files are unknown";
+  }
+
+  // Blobs are shared with other projects, so the size limit counts each
+  // blob of the project once.
+  std::vector<DirectoryEntry> blob_listing;
+  std::string blob_directory =
+      cache_directory + ICacheManager::kContentsBlobDirectory + '/';
+  ListDirectory(blob_directory, &blob_listing);
+  std::unordered_map<std::string, FileInfo> blobs;
+  for (const DirectoryEntry& blob : blob_listing) {
+    optional<FileInfo> info = GetFileInfo(blob_directory + blob.name);
+    if (info)
+      blobs[blob.name] = *info;
+  }
+
+  if (config->cacheSizeLimitMb > 0) {
+    int64_t limit = int64_t(config->cacheSizeLimitMb) * 1024 * 1024;
+    int64_t size = 0;
+    std::unordered_set<std::string> project_blobs;
+    for (CacheEntry* entry : kept) {
+      size += entry->bytes;
+      auto it = blobs.find(entry->blob);
+      if (it != blobs.end() && project_blobs.insert(entry->blob).second)
+        size += it->second.size;
+    }
+
+    // Evict the least recently used entries first, and keep the entries in
+    // use by the project as long as possible.
+    std::sort(kept.begin(), kept.end(),
+              [](const CacheEntry* a, const CacheEntry* b) {
+                return std::make_tuple(bool(a->used_by), a->last_used) <
+                       std::make_tuple(bool(b->used_by), b->last_used);
+              });
+    for (CacheEntry* entry : kept) {
+      if (size <= limit)
+        break;
+      if (now - entry->last_used < kGracePeriodSeconds)
+        continue;
+      remove_entry(*entry);
+      size -= entry->bytes;
+      auto it = blobs.find(entry->blob);
+      if (it != blobs.end() && blob_references[entry->blob] == 0 &&
+          project_blobs.erase(entry->blob)) {
+        size -= it->second.size;
+      }
+    }
+    if (size > limit) {
+      LOG_S(WARNING) << "The cache of the project takes " << (size >> 20)
+                     << "MB, more than cacheSizeLimitMb, but its entries are "
+                        "in use";
+    }
+  }
+
+  size_t removed_blobs = 0;
+  for (const auto& pair : blobs) {
+    if (blob_references[pair.first] > 0 ||
+        now - pair.second.last_modification_time < kGracePeriodSeconds) {
+      continue;
+    }
+    remove((blob_directory + pair.first).c_str());
+    removed_blobs++;
+    removed_bytes += pair.second.size;
+  }
+
+  LOG_S(INFO) << "Removed " << removed_entries << " cache entries and "
+              << removed_blobs << " blobs (" << (removed_bytes >> 20)
+              << "MB) in " << timer.ElapsedMicroseconds() / 1000 << "ms";
+}
+
+TEST_SUITE("CacheCollector") {
+  TEST_CASE("entry names") {
+    std::unordered_set<std::string> files = {"a.cc", "a.cc.json", "b.json",
+                                             "c.h.mpack"};
+    REQUIRE(GetEntryName("a.cc", files) == "a.cc");
+    REQUIRE(GetEntryName("a.cc.json", files) == "a.cc");
+    // Without the blob name next to it, this is the entry of "b.json".
+    REQUIRE(GetEntryName("b.json", files) == "b.json");
+    REQUIRE(GetEntryName("c.h.mpack", files) == "c.h.mpack");
+  }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct Config;
+struct TimestampManager;
+
+// Removes the cache entries of the project which are not used anymore from
+// Config::cacheDirectory, and evicts the least recently used ones until the
+// project fits in Config::cacheSizeLimitMb.
+//
+// An entry is used if it belongs to one of |project_files| or to a file which
+// one of them includes according to |timestamp_manager|. Entries written or
+// read recently are kept either way, since they may belong to files which
+// are being indexed right now. Blobs of file contents are removed once no
+// entry of any project in the cache directory refers to them. Evicted entries
+// of used files are forgotten by |timestamp_manager|, so that they are
+// indexed again.
+//
+// Safe to run while the project is being indexed. Does nothing for the packed
+// cache, see Config::cacheShardCount.
+void CollectCacheGarbage(Config* config,
+                         TimestampManager* timestamp_manager,
+                         const std::vector<std::string>& project_files);
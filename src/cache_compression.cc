@@ -0,0 +1,345 @@
+#include "cache_compression.h"
+
+#include "platform.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#if defined(USE_ZSTD)
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const char kMagic[4] = {'\x89', 'C', 'Q', 'Z'};
+const size_t kHeaderSize = 4 + 1 + 4 + 8;
+// Smaller entries, ie, the blob names of file contents, are stored as is.
+const size_t kMinCompressedSize = 256;
+// Bounds on the size which the header of a compressed entry may claim, so
+// that a corrupted or forged entry cannot make Decompress allocate an
+// arbitrary amount of memory. zstd needs at least 4 bytes for a block of up
+// to 128kb, which bounds the ratio.
+const uint64_t kMaxCompressionRatio = 32768;
+const uint64_t kMaxDecompressedSize = uint64_t(1) << 30;
+
+// The dictionary is trained once this many indexes, or bytes of them, were
+// sampled. Only the start of each index is sampled, which is where the
+// layout all indexes share is.
+const size_t kTrainingSamples = 1000;
+const size_t kMaxTrainingBytes = 32 << 20;
+const size_t kMaxSampleSize = 64 << 10;
+const size_t kDictionarySize = 112 << 10;
+
+// Name of the file in the dictionary directory holding the id of the current
+// dictionary.
+const char kCurrentDictionary[] = "current";
+
+void AppendInt(std::string* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    out->push_back(char((value >> (8 * i)) & 0xff));
+}
+
+uint64_t ReadInt(const std::string& in, size_t offset, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++)
+    value |= uint64_t(uint8_t(in[offset + i])) << (8 * i);
+  return value;
+}
+
+std::string GetDictionaryName(uint32_t id) {
+  char name[9];
+  snprintf(name, sizeof name, "%08x", id);
+  return name;
+}
+
+}  // namespace
+
+void Reflect(Reader& visitor, CacheCodec& value) {
+  std::string codec = visitor.GetString();
+  if (codec == "zstd")
+    value = CacheCodec::Zstd;
+  else
+    value = CacheCodec::None;
+}
+
+void Reflect(Writer& visitor, CacheCodec& value) {
+  switch (value) {
+    case CacheCodec::None:
+      visitor.String("none");
+      break;
+    case CacheCodec::Zstd:
+      visitor.String("zstd");
+      break;
+  }
+}
+
+bool IsCacheCodecSupported(CacheCodec codec) {
+  switch (codec) {
+    case CacheCodec::None:
+      return true;
+    case CacheCodec::Zstd:
+#if defined(USE_ZSTD)
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+struct CacheCompressor::Dictionary {
+  uint32_t id = 0;
+#if defined(USE_ZSTD)
+  ZSTD_CDict* cdict = nullptr;
+  ZSTD_DDict* ddict = nullptr;
+
+  ~Dictionary() {
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+  }
+#endif
+};
+
+// static
+std::shared_ptr<CacheCompressor> CacheCompressor::Get(
+    const std::string& cache_directory,
+    int level) {
+  static std::mutex mutex;
+  static std::unordered_map<std::string, std::shared_ptr<CacheCompressor>>
+      compressors;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<CacheCompressor>& compressor = compressors[cache_directory];
+  if (!compressor)
+    compressor = std::make_shared<CacheCompressor>(cache_directory, level);
+  return compressor;
+}
+
+CacheCompressor::CacheCompressor(const std::string& cache_directory,
+                                 int level)
+    : directory_(cache_directory + kDictionaryDirectory + '/'),
+      level_(level) {
+  optional<std::string> current =
+      ReadContent(directory_ + kCurrentDictionary);
+  if (current && !current->empty()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    current_ =
+        LoadDictionary(uint32_t(strtoul(current->c_str(), nullptr, 16)));
+  }
+}
+
+CacheCompressor::~CacheCompressor() = default;
+
+std::string CacheCompressor::Compress(const std::string& value,
+                                      CacheCodec codec,
+                                      bool is_index) {
+  if (codec != CacheCodec::Zstd || value.size() < kMinCompressedSize)
+    return value;
+#if defined(USE_ZSTD)
+  std::shared_ptr<Dictionary> dictionary;
+  if (is_index)
+    dictionary = SampleIndex(value);
+
+  std::string out(kMagic, sizeof kMagic);
+  out.push_back(char(codec));
+  AppendInt(&out, dictionary ? dictionary->id : 0, 4);
+  AppendInt(&out, value.size(), 8);
+  size_t capacity = ZSTD_compressBound(value.size());
+  out.resize(kHeaderSize + capacity);
+
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  size_t size =
+      dictionary
+          ? ZSTD_compress_usingCDict(cctx, &out[kHeaderSize], capacity,
+                                     value.data(), value.size(),
+                                     dictionary->cdict)
+          : ZSTD_compressCCtx(cctx, &out[kHeaderSize], capacity, value.data(),
+                              value.size(), level_);
+  ZSTD_freeCCtx(cctx);
+  if (ZSTD_isError(size) || kHeaderSize + size >= value.size())
+    return value;
+  out.resize(kHeaderSize + size);
+  return out;
+#else
+  return value;
+#endif
+}
+
+optional<std::string> CacheCompressor::Decompress(std::string entry) {
+  if (entry.size() < kHeaderSize ||
+      memcmp(entry.data(), kMagic, sizeof kMagic) != 0) {
+    return std::move(entry);
+  }
+  auto codec = CacheCodec(uint8_t(entry[4]));
+  auto dictionary_id = uint32_t(ReadInt(entry, 5, 4));
+  uint64_t size = ReadInt(entry, 9, 8);
+  uint64_t compressed_size = entry.size() - kHeaderSize;
+  if (size > kMaxDecompressedSize ||
+      size > compressed_size * kMaxCompressionRatio) {
+    LOG_S(WARNING) << "Cache entry claims an implausible size of " << size
+                   << " bytes";
+    return nullopt;
+  }
+
+#if defined(USE_ZSTD)
+  if (codec == CacheCodec::Zstd) {
+    std::shared_ptr<Dictionary> dictionary;
+    if (dictionary_id) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      dictionary = LoadDictionary(dictionary_id);
+      if (!dictionary)
+        return nullopt;
+    }
+
+    std::string out(size, '\0');
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    size_t decompressed_size =
+        dictionary
+            ? ZSTD_decompress_usingDDict(
+                  dctx, &out[0], out.size(), entry.data() + kHeaderSize,
+                  entry.size() - kHeaderSize, dictionary->ddict)
+            : ZSTD_decompressDCtx(dctx, &out[0], out.size(),
+                                  entry.data() + kHeaderSize,
+                                  entry.size() - kHeaderSize);
+    ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(decompressed_size) || decompressed_size != size) {
+      LOG_S(WARNING) << "Failed to decompress cache entry";
+      return nullopt;
+    }
+    return std::move(out);
+  }
+#endif
+
+  (void)dictionary_id;
+  (void)size;
+  LOG_S(WARNING) << "Cache entry uses unsupported codec " << int(codec);
+  return nullopt;
+}
+
+bool CacheCompressor::TrainDictionary(
+    const std::vector<std::string>& samples) {
+#if defined(USE_ZSTD)
+  std::string buffer;
+  std::vector<size_t> sizes;
+  for (const std::string& sample : samples) {
+    size_t size = std::min(sample.size(), kMaxSampleSize);
+    buffer.append(sample, 0, size);
+    sizes.push_back(size);
+  }
+
+  std::string content(kDictionarySize, '\0');
+  size_t size =
+      ZDICT_trainFromBuffer(&content[0], content.size(), buffer.data(),
+                            sizes.data(), unsigned(sizes.size()));
+  if (ZDICT_isError(size)) {
+    LOG_S(INFO) << "Unable to train cache dictionary: "
+                << ZDICT_getErrorName(size);
+    return false;
+  }
+  content.resize(size);
+  uint32_t id = ZDICT_getDictID(content.data(), content.size());
+  if (!id)
+    return false;
+
+  MakeDirectoryRecursive(directory_);
+  WriteToFile(directory_ + GetDictionaryName(id), content);
+  WriteToFile(directory_ + kCurrentDictionary, GetDictionaryName(id));
+  LOG_S(INFO) << "Trained cache dictionary " << GetDictionaryName(id)
+              << " on " << samples.size() << " indexes";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  current_ = LoadDictionary(id);
+  return current_ != nullptr;
+#else
+  return false;
+#endif
+}
+
+std::shared_ptr<CacheCompressor::Dictionary> CacheCompressor::LoadDictionary(
+    uint32_t id) {
+  auto it = dictionaries_.find(id);
+  if (it != dictionaries_.end())
+    return it->second;
+
+#if defined(USE_ZSTD)
+  optional<std::string> content =
+      ReadContent(directory_ + GetDictionaryName(id));
+  if (!content) {
+    LOG_S(WARNING) << "Missing cache dictionary " << GetDictionaryName(id);
+    return nullptr;
+  }
+  auto dictionary = std::make_shared<Dictionary>();
+  dictionary->id = id;
+  dictionary->cdict =
+      ZSTD_createCDict(content->data(), content->size(), level_);
+  dictionary->ddict = ZSTD_createDDict(content->data(), content->size());
+  if (!dictionary->cdict || !dictionary->ddict)
+    return nullptr;
+  dictionaries_[id] = dictionary;
+  return dictionary;
+#else
+  return nullptr;
+#endif
+}
+
+std::shared_ptr<CacheCompressor::Dictionary> CacheCompressor::SampleIndex(
+    const std::string& index) {
+  std::vector<std::string> samples;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_ || is_training_)
+      return current_;
+    samples_.push_back(index.substr(0, kMaxSampleSize));
+    sample_bytes_ += samples_.back().size();
+    if (samples_.size() < kTrainingSamples &&
+        sample_bytes_ < kMaxTrainingBytes) {
+      return nullptr;
+    }
+    is_training_ = true;
+    samples.swap(samples_);
+    sample_bytes_ = 0;
+  }
+
+  // Training takes a few seconds, so other indexes are written without a
+  // dictionary meanwhile.
+  bool trained = TrainDictionary(samples);
+  std::lock_guard<std::mutex> lock(mutex_);
+  is_training_ = false;
+  // Start sampling again if there were not enough distinct samples.
+  if (!trained)
+    samples_.clear();
+  return current_;
+}
+
+TEST_SUITE("CacheCompressor") {
+  TEST_CASE("round trip") {
+    CacheCompressor compressor("cache_compression_test/", 3);
+    std::string small = "small entry";
+    std::string large(4096, 'a');
+    REQUIRE(compressor.Compress(small, CacheCodec::Zstd, false) == small);
+    REQUIRE(compressor.Compress(large, CacheCodec::None, false) == large);
+    REQUIRE(*compressor.Decompress(small) == small);
+
+    std::string compressed =
+        compressor.Compress(large, CacheCodec::Zstd, false);
+    if (IsCacheCodecSupported(CacheCodec::Zstd))
+      REQUIRE(compressed.size() < large.size());
+    REQUIRE(*compressor.Decompress(compressed) == large);
+  }
+
+  TEST_CASE("implausible size") {
+    CacheCompressor compressor("cache_compression_test/", 3);
+    std::string entry(kMagic, sizeof kMagic);
+    entry.push_back(char(CacheCodec::Zstd));
+    AppendInt(&entry, 0, 4);
+    AppendInt(&entry, uint64_t(1) << 40, 8);
+    entry += "xxxx";
+    REQUIRE(!compressor.Decompress(entry));
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "serializer.h"
+
+#include <optional.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Codec of the entries of the cache, see Config::cacheCompression.
+enum class CacheCodec { None, Zstd };
+void Reflect(Reader& visitor, CacheCodec& value);
+void Reflect(Writer& visitor, CacheCodec& value);
+
+// Returns true if this build of cquery can read and write entries compressed
+// with |codec|. zstd support needs libzstd at configure time.
+bool IsCacheCodecSupported(CacheCodec codec);
+
+// Compresses and decompresses the entries of one cache directory.
+//
+// A compressed entry starts with a header: 4 magic bytes, the codec (1 byte),
+// the id of the dictionary it was compressed with or 0 (uint32_t) and the size
+// of the uncompressed entry (uint64_t), all little endian. Entries without the
+// magic are stored as is, so small entries and caches written without
+// compression stay readable.
+//
+// Indexes are small and share their keys and structure, so they are
+// compressed with a zstd dictionary trained on the first indexes written to
+// the cache directory. Dictionaries are stored in its kDictionaryDirectory,
+// named by their id, and never deleted, so that the entries compressed with
+// an older dictionary stay readable.
+class CacheCompressor {
+ public:
+  // Directory inside of the cache directory which stores the dictionaries.
+  static constexpr const char* kDictionaryDirectory = "@dictionaries";
+
+  // Returns the compressor of |cache_directory|, compressing at |level|.
+  // Compressors are shared by every cache manager of the process, so that
+  // they sample the indexes of every request to train their dictionary.
+  static std::shared_ptr<CacheCompressor> Get(
+      const std::string& cache_directory,
+      int level);
+
+  // Loads the current dictionary of |cache_directory|, if any. Use Get()
+  // instead, except for a directory which is not used by cache managers.
+  CacheCompressor(const std::string& cache_directory, int level);
+  ~CacheCompressor();
+
+  // Returns |value| compressed with |codec|, or |value| itself if |codec| is
+  // CacheCodec::None, is not supported or does not make |value| smaller.
+  // |is_index| is set for indexes, which use the dictionary.
+  std::string Compress(const std::string& value,
+                       CacheCodec codec,
+                       bool is_index);
+  // Returns the uncompressed contents of |entry|, or nullopt if it cannot be
+  // decompressed, ie, if this build does not support its codec.
+  optional<std::string> Decompress(std::string entry);
+
+  // Trains the dictionary of the cache directory on |samples| and uses it
+  // from now on. Returns false if there are not enough samples.
+  bool TrainDictionary(const std::vector<std::string>& samples);
+
+ private:
+  struct Dictionary;
+
+  std::shared_ptr<Dictionary> LoadDictionary(uint32_t id);
+  // Adds |index| to the training samples and trains the dictionary once there
+  // are enough of them. Returns the dictionary to compress |index| with.
+  std::shared_ptr<Dictionary> SampleIndex(const std::string& index);
+
+  std::string directory_;
+  int level_;
+
+  // Guards the members below.
+  std::mutex mutex_;
+  // Dictionary new indexes are compressed with, if there is one.
+  std::shared_ptr<Dictionary> current_;
+  // Dictionaries loaded so far by id, including |current_|.
+  std::unordered_map<uint32_t, std::shared_ptr<Dictionary>> dictionaries_;
+  // Prefixes of the indexes written so far, until |current_| is trained.
+  std::vector<std::string> samples_;
+  size_t sample_bytes_ = 0;
+  bool is_training_ = false;
+};
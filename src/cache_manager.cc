@@ -1,60 +1,389 @@
 #include "cache_manager.h"
 
+#include "cache_compression.h"
 #include "config.h"
 #include "indexer.h"
 #include "language_server_api.h"
+#include "memory_usage.h"
+#include "packed_cache_store.h"
 #include "platform.h"
 
 #include <loguru/loguru.hpp>
 
 #include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
 #include <unordered_map>
 
 namespace {
 
+// Indexes loaded into ICacheManager::caches_ by any cache manager.
+MemoryGauge* GetLoadedIndexesGauge() {
+  static MemoryGauge* gauge = GetMemoryGauge("cache_manager.loaded_indexes");
+  return gauge;
+}
+
+// Indexes loaded from the cache by any cache manager of the process, least
+// recently used first, within Config::cacheMemoryMb by EstimateMemoryUsage.
+// Evicted indexes stay alive as long as a cache manager holds them.
+//
+// Entries are keyed by the cache entry they were read from. A load which
+// raced with a write of the same entry is not inserted: the writer bumps the
+// generation of the key, which the loader read before loading.
+class SharedIndexCache {
+ public:
+  static SharedIndexCache* Get() {
+    static SharedIndexCache* cache = new SharedIndexCache();
+    return cache;
+  }
+
+  std::shared_ptr<const IndexFile> TryGet(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end())
+      return nullptr;
+    entries_.splice(entries_.end(), entries_, it->second);
+    return it->second->file;
+  }
+
+  uint64_t GetGeneration(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return generations_[GetStripe(key)];
+  }
+
+  // Inserts |file| if |key| was not written since GetGeneration returned
+  // |generation|, evicting the oldest entries to stay within |budget| bytes.
+  void Insert(const std::string& key,
+              const std::shared_ptr<const IndexFile>& file,
+              uint64_t generation,
+              size_t budget) {
+    size_t size = EstimateMemoryUsage(*file);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size > budget || generations_[GetStripe(key)] != generation)
+      return;
+    EraseLocked(key);
+    while (!entries_.empty() && bytes_ + size > budget)
+      EraseLocked(entries_.front().key);
+    entries_.push_back({key, file, size});
+    index_[key] = std::prev(entries_.end());
+    bytes_ += size;
+    GetSharedIndexesGauge()->Add(1, size);
+  }
+
+  // Drops the entry of |key|, which is being rewritten.
+  void Invalidate(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generations_[GetStripe(key)]++;
+    EraseLocked(key);
+  }
+
+  // Drops every entry and returns the bytes they used.
+  size_t Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t bytes = bytes_;
+    while (!entries_.empty())
+      EraseLocked(entries_.front().key);
+    return bytes;
+  }
+
+ private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const IndexFile> file;
+    size_t size;
+  };
+
+  static const size_t kNumStripes = 64;
+
+  static MemoryGauge* GetSharedIndexesGauge() {
+    static MemoryGauge* gauge =
+        GetMemoryGauge("cache_manager.shared_indexes");
+    return gauge;
+  }
+
+  size_t GetStripe(const std::string& key) {
+    return std::hash<std::string>()(key) % kNumStripes;
+  }
+
+  void EraseLocked(const std::string& key) {
+    auto it = index_.find(key);
+    if (it == index_.end())
+      return;
+    bytes_ -= it->second->size;
+    GetSharedIndexesGauge()->Add(-1, -int64_t(it->second->size));
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t bytes_ = 0;
+  uint64_t generations_[kNumStripes] = {};
+};
+
+// Name of the blob holding file contents which hash to |hash|.
+std::string GetContentsBlobName(uint64_t hash) {
+  char name[17];
+  snprintf(name, sizeof name, "%016" PRIx64, hash);
+  return name;
+}
+
+// Stands for Config::projectRoot in the paths of cached indexes, so that the
+// cache stays valid when the project is moved or checked out elsewhere.
+const char kProjectRootToken[] = "${projectRoot}/";
+
+// Indexes built with another Config::Index::profile record other features, so
+// each profile keeps its indexes apart. The full profile has no suffix.
+std::string GetProfileSuffix(Config* config) {
+  if (config->index.profile == "full")
+    return "";
+  return '#' + EscapeFileName(config->index.profile);
+}
+
+// Returns the cache entry of |source_file| for a project at |project_root|
+// whose indexes are in |project_directory|, see
+// ICacheManager::GetProjectDirectoryName. Entries of files in the project
+// only depend on their path relative to |project_root|.
+std::string GetCachePathInProject(const std::string& project_root,
+                                  const std::string& project_directory,
+                                  const std::string& source_file) {
+  if (StartsWith(source_file, project_root)) {
+    return project_directory + '/' +
+           EscapeFileName(source_file.substr(project_root.size()));
+  }
+  return '@' + project_directory + '/' + EscapeFileName(source_file);
+}
+
+// Moves the paths in |file| from a checkout at |from_root| to |to_root|.
+void MoveIndexPaths(IndexFile* file,
+                    const std::string& from_root,
+                    const std::string& to_root) {
+  auto move = [&](std::string& path) {
+    if (StartsWith(path, from_root))
+      path = to_root + path.substr(from_root.size());
+  };
+  move(file->import_file);
+  for (std::string& dependency : file->dependencies)
+    move(dependency);
+  for (IndexInclude& include : file->includes)
+    move(include.resolved_path);
+  // Flags like -I carry the path after the flag, and the arguments must match
+  // for the index to be used.
+  for (std::string& arg : file->args) {
+    size_t pos = arg.find(from_root);
+    if (pos != std::string::npos)
+      arg.replace(pos, from_root.size(), to_root);
+  }
+}
+
 // Manages loading caches from file paths for the indexer process.
 struct RealCacheManager : ICacheManager {
-  explicit RealCacheManager(Config* config) : config_(config) {}
+  explicit RealCacheManager(Config* config) : config_(config) {
+    if (config_->cacheShardCount > 0) {
+      packed_ = PackedCacheStore::Get(
+          config_->cacheDirectory + kPackedCacheDirectory,
+          config_->cacheShardCount);
+    }
+    compressor_ = CacheCompressor::Get(config_->cacheDirectory,
+                                       config_->cacheCompressionLevel);
+  }
   ~RealCacheManager() override = default;
 
+  // File contents are stored once per distinct content in the blob directory,
+  // named by their hash. The entry at GetCachePath() only holds the blob name,
+  // so headers shared by many configurations or projects are stored once.
   void WriteToCache(IndexFile& file) override {
     std::string cache_path = GetCachePath(file.path);
-    WriteToFile(cache_path, file.file_contents);
+    SharedIndexCache::Get()->Invalidate(GetSharedKey(file.path));
+    std::string blob_name =
+        GetContentsBlobName(HashStorageKey(file.file_contents));
+    std::string blob_path = GetContentsBlobDirectory() + blob_name;
+    if (!HasEntry(blob_path)) {
+      WriteEntry(blob_path,
+                 compressor_->Compress(file.file_contents,
+                                       config_->cacheCompression, false),
+                 true /*atomically*/);
+    }
+    WriteEntry(cache_path, blob_name);
 
+    MoveIndexPaths(&file, config_->projectRoot, kProjectRootToken);
     std::string indexed_content = Serialize(config_->cacheFormat, file);
-    WriteToFile(AppendSerializationFormat(cache_path), indexed_content);
+    MoveIndexPaths(&file, kProjectRootToken, config_->projectRoot);
+    WriteEntry(AppendSerializationFormat(cache_path),
+               compressor_->Compress(indexed_content,
+                                     config_->cacheCompression, true));
   }
 
   optional<std::string> LoadCachedFileContents(
       const std::string& path) override {
-    return ReadContent(GetCachePath(path));
+    optional<std::string> blob_name = ReadEntry(GetCachePath(path));
+    if (blob_name)
+      return Decompress(ReadEntry(GetContentsBlobDirectory() + *blob_name));
+    if (!HasSharedCache())
+      return nullopt;
+    blob_name = ReadContent(GetSharedCachePath(path));
+    if (!blob_name)
+      return nullopt;
+    return Decompress(ReadContent(config_->sharedCacheDirectory +
+                                  GetContentsBlobDirectory() + *blob_name),
+                      GetSharedCompressor());
   }
 
+  // Only the index is loaded; file contents are fetched on demand with
+  // LoadCachedFileContents.
   std::unique_ptr<IndexFile> RawCacheLoad(const std::string& path) override {
     std::string cache_path = GetCachePath(path);
-    optional<std::string> file_content = ReadContent(cache_path);
     optional<std::string> serialized_indexed_content =
-        ReadContent(AppendSerializationFormat(cache_path));
-    if (!file_content || !serialized_indexed_content)
+        Decompress(ReadEntry(AppendSerializationFormat(cache_path)));
+    if (serialized_indexed_content)
+      return DeserializeIndex(path, *serialized_indexed_content);
+    return RawSharedCacheLoad(path);
+  }
+
+  // Called from other threads than the one using the cache manager, so this
+  // must not touch |caches_|. Entries of the packed cache are records of a
+  // few large shard files, which stay in the page cache anyway, so only
+  // individual files are prefetched.
+  void Prefetch(const std::string& path) override {
+    if (packed_ || TryGetShared(path))
+      return;
+    PrefetchFile(config_->cacheDirectory +
+                 AppendSerializationFormat(GetCachePath(path)));
+  }
+
+  std::shared_ptr<const IndexFile> TryGetShared(
+      const std::string& path) override {
+    if (config_->cacheMemoryMb <= 0)
       return nullptr;
+    return SharedIndexCache::Get()->TryGet(GetSharedKey(path));
+  }
 
-    return Deserialize(config_->cacheFormat, path, *serialized_indexed_content,*file_content,
-                       IndexFile::kMajorVersion);
+  std::shared_ptr<const IndexFile> LoadShared(
+      const std::string& path) override {
+    if (config_->cacheMemoryMb <= 0)
+      return ICacheManager::LoadShared(path);
+    SharedIndexCache* shared = SharedIndexCache::Get();
+    std::string key = GetSharedKey(path);
+    uint64_t generation = shared->GetGeneration(key);
+    std::shared_ptr<const IndexFile> file = RawCacheLoad(path);
+    if (file) {
+      shared->Insert(key, file, generation,
+                     size_t(config_->cacheMemoryMb) * 1024 * 1024);
+    }
+    return file;
   }
 
-  std::string GetCachePath(const std::string& source_file) {
-    assert(!config_->cacheDirectory.empty());
-    std::string cache_file;
-    size_t len = config_->projectRoot.size();
-    if (StartsWith(source_file, config_->projectRoot)) {
-      cache_file = EscapeFileName(config_->projectRoot) + '/' +
-                   EscapeFileName(source_file.substr(len));
-    } else {
-      cache_file = '@' + EscapeFileName(config_->projectRoot) + '/' +
-                   EscapeFileName(source_file);
+  // Key of the indexes of |path| in SharedIndexCache. Cache managers of
+  // another cache directory or format load other entries.
+  std::string GetSharedKey(const std::string& path) {
+    return config_->cacheDirectory +
+           AppendSerializationFormat(GetCachePath(path));
+  }
+
+  std::unique_ptr<IndexFile> DeserializeIndex(
+      const std::string& path,
+      const std::string& serialized_indexed_content) {
+    std::unique_ptr<IndexFile> file =
+        Deserialize(config_->cacheFormat, path, serialized_indexed_content, "",
+                    IndexFile::GetMajorVersion());
+    if (file)
+      MoveIndexPaths(file.get(), kProjectRootToken, config_->projectRoot);
+    return file;
+  }
+
+  // Indexes are only looked up in the shared cache if there is no local one,
+  // and are never written there. Once a file is parsed locally, its local
+  // index takes over.
+  std::unique_ptr<IndexFile> RawSharedCacheLoad(const std::string& path) {
+    if (!HasSharedCache())
+      return nullptr;
+    optional<std::string> serialized_indexed_content = Decompress(
+        ReadContent(AppendSerializationFormat(GetSharedCachePath(path))),
+        GetSharedCompressor());
+    if (!serialized_indexed_content)
+      return nullptr;
+
+    return DeserializeIndex(path, *serialized_indexed_content);
+  }
+
+  // Returns the uncompressed contents of the cache entry |entry|. Entries of
+  // the shared cache are compressed with the dictionaries of its directory.
+  optional<std::string> Decompress(optional<std::string> entry) {
+    return Decompress(std::move(entry), compressor_.get());
+  }
+  optional<std::string> Decompress(optional<std::string> entry,
+                                   CacheCompressor* compressor) {
+    if (!entry)
+      return nullopt;
+    return compressor->Decompress(std::move(*entry));
+  }
+  CacheCompressor* GetSharedCompressor() {
+    if (!shared_compressor_) {
+      shared_compressor_ =
+          CacheCompressor::Get(config_->sharedCacheDirectory,
+                               config_->cacheCompressionLevel);
     }
+    return shared_compressor_.get();
+  }
 
-    return config_->cacheDirectory + cache_file;
+  bool HasSharedCache() const {
+    return !config_->sharedCacheDirectory.empty() &&
+           (!config_->projectCacheKey.empty() ||
+            !config_->sharedCacheProjectRoot.empty());
+  }
+
+  // Returns the path of the shared cache entry of |path|. The shared cache
+  // holds the project under the same projectCacheKey, or else under
+  // Config::sharedCacheProjectRoot.
+  std::string GetSharedCachePath(const std::string& path) {
+    std::string project_directory =
+        config_->projectCacheKey.empty()
+            ? EscapeFileName(config_->sharedCacheProjectRoot) +
+                  GetProfileSuffix(config_)
+            : GetProjectDirectoryName(config_);
+    return config_->sharedCacheDirectory +
+           GetCachePathInProject(config_->projectRoot, project_directory,
+                                 path);
+  }
+
+  // Cache entries are identified by their path relative to the cache
+  // directory. They are stored as files there, or as records of |packed_|.
+  optional<std::string> ReadEntry(const std::string& key) {
+    if (packed_)
+      return packed_->Read(key);
+    return ReadContent(config_->cacheDirectory + key);
+  }
+  // Blobs are shared and only written if they do not exist, so a partial
+  // write must never be visible under their name; they are written
+  // |atomically|. Packed records are only visible once written anyway.
+  void WriteEntry(const std::string& key,
+                  const std::string& value,
+                  bool atomically = false) {
+    if (packed_)
+      packed_->Write(key, value);
+    else if (atomically)
+      WriteToFileAtomically(config_->cacheDirectory + key, value);
+    else
+      WriteToFile(config_->cacheDirectory + key, value);
+  }
+  bool HasEntry(const std::string& key) {
+    if (packed_)
+      return packed_->Exists(key);
+    return FileExists(config_->cacheDirectory + key);
+  }
+
+  std::string GetContentsBlobDirectory() {
+    return std::string(kContentsBlobDirectory) + '/';
+  }
+
+  std::string GetCachePath(const std::string& source_file) {
+    assert(!config_->cacheDirectory.empty());
+    return GetCacheEntryName(config_, source_file);
   }
 
   std::string AppendSerializationFormat(const std::string& base) {
@@ -63,12 +392,17 @@ struct RealCacheManager : ICacheManager {
         return base + ".json";
       case SerializeFormat::MessagePack:
         return base + ".mpack";
+      case SerializeFormat::Binary:
+        return base + ".bin";
     }
     assert(false);
     return ".json";
   }
 
   Config* config_;
+  std::shared_ptr<PackedCacheStore> packed_;
+  std::shared_ptr<CacheCompressor> compressor_;
+  std::shared_ptr<CacheCompressor> shared_compressor_;
 };
 
 struct FakeCacheManager : ICacheManager {
@@ -108,37 +442,74 @@ std::shared_ptr<ICacheManager> ICacheManager::Make(Config* config) {
   return std::make_shared<RealCacheManager>(config);
 }
 
+// static
+std::string ICacheManager::GetProjectDirectoryName(Config* config) {
+  return EscapeFileName(config->projectCacheKey.empty()
+                            ? config->projectRoot
+                            : config->projectCacheKey) +
+         GetProfileSuffix(config);
+}
+
+// static
+std::string ICacheManager::GetCacheEntryName(Config* config,
+                                             const std::string& path) {
+  return GetCachePathInProject(config->projectRoot,
+                               GetProjectDirectoryName(config), path);
+}
+
+// static
+size_t ICacheManager::DropSharedIndexes() {
+  return SharedIndexCache::Get()->Clear();
+}
+
 // static
 std::shared_ptr<ICacheManager> ICacheManager::MakeFake(
     const std::vector<FakeCacheEntry>& entries) {
   return std::make_shared<FakeCacheManager>(entries);
 }
 
-ICacheManager::~ICacheManager() = default;
+ICacheManager::~ICacheManager() {
+  for (const auto& cache : caches_) {
+    GetLoadedIndexesGauge()->Add(-1,
+                                 -int64_t(EstimateMemoryUsage(*cache.second)));
+  }
+}
 
-IndexFile* ICacheManager::TryLoad(const std::string& path) {
+const IndexFile* ICacheManager::TryLoad(const std::string& path) {
   auto it = caches_.find(path);
   if (it != caches_.end())
     return it->second.get();
 
-  std::unique_ptr<IndexFile> cache = RawCacheLoad(path);
+  std::shared_ptr<const IndexFile> cache = TryGetShared(path);
+  if (!cache)
+    cache = LoadShared(path);
   if (!cache)
     return nullptr;
 
-  caches_[path] = std::move(cache);
-  return caches_[path].get();
+  GetLoadedIndexesGauge()->Add(1, EstimateMemoryUsage(*cache));
+  caches_[path] = cache;
+  return cache.get();
 }
 
 std::unique_ptr<IndexFile> ICacheManager::TryTakeOrLoad(
     const std::string& path) {
+  std::shared_ptr<const IndexFile> cache;
   auto it = caches_.find(path);
   if (it != caches_.end()) {
-    auto result = std::move(it->second);
+    cache = std::move(it->second);
     caches_.erase(it);
-    return result;
+    GetLoadedIndexesGauge()->Add(-1, -int64_t(EstimateMemoryUsage(*cache)));
+  } else {
+    cache = TryGetShared(path);
   }
-
-  return RawCacheLoad(path);
+  // Taken indexes are modified and imported, so they are only shared when
+  // another request loaded them already.
+  if (!cache)
+    return RawCacheLoad(path);
+  // Nobody else holds the index, so it can be moved out.
+  if (cache.use_count() == 1)
+    return MakeUnique<IndexFile>(std::move(const_cast<IndexFile&>(*cache)));
+  return MakeUnique<IndexFile>(*cache);
 }
 
 std::unique_ptr<IndexFile> ICacheManager::TakeOrLoad(const std::string& path) {
@@ -147,9 +518,14 @@ std::unique_ptr<IndexFile> ICacheManager::TakeOrLoad(const std::string& path) {
   return result;
 }
 
-void ICacheManager::IterateLoadedCaches(std::function<void(IndexFile*)> fn) {
-  for (const auto& cache : caches_) {
-    assert(cache.second);
-    fn(cache.second.get());
-  }
+void ICacheManager::Prefetch(const std::string& path) {}
+
+std::shared_ptr<const IndexFile> ICacheManager::TryGetShared(
+    const std::string& path) {
+  return nullptr;
+}
+
+std::shared_ptr<const IndexFile> ICacheManager::LoadShared(
+    const std::string& path) {
+  return RawCacheLoad(path);
 }
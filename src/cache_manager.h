@@ -2,7 +2,6 @@
 
 #include <optional.h>
 
-#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -24,27 +23,63 @@ struct ICacheManager {
 
   virtual ~ICacheManager();
 
+  // Name of the directories in the cache directory which hold the indexes of
+  // the project, see Config::projectCacheKey. Depends on
+  // Config::Index::profile.
+  static std::string GetProjectDirectoryName(Config* config);
+  // Returns the name of the cache entry of |path| relative to the cache
+  // directory. It holds the name of the blob with the cached contents of
+  // |path|, and the index is stored under the same name followed by the
+  // extension of Config::cacheFormat.
+  static std::string GetCacheEntryName(Config* config, const std::string& path);
+  // Drops the indexes which the cache managers of the process share, see
+  // Config::cacheMemoryMb, to free memory. Indexes which a cache manager holds
+  // stay alive until it is done. Returns the memory they used in bytes.
+  static size_t DropSharedIndexes();
+
   // Tries to load a cache for |path|, returning null if there is none. The
-  // cache loader still owns the cache.
-  IndexFile* TryLoad(const std::string& path);
+  // cache loader still owns the cache, which may be shared with the other
+  // cache managers of the process.
+  const IndexFile* TryLoad(const std::string& path);
 
   // Takes the existing cache or loads the cache at |path|. May return null if
-  // the cache does not exist.
+  // the cache does not exist. Caches which are shared are copied.
   std::unique_ptr<IndexFile> TryTakeOrLoad(const std::string& path);
 
   // Takes the existing cache or loads the cache at |path|. Asserts the cache
   // exists.
   std::unique_ptr<IndexFile> TakeOrLoad(const std::string& path);
 
+  // Directory inside of the cache directory which stores the contents of
+  // cached files, keyed by content hash.
+  static constexpr const char* kContentsBlobDirectory = "@blobs";
+  // Directory inside of the cache directory which stores the shards of the
+  // packed cache, see Config::cacheShardCount.
+  static constexpr const char* kPackedCacheDirectory = "@packed";
+  // Directory inside of the cache directory which stores the profiles written
+  // by $cquery/profile/stop.
+  static constexpr const char* kProfileDirectory = "@profiles";
+
   virtual void WriteToCache(IndexFile& file) = 0;
 
+  // Loads the file contents |path| had when its cache was written. Caches are
+  // loaded without their file contents, so this is the only way to get them.
   virtual optional<std::string> LoadCachedFileContents(
       const std::string& path) = 0;
 
-  // Iterate over all loaded caches.
-  void IterateLoadedCaches(std::function<void(IndexFile*)> fn);
+  // Starts reading the cached index of |path| from disk in the background,
+  // so that a later TryLoad does not block on it.
+  virtual void Prefetch(const std::string& path);
 
  protected:
   virtual std::unique_ptr<IndexFile> RawCacheLoad(const std::string& path) = 0;
-  std::unordered_map<std::string, std::unique_ptr<IndexFile>> caches_;
+  // Returns the index of |path| which another cache manager of the process
+  // loaded, if it is still around.
+  virtual std::shared_ptr<const IndexFile> TryGetShared(
+      const std::string& path);
+  // Loads the cache of |path| and shares it with the other cache managers of
+  // the process.
+  virtual std::shared_ptr<const IndexFile> LoadShared(const std::string& path);
+
+  std::unordered_map<std::string, std::shared_ptr<const IndexFile>> caches_;
 };
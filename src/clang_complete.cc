@@ -1,8 +1,11 @@
 #include "clang_complete.h"
 
+#include "async_log.h"
 #include "clang_utils.h"
+#include "memory_usage.h"
 #include "platform.h"
 #include "timer.h"
+#include "trace.h"
 
 #include <loguru.hpp>
 
@@ -349,6 +352,56 @@ void BuildDetailString(CXCompletionString completion_string,
   }
 }
 
+// Builds the completion items of |result| and appends them to |out|.
+void BuildCompletionItems(Config* config,
+                          const CXCompletionResult& result,
+                          std::vector<lsCompletionItem>& out) {
+  // TODO: fill in more data
+  lsCompletionItem ls_completion_item;
+
+  ls_completion_item.kind = GetCompletionKind(result.CursorKind);
+  ls_completion_item.documentation =
+      ToString(clang_getCompletionBriefComment(result.CompletionString));
+
+  // label/detail/filterText/insertText/priority
+  if (config->completion.detailedLabel) {
+    ls_completion_item.detail = ToString(
+        clang_getCompletionParent(result.CompletionString, nullptr));
+
+    auto first_idx = out.size();
+    out.push_back(ls_completion_item);
+
+    // label/filterText/insertText
+    BuildCompletionItemTexts(out, result.CompletionString,
+                             config->client.snippetSupport);
+
+    for (auto i = first_idx; i < out.size(); ++i) {
+      if (config->client.snippetSupport &&
+          out[i].insertTextFormat == lsInsertTextFormat::Snippet) {
+        out[i].insertText += "$0";
+      }
+
+      out[i].priority_ = GetCompletionPriority(
+          result.CompletionString, result.CursorKind, out[i].filterText);
+    }
+  } else {
+    bool do_insert = true;
+    BuildDetailString(result.CompletionString, ls_completion_item.label,
+                      ls_completion_item.detail, ls_completion_item.insertText,
+                      do_insert, ls_completion_item.insertTextFormat,
+                      &ls_completion_item.parameters_,
+                      config->client.snippetSupport);
+    if (config->client.snippetSupport &&
+        ls_completion_item.insertTextFormat == lsInsertTextFormat::Snippet) {
+      ls_completion_item.insertText += "$0";
+    }
+    ls_completion_item.priority_ =
+        GetCompletionPriority(result.CompletionString, result.CursorKind,
+                              ls_completion_item.label);
+    out.push_back(ls_completion_item);
+  }
+}
+
 void TryEnsureDocumentParsed(ClangCompleteManager* manager,
                              std::shared_ptr<CompletionSession> session,
                              std::unique_ptr<ClangTranslationUnit>* tu,
@@ -369,20 +422,26 @@ void TryEnsureDocumentParsed(ClangCompleteManager* manager,
       {StripFileType(session->file.filename)});
   std::vector<CXUnsavedFile> unsaved = snapshot.AsUnsavedFiles();
 
-  LOG_S(INFO) << "Creating completion session with arguments "
-              << StringJoin(args);
+  // Preloading creates sessions in bursts, ie, for every file of a view.
+  LOG_RATE_LIMITED_S(INFO, 5) << "Creating completion session with arguments "
+                              << StringJoin(args);
   *tu = ClangTranslationUnit::Create(index, session->file.filename, args,
                                      unsaved, Flags());
 
   // Build diagnostics.
   if (manager->config_->diagnosticsOnParse && *tu) {
-    // If we're emitting diagnostics, do an immediate reparse, otherwise we will
-    // emit stale/bad diagnostics.
-    *tu = ClangTranslationUnit::Reparse(std::move(*tu), unsaved);
-    if (!*tu) {
-      LOG_S(ERROR) << "Reparsing translation unit for diagnostics failed for "
-                   << session->file.filename;
-      return;
+    // Without CreatePreambleOnFirstParse the preamble is only built by the
+    // first reparse, and diagnostics from before then are stale/bad. Reparse
+    // immediately in that case; otherwise the parse above already has a
+    // preamble and its diagnostics can be used as is, which saves a full parse
+    // when creating a session.
+    if (!(Flags() & CXTranslationUnit_CreatePreambleOnFirstParse)) {
+      *tu = ClangTranslationUnit::Reparse(std::move(*tu), unsaved);
+      if (!*tu) {
+        LOG_S(ERROR) << "Reparsing translation unit for diagnostics failed"
+                     << " for " << session->file.filename;
+        return;
+      }
     }
 
     std::vector<lsDiagnostic> ls_diagnostics;
@@ -405,6 +464,10 @@ void CompletionParseMain(ClangCompleteManager* completion_manager) {
     // Fetching the completion request blocks until we have a request.
     ClangCompleteManager::ParseRequest request =
         completion_manager->parse_requests_.Dequeue();
+    if (request.predicted_view_generation &&
+        !completion_manager->CreatePredictedSession(request)) {
+      continue;
+    }
 
     // If we don't get a session then that means we don't care about the file
     // anymore - abandon the request.
@@ -422,6 +485,7 @@ void CompletionParseMain(ClangCompleteManager* completion_manager) {
       continue;
     }
 
+    ScopedTrace trace("completion", "parse", request.path);
     std::unique_ptr<ClangTranslationUnit> parsing;
     TryEnsureDocumentParsed(completion_manager, session, &parsing,
                             &session->index);
@@ -430,185 +494,216 @@ void CompletionParseMain(ClangCompleteManager* completion_manager) {
     // tu_last_parsed_at is only read by this thread, so it doesn't need to be
     // under the mutex.
     session->tu_last_parsed_at = std::chrono::high_resolution_clock::now();
-    std::lock_guard<std::mutex> lock(session->tu_lock);
-    session->tu = std::move(parsing);
+    session->tu_memory_usage = parsing ? parsing->GetMemoryUsage() : 0;
+    {
+      std::lock_guard<std::mutex> lock(session->tu_lock);
+      session->ClearCompletionResults();
+      session->tu = std::move(parsing);
+      session->tu_suspended = false;
+      session->tu_last_used_at = *session->tu_last_parsed_at;
+    }
+    completion_manager->EvictSessionsOverMemoryBudget();
   }
 }
 
-void CompletionQueryMain(ClangCompleteManager* completion_manager) {
-  while (true) {
-    // Fetching the completion request blocks until we have a request.
-    std::unique_ptr<ClangCompleteManager::CompletionRequest> request =
-        completion_manager->completion_request_.Take();
-    std::string path = request->document.uri.GetPath();
-
-    std::shared_ptr<CompletionSession> session =
-        completion_manager->TryGetSession(path, true /*mark_as_completion*/,
-                                          true /*create_if_needed*/);
-
-    std::lock_guard<std::mutex> lock(session->tu_lock);
-    Timer timer;
-    TryEnsureDocumentParsed(completion_manager, session, &session->tu,
-                            &session->index);
-    timer.ResetAndPrint("[complete] TryEnsureDocumentParsed");
+// Services one completion request. The caller has reserved the file of
+// |request|, so no other worker uses its session concurrently.
+void CompletionQuery(ClangCompleteManager* completion_manager,
+                     ClangCompleteManager::CompletionRequest* request,
+                     const std::string& path) {
+  std::shared_ptr<CompletionSession> session =
+      completion_manager->TryGetSession(path, true /*mark_as_completion*/,
+                                        true /*create_if_needed*/);
+
+  std::lock_guard<std::mutex> lock(session->tu_lock);
+  Timer timer;
+  TryEnsureDocumentParsed(completion_manager, session, &session->tu,
+                          &session->index);
+  timer.ResetAndPrint("[complete] TryEnsureDocumentParsed");
+
+  // It is possible we failed to create the document despite
+  // |TryEnsureDocumentParsed|.
+  if (!session->tu)
+    return;
 
-    // It is possible we failed to create the document despite
-    // |TryEnsureDocumentParsed|.
-    if (!session->tu)
-      continue;
+  timer.Reset();
+  WorkingFiles::Snapshot snapshot =
+      completion_manager->working_files_->AsSnapshot({StripFileType(path)});
+  std::vector<CXUnsavedFile> unsaved = snapshot.AsUnsavedFiles();
+  timer.ResetAndPrint("[complete] Creating WorkingFile snapshot");
 
+  // Resume a suspended translation unit before completing in it. Diagnostics
+  // reparse it anyways.
+  if (session->tu_suspended && request->position) {
     timer.Reset();
-    WorkingFiles::Snapshot snapshot =
-        completion_manager->working_files_->AsSnapshot({StripFileType(path)});
-    std::vector<CXUnsavedFile> unsaved = snapshot.AsUnsavedFiles();
-    timer.ResetAndPrint("[complete] Creating WorkingFile snapshot");
+    session->tu =
+        ClangTranslationUnit::Reparse(std::move(session->tu), unsaved);
+    timer.ResetAndPrint("[complete] Resuming suspended translation unit");
+    session->tu_suspended = false;
+    if (!session->tu) {
+      session->tu_memory_usage = 0;
+      return;
+    }
+  }
+  session->tu_last_used_at = std::chrono::high_resolution_clock::now();
+  session->tu_memory_usage = session->tu->GetMemoryUsage();
+  completion_manager->EvictSessionsOverMemoryBudget();
 
-    // Emit code completion data.
-    if (request->position) {
-      // Language server is 0-based, clang is 1-based.
-      unsigned line = request->position->line + 1;
-      unsigned column = request->position->character + 1;
+  // Emit code completion data.
+  if (request->position) {
+    // Language server is 0-based, clang is 1-based.
+    unsigned line = request->position->line + 1;
+    unsigned column = request->position->character + 1;
 
-      timer.Reset();
-      unsigned const kCompleteOptions =
-          CXCodeComplete_IncludeMacros | CXCodeComplete_IncludeBriefComments;
-      CXCodeCompleteResults* cx_results = clang_codeCompleteAt(
-          session->tu->cx_tu, session->file.filename.c_str(), line, column,
-          unsaved.data(), (unsigned)unsaved.size(), kCompleteOptions);
-      timer.ResetAndPrint("[complete] clangCodeCompleteAt");
-      if (!cx_results) {
-        if (request->on_complete)
-          request->on_complete({}, false /*is_cached_result*/);
-        continue;
-      }
+    timer.Reset();
+    unsigned const kCompleteOptions =
+        CXCodeComplete_IncludeMacros | CXCodeComplete_IncludeBriefComments;
+    CXCodeCompleteResults* cx_results = clang_codeCompleteAt(
+        session->tu->cx_tu, session->file.filename.c_str(), line, column,
+        unsaved.data(), (unsigned)unsaved.size(), kCompleteOptions);
+    timer.ResetAndPrint("[complete] clangCodeCompleteAt");
+    if (!cx_results) {
+      if (request->on_complete)
+        request->on_complete({}, false /*is_cached_result*/);
+      return;
+    }
 
-      {
-        if (request->on_complete) {
-          std::vector<lsCompletionItem> ls_result;
-          // this is a guess but can be larger in case of optional parameters,
-          // as they may be expanded into multiple items
-          ls_result.reserve(cx_results->NumResults);
-
-          timer.Reset();
-          for (unsigned i = 0; i < cx_results->NumResults; ++i) {
-            CXCompletionResult& result = cx_results->Results[i];
-
-            // TODO: Try to figure out how we can hide base method calls without
-            // also hiding method implementation assistance, ie,
-            //
-            //    void Foo::* {
-            //    }
-            //
-
-            if (clang_getCompletionAvailability(result.CompletionString) ==
-                CXAvailability_NotAvailable)
-              continue;
-
-            // TODO: fill in more data
-            lsCompletionItem ls_completion_item;
-
-            ls_completion_item.kind = GetCompletionKind(result.CursorKind);
-            ls_completion_item.documentation = ToString(
-                clang_getCompletionBriefComment(result.CompletionString));
-
-            // label/detail/filterText/insertText/priority
-            if (completion_manager->config_->completion.detailedLabel) {
-              ls_completion_item.detail = ToString(
-                  clang_getCompletionParent(result.CompletionString, nullptr));
-
-              auto first_idx = ls_result.size();
-              ls_result.push_back(ls_completion_item);
-
-              // label/filterText/insertText
-              BuildCompletionItemTexts(
-                  ls_result, result.CompletionString,
-                  completion_manager->config_->client.snippetSupport);
-
-              for (auto i = first_idx; i < ls_result.size(); ++i) {
-                if (completion_manager->config_->client.snippetSupport &&
-                    ls_result[i].insertTextFormat ==
-                        lsInsertTextFormat::Snippet) {
-                  ls_result[i].insertText += "$0";
-                }
-
-                ls_result[i].priority_ = GetCompletionPriority(
-                    result.CompletionString, result.CursorKind,
-                    ls_result[i].filterText);
-              }
-            } else {
-              bool do_insert = true;
-              BuildDetailString(
-                  result.CompletionString, ls_completion_item.label,
-                  ls_completion_item.detail, ls_completion_item.insertText,
-                  do_insert, ls_completion_item.insertTextFormat,
-                  &ls_completion_item.parameters_,
-                  completion_manager->config_->client.snippetSupport);
-              if (completion_manager->config_->client.snippetSupport &&
-                  ls_completion_item.insertTextFormat ==
-                      lsInsertTextFormat::Snippet) {
-                ls_completion_item.insertText += "$0";
-              }
-              ls_completion_item.priority_ = GetCompletionPriority(
-                  result.CompletionString, result.CursorKind,
-                  ls_completion_item.label);
-              ls_result.push_back(ls_completion_item);
-            }
+    {
+      if (request->on_complete) {
+        std::vector<lsCompletionItem> ls_result;
+        // this is a guess but can be larger in case of optional parameters,
+        // as they may be expanded into multiple items
+        ls_result.reserve(cx_results->NumResults);
+        CompletionSession::ItemRanges item_ranges;
+
+        timer.Reset();
+        for (unsigned i = 0; i < cx_results->NumResults; ++i) {
+          CXCompletionResult& result = cx_results->Results[i];
+
+          // TODO: Try to figure out how we can hide base method calls without
+          // also hiding method implementation assistance, ie,
+          //
+          //    void Foo::* {
+          //    }
+          //
+
+          if (clang_getCompletionAvailability(result.CompletionString) ==
+              CXAvailability_NotAvailable)
+            continue;
+
+          // Reuse the items built for the same completion string by the
+          // last completion, ie, the results clang caches for the preamble.
+          size_t first_item = ls_result.size();
+          auto cached =
+              session->completion_item_ranges.find(result.CompletionString);
+          if (cached != session->completion_item_ranges.end()) {
+            ls_result.insert(
+                ls_result.end(),
+                session->completion_items.begin() + cached->second.first,
+                session->completion_items.begin() + cached->second.second);
+          } else {
+            BuildCompletionItems(completion_manager->config_, result,
+                                 ls_result);
           }
+          item_ranges[result.CompletionString] =
+              std::make_pair(first_item, ls_result.size());
+        }
 
-          timer.ResetAndPrint("[complete] Building " +
-                              std::to_string(ls_result.size()) +
-                              " completion results");
+        timer.ResetAndPrint("[complete] Building " +
+                            std::to_string(ls_result.size()) +
+                            " completion results");
 
-          request->on_complete(ls_result, false /*is_cached_result*/);
-        }
+        request->on_complete(ls_result, false /*is_cached_result*/);
+
+        // Keep |cx_results| alive until the next completion. Its completion
+        // strings cannot be freed, so a completion string of the next
+        // results with the same address is the same string.
+        session->ClearCompletionResults();
+        session->completion_results = cx_results;
+        session->completion_items = std::move(ls_result);
+        session->completion_item_ranges = std::move(item_ranges);
+        cx_results = nullptr;
       }
+    }
 
-      // Make sure |ls_results| is destroyed before clearing |cx_results|.
+    if (cx_results)
       clang_disposeCodeCompleteResults(cx_results);
-    }
+  }
 
-    // Emit diagnostics.
-    if (request->emit_diagnostics) {
-      // TODO: before emitting diagnostics check if we have another completion
-      // request and think about servicing that first, because it may be much
-      // faster than reparsing the document.
-      // TODO: have a separate thread for diagnostics?
+  // Emit diagnostics.
+  if (request->emit_diagnostics) {
+    // TODO: before emitting diagnostics check if we have another completion
+    // request and think about servicing that first, because it may be much
+    // faster than reparsing the document.
+    // TODO: have a separate thread for diagnostics?
 
-      timer.Reset();
-      session->tu =
-          ClangTranslationUnit::Reparse(std::move(session->tu), unsaved);
-      timer.ResetAndPrint("[complete] clang_reparseTranslationUnit");
-      if (!session->tu) {
-        LOG_S(ERROR) << "Reparsing translation unit for diagnostics failed for "
-                     << path;
-        continue;
-      }
+    timer.Reset();
+    session->tu =
+        ClangTranslationUnit::Reparse(std::move(session->tu), unsaved);
+    timer.ResetAndPrint("[complete] clang_reparseTranslationUnit");
+    session->tu_suspended = false;
+    if (!session->tu) {
+      LOG_S(ERROR) << "Reparsing translation unit for diagnostics failed for "
+                   << path;
+      session->tu_memory_usage = 0;
+      return;
+    }
+    session->tu_memory_usage = session->tu->GetMemoryUsage();
 
-      size_t num_diagnostics = clang_getNumDiagnostics(session->tu->cx_tu);
-      std::vector<lsDiagnostic> ls_diagnostics;
-      ls_diagnostics.reserve(num_diagnostics);
-      for (unsigned i = 0; i < num_diagnostics; ++i) {
-        CXDiagnostic cx_diag = clang_getDiagnostic(session->tu->cx_tu, i);
-        optional<lsDiagnostic> diagnostic =
-            BuildAndDisposeDiagnostic(cx_diag, path);
-        // Filter messages like "too many errors emitted, stopping now
-        // [-ferror-limit=]" which has line = 0 and got subtracted by 1 after
-        // conversion to lsDiagnostic
-        if (diagnostic && diagnostic->range.start.line >= 0)
-          ls_diagnostics.push_back(*diagnostic);
-      }
-      completion_manager->on_diagnostic_(session->file.filename,
-                                         ls_diagnostics);
+    // libclang cannot cancel a reparse, but when the file was edited during
+    // it the diagnostics are already stale; the pending request emits newer
+    // ones.
+    if (completion_manager->HasPendingDiagnosticsRequest(path)) {
+      LOG_S(INFO) << "Dropping stale diagnostics for " << path;
+      return;
+    }
 
-      /*
+    size_t num_diagnostics = clang_getNumDiagnostics(session->tu->cx_tu);
+    std::vector<lsDiagnostic> ls_diagnostics;
+    ls_diagnostics.reserve(num_diagnostics);
+    for (unsigned i = 0; i < num_diagnostics; ++i) {
+      CXDiagnostic cx_diag = clang_getDiagnostic(session->tu->cx_tu, i);
+      optional<lsDiagnostic> diagnostic =
+          BuildAndDisposeDiagnostic(cx_diag, path);
+      // Filter messages like "too many errors emitted, stopping now
+      // [-ferror-limit=]" which has line = 0 and got subtracted by 1 after
+      // conversion to lsDiagnostic
+      if (diagnostic && diagnostic->range.start.line >= 0)
+        ls_diagnostics.push_back(*diagnostic);
+    }
+    completion_manager->on_diagnostic_(session->file.filename,
+                                       ls_diagnostics);
+
+    // Index the reparsed translation unit while we still hold |tu_lock|.
+    if (completion_manager->config_->index.onChange) {
       timer.Reset();
       completion_manager->on_index_(session->tu.get(), unsaved,
                                     session->file.filename, session->file.args);
       timer.ResetAndPrint("[complete] Reindex file");
-      */
     }
+  }
+}
+
+void CompletionQueryMain(ClangCompleteManager* completion_manager) {
+  while (true) {
+    // Fetching the completion request blocks until we have a request.
+    std::unique_ptr<ClangCompleteManager::CompletionRequest> request =
+        completion_manager->TakeCompletionRequest();
+    std::string path = request->document.uri.GetPath();
+    ScopedTrace trace("completion", "complete", path);
+    CompletionQuery(completion_manager, request.get(), path);
+    completion_manager->FinishCompletionRequest(path);
+  }
+}
 
-    continue;
+void CompletionIdleMain(ClangCompleteManager* completion_manager) {
+  while (true) {
+    // Check often enough that a session is not left unsuspended for much
+    // longer than the configured delay.
+    int delay = completion_manager->config_->completion.suspendIdleSeconds;
+    std::this_thread::sleep_for(
+        std::chrono::seconds(delay < 1 ? 60 : std::min(delay / 4 + 1, 60)));
+    completion_manager->SuspendIdleSessions();
   }
 }
 
@@ -620,7 +715,17 @@ CompletionSession::CompletionSession(const Project::Entry& file,
       working_files(working_files),
       index(0 /*excludeDeclarationsFromPCH*/, 0 /*displayDiagnostics*/) {}
 
-CompletionSession::~CompletionSession() {}
+CompletionSession::~CompletionSession() {
+  ClearCompletionResults();
+}
+
+void CompletionSession::ClearCompletionResults() {
+  if (completion_results)
+    clang_disposeCodeCompleteResults(completion_results);
+  completion_results = nullptr;
+  completion_items.clear();
+  completion_item_ranges.clear();
+}
 
 ClangCompleteManager::ParseRequest::ParseRequest(const std::string& path)
     : request_time(std::chrono::high_resolution_clock::now()), path(path) {}
@@ -636,16 +741,24 @@ ClangCompleteManager::ClangCompleteManager(Config* config,
       on_diagnostic_(on_diagnostic),
       on_index_(on_index),
       preloaded_sessions_(kMaxPreloadedSessions),
-      completion_sessions_(kMaxCompletionSessions) {
-  new std::thread([&]() {
-    SetCurrentThreadName("completequery");
-    CompletionQueryMain(this);
-  });
+      completion_sessions_(kMaxCompletionSessions),
+      parse_requests_("clang_complete.parse_requests") {
+  for (int i = 0; i < kNumCompletionWorkers; ++i) {
+    new std::thread([this, i]() {
+      SetCurrentThreadName("completequery" + std::to_string(i));
+      CompletionQueryMain(this);
+    });
+  }
 
   new std::thread([&]() {
     SetCurrentThreadName("completeparse");
     CompletionParseMain(this);
   });
+
+  new std::thread([&]() {
+    SetCurrentThreadName("completeidle");
+    CompletionIdleMain(this);
+  });
 }
 
 ClangCompleteManager::~ClangCompleteManager() {}
@@ -653,31 +766,97 @@ ClangCompleteManager::~ClangCompleteManager() {}
 void ClangCompleteManager::CodeComplete(
     const lsTextDocumentPositionParams& completion_location,
     const OnComplete& on_complete) {
-  completion_request_.WithLock(
-      [&](std::unique_ptr<CompletionRequest>& request_storage) {
-        // Ensure that we have a request.
-        if (!request_storage)
-          request_storage = MakeUnique<CompletionRequest>();
-
-        // Make the request send out code completion information.
-        request_storage->document = completion_location.textDocument;
-        request_storage->position = completion_location.position;
-        request_storage->on_complete = on_complete;
+  view_generation_++;
+  UpdateCompletionRequest(
+      completion_location.textDocument, [&](CompletionRequest* request) {
+        // Make the request send out code completion information. Completion
+        // is never delayed.
+        request->position = completion_location.position;
+        request->on_complete = on_complete;
+        request->ready_time = {};
       });
 }
 
 void ClangCompleteManager::DiagnosticsUpdate(
     const lsTextDocumentIdentifier& document) {
-  completion_request_.WithLock(
-      [&](std::unique_ptr<CompletionRequest>& request_storage) {
-        // Ensure that we have a request.
-        if (!request_storage)
-          request_storage = MakeUnique<CompletionRequest>();
-
-        // Make the request emit diagnostics.
-        request_storage->document = document;
-        request_storage->emit_diagnostics = true;
-      });
+  auto debounce = std::chrono::milliseconds(config_->diagnosticsDebounceMs);
+  UpdateCompletionRequest(document, [&](CompletionRequest* request) {
+    // Make the request emit diagnostics. Every further edit delays it again.
+    request->emit_diagnostics = true;
+    if (!request->position) {
+      request->ready_time =
+          std::chrono::high_resolution_clock::now() + debounce;
+    }
+  });
+}
+
+void ClangCompleteManager::UpdateCompletionRequest(
+    const lsTextDocumentIdentifier& document,
+    const std::function<void(CompletionRequest*)>& update) {
+  std::string path = document.uri.GetPath();
+  std::lock_guard<std::mutex> lock(completion_requests_lock_);
+  for (std::unique_ptr<CompletionRequest>& request : completion_requests_) {
+    if (request->document.uri.GetPath() == path) {
+      request->document = document;
+      update(request.get());
+      return;
+    }
+  }
+
+  auto request = MakeUnique<CompletionRequest>();
+  request->document = document;
+  update(request.get());
+  completion_requests_.push_back(std::move(request));
+  completion_requests_cv_.notify_one();
+}
+
+std::unique_ptr<ClangCompleteManager::CompletionRequest>
+ClangCompleteManager::TakeCompletionRequest() {
+  std::unique_lock<std::mutex> lock(completion_requests_lock_);
+  while (true) {
+    auto now = std::chrono::high_resolution_clock::now();
+    optional<std::chrono::time_point<std::chrono::high_resolution_clock>>
+        next_ready_time;
+    for (auto it = completion_requests_.begin();
+         it != completion_requests_.end(); ++it) {
+      std::string path = (*it)->document.uri.GetPath();
+      if (active_completion_paths_.count(path))
+        continue;
+      if ((*it)->ready_time > now) {
+        if (!next_ready_time || (*it)->ready_time < *next_ready_time)
+          next_ready_time = (*it)->ready_time;
+        continue;
+      }
+      std::unique_ptr<CompletionRequest> request = std::move(*it);
+      completion_requests_.erase(it);
+      active_completion_paths_.insert(path);
+      return request;
+    }
+    // Every pending request is either delayed or for a file which is being
+    // serviced.
+    if (next_ready_time)
+      completion_requests_cv_.wait_until(lock, *next_ready_time);
+    else
+      completion_requests_cv_.wait(lock);
+  }
+}
+
+bool ClangCompleteManager::HasPendingDiagnosticsRequest(
+    const std::string& path) {
+  std::lock_guard<std::mutex> lock(completion_requests_lock_);
+  for (const std::unique_ptr<CompletionRequest>& request :
+       completion_requests_) {
+    if (request->emit_diagnostics && request->document.uri.GetPath() == path)
+      return true;
+  }
+  return false;
+}
+
+void ClangCompleteManager::FinishCompletionRequest(const std::string& path) {
+  std::lock_guard<std::mutex> lock(completion_requests_lock_);
+  active_completion_paths_.erase(path);
+  // A request for |path| may have been waiting for this worker.
+  completion_requests_cv_.notify_all();
 }
 
 void ClangCompleteManager::NotifyView(const std::string& filename) {
@@ -687,11 +866,31 @@ void ClangCompleteManager::NotifyView(const std::string& filename) {
   // parsed soon.
   //
 
-  // Only reparse the file if we create a new CompletionSession.
-  if (EnsureCompletionOrCreatePreloadSession(filename))
+  view_generation_++;
+
+  // Only reparse the file if we create a new CompletionSession, or if its
+  // translation unit has been suspended.
+  if (EnsureCompletionOrCreatePreloadSession(filename)) {
+    parse_requests_.PriorityEnqueue(ParseRequest(filename));
+    return;
+  }
+  std::shared_ptr<CompletionSession> session =
+      TryGetSession(filename, false /*mark_as_completion*/,
+                    false /*create_if_needed*/);
+  if (session && session->tu_suspended)
     parse_requests_.PriorityEnqueue(ParseRequest(filename));
 }
 
+void ClangCompleteManager::PreloadRelatedFiles(
+    const std::vector<std::string>& filenames) {
+  int max_files = config_->completion.preloadRelatedFiles;
+  for (size_t i = 0; i < filenames.size() && int(i) < max_files; i++) {
+    ParseRequest request(filenames[i]);
+    request.predicted_view_generation = view_generation_.load();
+    parse_requests_.Enqueue(std::move(request));
+  }
+}
+
 void ClangCompleteManager::NotifyEdit(const std::string& filename) {
   //
   // We treat an edit like a view, because the completion logic will handle
@@ -716,7 +915,7 @@ void ClangCompleteManager::NotifyClose(const std::string& filename) {
   // On close, we clear any existing CompletionSession instance.
   //
 
-  std::lock_guard<std::mutex> lock(sessions_lock_);
+  std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
 
   // Take and drop. It's okay if we don't actually drop the file, it'll
   // eventually get pushed out of the caches as the user opens other files.
@@ -733,7 +932,7 @@ void ClangCompleteManager::NotifyClose(const std::string& filename) {
 
 bool ClangCompleteManager::EnsureCompletionOrCreatePreloadSession(
     const std::string& filename) {
-  std::lock_guard<std::mutex> lock(sessions_lock_);
+  std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
 
   // Check for an existing CompletionSession.
   if (preloaded_sessions_.TryGet(filename) ||
@@ -752,7 +951,7 @@ std::shared_ptr<CompletionSession> ClangCompleteManager::TryGetSession(
     const std::string& filename,
     bool mark_as_completion,
     bool create_if_needed) {
-  std::lock_guard<std::mutex> lock(sessions_lock_);
+  std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
 
   // Try to find a preloaded session.
   std::shared_ptr<CompletionSession> preloaded_session =
@@ -781,3 +980,152 @@ std::shared_ptr<CompletionSession> ClangCompleteManager::TryGetSession(
 
   return completion_session;
 }
+
+bool ClangCompleteManager::CreatePredictedSession(
+    const ParseRequest& request) {
+  if (*request.predicted_view_generation != view_generation_)
+    return false;
+
+  std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
+  if (preloaded_sessions_.TryGet(request.path) ||
+      completion_sessions_.TryGet(request.path)) {
+    return false;
+  }
+  // Do not push out the sessions of files which were actually viewed.
+  if (preloaded_sessions_.size() + 1 >= size_t(kMaxPreloadedSessions))
+    return false;
+  if (config_->completion.memoryBudgetMb >= 1) {
+    uint64_t total = 0;
+    auto add_usage =
+        [&](const std::shared_ptr<CompletionSession>& session) -> bool {
+          total += session->tu_memory_usage;
+          return true;
+        };
+    preloaded_sessions_.IterateValues(add_usage);
+    completion_sessions_.IterateValues(add_usage);
+    if (total * 2 > uint64_t(config_->completion.memoryBudgetMb) << 20)
+      return false;
+  }
+
+  LOG_S(INFO) << "Preloading completion session for " << request.path;
+  auto session = std::make_shared<CompletionSession>(
+      project_->FindCompilationEntryForFile(request.path), working_files_);
+  preloaded_sessions_.Insert(session->file.filename, session);
+  return true;
+}
+
+bool ClangCompleteManager::HasParsedSession(const std::string& filename) {
+  std::shared_ptr<CompletionSession> session =
+      TryGetSession(filename, false /*mark_as_completion*/,
+                    false /*create_if_needed*/);
+  if (!session)
+    return false;
+  std::unique_lock<std::mutex> lock(session->tu_lock, std::try_to_lock);
+  return lock.owns_lock() && session->tu != nullptr && !session->tu_suspended;
+}
+
+void ClangCompleteManager::EvictSessionsOverMemoryBudget() {
+  static MemoryGauge* gauge = GetMemoryGauge("completion.sessions");
+  std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
+  uint64_t total = 0;
+  auto add_usage =
+      [&](const std::shared_ptr<CompletionSession>& session) -> bool {
+        total += session->tu_memory_usage;
+        return true;
+      };
+  preloaded_sessions_.IterateValues(add_usage);
+  completion_sessions_.IterateValues(add_usage);
+  auto update_gauge = [&]() {
+    gauge->Set(preloaded_sessions_.size() + completion_sessions_.size(),
+               total);
+  };
+  update_gauge();
+
+  if (config_->completion.memoryBudgetMb < 1)
+    return;
+  uint64_t budget = uint64_t(config_->completion.memoryBudgetMb) << 20;
+  while (total > budget) {
+    std::shared_ptr<CompletionSession> session =
+        preloaded_sessions_.TryTakeOldest();
+    if (!session && completion_sessions_.size() > 1)
+      session = completion_sessions_.TryTakeOldest();
+    if (!session)
+      break;
+    uint64_t usage = std::min<uint64_t>(session->tu_memory_usage, total);
+    LOG_S(INFO) << "Dropping completion session for " << session->file.filename
+                << " (" << (usage >> 20) << "MB); sessions use "
+                << (total >> 20) << "MB of " << (budget >> 20) << "MB";
+    total -= usage;
+  }
+  update_gauge();
+}
+
+void ClangCompleteManager::SuspendIdleSessions() {
+  int delay = config_->completion.suspendIdleSeconds;
+  if (delay < 1)
+    return;
+
+  std::vector<std::shared_ptr<CompletionSession>> sessions;
+  {
+    std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
+    auto add_session =
+        [&](const std::shared_ptr<CompletionSession>& session) -> bool {
+          sessions.push_back(session);
+          return true;
+        };
+    preloaded_sessions_.IterateValues(add_session);
+    // Keep the most recent completion session, which is the one being edited.
+    bool is_most_recent = true;
+    completion_sessions_.IterateValues(
+        [&](const std::shared_ptr<CompletionSession>& session) -> bool {
+          if (!is_most_recent)
+            sessions.push_back(session);
+          is_most_recent = false;
+          return true;
+        });
+  }
+
+  auto idle_since = std::chrono::high_resolution_clock::now() -
+                    std::chrono::seconds(delay);
+  for (const std::shared_ptr<CompletionSession>& session : sessions) {
+    std::unique_lock<std::mutex> lock(session->tu_lock, std::try_to_lock);
+    if (!lock.owns_lock() || !session->tu || session->tu_suspended ||
+        session->tu_last_used_at > idle_since) {
+      continue;
+    }
+    uint64_t usage = session->tu_memory_usage;
+    // The cached results are rebuilt after the translation unit is resumed.
+    session->ClearCompletionResults();
+    if (!session->tu->Suspend())
+      continue;
+    session->tu_suspended = true;
+    session->tu_memory_usage = session->tu->GetMemoryUsage();
+    LOG_S(INFO) << "Suspended idle completion session for "
+                << session->file.filename << " (" << (usage >> 20) << "MB to "
+                << (session->tu_memory_usage >> 20) << "MB)";
+  }
+  EvictSessionsOverMemoryBudget();
+}
+
+std::string ClangCompleteManager::DropSessions(bool preloaded_only) {
+  static MemoryGauge* gauge = GetMemoryGauge("completion.sessions");
+  std::lock_guard<InstrumentedMutex> lock(sessions_lock_);
+  int count = 0;
+  uint64_t usage = 0;
+  auto drop = [&](LruSessionCache* sessions, size_t keep) {
+    while (sessions->size() > keep) {
+      std::shared_ptr<CompletionSession> session = sessions->TryTakeOldest();
+      count++;
+      usage += session->tu_memory_usage;
+    }
+  };
+  drop(&preloaded_sessions_, 0);
+  if (!preloaded_only)
+    drop(&completion_sessions_, 1);
+  if (count == 0)
+    return "";
+  gauge->Set(preloaded_sessions_.size() + completion_sessions_.size(),
+             std::max<int64_t>(gauge->bytes() - int64_t(usage), 0));
+  return std::to_string(count) + " completion sessions (" +
+         std::to_string(usage >> 20) + "MB)";
+}
@@ -1,8 +1,8 @@
 #pragma once
 
-#include "atomic_object.h"
 #include "clang_index.h"
 #include "clang_translation_unit.h"
+#include "instrumented_mutex.h"
 #include "language_server_api.h"
 #include "lru_cache.h"
 #include "project.h"
@@ -11,10 +11,16 @@
 
 #include <clang-c/Index.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 struct CompletionSession
     : public std::enable_shared_from_this<CompletionSession> {
@@ -31,9 +37,28 @@ struct CompletionSession
 
   // The active translation unit.
   std::unique_ptr<ClangTranslationUnit> tu;
+  // Bytes used by |tu| when it was last parsed.
+  std::atomic<uint64_t> tu_memory_usage{0};
+  // True if |tu| has been suspended and needs a reparse before it is used.
+  std::atomic<bool> tu_suspended{false};
+  // When |tu| was last parsed or completed in. Only used under |tu_lock|.
+  std::chrono::time_point<std::chrono::high_resolution_clock> tu_last_used_at;
+
+  // Results of the last code completion and the items built from them. Items
+  // are reused for completion strings the next completion shares with these
+  // results, ie, the global results clang caches with the preamble. Only used
+  // under |tu_lock|.
+  using ItemRanges =
+      std::unordered_map<CXCompletionString, std::pair<size_t, size_t>>;
+  CXCodeCompleteResults* completion_results = nullptr;
+  std::vector<lsCompletionItem> completion_items;
+  // Range in |completion_items| of the items of each completion string.
+  ItemRanges completion_item_ranges;
 
   CompletionSession(const Project::Entry& file, WorkingFiles* working_files);
   ~CompletionSession();
+
+  void ClearCompletionResults();
 };
 
 struct ClangCompleteManager {
@@ -53,12 +78,19 @@ struct ClangCompleteManager {
 
     std::chrono::time_point<std::chrono::high_resolution_clock> request_time;
     std::string path;
+    // Set if |path| is preloaded because the user is likely to view it next.
+    // Holds |view_generation_| when the request was made; the request is
+    // dropped once the user moved on.
+    optional<int> predicted_view_generation;
   };
   struct CompletionRequest {
     lsTextDocumentIdentifier document;
     optional<lsPosition> position;
     OnComplete on_complete;  // May be null/empty.
     bool emit_diagnostics = false;
+    // The request is not serviced before this time. Only diagnostics requests
+    // are delayed, until the file has not been edited for a while.
+    std::chrono::time_point<std::chrono::high_resolution_clock> ready_time;
   };
 
   ClangCompleteManager(Config* config,
@@ -78,6 +110,10 @@ struct ClangCompleteManager {
   // Notify the completion manager that |filename| has been viewed and we
   // should begin preloading completion data.
   void NotifyView(const std::string& filename);
+  // Preloads |filenames|, which the user is likely to view after the file of
+  // the last |NotifyView|, in the background. Bounded by
+  // |config_->completion.preloadRelatedFiles|.
+  void PreloadRelatedFiles(const std::vector<std::string>& filenames);
   // Notify the completion manager that |filename| has been edited.
   void NotifyEdit(const std::string& filename);
   // Notify the completion manager that |filename| has been saved. This
@@ -95,10 +131,47 @@ struct ClangCompleteManager {
   std::shared_ptr<CompletionSession> TryGetSession(const std::string& filename,
                                                    bool mark_as_completion,
                                                    bool create_if_needed);
+  // Creates the preloaded session of the predicted view |request| unless the
+  // user has moved on, |request->path| already has a session or the sessions
+  // use too much memory. Returns true if the session was created.
+  bool CreatePredictedSession(const ParseRequest& request);
+  // Returns true if |filename| has a session whose translation unit is parsed
+  // and not in use, so code completion can start without a full parse.
+  bool HasParsedSession(const std::string& filename);
+  // Drops the least recently used sessions while the sessions together use
+  // more memory than |config_->completion.memoryBudgetMb|. Preloaded sessions
+  // are dropped first, and the most recent completion session is kept. Also
+  // publishes the "completion.sessions" memory gauge.
+  void EvictSessionsOverMemoryBudget();
+  // Suspends the translation units of the sessions which were not used for
+  // |config_->completion.suspendIdleSeconds|, except for the most recent
+  // completion session. Sessions in use are skipped.
+  void SuspendIdleSessions();
+  // Drops the preloaded sessions to free memory, and unless |preloaded_only|
+  // every completion session but the most recent one as well. Sessions in use
+  // are freed once their user is done. Returns what was dropped, for the log.
+  std::string DropSessions(bool preloaded_only);
+
+  // Runs |update| on the pending completion request for |document|, creating
+  // one if needed. Requests for the same file are merged.
+  void UpdateCompletionRequest(
+      const lsTextDocumentIdentifier& document,
+      const std::function<void(CompletionRequest*)>& update);
+  // Blocks until there is a ready request for a file no other worker is
+  // servicing. The file stays reserved until |FinishCompletionRequest| is
+  // called.
+  std::unique_ptr<CompletionRequest> TakeCompletionRequest();
+  void FinishCompletionRequest(const std::string& path);
+  // Returns true if diagnostics for |path| have been requested again, ie, the
+  // file was edited while its diagnostics were being built.
+  bool HasPendingDiagnosticsRequest(const std::string& path);
 
   // TODO: make these configurable.
   const int kMaxPreloadedSessions = 10;
   const int kMaxCompletionSessions = 5;
+  // Number of threads servicing completion requests. Each file is serviced by
+  // at most one of them at a time.
+  const int kNumCompletionWorkers = 4;
 
   // Global state.
   Config* config_;
@@ -117,11 +190,20 @@ struct ClangCompleteManager {
   // much longer than the ones in |preloaded_sessions_|.
   LruSessionCache completion_sessions_;
   // Mutex which protects |view_sessions_| and |edit_sessions_|.
-  std::mutex sessions_lock_;
-
-  // Request a code completion at the given location.
-  AtomicObject<CompletionRequest> completion_request_;
+  InstrumentedMutex sessions_lock_{"clang_complete.sessions"};
+
+  // Pending code completion and diagnostics requests, at most one per file,
+  // oldest first.
+  std::vector<std::unique_ptr<CompletionRequest>> completion_requests_;
+  // Files which a completion worker is currently servicing.
+  std::unordered_set<std::string> active_completion_paths_;
+  // Protects |completion_requests_| and |active_completion_paths_|.
+  std::mutex completion_requests_lock_;
+  std::condition_variable completion_requests_cv_;
   // Parse requests. The path may already be parsed, in which case it should be
   // reparsed.
   ThreadedQueue<ParseRequest> parse_requests_;
+  // Incremented by every view and completion, which cancels the pending
+  // preloads of predicted views.
+  std::atomic<int> view_generation_{0};
 };
@@ -1,11 +1,15 @@
 #if USE_CLANG_CXX
 
 #include "clang_format.h"
+#include "platform.h"
 #include "working_files.h"
 
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
+#include <mutex>
+#include <unordered_map>
+
 using namespace clang;
 using clang::format::FormatStyle;
 
@@ -21,6 +25,71 @@ FormatStyle::LanguageKind getLanguageKindFromFilename(
   return FormatStyle::LK_Cpp;
 }
 
+// Range formatting only gives clang-format the text up to
+// |kFormatContextLines| lines after the range, if that skips at least
+// |kMinSkippedFormatSize| bytes. The text before the range is always needed to
+// indent it.
+const int kFormatContextLines = 32;
+const size_t kMinSkippedFormatSize = 64 * 1024;
+
+// Styles are parsed once per style file and reused until its modification
+// time changes.
+struct CachedStyle {
+  int64_t modification_time = 0;
+  FormatStyle style;
+};
+std::mutex g_styles_mutex;
+std::unordered_map<std::string, CachedStyle> g_styles;
+
+// Finds the style file which format::getStyle uses for |filename|. Returns
+// an empty path if there is none.
+std::string FindStyleFile(const std::string& filename,
+                          int64_t* modification_time) {
+  std::string dir = GetDirName(filename);
+  while (true) {
+    for (const char* name : {".clang-format", "_clang-format"}) {
+      std::string path = dir == "/" ? dir + name : dir + "/" + name;
+      optional<int64_t> time = GetLastModificationTime(path);
+      if (time) {
+        *modification_time = *time;
+        return path;
+      }
+    }
+    std::string parent = GetDirName(dir);
+    if (parent == dir || parent == ".")
+      return "";
+    dir = parent;
+  }
+}
+
+llvm::Expected<FormatStyle> GetStyle(const std::string& filename) {
+  int64_t modification_time = 0;
+  std::string style_file = FindStyleFile(filename, &modification_time);
+  // The language of the style depends on the extension.
+  size_t dot = filename.find_last_of("./");
+  std::string key = style_file + "\n" +
+                    (dot != std::string::npos && filename[dot] == '.'
+                         ? filename.substr(dot)
+                         : "");
+  {
+    std::lock_guard<std::mutex> lock(g_styles_mutex);
+    auto it = g_styles.find(key);
+    if (it != g_styles.end() &&
+        it->second.modification_time == modification_time)
+      return it->second.style;
+  }
+
+  llvm::Expected<FormatStyle> style =
+      format::getStyle("file", filename, "chromium");
+  if (style) {
+    std::lock_guard<std::mutex> lock(g_styles_mutex);
+    CachedStyle& cached = g_styles[key];
+    cached.modification_time = modification_time;
+    cached.style = *style;
+  }
+  return style;
+}
+
 }  // namespace
 
 std::vector<tooling::Replacement> ClangFormatDocument(
@@ -32,8 +101,7 @@ std::vector<tooling::Replacement> ClangFormatDocument(
       getLanguageKindFromFilename(working_file->filename);
   FormatStyle predefined_style;
   getPredefinedStyle("chromium", language_kind, &predefined_style);
-  llvm::Expected<FormatStyle> style =
-      format::getStyle("file", working_file->filename, "chromium");
+  llvm::Expected<FormatStyle> style = GetStyle(working_file->filename);
   if (!style) {
     // If, for some reason, we cannot get a format style, use Chromium's with
     // tab configuration provided by the client editor.
@@ -44,12 +112,27 @@ std::vector<tooling::Replacement> ClangFormatDocument(
     predefined_style.IndentWidth = options.tabSize;
   }
 
+  llvm::StringRef code = working_file->buffer_content;
+  size_t context_end = end;
+  for (int i = 0; i <= kFormatContextLines && context_end < code.size(); i++)
+    context_end = std::min(code.find('\n', context_end), code.size()) + 1;
+  bool is_partial = context_end + kMinSkippedFormatSize <= code.size();
+  if (is_partial)
+    code = code.substr(0, context_end);
+
   auto format_result = reformat(
-      style ? *style : predefined_style, working_file->buffer_content,
+      style ? *style : predefined_style, code,
       llvm::ArrayRef<tooling::Range>(tooling::Range(start, end - start)),
       working_file->filename);
-  return std::vector<tooling::Replacement>(format_result.begin(),
-                                           format_result.end());
+  std::vector<tooling::Replacement> result;
+  for (const tooling::Replacement& replacement : format_result) {
+    // The end of the partial text is not the end of the file.
+    if (is_partial &&
+        replacement.getOffset() + replacement.getLength() >= code.size())
+      continue;
+    result.push_back(replacement);
+  }
+  return result;
 }
 
 TEST_SUITE("ClangFormat") {
@@ -112,6 +195,24 @@ TEST_SUITE("ClangFormat") {
     REQUIRE(replacements[1].getLength() == 1);
     REQUIRE(replacements[1].getReplacementText() == "\n");
   }
+
+  TEST_CASE("range at start of large document") {
+    const std::string first_line = "int main() { int *i = 0; return 0; }\n";
+    std::string document = first_line;
+    while (document.size() < 2 * kMinSkippedFormatSize)
+      document += "int x;\n";
+    WorkingFile* file = new WorkingFile("foo.cc", document);
+    lsFormattingOptions formatting_options;
+    formatting_options.insertSpaces = true;
+    const auto replacements = ClangFormatDocument(
+        file, 0, first_line.size() - 1, formatting_options);
+
+    // Same as entireDocument.
+    REQUIRE(replacements.size() == 5);
+    REQUIRE(replacements[0].getOffset() == 12);
+    REQUIRE(replacements[4].getOffset() == 34);
+    REQUIRE(replacements[4].getReplacementText() == "\n");
+  }
 }
 
 #endif
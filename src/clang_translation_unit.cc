@@ -156,3 +156,16 @@ ClangTranslationUnit::ClangTranslationUnit(CXTranslationUnit tu) : cx_tu(tu) {}
 ClangTranslationUnit::~ClangTranslationUnit() {
   clang_disposeTranslationUnit(cx_tu);
 }
+
+uint64_t ClangTranslationUnit::GetMemoryUsage() const {
+  CXTUResourceUsage usage = clang_getCXTUResourceUsage(cx_tu);
+  uint64_t total = 0;
+  for (unsigned i = 0; i < usage.numEntries; ++i)
+    total += usage.entries[i].amount;
+  clang_disposeCXTUResourceUsage(usage);
+  return total;
+}
+
+bool ClangTranslationUnit::Suspend() {
+  return clang_suspendTranslationUnit(cx_tu) != 0;
+}
@@ -5,6 +5,7 @@
 
 #include <clang-c/Index.h>
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -27,5 +28,11 @@ struct ClangTranslationUnit {
   explicit ClangTranslationUnit(CXTranslationUnit tu);
   ~ClangTranslationUnit();
 
+  // Returns the number of bytes libclang uses for this translation unit.
+  uint64_t GetMemoryUsage() const;
+  // Frees the AST but keeps the preamble. The next |Reparse| restores the
+  // translation unit. Returns false if libclang could not suspend it.
+  bool Suspend();
+
   CXTranslationUnit cx_tu;
 };
\ No newline at end of file
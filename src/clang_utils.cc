@@ -107,22 +107,49 @@ optional<lsDiagnostic> BuildAndDisposeDiagnostic(CXDiagnostic diagnostic,
 }
 
 #if USE_CLANG_CXX
-static lsPosition OffsetToRange(llvm::StringRef document, size_t offset) {
-  // TODO: Support Windows line endings, etc.
-  llvm::StringRef text_before = document.substr(0, offset);
-  int num_line = text_before.count('\n');
-  int num_column = text_before.size() - text_before.rfind('\n') - 1;
-  return {num_line, num_column};
-}
+namespace {
+// Converts offsets into positions of |document|. Consecutive offsets are
+// usually increasing, so the scan continues from the last offset instead of
+// starting over.
+class OffsetToPosition {
+ public:
+  explicit OffsetToPosition(llvm::StringRef document) : document_(document) {}
+
+  lsPosition Get(size_t offset) {
+    // TODO: Support Windows line endings, etc.
+    if (offset < offset_) {
+      offset_ = 0;
+      line_ = 0;
+      line_start_ = 0;
+    }
+    offset = std::min(offset, document_.size());
+    for (; offset_ < offset; offset_++) {
+      if (document_[offset_] == '\n') {
+        line_++;
+        line_start_ = offset_ + 1;
+      }
+    }
+    return {line_, int(offset - line_start_)};
+  }
+
+ private:
+  llvm::StringRef document_;
+  size_t offset_ = 0;
+  int line_ = 0;
+  size_t line_start_ = 0;
+};
+}  // namespace
 
 std::vector<lsTextEdit> ConvertClangReplacementsIntoTextEdits(
     llvm::StringRef document,
     const std::vector<clang::tooling::Replacement>& clang_replacements) {
   std::vector<lsTextEdit> text_edits_result;
+  OffsetToPosition start_positions(document);
+  OffsetToPosition end_positions(document);
   for (const auto& replacement : clang_replacements) {
-    const auto startPosition = OffsetToRange(document, replacement.getOffset());
-    const auto endPosition = OffsetToRange(
-        document, replacement.getOffset() + replacement.getLength());
+    const auto startPosition = start_positions.Get(replacement.getOffset());
+    const auto endPosition = end_positions.Get(replacement.getOffset() +
+                                               replacement.getLength());
     text_edits_result.push_back(
         {{startPosition, endPosition}, replacement.getReplacementText()});
   }
@@ -14,6 +14,11 @@ struct CodeCompleteCache {
   optional<std::string> cached_path_;
   optional<lsPosition> cached_completion_position_;
   std::vector<lsCompletionItem> cached_results_;
+  // |cached_results_| as last filtered and sorted for |cached_filter_text_|.
+  // Completion can narrow this list when the user types more characters.
+  // Cleared whenever |cached_results_| changes.
+  optional<std::string> cached_filter_text_;
+  std::vector<lsCompletionItem> cached_filtered_results_;
 
   std::mutex mutex_;
 
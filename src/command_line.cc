@@ -1,30 +1,38 @@
 // TODO: cleanup includes
+#include "async_log.h"
 #include "cache_manager.h"
 #include "clang_complete.h"
 #include "code_complete_cache.h"
+#include "daemon.h"
 #include "file_consumer.h"
 #include "import_manager.h"
 #include "import_pipeline.h"
 #include "include_complete.h"
+#include "index_project.h"
+#include "index_worker.h"
 #include "indexer.h"
 #include "language_server_api.h"
 #include "lex_utils.h"
 #include "lru_cache.h"
 #include "match.h"
 #include "message_handler.h"
+#include "metrics.h"
 #include "options.h"
 #include "platform.h"
 #include "project.h"
 #include "query.h"
 #include "query_utils.h"
 #include "queue_manager.h"
+#include "response_cache.h"
 #include "semantic_highlight_symbol_cache.h"
 #include "serializer.h"
 #include "serializers/json.h"
+#include "session_recording.h"
 #include "test.h"
 #include "threaded_queue.h"
 #include "timer.h"
 #include "timestamp_manager.h"
+#include "trace.h"
 #include "work_thread.h"
 #include "working_files.h"
 
@@ -65,6 +73,7 @@ bool ShouldDisplayIpcTiming(IpcId id) {
   switch (id) {
     case IpcId::TextDocumentPublishDiagnostics:
     case IpcId::CqueryPublishInactiveRegions:
+    case IpcId::CqueryProgress:
     case IpcId::Unknown:
       return false;
     default:
@@ -74,6 +83,29 @@ bool ShouldDisplayIpcTiming(IpcId id) {
 
 REGISTER_IPC_MESSAGE(Ipc_CancelRequest);
 
+// Parses the initialization options given with --init into |config|. Prints
+// the error and returns false if they are malformed.
+bool ParseInitOptions(const std::string& init_options, Config* config) {
+  rapidjson::Document reader;
+  rapidjson::ParseResult ok = reader.Parse(init_options.c_str());
+  if (!ok) {
+    std::cerr << "Failed to parse --init as JSON: "
+              << rapidjson::GetParseError_En(ok.Code()) << " (" << ok.Offset()
+              << ")\n";
+    return false;
+  }
+  JsonReader json_reader{&reader};
+  try {
+    Reflect(json_reader, *config);
+  } catch (std::invalid_argument& e) {
+    std::cerr << "Fail to parse --init "
+              << static_cast<JsonReader&>(json_reader).GetPath()
+              << ", expected " << e.what() << "\n";
+    return false;
+  }
+  return true;
+}
+
 void PrintHelp() {
   std::cout << R"help(cquery is a low-latency C/C++/Objective-C language server.
 
@@ -85,9 +117,46 @@ Mode:
   --test-index <opt_filter_path>
                 Run index tests. opt_filter_path can be used to specify which
                 test to run (ie, "foo" will run all tests which contain "foo"
-                in the path). If not provided all tests are run.
+                in the path). If not provided all tests are run. The parse,
+                build and delta times and the index size of each test are
+                compared to index_tests/perf_baselines.txt; measurements
+                exceeding their baseline by more than
+                --test-index-margin <percent> (50 by default) are reported,
+                and fail the run with --test-index-fail-on-regression.
+                --test-index-update-baselines saves the measurements as the
+                new baselines.
+  --benchmark-index <opt_directory>
+                Generate a synthetic project in opt_directory (default
+                "benchmark_corpus"), index it and print how long each stage
+                of the pipeline took as JSON. The project is shaped with
+                --benchmark-tus, --benchmark-headers, --benchmark-fan-out,
+                --benchmark-template-depth, --benchmark-macros and
+                --benchmark-fan-in (references to one symbol per translation
+                unit); the number of indexer threads is set with
+                --benchmark-threads. --benchmark-fold-templates indexes with
+                index.foldTemplateSpecializations and --benchmark-profile
+                <name> with that index.profile; the time and size of each
+                optional indexer feature are reported either way, as well as
+                the size and load time of the cached indexes in each cache
+                format and cacheCompression.
+  --index-project <directory>
+                Index the project in <directory> on every core, write its
+                caches and exit, ie, to produce caches on a build machine.
+                Takes the initialization options from --init, which must set
+                cacheDirectory. Prints how long indexing took, and exits with
+                a non-zero status if a translation unit failed to index.
+  --index-worker
+                Index translation units sent over stdin. Started by cquery
+                itself, see the index.workerProcesses option.
   (default if no other mode is specified)
                 Run as a language server over stdin and stdout
+  --daemon      Run as a language server over stdin and stdout which shares
+                one daemon with the other editors of the same project. The
+                daemon is started if needed, with the same options, and stops
+                after --daemon-idle-timeout <seconds> without editors (600 by
+                default). initializationOptions of the first editor apply.
+  --daemon-server <socket>
+                Run as the daemon listening on <socket>. Started by --daemon.
 
 Other command line options:
   --debug       Disable libclang crash recovery so that in case of libclang or
@@ -100,6 +169,19 @@ Other command line options:
                 Print stdin (requests) and stdout (responses) to stderr
   --log-file <path>    Logging file for diagnostics
   --log-all-to-stderr  Write all log messages to STDERR.
+  --trace <path>
+                Record what each thread is doing to <path>, in the Chrome
+                trace event format. Open it in chrome://tracing or Perfetto.
+  --record <path>
+                Record the messages sent by the client, with the time they
+                arrived, to <path>.
+  --replay <path>
+                Run the language server on the messages recorded in <path>
+                instead of stdin, sent at the time they were recorded or, with
+                --replay-max-speed, as fast as possible. Once all requests are
+                answered, the latency of each kind of request is printed to
+                stderr and cquery exits. Run it with the cache directory of
+                the recorded session for realistic results.
   --wait-for-input     Wait for an '[Enter]' before exiting
   --help        Print this help information.
   --ci          Prevents tests from prompting the user for input. Used for
@@ -150,25 +232,50 @@ bool QueryDbMainLoop(Config* config,
 
   std::vector<std::unique_ptr<BaseIpcMessage>> messages =
       queue->for_querydb.DequeueAll();
+  CoalesceDidChangeNotifications(&messages);
+  // Readers only run while |db| is not locked here, so they see the effects of
+  // every message handled before them.
+  std::unique_lock<SharedMutex> lock(db->mutex, std::defer_lock);
+  if (!messages.empty())
+    lock.lock();
   for (auto& message : messages) {
+    // Handled once the message querydb was told to wait behind is done. Held
+    // back messages are not work, so that querydb still gets idle.
+    if (HoldBackBehindSuspendedRequest(&message))
+      continue;
     did_work = true;
 
-    for (MessageHandler* handler : *MessageHandler::message_handlers) {
-      if (handler->GetId() == message->method_id) {
-        handler->Run(std::move(message));
-        break;
-      }
+    lsRequestId id = message->GetRequestId();
+    if (EmitIfRequestCancelled(id)) {
+      queue->FinishRequest(id);
+      continue;
     }
-    if (message) {
+
+    MessageHandler* handler = FindMessageHandler(message->method_id);
+    if (!handler) {
       LOG_S(FATAL) << "Exiting; unhandled IPC message "
                    << IpcIdToString(message->method_id);
       exit(1);
     }
+    if (handler->IsReadOnly() && HasQueryDbReaders()) {
+      // The reader finishes the request.
+      queue->for_querydb_readers.Enqueue(std::move(message));
+      continue;
+    }
+    Timer time;
+    ScopedTrace trace("querydb", IpcIdToString(message->method_id));
+    ScopedRequestTrace request_trace(id);
+    handler->Run(std::move(message));
+    if (!std::holds_alternative<std::monostate>(id))
+      status->throttle.OnRequest(time.ElapsedMicroseconds());
+    queue->FinishRequest(id);
   }
+  if (lock)
+    lock.unlock();
 
-  // TODO: consider rate-limiting and checking for IPC messages so we don't
-  // block requests / we can serve partial requests.
-
+  // Requests are handled before index updates. Importing is time-sliced by
+  // |config->querydbImportBudgetMs|, so requests received while importing are
+  // handled on the next iteration instead of waiting for the whole backlog.
   if (QueryDb_ImportMain(config, db, import_manager, status, semantic_cache,
                          working_files)) {
     did_work = true;
@@ -183,13 +290,17 @@ void RunQueryDbThread(const std::string& bin_name,
                       MultiQueueWaiter* indexer_waiter) {
   Project project;
   SemanticHighlightSymbolCache semantic_cache;
+  ResponseCache response_cache;
   WorkingFiles working_files;
   FileConsumerSharedState file_consumer_shared;
+  ImportPipelineStatus import_pipeline_status;
 
   ClangCompleteManager clang_complete(
       config, &project, &working_files,
       [&](std::string path, std::vector<lsDiagnostic> diagnostics) {
-        EmitDiagnostics(&working_files, path, diagnostics);
+        import_pipeline_status.diagnostics_publisher.Publish(
+            &working_files, path, DiagnosticsSource::Completion,
+            std::move(diagnostics));
       },
       [&](ClangTranslationUnit* tu, const std::vector<CXUnsavedFile>& unsaved,
           const std::string& path, const std::vector<std::string>& args) {
@@ -202,7 +313,6 @@ void RunQueryDbThread(const std::string& bin_name,
   auto non_global_code_complete_cache = MakeUnique<CodeCompleteCache>();
   auto signature_cache = MakeUnique<CodeCompleteCache>();
   ImportManager import_manager;
-  ImportPipelineStatus import_pipeline_status;
   TimestampManager timestamp_manager;
   QueryDatabase db;
 
@@ -217,6 +327,7 @@ void RunQueryDbThread(const std::string& bin_name,
     handler->import_pipeline_status = &import_pipeline_status;
     handler->timestamp_manager = &timestamp_manager;
     handler->semantic_cache = &semantic_cache;
+    handler->response_cache = &response_cache;
     handler->working_files = &working_files;
     handler->clang_complete = &clang_complete;
     handler->include_complete = &include_complete;
@@ -226,6 +337,29 @@ void RunQueryDbThread(const std::string& bin_name,
     handler->signature_cache = signature_cache.get();
   }
 
+  StartHighlightingThread(&db, &working_files);
+
+  // Shed memory, cheapest to rebuild first. The governor is started by the
+  // initialize request.
+  import_pipeline_status.memory_governor.AddShedder(
+      [&](MemoryPressure pressure) {
+        return clang_complete.DropSessions(pressure != MemoryPressure::Hard);
+      });
+  import_pipeline_status.memory_governor.AddShedder(
+      [](MemoryPressure pressure) -> std::string {
+        size_t bytes = ICacheManager::DropSharedIndexes();
+        if (bytes == 0)
+          return "";
+        return "shared indexes (" + std::to_string(bytes >> 20) + "MB)";
+      });
+  import_pipeline_status.memory_governor.AddShedder(
+      [&](MemoryPressure pressure) -> std::string {
+        if (pressure != MemoryPressure::Hard)
+          return "";
+        DropPublishedSemanticHighlighting(&semantic_cache);
+        return "published semantic highlighting";
+      });
+
   // Run query db main loop.
   SetCurrentThreadName("querydb");
   while (true) {
@@ -235,14 +369,29 @@ void RunQueryDbThread(const std::string& bin_name,
         &semantic_cache, &working_files, &clang_complete, &include_complete,
         global_code_complete_cache.get(), non_global_code_complete_cache.get(),
         signature_cache.get());
-
-    // Cleanup and free any unused memory.
-    FreeUnusedMemory();
+    import_pipeline_status.memory_governor.ShedIfNeeded();
 
     if (!did_work) {
+      // Reuse the ids of removed symbols while there is nothing else to do;
+      // this runs in batches so new messages are handled in between.
+      if (db.ReclaimUnusedIds())
+        continue;
+      import_pipeline_status.snapshot.MaybeSave(&db, false /*force*/);
+
+      // Resume everything waiting for querydb to be idle; requests waiting
+      // for files which were not imported by the time indexing is done fail
+      // now. Indexing has not started while the project is loading.
       auto* queue = QueueManager::instance();
-      querydb_waiter->Wait(&queue->on_indexed, &queue->for_querydb,
-                           &queue->do_id_map);
+      if (project.is_loaded && !queue->HasWork() &&
+          import_pipeline_status.num_active_threads == 0 &&
+          ResumeAllSuspendedRequests()) {
+        continue;
+      }
+
+      // Cleanup and free any unused memory before going idle.
+      FreeUnusedMemory();
+
+      querydb_waiter->Wait(&queue->on_indexed, &queue->for_querydb);
     }
   }
 }
@@ -270,19 +419,19 @@ void RunQueryDbThread(const std::string& bin_name,
 // blocks.
 //
 // |ipc| is connected to a server.
-void LaunchStdinLoop(Config* config,
-                     std::unordered_map<IpcId, Timer>* request_times) {
+void LaunchStdinLoop(Config* config) {
   // If flushing cin requires flushing cout there could be deadlocks in some
   // clients.
   std::cin.tie(nullptr);
 
-  WorkThread::StartThread("stdin", [request_times]() {
+  WorkThread::StartThread("stdin", ThreadKind::Serving, []() {
     auto* queue = QueueManager::instance();
     while (true) {
       std::unique_ptr<BaseIpcMessage> message;
+      long long parse_us = 0;
       optional<std::string> err =
           MessageRegistry::instance()->ReadMessageFromStdin(
-              g_log_stdin_stdout_to_stderr, &message);
+              g_log_stdin_stdout_to_stderr, &message, &parse_us);
 
       // Message parsing can fail if we don't recognize the method.
       if (err) {
@@ -303,7 +452,6 @@ void LaunchStdinLoop(Config* config,
 
       // Cache |method_id| so we can access it after moving |message|.
       IpcId method_id = message->method_id;
-      (*request_times)[method_id] = Timer();
 
       switch (method_id) {
         case IpcId::Initialized: {
@@ -312,7 +460,9 @@ void LaunchStdinLoop(Config* config,
         }
 
         case IpcId::CancelRequest: {
-          // TODO: support cancellation
+          // querydb drops the request if it is still queued, and long running
+          // handlers poll for cancellation.
+          queue->CancelRequest(message->As<Ipc_CancelRequest>()->params.id);
           break;
         }
 
@@ -350,8 +500,16 @@ void LaunchStdinLoop(Config* config,
         case IpcId::CqueryCallers:
         case IpcId::CqueryBase:
         case IpcId::CqueryDerived:
+        case IpcId::CqueryStats:
+        case IpcId::CqueryMemory:
+        case IpcId::CqueryReloadIndex:
+        case IpcId::CqueryProfileStart:
+        case IpcId::CqueryProfileStop:
         case IpcId::CqueryIndexFile:
         case IpcId::CqueryWait: {
+          lsRequestId id = message->GetRequestId();
+          queue->request_tracer.OnReceived(id, method_id, parse_us);
+          queue->StartRequest(id);
           queue->for_querydb.Enqueue(std::move(message));
           break;
         }
@@ -370,9 +528,8 @@ void LaunchStdinLoop(Config* config,
   });
 }
 
-void LaunchStdoutThread(std::unordered_map<IpcId, Timer>* request_times,
-                        MultiQueueWaiter* waiter) {
-  WorkThread::StartThread("stdout", [=]() {
+void LaunchStdoutThread(MultiQueueWaiter* waiter) {
+  WorkThread::StartThread("stdout", ThreadKind::Serving, [=]() {
     auto* queue = QueueManager::instance();
 
     while (true) {
@@ -381,21 +538,29 @@ void LaunchStdoutThread(std::unordered_map<IpcId, Timer>* request_times,
         waiter->Wait(&queue->for_stdout);
         continue;
       }
+      QueueManager::PrioritizeStdout(&messages);
 
+      std::vector<long long> write_starts;
       for (auto& message : messages) {
-        if (ShouldDisplayIpcTiming(message.id)) {
-          Timer time = (*request_times)[message.id];
-          time.ResetAndPrint("[e2e] Running " +
-                             std::string(IpcIdToString(message.id)));
-        }
-
         if (g_log_stdin_stdout_to_stderr) {
           std::cerr << "[COUT] |" << message.content << "|\n";
           std::cerr.flush();
         }
 
-        std::cout << message.content;
-        std::cout.flush();
+        write_starts.push_back(RequestTracer::NowMicroseconds());
+        ScopedTrace trace("stdout", IpcIdToString(message.id));
+        std::cout.write(message.content.data(), message.content.size());
+      }
+      // Flush once for everything which was ready.
+      std::cout.flush();
+
+      // A response is written once the flush is done.
+      long long write_end = RequestTracer::NowMicroseconds();
+      for (size_t i = 0; i < messages.size(); i++) {
+        if (ShouldDisplayIpcTiming(messages[i].id)) {
+          queue->request_tracer.OnWritten(messages[i], write_starts[i],
+                                          write_end);
+        }
       }
     }
   });
@@ -406,13 +571,13 @@ void LanguageServerMain(const std::string& bin_name,
                         MultiQueueWaiter* querydb_waiter,
                         MultiQueueWaiter* indexer_waiter,
                         MultiQueueWaiter* stdout_waiter) {
-  std::unordered_map<IpcId, Timer> request_times;
+  QueueManager::instance()->request_tracer.Init(config);
 
-  LaunchStdinLoop(config, &request_times);
+  LaunchStdinLoop(config);
 
   // We run a dedicated thread for writing to stdout because there can be an
   // unknown number of delays when output information.
-  LaunchStdoutThread(&request_times, stdout_waiter);
+  LaunchStdoutThread(stdout_waiter);
 
   // Start querydb which takes over this thread. The querydb will launch
   // indexer threads as needed.
@@ -461,11 +626,25 @@ int main(int argc, char** argv) {
   g_debug = HasOption(options, "--debug");
   IndexInit();
 
+  // Workers talk to cquery over stdin and stdout, so they must not run any
+  // of the other modes.
+  if (HasOption(options, "--index-worker"))
+    return RunIndexWorker();
+  // Clients of a daemon only relay messages to it.
+  if (HasOption(options, "--daemon"))
+    return RunDaemonClient(argc, argv);
+
   bool language_server = true;
 
-  if (HasOption(options, "--log-file")) {
-    loguru::add_file(options["--log-file"].c_str(), loguru::Truncate,
-                     loguru::Verbosity_MAX);
+  if (HasOption(options, "--log-file") &&
+      !AddAsyncLogFile(options["--log-file"], loguru::Verbosity_MAX)) {
+    std::cerr << "Failed to open log file " << options["--log-file"] << "\n";
+    return 1;
+  }
+
+  if (HasOption(options, "--trace") && !StartTracing(options["--trace"])) {
+    std::cerr << "Failed to open trace file " << options["--trace"] << "\n";
+    return 1;
   }
 
   if (HasOption(options, "--log-stdin-stdout-to-stderr"))
@@ -489,33 +668,91 @@ int main(int argc, char** argv) {
   if (HasOption(options, "--test-index")) {
     g_debug = true;
     language_server = false;
-    if (!RunIndexTests(options["--test-index"], !HasOption(options, "--ci")))
+    IndexTestPerfOptions perf_options;
+    if (HasOption(options, "--test-index-margin")) {
+      perf_options.margin_percent =
+          atoi(options["--test-index-margin"].c_str());
+    }
+    perf_options.fail_on_regression =
+        HasOption(options, "--test-index-fail-on-regression");
+    perf_options.update_baselines =
+        HasOption(options, "--test-index-update-baselines");
+    if (!RunIndexTests(options["--test-index"], !HasOption(options, "--ci"),
+                       perf_options)) {
+      return 1;
+    }
+  }
+
+  if (HasOption(options, "--benchmark-index")) {
+    language_server = false;
+    IndexBenchmarkOptions benchmark;
+    if (!options["--benchmark-index"].empty())
+      benchmark.directory = options["--benchmark-index"];
+    auto read_int = [&](const char* option, int* value) {
+      if (HasOption(options, option))
+        *value = atoi(options[option].c_str());
+    };
+    read_int("--benchmark-tus", &benchmark.translation_units);
+    read_int("--benchmark-headers", &benchmark.headers);
+    read_int("--benchmark-fan-out", &benchmark.header_fan_out);
+    read_int("--benchmark-template-depth", &benchmark.template_depth);
+    read_int("--benchmark-macros", &benchmark.macro_density);
+    read_int("--benchmark-fan-in", &benchmark.fan_in_uses);
+    read_int("--benchmark-threads", &benchmark.threads);
+    benchmark.fold_template_specializations =
+        HasOption(options, "--benchmark-fold-templates");
+    if (HasOption(options, "--benchmark-profile"))
+      benchmark.profile = options["--benchmark-profile"];
+    if (!RunIndexBenchmark(benchmark))
       return 1;
   }
 
+  if (HasOption(options, "--index-project")) {
+    Config config;
+    if (HasOption(options, "--init") &&
+        !ParseInitOptions(options["--init"], &config)) {
+      return 1;
+    }
+    if (config.threadPlacement)
+      WorkThread::EnablePlacement();
+    // The indexer threads keep waiting on |indexer_waiter|, so do not return
+    // from main.
+    exit(RunIndexProject(options["--index-project"], &config,
+                         &indexer_waiter));
+  }
+
   if (language_server) {
     if (HasOption(options, "--init")) {
       // We check syntax error here but override client-side
       // initializationOptions in messages/initialize.cc
       g_init_options = options["--init"];
-      rapidjson::Document reader;
-      rapidjson::ParseResult ok = reader.Parse(g_init_options.c_str());
-      if (!ok) {
-        std::cerr << "Failed to parse --init as JSON: "
-                  << rapidjson::GetParseError_En(ok.Code()) << " ("
-                  << ok.Offset() << ")\n";
+      Config config;
+      if (!ParseInitOptions(g_init_options, &config))
         return 1;
-      }
-      JsonReader json_reader{&reader};
-      try {
-        Config config;
-        Reflect(json_reader, config);
-      } catch (std::invalid_argument& e) {
-        std::cerr << "Fail to parse --init "
-                  << static_cast<JsonReader&>(json_reader).GetPath()
-                  << ", expected " << e.what() << "\n";
+      // Threads are placed when they start, which is before the client sends
+      // its initialization options.
+      if (config.threadPlacement)
+        WorkThread::EnablePlacement();
+    }
+
+    if (HasOption(options, "--daemon-server")) {
+      int idle_timeout = 600;
+      if (HasOption(options, "--daemon-idle-timeout"))
+        idle_timeout = atoi(options["--daemon-idle-timeout"].c_str());
+      if (!StartDaemonServer(options["--daemon-server"], idle_timeout))
         return 1;
-      }
+    }
+
+    if (HasOption(options, "--record") &&
+        !StartSessionRecording(options["--record"])) {
+      std::cerr << "Failed to open recording " << options["--record"] << "\n";
+      return 1;
+    }
+    if (HasOption(options, "--replay") &&
+        !StartSessionReplay(options["--replay"],
+                            HasOption(options, "--replay-max-speed"))) {
+      std::cerr << "Failed to read recording " << options["--replay"] << "\n";
+      return 1;
     }
 
     // std::cerr << "Running language server" << std::endl;
@@ -0,0 +1,91 @@
+#include "compile_args.h"
+
+#include "utils.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+
+CompileArgs::CompileArgs(std::vector<std::string> args)
+    : args_(std::make_shared<const std::vector<std::string>>(std::move(args))) {
+}
+
+CompileArgs::CompileArgs(std::initializer_list<std::string> args)
+    : CompileArgs(std::vector<std::string>(args)) {}
+
+std::vector<std::string> CompileArgs::Get() const {
+  if (!args_)
+    return {};
+  std::vector<std::string> result = *args_;
+  if (file_index_ >= 0)
+    result[file_index_] = file_;
+  return result;
+}
+
+void CompileArgs::Intern(const std::string& file,
+                         CompileArgsInterner* interner) {
+  if (!args_ || file_index_ >= 0)
+    return;
+
+  std::vector<std::string> args = *args_;
+  auto it = std::find(args.begin(), args.end(), file);
+  int file_index = -1;
+  if (it != args.end()) {
+    file_index = int(it - args.begin());
+    it->clear();
+  }
+
+  std::string joined;
+  for (const std::string& arg : args) {
+    joined += arg;
+    joined += '\0';
+  }
+  auto& candidates = interner->args[HashUsr(joined)];
+  CompileArgsInterner::Args interned;
+  for (const auto& candidate : candidates) {
+    if (*candidate == args) {
+      interned = candidate;
+      break;
+    }
+  }
+  if (!interned) {
+    interned =
+        std::make_shared<const std::vector<std::string>>(std::move(args));
+    candidates.push_back(interned);
+  }
+
+  args_ = interned;
+  if (file_index >= 0) {
+    file_index_ = file_index;
+    file_ = file;
+  }
+}
+
+bool CompileArgs::operator==(const std::vector<std::string>& other) const {
+  if (!args_)
+    return other.empty();
+  if (args_->size() != other.size())
+    return false;
+  for (size_t i = 0; i < other.size(); i++) {
+    const std::string& arg = int(i) == file_index_ ? file_ : (*args_)[i];
+    if (arg != other[i])
+      return false;
+  }
+  return true;
+}
+
+TEST_SUITE("CompileArgs") {
+  TEST_CASE("intern") {
+    CompileArgsInterner interner;
+    CompileArgs a{"clang", "-DA", "/a.cc"};
+    CompileArgs b{"clang", "-DA", "/b.cc"};
+    CompileArgs c{"clang", "-DC", "/c.cc"};
+    a.Intern("/a.cc", &interner);
+    b.Intern("/b.cc", &interner);
+    c.Intern("/c.cc", &interner);
+    REQUIRE(interner.args.size() == 2);
+    REQUIRE(a == std::vector<std::string>({"clang", "-DA", "/a.cc"}));
+    REQUIRE(b.Get() == std::vector<std::string>({"clang", "-DA", "/b.cc"}));
+    REQUIRE(c != std::vector<std::string>({"clang", "-DA", "/c.cc"}));
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct CompileArgsInterner;
+
+// Immutable compiler arguments of a file. Copies share the same storage, so
+// a Project::Entry can be copied into index requests and completion sessions
+// without copying every argument.
+//
+// Most files of a project are compiled with one of a few sets of flags. After
+// Intern(), files whose arguments only differ by the file path itself also
+// share storage; the path is kept separately and put back by Get().
+class CompileArgs {
+ public:
+  CompileArgs() {}
+  CompileArgs(std::vector<std::string> args);
+  CompileArgs(std::initializer_list<std::string> args);
+
+  // Returns a copy of the arguments.
+  std::vector<std::string> Get() const;
+  operator std::vector<std::string>() const { return Get(); }
+
+  bool empty() const { return !args_ || args_->empty(); }
+
+  // Shares storage with arguments previously interned in |interner| which are
+  // the same except for |file|.
+  void Intern(const std::string& file, CompileArgsInterner* interner);
+
+  bool operator==(const std::vector<std::string>& other) const;
+  bool operator!=(const std::vector<std::string>& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  std::shared_ptr<const std::vector<std::string>> args_;
+  // Index of the argument which is |file_| when |args_| is interned, or -1.
+  // The interned arguments hold an empty string there.
+  int file_index_ = -1;
+  std::string file_;
+};
+
+struct CompileArgsInterner {
+  using Args = std::shared_ptr<const std::vector<std::string>>;
+  // Interned arguments by hash.
+  std::unordered_map<uint64_t, std::vector<Args>> args;
+};
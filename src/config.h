@@ -1,5 +1,6 @@
 #pragma once
 
+#include "cache_compression.h"
 #include "serializer.h"
 
 #include <string>
@@ -23,8 +24,18 @@ initialization options specified by the client. For example, in shell syntax:
 struct Config {
   // Root directory of the project. **Not available for configuration**
   std::string projectRoot;
+  // Root directories of all workspace folders, starting with `projectRoot`.
+  // They share one index. **Not available for configuration**
+  std::vector<std::string> workspaceFolders;
   // Directory containing compile_commands.json.
   std::string compilationDatabaseDirectory;
+  // A file which compile_commands.json lists several times, ie, once per
+  // build configuration, is only indexed with one of its entries: the first
+  // one with an argument matching the earliest ECMAScript regex of this list,
+  // or the first entry if no argument matches.
+  //
+  // Example: `["^-DNDEBUG$"]`
+  std::vector<std::string> compilationDatabasePreferredArgs;
   // Cache directory for indexed files.
   std::string cacheDirectory;
   // Cache serialization format.
@@ -37,7 +48,64 @@ struct Config {
   // takes only 60% of the corresponding JSON size, but is difficult to inspect.
   // msgpack does not store map keys and you need to re-index whenever a struct
   // member has changed.
+  //
+  // "binary" stores fixed-width values without any type tags. It is the
+  // fastest to load but, like msgpack, needs a re-index whenever a struct
+  // member has changed.
   SerializeFormat cacheFormat = SerializeFormat::Json;
+  // If greater than 0, cache entries are packed into this many append-only
+  // shard files in `cacheDirectory/@packed` instead of one file per indexed
+  // file and per distinct file content. This makes loading a large cache a few
+  // large reads instead of a huge number of small ones, which helps on network
+  // file systems. Changing the value invalidates the cache.
+  int cacheShardCount = 0;
+  // Memory in megabytes for the indexes loaded from the cache which are kept
+  // around for the whole process, so that the index of a file needed by the
+  // requests of several translation units, ie, of a common header, is read
+  // and deserialized once. 0 disables it.
+  int cacheMemoryMb = 256;
+  // Codec cache entries are compressed with: "none" or "zstd", which needs
+  // cquery to be built with libzstd. Indexes are compressed with a dictionary
+  // trained on the first indexes written, which is stored in
+  // `cacheDirectory/@dictionaries`. Entries written with another codec, or
+  // without compression, stay readable.
+  CacheCodec cacheCompression = CacheCodec::None;
+  // zstd compression level, from 1 (fastest) to 19 (smallest).
+  int cacheCompressionLevel = 3;
+  // Number of queued index requests whose cache entries, and those of their
+  // dependencies, are read ahead in the background when an indexer thread
+  // takes a request, so that checking and loading the cache does not block
+  // on the disk. 0 disables it.
+  int cachePrefetchCount = 16;
+  // If true, the cache entries of files which are neither in the project nor
+  // included by one of its files, ie, deleted or renamed files, are removed
+  // in the background at startup, as well as the file contents no project
+  // refers to anymore.
+  bool cacheCollectGarbage = true;
+  // If greater than 0, the least recently used cache entries of the project
+  // are also removed until they take at most this many megabytes. Used files
+  // are indexed again when needed.
+  int cacheSizeLimitMb = 0;
+  // Read-only cache directory shared by a team, ie, on a network file system,
+  // which a cquery with `cacheShardCount` 0 and the same `cacheFormat` and
+  // `fastUsrHash` wrote. Indexes which are not in `cacheDirectory` are
+  // loaded from there, and are used like any cached index if the contents
+  // and arguments of the file and its dependencies match. A fresh checkout
+  // then does not need to be parsed.
+  std::string sharedCacheDirectory;
+  // `projectRoot` of the cquery which wrote `sharedCacheDirectory`, used to
+  // find the project in it if `projectCacheKey` is not set.
+  std::string sharedCacheProjectRoot;
+  // Name under which the indexes of the project are stored in
+  // `cacheDirectory`; defaults to `projectRoot`. Paths in the project are
+  // cached relative to `projectRoot`, so moved checkouts and worktrees of a
+  // repository which use the same key share their indexes. Files which
+  // differ between them are reindexed as usual.
+  std::string projectCacheKey;
+  // If true, symbols are identified by a faster non-cryptographic hash of
+  // their USR instead of siphash. Caches written with either hash are not
+  // compatible, so changing the value re-indexes the project.
+  bool fastUsrHash = false;
   // Value to use for clang -resource-dir if not present in
   // compile_commands.json.
   //
@@ -62,19 +130,120 @@ struct Config {
   // If true, project paths that were skipped by the whitelist/blacklist will
   // be logged.
   bool logSkippedPathsForIndex = false;
+  // References are only recorded in files whose absolute path matches a regex
+  // in the whitelist, or does not match any regex in the blacklist, using the
+  // same rules as indexWhitelist/indexBlacklist. Declarations are still
+  // indexed everywhere. Skipping references inside system and third-party
+  // headers saves a lot of indexing time for template-heavy code.
+  //
+  // Example: whitelist `^/work/project/` and blacklist `.*`.
+  std::vector<std::string> indexReferencesWhitelist;
+  std::vector<std::string> indexReferencesBlacklist;
 
   // Maximum workspace search results.
   int maxWorkspaceSearchResults = 500;
+  // Maximum number of locations returned by textDocument/references. A client
+  // can fetch the next ones by sending the same request with |startIndex| set
+  // to the number of locations it already has. If less than 1, every
+  // location is returned.
+  int maxReferencesResults = 10000;
   // If true, workspace search results will be dynamically rescored/reordered
   // as the search progresses. Some clients do their own ordering and assume
   // that the results stay sorted in the same order as the search progresses.
   bool sortWorkspaceSearchResults = true;
+  // Number of threads used to rank workspace search results when
+  // |sortWorkspaceSearchResults| is true. If less than 1, one thread per CPU
+  // core is used. Small candidate lists are always ranked on the querydb
+  // thread.
+  int workspaceSymbolThreads = 0;
 
   // Force a certain number of indexer threads. If less than 1 a default value
   // is be used (80% number of CPU cores).
   int indexerCount = 0;
+  // If true, fewer indexers parse files while requests take longer than
+  // |indexerRequestLatencyMs|, while the system load exceeds the number of
+  // cores, or while running on battery. Otherwise all indexers parse.
+  bool indexerAdaptive = true;
+  int indexerRequestLatencyMs = 100;
+  // Percentage of |indexerCount| which parses while running on battery.
+  int indexerBatteryPercent = 50;
+  // If true, indexer threads run at a lower CPU and IO priority than the
+  // threads answering requests.
+  bool indexerLowPriority = true;
+  // If true, indexer threads are spread over the NUMA nodes of the machine,
+  // and the threads answering requests run on the first one, where querydb
+  // memory is then allocated. Only takes effect when given with --init, since
+  // the threads are started before the client initializes. Linux only.
+  bool threadPlacement = false;
   // If false, the indexer will be disabled.
   bool enableIndexing = true;
+  // Maximum time in milliseconds querydb spends importing index updates before
+  // it handles pending requests again. If less than 1, all queued updates are
+  // imported at once.
+  int querydbImportBudgetMs = 20;
+  // Number of threads which run read-only requests (hover, references,
+  // workspace/symbol, ...) concurrently with each other and with the querydb
+  // thread. If less than 1 every request runs on the querydb thread.
+  int querydbReaderThreads = 2;
+  // If greater than 0, querydb is saved to a snapshot in the cache directory
+  // at most this often while it is idle, and on shutdown. A restart loads the
+  // snapshot so the project can be queried right away, and then only imports
+  // the files which changed since. If less than 1, snapshots are not used.
+  int querydbSnapshotIntervalMs = 0;
+  // If not empty, the reference lists of querydb, which are most of its
+  // memory, are kept in memory mapped files in this directory instead of on
+  // the heap. The kernel then writes cold lists out when memory runs low and
+  // reads them back when a query needs them, so a project whose database
+  // does not fit in memory can still be loaded. The files are deleted right
+  // away; the directory needs room for the database. Not supported on
+  // Windows.
+  std::string querydbPagedStorageDirectory;
+  // Bounds on the work queued between indexing stages, so that memory stays
+  // bounded when querydb falls behind. Once do_id_map (parsed indexes waiting
+  // for id mapping) or on_indexed (updates waiting for querydb) reaches its
+  // high watermark, indexers stop parsing new files until every queue is back
+  // below its low watermark. A high watermark less than 1 disables the bound.
+  int indexerDoIdMapHighWatermark = 1000;
+  int indexerDoIdMapLowWatermark = 500;
+  int indexerOnIndexedHighWatermark = 500;
+  int indexerOnIndexedLowWatermark = 250;
+  // Limits in megabytes on the resident memory of cquery, checked about once
+  // a second. Past either limit indexers stop parsing new files, and the
+  // preloaded completion sessions and the indexes kept by
+  // |cacheMemoryMb| are dropped. Past |memoryHardLimitMb| every completion
+  // session but the most recent one and the semantic highlighting kept for
+  // deltas are dropped as well. A limit counts as passed until memory drops
+  // below 90% of it. What is dropped is logged. Less than 1 disables a limit.
+  int memorySoftLimitMb = 0;
+  int memoryHardLimitMb = 0;
+  // If greater than 0, memory stalls of at least this percentage of the time
+  // count like passing |memorySoftLimitMb|. This is "some avg10" of the
+  // memory.pressure file of the cgroup of cquery, so that limits of the
+  // cgroup or of the machine are noticed as well. Linux only.
+  int memoryStallPercent = 0;
+  // If true, a changed header is reindexed through the translation unit
+  // including it which was fastest to parse. The header and that translation
+  // unit are imported again. Otherwise headers are reindexed through the
+  // translation unit which first indexed them.
+  //
+  // Off by default, since the other translation units including the header
+  // are not reindexed: their own indexes, eg, references from them to
+  // symbols which the header renamed or removed, stay stale until they are
+  // indexed again. The header is also only indexed with the arguments, and
+  // so the macros, of the chosen translation unit.
+  bool headerGranularReindex = false;
+  // Number of precompiled preambles each indexer thread keeps. A preamble is
+  // built for the leading block of `#include <...>` directives once two
+  // translation units with the same arguments share it, and reused for later
+  // ones. If less than 1, preambles are not used.
+  int indexerPreambleCacheSize = 0;
+  // Number of translation units of interactive index requests, ie, of files
+  // open in the editor, which the indexers keep in memory. Indexing such a
+  // file again, eg, after a save, reparses the translation unit with its
+  // precompiled preamble instead of parsing it from scratch. Each one takes
+  // as much memory as a completion session. If less than 1, translation
+  // units are not kept.
+  int indexerReparseCacheSize = 2;
 
   // If true, cquery will send progress reports while indexing
   // How often should cquery send progress report messages?
@@ -88,6 +257,16 @@ struct Config {
   // This does not guarantee a progress report will be delivered every
   // interval; it could take significantly longer if cquery is completely idle.
   int progressReportFrequencyMs = 500;
+  // Requests which take longer than this many milliseconds from reading them
+  // to writing their response log how long each stage took, ie, waiting for
+  // querydb or running the handler. They are counted in the
+  // "request_slow.<method>" metrics. Less than 1 disables the log.
+  int slowRequestThresholdMs = 1000;
+
+  // If true, semantic highlighting of a file which was reindexed only sends
+  // the ranges which changed, in $cquery/publishSemanticHighlightingDelta.
+  // Opening or viewing a file still sends every range.
+  bool semanticHighlightingDeltas = false;
 
   // If true, document links are reported for #include directives.
   bool showDocumentLinksOnIncludes = true;
@@ -114,9 +293,25 @@ struct Config {
   bool diagnosticsOnParse = true;
   // If true, diagnostics from code completion will be reported.
   bool diagnosticsOnCodeCompletion = true;
+  // Diagnostics for an edited file are only rebuilt once it has not been
+  // edited for this many milliseconds.
+  int diagnosticsDebounceMs = 250;
+  // Diagnostics of a file are published at most once per this many
+  // milliseconds. Updates in between are combined into one, and updates which
+  // do not change the diagnostics are never sent. 0 publishes every change.
+  int diagnosticsPublishIntervalMs = 500;
 
   // Enables code lens on parameter and function variables.
   bool codeLensOnLocalVariables = true;
+  // If true, code lens are listed without their locations, which are only
+  // computed when the client resolves a lens (codeLens/resolve). This keeps
+  // textDocument/codeLens fast on files with many symbols.
+  bool codeLensResolve = false;
+
+  // If true, the lines ending at a typed '}' or ';' are formatted
+  // (textDocument/onTypeFormatting). Requires cquery to be built with
+  // --use-clang-cxx.
+  bool formatOnType = false;
 
   // Version of the client. If undefined the version check is skipped. Used to
   // inform users their vscode client is too old and needs to be updated.
@@ -154,6 +349,32 @@ struct Config {
     // Be wary, this is quickly quite verbose,
     // items can end up truncated by the UIs.
     bool detailedLabel = false;
+
+    // Memory budget in megabytes for the translation units of all completion
+    // sessions, as reported by libclang. The least recently used sessions are
+    // dropped when they use more than this. If less than 1, only the number
+    // of sessions is limited.
+    int memoryBudgetMb = 4096;
+
+    // Seconds after which the translation unit of a completion session which
+    // was not used is suspended, which frees most of its memory. It is
+    // reparsed by the next view, completion or diagnostics of the file. The
+    // most recent completion session is never suspended. If less than 1,
+    // translation units are never suspended.
+    int suspendIdleSeconds = 900;
+
+    // Number of files the user is likely to view next, ie, the source file of
+    // a viewed header and the headers of a viewed source file, which are
+    // parsed in the background when a file is viewed. Pending preloads are
+    // cancelled by the next view or completion, and skipped while the
+    // sessions use more than half of |memoryBudgetMb|. If less than 1, only
+    // viewed files are preloaded.
+    int preloadRelatedFiles = 2;
+
+    // If true, member completions (after ., -> or ::) are computed in the
+    // background as soon as the trigger is typed, so they are usually cached
+    // when the client asks for them.
+    bool speculative = false;
   };
   Completion completion;
 
@@ -164,6 +385,21 @@ struct Config {
     // - https://github.com/emacs-lsp/lsp-mode/pull/224
     // - https://github.com/autozimu/LanguageClient-neovim/issues/224
     int comments = 2;
+    // If true, only the range of each comment is stored when a file is
+    // indexed, and hover reads the text from the file the first time it is
+    // needed. Saves the memory and cache space of the comments of every
+    // declaration, most of which are never hovered.
+    bool lazyComments = false;
+
+    // Set of optional indexer features to record. "full" records everything.
+    // "navigation-only" skips macros, comments, local variables, implicit
+    // calls (ie, of constructors and conversion operators), references made
+    // from the bodies of templates and references in variable initializers,
+    // which keeps what goto definition and find references need for the
+    // other symbols and saves much of the index build time and size. The cost
+    // of each feature is reported in the index.* latency histograms and by
+    // --benchmark-index. Each profile has its own indexes in the cache.
+    std::string profile = "full";
 
     // Attempt to convert calls of make* functions to constructors based on
     // hueristics.
@@ -172,6 +408,62 @@ struct Config {
     // invocations. Specifically, cquery will try to attribute a ctor call
     // whenever the function name starts with make (ignoring case).
     bool attributeMakeCallsToCtor = true;
+
+    // If true, implicit instantiations of function templates and of the
+    // members of class templates are indexed as the template they were
+    // instantiated from, instead of as one function per instantiation.
+    // References to class and variable templates always are. Explicit and
+    // partial specializations keep their own entities.
+    bool foldTemplateSpecializations = false;
+    // If greater than 0, at most this many references to each function are
+    // recorded from the bodies of folded instantiations.
+    int maxInstantiationUses = 0;
+
+    // If true, an edited file is reindexed from its code completion
+    // translation unit after each diagnostics reparse, so references and
+    // semantic highlighting follow unsaved changes without another parse.
+    bool onChange = false;
+
+    // If true, the project root and the quote include directories are
+    // watched by the server itself (inotify on Linux), and files changed
+    // there are handled as if the client had sent
+    // workspace/didChangeWatchedFiles for them. Useful for clients which do
+    // not watch files outside of the workspace. A change of
+    // compile_commands.json reloads the project and indexes the files which
+    // were added or whose arguments changed.
+    bool watchFiles = false;
+
+    // If true, every indexer thread parses in a cquery process of its own,
+    // which is restarted when it crashes. A crash of clang then only fails
+    // the translation unit being parsed, and the memory of a worker is
+    // returned to the system when it is restarted. Not supported on Windows.
+    bool workerProcesses = false;
+    // Index worker processes using more memory than this after indexing a
+    // translation unit are restarted. 0 means no limit.
+    int workerMemoryLimitMb = 2048;
+    // Index workers which do not answer within this many seconds, ie, since
+    // clang hangs on a translation unit, are killed, and the translation
+    // unit fails to index. The next translation unit starts a new worker. 0
+    // means no limit.
+    int workerTimeoutSeconds = 300;
+    // Commands which start an index worker, possibly on another machine, ie,
+    // ["/usr/bin/ssh", "build1", "/opt/cquery/bin/cquery", "--index-worker"].
+    // Each command is the argument vector of a process, whose first element
+    // is the absolute path of the program; it is not run through a shell. If
+    // not empty, indexer threads use workers started by these commands in
+    // turn instead of local ones; indexerCount is the number of workers kept
+    // busy. Workers read the files of the project from disk, so they must
+    // see them under the same paths.
+    //
+    // The commands run with the rights of cquery, so they are only taken
+    // from --init, which the user controls, and never from the
+    // initializationOptions which the client sends.
+    std::vector<std::vector<std::string>> workerCommands;
+
+    // If true, a translation unit which only includes other source files of
+    // the project, ie, the unity_N.cc or jumbo file of a unity build, is not
+    // indexed. The included files are indexed on their own, in parallel.
+    bool skipUnitySources = true;
   };
   Index index;
 
@@ -181,12 +473,43 @@ struct Config {
   std::vector<std::string> dumpAST;
 };
 MAKE_REFLECT_STRUCT(Config::ClientCapability, snippetSupport);
-MAKE_REFLECT_STRUCT(Config::Completion, filterAndSort, detailedLabel);
-MAKE_REFLECT_STRUCT(Config::Index, comments, attributeMakeCallsToCtor);
+MAKE_REFLECT_STRUCT(Config::Completion,
+                    filterAndSort,
+                    detailedLabel,
+                    memoryBudgetMb,
+                    suspendIdleSeconds,
+                    preloadRelatedFiles,
+                    speculative);
+MAKE_REFLECT_STRUCT(Config::Index,
+                    comments,
+                    lazyComments,
+                    profile,
+                    attributeMakeCallsToCtor,
+                    foldTemplateSpecializations,
+                    maxInstantiationUses,
+                    onChange,
+                    watchFiles,
+                    workerProcesses,
+                    workerMemoryLimitMb,
+                    workerTimeoutSeconds,
+                    workerCommands,
+                    skipUnitySources);
 MAKE_REFLECT_STRUCT(Config,
                     compilationDatabaseDirectory,
+                    compilationDatabasePreferredArgs,
                     cacheDirectory,
                     cacheFormat,
+                    cacheShardCount,
+                    cacheMemoryMb,
+                    cacheCompression,
+                    cacheCompressionLevel,
+                    cachePrefetchCount,
+                    cacheCollectGarbage,
+                    cacheSizeLimitMb,
+                    sharedCacheDirectory,
+                    sharedCacheProjectRoot,
+                    projectCacheKey,
+                    fastUsrHash,
                     resourceDirectory,
 
                     extraClangArguments,
@@ -194,25 +517,55 @@ MAKE_REFLECT_STRUCT(Config,
                     indexWhitelist,
                     indexBlacklist,
                     logSkippedPathsForIndex,
+                    indexReferencesWhitelist,
+                    indexReferencesBlacklist,
 
                     maxWorkspaceSearchResults,
+                    maxReferencesResults,
                     sortWorkspaceSearchResults,
+                    workspaceSymbolThreads,
 
                     indexerCount,
+                    indexerAdaptive,
+                    indexerRequestLatencyMs,
+                    indexerBatteryPercent,
+                    indexerLowPriority,
+                    threadPlacement,
                     enableIndexing,
+                    querydbImportBudgetMs,
+                    querydbReaderThreads,
+                    querydbSnapshotIntervalMs,
+                    querydbPagedStorageDirectory,
+                    indexerDoIdMapHighWatermark,
+                    indexerDoIdMapLowWatermark,
+                    indexerOnIndexedHighWatermark,
+                    indexerOnIndexedLowWatermark,
+                    memorySoftLimitMb,
+                    memoryHardLimitMb,
+                    memoryStallPercent,
+                    headerGranularReindex,
+                    indexerPreambleCacheSize,
+                    indexerReparseCacheSize,
                     progressReportFrequencyMs,
+                    slowRequestThresholdMs,
 
                     includeCompletionMaximumPathLength,
                     includeCompletionWhitelistLiteralEnding,
                     includeCompletionWhitelist,
                     includeCompletionBlacklist,
 
+                    semanticHighlightingDeltas,
                     showDocumentLinksOnIncludes,
 
                     diagnosticsOnParse,
                     diagnosticsOnCodeCompletion,
+                    diagnosticsDebounceMs,
+                    diagnosticsPublishIntervalMs,
 
                     codeLensOnLocalVariables,
+                    codeLensResolve,
+
+                    formatOnType,
 
                     clientVersion,
 
@@ -0,0 +1,641 @@
+#include "daemon.h"
+
+#include "language_server_api.h"
+#include "platform.h"
+#include "work_thread.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::string ToJson(const rapidjson::Value& value) {
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+  value.Accept(writer);
+  return std::string(output.GetString(), output.GetSize());
+}
+
+bool WriteMessage(PlatformConnection* connection, const std::string& body) {
+  std::string message;
+  AppendOutMessage(body.data(), body.size(), &message);
+  return connection->Write(message.data(), message.size());
+}
+
+// Returns the string member |name| of |object|, or "".
+std::string GetString(const rapidjson::Value& object, const char* name) {
+  if (!object.IsObject())
+    return "";
+  auto it = object.FindMember(name);
+  if (it == object.MemberEnd() || !it->value.IsString())
+    return "";
+  return it->value.GetString();
+}
+
+// Returns params.textDocument.uri of |message|, or "".
+std::string GetDocumentUri(const rapidjson::Value& message) {
+  auto params = message.FindMember("params");
+  if (params == message.MemberEnd() || !params->value.IsObject())
+    return "";
+  auto document = params->value.FindMember("textDocument");
+  if (document == params->value.MemberEnd())
+    return "";
+  return GetString(document->value, "uri");
+}
+
+// |id| and |value| are JSON.
+std::string MakeResponse(const std::string& id,
+                         const char* key,
+                         const std::string& value) {
+  return "{\"jsonrpc\":\"2.0\",\"id\":" + id + ",\"" + key + "\":" + value +
+         "}";
+}
+
+// Replaces the id |server_id| of the response |body| with |client_id|, which
+// is JSON, without parsing |body| again. The id is written before the result,
+// so the first "id" key is the one of the response. Returns false if |body|
+// does not look like that.
+bool ReplaceResponseId(std::string* body,
+                       int64_t server_id,
+                       const std::string& client_id) {
+  const std::string key = "\"id\":";
+  std::string needle = key + std::to_string(server_id);
+  size_t start = body->find(key);
+  if (start == std::string::npos || body->compare(start, needle.size(),
+                                                  needle) != 0)
+    return false;
+  size_t end = start + needle.size();
+  if (end < body->size() && isdigit(static_cast<unsigned char>((*body)[end])))
+    return false;
+  body->replace(start + key.size(), end - start - key.size(), client_id);
+  return true;
+}
+
+struct DaemonClient {
+  int id = 0;
+  std::unique_ptr<PlatformConnection> connection;
+  // Set once the client got the result of initialize. Notifications are only
+  // sent to initialized clients.
+  bool initialized = false;
+  std::unordered_set<std::string> open_documents;
+
+  // Queues |body| for WriteMain, so that a client which does not read its
+  // messages does not hold up the others.
+  void Send(std::string body) {
+    {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      if (stop_)
+        return;
+      writes_.push_back(std::move(body));
+    }
+    write_ready_.notify_one();
+  }
+
+  // Shuts the connection down once the queued messages are written.
+  void ShutdownAfterWrites() {
+    {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      shutdown_ = true;
+    }
+    write_ready_.notify_one();
+  }
+
+  // Drops the queued messages and lets WriteMain return.
+  void StopWriting() {
+    {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      stop_ = true;
+      writes_.clear();
+    }
+    write_ready_.notify_one();
+  }
+
+  // Writes the queued messages to |connection| in order. Runs on a thread of
+  // its own for each client.
+  void WriteMain() {
+    while (true) {
+      std::string body;
+      {
+        std::unique_lock<std::mutex> lock(write_mutex_);
+        write_ready_.wait(lock, [this]() {
+          return stop_ || shutdown_ || !writes_.empty();
+        });
+        if (stop_)
+          return;
+        if (writes_.empty()) {
+          connection->Shutdown();
+          return;
+        }
+        body = std::move(writes_.front());
+        writes_.pop_front();
+      }
+      // The reader of the client then sees the connection close.
+      if (!WriteMessage(connection.get(), body)) {
+        connection->Shutdown();
+        return;
+      }
+    }
+  }
+
+ private:
+  std::mutex write_mutex_;
+  std::condition_variable write_ready_;
+  std::deque<std::string> writes_;
+  bool shutdown_ = false;
+  bool stop_ = false;
+};
+
+// Connects the clients of the daemon to the language server of this process.
+// Everything which touches the state of the clients or queues a message holds
+// |mutex_|, so messages keep their order. Messages to clients are written by
+// their writer threads without holding |mutex_|; see DaemonClient::Send.
+class DaemonMultiplexer {
+ public:
+  DaemonMultiplexer(std::unique_ptr<PlatformListener> listener,
+                    std::unique_ptr<PlatformConnection> server_stdin,
+                    std::unique_ptr<PlatformConnection> server_stdout,
+                    int idle_timeout_seconds)
+      : listener_(std::move(listener)),
+        server_stdin_(std::move(server_stdin)),
+        server_stdout_(std::move(server_stdout)),
+        idle_timeout_seconds_(idle_timeout_seconds) {}
+
+  void Start() {
+    WorkThread::StartThread("daemon", [this]() { AcceptMain(); });
+    WorkThread::StartThread("daemon_output", [this]() { ServerOutputMain(); });
+    // Also stop if the client which started the daemon never connects.
+    std::lock_guard<std::mutex> lock(mutex_);
+    ScheduleIdleShutdown();
+  }
+
+ private:
+  struct PendingRequest {
+    // 0 for requests of the multiplexer itself.
+    int client = 0;
+    // JSON id the client used.
+    std::string client_id;
+    bool is_initialize = false;
+  };
+
+  void AcceptMain() {
+    while (std::unique_ptr<PlatformConnection> connection =
+               listener_->Accept()) {
+      auto client = std::make_shared<DaemonClient>();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // The server is going away; the client starts a new daemon.
+        if (shutting_down_)
+          continue;
+        client->id = next_client_id_++;
+        client->connection = std::move(connection);
+        clients_[client->id] = client;
+        idle_generation_++;
+        LOG_S(INFO) << "Daemon client " << client->id << " connected";
+      }
+      WorkThread::StartThread("daemon_client",
+                              [this, client]() { ClientMain(client); });
+      WorkThread::StartThread("daemon_client_writer",
+                              [client]() { client->WriteMain(); });
+    }
+    LOG_S(ERROR) << "Daemon stopped accepting clients";
+  }
+
+  void ClientMain(std::shared_ptr<DaemonClient> client) {
+    FILE* input = client->connection->GetReadStream();
+    while (optional<std::string> content = ReadJsonRpcContentFrom(input))
+      OnClientMessage(client.get(), *content);
+    OnClientClosed(client.get());
+  }
+
+  void OnClientMessage(DaemonClient* client, const std::string& content) {
+    rapidjson::Document message;
+    message.Parse(content.c_str());
+    if (message.HasParseError() || !message.IsObject()) {
+      LOG_S(WARNING) << "Ignoring malformed message of daemon client "
+                     << client->id;
+      return;
+    }
+    std::string method = GetString(message, "method");
+    auto id = message.FindMember("id");
+    bool has_id = id != message.MemberEnd() && !id->value.IsNull();
+    std::string client_id = has_id ? ToJson(id->value) : "";
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A response; the server does not send requests.
+    if (method.empty())
+      return;
+
+    bool is_initialize = false;
+    if (method == "initialize") {
+      if (initialize_sent_) {
+        if (initialize_result_)
+          ReplyInitialize(client, client_id);
+        else
+          waiting_for_initialize_.emplace_back(client->id, client_id);
+        return;
+      }
+      initialize_sent_ = true;
+      is_initialize = true;
+    } else if (method == "initialized") {
+      if (initialized_sent_)
+        return;
+      initialized_sent_ = true;
+    } else if (method == "shutdown") {
+      // The server is shut down once no client used it for a while.
+      client->Send(MakeResponse(client_id, "result", "null"));
+      return;
+    } else if (method == "exit") {
+      client->ShutdownAfterWrites();
+      return;
+    } else if (method == "textDocument/didOpen") {
+      std::string uri = GetDocumentUri(message);
+      if (client->open_documents.insert(uri).second)
+        open_counts_[uri]++;
+    } else if (method == "textDocument/didClose") {
+      std::string uri = GetDocumentUri(message);
+      if (!client->open_documents.erase(uri) || --open_counts_[uri] > 0)
+        return;
+      open_counts_.erase(uri);
+    } else if (method == "$/cancelRequest") {
+      auto params = message.FindMember("params");
+      if (params == message.MemberEnd() || !params->value.IsObject())
+        return;
+      auto cancel_id = params->value.FindMember("id");
+      if (cancel_id == params->value.MemberEnd())
+        return;
+      auto it = server_ids_.find(
+          std::make_pair(client->id, ToJson(cancel_id->value)));
+      if (it == server_ids_.end())
+        return;
+      cancel_id->value.SetInt64(it->second);
+      SendToServer(ToJson(message));
+      return;
+    }
+
+    if (!has_id) {
+      SendToServer(content);
+      return;
+    }
+    int64_t server_id = next_server_id_++;
+    PendingRequest& request = pending_[server_id];
+    request.client = client->id;
+    request.client_id = client_id;
+    request.is_initialize = is_initialize;
+    server_ids_[std::make_pair(client->id, client_id)] = server_id;
+    id->value.SetInt64(server_id);
+    SendToServer(ToJson(message));
+  }
+
+  void OnClientClosed(DaemonClient* client) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LOG_S(INFO) << "Daemon client " << client->id << " disconnected";
+    for (const std::string& uri : client->open_documents) {
+      if (--open_counts_[uri] > 0)
+        continue;
+      open_counts_.erase(uri);
+      rapidjson::StringBuffer output;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+      writer.StartObject();
+      writer.Key("jsonrpc");
+      writer.String("2.0");
+      writer.Key("method");
+      writer.String("textDocument/didClose");
+      writer.Key("params");
+      writer.StartObject();
+      writer.Key("textDocument");
+      writer.StartObject();
+      writer.Key("uri");
+      writer.String(uri.c_str(), rapidjson::SizeType(uri.size()));
+      writer.EndObject();
+      writer.EndObject();
+      writer.EndObject();
+      SendToServer(std::string(output.GetString(), output.GetSize()));
+    }
+    // Nobody waits for the answers anymore.
+    for (const auto& entry : pending_) {
+      if (entry.second.client == client->id) {
+        SendToServer(
+            "{\"jsonrpc\":\"2.0\",\"method\":\"$/cancelRequest\","
+            "\"params\":{\"id\":" +
+            std::to_string(entry.first) + "}}");
+      }
+    }
+    waiting_for_initialize_.erase(
+        std::remove_if(waiting_for_initialize_.begin(),
+                       waiting_for_initialize_.end(),
+                       [&](const std::pair<int, std::string>& waiting) {
+                         return waiting.first == client->id;
+                       }),
+        waiting_for_initialize_.end());
+    client->StopWriting();
+    clients_.erase(client->id);
+    if (clients_.empty())
+      ScheduleIdleShutdown();
+  }
+
+  void ServerOutputMain() {
+    FILE* input = server_stdout_->GetReadStream();
+    while (optional<std::string> content = ReadJsonRpcContentFrom(input)) {
+      rapidjson::Document message;
+      message.Parse(content->c_str());
+      if (message.HasParseError() || !message.IsObject())
+        continue;
+      auto id = message.FindMember("id");
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (id == message.MemberEnd() || message.HasMember("method")) {
+        for (auto& entry : clients_) {
+          if (entry.second->initialized)
+            entry.second->Send(*content);
+        }
+        continue;
+      }
+      if (!id->value.IsInt64())
+        continue;
+      int64_t server_id = id->value.GetInt64();
+      auto it = pending_.find(server_id);
+      if (it == pending_.end())
+        continue;
+      PendingRequest request = it->second;
+      pending_.erase(it);
+      server_ids_.erase(std::make_pair(request.client, request.client_id));
+
+      if (request.client == 0) {
+        // The idle shutdown finished.
+        SendToServer("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+        continue;
+      }
+      if (request.is_initialize)
+        OnInitializeResponse(message);
+      auto client = clients_.find(request.client);
+      if (client == clients_.end())
+        continue;
+
+      std::string body = *content;
+      if (!ReplaceResponseId(&body, server_id, request.client_id)) {
+        rapidjson::Document client_id;
+        client_id.Parse(request.client_id.c_str());
+        id->value.CopyFrom(client_id, message.GetAllocator());
+        body = ToJson(message);
+      }
+      if (request.is_initialize)
+        client->second->initialized = true;
+      client->second->Send(std::move(body));
+    }
+    LOG_S(INFO) << "Language server of the daemon closed stdout";
+  }
+
+  void OnInitializeResponse(const rapidjson::Document& message) {
+    auto result = message.FindMember("result");
+    if (result != message.MemberEnd()) {
+      initialize_result_ = ToJson(result->value);
+    } else {
+      // Let the next client try again.
+      initialize_sent_ = false;
+    }
+    auto error = message.FindMember("error");
+    for (const std::pair<int, std::string>& waiting :
+         waiting_for_initialize_) {
+      auto client = clients_.find(waiting.first);
+      if (client == clients_.end())
+        continue;
+      if (initialize_result_) {
+        ReplyInitialize(client->second.get(), waiting.second);
+      } else if (error != message.MemberEnd()) {
+        client->second->Send(
+            MakeResponse(waiting.second, "error", ToJson(error->value)));
+      }
+    }
+    waiting_for_initialize_.clear();
+  }
+
+  void ReplyInitialize(DaemonClient* client, const std::string& client_id) {
+    client->Send(MakeResponse(client_id, "result", *initialize_result_));
+    client->initialized = true;
+  }
+
+  void SendToServer(const std::string& body) {
+    WriteMessage(server_stdin_.get(), body);
+  }
+
+  // Shuts the server down unless a client connects within
+  // |idle_timeout_seconds_|. Called with |mutex_| held.
+  void ScheduleIdleShutdown() {
+    uint64_t generation = ++idle_generation_;
+    WorkThread::StartThread("daemon_idle", [this, generation]() {
+      std::this_thread::sleep_for(std::chrono::seconds(idle_timeout_seconds_));
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!clients_.empty() || generation != idle_generation_ ||
+          shutting_down_)
+        return;
+      LOG_S(INFO) << "Shutting down the daemon after "
+                  << idle_timeout_seconds_ << "s without clients";
+      shutting_down_ = true;
+      if (!initialize_sent_) {
+        SendToServer("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+        return;
+      }
+      // shutdown saves the querydb snapshot; exit follows its response.
+      int64_t server_id = next_server_id_++;
+      pending_[server_id] = PendingRequest();
+      SendToServer("{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(server_id) +
+                   ",\"method\":\"shutdown\"}");
+    });
+  }
+
+  std::unique_ptr<PlatformListener> listener_;
+  std::unique_ptr<PlatformConnection> server_stdin_;
+  std::unique_ptr<PlatformConnection> server_stdout_;
+  const int idle_timeout_seconds_;
+
+  std::mutex mutex_;
+  std::unordered_map<int, std::shared_ptr<DaemonClient>> clients_;
+  int next_client_id_ = 1;
+  // Requests sent to the server by their server id, and the server id of
+  // each (client, client id) for $/cancelRequest.
+  std::unordered_map<int64_t, PendingRequest> pending_;
+  std::map<std::pair<int, std::string>, int64_t> server_ids_;
+  int64_t next_server_id_ = 1;
+  bool initialize_sent_ = false;
+  bool initialized_sent_ = false;
+  // Result of the first initialize request as JSON, which later clients get
+  // as is.
+  optional<std::string> initialize_result_;
+  // Clients which sent initialize while the first one was pending, with the
+  // id of their request.
+  std::vector<std::pair<int, std::string>> waiting_for_initialize_;
+  // Number of clients which have each document open.
+  std::unordered_map<std::string, int> open_counts_;
+  // Changes whenever a client connects or the last one disconnects, so that
+  // an idle shutdown can tell whether it is stale.
+  uint64_t idle_generation_ = 0;
+  bool shutting_down_ = false;
+};
+
+// Returns the project root of the initialize request |content|.
+std::string GetProjectRoot(const std::string& content) {
+  rapidjson::Document message;
+  message.Parse(content.c_str());
+  if (!message.HasParseError() && message.IsObject()) {
+    auto params = message.FindMember("params");
+    if (params != message.MemberEnd()) {
+      lsDocumentUri root_uri;
+      root_uri.raw_uri = GetString(params->value, "rootUri");
+      if (!root_uri.raw_uri.empty())
+        return NormalizePath(root_uri.GetPath());
+      std::string root_path = GetString(params->value, "rootPath");
+      if (!root_path.empty())
+        return NormalizePath(root_path);
+    }
+  }
+  return GetWorkingDirectory();
+}
+
+// Connects to the daemon listening on |socket_path|, and starts it with
+// |server_args| if there is none.
+std::unique_ptr<PlatformConnection> ConnectToDaemon(
+    const std::string& socket_path,
+    const std::vector<std::string>& server_args) {
+  std::unique_ptr<PlatformConnection> connection =
+      ConnectToLocalSocket(socket_path);
+  if (connection || !StartDetachedProcess(server_args))
+    return connection;
+  for (int i = 0; i < 100 && !connection; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    connection = ConnectToLocalSocket(socket_path);
+  }
+  return connection;
+}
+
+// Hashes |root| with 64-bit FNV-1a. Unlike std::hash, the result does not
+// depend on the standard library cquery was built with, so every client of a
+// project finds the same daemon.
+uint64_t HashProjectRoot(const std::string& root) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : root) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void WriteToStdout(const std::string& body) {
+  std::string message;
+  AppendOutMessage(body.data(), body.size(), &message);
+  fwrite(message.data(), 1, message.size(), stdout);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int RunDaemonClient(int argc, char** argv) {
+  optional<std::string> initialize = ReadJsonRpcContentFrom(stdin);
+  if (!initialize)
+    return 1;
+  std::string directory = GetLocalSocketDirectory();
+  if (directory.empty()) {
+    LOG_S(ERROR) << "Daemon mode is not supported on this platform";
+    return 1;
+  }
+  std::string root = GetProjectRoot(*initialize);
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx",
+           static_cast<unsigned long long>(HashProjectRoot(root)));
+  std::string socket_path = directory + "cquery-" + hash + ".sock";
+
+  std::vector<std::string> server_args = {GetExecutablePath(),
+                                          "--daemon-server=" + socket_path};
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) != "--daemon")
+      server_args.push_back(argv[i]);
+  }
+
+  // A daemon which is shutting down closes new connections right away; the
+  // next attempt then starts a new one.
+  std::unique_ptr<PlatformConnection> connection;
+  optional<std::string> response;
+  for (int attempt = 0; attempt < 3 && !response; attempt++) {
+    connection = ConnectToDaemon(socket_path, server_args);
+    if (connection && WriteMessage(connection.get(), *initialize))
+      response = ReadJsonRpcContentFrom(connection->GetReadStream());
+  }
+  if (!response) {
+    LOG_S(ERROR) << "Cannot connect to the daemon at " << socket_path;
+    return 1;
+  }
+  LOG_S(INFO) << "Connected to the daemon of " << root << " at "
+              << socket_path;
+  WriteToStdout(*response);
+
+  PlatformConnection* daemon = connection.get();
+  WorkThread::StartThread("stdin", [daemon]() {
+    while (optional<std::string> content = ReadJsonRpcContentFrom(stdin)) {
+      if (!WriteMessage(daemon, *content))
+        break;
+    }
+    // The editor is gone.
+    daemon->Shutdown();
+  });
+  while (optional<std::string> content =
+             ReadJsonRpcContentFrom(connection->GetReadStream()))
+    WriteToStdout(*content);
+  return 0;
+}
+
+bool StartDaemonServer(const std::string& socket_path,
+                       int idle_timeout_seconds) {
+  std::unique_ptr<PlatformListener> listener =
+      ListenOnLocalSocket(socket_path);
+  if (!listener) {
+    LOG_S(INFO) << "Another daemon is listening on " << socket_path;
+    return false;
+  }
+  std::unique_ptr<PlatformConnection> server_stdin, server_stdout;
+  if (!RedirectStandardStreams(&server_stdin, &server_stdout)) {
+    LOG_S(ERROR) << "Cannot redirect stdin and stdout of the daemon";
+    return false;
+  }
+  LOG_S(INFO) << "Daemon listening on " << socket_path;
+  // Lives as long as the process.
+  auto* multiplexer =
+      new DaemonMultiplexer(std::move(listener), std::move(server_stdin),
+                            std::move(server_stdout), idle_timeout_seconds);
+  multiplexer->Start();
+  return true;
+}
+
+TEST_SUITE("Daemon") {
+  TEST_CASE("replace response id") {
+    std::string body = "{\"jsonrpc\":\"2.0\",\"id\":12,\"result\":{\"id\":1}}";
+    REQUIRE(ReplaceResponseId(&body, 12, "\"a\""));
+    REQUIRE(body == "{\"jsonrpc\":\"2.0\",\"id\":\"a\",\"result\":{\"id\":1}}");
+
+    body = "{\"jsonrpc\":\"2.0\",\"id\":123,\"result\":null}";
+    REQUIRE(!ReplaceResponseId(&body, 12, "1"));
+    body = "{\"jsonrpc\":\"2.0\",\"result\":{\"id\":12}}";
+    REQUIRE(!ReplaceResponseId(&body, 1, "1"));
+  }
+
+  TEST_CASE("project root hash") {
+    REQUIRE(HashProjectRoot("") == 0xcbf29ce484222325ULL);
+    REQUIRE(HashProjectRoot("a") == 0xaf63dc4c8601ec8cULL);
+  }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+// Daemon mode shares one language server, and so one QueryDatabase, indexer
+// pool and completion manager, between all the editors working on a project.
+//
+// An editor starts cquery with --daemon as usual. It reads the initialize
+// request, connects to the daemon of the project root over a local socket,
+// starting the daemon if nobody is listening yet, and then relays the
+// messages of the editor. The daemon is a regular language server whose
+// stdin and stdout are connected to a multiplexer: it hands out request ids
+// of its own and routes each response back to the client which sent the
+// request, and sends notifications to every client. Clients after the first
+// get the answer of the first initialize request right away, and shutdown
+// and exit only disconnect the client. An open document stays open until
+// every client which opened it closed it or disconnected.
+
+// Runs as a client of the daemon of the project in the initialize request on
+// stdin, with the command line options of this process. Returns the exit
+// code of the process.
+int RunDaemonClient(int argc, char** argv);
+
+// Starts the multiplexer for the clients of |socket_path| and replaces stdin
+// and stdout of this process with it; the caller then runs the language
+// server. The server is shut down once it had no clients for
+// |idle_timeout_seconds|. Returns false if another daemon is listening on
+// |socket_path|.
+bool StartDaemonServer(const std::string& socket_path,
+                       int idle_timeout_seconds);
@@ -0,0 +1,240 @@
+#include "diagnostics_publisher.h"
+
+#include "config.h"
+#include "queue_manager.h"
+#include "timer.h"
+#include "work_thread.h"
+#include "working_files.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace {
+
+long long GetCurrentTimeInMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             Timer::Clock::now().time_since_epoch())
+      .count();
+}
+
+void SendDiagnostics(const std::string& path,
+                     const std::vector<lsDiagnostic>& diagnostics) {
+  Out_TextDocumentPublishDiagnostics out;
+  out.params.uri = lsDocumentUri::FromPath(path);
+  out.params.diagnostics = diagnostics;
+  QueueManager::WriteStdoutNotification(IpcId::TextDocumentPublishDiagnostics,
+                                        out.params.uri.raw_uri, true, out);
+}
+
+// Identifies diagnostics which both sources report.
+std::string GetDiagnosticKey(const lsDiagnostic& diagnostic) {
+  const lsRange& range = diagnostic.range;
+  return std::to_string(range.start.line) + ':' +
+         std::to_string(range.start.character) + '-' +
+         std::to_string(range.end.line) + ':' +
+         std::to_string(range.end.character) + ' ' + diagnostic.message;
+}
+
+}  // namespace
+
+void DiagnosticsPublisher::Init(Config* config) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (config_)
+      return;
+    config_ = config;
+  }
+  WorkThread::StartThread("diagnostics", [this]() { PublishPendingMain(); });
+}
+
+void DiagnosticsPublisher::Publish(WorkingFiles* working_files,
+                                   const std::string& path,
+                                   DiagnosticsSource source,
+                                   std::vector<lsDiagnostic> diagnostics) {
+  std::vector<lsDiagnostic> merged;
+  bool send = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int interval_ms = GetIntervalMs();
+    File& file = files_[path];
+    if (source == DiagnosticsSource::Completion) {
+      // Code completion parses the current buffer, so it replaces what the
+      // indexer reported for the file on disk.
+      file.completion = std::move(diagnostics);
+      file.indexer.clear();
+    } else {
+      file.indexer = std::move(diagnostics);
+    }
+    merged = Merge(file.completion, file.indexer);
+
+    long long now = GetCurrentTimeInMilliseconds();
+    if (IsSame(merged, file.published)) {
+      pending_.erase(path);
+    } else if (now - file.published_at_ms >= interval_ms) {
+      file.published = merged;
+      file.published_at_ms = now;
+      pending_.erase(path);
+      send = true;
+    } else if (pending_.insert(path).second) {
+      pending_changed_.notify_one();
+    }
+
+    if (file.completion.empty() && file.indexer.empty() &&
+        file.published.empty() && !pending_.count(path)) {
+      files_.erase(path);
+    }
+  }
+  if (send)
+    SendDiagnostics(path, merged);
+
+  // Cache diagnostics so we can show fixits.
+  working_files->DoActionOnFile(path, [&](WorkingFile* working_file) {
+    if (working_file)
+      working_file->diagnostics_ = std::move(merged);
+  });
+}
+
+void DiagnosticsPublisher::Clear(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_.erase(path);
+    pending_.erase(path);
+  }
+  SendDiagnostics(path, {});
+}
+
+// static
+std::vector<lsDiagnostic> DiagnosticsPublisher::Merge(
+    const std::vector<lsDiagnostic>& completion,
+    const std::vector<lsDiagnostic>& indexer) {
+  std::vector<lsDiagnostic> result = completion;
+  if (indexer.empty())
+    return result;
+  std::unordered_set<std::string> seen;
+  for (const lsDiagnostic& diagnostic : completion)
+    seen.insert(GetDiagnosticKey(diagnostic));
+  for (const lsDiagnostic& diagnostic : indexer) {
+    if (seen.insert(GetDiagnosticKey(diagnostic)).second)
+      result.push_back(diagnostic);
+  }
+  return result;
+}
+
+// static
+bool DiagnosticsPublisher::IsSame(const std::vector<lsDiagnostic>& a,
+                                  const std::vector<lsDiagnostic>& b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(),
+                    [](const lsDiagnostic& x, const lsDiagnostic& y) {
+                      return x.range == y.range && x.severity == y.severity &&
+                             x.code == y.code && x.source == y.source &&
+                             x.message == y.message;
+                    });
+}
+
+void DiagnosticsPublisher::PublishPendingMain() {
+  while (true) {
+    std::vector<std::pair<std::string, std::vector<lsDiagnostic>>> due;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      int interval_ms = GetIntervalMs();
+      long long now = GetCurrentTimeInMilliseconds();
+      long long next = -1;
+      for (auto it = pending_.begin(); it != pending_.end();) {
+        File& file = files_[*it];
+        long long at = file.published_at_ms + interval_ms;
+        if (at > now) {
+          next = next < 0 ? at : std::min(next, at);
+          ++it;
+          continue;
+        }
+        file.published = Merge(file.completion, file.indexer);
+        file.published_at_ms = now;
+        due.emplace_back(*it, file.published);
+        it = pending_.erase(it);
+      }
+      if (due.empty()) {
+        if (next < 0)
+          pending_changed_.wait(lock);
+        else
+          pending_changed_.wait_for(lock,
+                                    std::chrono::milliseconds(next - now));
+        continue;
+      }
+    }
+    for (const auto& entry : due)
+      SendDiagnostics(entry.first, entry.second);
+  }
+}
+
+int DiagnosticsPublisher::GetIntervalMs() {
+  return config_ ? config_->diagnosticsPublishIntervalMs : 0;
+}
+
+TEST_SUITE("DiagnosticsPublisher") {
+  TEST_CASE("merge") {
+    lsDiagnostic a;
+    a.range = lsRange(lsPosition(1, 0), lsPosition(1, 5));
+    a.message = "a";
+    lsDiagnostic b = a;
+    b.message = "b";
+
+    // Diagnostics reported by both sources are kept once.
+    std::vector<lsDiagnostic> merged =
+        DiagnosticsPublisher::Merge({a}, {b, a});
+    REQUIRE(merged.size() == 2);
+    REQUIRE(merged[0].message == "a");
+    REQUIRE(merged[1].message == "b");
+
+    REQUIRE(DiagnosticsPublisher::IsSame(merged, {a, b}));
+    REQUIRE(!DiagnosticsPublisher::IsSame(merged, {b, a}));
+    b.severity = lsDiagnosticSeverity::Error;
+    REQUIRE(!DiagnosticsPublisher::IsSame(merged, {a, b}));
+  }
+
+  TEST_CASE("held back updates are sent") {
+    static MultiQueueWaiter querydb_waiter;
+    static MultiQueueWaiter indexer_waiter;
+    static MultiQueueWaiter stdout_waiter;
+    QueueManager::CreateInstance(&querydb_waiter, &indexer_waiter,
+                                 &stdout_waiter);
+    QueueManager* queue = QueueManager::instance();
+    static Config config;
+    config.diagnosticsPublishIntervalMs = 50;
+    // Never destroyed, since its thread keeps running.
+    DiagnosticsPublisher* publisher = new DiagnosticsPublisher();
+    publisher->Init(&config);
+    WorkingFiles working_files;
+
+    auto publish = [&](const std::string& message) {
+      lsDiagnostic diagnostic;
+      diagnostic.message = message;
+      publisher->Publish(&working_files, "/a.cc", DiagnosticsSource::Indexer,
+                         {diagnostic});
+    };
+    auto wait_for = [&](const std::string& message) -> bool {
+      Timer timer;
+      while (timer.ElapsedMicroseconds() < 5 * 1000 * 1000) {
+        for (const Stdout_Request& request : queue->for_stdout.DequeueAll()) {
+          if (request.content.find("\"" + message + "\"") !=
+              std::string::npos)
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      return false;
+    };
+
+    // The first update is sent right away, the second one within the same
+    // interval once it passed. The thread keeps doing so afterwards.
+    publish("a");
+    publish("b");
+    REQUIRE(wait_for("b"));
+    publish("c");
+    publish("d");
+    REQUIRE(wait_for("d"));
+  }
+}
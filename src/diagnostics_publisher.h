@@ -0,0 +1,71 @@
+#pragma once
+
+#include "language_server_api.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct Config;
+struct WorkingFiles;
+
+enum class DiagnosticsSource { Indexer, Completion };
+
+// Sends textDocument/publishDiagnostics. The indexer and code completion both
+// report diagnostics of a file, which are merged. An update which does not
+// change what the client shows is not sent, and each file is published at most
+// once per |Config::diagnosticsPublishIntervalMs|; updates in between are
+// combined and sent once the interval passed. Clients slow down a lot on files
+// with many errors which are republished on every edit.
+class DiagnosticsPublisher {
+ public:
+  // Starts the thread which sends the updates held back by the interval.
+  void Init(Config* config);
+
+  // Updates the diagnostics of |path| reported by |source|, and caches the
+  // merged diagnostics in the working file of |path| for their fixits.
+  void Publish(WorkingFiles* working_files,
+               const std::string& path,
+               DiagnosticsSource source,
+               std::vector<lsDiagnostic> diagnostics);
+  // Forgets the diagnostics of |path| and clears them in the client, ie, once
+  // it is closed.
+  void Clear(const std::string& path);
+
+  // Returns the diagnostics of code completion followed by those of the
+  // indexer which code completion did not report as well.
+  static std::vector<lsDiagnostic> Merge(
+      const std::vector<lsDiagnostic>& completion,
+      const std::vector<lsDiagnostic>& indexer);
+  // Returns true if the client shows |a| and |b| the same way.
+  static bool IsSame(const std::vector<lsDiagnostic>& a,
+                     const std::vector<lsDiagnostic>& b);
+
+ private:
+  struct File {
+    std::vector<lsDiagnostic> completion;
+    std::vector<lsDiagnostic> indexer;
+    // What the client shows.
+    std::vector<lsDiagnostic> published;
+    long long published_at_ms = 0;
+  };
+
+  // Sends the held back updates which are due, or waits until one is.
+  void PublishPendingMain();
+  // Called with |mutex_| held.
+  int GetIntervalMs();
+
+  // Read when publishing, since the config is only known once the client
+  // initialized cquery.
+  Config* config_ = nullptr;
+
+  std::mutex mutex_;
+  std::condition_variable pending_changed_;
+  // Guarded by |mutex_|. Files without any diagnostics are not kept.
+  std::unordered_map<std::string, File> files_;
+  // Files of |files_| with changes held back by the interval.
+  std::unordered_set<std::string> pending_;
+};
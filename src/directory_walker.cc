@@ -0,0 +1,297 @@
+#include "directory_walker.h"
+
+#include "platform.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+bool MatchGlobAt(const std::string& glob,
+                 size_t g,
+                 const std::string& path,
+                 size_t p) {
+  while (g < glob.size()) {
+    char c = glob[g];
+    if (c == '*') {
+      bool double_star = g + 1 < glob.size() && glob[g + 1] == '*' &&
+                         (g == 0 || glob[g - 1] == '/');
+      // A trailing "**" matches everything, "**/" any number of directories.
+      if (double_star && g + 2 == glob.size())
+        return true;
+      if (double_star && glob[g + 2] == '/') {
+        for (size_t q = p;; ++q) {
+          if (MatchGlobAt(glob, g + 3, path, q))
+            return true;
+          q = path.find('/', q);
+          if (q == std::string::npos)
+            return false;
+        }
+      }
+      while (g < glob.size() && glob[g] == '*')
+        ++g;
+      for (size_t q = p;; ++q) {
+        if (MatchGlobAt(glob, g, path, q))
+          return true;
+        if (q == path.size() || path[q] == '/')
+          return false;
+      }
+    }
+
+    if (p == path.size())
+      return false;
+    if (c == '?') {
+      if (path[p] == '/')
+        return false;
+      ++g;
+      ++p;
+      continue;
+    }
+    if (c == '[') {
+      size_t start = g + 1;
+      bool negated =
+          start < glob.size() && (glob[start] == '!' || glob[start] == '^');
+      if (negated)
+        ++start;
+      // A ']' right after the '[' is part of the set.
+      size_t end = glob.find(']', start + 1);
+      if (end != std::string::npos) {
+        bool found = false;
+        for (size_t i = start; i < end; ++i) {
+          if (i + 2 < end && glob[i + 1] == '-') {
+            found = found || (path[p] >= glob[i] && path[p] <= glob[i + 2]);
+            i += 2;
+          } else {
+            found = found || glob[i] == path[p];
+          }
+        }
+        if (found == negated || path[p] == '/')
+          return false;
+        g = end + 1;
+        ++p;
+        continue;
+      }
+      // Without a closing ']' the '[' is matched literally.
+    }
+    if (c == '\\' && g + 1 < glob.size())
+      c = glob[++g];
+    if (c != path[p])
+      return false;
+    ++g;
+    ++p;
+  }
+  return p == path.size();
+}
+
+struct PendingDirectory {
+  // Absolute path and path relative to the walk root, both ending in a slash
+  // unless the relative path is empty.
+  std::string path;
+  std::string relative_path;
+  std::shared_ptr<const IgnoreRules> rules;
+};
+
+// Reads the ignore files in |entries| of |directory|. Returns the rules of
+// |directory|, which are |directory.rules| if it adds none.
+std::shared_ptr<const IgnoreRules> ReadIgnoreRules(
+    const PendingDirectory& directory,
+    const std::vector<DirectoryEntry>& entries) {
+  std::shared_ptr<IgnoreRules> rules;
+  for (const DirectoryEntry& entry : entries) {
+    if (entry.is_dir ||
+        (entry.name != ".gitignore" && entry.name != ".cqueryignore")) {
+      continue;
+    }
+    if (!rules) {
+      rules = std::make_shared<IgnoreRules>(directory.rules,
+                                            directory.relative_path);
+    }
+    for (const std::string& line :
+         ReadLinesWithEnding(directory.path + entry.name)) {
+      rules->AddPattern(line);
+    }
+  }
+  if (!rules || rules->empty())
+    return directory.rules;
+  return rules;
+}
+
+}  // namespace
+
+IgnoreRules::IgnoreRules(std::shared_ptr<const IgnoreRules> parent,
+                         std::string dir)
+    : parent_(std::move(parent)), dir_(std::move(dir)) {}
+
+void IgnoreRules::AddPattern(std::string line) {
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r' ||
+                           line.back() == ' ' || line.back() == '\t')) {
+    line.pop_back();
+  }
+  if (line.empty() || line[0] == '#')
+    return;
+
+  Pattern pattern;
+  if (line[0] == '!') {
+    pattern.negated = true;
+    line.erase(0, 1);
+  }
+  if (!line.empty() && line.back() == '/') {
+    pattern.dir_only = true;
+    line.pop_back();
+  }
+  if (line.empty())
+    return;
+  // A pattern with a slash is relative to the directory of the ignore file,
+  // other patterns match a name at any depth.
+  if (line[0] == '/')
+    pattern.glob = line.substr(1);
+  else if (line.find('/') != std::string::npos)
+    pattern.glob = line;
+  else
+    pattern.glob = "**/" + line;
+  patterns_.push_back(std::move(pattern));
+}
+
+bool IgnoreRules::IsIgnored(const std::string& path, bool is_dir) const {
+  bool ignored = false;
+  Match(path, is_dir, &ignored);
+  return ignored;
+}
+
+void IgnoreRules::Match(const std::string& path,
+                        bool is_dir,
+                        bool* ignored) const {
+  // Rules of inner directories take precedence, so apply them last.
+  if (parent_)
+    parent_->Match(path, is_dir, ignored);
+  if (!StartsWith(path, dir_))
+    return;
+  std::string relative_path = path.substr(dir_.size());
+  for (const Pattern& pattern : patterns_) {
+    if ((!pattern.dir_only || is_dir) &&
+        MatchIgnoreGlob(pattern.glob, relative_path)) {
+      *ignored = !pattern.negated;
+    }
+  }
+}
+
+bool MatchIgnoreGlob(const std::string& glob, const std::string& path) {
+  return MatchGlobAt(glob, 0, path, 0);
+}
+
+void WalkProjectDirectory(
+    std::string root,
+    int num_threads,
+    const std::function<void(const std::string&)>& handler) {
+  EnsureEndsInSlash(root);
+
+  // Directories waiting to be listed, and the number of directories being
+  // listed, which may add more. Protected by |mutex|, which also serializes
+  // the calls to |handler|.
+  std::vector<PendingDirectory> pending;
+  int active = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  PendingDirectory root_directory;
+  root_directory.path = root;
+  pending.push_back(std::move(root_directory));
+
+  auto walk = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<DirectoryEntry> entries;
+    std::vector<std::string> files;
+    std::vector<PendingDirectory> subdirectories;
+    while (true) {
+      while (pending.empty() && active > 0)
+        cv.wait(lock);
+      if (pending.empty())
+        break;
+      PendingDirectory directory = std::move(pending.back());
+      pending.pop_back();
+      ++active;
+      lock.unlock();
+
+      entries.clear();
+      files.clear();
+      subdirectories.clear();
+      if (!ListDirectory(directory.path, &entries))
+        LOG_S(WARNING) << "Unable to read directory " << directory.path;
+      std::shared_ptr<const IgnoreRules> rules =
+          ReadIgnoreRules(directory, entries);
+      for (const DirectoryEntry& entry : entries) {
+        if (!IsIndexedDirectoryEntry(entry.name))
+          continue;
+        std::string relative_path = directory.relative_path + entry.name;
+        if (rules && rules->IsIgnored(relative_path, entry.is_dir))
+          continue;
+        if (entry.is_dir) {
+          PendingDirectory subdirectory;
+          subdirectory.path = directory.path + entry.name + "/";
+          subdirectory.relative_path = relative_path + "/";
+          subdirectory.rules = rules;
+          subdirectories.push_back(std::move(subdirectory));
+        } else {
+          files.push_back(directory.path + entry.name);
+        }
+      }
+
+      lock.lock();
+      --active;
+      for (PendingDirectory& subdirectory : subdirectories)
+        pending.push_back(std::move(subdirectory));
+      for (const std::string& file : files)
+        handler(file);
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i)
+    threads.emplace_back(walk);
+  walk();
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+TEST_SUITE("DirectoryWalker") {
+  TEST_CASE("glob") {
+    REQUIRE(MatchIgnoreGlob("*.o", "a.o"));
+    REQUIRE(!MatchIgnoreGlob("*.o", "dir/a.o"));
+    REQUIRE(MatchIgnoreGlob("**/*.o", "a.o"));
+    REQUIRE(MatchIgnoreGlob("**/*.o", "dir/sub/a.o"));
+    REQUIRE(MatchIgnoreGlob("a/**/b", "a/b"));
+    REQUIRE(MatchIgnoreGlob("a/**/b", "a/x/y/b"));
+    REQUIRE(!MatchIgnoreGlob("a/**/b", "a/x/yb"));
+    REQUIRE(MatchIgnoreGlob("out/**", "out/x/y"));
+    REQUIRE(MatchIgnoreGlob("file?.[ch]", "file1.h"));
+    REQUIRE(!MatchIgnoreGlob("file?.[ch]", "file1.cc"));
+    REQUIRE(MatchIgnoreGlob("[!a-c]x", "dx"));
+    REQUIRE(!MatchIgnoreGlob("[!a-c]x", "bx"));
+  }
+
+  TEST_CASE("rules") {
+    auto root = std::make_shared<IgnoreRules>(nullptr, "");
+    root->AddPattern("node_modules/\n");
+    root->AddPattern("# comment");
+    root->AddPattern("/build");
+    root->AddPattern("*.gen.cc");
+    REQUIRE(root->IsIgnored("node_modules", true));
+    REQUIRE(root->IsIgnored("web/node_modules", true));
+    REQUIRE(!root->IsIgnored("node_modules", false));
+    REQUIRE(root->IsIgnored("build", true));
+    REQUIRE(!root->IsIgnored("src/build", true));
+    REQUIRE(root->IsIgnored("src/a.gen.cc", false));
+
+    IgnoreRules src(root, "src/");
+    src.AddPattern("!keep.gen.cc");
+    REQUIRE(src.IsIgnored("src/a.gen.cc", false));
+    REQUIRE(!src.IsIgnored("src/keep.gen.cc", false));
+    REQUIRE(!src.IsIgnored("src/b.cc", false));
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Patterns read from the .gitignore or .cqueryignore files of one directory.
+// Supports the usual subset of the gitignore syntax: comments, negation with
+// '!', '/' to anchor a pattern to the directory, a trailing '/' for
+// directories only, and the '*', '?', '[...]' and '**' wildcards.
+class IgnoreRules {
+ public:
+  // |parent| holds the rules of the enclosing directories, if any. |dir| is
+  // the directory of the rules relative to the walk root, ending in a slash
+  // unless it is the root itself.
+  IgnoreRules(std::shared_ptr<const IgnoreRules> parent, std::string dir);
+
+  void AddPattern(std::string line);
+  bool empty() const { return patterns_.empty(); }
+
+  // Returns true if |path|, relative to the walk root, is ignored by these
+  // rules or by the rules of an enclosing directory.
+  bool IsIgnored(const std::string& path, bool is_dir) const;
+
+ private:
+  struct Pattern {
+    std::string glob;
+    bool negated = false;
+    bool dir_only = false;
+  };
+
+  // Sets |*ignored| according to the last pattern matching |path|.
+  void Match(const std::string& path, bool is_dir, bool* ignored) const;
+
+  std::shared_ptr<const IgnoreRules> parent_;
+  std::string dir_;
+  std::vector<Pattern> patterns_;
+};
+
+// Returns true if |path| matches the gitignore style |glob|. '*' and '?' do
+// not match a slash, "**/" matches any number of directories and a trailing
+// "/**" everything inside a directory.
+bool MatchIgnoreGlob(const std::string& glob, const std::string& path);
+
+// Lists the files under |root| with |num_threads| threads, skipping what the
+// .gitignore and .cqueryignore files of the traversed directories ignore as
+// well as the entries IsIndexedDirectoryEntry rejects. |handler| is called
+// with the absolute path of each file, one call at a time but in no
+// particular order.
+void WalkProjectDirectory(
+    std::string root,
+    int num_threads,
+    const std::function<void(const std::string&)>& handler);
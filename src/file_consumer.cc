@@ -9,16 +9,29 @@
 
 namespace {
 
-optional<std::string> GetFileContents(const std::string& path,
-                                      FileContentsMap* file_contents) {
+// Returns the contents of |file| and records them in |file_contents|. The
+// contents are taken from |tu|, which has already loaded the file for the
+// parse, and only read from disk if clang does not have them.
+const std::string* GetFileContents(CXTranslationUnit tu,
+                                   CXFile file,
+                                   const std::string& path,
+                                   FileContentsMap* file_contents) {
   auto it = file_contents->find(path);
-  if (it == file_contents->end()) {
-    optional<std::string> content = ReadContent(path);
-    if (content)
-      (*file_contents)[path] = FileContents(path, *content);
-    return content;
-  }
-  return it->second.content;
+  if (it != file_contents->end())
+    return &it->second.content;
+
+  size_t size = 0;
+  const char* buffer = tu ? clang_getFileContents(tu, file, &size) : nullptr;
+  optional<std::string> content;
+  if (buffer)
+    content = std::string(buffer, size);
+  else
+    content = ReadContent(path);
+  if (!content)
+    return nullptr;
+  it = file_contents->emplace(path, FileContents(path, std::move(*content)))
+           .first;
+  return &it->second.content;
 }
 
 }  // namespace
@@ -29,22 +42,23 @@ bool operator==(const CXFileUniqueID& a, const CXFileUniqueID& b) {
 }
 
 bool FileConsumerSharedState::Mark(const std::string& file) {
-  std::lock_guard<std::mutex> lock(mutex);
-  return used_files.insert(file).second;
+  return used_files.Insert(file);
 }
 
 void FileConsumerSharedState::Reset(const std::string& file) {
-  std::lock_guard<std::mutex> lock(mutex);
-  auto it = used_files.find(file);
-  if (it != used_files.end())
-    used_files.erase(it);
+  used_files.Erase(file);
+}
+
+bool FileConsumerSharedState::IsUsed(const std::string& file) const {
+  return used_files.Contains(file);
 }
 
 FileConsumer::FileConsumer(FileConsumerSharedState* shared_state,
                            const std::string& parse_file)
     : shared_(shared_state), parse_file_(parse_file) {}
 
-IndexFile* FileConsumer::TryConsumeFile(CXFile file,
+IndexFile* FileConsumer::TryConsumeFile(CXTranslationUnit tu,
+                                        CXFile file,
                                         bool* is_first_ownership,
                                         FileContentsMap* file_contents_map) {
   assert(is_first_ownership);
@@ -75,7 +89,8 @@ IndexFile* FileConsumer::TryConsumeFile(CXFile file,
   }
 
   // Read the file contents, if we fail then we cannot index the file.
-  optional<std::string> contents = GetFileContents(file_name, file_contents_map);
+  const std::string* contents =
+      GetFileContents(tu, file, file_name, file_contents_map);
   if (!contents) {
     *is_first_ownership = false;
     return nullptr;
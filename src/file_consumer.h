@@ -1,6 +1,7 @@
 #pragma once
 
 #include "file_contents.h"
+#include "striped_hash.h"
 #include "utils.h"
 
 #include <clang-c/Index.h>
@@ -17,13 +18,14 @@ MAKE_HASHABLE(CXFileUniqueID, t.data[0], t.data[1], t.data[2]);
 bool operator==(const CXFileUniqueID& a, const CXFileUniqueID& b);
 
 struct FileConsumerSharedState {
-  mutable std::unordered_set<std::string> used_files;
-  mutable std::mutex mutex;
+  StripedHashSet<std::string> used_files{"file_consumer.used_files"};
 
   // Mark the file as used. Returns true if the file was not previously used.
   bool Mark(const std::string& file);
   // Reset the used state (ie, mark the file as unused).
   void Reset(const std::string& file);
+  // Returns true if the file is used.
+  bool IsUsed(const std::string& file) const;
 };
 
 // FileConsumer is used by the indexer. When it encouters a file, it tries to
@@ -45,8 +47,10 @@ struct FileConsumer {
   // is set to false.
   //
   // note: file_contents is passed as a parameter instead of as a member
-  // variable since it is large and we do not want to copy it.
-  IndexFile* TryConsumeFile(CXFile file,
+  // variable since it is large and we do not want to copy it. Contents which
+  // are not in it yet are taken from |tu|, which has loaded |file| already.
+  IndexFile* TryConsumeFile(CXTranslationUnit tu,
+                            CXFile file,
                             bool* is_first_ownership,
                             FileContentsMap* file_contents);
 
@@ -1,12 +1,14 @@
 #include "file_contents.h"
 
+#include <utility>
+
 FileContents::FileContents() : line_offsets_{0} {}
 
-FileContents::FileContents(const std::string& path, const std::string& content)
-    : path(path), content(content) {
+FileContents::FileContents(const std::string& path, std::string content)
+    : path(path), content(std::move(content)) {
   line_offsets_.push_back(0);
-  for (size_t i = 0; i < content.size(); i++) {
-    if (content[i] == '\n')
+  for (size_t i = 0; i < this->content.size(); i++) {
+    if (this->content[i] == '\n')
       line_offsets_.push_back(i + 1);
   }
 }
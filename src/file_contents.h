@@ -9,7 +9,7 @@
 
 struct FileContents {
   FileContents();
-  FileContents(const std::string& path, const std::string& content);
+  FileContents(const std::string& path, std::string content);
 
   optional<int> ToOffset(Position p) const;
   optional<std::string> ContentsInRange(Range range) const;
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hash map from USR hashes to small values, such as ids. Entries are stored
+// inline in one array and found by linear probing, so a lookup touches one or
+// two cache lines and an insert never allocates unless the table grows.
+// Entries cannot be erased.
+template <typename TValue>
+class FlatUsrMap {
+ public:
+  // Returns the value of |key|, or nullptr. The pointer is valid until the
+  // next insert.
+  const TValue* Find(uint64_t key) const {
+    if (slots_.empty())
+      return nullptr;
+    for (size_t i = GetSlot(key);; i = (i + 1) & (slots_.size() - 1)) {
+      const Slot& slot = slots_[i];
+      if (!slot.occupied)
+        return nullptr;
+      if (slot.key == key)
+        return &slot.value;
+    }
+  }
+
+  // Sets the value of |key|, inserting it if needed.
+  void Set(uint64_t key, const TValue& value) {
+    // Grow at 75% load, so that probe sequences stay short.
+    if ((size_ + 1) * 4 > slots_.size() * 3)
+      Rehash(slots_.empty() ? 16 : slots_.size() * 2);
+    Slot& slot = FindSlot(key);
+    if (!slot.occupied) {
+      slot.occupied = true;
+      slot.key = key;
+      size_++;
+    }
+    slot.value = value;
+  }
+
+  // Makes room for |count| entries without rehashing.
+  void reserve(size_t count) {
+    size_t capacity = 16;
+    while (count * 4 > capacity * 3)
+      capacity *= 2;
+    if (capacity > slots_.size())
+      Rehash(capacity);
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // Heap memory used by the table.
+  size_t HeapBytes() const { return slots_.capacity() * sizeof(Slot); }
+
+ private:
+  struct Slot {
+    uint64_t key = 0;
+    TValue value = TValue();
+    bool occupied = false;
+  };
+
+  size_t GetSlot(uint64_t key) const {
+    // Mix the key so that the slot does not only depend on its low bits.
+    return size_t((key * 0x9E3779B97F4A7C15ull) >> 32) & (slots_.size() - 1);
+  }
+
+  // Returns the slot of |key|, or the empty slot where it belongs.
+  Slot& FindSlot(uint64_t key) {
+    for (size_t i = GetSlot(key);; i = (i + 1) & (slots_.size() - 1)) {
+      Slot& slot = slots_[i];
+      if (!slot.occupied || slot.key == key)
+        return slot;
+    }
+  }
+
+  void Rehash(size_t capacity) {
+    std::vector<Slot> old(capacity);
+    old.swap(slots_);
+    for (const Slot& slot : old) {
+      if (slot.occupied) {
+        Slot& new_slot = FindSlot(slot.key);
+        new_slot = slot;
+      }
+    }
+  }
+
+  // Size is zero or a power of two.
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string_view.h>
+
+#include <vector>
+
+// Scores how well |pattern| matches |str| by aligning the characters of
+// |pattern| with a subsequence of |str|; higher is better. Returns a large
+// negative value if |pattern| is not a subsequence of |str|, ignoring case.
+//
+// |score| and |dp| are scratch buffers of at least |str.size()| elements,
+// which callers reuse across candidates to avoid allocating.
+int FuzzyEvaluate(std::string_view pattern,
+                  std::string_view str,
+                  std::vector<int>& score,
+                  std::vector<int>& dp);
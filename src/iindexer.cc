@@ -1,8 +1,55 @@
 #include "iindexer.h"
 
+#include "clang_translation_unit.h"
+#include "index_worker.h"
 #include "indexer.h"
+#include "lru_cache.h"
+#include "platform.h"
+#include "preamble_cache.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <loguru.hpp>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
 
 namespace {
+// Translation units kept by ClangIndexer::IndexWithReparse. They are shared
+// by the indexers since the next request for a file may be taken by any of
+// them, so each has its own ClangIndex instead of the one of the indexer
+// which created it.
+struct ReparseEntry {
+  std::vector<std::string> args;
+  // Declared before |tu| so that it is destroyed after it.
+  std::unique_ptr<ClangIndex> index;
+  std::unique_ptr<ClangTranslationUnit> tu;
+};
+
+std::mutex reparse_cache_mutex;
+LruCache<std::string, ReparseEntry>* reparse_cache = nullptr;
+
+// Takes the translation unit of |file| out of the cache, so that only the
+// calling indexer uses it until it is put back.
+std::shared_ptr<ReparseEntry> TakeReparseEntry(const std::string& file) {
+  std::lock_guard<std::mutex> lock(reparse_cache_mutex);
+  if (!reparse_cache)
+    return nullptr;
+  return reparse_cache->TryTake(file);
+}
+
+void PutReparseEntry(Config* config,
+                     const std::string& file,
+                     const std::shared_ptr<ReparseEntry>& entry) {
+  std::lock_guard<std::mutex> lock(reparse_cache_mutex);
+  if (!reparse_cache) {
+    reparse_cache = new LruCache<std::string, ReparseEntry>(
+        config->indexerReparseCacheSize);
+  }
+  reparse_cache->Insert(file, entry);
+}
+
 struct ClangIndexer : IIndexer {
   ~ClangIndexer() override = default;
 
@@ -12,6 +59,7 @@ struct ClangIndexer : IIndexer {
       std::string file,
       const std::vector<std::string>& args,
       const std::vector<FileContents>& file_contents,
+      bool is_interactive,
       PerformanceImportFile* perf) override {
     bool dump_ast = false;
     for (const std::string& pattern : config->dumpAST)
@@ -19,12 +67,278 @@ struct ClangIndexer : IIndexer {
         dump_ast = true;
         break;
       }
+
+    if (is_interactive && config->indexerReparseCacheSize > 0 &&
+        config->enableIndexing && !dump_ast) {
+      return IndexWithReparse(config, file_consumer_shared, file, args,
+                              file_contents, perf);
+    }
+    if (config->indexerPreambleCacheSize > 0 &&
+        !config->cacheDirectory.empty()) {
+      auto result = IndexWithPreamble(config, file_consumer_shared, file, args,
+                                      file_contents, perf, dump_ast);
+      if (result)
+        return result;
+    }
     return Parse(config, file_consumer_shared, file, args, file_contents, perf,
-                 &index, dump_ast);
+                 &index, dump_ast, &ns);
+  }
+
+  // Parses |file| by reparsing the translation unit kept from the last time
+  // it was indexed with |args|, if any, and keeps the translation unit for
+  // the next time. The translation unit has a precompiled preamble, so a
+  // reparse only parses the code after the leading includes again.
+  optional<std::vector<std::unique_ptr<IndexFile>>> IndexWithReparse(
+      Config* config,
+      FileConsumerSharedState* file_consumer_shared,
+      std::string file,
+      const std::vector<std::string>& args,
+      const std::vector<FileContents>& file_contents,
+      PerformanceImportFile* perf) {
+    file = NormalizePath(file);
+    Timer timer;
+
+    std::vector<CXUnsavedFile> unsaved_files;
+    for (const FileContents& contents : file_contents) {
+      CXUnsavedFile unsaved;
+      unsaved.Filename = contents.path.c_str();
+      unsaved.Contents = contents.content.c_str();
+      unsaved.Length = (unsigned long)contents.content.size();
+      unsaved_files.push_back(unsaved);
+    }
+
+    std::shared_ptr<ReparseEntry> entry = TakeReparseEntry(file);
+    if (entry && entry->args == args) {
+      entry->tu =
+          ClangTranslationUnit::Reparse(std::move(entry->tu), unsaved_files);
+      if (!entry->tu)
+        entry = nullptr;
+    } else {
+      entry = nullptr;
+    }
+    if (!entry) {
+      entry = std::make_shared<ReparseEntry>();
+      entry->args = args;
+      entry->index = MakeUnique<ClangIndex>();
+      unsigned flags = CXTranslationUnit_KeepGoing |
+                       CXTranslationUnit_DetailedPreprocessingRecord |
+                       CXTranslationUnit_PrecompiledPreamble;
+#if !defined(_WIN32)
+      // See the completion flags in clang_complete.cc.
+      flags |= CXTranslationUnit_CreatePreambleOnFirstParse;
+#endif
+      entry->tu = ClangTranslationUnit::Create(entry->index.get(), file, args,
+                                               unsaved_files, flags);
+      if (!entry->tu)
+        return nullopt;
+    }
+    perf->index_parse = timer.ElapsedMicrosecondsAndReset();
+
+    auto result =
+        ParseWithTu(config, file_consumer_shared, perf, entry->tu.get(),
+                    entry->index.get(), file, args, unsaved_files, &ns);
+    if (result)
+      PutReparseEntry(config, file, entry);
+    return result;
+  }
+
+  // Parses |file| with a precompiled preamble if there is a usable one.
+  optional<std::vector<std::unique_ptr<IndexFile>>> IndexWithPreamble(
+      Config* config,
+      FileConsumerSharedState* file_consumer_shared,
+      const std::string& file,
+      const std::vector<std::string>& args,
+      const std::vector<FileContents>& file_contents,
+      PerformanceImportFile* perf,
+      bool dump_ast) {
+    if (!preambles_) {
+      preambles_ = MakeUnique<PreambleCache>(
+          config->cacheDirectory + "@preambles/",
+          config->indexerPreambleCacheSize);
+    }
+
+    optional<std::string> contents;
+    for (const FileContents& file_content : file_contents) {
+      if (file_content.path == file)
+        contents = file_content.content;
+    }
+    if (!contents)
+      contents = ReadContent(file);
+    if (!contents)
+      return nullopt;
+
+    std::shared_ptr<PreambleCache::Preamble> preamble =
+        preambles_->Get(&index, file_consumer_shared, file, *contents, args);
+    if (!preamble)
+      return nullopt;
+
+    std::vector<std::string> preamble_args = args;
+    preamble_args.push_back("-include-pch");
+    preamble_args.push_back(preamble->pch_path);
+    // clang rejects a precompiled header if files in it are overridden. They
+    // are unchanged on disk, see PreambleCache::Get.
+    std::unordered_set<std::string> preamble_files(preamble->files.begin(),
+                                                   preamble->files.end());
+    std::vector<FileContents> preamble_file_contents;
+    for (const FileContents& file_content : file_contents) {
+      if (!preamble_files.count(file_content.path))
+        preamble_file_contents.push_back(file_content);
+    }
+
+    auto result = Parse(config, file_consumer_shared, file, preamble_args,
+                        preamble_file_contents, perf, &index, dump_ast, &ns);
+    if (!result) {
+      LOG_S(WARNING) << "Parsing " << file << " with a preamble failed";
+      preambles_->Drop(*contents, args);
+      return nullopt;
+    }
+
+    perf->index_preamble_saved = preamble->parse_time;
+    for (std::unique_ptr<IndexFile>& index_file : *result) {
+      // The index must not depend on the precompiled header.
+      index_file->args = args;
+      // Includes in the preamble are not reported while indexing.
+      std::unordered_set<std::string> dependencies(
+          index_file->dependencies.begin(), index_file->dependencies.end());
+      for (const std::string& preamble_file : preamble->files) {
+        if (preamble_file != index_file->path &&
+            dependencies.insert(preamble_file).second) {
+          index_file->dependencies.push_back(preamble_file);
+        }
+      }
+    }
+    return result;
   }
 
   // Note: constructing this acquires a global lock
   ClangIndex index;
+  // Qualified names of containers, shared by the translation units this
+  // indexer parses.
+  NamespaceHelper ns;
+  std::unique_ptr<PreambleCache> preambles_;
+};
+
+// Sends translation units to an index worker process, which runs a
+// ClangIndexer. The worker may run on another machine, as it only talks to
+// cquery over its stdin and stdout. It does not see which files other
+// indexers take while it parses, so headers are deduplicated when its results
+// arrive.
+struct ProcessIndexer : IIndexer {
+  ProcessIndexer() {
+    static std::atomic<int> num_indexers{0};
+    index_ = num_indexers++;
+  }
+  ~ProcessIndexer() override = default;
+
+  optional<std::vector<std::unique_ptr<IndexFile>>> Index(
+      Config* config,
+      FileConsumerSharedState* file_consumer_shared,
+      std::string file,
+      const std::vector<std::string>& args,
+      const std::vector<FileContents>& file_contents,
+      bool is_interactive,
+      PerformanceImportFile* perf) override {
+    if (!worker_ && !fallback_)
+      StartWorker(config);
+    if (fallback_) {
+      return fallback_->Index(config, file_consumer_shared, file, args,
+                              file_contents, is_interactive, perf);
+    }
+
+    IndexWorkerRequest request;
+    request.path = file;
+    request.args = args;
+    for (const FileContents& file_content : file_contents) {
+      request.file_contents.push_back(
+          {file_content.path, file_content.content});
+    }
+    // Only the changes since the previous request are sent, as the set of
+    // used files grows to every header of the project.
+    std::unordered_set<std::string> used_files;
+    for (std::string& used_file : file_consumer_shared->used_files.Snapshot()) {
+      if (!sent_used_files_.count(used_file))
+        request.used_files_added.push_back(used_file);
+      used_files.insert(std::move(used_file));
+    }
+    for (const std::string& used_file : sent_used_files_) {
+      if (!used_files.count(used_file))
+        request.used_files_removed.push_back(used_file);
+    }
+    sent_used_files_ = std::move(used_files);
+
+    std::string message = SerializeIndexWorkerMessage(request);
+    std::string payload;
+    IndexWorkerResponse response;
+    if (!worker_->Write(message.data(), message.size()) ||
+        !ReadIndexWorkerMessage(worker_.get(), &payload) ||
+        !ParseIndexWorkerMessage(payload, &response)) {
+      LOG_S(ERROR) << "Index worker exited or timed out while indexing "
+                   << file << " (" << command_ << ")";
+      StopWorker();
+      return nullopt;
+    }
+    if (config->index.workerMemoryLimitMb > 0 &&
+        response.memory_mb > config->index.workerMemoryLimitMb) {
+      LOG_S(INFO) << "Restarting index worker using " << response.memory_mb
+                  << "mb";
+      StopWorker();
+    }
+    if (!response.ok)
+      return nullopt;
+
+    *perf = response.perf;
+    std::vector<std::unique_ptr<IndexFile>> result;
+    for (IndexWorkerResult& indexed : response.files) {
+      if (!file_consumer_shared->Mark(indexed.path))
+        continue;
+      std::unique_ptr<IndexFile> index =
+          Deserialize(SerializeFormat::Binary, indexed.path, indexed.index,
+                      indexed.file_contents, nullopt);
+      if (!index) {
+        file_consumer_shared->Reset(indexed.path);
+        continue;
+      }
+      index->diagnostics_ = std::move(indexed.diagnostics);
+      result.push_back(std::move(index));
+    }
+    return std::move(result);
+  }
+
+  void StartWorker(Config* config) {
+    const std::vector<std::vector<std::string>>& commands =
+        config->index.workerCommands;
+    std::vector<std::string> command = {GetExecutablePath(), "--index-worker"};
+    // Spread the indexers over the commands.
+    if (!commands.empty())
+      command = commands[index_ % commands.size()];
+    command_ = StringJoin(command, " ");
+    worker_ = StartProcess(command);
+    std::string message;
+    if (worker_) {
+      if (config->index.workerTimeoutSeconds > 0)
+        worker_->SetReadTimeout(config->index.workerTimeoutSeconds * 1000);
+      message = SerializeIndexWorkerMessage(*config);
+      if (worker_->Write(message.data(), message.size()))
+        return;
+    }
+    LOG_S(WARNING) << "Unable to start an index worker, indexing in-process";
+    worker_.reset();
+    fallback_ = MakeClangIndexer();
+  }
+
+  // Kills the worker; the next request starts a new one.
+  void StopWorker() {
+    worker_.reset();
+    sent_used_files_.clear();
+  }
+
+  int index_;
+  std::string command_;
+  std::unique_ptr<PlatformProcess> worker_;
+  // Used files as of the last request sent to |worker_|.
+  std::unordered_set<std::string> sent_used_files_;
+  // Used instead of workers if they cannot be started.
+  std::unique_ptr<IIndexer> fallback_;
 };
 
 struct TestIndexer : IIndexer {
@@ -56,6 +370,7 @@ struct TestIndexer : IIndexer {
       std::string file,
       const std::vector<std::string>& args,
       const std::vector<FileContents>& file_contents,
+      bool is_interactive,
       PerformanceImportFile* perf) override {
     auto it = indexes.find(file);
     if (it == indexes.end()) {
@@ -85,6 +400,11 @@ std::unique_ptr<IIndexer> IIndexer::MakeClangIndexer() {
   return MakeUnique<ClangIndexer>();
 }
 
+// static
+std::unique_ptr<IIndexer> IIndexer::MakeProcessIndexer() {
+  return MakeUnique<ProcessIndexer>();
+}
+
 // static
 std::unique_ptr<IIndexer> IIndexer::MakeTestIndexer(
     std::initializer_list<TestEntry> entries) {
@@ -30,6 +30,9 @@ struct IIndexer {
   };
 
   static std::unique_ptr<IIndexer> MakeClangIndexer();
+  // Indexes in an index worker process, see Config::Index::workerProcesses
+  // and Config::Index::workerCommands.
+  static std::unique_ptr<IIndexer> MakeProcessIndexer();
   static std::unique_ptr<IIndexer> MakeTestIndexer(
       std::initializer_list<TestEntry> entries);
 
@@ -40,5 +43,6 @@ struct IIndexer {
       std::string file,
       const std::vector<std::string>& args,
       const std::vector<FileContents>& file_contents,
+      bool is_interactive,
       PerformanceImportFile* perf) = 0;
 };
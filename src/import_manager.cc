@@ -1,14 +1,47 @@
 #include "import_manager.h"
 
+#include "queue_manager.h"
+#include "utils.h"
+
+#include <loguru.hpp>
+
+ImportManager::ImportManager() = default;
+ImportManager::~ImportManager() = default;
+
 bool ImportManager::TryMarkDependencyImported(const std::string& path) {
-  std::lock_guard<std::mutex> lock(dependency_mutex_);
-  return dependency_imported_.insert(path).second;
+  return dependency_imported_.Insert(path);
+}
+
+bool ImportManager::StartQueryDbImport(const std::string& path,
+                                       Index_DoIdMap* request) {
+  std::lock_guard<InstrumentedMutex> lock(querydb_pending_mutex_);
+  if (querydb_processing_.Insert(path))
+    return true;
+
+  std::unique_ptr<Index_DoIdMap>& pending = querydb_pending_[path];
+  if (pending)
+    LOG_S(INFO) << "Replacing pending index for " << path;
+  pending = MakeUnique<Index_DoIdMap>(std::move(*request));
+  return false;
+}
+
+std::unique_ptr<Index_DoIdMap> ImportManager::DoneQueryDbImport(
+    const std::string& path) {
+  std::lock_guard<InstrumentedMutex> lock(querydb_pending_mutex_);
+  auto it = querydb_pending_.find(path);
+  if (it == querydb_pending_.end()) {
+    querydb_processing_.Erase(path);
+    return nullptr;
+  }
+  std::unique_ptr<Index_DoIdMap> pending = std::move(it->second);
+  querydb_pending_.erase(it);
+  return pending;
 }
 
-bool ImportManager::StartQueryDbImport(const std::string& path) {
-  return querydb_processing_.insert(path).second;
+void ImportManager::MarkLoadedFromSnapshot(const std::string& path) {
+  loaded_from_snapshot_.Insert(path);
 }
 
-void ImportManager::DoneQueryDbImport(const std::string& path) {
-  querydb_processing_.erase(path);
+bool ImportManager::TakeLoadedFromSnapshot(const std::string& path) {
+  return loaded_from_snapshot_.Erase(path);
 }
@@ -1,29 +1,57 @@
 #pragma once
 
+#include "instrumented_mutex.h"
+#include "striped_hash.h"
+
+#include <memory>
 #include <mutex>
 #include <string>
-#include <unordered_set>
+#include <unordered_map>
+
+struct Index_DoIdMap;
 
 // Manages files inside of the indexing pipeline so we don't have the same file
 // being imported multiple times.
-//
-// NOTE: This is not thread safe and should only be used on the querydb thread.
 struct ImportManager {
+  ImportManager();
+  ~ImportManager();
+
   // Try to mark the given dependency as imported. A dependency can only ever be
   // imported once.
   bool TryMarkDependencyImported(const std::string& path);
 
   // Try to import the given file into querydb. We should only ever be
   // importing a file into querydb once per file. Returns true if the file
-  // can be imported.
-  bool StartQueryDbImport(const std::string& path);
+  // can be imported. Otherwise |request| is kept in the pending slot of
+  // |path|, replacing an older request, and is handed back by
+  // DoneQueryDbImport; the request is left alone if this returns true.
+  bool StartQueryDbImport(const std::string& path, Index_DoIdMap* request);
+
+  // The file has been fully imported. Returns the newest request which
+  // arrived in the meantime, which then owns the import of |path|. Otherwise
+  // the file can be imported again later on.
+  std::unique_ptr<Index_DoIdMap> DoneQueryDbImport(const std::string& path);
+
+  // Files which querydb loaded from its snapshot. The first cache hit of such
+  // a file does not need to be imported again. Returns true if |path| was
+  // loaded from the snapshot and not taken before.
+  void MarkLoadedFromSnapshot(const std::string& path);
+  bool TakeLoadedFromSnapshot(const std::string& path);
 
-  // The file has been fully imported and can be imported again later on.
-  void DoneQueryDbImport(const std::string& path);
+  // Imports are started by indexer threads and finished by querydb. Both
+  // sides take |querydb_pending_mutex_| so that a request cannot be parked
+  // after the import it waits for finished.
+  StripedHashSet<std::string> querydb_processing_{
+      "import_manager.querydb_processing"};
+  InstrumentedMutex querydb_pending_mutex_{"import_manager"};
+  std::unordered_map<std::string, std::unique_ptr<Index_DoIdMap>>
+      querydb_pending_;
 
-  std::unordered_set<std::string> querydb_processing_;
+  // Checked by every indexer thread for every dependency, so the set is
+  // striped to keep them from serializing on one lock.
+  StripedHashSet<std::string> dependency_imported_{
+      "import_manager.dependency_imported"};
 
-  // TODO: use std::shared_mutex so we can have multiple readers.
-  std::mutex dependency_mutex_;
-  std::unordered_set<std::string> dependency_imported_;
+  StripedHashSet<std::string> loaded_from_snapshot_{
+      "import_manager.loaded_from_snapshot"};
 };
\ No newline at end of file
@@ -1,40 +1,59 @@
 #include "import_pipeline.h"
 
+#include "async_log.h"
 #include "cache_manager.h"
 #include "config.h"
 #include "iindexer.h"
 #include "import_manager.h"
 #include "language_server_api.h"
+#include "memory_usage.h"
 #include "message_handler.h"
+#include "metrics.h"
 #include "platform.h"
 #include "project.h"
 #include "query_utils.h"
 #include "queue_manager.h"
 #include "timer.h"
 #include "timestamp_manager.h"
+#include "trace.h"
+#include "working_files.h"
 
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace {
 
+// Bound on the messages logged per second by each of the call sites which log
+// for every file, so that bulk indexing does not flood the log.
+const int kMaxFileLogsPerSecond = 20;
+
 struct IModificationTimestampFetcher {
   virtual ~IModificationTimestampFetcher() = default;
   virtual optional<int64_t> GetModificationTime(const std::string& path) = 0;
 };
 struct RealModificationTimestampFetcher : IModificationTimestampFetcher {
+  explicit RealModificationTimestampFetcher(
+      TimestampManager* timestamp_manager)
+      : timestamp_manager_(timestamp_manager) {}
   ~RealModificationTimestampFetcher() override = default;
 
   // IModificationTimestamp:
   optional<int64_t> GetModificationTime(const std::string& path) override {
-    return GetLastModificationTime(path);
+    return timestamp_manager_->GetModificationTime(path);
   }
+
+  TimestampManager* timestamp_manager_;
 };
 struct FakeModificationTimestampFetcher : IModificationTimestampFetcher {
   std::unordered_map<std::string, optional<int64_t>> entries;
@@ -57,6 +76,140 @@ long long GetCurrentTimeInMilliseconds() {
   return elapsed_milliseconds;
 }
 
+// Records the indexer stages of |perf| which ran into their histograms. Saving
+// to disk runs later on the cache writer thread and is recorded there.
+void RecordIndexLatencies(const PerformanceImportFile& perf) {
+  static LatencyHistogram* parse = GetLatencyHistogram("index.parse");
+  static LatencyHistogram* build = GetLatencyHistogram("index.build");
+  static LatencyHistogram* load_cached =
+      GetLatencyHistogram("index.load_cached");
+  static LatencyHistogram* id_map = GetLatencyHistogram("index.id_map");
+  static LatencyHistogram* make_delta =
+      GetLatencyHistogram("index.make_delta");
+  // Share of index.build spent on each feature of Config::Index::profile.
+  static LatencyHistogram* macros = GetLatencyHistogram("index.build.macros");
+  static LatencyHistogram* comments =
+      GetLatencyHistogram("index.build.comments");
+  static LatencyHistogram* locals = GetLatencyHistogram("index.build.locals");
+  static LatencyHistogram* implicit_calls =
+      GetLatencyHistogram("index.build.implicit_calls");
+  static LatencyHistogram* template_usages =
+      GetLatencyHistogram("index.build.template_usages");
+  static LatencyHistogram* initializer_usages =
+      GetLatencyHistogram("index.build.initializer_usages");
+  if (perf.index_parse)
+    parse->Record(perf.index_parse);
+  if (perf.index_build) {
+    build->Record(perf.index_build);
+    macros->Record(perf.index_macros.time);
+    comments->Record(perf.index_comments.time);
+    locals->Record(perf.index_locals.time);
+    implicit_calls->Record(perf.index_implicit_calls.time);
+    template_usages->Record(perf.index_template_usages.time);
+    initializer_usages->Record(perf.index_initializer_usages.time);
+  }
+  if (perf.index_load_cached)
+    load_cached->Record(perf.index_load_cached);
+  id_map->Record(perf.querydb_id_map);
+  make_delta->Record(perf.index_make_delta);
+}
+
+// How often querydb refreshes its memory gauges while importing.
+const long long kMemoryGaugeIntervalMs = 10000;
+
+MemoryGauge* GetOnIndexedMemoryGauge() {
+  static MemoryGauge* gauge = GetMemoryGauge("queue.on_indexed");
+  return gauge;
+}
+
+// Lets CacheWriter_Stop() wait for CacheWriter_Main() to return.
+struct CacheWriterState {
+  std::mutex mutex;
+  std::condition_variable stopped;
+  bool running = false;
+
+  static CacheWriterState* Get() {
+    static CacheWriterState* state = new CacheWriterState();
+    return state;
+  }
+};
+
+// The newest index of each path whose update was built, while the cache does
+// not hold it yet. Indexes handed to the cache writer thread stay until they
+// are written; indexes which are not written, like the ones built from
+// unsaved buffers, stay until a newer index of the path replaces them. When
+// the previous index of a file is needed, the cache then holds an older
+// index or none at all, so it is read from here first.
+class PendingIndexes {
+ public:
+  static PendingIndexes* Get() {
+    static PendingIndexes* pending = new PendingIndexes();
+    return pending;
+  }
+
+  // Makes |file| the newest index of its path, replacing an older one. Only
+  // an index which is |write_to_disk| is handed to the cache writer.
+  void Put(std::unique_ptr<IndexFile> file, bool write_to_disk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::string path = file->path;
+    WaitForWrite(&lock, path);
+    Entry& entry = entries_[path];
+    entry.file = std::move(file);
+    entry.write_to_disk = write_to_disk;
+  }
+
+  // Returns a copy of the pending index of |path|, or null if there is none.
+  // Waits for the cache writer if it is writing the index right now.
+  std::unique_ptr<IndexFile> TryCopy(const std::string& path) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    WaitForWrite(&lock, path);
+    auto it = entries_.find(path);
+    if (it == entries_.end())
+      return nullptr;
+    return MakeUnique<IndexFile>(*it->second.file);
+  }
+
+  // Returns the index of |path| for the cache writer to write, or null if it
+  // was written already or replaced by an index which is not written. The
+  // index is not touched by anyone else until EndWrite is called.
+  IndexFile* BeginWrite(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(path);
+    if (it == entries_.end() || !it->second.write_to_disk)
+      return nullptr;
+    it->second.is_writing = true;
+    return it->second.file.get();
+  }
+
+  // The index returned by BeginWrite is in the cache now.
+  void EndWrite(const std::string& path) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.erase(path);
+    }
+    written_.notify_all();
+  }
+
+ private:
+  struct Entry {
+    std::unique_ptr<IndexFile> file;
+    bool write_to_disk = false;
+    bool is_writing = false;
+  };
+
+  void WaitForWrite(std::unique_lock<std::mutex>* lock,
+                    const std::string& path) {
+    written_.wait(*lock, [&]() {
+      auto it = entries_.find(path);
+      return it == entries_.end() || !it->second.is_writing;
+    });
+  }
+
+  std::mutex mutex_;
+  std::condition_variable written_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
 struct ActiveThread {
   ActiveThread(Config* config, ImportPipelineStatus* status)
       : config_(config), status_(status) {
@@ -83,6 +236,11 @@ struct ActiveThread {
     out.params.onIdMappedCount = queue->on_id_mapped.Size();
     out.params.onIndexedCount = queue->on_indexed.Size();
     out.params.activeThreads = status_->num_active_threads;
+    out.params.parseStalled = status_->parse_stalled;
+    out.params.stallMs = status_->stall_ms;
+    if (out.params.parseStalled)
+      out.params.stallMs +=
+          GetCurrentTimeInMilliseconds() - status_->stall_start;
 
     // Ignore this progress update if the last update was too recent.
     if (config_->progressReportFrequencyMs != 0) {
@@ -99,19 +257,71 @@ struct ActiveThread {
           GetCurrentTimeInMilliseconds() + config_->progressReportFrequencyMs;
     }
 
-    QueueManager::WriteStdout(IpcId::Unknown, out);
+    out.params.memoryUsage = GetMemoryUsage();
+    // Only the latest progress matters to the client.
+    QueueManager::WriteStdoutNotification(IpcId::CqueryProgress,
+                                          std::string(), true, out);
   }
 
   Config* config_;
   ImportPipelineStatus* status_;
 };
 
+// Returns true if indexers should not parse another file because a later
+// stage is backed up or memory is short. Parsing stops when a queue reaches
+// its high watermark and resumes once every queue is below its low watermark,
+// and stops while there is memory pressure, see MemoryGovernor. Memory
+// pressure alone still lets interactive requests, which the user waits on, be
+// parsed; |interactive_only| is then set.
+bool ShouldStallParse(Config* config,
+                      ImportPipelineStatus* status,
+                      bool* interactive_only = nullptr) {
+  auto* queue = QueueManager::instance();
+  bool stalled = status->parse_stalled;
+  auto backed_up = [&](size_t size, int high, int low) {
+    if (high < 1)
+      return false;
+    return size >= size_t(stalled ? std::max(1, std::min(low, high)) : high);
+  };
+  bool queue_stall = backed_up(queue->do_id_map.Size(),
+                               config->indexerDoIdMapHighWatermark,
+                               config->indexerDoIdMapLowWatermark) ||
+                     backed_up(queue->on_indexed.Size(),
+                               config->indexerOnIndexedHighWatermark,
+                               config->indexerOnIndexedLowWatermark);
+  bool stall = queue_stall || (queue->index_request.Size() > 0 &&
+                               status->memory_governor.CheckPressure() !=
+                                   MemoryPressure::None);
+  if (interactive_only)
+    *interactive_only = stall && !queue_stall;
+
+  if (stall != stalled && status->parse_stalled.exchange(stall) != stall) {
+    long long now = GetCurrentTimeInMilliseconds();
+    if (stall) {
+      status->stall_start = now;
+      LOG_S(INFO) << "Pausing parsing, do_id_map="
+                  << queue->do_id_map.Size()
+                  << " on_indexed=" << queue->on_indexed.Size()
+                  << " memory_pressure="
+                  << int(status->memory_governor.pressure());
+    } else {
+      status->stall_ms += now - status->stall_start;
+      LOG_S(INFO) << "Resuming parsing after "
+                  << now - status->stall_start << "ms";
+    }
+  }
+  return stall;
+}
+
 enum class ShouldParse { Yes, No, NoSuchFile };
 
 // Checks if |path| needs to be reparsed. This will modify cached state
 // such that calling this function twice with the same path may return true
 // the first time but will return false the second.
 //
+// |previous_args_fingerprint|: GetArgsFingerprint() of the arguments of the
+// cached index, if any.
+// |args_fingerprint|: GetArgsFingerprint() of the current arguments.
 // |from|: The file which generated the parse request for this file.
 ShouldParse FileNeedsParse(
     bool is_interactive,
@@ -119,9 +329,9 @@ ShouldParse FileNeedsParse(
     IModificationTimestampFetcher* modification_timestamp_fetcher,
     ImportManager* import_manager,
     const std::shared_ptr<ICacheManager>& cache_manager,
-    IndexFile* opt_previous_index,
+    optional<uint64_t> previous_args_fingerprint,
+    uint64_t args_fingerprint,
     const std::string& path,
-    const std::vector<std::string>& args,
     const optional<std::string>& from) {
   auto unwrap_opt = [](const optional<std::string>& opt) -> std::string {
     if (opt)
@@ -146,28 +356,36 @@ ShouldParse FileNeedsParse(
   optional<int64_t> last_cached_modification =
       timestamp_manager->GetLastCachedModificationTime(cache_manager.get(), path);
 
-  // File has been changed.
+  // File has been changed. Checking out a branch or regenerating build files
+  // often updates the timestamp without changing the contents, so compare the
+  // contents before reparsing.
   if (!last_cached_modification ||
       modification_timestamp != *last_cached_modification) {
-    LOG_S(INFO) << "Timestamp has changed for " << path << unwrap_opt(from);
-    return ShouldParse::Yes;
+    optional<uint64_t> last_cached_hash =
+        last_cached_modification
+            ? timestamp_manager->GetLastCachedContentHash(cache_manager.get(),
+                                                          path)
+            : nullopt;
+    optional<std::string> content =
+        last_cached_hash ? ReadContent(path) : nullopt;
+    if (!content || HashStorageKey(*content) != *last_cached_hash) {
+      LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+          << "Timestamp has changed for " << path << unwrap_opt(from);
+      return ShouldParse::Yes;
+    }
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Timestamp has changed but contents have not for " << path
+        << unwrap_opt(from);
+    timestamp_manager->UpdateCachedModificationTime(
+        path, *modification_timestamp, *last_cached_hash);
   }
 
   // Command-line arguments changed.
-  auto is_file = [](const std::string& arg) {
-    return EndsWithAny(arg, {".h", ".c", ".cc", ".cpp", ".hpp", ".m", ".mm"});
-  };
-  if (opt_previous_index) {
-    auto& prev_args = opt_previous_index->args;
-    bool same = prev_args.size() == args.size();
-    for (size_t i = 0; i < args.size() && same; ++i) {
-      same = prev_args[i] == args[i] ||
-             (is_file(prev_args[i]) && is_file(args[i]));
-    }
-    if (!same) {
-      LOG_S(INFO) << "Arguments have changed for " << path << unwrap_opt(from);
-      return ShouldParse::Yes;
-    }
+  if (previous_args_fingerprint &&
+      *previous_args_fingerprint != args_fingerprint) {
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Arguments have changed for " << path << unwrap_opt(from);
+    return ShouldParse::Yes;
   }
 
   // File has not changed, do not parse it.
@@ -186,19 +404,40 @@ CacheLoadResult TryLoadFromCache(
     const std::string& path_to_index) {
   // Always run this block, even if we are interactive, so we can check
   // dependencies and reset files in |file_consumer_shared|.
-  IndexFile* previous_index = cache_manager->TryLoad(path_to_index);
-  if (!previous_index)
-    return CacheLoadResult::Parse;
+  //
+  // The state saved by |timestamp_manager| usually describes the cache of the
+  // translation unit, so the cached index only needs to be loaded to import
+  // it. Otherwise, ie, if the cache was written by another checkout sharing
+  // projectCacheKey, it is loaded now.
+  optional<std::vector<std::string>> dependencies =
+      timestamp_manager->GetDependencies(path_to_index);
+  optional<uint64_t> previous_args_fingerprint =
+      timestamp_manager->GetLastCachedArgsFingerprint(path_to_index);
+  if (!dependencies || !previous_args_fingerprint) {
+    const IndexFile* previous_index = cache_manager->TryLoad(path_to_index);
+    if (!previous_index)
+      return CacheLoadResult::Parse;
+    if (previous_index->import_file == path_to_index) {
+      timestamp_manager->UpdateTranslationUnit(
+          path_to_index, previous_index->dependencies,
+          previous_index->import_file_parse_time);
+    }
+    dependencies = previous_index->dependencies;
+    previous_args_fingerprint = GetArgsFingerprint(previous_index->args);
+  }
 
   // If none of the dependencies have changed and the index is not
   // interactive (ie, requested by a file save), skip parsing and just load
   // from cache.
 
+  // The arguments are the same for every dependency, so only hash them once.
+  uint64_t args_fingerprint = GetArgsFingerprint(entry.args);
+
   // Check timestamps and update |file_consumer_shared|.
   ShouldParse path_state = FileNeedsParse(
       is_interactive, timestamp_manager, modification_timestamp_fetcher,
-      import_manager, cache_manager, previous_index, path_to_index, entry.args,
-      nullopt);
+      import_manager, cache_manager, previous_args_fingerprint,
+      args_fingerprint, path_to_index, nullopt);
   if (path_state == ShouldParse::Yes)
     file_consumer_shared->Reset(path_to_index);
 
@@ -211,13 +450,14 @@ CacheLoadResult TryLoadFromCache(
 
   bool needs_reparse = is_interactive || path_state == ShouldParse::Yes;
 
-  for (const std::string& dependency : previous_index->dependencies) {
+  for (const std::string& dependency : *dependencies) {
     assert(!dependency.empty());
 
     if (FileNeedsParse(is_interactive, timestamp_manager,
                        modification_timestamp_fetcher, import_manager,
-                       cache_manager, previous_index, dependency, entry.args,
-                       previous_index->path) == ShouldParse::Yes) {
+                       cache_manager, previous_args_fingerprint,
+                       args_fingerprint, dependency,
+                       path_to_index) == ShouldParse::Yes) {
       needs_reparse = true;
 
       // Do not break here, as we need to update |file_consumer_shared| for
@@ -231,24 +471,36 @@ CacheLoadResult TryLoadFromCache(
     return CacheLoadResult::Parse;
 
   // No timestamps changed - load directly from cache.
-  LOG_S(INFO) << "Skipping parse; no timestamp change for " << path_to_index;
+  LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+      << "Skipping parse; no timestamp change for " << path_to_index;
 
   // TODO/FIXME: real perf
   PerformanceImportFile perf;
 
+  // Files which querydb loaded from its snapshot already hold the cached
+  // index, so there is nothing to import.
   std::vector<Index_DoIdMap> result;
-  result.push_back(Index_DoIdMap(cache_manager->TakeOrLoad(path_to_index), cache_manager, perf,
-                                 is_interactive, false /*write_to_disk*/));
-  for (const std::string& dependency : previous_index->dependencies) {
+  if (!import_manager->TakeLoadedFromSnapshot(path_to_index)) {
+    std::unique_ptr<IndexFile> index =
+        cache_manager->TryTakeOrLoad(path_to_index);
+    // The saved state may outlive the cache, ie, if it was deleted by hand.
+    if (!index)
+      return CacheLoadResult::Parse;
+    result.push_back(Index_DoIdMap(std::move(index), cache_manager, perf,
+                                   is_interactive, false /*write_to_disk*/));
+  }
+  for (const std::string& dependency : *dependencies) {
     // Only load a dependency if it is not already loaded.
     //
     // This is important for perf in large projects where there are lots of
     // dependencies shared between many files.
-    if (!file_consumer_shared->Mark(dependency))
+    if (!file_consumer_shared->Mark(dependency) ||
+        import_manager->TakeLoadedFromSnapshot(dependency))
       continue;
 
-    LOG_S(INFO) << "Emitting index result for " << dependency << " (via "
-                << previous_index->path << ")";
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Emitting index result for " << dependency << " (via "
+        << path_to_index << ")";
 
     std::unique_ptr<IndexFile> dependency_index =
         cache_manager->TryTakeOrLoad(dependency);
@@ -266,62 +518,31 @@ CacheLoadResult TryLoadFromCache(
   return CacheLoadResult::DoNotParse;
 }
 
+// Returns the unsaved contents to parse |entry| with, which are only
+// |entry_contents| for the file itself. Every other file is read from disk by
+// clang, and the indexer takes the contents of each file from the translation
+// unit, so they match what was parsed.
+//
+// The buffers of other working files are not passed, even for interactive
+// requests: the indexes of the other files are cached with their modification
+// time on disk, so unsaved edits would be persisted as if they were saved.
 std::vector<FileContents> PreloadFileContents(
-    const std::shared_ptr<ICacheManager>& cache_manager,
     const Project::Entry& entry,
-    const std::string& entry_contents,
-    const std::string& path_to_index) {
-  // Load file contents for all dependencies into memory. If the dependencies
-  // for the file changed we may not end up using all of the files we
-  // preloaded. If a new dependency was added the indexer will grab the file
-  // contents as soon as possible.
-  //
-  // We do this to minimize the race between indexing a file and capturing the
-  // file contents.
-  //
-  // TODO: We might be able to optimize perf by only copying for files in
-  //       working_files. We can pass that same set of files to the indexer as
-  //       well. We then default to a fast file-copy if not in working set.
-
-  // index->file_contents comes from cache, so we need to check if that cache is
-  // still valid. if so, we can use it, otherwise we need to load from disk.
-  auto get_latest_content = [](const std::string& path, int64_t cached_time,
-                               const std::string& cached) -> std::string {
-    optional<int64_t> mod_time = GetLastModificationTime(path);
-    if (!mod_time)
-      return "";
-
-    if (*mod_time == cached_time)
-      return cached;
-
-    optional<std::string> fresh_content = ReadContent(path);
-    if (!fresh_content) {
-      LOG_S(ERROR) << "Failed to load content for " << path;
-      return "";
-    }
-    return *fresh_content;
-  };
-
+    const std::string& entry_contents) {
   std::vector<FileContents> file_contents;
   file_contents.push_back(FileContents(entry.filename, entry_contents));
-  cache_manager->IterateLoadedCaches([&](IndexFile* index) {
-    if (index->path == entry.filename)
-      return;
-    file_contents.push_back(FileContents(
-        index->path,
-        get_latest_content(index->path, index->last_modification_time,
-                           index->file_contents)));
-  });
-
   return file_contents;
 }
 
-void ParseFile(Config* config,
+// Returns false if the file could not be indexed.
+bool ParseFile(Config* config,
                WorkingFiles* working_files,
+               DiagnosticsPublisher* diagnostics_publisher,
                FileConsumerSharedState* file_consumer_shared,
                TimestampManager* timestamp_manager,
                IModificationTimestampFetcher* modification_timestamp_fetcher,
                ImportManager* import_manager,
+               Project* project,
                IIndexer* indexer,
                const Index_Request& request,
                const Project::Entry& entry) {
@@ -329,28 +550,76 @@ void ParseFile(Config* config,
   // directly (ie, a header file, which are not listed in the project). If this
   // file is inferred, then try to use the file which originally imported it.
   std::string path_to_index = entry.filename;
+  Project::Entry index_entry = entry;
   if (entry.is_inferred) {
-    IndexFile* entry_cache = request.cache_manager->TryLoad(entry.filename);
-    if (entry_cache)
+    const IndexFile* entry_cache =
+        request.cache_manager->TryLoad(entry.filename);
+    if (entry_cache) {
       path_to_index = entry_cache->import_file;
+    } else {
+      // The file has not been indexed yet, reindex it through any
+      // translation unit which includes it.
+      std::vector<std::string> importers =
+          timestamp_manager->GetImporters(entry.filename);
+      if (!importers.empty())
+        path_to_index = importers[0];
+    }
+
+    // Only the header and the chosen translation unit are reindexed; see
+    // Config::headerGranularReindex for what stays stale.
+    optional<std::string> cheapest;
+    if (config->headerGranularReindex)
+      cheapest = timestamp_manager->GetCheapestImporter(entry.filename);
+    const IndexFile* importer_cache =
+        cheapest ? request.cache_manager->TryLoad(*cheapest) : nullptr;
+    if (importer_cache) {
+      path_to_index = *cheapest;
+      index_entry.args = importer_cache->args;
+    }
   }
 
   // Try to load the file from cache.
   if (TryLoadFromCache(file_consumer_shared, timestamp_manager,
                        modification_timestamp_fetcher, import_manager,
-                       request.cache_manager, request.is_interactive, entry,
+                       request.cache_manager, request.is_interactive,
+                       index_entry,
                        path_to_index) == CacheLoadResult::DoNotParse) {
-    return;
+    return true;
+  }
+
+  std::string entry_contents;
+  if (request.contents) {
+    entry_contents = *request.contents;
+  } else {
+    optional<std::string> content = ReadContent(entry.filename);
+    if (!content) {
+      LOG_S(ERROR) << "Cannot read file " << entry.filename;
+      return false;
+    }
+    entry_contents = std::move(*content);
+  }
+
+  // The sources a unity build source includes are entries of their own,
+  // which other indexer threads parse in parallel. Parsing the aggregate too
+  // would index each of them twice, in one huge translation unit.
+  if (config->index.skipUnitySources && !entry.is_inferred &&
+      !request.is_interactive &&
+      project->IsUnityBuildSource(entry.filename, entry_contents)) {
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Skipping unity build source " << entry.filename;
+    return true;
   }
 
-  LOG_S(INFO) << "Parsing " << path_to_index;
-  std::vector<FileContents> file_contents = PreloadFileContents(
-    request.cache_manager, entry, request.contents, path_to_index);
+  LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+      << "Parsing " << path_to_index;
+  std::vector<FileContents> file_contents =
+      PreloadFileContents(entry, entry_contents);
 
   std::vector<Index_DoIdMap> result;
   PerformanceImportFile perf;
   auto indexes = indexer->Index(config, file_consumer_shared, path_to_index,
-                                entry.args, file_contents, &perf);
+                                index_entry.args, file_contents,
+                                request.is_interactive, &perf);
 
   if (!indexes) {
     if (config->enableIndexing &&
@@ -361,7 +630,7 @@ void ParseFile(Config* config,
       out.error.message = "Failed to index " + path_to_index;
       QueueManager::WriteStdout(IpcId::Unknown, out);
     }
-    return;
+    return false;
   }
 
   for (std::unique_ptr<IndexFile>& new_index : *indexes) {
@@ -370,18 +639,114 @@ void ParseFile(Config* config,
     // Only emit diagnostics for non-interactive sessions, which makes it easier
     // to identify indexing problems. For interactive sessions, diagnostics are
     // handled by code completion.
-    if (!request.is_interactive)
-      EmitDiagnostics(working_files, new_index->path, new_index->diagnostics_);
+    if (!request.is_interactive) {
+      diagnostics_publisher->Publish(working_files, new_index->path,
+                                     DiagnosticsSource::Indexer,
+                                     new_index->diagnostics_);
+    }
+
+    new_index->import_file_parse_time = perf.index_parse + perf.index_build;
+    // The index of a translation unit reparsed for a changed header is
+    // emitted even if the unit itself did not change: its references into the
+    // header may have.
+    if (new_index->path == path_to_index) {
+      timestamp_manager->UpdateTranslationUnit(
+          path_to_index, new_index->dependencies,
+          new_index->import_file_parse_time);
+    }
 
     // When main thread does IdMap request it will request the previous index if
     // needed.
-    LOG_S(INFO) << "Emitting index result for " << new_index->path;
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Emitting index result for " << new_index->path;
     result.push_back(Index_DoIdMap(std::move(new_index), request.cache_manager, perf,
                                    request.is_interactive,
                                    true /*write_to_disk*/));
   }
 
   QueueManager::instance()->do_id_map.EnqueueAll(std::move(result));
+  return true;
+}
+
+// Starts reading the cache entries of the first Config::cachePrefetchCount
+// queued index requests, and of their dependencies, in the background. By
+// the time an indexer thread takes one of them, checking and loading its
+// cache is served from memory. Each request is only prefetched once.
+void PrefetchQueuedIndexRequests(Config* config,
+                                 TimestampManager* timestamp_manager) {
+  if (config->cachePrefetchCount <= 0)
+    return;
+  std::vector<std::pair<std::shared_ptr<ICacheManager>, std::string>> paths;
+  QueueManager::instance()->index_request.ForEachFront(
+      size_t(config->cachePrefetchCount), [&](Index_Request& request) {
+        if (request.is_prefetched || !request.cache_manager)
+          return;
+        request.is_prefetched = true;
+        paths.emplace_back(request.cache_manager, request.path);
+      });
+
+  // Do not hold the queue lock while talking to the file system.
+  for (const auto& path : paths) {
+    path.first->Prefetch(path.second);
+    optional<std::vector<std::string>> dependencies =
+        timestamp_manager->GetDependencies(path.second);
+    if (!dependencies)
+      continue;
+    for (const std::string& dependency : *dependencies)
+      path.first->Prefetch(dependency);
+  }
+}
+
+// Writes |file| to |cache_manager| and records its modification time in
+// |perf|.
+void WriteIndexToCache(TimestampManager* timestamp_manager,
+                       ICacheManager* cache_manager,
+                       IndexFile& file,
+                       PerformanceImportFile* perf) {
+  ScopedTrace trace("index", "save_to_disk", file.path);
+  Timer time;
+  cache_manager->WriteToCache(file);
+  perf->index_save_to_disk = time.ElapsedMicroseconds();
+  static LatencyHistogram* save_to_disk =
+      GetLatencyHistogram("index.save_to_disk");
+  save_to_disk->Record(perf->index_save_to_disk);
+  timestamp_manager->UpdateCachedModificationTime(
+      file.path, file.last_modification_time, file.file_contents_hash,
+      GetArgsFingerprint(file.args));
+  LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+      << "Wrote cached index for " << file.path << " (index_save_to_disk: "
+      << FormatMicroseconds(perf->index_save_to_disk) << ")";
+}
+
+// Writes the indexes queued in do_id_map to the cache instead of importing
+// them, see ImportPipelineStatus::cache_only. Indexes loaded from the cache
+// since they are up to date are dropped.
+void IndexMain_WriteCacheOnly(TimestampManager* timestamp_manager,
+                              ImportPipelineStatus* status) {
+  auto* queue = QueueManager::instance();
+  while (true) {
+    optional<Index_DoIdMap> request = queue->do_id_map.TryDequeue();
+    if (!request)
+      return;
+    if (!request->write_to_disk)
+      continue;
+    bool is_translation_unit =
+        request->current->path == request->current->import_file;
+    PerformanceImportFile& perf = request->perf;
+    WriteIndexToCache(timestamp_manager, request->cache_manager.get(),
+                      *request->current, &perf);
+
+    std::lock_guard<std::mutex> lock(status->cache_only_mutex);
+    PerformanceImportFile& total = status->cache_only_perf;
+    status->num_written_files++;
+    total.index_save_to_disk += perf.index_save_to_disk;
+    if (is_translation_unit) {
+      status->num_parsed_files++;
+      total.index_parse += perf.index_parse;
+      total.index_preamble_saved += perf.index_preamble_saved;
+      total.index_build += perf.index_build;
+    }
+  }
 }
 
 bool IndexMain_DoParse(
@@ -391,27 +756,124 @@ bool IndexMain_DoParse(
     TimestampManager* timestamp_manager,
     IModificationTimestampFetcher* modification_timestamp_fetcher,
     ImportManager* import_manager,
-    IIndexer* indexer) {
+    ImportPipelineStatus* status,
+    Project* project,
+    IIndexer* indexer,
+    bool interactive_only = false) {
   auto* queue = QueueManager::instance();
-  optional<Index_Request> request = queue->index_request.TryDequeue();
+  optional<Index_Request> request =
+      interactive_only
+          ? queue->index_request.TryDequeueIf(
+                [](const Index_Request& queued) {
+                  return queued.is_interactive;
+                })
+          : queue->index_request.TryDequeue();
   if (!request)
     return false;
+  static LatencyHistogram* queue_time =
+      GetLatencyHistogram("queue.index_request");
+  queue_time->Record(request->queued_time.ElapsedMicroseconds());
+  PrefetchQueuedIndexRequests(config, timestamp_manager);
 
   Project::Entry entry;
   entry.filename = request->path;
   entry.args = request->args;
-  ParseFile(config, working_files, file_consumer_shared, timestamp_manager,
-            modification_timestamp_fetcher, import_manager,
-            indexer, request.value(), entry);
+  entry.is_inferred = request->is_inferred;
+  ScopedTrace trace("index", "parse", request->path);
+  {
+    std::lock_guard<std::mutex> lock(status->parsing_mutex);
+    status->parsing[request->path]++;
+  }
+  bool ok = ParseFile(config, working_files, &status->diagnostics_publisher,
+                      file_consumer_shared, timestamp_manager,
+                      modification_timestamp_fetcher, import_manager, project,
+                      indexer, request.value(), entry);
+  {
+    std::lock_guard<std::mutex> lock(status->parsing_mutex);
+    auto it = status->parsing.find(request->path);
+    if (--it->second == 0)
+      status->parsing.erase(it);
+  }
+
+  // Only the thread which parsed a request and other threads holding a
+  // pending request drain the indexes, so the request is done once every
+  // queued index is written.
+  if (status->cache_only) {
+    if (!ok)
+      status->num_failed_requests++;
+    IndexMain_WriteCacheOnly(timestamp_manager, status);
+    status->num_pending_requests--;
+  }
   return true;
 }
 
-bool IndexMain_DoCreateIndexUpdate(TimestampManager* timestamp_manager) {
+bool IndexMain_DoIdMap(QueryDatabase* db, ImportManager* import_manager) {
+  auto* queue = QueueManager::instance();
+  optional<Index_DoIdMap> request = queue->do_id_map.TryDequeue();
+  if (!request)
+    return false;
+
+  assert(request->current);
+  ScopedTrace trace("index", "id_map", request->current->path);
+
+  // If the request does not have previous state and we have already imported
+  // it, load the previous state from disk and rerun IdMap logic later. Do not
+  // do this if we have already attempted in the past.
+  if (!request->load_previous && !request->previous) {
+    bool imported;
+    {
+      SharedLock lock(db->mutex);
+      imported = db->usr_to_file.find(NormalizedPath(
+                     request->current->path)) != db->usr_to_file.end();
+    }
+    if (imported) {
+      request->load_previous = true;
+      queue->load_previous_index.Enqueue(std::move(*request));
+      return true;
+    }
+  }
+
+  // Check if the file is already being imported into querydb. If it is, park
+  // the request until that import is done; a newer request replaces it, so
+  // stale intermediate updates are never applied.
+  //
+  // Note, we must do this *after* we have checked for the previous index,
+  // otherwise we will never actually generate the IdMap.
+  if (!request->owns_querydb_import &&
+      !import_manager->StartQueryDbImport(request->current->path,
+                                          &*request)) {
+    return true;
+  }
+
+  Index_OnIdMapped response(request->cache_manager, request->perf,
+                            request->is_interactive, request->write_to_disk);
+  Timer time;
+
+  auto make_map = [db](std::unique_ptr<IndexFile> file)
+      -> std::unique_ptr<Index_OnIdMapped::File> {
+    if (!file)
+      return nullptr;
+
+    auto id_map = MakeUnique<IdMap>(db, file->id_cache);
+    return MakeUnique<Index_OnIdMapped::File>(std::move(file),
+                                              std::move(id_map));
+  };
+  response.current = make_map(std::move(request->current));
+  response.previous = make_map(std::move(request->previous));
+  response.perf.querydb_id_map = time.ElapsedMicrosecondsAndReset();
+
+  queue->on_id_mapped.Enqueue(std::move(response));
+  return true;
+}
+
+bool IndexMain_DoCreateIndexUpdate(TimestampManager* timestamp_manager,
+                                   ImportPipelineStatus* status) {
   auto* queue = QueueManager::instance();
   optional<Index_OnIdMapped> response = queue->on_id_mapped.TryDequeue();
   if (!response)
     return false;
 
+  ScopedTrace trace("index", "make_delta", response->current->file->path);
   Timer time;
 
   IdMap* previous_id_map = nullptr;
@@ -426,19 +888,22 @@ bool IndexMain_DoCreateIndexUpdate(TimestampManager* timestamp_manager) {
       IndexUpdate::CreateDelta(previous_id_map, response->current->ids.get(),
                                previous_index, response->current->file.get());
   response->perf.index_make_delta = time.ElapsedMicrosecondsAndReset();
-  LOG_S(INFO) << "Built index update for " << response->current->file->path
-              << " (is_delta=" << !!response->previous << ")";
-
-  // Write current index to disk if requested.
+  LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+      << "Built index update for " << response->current->file->path
+      << " (is_delta=" << !!response->previous << ")";
+
+  // Counted before either queue sees the update, see QueryDbSnapshot.
+  status->snapshot.OnUpdateCreated(response->write_to_disk);
+
+  // Keep current index as the previous index of the next update of the file,
+  // see PendingIndexes. Write it to disk if requested, on the cache writer
+  // thread instead of blocking on serialization and IO here.
+  std::string path = response->current->file->path;
+  PendingIndexes::Get()->Put(std::move(response->current->file),
+                             response->write_to_disk);
   if (response->write_to_disk) {
-    LOG_S(INFO) << "Writing cached index to disk for "
-                << response->current->file->path;
-    time.Reset();
-    response->cache_manager->WriteToCache(*response->current->file);
-    response->perf.index_save_to_disk = time.ElapsedMicrosecondsAndReset();
-    timestamp_manager->UpdateCachedModificationTime(
-        response->current->file->path,
-        response->current->file->last_modification_time);
+    queue->write_cache.Enqueue(
+        Index_OnWriteCache(path, response->cache_manager, response->perf));
   }
 
 #if false
@@ -465,7 +930,10 @@ bool IndexMain_DoCreateIndexUpdate(TimestampManager* timestamp_manager) {
     LOG_S(INFO) << "Applying IndexUpdate" << std::endl << update.ToString();
 #endif
 
+  RecordIndexLatencies(response->perf);
   Index_OnIndexed reply(update, response->perf);
+  reply.memory_bytes = EstimateMemoryUsage(reply.update);
+  GetOnIndexedMemoryGauge()->Add(1, reply.memory_bytes);
   queue->on_indexed.Enqueue(std::move(reply));
 
   return true;
@@ -477,7 +945,14 @@ bool IndexMain_LoadPreviousIndex() {
   if (!response)
     return false;
 
-  response->previous = response->cache_manager->TryTakeOrLoad(response->current->path);
+  // The index which was applied last may not be in the cache (yet), which
+  // then holds an older one.
+  response->previous =
+      PendingIndexes::Get()->TryCopy(response->current->path);
+  if (!response->previous) {
+    response->previous =
+        response->cache_manager->TryTakeOrLoad(response->current->path);
+  }
   LOG_IF_S(ERROR, !response->previous)
       << "Unable to load previous index for already imported index "
       << response->current->path;
@@ -486,6 +961,10 @@ bool IndexMain_LoadPreviousIndex() {
   return true;
 }
 
+// Merged updates are applied by querydb in one step, so keep them small
+// enough to fit its import budget (see Config::querydbImportBudgetMs).
+const size_t kMaxMergedUpdateCost = 50000;
+
 bool IndexMergeIndexUpdates() {
   auto* queue = QueueManager::instance();
   optional<Index_OnIndexed> root = queue->on_indexed.TryDequeue();
@@ -494,6 +973,10 @@ bool IndexMergeIndexUpdates() {
 
   bool did_merge = false;
   while (true) {
+    if (root->update.EstimateApplyCost() >= kMaxMergedUpdateCost) {
+      queue->on_indexed.Enqueue(std::move(*root));
+      return did_merge;
+    }
     optional<Index_OnIndexed> to_join = queue->on_indexed.TryDequeue();
     if (!to_join) {
       queue->on_indexed.Enqueue(std::move(*root));
@@ -503,6 +986,9 @@ bool IndexMergeIndexUpdates() {
     did_merge = true;
     Timer time;
     root->update.Merge(to_join->update);
+    // Merging copies the update, so the estimates roughly add up.
+    root->memory_bytes += to_join->memory_bytes;
+    GetOnIndexedMemoryGauge()->Add(-1, 0);
     // time.ResetAndPrint("Joined querydb updates for files: " +
     // StringJoinMap(root->update.files_def_update,
     //[](const QueryFile::DefUpdate& update) {
@@ -514,7 +1000,17 @@ bool IndexMergeIndexUpdates() {
 }  // namespace
 
 ImportPipelineStatus::ImportPipelineStatus()
-    : num_active_threads(0), next_progress_output(0) {}
+    : num_active_threads(0),
+      next_progress_output(0),
+      parse_stalled(false),
+      stall_start(0),
+      stall_ms(0),
+      next_memory_gauge_update(0),
+      cache_only(false),
+      num_pending_requests(0),
+      num_failed_requests(0),
+      num_written_files(0),
+      num_parsed_files(0) {}
 
 // Index a file using an already-parsed translation unit from code completion.
 // Since most of the time for indexing a file comes from parsing, we can do
@@ -536,18 +1032,21 @@ void IndexWithTuFromCodeCompletion(
   if (!indexes)
     return;
 
+  // The indexes come from unsaved buffers, so they are not written to disk,
+  // where they would be taken for the saved contents. The next update of the
+  // file still finds them as its previous index, see PendingIndexes.
+  std::shared_ptr<ICacheManager> cache_manager = ICacheManager::Make(config);
   std::vector<Index_DoIdMap> result;
   for (std::unique_ptr<IndexFile>& new_index : *indexes) {
     Timer time;
 
-    std::shared_ptr<ICacheManager> cache_manager;
-    assert(false && "FIXME cache_manager");
     // When main thread does IdMap request it will request the previous index if
     // needed.
-    LOG_S(INFO) << "Emitting index result for " << new_index->path;
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Emitting index result for " << new_index->path;
     result.push_back(Index_DoIdMap(std::move(new_index), cache_manager, perf,
                                    true /*is_interactive*/,
-                                   true /*write_to_disk*/));
+                                   false /*write_to_disk*/));
   }
 
   LOG_IF_S(WARNING, result.size() > 1)
@@ -556,7 +1055,76 @@ void IndexWithTuFromCodeCompletion(
   QueueManager::instance()->do_id_map.EnqueueAll(std::move(result));
 }
 
-void Indexer_Main(Config* config,
+void CacheWriter_Main(TimestampManager* timestamp_manager,
+                      ImportPipelineStatus* status) {
+  auto* queue = QueueManager::instance();
+  CacheWriterState* state = CacheWriterState::Get();
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->running = true;
+  }
+  while (true) {
+    // Block until there is a write, then take everything which has queued up
+    // meanwhile as one batch. A write without a path asks to stop once the
+    // batch is written.
+    std::vector<Index_OnWriteCache> writes;
+    writes.push_back(queue->write_cache.Dequeue());
+    for (Index_OnWriteCache& write : queue->write_cache.DequeueAll())
+      writes.push_back(std::move(write));
+    auto stop_request = std::remove_if(
+        writes.begin(), writes.end(),
+        [](const Index_OnWriteCache& write) { return write.path.empty(); });
+    bool stop = stop_request != writes.end();
+    writes.erase(stop_request, writes.end());
+
+    // A file may be reindexed several times before its cache is written; only
+    // the latest index is pending, so the later writes of a path find nothing
+    // to write.
+    Timer batch_time;
+    size_t num_written = 0;
+    status->snapshot.BeginCacheWrite();
+    for (Index_OnWriteCache& write : writes) {
+      IndexFile* file = PendingIndexes::Get()->BeginWrite(write.path);
+      if (!file)
+        continue;
+      WriteIndexToCache(timestamp_manager, write.cache_manager.get(), *file,
+                        &write.perf);
+      PendingIndexes::Get()->EndWrite(write.path);
+      num_written++;
+    }
+    status->snapshot.EndCacheWrite(int(writes.size()));
+    LOG_S(INFO) << "[perf] Wrote " << num_written << " cached indexes ("
+                << writes.size() - num_written << " coalesced) in "
+                << FormatMicroseconds(batch_time.ElapsedMicroseconds());
+
+    // Persist the include graph and cached timestamps once the writes have
+    // caught up, instead of after every batch.
+    if (stop || queue->write_cache.IsEmpty())
+      timestamp_manager->Save();
+
+    if (stop) {
+      LOG_S(INFO) << "Stopped writing caches";
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->running = false;
+      state->stopped.notify_all();
+      return;
+    }
+  }
+}
+
+void CacheWriter_Stop() {
+  CacheWriterState* state = CacheWriterState::Get();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  if (!state->running)
+    return;
+  QueueManager::instance()->write_cache.Enqueue(
+      Index_OnWriteCache("", nullptr, PerformanceImportFile()));
+  state->stopped.wait(lock, [state]() { return !state->running; });
+}
+
+void Indexer_Main(int indexer_index,
+                  Config* config,
+                  QueryDatabase* db,
                   FileConsumerSharedState* file_consumer_shared,
                   TimestampManager* timestamp_manager,
                   ImportManager* import_manager,
@@ -564,47 +1132,82 @@ void Indexer_Main(Config* config,
                   Project* project,
                   WorkingFiles* working_files,
                   MultiQueueWaiter* waiter) {
-  RealModificationTimestampFetcher modification_timestamp_fetcher;
+  if (config->indexerLowPriority)
+    SetCurrentThreadLowPriority();
+  RealModificationTimestampFetcher modification_timestamp_fetcher(
+      timestamp_manager);
   auto* queue = QueueManager::instance();
   // Build one index per-indexer, as building the index acquires a global lock.
-  auto indexer = IIndexer::MakeClangIndexer();
+  auto indexer = config->index.workerProcesses ||
+                         !config->index.workerCommands.empty()
+                     ? IIndexer::MakeProcessIndexer()
+                     : IIndexer::MakeClangIndexer();
 
   while (true) {
     bool did_work = false;
+    bool stalled = false;
+    bool throttled = false;
 
     {
       ActiveThread active_thread(config, status);
 
-      // TODO: process all off IndexMain_DoIndex before calling
-      // IndexMain_DoCreateIndexUpdate for better icache behavior. We need to
-      // have some threads spinning on both though otherwise memory usage will
-      // get bad.
-
-      // We need to make sure to run both IndexMain_DoParse and
-      // IndexMain_DoCreateIndexUpdate so we don't starve querydb from doing any
-      // work. Running both also lets the user query the partially constructed
-      // index.
-      did_work = IndexMain_DoParse(
-                      config, working_files, file_consumer_shared,
-                      timestamp_manager, &modification_timestamp_fetcher,
-                      import_manager, indexer.get()) ||
-                  did_work;
-
-      did_work = IndexMain_DoCreateIndexUpdate(timestamp_manager) ||
-                 did_work;
+      // Finish the files which are already in flight before parsing another
+      // one. Later stages are cheap compared to parsing, and draining them
+      // first keeps the number of IndexFiles held in memory low and gets
+      // results to querydb (and the user) sooner.
+      bool did_stage_work = !status->cache_only;
+      while (did_stage_work) {
+        did_stage_work = IndexMain_LoadPreviousIndex();
+        did_stage_work = IndexMain_DoIdMap(db, import_manager) ||
+                         did_stage_work;
+        did_stage_work =
+            IndexMain_DoCreateIndexUpdate(timestamp_manager, status) ||
+            did_stage_work;
+        did_work = did_stage_work || did_work;
+      }
 
-      did_work = IndexMain_LoadPreviousIndex() || did_work;
+      // Parse one file per iteration; other threads keep draining the later
+      // stages meanwhile, so querydb is never starved.
+      bool interactive_only = false;
+      stalled = ShouldStallParse(config, status, &interactive_only);
+      // A throttled indexer does not parse, but keeps running the stages
+      // above so their queues drain at full speed.
+      throttled = !status->throttle.MayParse(indexer_index);
+      if ((!stalled || interactive_only) && !throttled) {
+        did_work = IndexMain_DoParse(
+                        config, working_files, file_consumer_shared,
+                        timestamp_manager, &modification_timestamp_fetcher,
+                        import_manager, status, project, indexer.get(),
+                        interactive_only) ||
+                    did_work;
+      }
 
       // Nothing to index and no index updates to create, so join some already
-      // created index updates to reduce work on querydb thread.
-      if (!did_work)
+      // created index updates to reduce work on querydb thread. Not while
+      // stalled: merging shortens on_indexed without freeing any memory.
+      if (!did_work && !stalled)
         did_work = IndexMergeIndexUpdates() || did_work;
     }
 
+    // The queues we would wait on are not empty while stalled, so poll until
+    // querydb catches up.
+    if (!did_work && stalled) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+
+    // index_request is not empty while throttled either, and the throttle
+    // changes at most once a second.
+    if (!did_work && throttled) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+
     // We didn't do any work, so wait for a notification.
     if (!did_work) {
       waiter->Wait(&queue->on_indexed, &queue->index_request,
-                   &queue->on_id_mapped, &queue->load_previous_index);
+                   &queue->do_id_map, &queue->on_id_mapped,
+                   &queue->load_previous_index);
     }
   }
 }
@@ -619,81 +1222,73 @@ bool QueryDb_ImportMain(Config* config,
 
   ActiveThread active_thread(config, status);
 
-  bool did_work = false;
-
-  while (true) {
-    optional<Index_DoIdMap> request = queue->do_id_map.TryDequeue();
-    if (!request)
-      break;
-    did_work = true;
-
-    assert(request->current);
-
-    // If the request does not have previous state and we have already imported
-    // it, load the previous state from disk and rerun IdMap logic later. Do not
-    // do this if we have already attempted in the past.
-    if (!request->load_previous && !request->previous &&
-        db->usr_to_file.find(NormalizedPath(request->current->path)) !=
-            db->usr_to_file.end()) {
-      assert(!request->load_previous);
-      request->load_previous = true;
-      queue->load_previous_index.Enqueue(std::move(*request));
-      continue;
-    }
-
-    // Check if the file is already being imported into querydb. If it is, drop
-    // the request.
-    //
-    // Note, we must do this *after* we have checked for the previous index,
-    // otherwise we will never actually generate the IdMap.
-    if (!import_manager->StartQueryDbImport(request->current->path)) {
-      LOG_S(INFO) << "Dropping index as it is already being imported for "
-                  << request->current->path;
-      continue;
-    }
-
-    Index_OnIdMapped response(request->cache_manager, request->perf, request->is_interactive,
-                              request->write_to_disk);
-    Timer time;
-
-    auto make_map = [db](std::unique_ptr<IndexFile> file)
-        -> std::unique_ptr<Index_OnIdMapped::File> {
-      if (!file)
-        return nullptr;
-
-      auto id_map = MakeUnique<IdMap>(db, file->id_cache);
-      return MakeUnique<Index_OnIdMapped::File>(std::move(file),
-                                                std::move(id_map));
-    };
-    response.current = make_map(std::move(request->current));
-    response.previous = make_map(std::move(request->previous));
-    response.perf.querydb_id_map = time.ElapsedMicrosecondsAndReset();
+  // Stop once the budget is used up so that requests queued meanwhile do not
+  // wait for the whole backlog; the caller runs us again after handling them.
+  Timer budget_time;
+  auto out_of_budget = [&]() {
+    return config->querydbImportBudgetMs > 0 &&
+           budget_time.ElapsedMicroseconds() >=
+               config->querydbImportBudgetMs * 1000ll;
+  };
 
-    queue->on_id_mapped.Enqueue(std::move(response));
-  }
+  bool did_work = false;
 
-  while (true) {
+  while (!out_of_budget()) {
     optional<Index_OnIndexed> response = queue->on_indexed.TryDequeue();
     if (!response)
       break;
 
     did_work = true;
+    GetOnIndexedMemoryGauge()->Add(-1, -int64_t(response->memory_bytes));
+    static LatencyHistogram* queue_time =
+        GetLatencyHistogram("queue.on_indexed");
+    queue_time->Record(response->queued_time.ElapsedMicroseconds());
+    std::lock_guard<SharedMutex> lock(db->mutex);
+    ScopedTrace trace(
+        "querydb", "apply",
+        std::to_string(response->update.files_def_update.size()) + " files");
 
     Timer time;
     db->ApplyIndexUpdate(&response->update);
-    time.ResetAndPrint("Applying index update for " +
-                       StringJoinMap(response->update.files_def_update,
-                                     [](const QueryFile::DefUpdate& value) {
-                                       return value.value.path;
-                                     }));
+    // Every update which was created adds one file, merged or not.
+    status->snapshot.OnUpdatesApplied(
+        int(response->update.files_def_update.size()));
+    static LatencyHistogram* apply = GetLatencyHistogram("querydb.apply");
+    apply->Record(time.ElapsedMicroseconds());
+    LOG_RATE_LIMITED_S(INFO, kMaxFileLogsPerSecond)
+        << "Applying index update for "
+        << StringJoinMap(response->update.files_def_update,
+                         [](const QueryFile::DefUpdate& value) {
+                           return value.value.path;
+                         })
+        << " took " << FormatMicroseconds(time.ElapsedMicroseconds());
 
     // Update indexed content, inactive lines, and semantic highlighting.
     for (auto& updated_file : response->update.files_def_update) {
       WorkingFile* working_file =
           working_files->GetFileByFilename(updated_file.value.path);
       if (working_file) {
-        // Update indexed content.
-        working_file->SetIndexContent(updated_file.file_content);
+        // Update indexed content, unless the file already has it, which keeps
+        // its line mapping. Indexes loaded from cache do not carry their file
+        // contents, so only read them for files which are open.
+        if (!updated_file.file_content_hash ||
+            updated_file.file_content_hash !=
+                working_file->index_content_hash) {
+          std::shared_ptr<const std::string> content =
+              updated_file.file_content;
+          if ((!content || content->empty()) &&
+              !config->cacheDirectory.empty()) {
+            optional<std::string> cached_file_contents =
+                ICacheManager::Make(config)->LoadCachedFileContents(
+                    updated_file.value.path);
+            if (cached_file_contents) {
+              content = std::make_shared<const std::string>(
+                  std::move(*cached_file_contents));
+            }
+          }
+          working_file->SetIndexContent(content ? *content : std::string(),
+                                        updated_file.file_content_hash);
+        }
 
         // Inactive lines.
         EmitInactiveLines(working_file, updated_file.value.inactive_regions);
@@ -702,15 +1297,38 @@ bool QueryDb_ImportMain(Config* config,
         QueryFileId file_id =
             db->usr_to_file[NormalizedPath(working_file->filename)];
         QueryFile* file = &db->files[file_id.id];
-        EmitSemanticHighlighting(db, semantic_cache, working_file, file);
+        EmitSemanticHighlighting(db, semantic_cache, working_file, file,
+                                 config->semanticHighlightingDeltas
+                                     ? SemanticHighlightingMode::Delta
+                                     : SemanticHighlightingMode::IfChanged);
       }
 
       // Mark the files as being done in querydb stage after we apply the index
-      // update.
-      import_manager->DoneQueryDbImport(updated_file.value.path);
+      // update. A request which arrived during the import is run again from
+      // the start, as its previous index predates the update just applied;
+      // the index of that update is kept in PendingIndexes.
+      std::unique_ptr<Index_DoIdMap> pending =
+          import_manager->DoneQueryDbImport(updated_file.value.path);
+      if (pending) {
+        pending->previous = nullptr;
+        pending->load_previous = false;
+        pending->owns_querydb_import = true;
+        queue->do_id_map.Enqueue(std::move(*pending));
+      }
+      ResumeRequestsWaitingFor(ImportedEvent(updated_file.value.path));
     }
   }
 
+  // Walking the database takes a while for large projects, so its memory
+  // gauges are only refreshed every few seconds.
+  long long now = GetCurrentTimeInMilliseconds();
+  if (did_work && now >= status->next_memory_gauge_update) {
+    status->next_memory_gauge_update = now + kMemoryGaugeIntervalMs;
+    SharedLock lock(db->mutex);
+    UpdateQueryDbMemoryGauges(db);
+    UpdateWorkingFilesMemoryGauge(working_files);
+  }
+
   return did_work;
 }
 
@@ -729,7 +1347,7 @@ TEST_SUITE("ImportPipeline") {
       return IndexMain_DoParse(&config, &working_files, &file_consumer_shared,
                                &timestamp_manager,
                                &modification_timestamp_fetcher, &import_manager,
-                               indexer.get());
+                               &pipeline_status, &project, indexer.get());
     }
 
     void MakeRequest(const std::string& path,
@@ -751,6 +1369,8 @@ TEST_SUITE("ImportPipeline") {
     TimestampManager timestamp_manager;
     FakeModificationTimestampFetcher modification_timestamp_fetcher;
     ImportManager import_manager;
+    ImportPipelineStatus pipeline_status;
+    Project project;
     std::shared_ptr<ICacheManager> cache_manager;
     std::unique_ptr<IIndexer> indexer;
   };
@@ -760,18 +1380,17 @@ TEST_SUITE("ImportPipeline") {
                      bool is_interactive = false,
                      const std::vector<std::string>& old_args = {},
                      const std::vector<std::string>& new_args = {}) {
-      std::unique_ptr<IndexFile> opt_previous_index;
-      if (!old_args.empty()) {
-        opt_previous_index = MakeUnique<IndexFile>("---.cc", "<empty>");
-        opt_previous_index->args = old_args;
-      }
+      optional<uint64_t> previous_args_fingerprint;
+      if (!old_args.empty())
+        previous_args_fingerprint = GetArgsFingerprint(old_args);
       optional<std::string> from;
       if (is_dependency)
         from = std::string("---.cc");
       return FileNeedsParse(is_interactive /*is_interactive*/,
                             &timestamp_manager, &modification_timestamp_fetcher,
                             &import_manager, cache_manager,
-                            opt_previous_index.get(), file, new_args, from);
+                            previous_args_fingerprint,
+                            GetArgsFingerprint(new_args), file, from);
     };
 
     // A file with no timestamp is not imported, since this implies the file no
@@ -796,7 +1415,7 @@ TEST_SUITE("ImportPipeline") {
       REQUIRE(check("aa.cc") == ShouldParse::Yes);
       REQUIRE(check("aa.cc") == ShouldParse::Yes);
       REQUIRE(check("aa.cc") == ShouldParse::Yes);
-      timestamp_manager.UpdateCachedModificationTime("aa.cc", timestamp);
+      timestamp_manager.UpdateCachedModificationTime("aa.cc", timestamp, 0);
       REQUIRE(check("aa.cc") == ShouldParse::No);
     };
     check_timestamp_change(5);
@@ -805,7 +1424,7 @@ TEST_SUITE("ImportPipeline") {
     check_timestamp_change(4);
 
     // Argument change implies reimport, even if timestamp has not changed.
-    timestamp_manager.UpdateCachedModificationTime("aa.cc", 5);
+    timestamp_manager.UpdateCachedModificationTime("aa.cc", 5, 0);
     modification_timestamp_fetcher.entries["aa.cc"] = 5;
     REQUIRE(check("aa.cc", false /*is_dependency*/, false /*is_interactive*/,
                   {"b"} /*old_args*/,
@@ -863,4 +1482,95 @@ TEST_SUITE("ImportPipeline") {
 
     REQUIRE(file_consumer_shared.used_files.empty());
   }
+
+  TEST_CASE_FIXTURE(Fixture, "prefetch queued requests") {
+    indexer = IIndexer::MakeTestIndexer(
+        {IIndexer::TestEntry{"foo.cc", 1}, IIndexer::TestEntry{"bar.cc", 1},
+         IIndexer::TestEntry{"baz.cc", 1}});
+    config.cachePrefetchCount = 1;
+
+    MakeRequest("foo.cc");
+    MakeRequest("bar.cc");
+    MakeRequest("baz.cc");
+    PumpOnce();
+    std::vector<bool> prefetched;
+    queue->index_request.ForEachFront(2, [&](Index_Request& request) {
+      prefetched.push_back(request.is_prefetched);
+    });
+    REQUIRE(prefetched.size() == 2);
+    REQUIRE(prefetched[0]);
+    REQUIRE(!prefetched[1]);
+  }
+
+  TEST_CASE_FIXTURE(Fixture, "stall parsing") {
+    indexer = IIndexer::MakeTestIndexer({IIndexer::TestEntry{"foo.cc", 10}});
+    config.indexerDoIdMapHighWatermark = 10;
+    config.indexerDoIdMapLowWatermark = 5;
+    ImportPipelineStatus status;
+
+    REQUIRE(!ShouldStallParse(&config, &status));
+    MakeRequest("foo.cc");
+    PumpOnce();
+    REQUIRE(queue->do_id_map.Size() == 10);
+    REQUIRE(ShouldStallParse(&config, &status));
+    REQUIRE(status.parse_stalled);
+
+    // Stay stalled until below the low watermark.
+    while (queue->do_id_map.Size() > 5)
+      queue->do_id_map.TryDequeue();
+    REQUIRE(ShouldStallParse(&config, &status));
+    queue->do_id_map.TryDequeue();
+    REQUIRE(!ShouldStallParse(&config, &status));
+    REQUIRE(!status.parse_stalled);
+  }
+
+  TEST_CASE("pending indexes") {
+    PendingIndexes* pending = PendingIndexes::Get();
+    pending->Put(MakeUnique<IndexFile>("pending.cc", "1"), true);
+    pending->Put(MakeUnique<IndexFile>("pending.cc", "2"), false);
+
+    // The newest index is not written, but is still the previous index.
+    REQUIRE(!pending->BeginWrite("pending.cc"));
+    std::unique_ptr<IndexFile> previous = pending->TryCopy("pending.cc");
+    REQUIRE(previous);
+    REQUIRE(previous->file_contents == "2");
+
+    pending->Put(MakeUnique<IndexFile>("pending.cc", "3"), true);
+    IndexFile* write = pending->BeginWrite("pending.cc");
+    REQUIRE(write);
+    REQUIRE(write->file_contents == "3");
+    pending->EndWrite("pending.cc");
+    REQUIRE(!pending->TryCopy("pending.cc"));
+  }
+
+  TEST_CASE_FIXTURE(Fixture, "pending querydb import") {
+    auto make_request = [&](const std::string& contents) {
+      return Index_DoIdMap(MakeUnique<IndexFile>("foo.cc", contents),
+                           cache_manager, PerformanceImportFile(),
+                           false /*is_interactive*/, true /*write_to_disk*/);
+    };
+
+    Index_DoIdMap first = make_request("1");
+    REQUIRE(import_manager.StartQueryDbImport("foo.cc", &first));
+
+    // Only the newest request arriving during the import is kept.
+    Index_DoIdMap second = make_request("2");
+    Index_DoIdMap third = make_request("3");
+    REQUIRE(!import_manager.StartQueryDbImport("foo.cc", &second));
+    REQUIRE(!import_manager.StartQueryDbImport("foo.cc", &third));
+
+    std::unique_ptr<Index_DoIdMap> pending =
+        import_manager.DoneQueryDbImport("foo.cc");
+    REQUIRE(pending);
+    REQUIRE(pending->current->file_contents == "3");
+
+    // The pending request owns the import until it is done as well.
+    Index_DoIdMap fourth = make_request("4");
+    REQUIRE(!import_manager.StartQueryDbImport("foo.cc", &fourth));
+    pending = import_manager.DoneQueryDbImport("foo.cc");
+    REQUIRE(pending);
+    REQUIRE(pending->current->file_contents == "4");
+    REQUIRE(!import_manager.DoneQueryDbImport("foo.cc"));
+    REQUIRE(import_manager.StartQueryDbImport("foo.cc", &first));
+  }
 }
@@ -1,10 +1,18 @@
 #pragma once
 
+#include "diagnostics_publisher.h"
+#include "indexer_throttle.h"
+#include "memory_governor.h"
+#include "performance.h"
+#include "query_snapshot.h"
+
 // FIXME: do not include clang-c outside of clang_ files.
 #include <clang-c/Index.h>
 
 #include <atomic>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct ClangTranslationUnit;
@@ -22,6 +30,46 @@ struct ImportPipelineStatus {
   std::atomic<int> num_active_threads;
   std::atomic<long long> next_progress_output;
 
+  // Set while indexers do not parse new files because later stages are
+  // backed up or memory is short. |stall_start| is when the current stall
+  // began, |stall_ms| the duration of all previous stalls.
+  std::atomic<bool> parse_stalled;
+  std::atomic<long long> stall_start;
+  std::atomic<long long> stall_ms;
+
+  // When querydb next refreshes its memory gauges, see
+  // UpdateQueryDbMemoryGauges. Only used by querydb.
+  long long next_memory_gauge_update;
+
+  // Keeps track of the index updates in flight for the querydb snapshot.
+  QueryDbSnapshot snapshot;
+  // Decides how many indexers parse files.
+  IndexerThrottle throttle;
+  // Sheds memory under pressure, which also stops parsing.
+  MemoryGovernor memory_governor;
+  // Publishes the diagnostics of the indexer and of code completion.
+  DiagnosticsPublisher diagnostics_publisher;
+  // Paths of the index requests which indexers are parsing, with the number
+  // of indexers parsing each. Together with the queued index requests, these
+  // are the files whose index may still change, see CountPendingFiles.
+  std::mutex parsing_mutex;
+  std::unordered_map<std::string, int> parsing;
+
+  // Set by --index-project, which only writes the caches of the project.
+  // Indexers then write every index to the cache right after parsing it, and
+  // nothing is imported into querydb. |num_pending_requests| is the number of
+  // queued index requests which are not done yet, including their cache
+  // writes.
+  bool cache_only;
+  std::atomic<int> num_pending_requests;
+  std::atomic<int> num_failed_requests;
+  // Totals of the written indexes. The parse and build times are counted once
+  // per translation unit.
+  std::mutex cache_only_mutex;
+  int num_written_files;
+  int num_parsed_files;
+  PerformanceImportFile cache_only_perf;
+
   ImportPipelineStatus();
 };
 
@@ -33,7 +81,20 @@ void IndexWithTuFromCodeCompletion(
     const std::string& path,
     const std::vector<std::string>& args);
 
-void Indexer_Main(Config* config,
+// Writes the caches queued in QueueManager::write_cache. Runs on its own
+// thread so indexer threads do not wait on serialization and disk IO.
+void CacheWriter_Main(TimestampManager* timestamp_manager,
+                      ImportPipelineStatus* status);
+// Makes CacheWriter_Main write the caches queued so far and return, and waits
+// for it. Called before exiting, so that the cache is not closed while it is
+// being written to.
+void CacheWriter_Stop();
+
+// |indexer_index| is in [0, Config::indexerCount), see IndexerThrottle. |db|
+// is not used if ImportPipelineStatus::cache_only is set.
+void Indexer_Main(int indexer_index,
+                  Config* config,
+                  QueryDatabase* db,
                   FileConsumerSharedState* file_consumer_shared,
                   TimestampManager* timestamp_manager,
                   ImportManager* import_manager,
@@ -3,10 +3,17 @@
 #include "match.h"
 #include "platform.h"
 #include "project.h"
+#include "serializers/binary.h"
 #include "standard_includes.h"
 #include "timer.h"
 #include "work_thread.h"
 
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <ctime>
+#include <iterator>
 #include <thread>
 
 namespace {
@@ -96,6 +103,191 @@ lsCompletionItem BuildCompletionItem(Config* config,
   return item;
 }
 
+// Listing a directory is mostly waiting on the file system, so scan with more
+// threads than there are cores.
+const unsigned kScanThreadsPerCore = 2;
+
+// Returns |directories| normalized and without duplicates. Directories inside
+// of another one are dropped, since scanning the outer one finds their files.
+std::vector<std::string> GetScanRoots(std::vector<std::string> directories) {
+  for (std::string& directory : directories) {
+    directory = NormalizePath(directory);
+    EnsureEndsInSlash(directory);
+  }
+  std::sort(directories.begin(), directories.end());
+  std::vector<std::string> roots;
+  for (std::string& directory : directories) {
+    if (roots.empty() || !StartsWith(directory, roots.back()))
+      roots.push_back(std::move(directory));
+  }
+  return roots;
+}
+
+// Bump when the layout of IncludeDirectory changes.
+const int kSavedIncludeDirectoriesVersion = 1;
+
+// Listing of a directory. Saved listings are reused while the modification
+// time of the directory stays the same, which is the case until an entry is
+// added, removed or renamed.
+struct IncludeDirectory {
+  // Absolute path ending in a slash.
+  std::string path;
+  int64_t modification_time = 0;
+  std::vector<std::string> files;
+  std::vector<std::string> subdirectories;
+};
+MAKE_REFLECT_STRUCT(IncludeDirectory,
+                    path,
+                    modification_time,
+                    files,
+                    subdirectories);
+
+using IncludeDirectories = std::unordered_map<std::string, IncludeDirectory>;
+
+IncludeDirectories LoadIncludeDirectories(const std::string& path) {
+  IncludeDirectories result;
+  optional<std::string> content = ReadContent(path);
+  if (!content)
+    return result;
+
+  std::vector<IncludeDirectory> saved;
+  try {
+    BinaryReader reader(*content);
+    int version;
+    Reflect(reader, version);
+    if (version != kSavedIncludeDirectoriesVersion)
+      return result;
+    Reflect(reader, saved);
+  } catch (std::invalid_argument& e) {
+    LOG_S(INFO) << "Failed to load include directories from " << path << ": "
+                << e.what();
+    return result;
+  }
+  for (IncludeDirectory& directory : saved) {
+    std::string key = directory.path;
+    result.emplace(std::move(key), std::move(directory));
+  }
+  return result;
+}
+
+void SaveIncludeDirectories(const std::string& path,
+                            const IncludeDirectories& directories) {
+  std::vector<IncludeDirectory> saved;
+  for (const auto& entry : directories)
+    saved.push_back(entry.second);
+
+  std::string content;
+  BinaryWriter writer(&content);
+  int version = kSavedIncludeDirectoriesVersion;
+  Reflect(writer, version);
+  Reflect(writer, saved);
+  WriteToFile(path, content);
+}
+
+// Lists |roots| and all of their subdirectories, reusing the listings in
+// |previous| of directories which did not change. Directories are visited by
+// a pool of threads, so a large tree is split across threads as well. Sets
+// |num_listed| to the number of directories which had to be listed.
+IncludeDirectories ScanDirectories(const std::vector<std::string>& roots,
+                                   const IncludeDirectories& previous,
+                                   size_t* num_listed) {
+  // A directory can still change within the second it was listed in without
+  // its modification time changing, so such listings are not reused.
+  int64_t recent = int64_t(time(nullptr)) - 1;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> pending(roots.rbegin(), roots.rend());
+  // Number of directories which are being visited.
+  size_t active = 0;
+  IncludeDirectories result;
+  *num_listed = 0;
+
+  auto scan = [&]() {
+    std::vector<DirectoryEntry> entries;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&]() { return !pending.empty() || active == 0; });
+      if (pending.empty())
+        break;
+      std::string path = std::move(pending.back());
+      pending.pop_back();
+      active++;
+      lock.unlock();
+
+      IncludeDirectory directory;
+      bool listed = false;
+      optional<int64_t> modification_time = GetLastModificationTime(path);
+      auto it = previous.find(path);
+      if (modification_time && it != previous.end() &&
+          it->second.modification_time == *modification_time) {
+        directory = it->second;
+      } else if (modification_time) {
+        listed = true;
+        directory.path = path;
+        if (*modification_time < recent)
+          directory.modification_time = *modification_time;
+        entries.clear();
+        if (!ListDirectory(path, &entries)) {
+          LOG_S(WARNING) << "Unable to read directory " << path;
+          directory.modification_time = 0;
+        }
+        for (DirectoryEntry& entry : entries) {
+          if (!IsIndexedDirectoryEntry(entry.name))
+            continue;
+          if (entry.is_dir)
+            directory.subdirectories.push_back(std::move(entry.name));
+          else
+            directory.files.push_back(std::move(entry.name));
+        }
+      }
+
+      lock.lock();
+      active--;
+      if (modification_time) {
+        if (listed)
+          ++*num_listed;
+        for (const std::string& subdirectory : directory.subdirectories)
+          pending.push_back(path + subdirectory + "/");
+        result.emplace(std::move(path), std::move(directory));
+      }
+      if (!pending.empty() || active == 0)
+        cv.notify_all();
+    }
+  };
+
+  unsigned num_threads =
+      std::max(std::thread::hardware_concurrency(), 1u) * kScanThreadsPerCore;
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; i++)
+    threads.emplace_back(scan);
+  scan();
+  for (std::thread& thread : threads)
+    thread.join();
+  return result;
+}
+
+// Returns the sorted absolute paths of the files in |roots| and their
+// subdirectories.
+std::vector<std::string> GetFiles(const std::vector<std::string>& roots,
+                                  const IncludeDirectories& directories) {
+  std::vector<std::string> result;
+  std::vector<std::string> pending(roots.begin(), roots.end());
+  while (!pending.empty()) {
+    std::string path = std::move(pending.back());
+    pending.pop_back();
+    auto it = directories.find(path);
+    if (it == directories.end())
+      continue;
+    for (const std::string& file : it->second.files)
+      result.push_back(path + file);
+    for (const std::string& subdirectory : it->second.subdirectories)
+      pending.push_back(path + subdirectory + "/");
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
 }  // namespace
 
 IncludeComplete::IncludeComplete(Config* config, Project* project)
@@ -107,6 +299,7 @@ void IncludeComplete::Rescan() {
 
   completion_items.clear();
   absolute_path_to_completion_item.clear();
+  path_root_ = PathNode();
 
   if (!match_ && (!config_->includeCompletionWhitelist.empty() ||
                   !config_->includeCompletionBlacklist.empty()))
@@ -118,12 +311,11 @@ void IncludeComplete::Rescan() {
     Timer timer;
 
     InsertStlIncludes();
-    // InsertIncludesFromDirectory(config_->projectRoot,
-    //                             false /*use_angle_brackets*/);
-    for (const std::string& dir : project_->quote_include_directories)
-      InsertIncludesFromDirectory(dir, false /*use_angle_brackets*/);
-    for (const std::string& dir : project_->angle_include_directories)
-      InsertIncludesFromDirectory(dir, true /*use_angle_brackets*/);
+    InsertIncludesFromDirectories(
+        project_->quote_include_directories,
+        project_->angle_include_directories,
+        config_->cacheDirectory + EscapeFileName(config_->projectRoot) +
+            ".include_directories");
 
     timer.ResetAndPrint("[perf] Scanning for includes");
     is_scanning = false;
@@ -143,56 +335,157 @@ void IncludeComplete::AddFile(const std::string& absolute_path) {
   lsCompletionItem item = BuildCompletionItem(
       config_, trimmed_path, use_angle_brackets, false /*is_stl*/);
 
-  if (is_scanning) {
-    std::lock_guard<std::mutex> lock(completion_items_mutex);
-    if (absolute_path_to_completion_item
-            .insert(std::make_pair(absolute_path, completion_items.size()))
-            .second)
-      completion_items.push_back(item);
-  } else {
-    if (absolute_path_to_completion_item
-            .insert(std::make_pair(absolute_path, completion_items.size()))
-            .second)
-      completion_items.push_back(item);
-  }
+  std::unique_lock<std::mutex> lock(completion_items_mutex, std::defer_lock);
+  if (is_scanning)
+    lock.lock();
+  if (absolute_path_to_completion_item
+          .insert(std::make_pair(absolute_path, completion_items.size()))
+          .second)
+    PushCompletionItem(std::move(item));
 }
 
 void IncludeComplete::InsertIncludesFromDirectory(std::string directory,
                                                   bool use_angle_brackets) {
-  directory = NormalizePath(directory);
-  EnsureEndsInSlash(directory);
-
-  std::vector<CompletionCandidate> results;
-  GetFilesInFolder(
-      directory, true /*recursive*/, false /*add_folder_to_path*/,
-      [&](const std::string& path) {
-        if (!EndsWithAny(path,
-                         config_->includeCompletionWhitelistLiteralEnding))
-          return;
-        if (match_ && !match_->IsMatch(directory + path))
-          return;
-
-        CompletionCandidate candidate;
-        candidate.absolute_path = directory + path;
-        candidate.completion_item = BuildCompletionItem(
-            config_, path, use_angle_brackets, false /*is_stl*/);
-        results.push_back(candidate);
-      });
+  std::vector<std::string> empty;
+  if (use_angle_brackets)
+    InsertIncludesFromDirectories(empty, {directory}, "");
+  else
+    InsertIncludesFromDirectories({directory}, empty, "");
+}
+
+void IncludeComplete::InsertIncludesFromDirectories(
+    const std::vector<std::string>& quote_directories,
+    const std::vector<std::string>& angle_directories,
+    const std::string& saved_path) {
+  // Maps each include directory to whether it uses angle brackets. Quote
+  // directories take precedence, like they do when resolving an include.
+  std::unordered_map<std::string, bool> include_directories;
+  auto add_directories = [&](const std::vector<std::string>& directories,
+                             bool use_angle_brackets) {
+    for (std::string directory : directories) {
+      directory = NormalizePath(directory);
+      EnsureEndsInSlash(directory);
+      include_directories.emplace(directory, use_angle_brackets);
+    }
+  };
+  add_directories(quote_directories, false /*use_angle_brackets*/);
+  add_directories(angle_directories, true /*use_angle_brackets*/);
+
+  auto insert_files = [&](const std::vector<std::string>& files) {
+    std::vector<CompletionCandidate> results;
+    for (const std::string& absolute_path : files) {
+      if (!EndsWithAny(absolute_path,
+                       config_->includeCompletionWhitelistLiteralEnding))
+        continue;
+      if (match_ && !match_->IsMatch(absolute_path))
+        continue;
+
+      // Complete the path relative to the innermost include directory, which
+      // is the shortest way to include it.
+      auto directory = include_directories.end();
+      for (size_t end = absolute_path.rfind('/');
+           end != std::string::npos && end > 0 &&
+           directory == include_directories.end();
+           end = absolute_path.rfind('/', end - 1)) {
+        directory = include_directories.find(absolute_path.substr(0, end + 1));
+      }
+      if (directory == include_directories.end())
+        continue;
+
+      CompletionCandidate candidate;
+      candidate.absolute_path = absolute_path;
+      candidate.completion_item = BuildCompletionItem(
+          config_, absolute_path.substr(directory->first.size()),
+          directory->second, false /*is_stl*/);
+      results.push_back(std::move(candidate));
+    }
+
+    std::lock_guard<std::mutex> lock(completion_items_mutex);
+    for (const CompletionCandidate& result : results) {
+      if (absolute_path_to_completion_item
+              .insert(std::make_pair(result.absolute_path,
+                                     completion_items.size()))
+              .second)
+        PushCompletionItem(result.completion_item);
+    }
+  };
+
+  std::vector<std::string> roots;
+  for (const auto& entry : include_directories)
+    roots.push_back(entry.first);
+  roots = GetScanRoots(roots);
+
+  // Offer the files found last time right away, then bring them up to date.
+  IncludeDirectories saved;
+  std::vector<std::string> saved_files;
+  if (!saved_path.empty()) {
+    saved = LoadIncludeDirectories(saved_path);
+    saved_files = GetFiles(roots, saved);
+    insert_files(saved_files);
+  }
+
+  size_t num_listed;
+  IncludeDirectories scanned = ScanDirectories(roots, saved, &num_listed);
+  std::vector<std::string> files = GetFiles(roots, scanned);
+  std::vector<std::string> added;
+  std::set_difference(files.begin(), files.end(), saved_files.begin(),
+                      saved_files.end(), std::back_inserter(added));
+  std::vector<std::string> removed;
+  std::set_difference(saved_files.begin(), saved_files.end(), files.begin(),
+                      files.end(), std::back_inserter(removed));
+  insert_files(added);
+  RemoveFiles(removed);
+  LOG_S(INFO) << "Listed " << num_listed << " of " << scanned.size()
+              << " include directories; " << added.size() << " files added, "
+              << removed.size() << " removed";
+
+  if (!saved_path.empty() &&
+      (num_listed > 0 || scanned.size() != saved.size()))
+    SaveIncludeDirectories(saved_path, scanned);
+}
+
+void IncludeComplete::RemoveFiles(
+    const std::vector<std::string>& absolute_paths) {
+  if (absolute_paths.empty())
+    return;
 
   std::lock_guard<std::mutex> lock(completion_items_mutex);
-  for (const CompletionCandidate& result : results) {
-    if (absolute_path_to_completion_item
-            .insert(
-                std::make_pair(result.absolute_path, completion_items.size()))
-            .second)
-      completion_items.push_back(result.completion_item);
+  std::vector<bool> remove(completion_items.size());
+  bool any = false;
+  for (const std::string& absolute_path : absolute_paths) {
+    auto it = absolute_path_to_completion_item.find(absolute_path);
+    if (it == absolute_path_to_completion_item.end())
+      continue;
+    remove[it->second] = true;
+    absolute_path_to_completion_item.erase(it);
+    any = true;
+  }
+  if (!any)
+    return;
+
+  // Compact |completion_items| and remap the indices pointing into it.
+  std::vector<int> new_index(completion_items.size());
+  size_t kept = 0;
+  for (size_t i = 0; i < completion_items.size(); i++) {
+    new_index[i] = int(kept);
+    if (!remove[i])
+      completion_items[kept++] = std::move(completion_items[i]);
   }
+  completion_items.resize(kept);
+  for (auto& entry : absolute_path_to_completion_item)
+    entry.second = new_index[entry.second];
+
+  std::vector<lsCompletionItem> items = std::move(completion_items);
+  completion_items.clear();
+  path_root_ = PathNode();
+  for (lsCompletionItem& item : items)
+    PushCompletionItem(std::move(item));
 }
 
 void IncludeComplete::InsertStlIncludes() {
   std::lock_guard<std::mutex> lock(completion_items_mutex);
   for (const char* stl_header : kStandardLibraryIncludes) {
-    completion_items.push_back(BuildCompletionItem(
+    PushCompletionItem(BuildCompletionItem(
         config_, stl_header, true /*use_angle_brackets*/, true /*is_stl*/));
   }
 }
@@ -206,3 +499,43 @@ optional<lsCompletionItem> IncludeComplete::FindCompletionItemForAbsolutePath(
     return nullopt;
   return completion_items[it->second];
 }
+
+std::vector<const lsCompletionItem*>
+IncludeComplete::GetCompletionItemsInDirectoryOf(const std::string& path) {
+  std::vector<const lsCompletionItem*> result;
+  const PathNode* node = &path_root_;
+  for (size_t start = 0, end;
+       (end = path.find('/', start)) != std::string::npos; start = end + 1) {
+    auto it = node->children.find(path.substr(start, end - start));
+    if (it == node->children.end())
+      return result;
+    node = it->second.get();
+  }
+
+  std::vector<const PathNode*> pending{node};
+  while (!pending.empty()) {
+    node = pending.back();
+    pending.pop_back();
+    for (int index : node->items)
+      result.push_back(&completion_items[index]);
+    for (const auto& child : node->children)
+      pending.push_back(child.second.get());
+  }
+  return result;
+}
+
+void IncludeComplete::PushCompletionItem(lsCompletionItem item) {
+  // The label may be elided, use the path which is inserted.
+  const std::string& path = item.textEdit->newText;
+  PathNode* node = &path_root_;
+  for (size_t start = 0, end;
+       (end = path.find('/', start)) != std::string::npos; start = end + 1) {
+    std::unique_ptr<PathNode>& child =
+        node->children[path.substr(start, end - start)];
+    if (!child)
+      child = MakeUnique<PathNode>();
+    node = child.get();
+  }
+  node->items.push_back(int(completion_items.size()));
+  completion_items.push_back(std::move(item));
+}
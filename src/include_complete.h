@@ -22,11 +22,28 @@ struct IncludeComplete {
   // blocking function and should be run off the querydb thread.
   void InsertIncludesFromDirectory(std::string directory,
                                    bool use_angle_brackets);
+  // Scans all of the given directories in parallel. Files in more than one of
+  // them are completed relative to the innermost directory. If |saved_path| is
+  // not empty, the listings saved there are offered first and only changed
+  // directories are listed again; the result is saved back to |saved_path|.
+  void InsertIncludesFromDirectories(
+      const std::vector<std::string>& quote_directories,
+      const std::vector<std::string>& angle_directories,
+      const std::string& saved_path);
+  // Removes the completion items of files which no longer exist.
+  void RemoveFiles(const std::vector<std::string>& absolute_paths);
   void InsertStlIncludes();
 
   optional<lsCompletionItem> FindCompletionItemForAbsolutePath(
       const std::string& absolute_path);
 
+  // Returns the completion items whose path is inside of the directory of
+  // |path|, ie, everything up to its last '/', or in one of its
+  // subdirectories. Must be called with |completion_items_mutex| held when
+  // |is_scanning| is true.
+  std::vector<const lsCompletionItem*> GetCompletionItemsInDirectoryOf(
+      const std::string& path);
+
   // Guards |completion_items| when |is_scanning| is true.
   std::mutex completion_items_mutex;
   std::atomic<bool> is_scanning;
@@ -39,6 +56,17 @@ struct IncludeComplete {
   // angle vs quote include style (ie, <foo> vs "foo").
   std::unordered_map<std::string, int> absolute_path_to_completion_item;
 
+  // Indices into |completion_items| by the directories of the completed path,
+  // so completing "foo/ba" only looks at the items in foo/.
+  struct PathNode {
+    std::unordered_map<std::string, std::unique_ptr<PathNode>> children;
+    std::vector<int> items;
+  };
+  PathNode path_root_;
+
+  // Appends |item| to |completion_items| and indexes it in |path_root_|.
+  void PushCompletionItem(lsCompletionItem item);
+
   // Cached references
   Config* config_;
   Project* project_;
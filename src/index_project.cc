@@ -0,0 +1,170 @@
+#include "index_project.h"
+
+#include "cache_compression.h"
+#include "cache_manager.h"
+#include "config.h"
+#include "file_consumer.h"
+#include "import_manager.h"
+#include "import_pipeline.h"
+#include "indexer.h"
+#include "platform.h"
+#include "project.h"
+#include "queue_manager.h"
+#include "timer.h"
+#include "timestamp_manager.h"
+#include "utils.h"
+#include "work_thread.h"
+#include "working_files.h"
+
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+extern int g_index_comments;
+extern bool g_index_lazy_comments;
+
+namespace {
+
+// How often the number of remaining files is printed.
+const int kProgressIntervalMs = 10000;
+
+void PrintDuration(const char* name, uint64_t microseconds) {
+  std::cout << "  " << name << ": " << FormatMicroseconds(microseconds)
+            << std::endl;
+}
+
+}  // namespace
+
+int RunIndexProject(const std::string& directory,
+                    Config* config,
+                    MultiQueueWaiter* indexer_waiter) {
+  Timer total_time;
+  config->projectRoot = directory;
+  if (config->projectRoot.empty() ||
+      (config->projectRoot[0] != '/' &&
+       config->projectRoot.find(':') == std::string::npos)) {
+    config->projectRoot = GetWorkingDirectory() + config->projectRoot;
+  }
+  config->projectRoot = NormalizePath(config->projectRoot);
+  EnsureEndsInSlash(config->projectRoot);
+  config->workspaceFolders = {config->projectRoot};
+
+  if (config->cacheDirectory.empty()) {
+    std::cerr << "--index-project needs a cacheDirectory in --init"
+              << std::endl;
+    return 1;
+  }
+  config->cacheDirectory = NormalizePath(config->cacheDirectory);
+  EnsureEndsInSlash(config->cacheDirectory);
+  if (!config->sharedCacheDirectory.empty())
+    EnsureEndsInSlash(config->sharedCacheDirectory);
+  if (!config->sharedCacheProjectRoot.empty())
+    EnsureEndsInSlash(config->sharedCacheProjectRoot);
+  if (config->resourceDirectory.empty())
+    config->resourceDirectory = GetDefaultResourceDirectory();
+  if (!GetIndexProfile(config->index.profile)) {
+    std::cerr << "Unknown index.profile " << config->index.profile
+              << std::endl;
+    return 1;
+  }
+  if (!IsCacheCodecSupported(config->cacheCompression)) {
+    std::cerr << "cquery was built without support for the cacheCompression "
+                 "codec"
+              << std::endl;
+    return 1;
+  }
+  g_index_comments = config->index.comments;
+  g_index_lazy_comments = config->index.lazyComments;
+  g_fast_usr_hash = config->fastUsrHash;
+
+  // There is no client to report progress to or to stay responsive for, so
+  // every core parses all the time.
+  config->progressReportFrequencyMs = -1;
+  config->indexerAdaptive = false;
+  if (config->indexerCount <= 0) {
+    config->indexerCount =
+        std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  std::string project_directory =
+      ICacheManager::GetProjectDirectoryName(config);
+  MakeDirectoryRecursive(config->cacheDirectory + project_directory);
+  MakeDirectoryRecursive(config->cacheDirectory + '@' + project_directory);
+  MakeDirectoryRecursive(config->cacheDirectory +
+                         ICacheManager::kContentsBlobDirectory);
+
+  // The indexers use these until the process exits.
+  Timer time;
+  auto* timestamp_manager = new TimestampManager();
+  timestamp_manager->Load(config->cacheDirectory +
+                              EscapeFileName(config->projectRoot) +
+                              ".include_graph",
+                          config->projectCacheKey.empty());
+  timestamp_manager->PrefetchModificationTimes();
+  auto* project = new Project();
+  project->Load(config, config->extraClangArguments,
+                config->compilationDatabaseDirectory, config->workspaceFolders,
+                config->resourceDirectory);
+  uint64_t load_time = time.ElapsedMicrosecondsAndReset();
+
+  auto* file_consumer_shared = new FileConsumerSharedState();
+  auto* import_manager = new ImportManager();
+  auto* working_files = new WorkingFiles();
+  auto* status = new ImportPipelineStatus();
+  status->cache_only = true;
+  status->throttle.Init(config);
+  status->memory_governor.Init(config);
+
+  auto* queue = QueueManager::instance();
+  project->ForAllFilteredFiles(
+      config, [&](int i, const Project::Entry& entry) {
+        status->num_pending_requests++;
+        queue->index_request.Enqueue(
+            Index_Request(entry.filename, entry.args, false /*is_interactive*/,
+                          nullopt, ICacheManager::Make(config)));
+      });
+  int num_requests = status->num_pending_requests;
+  std::cout << "Indexing " << num_requests << " files with "
+            << config->indexerCount << " indexers" << std::endl;
+
+  for (int i = 0; i < config->indexerCount; ++i) {
+    std::thread([=]() {
+      SetCurrentThreadName("indexer" + std::to_string(i));
+      WorkThread::PlaceCurrentThread(ThreadKind::Indexer);
+      Indexer_Main(i, config, nullptr /*db*/, file_consumer_shared,
+                   timestamp_manager, import_manager, status, project,
+                   working_files, indexer_waiter);
+    }).detach();
+  }
+
+  Timer progress_time;
+  while (status->num_pending_requests > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (progress_time.ElapsedMicroseconds() >= kProgressIntervalMs * 1000) {
+      progress_time.Reset();
+      std::cout << status->num_pending_requests << " of " << num_requests
+                << " files remaining" << std::endl;
+    }
+  }
+  uint64_t index_time = time.ElapsedMicrosecondsAndReset();
+  timestamp_manager->Save();
+
+  std::lock_guard<std::mutex> lock(status->cache_only_mutex);
+  const PerformanceImportFile& perf = status->cache_only_perf;
+  int num_failed = status->num_failed_requests;
+  std::cout << "Parsed " << status->num_parsed_files << " of " << num_requests
+            << " files and wrote " << status->num_written_files
+            << " cached indexes; " << num_failed << " failed" << std::endl;
+  PrintDuration("load project", load_time);
+  PrintDuration("index", index_time);
+  PrintDuration("total", total_time.ElapsedMicroseconds());
+  std::cout << "Summed over indexers:" << std::endl;
+  PrintDuration("index_parse", perf.index_parse);
+  PrintDuration("index_preamble_saved", perf.index_preamble_saved);
+  PrintDuration("index_build", perf.index_build);
+  PrintDuration("index_save_to_disk", perf.index_save_to_disk);
+  return num_failed > 0 ? 1 : 0;
+}
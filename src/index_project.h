@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+struct Config;
+struct MultiQueueWaiter;
+
+// Indexes the project in |directory| without a client and writes its caches,
+// so that they can be produced ahead of time, ie, by continuous integration.
+// |config| holds the initialization options; Config::cacheDirectory must be
+// set. Every core runs an indexer, and nothing is imported into querydb.
+// Prints a summary of the time spent and returns the exit code of the
+// process, which is non-zero if a translation unit failed to index.
+int RunIndexProject(const std::string& directory,
+                    Config* config,
+                    MultiQueueWaiter* indexer_waiter);
@@ -0,0 +1,152 @@
+#include "index_worker.h"
+
+#include "config.h"
+#include "file_consumer.h"
+#include "iindexer.h"
+#include "indexer.h"
+#include "platform.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <stdio.h>
+#include <unordered_set>
+
+extern int g_index_comments;
+extern bool g_index_lazy_comments;
+
+namespace {
+
+bool ReadExactly(FILE* file, void* data, size_t size) {
+  return fread(data, 1, size, file) == size;
+}
+
+// Reading the byte count and the message are separate, as the reads are
+// blocking and the byte count tells how much to read.
+template <typename TRead>
+bool ReadMessage(TRead read, std::string* payload) {
+  uint32_t size;
+  if (!read(&size, sizeof(size)))
+    return false;
+  payload->resize(size);
+  return size == 0 || read(&(*payload)[0], size);
+}
+
+bool ReadFromStdin(std::string* payload) {
+  return ReadMessage(
+      [](void* data, size_t size) { return ReadExactly(stdin, data, size); },
+      payload);
+}
+
+bool WriteToStdout(const std::string& message) {
+  return fwrite(message.data(), 1, message.size(), stdout) == message.size() &&
+         fflush(stdout) == 0;
+}
+
+}  // namespace
+
+bool ReadIndexWorkerMessage(PlatformProcess* process, std::string* payload) {
+  return ReadMessage(
+      [&](void* data, size_t size) { return process->Read(data, size); },
+      payload);
+}
+
+int RunIndexWorker() {
+  SetCurrentThreadName("index_worker");
+
+  std::string payload;
+  Config config;
+  if (!ReadFromStdin(&payload) || !ParseIndexWorkerMessage(payload, &config)) {
+    LOG_S(ERROR) << "Index worker did not receive a config";
+    return 1;
+  }
+  g_index_comments = config.index.comments;
+  g_index_lazy_comments = config.index.lazyComments;
+  g_fast_usr_hash = config.fastUsrHash;
+
+  std::unique_ptr<IIndexer> indexer = IIndexer::MakeClangIndexer();
+  // Files indexed by someone else, kept up to date by each request.
+  std::unordered_set<std::string> used_files;
+  while (ReadFromStdin(&payload)) {
+    IndexWorkerRequest request;
+    if (!ParseIndexWorkerMessage(payload, &request)) {
+      LOG_S(ERROR) << "Index worker received a malformed request";
+      return 1;
+    }
+
+    // Only the files nobody indexed yet are returned. Files which cquery
+    // marks as used while this request is parsed are dropped by cquery.
+    for (const std::string& used_file : request.used_files_removed)
+      used_files.erase(used_file);
+    for (std::string& used_file : request.used_files_added)
+      used_files.insert(std::move(used_file));
+    FileConsumerSharedState file_consumer_shared;
+    for (const std::string& used_file : used_files)
+      file_consumer_shared.Mark(used_file);
+    std::vector<FileContents> file_contents;
+    for (IndexWorkerFile& file : request.file_contents)
+      file_contents.emplace_back(file.path, std::move(file.content));
+
+    IndexWorkerResponse response;
+    auto indexes =
+        indexer->Index(&config, &file_consumer_shared, request.path,
+                       request.args, file_contents, false /*is_interactive*/,
+                       &response.perf);
+    response.ok = bool(indexes);
+    if (indexes) {
+      for (std::unique_ptr<IndexFile>& index : *indexes) {
+        IndexWorkerResult result;
+        result.path = index->path;
+        result.index = Serialize(SerializeFormat::Binary, *index);
+        result.file_contents = std::move(index->file_contents);
+        result.diagnostics = std::move(index->diagnostics_);
+        response.files.push_back(std::move(result));
+      }
+    }
+    // Free the indexes before measuring.
+    indexes = nullopt;
+    FreeUnusedMemory();
+    response.memory_mb = int(GetProcessMemoryUsedInMb());
+
+    if (!WriteToStdout(SerializeIndexWorkerMessage(response)))
+      return 1;
+  }
+  return 0;
+}
+
+TEST_SUITE("IndexWorker") {
+  TEST_CASE("message round trip") {
+    IndexWorkerRequest request;
+    request.path = "foo.cc";
+    request.args = {"clang", "-DA"};
+    request.file_contents.push_back({"foo.h", std::string("a\0b", 3)});
+    request.used_files_added = {"bar.h"};
+    request.used_files_removed = {"baz.h"};
+    std::string message = SerializeIndexWorkerMessage(request);
+
+    size_t offset = 0;
+    auto read = [&](void* data, size_t size) -> bool {
+      if (message.size() - offset < size)
+        return false;
+      memcpy(data, message.data() + offset, size);
+      offset += size;
+      return true;
+    };
+    std::string payload;
+    REQUIRE(ReadMessage(read, &payload));
+    REQUIRE(offset == message.size());
+    REQUIRE(!ReadMessage(read, &payload));
+
+    IndexWorkerRequest parsed;
+    REQUIRE(ParseIndexWorkerMessage(payload, &parsed));
+    REQUIRE(parsed.path == "foo.cc");
+    REQUIRE(parsed.args == request.args);
+    REQUIRE(parsed.file_contents.size() == 1);
+    REQUIRE(parsed.file_contents[0].content == std::string("a\0b", 3));
+    REQUIRE(parsed.used_files_added == request.used_files_added);
+    REQUIRE(parsed.used_files_removed == request.used_files_removed);
+    REQUIRE(!ParseIndexWorkerMessage(payload.substr(1), &parsed));
+    REQUIRE(!ParseIndexWorkerMessage(payload + "x", &parsed));
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "language_server_api.h"
+#include "performance.h"
+#include "serializer.h"
+#include "serializers/binary.h"
+
+#include <string.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct PlatformProcess;
+
+// Messages between cquery and its index worker processes, see
+// Config::Index::workerProcesses. Every message is a uint32_t byte count
+// followed by the message in the binary serialization format. The first
+// message sent to a worker is the Config, every following one is an
+// IndexWorkerRequest which the worker answers with an IndexWorkerResponse.
+
+struct IndexWorkerFile {
+  std::string path;
+  std::string content;
+};
+MAKE_REFLECT_STRUCT(IndexWorkerFile, path, content);
+
+struct IndexWorkerRequest {
+  std::string path;
+  std::vector<std::string> args;
+  // Unsaved contents of open files.
+  std::vector<IndexWorkerFile> file_contents;
+  // Changes since the previous request of the worker to the files which are
+  // indexed by someone else already, see FileConsumerSharedState::used_files.
+  // The first request of a worker adds all of them.
+  std::vector<std::string> used_files_added;
+  std::vector<std::string> used_files_removed;
+};
+MAKE_REFLECT_STRUCT(IndexWorkerRequest,
+                    path,
+                    args,
+                    file_contents,
+                    used_files_added,
+                    used_files_removed);
+
+// An IndexFile, with the state which Serialize() leaves out.
+struct IndexWorkerResult {
+  std::string path;
+  std::string index;
+  std::string file_contents;
+  std::vector<lsDiagnostic> diagnostics;
+};
+MAKE_REFLECT_STRUCT(IndexWorkerResult, path, index, file_contents, diagnostics);
+
+struct IndexWorkerResponse {
+  // False if the translation unit could not be parsed.
+  bool ok = false;
+  PerformanceImportFile perf;
+  std::vector<IndexWorkerResult> files;
+  // Memory used by the worker after indexing.
+  int memory_mb = 0;
+};
+MAKE_REFLECT_STRUCT(IndexWorkerResponse, ok, perf, files, memory_mb);
+
+// Serializes |message| with its byte count.
+template <typename T>
+std::string SerializeIndexWorkerMessage(T& message) {
+  std::string result(sizeof(uint32_t), '\0');
+  BinaryWriter writer(&result);
+  Reflect(writer, message);
+  uint32_t size = uint32_t(result.size() - sizeof(uint32_t));
+  memcpy(&result[0], &size, sizeof(size));
+  return result;
+}
+
+// Parses a message read by ReadIndexWorkerMessage. Returns false if it is
+// malformed.
+template <typename T>
+bool ParseIndexWorkerMessage(const std::string& payload, T* message) {
+  try {
+    BinaryReader reader(payload);
+    Reflect(reader, *message);
+    return reader.AtEnd();
+  } catch (std::invalid_argument&) {
+    return false;
+  }
+}
+
+// Reads the next message of |process| without its byte count. Returns false
+// if the process exited.
+bool ReadIndexWorkerMessage(PlatformProcess* process, std::string* payload);
+
+// Runs an index worker on stdin and stdout until stdin is closed. Returns the
+// exit code of the process.
+int RunIndexWorker();
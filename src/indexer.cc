@@ -2,6 +2,7 @@
 
 #include "clang_cursor.h"
 #include "clang_utils.h"
+#include "match.h"
 #include "platform.h"
 #include "serializer.h"
 #include "timer.h"
@@ -14,12 +15,18 @@
 #include <chrono>
 #include <climits>
 #include <iostream>
+#include <map>
+#include <set>
+#include <tuple>
 
 // TODO: See if we can use clang_indexLoc_getFileLocation to get a type ref on
 // |Foobar| in DISALLOW_COPY(Foobar)
 
 // Defined in command_line.cc
 extern bool g_debug;
+// Defined in messages/initialize.cc
+extern int g_index_comments;
+extern bool g_index_lazy_comments;
 
 namespace {
 
@@ -235,10 +242,57 @@ struct ConstructorCache {
   }
 };
 
+// Cost of an optional feature while indexing one translation unit. Most of
+// the callbacks take well under a microsecond, so their time is added up at
+// the resolution of the clock.
+struct FeatureCost {
+  Timer::Clock::duration time = Timer::Clock::duration::zero();
+  uint64_t size = 0;
+
+  void CopyTo(IndexFeatureCost* cost) const {
+    cost->time =
+        std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+    cost->size = size;
+  }
+};
+
+// Adds the time until it is destroyed to |cost|, if it is not null.
+class FeatureTimer {
+ public:
+  explicit FeatureTimer(FeatureCost* cost) : cost_(cost) {
+    if (cost_)
+      start_ = Timer::Clock::now();
+  }
+  ~FeatureTimer() {
+    if (cost_)
+      cost_->time += Timer::Clock::now() - start_;
+  }
+
+  // Drops the time measured so far, ie, when the callback turns out not to be
+  // about the feature.
+  void Cancel() { cost_ = nullptr; }
+
+ private:
+  FeatureCost* cost_;
+  Timer::Clock::time_point start_;
+};
+
 struct IndexParam {
   Config* config = nullptr;
 
-  std::unordered_set<CXFile> seen_cx_files;
+  // Features recorded for Config::Index::profile, and what each of them cost.
+  IndexFeatures features;
+  FeatureCost macros_cost;
+  FeatureCost comments_cost;
+  FeatureCost locals_cost;
+  FeatureCost implicit_calls_cost;
+  FeatureCost template_usages_cost;
+  FeatureCost initializer_usages_cost;
+
+  // Result of ConsumeFile for every file seen so far. Most callbacks are for
+  // files which were consumed already or which another translation unit
+  // owns, so their answer is looked up here before querying FileConsumer.
+  std::unordered_map<CXFile, IndexFile*> consumed_files;
   std::vector<std::string> seen_files;
   FileContentsMap file_contents;
   std::unordered_map<std::string, int64_t> file_modification_times;
@@ -254,36 +308,111 @@ struct IndexParam {
   ClangTranslationUnit* tu = nullptr;
 
   FileConsumer* file_consumer = nullptr;
-  NamespaceHelper ns;
+  // Owned by the indexer thread if it keeps one across translation units,
+  // otherwise points to |local_ns|.
+  NamespaceHelper* ns = nullptr;
+  NamespaceHelper local_ns;
   ConstructorCache ctors;
 
+  // Filter for files to record references in; see
+  // Config::indexReferencesBlacklist. Only set if there is a blacklist.
+  optional<GroupMatch> references_matcher;
+  std::unordered_map<CXFile, bool> index_references;
+
+  // Function references made from the bodies of implicit template
+  // instantiations, which were folded into their template; see
+  // Config::Index::foldTemplateSpecializations. Every instantiation repeats
+  // the references of the template, so each is recorded once.
+  std::set<std::tuple<IndexFile*, RawId, Range>> instantiation_refs;
+  std::map<std::pair<IndexFile*, RawId>, int> instantiation_ref_counts;
+
   IndexParam(Config* config, ClangTranslationUnit* tu, FileConsumer* file_consumer)
-      : config(config), tu(tu), file_consumer(file_consumer) {}
+      : config(config), tu(tu), file_consumer(file_consumer), ns(&local_ns) {
+    features = GetIndexProfile(config->index.profile).value_or(IndexFeatures());
+    if (!config->indexReferencesBlacklist.empty()) {
+      references_matcher.emplace(config->indexReferencesWhitelist,
+                                 config->indexReferencesBlacklist);
+    }
+  }
 };
 
+// Returns the template which |cursor| implicitly instantiates, if
+// Config::Index::foldTemplateSpecializations is set. Also returns the member
+// of a class template which a member of an implicit instantiation of it was
+// instantiated from. Implicit instantiations are located at their template,
+// unlike explicit and partial specializations, which are kept apart.
+optional<ClangCursor> GetFoldedTemplate(IndexParam* param,
+                                        const ClangCursor& cursor) {
+  if (!param->config->index.foldTemplateSpecializations)
+    return nullopt;
+  CXCursor pattern = clang_getSpecializedCursorTemplate(cursor.cx_cursor);
+  if (clang_Cursor_isNull(pattern) ||
+      !clang_equalLocations(clang_getCursorLocation(cursor.cx_cursor),
+                            clang_getCursorLocation(pattern)))
+    return nullopt;
+  return ClangCursor(pattern);
+}
+
+// Returns true if a reference from the body of an implicit instantiation to
+// |called_id| at |loc| should be recorded; false if another instantiation
+// recorded it already, or if Config::Index::maxInstantiationUses references
+// to |called_id| were recorded.
+bool RecordInstantiationRef(IndexParam* param,
+                            IndexFile* db,
+                            IndexFuncId called_id,
+                            Range loc) {
+  if (!param->instantiation_refs.emplace(db, called_id.id, loc).second)
+    return false;
+  int max_uses = param->config->index.maxInstantiationUses;
+  int& count =
+      param->instantiation_ref_counts[std::make_pair(db, called_id.id)];
+  if (max_uses > 0 && count >= max_uses)
+    return false;
+  count++;
+  return true;
+}
+
+// Returns true if references inside |file| should be indexed.
+bool ShouldIndexReferences(IndexParam* param, CXFile file) {
+  if (!param->references_matcher)
+    return true;
+  auto it = param->index_references.find(file);
+  if (it != param->index_references.end())
+    return it->second;
+  std::string file_name = FileName(file);
+  bool result =
+      (param->primary_file && file_name == param->primary_file->path) ||
+      param->references_matcher->IsMatch(file_name);
+  param->index_references[file] = result;
+  return result;
+}
+
 IndexFile* ConsumeFile(IndexParam* param, CXFile file) {
+  auto it = param->consumed_files.find(file);
+  if (it != param->consumed_files.end())
+    return it->second;
+
   bool is_first_ownership = false;
   IndexFile* db = param->file_consumer->TryConsumeFile(
-      file, &is_first_ownership, &param->file_contents);
-
-  // If this is the first time we have seen the file (ignoring if we are
-  // generating an index for it):
-  if (param->seen_cx_files.insert(file).second) {
-    std::string file_name = FileName(file);
-    // Sometimes the fill name will be empty. Not sure why. Not much we can do
-    // with it.
-    if (!file_name.empty()) {
-      // Add to all files we have seen so we can generate proper dependency
-      // graph.
-      param->seen_files.push_back(file_name);
-
-      // Set modification time.
-      optional<int64_t> modification_time = GetLastModificationTime(file_name);
-      LOG_IF_S(ERROR, !modification_time)
-          << "Failed fetching modification time for " << file_name;
-      if (modification_time)
-        param->file_modification_times[file_name] = *modification_time;
-    }
+      param->tu->cx_tu, file, &is_first_ownership, &param->file_contents);
+  param->consumed_files[file] = db;
+
+  // This is the first time we have seen the file (ignoring if we are
+  // generating an index for it).
+  std::string file_name = FileName(file);
+  // Sometimes the fill name will be empty. Not sure why. Not much we can do
+  // with it.
+  if (!file_name.empty()) {
+    // Add to all files we have seen so we can generate proper dependency
+    // graph.
+    param->seen_files.push_back(file_name);
+
+    // Set modification time.
+    optional<int64_t> modification_time = GetLastModificationTime(file_name);
+    LOG_IF_S(ERROR, !modification_time)
+        << "Failed fetching modification time for " << file_name;
+    if (modification_time)
+      param->file_modification_times[file_name] = *modification_time;
   }
 
   if (is_first_ownership) {
@@ -293,7 +422,7 @@ IndexFile* ConsumeFile(IndexParam* param, CXFile file) {
       Range range = ResolveCXSourceRange(skipped->ranges[i]);
       // clang_getSkippedRanges reports start one token after the '#', move it
       // back so it starts at the '#'
-      range.start.column -= 1;
+      range.start.AddColumn(-1);
       db->skipped_by_preprocessor.push_back(range);
     }
     clang_disposeSourceRangeList(skipped);
@@ -340,10 +469,10 @@ bool CursorSpellingContainsString(CXCursor cursor,
   return result;
 }
 
-// Returns the document content for the given range. May not work perfectly
-// when there are tabs instead of spaces.
-std::string GetDocumentContentInRange(CXTranslationUnit cx_tu,
-                                      CXSourceRange range) {
+// Rebuilds the document content for the given range from its tokens. May not
+// work perfectly when there are tabs instead of spaces.
+std::string TokenizeDocumentContentInRange(CXTranslationUnit cx_tu,
+                                           CXSourceRange range) {
   std::string result;
 
   CXToken* tokens;
@@ -358,7 +487,7 @@ std::string GetDocumentContentInRange(CXTranslationUnit cx_tu,
         ResolveCXSourceRange(clang_getTokenExtent(cx_tu, tokens[i]));
     if (previous_token_range) {
       // Insert newlines.
-      int16_t line_delta =
+      int line_delta =
           token_range.start.line - previous_token_range->end.line;
       assert(line_delta >= 0);
       if (line_delta > 0) {
@@ -367,7 +496,7 @@ std::string GetDocumentContentInRange(CXTranslationUnit cx_tu,
         previous_token_range->end.column = 0;
       }
       // Insert spaces.
-      int16_t column_delta =
+      int column_delta =
           token_range.start.column - previous_token_range->end.column;
       assert(column_delta >= 0);
       result.append((size_t)column_delta, ' ');
@@ -385,6 +514,44 @@ std::string GetDocumentContentInRange(CXTranslationUnit cx_tu,
   return result;
 }
 
+// Returns true if TokenizeDocumentContentInRange would return |text| as is,
+// ie, |text| has no comments, line continuations, tabs, carriage returns or
+// trailing spaces.
+bool IsTokenLayout(const std::string& text) {
+  for (size_t i = 0; i < text.size(); i++) {
+    switch (text[i]) {
+      case '\\':
+      case '\r':
+      case '\t':
+        return false;
+      case '/':
+        if (i + 1 < text.size() && (text[i + 1] == '/' || text[i + 1] == '*'))
+          return false;
+        break;
+      case ' ':
+        if (i + 1 < text.size() && text[i + 1] == '\n')
+          return false;
+        break;
+    }
+  }
+  return true;
+}
+
+// Returns the document content of |range| in the file of |db|, laid out like
+// TokenizeDocumentContentInRange. It is sliced from the contents which the
+// indexer read, and only tokenized from |cx_range| if the slice would read
+// differently.
+std::string GetDocumentContentInRange(IndexParam* param,
+                                      IndexFile* db,
+                                      Range range,
+                                      CXSourceRange cx_range) {
+  const FileContents& fc = param->file_contents[db->path];
+  optional<std::string> content = fc.ContentsInRange(range);
+  if (content && IsTokenLayout(*content))
+    return *content;
+  return TokenizeDocumentContentInRange(param->tu->cx_tu, cx_range);
+}
+
 bool IsFunctionCallContext(CXCursorKind kind) {
   switch (kind) {
     case CXCursor_FunctionDecl:
@@ -405,6 +572,13 @@ bool IsFunctionCallContext(CXCursorKind kind) {
   return false;
 }
 
+// Returns true if |cursor| is a variable declared in the body of a function;
+// see IndexFeatures::locals. Parameters are indexed by every profile.
+bool IsLocalVariable(const ClangCursor& cursor) {
+  return cursor.get_kind() == CXCursor_VarDecl &&
+         IsFunctionCallContext(cursor.get_semantic_parent().get_kind());
+}
+
 void SetTypeName(IndexType* type,
                  const ClangCursor& cursor,
                  const CXIdxContainerInfo* container,
@@ -466,6 +640,40 @@ optional<IndexTypeId> ResolveToDeclarationType(IndexFile* db,
   return type_id;
 }
 
+// Sets the comments of |def| to those of |cursor|. With
+// Config::Index::lazyComments, only their range is stored if they are in the
+// file of |db|.
+template <typename TDef>
+void SetComments(IndexParam* param,
+                 IndexFile* db,
+                 const ClangCursor& cursor,
+                 TDef* def) {
+  FeatureTimer timer(&param->comments_cost);
+  if (!param->features.comments) {
+    def->comments.clear();
+    def->comments_range = Maybe<Range>();
+    return;
+  }
+  if (g_index_comments && g_index_lazy_comments) {
+    CXSourceRange range = clang_Cursor_getCommentRange(cursor.cx_cursor);
+    if (clang_Range_isNull(range)) {
+      def->comments.clear();
+      def->comments_range = Maybe<Range>();
+      return;
+    }
+    CXFile file;
+    Range comments_range = ResolveCXSourceRange(range, &file);
+    if (FileName(file) == db->path) {
+      def->comments.clear();
+      def->comments_range = comments_range;
+      return;
+    }
+  }
+  def->comments = cursor.get_comments();
+  def->comments_range = Maybe<Range>();
+  param->comments_cost.size += def->comments.size();
+}
+
 void SetVarDetail(IndexVar* var,
                   std::string_view short_name,
                   const ClangCursor& cursor,
@@ -480,11 +688,11 @@ void SetVarDetail(IndexVar* var,
   // string. Shorten it to just "lambda".
   if (type_name.find("(lambda at") != std::string::npos)
     type_name = "lambda";
-  def.comments = cursor.get_comments();
+  SetComments(param, db, cursor, &def);
   def.storage = GetStorageClass(clang_Cursor_getStorageClass(cursor.cx_cursor));
 
   std::string qualified_name =
-      param->ns.QualifiedName(semanticContainer, short_name);
+      param->ns->QualifiedName(semanticContainer, short_name);
 
   if (cursor.get_kind() == CXCursor_EnumConstantDecl && semanticContainer) {
     CXType enum_type = clang_getCanonicalType(
@@ -530,7 +738,7 @@ void SetVarDetail(IndexVar* var,
 
   if (is_first_seen) {
     optional<IndexTypeId> var_type =
-        ResolveToDeclarationType(db, cursor, &param->ns);
+        ResolveToDeclarationType(db, cursor, param->ns);
     if (var_type) {
       // Don't treat enum definition variables as instantiations.
       bool is_enum_member = semanticContainer &&
@@ -566,67 +774,78 @@ void OnIndexReference_Function(IndexFile* db,
 }  // namespace
 
 // static
-const int IndexFile::kMajorVersion = 11;
-const int IndexFile::kMinorVersion = 0;
+const int IndexFile::kMajorVersion = 14;
+const int IndexFile::kMinorVersion = 5;
+const int IndexFile::kMinimumMinorVersion = 5;
+
+// static
+int IndexFile::GetMajorVersion() {
+  return g_fast_usr_hash ? kMajorVersion + 1000 : kMajorVersion;
+}
 
 IndexFile::IndexFile(const std::string& path,
                      const std::string& contents)
-    : id_cache(path), path(path), file_contents(contents) {
-  // TODO: Reconsider if we should still be reusing the same id_cache.
-  // Preallocate any existing resolved ids.
-  for (const auto& entry : id_cache.usr_to_type_id)
-    types.push_back(IndexType(entry.second, entry.first));
-  for (const auto& entry : id_cache.usr_to_func_id)
-    funcs.push_back(IndexFunc(entry.second, entry.first));
-  for (const auto& entry : id_cache.usr_to_var_id)
-    vars.push_back(IndexVar(entry.second, entry.first));
-}
+    : id_cache(path), path(path), file_contents(contents) {}
 
 // TODO: Optimize for const char*?
 IndexTypeId IndexFile::ToTypeId(Usr usr) {
-  auto it = id_cache.usr_to_type_id.find(usr);
-  if (it != id_cache.usr_to_type_id.end())
-    return it->second;
+  if (const IndexTypeId* cached = id_cache.usr_to_type_id.Find(usr))
+    return *cached;
 
   IndexTypeId id(types.size());
   types.push_back(IndexType(id, usr));
-  id_cache.usr_to_type_id[usr] = id;
-  id_cache.type_id_to_usr[id] = usr;
+  id_cache.usr_to_type_id.Set(usr, id);
+  id_cache.type_id_to_usr.push_back(usr);
   return id;
 }
 IndexFuncId IndexFile::ToFuncId(Usr usr) {
-  auto it = id_cache.usr_to_func_id.find(usr);
-  if (it != id_cache.usr_to_func_id.end())
-    return it->second;
+  if (const IndexFuncId* cached = id_cache.usr_to_func_id.Find(usr))
+    return *cached;
 
   IndexFuncId id(funcs.size());
   funcs.push_back(IndexFunc(id, usr));
-  id_cache.usr_to_func_id[usr] = id;
-  id_cache.func_id_to_usr[id] = usr;
+  id_cache.usr_to_func_id.Set(usr, id);
+  id_cache.func_id_to_usr.push_back(usr);
   return id;
 }
 IndexVarId IndexFile::ToVarId(Usr usr) {
-  auto it = id_cache.usr_to_var_id.find(usr);
-  if (it != id_cache.usr_to_var_id.end())
-    return it->second;
+  if (const IndexVarId* cached = id_cache.usr_to_var_id.Find(usr))
+    return *cached;
 
   IndexVarId id(vars.size());
   vars.push_back(IndexVar(id, usr));
-  id_cache.usr_to_var_id[usr] = id;
-  id_cache.var_id_to_usr[id] = usr;
+  id_cache.usr_to_var_id.Set(usr, id);
+  id_cache.var_id_to_usr.push_back(usr);
   return id;
 }
 
+namespace {
+
+Usr GetUsrHash(IndexFile* file, const CXCursor& cursor) {
+  // The USR of a declaration cursor only depends on its declaration, which is
+  // the first data pointer of the cursor.
+  if (!clang_isDeclaration(cursor.kind) || !cursor.data[0])
+    return ClangCursor(cursor).get_usr_hash();
+  auto it = file->decl_to_usr.find(cursor.data[0]);
+  if (it != file->decl_to_usr.end())
+    return it->second;
+  Usr usr = ClangCursor(cursor).get_usr_hash();
+  file->decl_to_usr[cursor.data[0]] = usr;
+  return usr;
+}
+
+}  // namespace
+
 IndexTypeId IndexFile::ToTypeId(const CXCursor& cursor) {
-  return ToTypeId(ClangCursor(cursor).get_usr_hash());
+  return ToTypeId(GetUsrHash(this, cursor));
 }
 
 IndexFuncId IndexFile::ToFuncId(const CXCursor& cursor) {
-  return ToFuncId(ClangCursor(cursor).get_usr_hash());
+  return ToFuncId(GetUsrHash(this, cursor));
 }
 
 IndexVarId IndexFile::ToVarId(const CXCursor& cursor) {
-  return ToVarId(ClangCursor(cursor).get_usr_hash());
+  return ToVarId(GetUsrHash(this, cursor));
 }
 
 IndexType* IndexFile::Resolve(IndexTypeId id) {
@@ -657,6 +876,26 @@ void UniqueAdd(std::vector<T>& values, T value) {
     values.push_back(value);
 }
 
+// Use lists shorter than this are scanned instead of building a hash set.
+const size_t kMinUsesForUseSet = 32;
+
+// Appends |use| to |entity->uses| if it is not there already.
+template <typename TEntity>
+void UniqueAddUse(TEntity* entity, Range use) {
+  std::vector<Range>& uses = entity->uses;
+  if (uses.size() < kMinUsesForUseSet) {
+    UniqueAdd(uses, use);
+    return;
+  }
+  IndexUseSet& set = entity->uses_set;
+  for (; set.size < uses.size(); set.size++)
+    set.ranges.insert(uses[set.size]);
+  if (set.ranges.insert(use).second) {
+    uses.push_back(use);
+    set.size++;
+  }
+}
+
 IdCache::IdCache(const std::string& primary_file)
     : primary_file(primary_file) {}
 
@@ -853,7 +1092,7 @@ void VisitDeclForTypeUsageVisitorHandler(ClangCursor cursor,
     IndexType* ref_type = db->Resolve(*param->toplevel_type);
     std::string name = cursor.get_referenced().get_spelling();
     if (name == ref_type->def.ShortName()) {
-      UniqueAdd(ref_type->uses, cursor.get_spelling_range());
+      UniqueAddUse(ref_type, cursor.get_spelling_range());
       param->toplevel_type = nullopt;
       return;
     }
@@ -876,7 +1115,7 @@ void VisitDeclForTypeUsageVisitorHandler(ClangCursor cursor,
   // TODO: Should we even be visiting this if the file is not from the main
   // def? Try adding assert on |loc| later.
   Range loc = cursor.get_spelling_range();
-  UniqueAdd(ref_type_def->uses, loc);
+  UniqueAddUse(ref_type_def, loc);
 }
 
 ClangCursor::VisitResult VisitDeclForTypeUsageVisitor(
@@ -1051,11 +1290,17 @@ optional<IndexTypeId> AddDeclTypeUsages(
   return param.initial_type;
 }
 
+struct DeclInitializerUsagesData {
+  IndexFile* db;
+  IndexParam* param;
+};
+
 // Various versions of LLVM (ie, 4.0) will not visit inline variable references
 // for template arguments.
-ClangCursor::VisitResult AddDeclInitializerUsagesVisitor(ClangCursor cursor,
-                                                         ClangCursor parent,
-                                                         IndexFile* db) {
+ClangCursor::VisitResult AddDeclInitializerUsagesVisitor(
+    ClangCursor cursor,
+    ClangCursor parent,
+    DeclInitializerUsagesData* data) {
   /*
     We need to index the |DeclRefExpr| below (ie, |var| inside of
     Foo<int>::var).
@@ -1096,9 +1341,10 @@ ClangCursor::VisitResult AddDeclInitializerUsagesVisitor(ClangCursor cursor,
         break;
 
       Range loc = cursor.get_spelling_range();
-      IndexVarId ref_id = db->ToVarId(HashUsr(ref_usr));
-      IndexVar* ref_def = db->Resolve(ref_id);
-      UniqueAdd(ref_def->uses, loc);
+      IndexVarId ref_id = data->db->ToVarId(HashUsr(ref_usr));
+      IndexVar* ref_def = data->db->Resolve(ref_id);
+      UniqueAddUse(ref_def, loc);
+      data->param->initializer_usages_cost.size++;
       break;
     }
 
@@ -1109,8 +1355,16 @@ ClangCursor::VisitResult AddDeclInitializerUsagesVisitor(ClangCursor cursor,
   return ClangCursor::VisitResult::Recurse;
 }
 
-void AddDeclInitializerUsages(IndexFile* db, ClangCursor decl_cursor) {
-  decl_cursor.VisitChildren(&AddDeclInitializerUsagesVisitor, db);
+void AddDeclInitializerUsages(IndexParam* param,
+                              IndexFile* db,
+                              ClangCursor decl_cursor) {
+  FeatureTimer timer(&param->initializer_usages_cost);
+  if (!param->features.initializer_usages)
+    return;
+  DeclInitializerUsagesData data;
+  data.db = db;
+  data.param = param;
+  decl_cursor.VisitChildren(&AddDeclInitializerUsagesVisitor, &data);
 }
 
 bool AreEqualLocations(CXIdxLoc loc, CXCursor cursor) {
@@ -1137,6 +1391,7 @@ ClangCursor::VisitResult VisitMacroDefinitionAndExpansions(ClangCursor cursor,
       IndexFile* db = ConsumeFile(param, file);
       if (!db)
         break;
+      param->macros_cost.size++;
 
       // TODO: Considering checking clang_Cursor_isMacroFunctionLike, but the
       // only real difference will be that we show 'callers' instead of 'refs'
@@ -1151,18 +1406,19 @@ ClangCursor::VisitResult VisitMacroDefinitionAndExpansions(ClangCursor cursor,
       IndexVar* var_def = db->Resolve(db->ToVarId(decl_usr));
       if (cursor.get_kind() == CXCursor_MacroDefinition) {
         CXSourceRange cx_extent = clang_getCursorExtent(cursor.cx_cursor);
+        Range extent = ResolveCXSourceRange(cx_extent, nullptr);
         var_def->def.detailed_name = cursor.get_display_name();
         var_def->def.short_name_offset = 0;
         var_def->def.short_name_size = int(var_def->def.detailed_name.size());
         var_def->def.hover =
-            "#define " + GetDocumentContentInRange(param->tu->cx_tu, cx_extent);
+            "#define " +
+            GetDocumentContentInRange(param, db, extent, cx_extent);
         var_def->def.kind = ClangSymbolKind::Macro;
-        var_def->def.comments = cursor.get_comments();
+        SetComments(param, db, cursor, &var_def->def);
         var_def->def.definition_spelling = decl_loc_spelling;
-        var_def->def.definition_extent =
-            ResolveCXSourceRange(cx_extent, nullptr);
+        var_def->def.definition_extent = extent;
       } else
-        UniqueAdd(var_def->uses, decl_loc_spelling);
+        UniqueAddUse(var_def, decl_loc_spelling);
 
       break;
     }
@@ -1213,7 +1469,8 @@ ClangCursor::VisitResult TemplateVisitor(ClangCursor cursor,
             ref_type_index->uses.push_back(ref_cursor.get_extent());
           }
         }
-        UniqueAdd(ref_index->uses, cursor.get_spelling_range());
+        UniqueAddUse(ref_index, cursor.get_spelling_range());
+        data->param->template_usages_cost.size++;
       }
       break;
     }
@@ -1231,6 +1488,7 @@ ClangCursor::VisitResult TemplateVisitor(ClangCursor cursor,
             OnIndexReference_Function(db, cursor.get_spelling_range(),
                                       data->container, called_id, called,
                                       /*implicit=*/false);
+            data->param->template_usages_cost.size++;
             break;
           }
         }
@@ -1255,7 +1513,8 @@ ClangCursor::VisitResult TemplateVisitor(ClangCursor cursor,
           ref_index->def.short_name_size = ref_index->def.detailed_name.size();
           ref_index->def.kind = ClangSymbolKind::Parameter;
         }
-        UniqueAdd(ref_index->uses, cursor.get_spelling_range());
+        UniqueAddUse(ref_index, cursor.get_spelling_range());
+        data->param->template_usages_cost.size++;
       }
       break;
     }
@@ -1277,7 +1536,8 @@ ClangCursor::VisitResult TemplateVisitor(ClangCursor cursor,
           ref_index->def.short_name_size = ref_index->def.detailed_name.size();
           ref_index->def.kind = ClangSymbolKind::Parameter;
         }
-        UniqueAdd(ref_index->uses, cursor.get_spelling_range());
+        UniqueAddUse(ref_index, cursor.get_spelling_range());
+        data->param->template_usages_cost.size++;
       }
       break;
     }
@@ -1287,6 +1547,14 @@ ClangCursor::VisitResult TemplateVisitor(ClangCursor cursor,
 
 }  // namespace
 
+void NamespaceHelper::BeginTranslationUnit() {
+  // Bound the memory kept by an indexer thread.
+  const size_t kMaxCachedUsrs = 1 << 16;
+  container_cursor_to_qualified_name.clear();
+  if (usr_to_qualified_name.size() > kMaxCachedUsrs)
+    usr_to_qualified_name.clear();
+}
+
 std::string NamespaceHelper::QualifiedName(const CXIdxContainerInfo* container,
                                            std::string_view unqualified_name) {
   if (!container)
@@ -1297,6 +1565,7 @@ std::string NamespaceHelper::QualifiedName(const CXIdxContainerInfo* container,
   // put their names into a map of USR -> qualified_name.
   ClangCursor cursor(container->cursor);
   std::vector<ClangCursor> namespaces;
+  std::vector<optional<Usr>> namespace_usrs;
   std::string qualifier;
   while (cursor.get_kind() != CXCursor_TranslationUnit &&
          !IsScopeSemanticContainer(cursor.get_kind())) {
@@ -1305,7 +1574,21 @@ std::string NamespaceHelper::QualifiedName(const CXIdxContainerInfo* container,
       qualifier = it->second;
       break;
     }
+    // Fall back to names computed by previous translation units. Cursors
+    // without a USR cannot be shared between them.
+    optional<Usr> usr;
+    std::string usr_string = cursor.get_usr();
+    if (!usr_string.empty()) {
+      usr = HashUsr(usr_string);
+      auto usr_it = usr_to_qualified_name.find(*usr);
+      if (usr_it != usr_to_qualified_name.end()) {
+        qualifier = usr_it->second;
+        container_cursor_to_qualified_name[cursor] = qualifier;
+        break;
+      }
+    }
     namespaces.push_back(cursor);
+    namespace_usrs.push_back(usr);
     cursor = clang_getCursorSemanticParent(cursor.cx_cursor);
   }
   for (size_t i = namespaces.size(); i > 0;) {
@@ -1335,9 +1618,12 @@ std::string NamespaceHelper::QualifiedName(const CXIdxContainerInfo* container,
       }
     qualifier += "::";
     container_cursor_to_qualified_name[namespaces[i]] = qualifier;
+    if (namespace_usrs[i])
+      usr_to_qualified_name[*namespace_usrs[i]] = qualifier;
   }
   // C++17 string::append
-  return qualifier + std::string(unqualified_name);
+  qualifier.append(unqualified_name.data(), unqualified_name.size());
+  return qualifier;
 }
 
 void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
@@ -1361,6 +1647,11 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
   if (!db)
     return;
 
+  // References to implicit instantiations go to their template, which is
+  // declared on its own.
+  if (GetFoldedTemplate(param, decl->cursor))
+    return;
+
   // The language of this declaration
   LanguageId decl_lang = [decl]() {
     switch (clang_getCursorLanguage(decl->cursor)) {
@@ -1380,7 +1671,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
     db->language = decl_lang;
   }
 
-  NamespaceHelper* ns = &param->ns;
+  NamespaceHelper* ns = param->ns;
 
   switch (decl->entityInfo->kind) {
     case CXIdxEntity_CXXNamespace: {
@@ -1391,7 +1682,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
       ns->def.kind = GetSymbolKind(decl->entityInfo->kind);
       if (ns->def.detailed_name.empty()) {
         SetTypeName(ns, decl_cursor, decl->semanticContainer,
-                    decl->entityInfo->name, &param->ns);
+                    decl->entityInfo->name, param->ns);
         ns->def.definition_spelling = decl_spell;
         ns->def.definition_extent = decl_cursor.get_extent();
         if (decl->semanticContainer) {
@@ -1421,6 +1712,13 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
           decl_cursor.template_specialization_to_template_definition())
         break;
 
+      bool is_local = IsLocalVariable(decl_cursor);
+      if (is_local && !param->features.locals)
+        break;
+      FeatureTimer local_timer(is_local ? &param->locals_cost : nullptr);
+      if (is_local)
+        param->locals_cost.size++;
+
       IndexVarId var_id = db->ToVarId(HashUsr(decl->entityInfo->USR));
       IndexVar* var = db->Resolve(var_id);
 
@@ -1445,7 +1743,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
         var->declarations.push_back(decl_spell);
       }
 
-      AddDeclInitializerUsages(db, decl_cursor);
+      AddDeclInitializerUsages(param, db, decl_cursor);
       var = db->Resolve(var_id);
 
       // Declaring variable type information. Note that we do not insert an
@@ -1495,7 +1793,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
 
       IndexFuncId func_id = db->ToFuncId(decl_cursor_resolved.cx_cursor);
       IndexFunc* func = db->Resolve(func_id);
-      func->def.comments = decl_cursor.get_comments();
+      SetComments(param, db, decl_cursor, &func->def);
       func->def.kind = GetSymbolKind(decl->entityInfo->kind);
       func->def.storage =
           GetStorageClass(clang_Cursor_getStorageClass(decl->cursor));
@@ -1520,7 +1818,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
         declaration.spelling = decl_spelling;
         declaration.extent = decl_extent;
         declaration.content = GetDocumentContentInRange(
-            param->tu->cx_tu, clang_getCursorExtent(decl->cursor));
+            param, db, decl_extent, clang_getCursorExtent(decl->cursor));
 
         // Add parameters.
         for (ClangCursor arg : decl_cursor.get_arguments()) {
@@ -1533,7 +1831,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
               if (param_spelling.start.column ==
                       (param_spelling.end.column - 1) &&
                   arg.get_display_name().empty()) {
-                param_spelling.end.column -= 1;
+                param_spelling.end.AddColumn(-1);
               }
 
               declaration.param_spellings.push_back(param_spelling);
@@ -1566,7 +1864,9 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
         // CXCursor_OverloadedDeclRef in templates are not processed by
         // OnIndexReference, thus we use TemplateVisitor to collect function
         // references.
-        if (decl->entityInfo->templateKind == CXIdxEntity_Template) {
+        if (decl->entityInfo->templateKind == CXIdxEntity_Template &&
+            param->features.template_usages) {
+          FeatureTimer template_timer(&param->template_usages_cost);
           TemplateVisitorData data;
           data.db = db;
           data.param = param;
@@ -1587,11 +1887,11 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
 
           // Mark a type reference at the ctor/dtor location.
           if (decl->entityInfo->kind == CXIdxEntity_CXXConstructor)
-            UniqueAdd(declaring_type_def->uses, decl_spelling);
+            UniqueAddUse(declaring_type_def, decl_spelling);
           if (decl->entityInfo->kind == CXIdxEntity_CXXDestructor) {
             Range dtor_type_range = decl_spelling;
-            dtor_type_range.start.column += 1;  // Don't count the leading ~
-            UniqueAdd(declaring_type_def->uses, dtor_type_range);
+            dtor_type_range.start.AddColumn(1);  // Don't count the leading ~
+            UniqueAddUse(declaring_type_def, dtor_type_range);
           }
 
           // Add function to declaring type.
@@ -1645,9 +1945,9 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
       type->def.definition_extent = extent;
 
       SetTypeName(type, decl_cursor, decl->semanticContainer,
-                  decl->entityInfo->name, &param->ns);
+                  decl->entityInfo->name, param->ns);
       type->def.kind = GetSymbolKind(decl->entityInfo->kind);
-      type->def.comments = decl_cursor.get_comments();
+      SetComments(param, db, decl_cursor, &type->def);
 
       // For Typedef/CXXTypeAlias spanning a few lines, display the declaration
       // line, with spelling name replaced with qualified name.
@@ -1668,7 +1968,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
         }
       }
 
-      UniqueAdd(type->uses, spell);
+      UniqueAddUse(type, spell);
       break;
     }
 
@@ -1691,9 +1991,9 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
       // if (!decl->isRedeclaration) {
 
       SetTypeName(type, decl_cursor, decl->semanticContainer,
-                  decl->entityInfo->name, &param->ns);
+                  decl->entityInfo->name, param->ns);
       type->def.kind = GetSymbolKind(decl->entityInfo->kind);
-      type->def.comments = decl_cursor.get_comments();
+      SetComments(param, db, decl_cursor, &type->def);
       // }
 
       if (decl->isDefinition) {
@@ -1711,7 +2011,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
           }
         }
       } else
-        UniqueAdd(type->uses, decl_spell);
+        UniqueAddUse(type, decl_spell);
 
       switch (decl->entityInfo->templateKind) {
         default:
@@ -1745,6 +2045,9 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
         }
           // fallthrough
         case CXIdxEntity_Template: {
+          if (!param->features.template_usages)
+            break;
+          FeatureTimer template_timer(&param->template_usages_cost);
           TemplateVisitorData data;
           data.db = db;
           data.container = decl_cursor;
@@ -1770,7 +2073,7 @@ void OnIndexDeclaration(CXClientData client_data, const CXIdxDeclInfo* decl) {
           AddDeclTypeUsages(db, base_class->cursor, nullopt,
                             decl->semanticContainer, decl->lexicalContainer);
           optional<IndexTypeId> parent_type_id =
-              ResolveToDeclarationType(db, base_class->cursor, &param->ns);
+              ResolveToDeclarationType(db, base_class->cursor, param->ns);
           // type_def ptr could be invalidated by ResolveToDeclarationType and
           // TemplateVisitor.
           type = db->Resolve(type_id);
@@ -1836,7 +2139,7 @@ void CheckTypeDependentMemberRefExpr(Range* spell,
     if (maybe_period) {
       int i = *maybe_period;
       if (fc.content[i] == '.')
-        spell->start.column++;
+        spell->start.AddColumn(1);
       // -> is likely unexposed.
     }
   }
@@ -1849,7 +2152,7 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
                             nullptr, nullptr, nullptr);
   IndexParam* param = static_cast<IndexParam*>(client_data);
   IndexFile* db = ConsumeFile(param, file);
-  if (!db)
+  if (!db || !ShouldIndexReferences(param, file))
     return;
 
   ClangCursor cursor(ref->cursor);
@@ -1876,6 +2179,13 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
       ClangCursor referenced = ref->referencedEntity->cursor;
       referenced = referenced.template_specialization_to_template_definition();
 
+      bool is_local = IsLocalVariable(referenced);
+      if (is_local && !param->features.locals)
+        break;
+      FeatureTimer local_timer(is_local ? &param->locals_cost : nullptr);
+      if (is_local)
+        param->locals_cost.size++;
+
       IndexVarId var_id = db->ToVarId(referenced.get_usr_hash());
       IndexVar* var = db->Resolve(var_id);
       // Lambda paramaters are not processed by OnIndexDeclaration and
@@ -1897,7 +2207,7 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
           var->def.kind = ClangSymbolKind::Parameter;
         }
       }
-      UniqueAdd(var->uses, loc);
+      UniqueAddUse(var, loc);
       break;
     }
 
@@ -1919,10 +2229,21 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
       //  }
 
       // TODO: search full history?
+      FeatureTimer implicit_timer(&param->implicit_calls_cost);
       ClangCursor ref_cursor(ref->cursor);
       Range loc = ref_cursor.get_spelling_range();
 
-      IndexFuncId called_id = db->ToFuncId(HashUsr(ref->referencedEntity->USR));
+      Usr called_usr = HashUsr(ref->referencedEntity->USR);
+      if (optional<ClangCursor> pattern =
+              GetFoldedTemplate(param, ref->referencedEntity->cursor))
+        called_usr = pattern->get_usr_hash();
+      ClangCursor caller_cursor = ref->container->cursor;
+      optional<ClangCursor> caller_pattern =
+          GetFoldedTemplate(param, caller_cursor);
+      if (caller_pattern)
+        caller_cursor = *caller_pattern;
+
+      IndexFuncId called_id = db->ToFuncId(called_usr);
       IndexFunc* called = db->Resolve(called_id);
 
       std::string_view short_name = called->def.ShortName();
@@ -1942,6 +2263,13 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
             !CursorSpellingContainsString(ref->cursor, param->tu->cx_tu,
                                           short_name)));
 
+      if (!is_implicit)
+        implicit_timer.Cancel();
+      else if (!param->features.implicit_calls)
+        break;
+      else
+        param->implicit_calls_cost.size++;
+
       // Extents have larger ranges and thus less specific, and will be
       // overriden by other functions if exist.
       //
@@ -1952,8 +2280,11 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
       else
         CheckTypeDependentMemberRefExpr(&loc, ref_cursor, param, db);
 
-      OnIndexReference_Function(db, loc, ref->container->cursor, called_id,
-                                called, is_implicit);
+      if (!caller_pattern ||
+          RecordInstantiationRef(param, db, called_id, loc)) {
+        OnIndexReference_Function(db, loc, caller_cursor, called_id, called,
+                                  is_implicit);
+      }
 
       // Checks if |str| starts with |start|. Ignores case.
       auto str_begin = [](const char* start, const char* str) {
@@ -1970,8 +2301,12 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
 
       bool is_template = ref->referencedEntity->templateKind !=
                          CXIdxEntityCXXTemplateKind::CXIdxEntity_NonTemplate;
-      if (param->config->index.attributeMakeCallsToCtor && is_template &&
+      if (param->config->index.attributeMakeCallsToCtor &&
+          param->features.implicit_calls && is_template &&
           str_begin("make", ref->referencedEntity->name)) {
+        // The constructor call is implicit even if the make call is not.
+        FeatureTimer make_timer(is_implicit ? nullptr
+                                            : &param->implicit_calls_cost);
         // Try to find the return type of called function. That type will have
         // the constructor function we add a usage to.
         optional<ClangCursor> opt_found_type = FindType(ref->cursor);
@@ -1994,6 +2329,7 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
           if (ctor_usr) {
             IndexFunc* ctor = db->Resolve(db->ToFuncId(*ctor_usr));
             AddFuncRef(&ctor->callers, IndexFuncRef(loc, true /*is_implicit*/));
+            param->implicit_calls_cost.size++;
           }
         }
       }
@@ -2029,7 +2365,7 @@ void OnIndexReference(CXClientData client_data, const CXIdxEntityRefInfo* ref) {
       //    Foo f;
       //  }
       //
-      UniqueAdd(ref_type->uses, ClangCursor(ref->cursor).get_spelling_range());
+      UniqueAddUse(ref_type, ClangCursor(ref->cursor).get_spelling_range());
       break;
     }
 
@@ -2073,7 +2409,8 @@ optional<std::vector<std::unique_ptr<IndexFile>>> Parse(
     const std::vector<FileContents>& file_contents,
     PerformanceImportFile* perf,
     ClangIndex* index,
-    bool dump_ast) {
+    bool dump_ast,
+    NamespaceHelper* ns) {
   if (!config->enableIndexing)
     return nullopt;
 
@@ -2103,7 +2440,23 @@ optional<std::vector<std::unique_ptr<IndexFile>>> Parse(
     Dump(clang_getTranslationUnitCursor(tu->cx_tu));
 
   return ParseWithTu(config, file_consumer_shared, perf, tu.get(), index, file,
-                     args, unsaved_files);
+                     args, unsaved_files, ns);
+}
+
+optional<IndexFeatures> GetIndexProfile(const std::string& name) {
+  IndexFeatures features;
+  if (name == "full")
+    return features;
+  if (name == "navigation-only") {
+    features.macros = false;
+    features.comments = false;
+    features.locals = false;
+    features.implicit_calls = false;
+    features.template_usages = false;
+    features.initializer_usages = false;
+    return features;
+  }
+  return nullopt;
 }
 
 optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
@@ -2114,7 +2467,8 @@ optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
     ClangIndex* index,
     const std::string& file,
     const std::vector<std::string>& args,
-    const std::vector<CXUnsavedFile>& file_contents) {
+    const std::vector<CXUnsavedFile>& file_contents,
+    NamespaceHelper* ns) {
   Timer timer;
 
   IndexerCallbacks callback = {0};
@@ -2131,6 +2485,10 @@ optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
 
   FileConsumer file_consumer(file_consumer_shared, file);
   IndexParam param(config, tu, &file_consumer);
+  if (ns) {
+    ns->BeginTranslationUnit();
+    param.ns = ns;
+  }
   for (const CXUnsavedFile& contents : file_contents) {
     param.file_contents[contents.Filename] = FileContents(
         contents.Filename, std::string(contents.Contents, contents.Length));
@@ -2160,10 +2518,21 @@ optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
 
   clang_IndexAction_dispose(index_action);
 
-  ClangCursor(clang_getTranslationUnitCursor(tu->cx_tu))
-      .VisitChildren(&VisitMacroDefinitionAndExpansions, &param);
+  {
+    FeatureTimer macros_timer(&param.macros_cost);
+    if (param.features.macros) {
+      ClangCursor(clang_getTranslationUnitCursor(tu->cx_tu))
+          .VisitChildren(&VisitMacroDefinitionAndExpansions, &param);
+    }
+  }
 
   perf->index_build = timer.ElapsedMicrosecondsAndReset();
+  param.macros_cost.CopyTo(&perf->index_macros);
+  param.comments_cost.CopyTo(&perf->index_comments);
+  param.locals_cost.CopyTo(&perf->index_locals);
+  param.implicit_calls_cost.CopyTo(&perf->index_implicit_calls);
+  param.template_usages_cost.CopyTo(&perf->index_template_usages);
+  param.initializer_usages_cost.CopyTo(&perf->index_initializer_usages);
 
   std::unordered_map<std::string, int> inc_to_line;
   // TODO
@@ -2175,6 +2544,12 @@ optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
   for (std::unique_ptr<IndexFile>& entry : result) {
     entry->import_file = file;
     entry->args = args;
+    // Declarations are freed with the translation unit.
+    entry->decl_to_usr.clear();
+    for (IndexType& type : entry->types)
+      type.uses_set = IndexUseSet();
+    for (IndexVar& var : entry->vars)
+      var.uses_set = IndexUseSet();
 
     if (param.primary_file) {
       // If there are errors, show at least one at the include position.
@@ -2194,6 +2569,7 @@ optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
 
     // Update file contents and modification time.
     entry->last_modification_time = param.file_modification_times[entry->path];
+    entry->file_contents_hash = HashStorageKey(entry->file_contents);
 
     // Update dependencies for the file. Do not include the file in its own
     // dependency set.
@@ -7,6 +7,7 @@
 #include "clang_utils.h"
 #include "file_consumer.h"
 #include "file_contents.h"
+#include "flat_usr_map.h"
 #include "language_server_api.h"
 #include "maybe.h"
 #include "performance.h"
@@ -25,6 +26,7 @@
 #include <cassert>
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct IndexType;
@@ -155,12 +157,19 @@ inline void Reflect(Writer& visitor, IndexFuncRef& value) {
   visitor.String(s.c_str());
 }
 
-template <typename TypeId, typename FuncId, typename VarId, typename Range>
+template <typename TypeId,
+          typename FuncId,
+          typename VarId,
+          typename Range,
+          typename Name = std::string>
 struct TypeDefDefinitionData {
   // General metadata.
-  std::string detailed_name;
+  Name detailed_name;
   std::string hover;
   std::string comments;
+  // With Config::Index::lazyComments, |comments| is empty and the comments
+  // are the text in this range of the file instead.
+  Maybe<Range> comments_range;
 
   // While a class/type can technically have a separate declaration/definition,
   // it doesn't really happen in practice. The declaration never contains
@@ -191,17 +200,20 @@ struct TypeDefDefinitionData {
   ClangSymbolKind kind = ClangSymbolKind::Unknown;
 
   bool operator==(
-      const TypeDefDefinitionData<TypeId, FuncId, VarId, Range>& other) const {
+      const TypeDefDefinitionData<TypeId, FuncId, VarId, Range, Name>& other)
+      const {
     return detailed_name == other.detailed_name &&
            definition_spelling == other.definition_spelling &&
            definition_extent == other.definition_extent &&
            alias_of == other.alias_of && parents == other.parents &&
            types == other.types && funcs == other.funcs && vars == other.vars &&
-           hover == other.hover && comments == other.comments;
+           hover == other.hover && comments == other.comments &&
+           comments_range == other.comments_range;
   }
 
   bool operator!=(
-      const TypeDefDefinitionData<TypeId, FuncId, VarId, Range>& other) const {
+      const TypeDefDefinitionData<TypeId, FuncId, VarId, Range, Name>& other)
+      const {
     return !(*this == other);
   }
 
@@ -214,9 +226,10 @@ template <typename TVisitor,
           typename TypeId,
           typename FuncId,
           typename VarId,
-          typename Range>
+          typename Range,
+          typename Name>
 void Reflect(TVisitor& visitor,
-             TypeDefDefinitionData<TypeId, FuncId, VarId, Range>& value) {
+             TypeDefDefinitionData<TypeId, FuncId, VarId, Range, Name>& value) {
   REFLECT_MEMBER_START();
   REFLECT_MEMBER(detailed_name);
   REFLECT_MEMBER(short_name_offset);
@@ -224,6 +237,7 @@ void Reflect(TVisitor& visitor,
   REFLECT_MEMBER(kind);
   REFLECT_MEMBER(hover);
   REFLECT_MEMBER(comments);
+  REFLECT_MEMBER(comments_range);
   REFLECT_MEMBER(definition_spelling);
   REFLECT_MEMBER(definition_extent);
   REFLECT_MEMBER(alias_of);
@@ -234,6 +248,17 @@ void Reflect(TVisitor& visitor,
   REFLECT_MEMBER_END();
 }
 
+// Hash set of the ranges in a use list of an entity, so that adding a use
+// to a symbol which is referenced thousands of times in a translation unit
+// does not scan the whole list. Only built for large lists while indexing,
+// and never serialized.
+struct IndexUseSet {
+  std::unordered_set<Range> ranges;
+  // Number of leading elements of the use list which are in |ranges|. Uses
+  // appended to the list directly are added to |ranges| on the next lookup.
+  size_t size = 0;
+};
+
 struct IndexType {
   using Def =
       TypeDefDefinitionData<IndexTypeId, IndexFuncId, IndexVarId, Range>;
@@ -252,6 +277,7 @@ struct IndexType {
   // Every usage, useful for things like renames.
   // NOTE: Do not insert directly! Use AddUsage instead.
   std::vector<Range> uses;
+  IndexUseSet uses_set;
 
   IndexType() {}  // For serialization.
   IndexType(IndexTypeId id, Usr usr);
@@ -264,12 +290,15 @@ template <typename TypeId,
           typename FuncId,
           typename VarId,
           typename FuncRef,
-          typename Range>
+          typename Range,
+          typename Name = std::string>
 struct FuncDefDefinitionData {
   // General metadata.
-  std::string detailed_name;
+  Name detailed_name;
   std::string hover;
   std::string comments;
+  // See TypeDefDefinitionData::comments_range.
+  Maybe<Range> comments_range;
   Maybe<Range> definition_spelling;
   Maybe<Range> definition_extent;
 
@@ -291,17 +320,20 @@ struct FuncDefDefinitionData {
   StorageClass storage = StorageClass::Invalid;
 
   bool operator==(
-      const FuncDefDefinitionData<TypeId, FuncId, VarId, FuncRef, Range>& other)
+      const FuncDefDefinitionData<TypeId, FuncId, VarId, FuncRef, Range, Name>&
+          other)
       const {
     return detailed_name == other.detailed_name && hover == other.hover &&
            definition_spelling == other.definition_spelling &&
            definition_extent == other.definition_extent &&
            declaring_type == other.declaring_type && base == other.base &&
            locals == other.locals && callees == other.callees &&
-           hover == other.hover && comments == other.comments;
+           hover == other.hover && comments == other.comments &&
+           comments_range == other.comments_range;
   }
   bool operator!=(
-      const FuncDefDefinitionData<TypeId, FuncId, VarId, FuncRef, Range>& other)
+      const FuncDefDefinitionData<TypeId, FuncId, VarId, FuncRef, Range, Name>&
+          other)
       const {
     return !(*this == other);
   }
@@ -317,10 +349,11 @@ template <typename TVisitor,
           typename FuncId,
           typename VarId,
           typename FuncRef,
-          typename Range>
+          typename Range,
+          typename Name>
 void Reflect(
     TVisitor& visitor,
-    FuncDefDefinitionData<TypeId, FuncId, VarId, FuncRef, Range>& value) {
+    FuncDefDefinitionData<TypeId, FuncId, VarId, FuncRef, Range, Name>& value) {
   REFLECT_MEMBER_START();
   REFLECT_MEMBER(detailed_name);
   REFLECT_MEMBER(short_name_offset);
@@ -329,6 +362,7 @@ void Reflect(
   REFLECT_MEMBER(storage);
   REFLECT_MEMBER(hover);
   REFLECT_MEMBER(comments);
+  REFLECT_MEMBER(comments_range);
   REFLECT_MEMBER(definition_spelling);
   REFLECT_MEMBER(definition_extent);
   REFLECT_MEMBER(declaring_type);
@@ -388,12 +422,18 @@ MAKE_REFLECT_STRUCT(IndexFunc::Declaration,
                     content,
                     param_spellings);
 
-template <typename TypeId, typename FuncId, typename VarId, typename Range>
+template <typename TypeId,
+          typename FuncId,
+          typename VarId,
+          typename Range,
+          typename Name = std::string>
 struct VarDefDefinitionData {
   // General metadata.
-  std::string detailed_name;
+  Name detailed_name;
   std::string hover;
   std::string comments;
+  // See TypeDefDefinitionData::comments_range.
+  Maybe<Range> comments_range;
   // TODO: definitions should be a list of ranges, since there can be more
   //       than one - when??
   Maybe<Range> definition_spelling;
@@ -420,14 +460,17 @@ struct VarDefDefinitionData {
   bool is_macro() const { return kind == ClangSymbolKind::Macro; }
 
   bool operator==(
-      const VarDefDefinitionData<TypeId, FuncId, VarId, Range>& other) const {
+      const VarDefDefinitionData<TypeId, FuncId, VarId, Range, Name>& other)
+      const {
     return detailed_name == other.detailed_name && hover == other.hover &&
            definition_spelling == other.definition_spelling &&
            definition_extent == other.definition_extent &&
-           variable_type == other.variable_type && comments == other.comments;
+           variable_type == other.variable_type && comments == other.comments &&
+           comments_range == other.comments_range;
   }
   bool operator!=(
-      const VarDefDefinitionData<TypeId, FuncId, VarId, Range>& other) const {
+      const VarDefDefinitionData<TypeId, FuncId, VarId, Range, Name>& other)
+      const {
     return !(*this == other);
   }
 
@@ -441,15 +484,17 @@ template <typename TVisitor,
           typename TypeId,
           typename FuncId,
           typename VarId,
-          typename Range>
+          typename Range,
+          typename Name>
 void Reflect(TVisitor& visitor,
-             VarDefDefinitionData<TypeId, FuncId, VarId, Range>& value) {
+             VarDefDefinitionData<TypeId, FuncId, VarId, Range, Name>& value) {
   REFLECT_MEMBER_START();
   REFLECT_MEMBER(detailed_name);
   REFLECT_MEMBER(short_name_size);
   REFLECT_MEMBER(short_name_offset);
   REFLECT_MEMBER(hover);
   REFLECT_MEMBER(comments);
+  REFLECT_MEMBER(comments_range);
   REFLECT_MEMBER(definition_spelling);
   REFLECT_MEMBER(definition_extent);
   REFLECT_MEMBER(variable_type);
@@ -471,6 +516,7 @@ struct IndexVar {
   std::vector<Range> declarations;
   // Usages.
   std::vector<Range> uses;
+  IndexUseSet uses_set;
 
   IndexVar() {}  // For serialization.
   IndexVar(IndexVarId id, Usr usr) : usr(usr), id(id) {
@@ -483,12 +529,14 @@ MAKE_HASHABLE(IndexVar, t.id);
 
 struct IdCache {
   std::string primary_file;
-  std::unordered_map<Usr, IndexTypeId> usr_to_type_id;
-  std::unordered_map<Usr, IndexFuncId> usr_to_func_id;
-  std::unordered_map<Usr, IndexVarId> usr_to_var_id;
-  std::unordered_map<IndexTypeId, Usr> type_id_to_usr;
-  std::unordered_map<IndexFuncId, Usr> func_id_to_usr;
-  std::unordered_map<IndexVarId, Usr> var_id_to_usr;
+  // Looked up for every declaration and reference the indexer sees.
+  FlatUsrMap<IndexTypeId> usr_to_type_id;
+  FlatUsrMap<IndexFuncId> usr_to_func_id;
+  FlatUsrMap<IndexVarId> usr_to_var_id;
+  // Ids are dense, so these are indexed by id.
+  std::vector<Usr> type_id_to_usr;
+  std::vector<Usr> func_id_to_usr;
+  std::vector<Usr> var_id_to_usr;
 
   IdCache(const std::string& primary_file);
 };
@@ -500,6 +548,8 @@ struct IndexInclude {
   // Absolute path to the index.
   std::string resolved_path;
 };
+void Reflect(Reader& visitor, IndexInclude& value);
+void Reflect(Writer& visitor, IndexInclude& value);
 
 // Used to identify the language at a file level. The ordering is important, as
 // a file previously identified as `C`, will be changed to `Cpp` if it
@@ -510,17 +560,29 @@ MAKE_REFLECT_TYPE_PROXY(LanguageId);
 struct IndexFile {
   IdCache id_cache;
 
-  // For both JSON and MessagePack cache files.
+  // For all cache formats. Caches of another major version are never read.
   static const int kMajorVersion;
-  // For MessagePack cache files.
-  // JSON has good forward compatibility because field addition/deletion do not
-  // harm but currently no efforts have been made to make old MessagePack cache
-  // files accepted by newer cquery.
+  // Version of the cache schema within kMajorVersion. JSON caches store
+  // member names, so adding or removing a member does not harm them.
+  // MessagePack and binary caches do not, so a member added to the cache is
+  // reflected with REFLECT_MEMBER_SINCE and a removed one with
+  // REFLECT_REMOVED_MEMBER, together with a bump of kMinorVersion. Caches
+  // from kMinimumMinorVersion on are then still read, with the new members at
+  // their default values until the file is indexed again. Changes which make
+  // old caches wrong, ie, a member whose meaning changes, bump kMajorVersion.
   static const int kMinorVersion;
+  // Oldest minor version which is still read.
+  static const int kMinimumMinorVersion;
+  // kMajorVersion, offset if g_fast_usr_hash is set so that caches using
+  // different USR hashes are never mixed.
+  static int GetMajorVersion();
 
   std::string path;
   std::vector<std::string> args;
   int64_t last_modification_time = 0;
+  // HashStorageKey of |file_contents|, so that a file whose timestamp changed
+  // without its contents changing does not need to be reindexed.
+  uint64_t file_contents_hash = 0;
   LanguageId language = LanguageId::Unknown;
 
   // The path to the translation unit cc file which caused the creation of this
@@ -528,6 +590,10 @@ struct IndexFile {
   // instances (ie, each header has a separate one). When the user edits a
   // header we need to lookup the original translation unit and reindex that.
   std::string import_file;
+  // Time in microseconds it took to parse and index |import_file| when this
+  // index was built. Used to pick the cheapest translation unit to reindex a
+  // header with, and to dispatch the most expensive ones first.
+  uint64_t import_file_parse_time = 0;
 
   // Source ranges that were not processed.
   std::vector<Range> skipped_by_preprocessor;
@@ -542,6 +608,10 @@ struct IndexFile {
   std::vector<lsDiagnostic> diagnostics_;
   // File contents at the time of index. Not serialized.
   std::string file_contents;
+  // USR hashes of declaration cursors seen while indexing, keyed by their
+  // clang declaration, since computing a USR is expensive. Only valid while
+  // the translation unit is being indexed. Not serialized.
+  std::unordered_map<const void*, Usr> decl_to_usr;
 
   IndexFile(const std::string& path, const std::string& contents);
 
@@ -559,13 +629,37 @@ struct IndexFile {
 };
 
 struct NamespaceHelper {
+  // Qualified names of the containers in the translation unit being indexed.
+  // Cursors are only valid for that translation unit, see
+  // BeginTranslationUnit.
   std::unordered_map<ClangCursor, std::string>
       container_cursor_to_qualified_name;
+  // Qualified names of containers by USR. These stay valid across translation
+  // units, so a NamespaceHelper which is kept by an indexer thread does not
+  // need to walk the semantic parents of the same headers again.
+  std::unordered_map<Usr, std::string> usr_to_qualified_name;
+
+  // Forgets the cursors of the previous translation unit.
+  void BeginTranslationUnit();
 
   std::string QualifiedName(const CXIdxContainerInfo* container,
                             std::string_view unqualified_name);
 };
 
+// Optional features of the indexer; see Config::Index::profile.
+struct IndexFeatures {
+  bool macros = true;
+  bool comments = true;
+  bool locals = true;
+  bool implicit_calls = true;
+  bool template_usages = true;
+  bool initializer_usages = true;
+};
+
+// Returns the features recorded by the indexing profile |name|, or nullopt if
+// there is no such profile.
+optional<IndexFeatures> GetIndexProfile(const std::string& name);
+
 // |import_file| is the cc file which is what gets passed to clang.
 // |desired_index_file| is the (h or cc) file which has actually changed.
 // |dependencies| are the existing dependencies of |import_file| if this is a
@@ -578,7 +672,8 @@ optional<std::vector<std::unique_ptr<IndexFile>>> Parse(
     const std::vector<FileContents>& file_contents,
     PerformanceImportFile* perf,
     ClangIndex* index,
-    bool dump_ast = false);
+    bool dump_ast = false,
+    NamespaceHelper* ns = nullptr);
 optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
     Config* config,
     FileConsumerSharedState* file_consumer_shared,
@@ -587,7 +682,8 @@ optional<std::vector<std::unique_ptr<IndexFile>>> ParseWithTu(
     ClangIndex* index,
     const std::string& file,
     const std::vector<std::string>& args,
-    const std::vector<CXUnsavedFile>& file_contents);
+    const std::vector<CXUnsavedFile>& file_contents,
+    NamespaceHelper* ns = nullptr);
 
 void ConcatTypeAndName(std::string& type, const std::string& name);
 
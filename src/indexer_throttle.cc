@@ -0,0 +1,143 @@
+#include "indexer_throttle.h"
+
+#include "config.h"
+#include "platform.h"
+#include "timer.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace {
+
+// How long after a request the user counts as interacting with the editor.
+const long long kInteractiveMs = 3000;
+const long long kUpdateIntervalMs = 1000;
+
+long long GetCurrentTimeInMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             Timer::Clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+// static
+int IndexerThrottle::ComputeParsingIndexers(Config* config,
+                                            const Signals& signals) {
+  int max_indexers = std::max(signals.max_indexers, 1);
+  if (!config->indexerAdaptive)
+    return max_indexers;
+
+  int target = max_indexers;
+  if (signals.on_battery) {
+    target = std::min(target,
+                      max_indexers * config->indexerBatteryPercent / 100);
+  }
+  if (signals.interactive && config->indexerRequestLatencyMs > 0) {
+    // Halve while requests are slow, and grow back one by one while the user
+    // keeps working.
+    if (signals.request_ms > config->indexerRequestLatencyMs)
+      target = std::min(target, signals.parsing_indexers / 2);
+    else
+      target = std::min(target, signals.parsing_indexers + 1);
+  }
+  if (signals.load_average >= 0) {
+    // The load includes the parsing indexers themselves, so only back off
+    // once there is more work than cores, and hold between.
+    double excess = signals.load_average - signals.num_cores;
+    if (excess > 1)
+      target = std::min(target, signals.parsing_indexers - 1);
+    else if (excess > 0)
+      target = std::min(target, signals.parsing_indexers);
+  }
+  return std::max(1, std::min(target, max_indexers));
+}
+
+void IndexerThrottle::Init(Config* config) {
+  config_ = config;
+  parsing_indexers_ = std::max(config->indexerCount, 1);
+}
+
+void IndexerThrottle::OnRequest(uint64_t microseconds) {
+  last_request_ms_ = GetCurrentTimeInMilliseconds();
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Exponential moving average, so one slow request does not throttle much.
+  request_ms_ = request_ms_ * 0.75 + microseconds / 1000.0 * 0.25;
+}
+
+bool IndexerThrottle::MayParse(int indexer_index) {
+  // Indexer 0 always parses, so checking the signals does not cost the
+  // others anything.
+  if (indexer_index == 0) {
+    MaybeUpdate();
+    return true;
+  }
+  return indexer_index < parsing_indexers_;
+}
+
+void IndexerThrottle::MaybeUpdate() {
+  if (!config_ || !config_->indexerAdaptive)
+    return;
+  long long now = GetCurrentTimeInMilliseconds();
+  Signals signals;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (now < next_update_ms_)
+      return;
+    next_update_ms_ = now + kUpdateIntervalMs;
+    signals.request_ms = request_ms_;
+  }
+  signals.max_indexers = config_->indexerCount;
+  signals.parsing_indexers = parsing_indexers_;
+  signals.num_cores = std::max<int>(std::thread::hardware_concurrency(), 1);
+  signals.load_average = GetSystemLoadAverage().value_or(-1);
+  signals.on_battery = IsOnBatteryPower();
+  signals.interactive = now - last_request_ms_ < kInteractiveMs;
+
+  int parsing = ComputeParsingIndexers(config_, signals);
+  if (parsing != signals.parsing_indexers) {
+    LOG_S(INFO) << "Using " << parsing << " of " << signals.max_indexers
+                << " indexers for parsing (load=" << signals.load_average
+                << ", battery=" << signals.on_battery
+                << ", request_ms=" << signals.request_ms << ")";
+    parsing_indexers_ = parsing;
+  }
+}
+
+TEST_SUITE("IndexerThrottle") {
+  TEST_CASE("parsing indexers") {
+    Config config;
+    IndexerThrottle::Signals signals;
+    signals.max_indexers = 8;
+    signals.parsing_indexers = 8;
+    signals.num_cores = 8;
+    signals.load_average = 4;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 8);
+
+    signals.on_battery = true;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 4);
+    signals.on_battery = false;
+
+    signals.interactive = true;
+    signals.request_ms = config.indexerRequestLatencyMs * 2;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 4);
+    signals.parsing_indexers = 1;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 1);
+    signals.request_ms = 0;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 2);
+    signals.interactive = false;
+
+    signals.parsing_indexers = 6;
+    signals.load_average = 12;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 5);
+    signals.load_average = 8.5;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 6);
+
+    config.indexerAdaptive = false;
+    REQUIRE(IndexerThrottle::ComputeParsingIndexers(&config, signals) == 8);
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+struct Config;
+
+// Chooses how many of the Config::indexerCount indexer threads parse files.
+// All of them parse while the user is idle, the system has spare cores and
+// the machine is on AC power; fewer parse while requests are slow, the system
+// is overloaded or the machine is running on battery. Indexers which do not
+// parse still run the later, cheap stages of the import pipeline.
+class IndexerThrottle {
+ public:
+  // What ComputeParsingIndexers bases its decision on.
+  struct Signals {
+    int max_indexers = 1;
+    // Number of indexers currently allowed to parse.
+    int parsing_indexers = 1;
+    int num_cores = 1;
+    // One minute load average of the system, or a negative value if unknown.
+    double load_average = -1;
+    bool on_battery = false;
+    // True if a request was handled in the last few seconds, and the average
+    // time querydb recently took to handle one.
+    bool interactive = false;
+    double request_ms = 0;
+  };
+  // Returns how many indexers should parse, between 1 and
+  // |signals.max_indexers|. The load average lags behind, so the count only
+  // shrinks one indexer at a time because of it.
+  static int ComputeParsingIndexers(Config* config, const Signals& signals);
+
+  void Init(Config* config);
+
+  // Called by querydb after it handled a request in |microseconds|.
+  void OnRequest(uint64_t microseconds);
+  // Returns true if the indexer with the given index, in [0, indexerCount),
+  // may parse a file. Updates the signals at most once a second.
+  bool MayParse(int indexer_index);
+
+ private:
+  void MaybeUpdate();
+
+  Config* config_ = nullptr;
+  std::atomic<int> parsing_indexers_{1};
+  std::atomic<long long> last_request_ms_{0};
+
+  std::mutex mutex_;
+  // Guarded by |mutex_|.
+  long long next_update_ms_ = 0;
+  double request_ms_ = 0;
+};
@@ -0,0 +1,71 @@
+#include "instrumented_mutex.h"
+
+#include "metrics.h"
+#include "timer.h"
+
+#include <doctest/doctest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#if defined(USE_LOCK_STATS)
+namespace {
+
+long long NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             Timer::Clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+InstrumentedMutex::InstrumentedMutex(const char* name)
+    : wait_(GetLatencyHistogram(std::string("lock.") + name + ".wait")),
+      hold_(GetLatencyHistogram(std::string("lock.") + name + ".hold")) {}
+
+void InstrumentedMutex::LockAndRecord() {
+  // Uncontended acquisitions are counted without reading the clock twice.
+  if (mutex_.try_lock()) {
+    locked_at_us_ = NowMicroseconds();
+    wait_->Record(0);
+    return;
+  }
+  long long start = NowMicroseconds();
+  mutex_.lock();
+  locked_at_us_ = NowMicroseconds();
+  wait_->Record(locked_at_us_ - start);
+}
+
+bool InstrumentedMutex::TryLockAndRecord() {
+  if (!mutex_.try_lock())
+    return false;
+  locked_at_us_ = NowMicroseconds();
+  wait_->Record(0);
+  return true;
+}
+
+void InstrumentedMutex::UnlockAndRecord() {
+  long long held = NowMicroseconds() - locked_at_us_;
+  mutex_.unlock();
+  hold_->Record(held);
+}
+#else
+InstrumentedMutex::InstrumentedMutex(const char* name) {
+  (void)name;
+}
+#endif
+
+TEST_SUITE("InstrumentedMutex") {
+  TEST_CASE("lock") {
+    InstrumentedMutex mutex("test");
+    bool locked = true;
+    {
+      std::lock_guard<InstrumentedMutex> lock(mutex);
+      std::thread([&]() { locked = mutex.try_lock(); }).join();
+    }
+    REQUIRE(!locked);
+    REQUIRE(mutex.try_lock());
+    mutex.unlock();
+  }
+}
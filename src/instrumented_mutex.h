@@ -0,0 +1,54 @@
+#pragma once
+
+#include <mutex>
+
+class LatencyHistogram;
+
+// std::mutex which, when cquery is configured with --enable-lock-stats,
+// records the time threads wait to acquire it and the time it is held in the
+// "lock.<name>.wait" and "lock.<name>.hold" latency histograms of
+// $cquery/stats. Their count is the number of acquisitions. Locks sharing a
+// name, ie, the stripes of StripedHashSet, share the histograms. Otherwise
+// this is a plain std::mutex.
+class InstrumentedMutex {
+ public:
+  explicit InstrumentedMutex(const char* name);
+
+  void lock() {
+#if defined(USE_LOCK_STATS)
+    LockAndRecord();
+#else
+    mutex_.lock();
+#endif
+  }
+  bool try_lock() {
+#if defined(USE_LOCK_STATS)
+    return TryLockAndRecord();
+#else
+    return mutex_.try_lock();
+#endif
+  }
+  void unlock() {
+#if defined(USE_LOCK_STATS)
+    UnlockAndRecord();
+#else
+    mutex_.unlock();
+#endif
+  }
+
+ private:
+  InstrumentedMutex(const InstrumentedMutex&) = delete;
+  InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+  std::mutex mutex_;
+#if defined(USE_LOCK_STATS)
+  void LockAndRecord();
+  bool TryLockAndRecord();
+  void UnlockAndRecord();
+
+  LatencyHistogram* wait_;
+  LatencyHistogram* hold_;
+  // Guarded by |mutex_|.
+  long long locked_at_us_ = 0;
+#endif
+};
@@ -0,0 +1,92 @@
+#include "interned_string.h"
+
+#include "memory_usage.h"
+#include "striped_hash.h"
+
+#include <doctest/doctest.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+// 64-bit FNV-1a; the string_view backport has no std::hash.
+struct StringViewHash {
+  size_t operator()(std::string_view str) const {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : str) {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 1099511628211ULL;
+    }
+    return size_t(hash);
+  }
+};
+
+// Part of the pool with its own lock, so that indexer threads interning
+// different strings rarely wait for each other. Keys point into the pooled
+// strings, so lookups do not copy the string.
+struct PoolStripe {
+  std::mutex mutex;
+  std::unordered_map<std::string_view, const std::string*, StringViewHash>
+      strings;
+};
+
+const std::string* EmptyString() {
+  static const std::string* empty = new std::string();
+  return empty;
+}
+
+// Returns the pooled copy of |str|. Defs are converted on indexer threads, so
+// the pool is shared by every thread.
+const std::string* Intern(std::string_view str) {
+  if (str.empty())
+    return EmptyString();
+  // Leaked so that interned strings stay valid during static destruction.
+  static auto* pool = new std::array<PoolStripe, kHashStripes>();
+  static MemoryGauge* gauge = GetMemoryGauge("interned_strings");
+  size_t hash = StringViewHash()(str);
+  PoolStripe& stripe = (*pool)[GetHashStripe(hash)];
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+  auto it = stripe.strings.find(str);
+  if (it != stripe.strings.end())
+    return it->second;
+  // Never freed, see InternedString.
+  const std::string* pooled = new std::string(str.data(), str.size());
+  stripe.strings.emplace(std::string_view(*pooled), pooled);
+  gauge->Add(1, sizeof(std::string) + 3 * sizeof(void*) + HeapBytes(*pooled));
+  return pooled;
+}
+
+}  // namespace
+
+InternedString::InternedString() : str_(EmptyString()) {}
+
+InternedString::InternedString(const std::string& str)
+    : str_(Intern(str)) {}
+
+InternedString::InternedString(std::string_view str) : str_(Intern(str)) {}
+
+InternedString::InternedString(const char* str)
+    : str_(Intern(std::string_view(str))) {}
+
+TEST_SUITE("InternedString") {
+  TEST_CASE("shares storage") {
+    InternedString a("foo::Bar");
+    InternedString b(std::string("foo::Bar"));
+    InternedString c(std::string_view("foo::Baz"));
+    REQUIRE(a == b);
+    REQUIRE(a.c_str() == b.c_str());
+    REQUIRE(a != c);
+    REQUIRE(a == std::string("foo::Bar"));
+    REQUIRE(c.str() == "foo::Baz");
+    REQUIRE(InternedString("") == InternedString());
+    REQUIRE(InternedString().empty());
+
+    std::string long_name(100, 'x');
+    InternedString d(long_name);
+    REQUIRE(InternedString(std::string_view(long_name)) == d);
+    REQUIRE(d.str() == long_name);
+  }
+}
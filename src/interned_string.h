@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string_view.h>
+
+#include <string>
+
+// Immutable string stored in a process-wide pool. Equal strings share the
+// same storage, so copies are a pointer copy and equality is a pointer
+// comparison.
+//
+// The pool is append-only: pooled strings are never freed, so it grows with
+// every distinct string which was ever interned, even after nothing refers to
+// it anymore. This is meant for symbol names, which are repeated across many
+// indexed files (every header defines the same |std::vector<T>::push_back|)
+// and keep being referenced as files are reindexed; do not intern strings
+// which are unbounded, like file contents. Its size is reported by the
+// "interned_strings" memory gauge.
+class InternedString {
+ public:
+  InternedString();
+  InternedString(const std::string& str);
+  InternedString(std::string_view str);
+  InternedString(const char* str);
+
+  const std::string& str() const { return *str_; }
+  const char* c_str() const { return str_->c_str(); }
+  size_t size() const { return str_->size(); }
+  bool empty() const { return str_->empty(); }
+
+  operator const std::string&() const { return *str_; }
+  operator std::string_view() const { return *str_; }
+
+  bool operator==(const InternedString& other) const {
+    return str_ == other.str_;
+  }
+  bool operator!=(const InternedString& other) const {
+    return str_ != other.str_;
+  }
+  bool operator==(const std::string& other) const { return *str_ == other; }
+  bool operator!=(const std::string& other) const { return *str_ != other; }
+  bool operator==(std::string_view other) const {
+    return std::string_view(*str_) == other;
+  }
+  bool operator!=(std::string_view other) const {
+    return std::string_view(*str_) != other;
+  }
+  // Literals would convert to both std::string and std::string_view.
+  bool operator==(const char* other) const { return *str_ == other; }
+  bool operator!=(const char* other) const { return *str_ != other; }
+
+ private:
+  const std::string* str_;
+};
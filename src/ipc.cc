@@ -65,6 +65,8 @@ const char* IpcIdToString(IpcId id) {
       return "$cquery/publishInactiveRegions";
     case IpcId::CqueryPublishSemanticHighlighting:
       return "$cquery/publishSemanticHighlighting";
+    case IpcId::CqueryProgress:
+      return "$cquery/progress";
 
     case IpcId::CqueryFreshenIndex:
       return "$cquery/freshenIndex";
@@ -86,6 +88,16 @@ const char* IpcIdToString(IpcId id) {
       return "$cquery/base";
     case IpcId::CqueryDerived:
       return "$cquery/derived";
+    case IpcId::CqueryStats:
+      return "$cquery/stats";
+    case IpcId::CqueryMemory:
+      return "$cquery/memory";
+    case IpcId::CqueryReloadIndex:
+      return "$cquery/reloadIndex";
+    case IpcId::CqueryProfileStart:
+      return "$cquery/profile/start";
+    case IpcId::CqueryProfileStop:
+      return "$cquery/profile/stop";
 
     case IpcId::Unknown:
       return "$unknown";
@@ -43,6 +43,8 @@ enum class IpcId : int {
   CqueryTextDocumentDidView,
   CqueryPublishInactiveRegions,
   CqueryPublishSemanticHighlighting,
+  // Sent to the client while indexing, see Out_Progress.
+  CqueryProgress,
 
   // Custom messages
   CqueryFreshenIndex,
@@ -57,6 +59,15 @@ enum class IpcId : int {
   CqueryCallers,  // Show all callers of a function.
   CqueryBase,     // Show base types/method.
   CqueryDerived,  // Show all derived types/methods.
+  // Latency statistics of the server.
+  CqueryStats,
+  // Approximate memory usage of each part of the server.
+  CqueryMemory,
+  // Rebuild querydb from the cache.
+  CqueryReloadIndex,
+  // Sampling profiler of the server, see profiler.h.
+  CqueryProfileStart,
+  CqueryProfileStop,
 
   // Internal implementation detail.
   Unknown,
@@ -72,6 +83,9 @@ const char* IpcIdToString(IpcId id);
 
 struct BaseIpcMessage {
   const IpcId method_id;
+  // Set once the request waited for the import of its file, see
+  // FindFileOrFail.
+  bool waited_for_import = false;
   BaseIpcMessage(IpcId method_id);
   virtual ~BaseIpcMessage();
 
@@ -1,15 +1,44 @@
 #include "language_server_api.h"
 
 #include "serializers/json.h"
+#include "session_recording.h"
+#include "timer.h"
 
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
 #include <stdio.h>
 #include <iostream>
+#include <mutex>
 
 MessageRegistry* MessageRegistry::instance_ = nullptr;
 
+namespace {
+
+using PooledDocument =
+    rapidjson::GenericDocument<rapidjson::UTF8<>,
+                               rapidjson::MemoryPoolAllocator<>,
+                               rapidjson::MemoryPoolAllocator<>>;
+
+// Memory a thread parses the messages it reads into. The buffers are reused
+// for every message, so a typical message is parsed without allocating; the
+// pools of a larger one grow by chunks which are freed once it is read.
+struct MessageParseBuffers {
+  static constexpr size_t kValueBufferSize = 64 * 1024;
+  static constexpr size_t kStackBufferSize = 16 * 1024;
+  static constexpr size_t kStackCapacity = 1024;
+
+  // rapidjson aligns allocations to 8 bytes from the start of the buffer.
+  alignas(8) char value_buffer[kValueBufferSize];
+  alignas(8) char stack_buffer[kStackBufferSize];
+  rapidjson::MemoryPoolAllocator<> value_allocator{value_buffer,
+                                                   sizeof(value_buffer)};
+  rapidjson::MemoryPoolAllocator<> stack_allocator{stack_buffer,
+                                                   sizeof(stack_buffer)};
+};
+
+}  // namespace
+
 lsTextDocumentIdentifier
 lsVersionedTextDocumentIdentifier::AsTextDocumentIdentifier() const {
   lsTextDocumentIdentifier result;
@@ -17,116 +46,94 @@ lsVersionedTextDocumentIdentifier::AsTextDocumentIdentifier() const {
   return result;
 }
 
-// Reads a JsonRpc message. |read| returns the next input character.
+// Reads a JsonRpc message from |file|. Header lines are read through the
+// stdio buffer, and the content is read with a single fread directly into the
+// returned string.
 optional<std::string> ReadJsonRpcContentFrom(
-    std::function<optional<char>()> read) {
-  // Read the content length. It is terminated by the "\r\n" sequence.
-  int exit_seq = 0;
-  std::string stringified_content_length;
+    FILE* file,
+    std::vector<std::string>* headers) {
+  // Read the headers. Each one is terminated by the "\r\n" sequence, and an
+  // empty line ends the header section.
+  const char* kContentLengthStart = "Content-Length: ";
+  optional<size_t> content_length;
+  std::string header;
   while (true) {
-    optional<char> opt_c = read();
-    if (!opt_c) {
-      LOG_S(INFO) << "No more input when reading content length header";
+    header.clear();
+    int c;
+    while ((c = getc(file)) != EOF && c != '\n')
+      header += char(c);
+    if (c == EOF || header.empty() || header.back() != '\r') {
+      LOG_S(INFO) << "No more input when reading headers";
       return nullopt;
     }
-    char c = *opt_c;
-
-    if (exit_seq == 0 && c == '\r')
-      ++exit_seq;
-    if (exit_seq == 1 && c == '\n')
+    header.pop_back();
+    if (header.empty())
       break;
-
-    stringified_content_length += c;
+    if (StartsWith(header, kContentLengthStart))
+      content_length = size_t(
+          strtoull(header.c_str() + strlen(kContentLengthStart), nullptr, 10));
+    else if (headers)
+      headers->push_back(header);
   }
-  const char* kContentLengthStart = "Content-Length: ";
-  assert(StartsWith(stringified_content_length, kContentLengthStart));
-  int content_length =
-      atoi(stringified_content_length.c_str() + strlen(kContentLengthStart));
-
-  // There is always a "\r\n" sequence before the actual content.
-  auto expect_char = [&](char expected) {
-    optional<char> opt_c = read();
-    return opt_c && *opt_c == expected;
-  };
-  if (!expect_char('\r') || !expect_char('\n')) {
-    LOG_S(INFO) << "Unexpected token (expected \r\n sequence)";
+  if (!content_length) {
+    LOG_S(INFO) << "Missing Content-Length header";
     return nullopt;
   }
 
   // Read content.
-  std::string content;
-  content.reserve(content_length);
-  for (size_t i = 0; i < content_length; ++i) {
-    optional<char> c = read();
-    if (!c) {
-      LOG_S(INFO) << "No more input when reading content body";
-      return nullopt;
-    }
-    content += *c;
+  std::string content(*content_length, '\0');
+  if (*content_length &&
+      fread(&content[0], 1, *content_length, file) != *content_length) {
+    LOG_S(INFO) << "No more input when reading content body";
+    return nullopt;
   }
-
   return content;
 }
 
-std::function<optional<char>()> MakeContentReader(std::string* content,
-                                                  bool can_be_empty) {
-  return [content, can_be_empty]() -> optional<char> {
-    if (!can_be_empty)
-      REQUIRE(!content->empty());
-    if (content->empty())
-      return nullopt;
-    char c = (*content)[0];
-    content->erase(content->begin());
-    return c;
-  };
-}
-
 TEST_SUITE("FindIncludeLine") {
   TEST_CASE("ReadContentFromSource") {
-    auto parse_correct = [](std::string content) -> std::string {
-      auto reader = MakeContentReader(&content, false /*can_be_empty*/);
-      auto got = ReadJsonRpcContentFrom(reader);
-      REQUIRE(got);
-      return got.value();
-    };
-
-    auto parse_incorrect = [](std::string content) -> optional<std::string> {
-      auto reader = MakeContentReader(&content, true /*can_be_empty*/);
-      return ReadJsonRpcContentFrom(reader);
+    auto parse = [](std::string content) -> optional<std::string> {
+      FILE* file = tmpfile();
+      REQUIRE(file);
+      fwrite(content.data(), 1, content.size(), file);
+      rewind(file);
+      optional<std::string> got = ReadJsonRpcContentFrom(file);
+      fclose(file);
+      return got;
     };
 
-    REQUIRE(parse_correct("Content-Length: 0\r\n\r\n") == "");
-    REQUIRE(parse_correct("Content-Length: 1\r\n\r\na") == "a");
-    REQUIRE(parse_correct("Content-Length: 4\r\n\r\nabcd") == "abcd");
+    REQUIRE(parse("Content-Length: 0\r\n\r\n") == std::string(""));
+    REQUIRE(parse("Content-Length: 1\r\n\r\na") == std::string("a"));
+    REQUIRE(parse("Content-Length: 4\r\n\r\nabcd") == std::string("abcd"));
+    REQUIRE(parse("Content-Type: x\r\nContent-Length: 2\r\n\r\nab") ==
+            std::string("ab"));
 
-    REQUIRE(parse_incorrect("ggg") == optional<std::string>());
-    REQUIRE(parse_incorrect("Content-Length: 0\r\n") ==
-            optional<std::string>());
-    REQUIRE(parse_incorrect("Content-Length: 5\r\n\r\nab") ==
-            optional<std::string>());
+    REQUIRE(parse("ggg") == optional<std::string>());
+    REQUIRE(parse("Content-Length: 0\r\n") == optional<std::string>());
+    REQUIRE(parse("Content-Type: x\r\n\r\n") == optional<std::string>());
+    REQUIRE(parse("Content-Length: 5\r\n\r\nab") == optional<std::string>());
   }
 }
 
-optional<char> ReadCharFromStdinBlocking() {
+optional<std::string> MessageRegistry::ReadMessageFromStdin(
+    bool log_stdin_to_stderr,
+    std::unique_ptr<BaseIpcMessage>* message,
+    long long* parse_us) {
   // We do not use std::cin because it does not read bytes once stuck in
   // cin.bad(). We can call cin.clear() but C++ iostream has other annoyance
   // like std::{cin,cout} is tied by default, which causes undesired cout flush
   // for cin operations.
-  int c = getchar();
-  if (c >= 0)
-    return c;
-  return nullopt;
-}
-
-optional<std::string> MessageRegistry::ReadMessageFromStdin(
-    bool log_stdin_to_stderr,
-    std::unique_ptr<BaseIpcMessage>* message) {
-  optional<std::string> content =
-      ReadJsonRpcContentFrom(&ReadCharFromStdinBlocking);
+  optional<std::string> content;
+  if (IsReplayingSession())
+    content = ReadReplayedMessage();
+  else
+    content = ReadJsonRpcContentFrom(stdin);
   if (!content) {
     LOG_S(ERROR) << "Failed to read JsonRpc input; exiting";
     exit(1);
   }
+  // Recorded before parsing, which modifies |content|.
+  RecordSessionMessage(*content);
 
   if (log_stdin_to_stderr) {
     // TODO: This should go inside of ReadJsonRpcContentFrom since it does not
@@ -136,12 +143,26 @@ optional<std::string> MessageRegistry::ReadMessageFromStdin(
     std::cerr.flush();
   }
 
-  rapidjson::Document document;
-  document.Parse(content->c_str(), content->length());
-  assert(!document.HasParseError());
-
-  JsonReader json_reader{&document};
-  return Parse(json_reader, message);
+  // Parse in place; |document| keeps pointers into |content|, which outlives
+  // it.
+  Timer timer;
+  static thread_local MessageParseBuffers buffers;
+  optional<std::string> error;
+  {
+    PooledDocument document(&buffers.value_allocator,
+                            MessageParseBuffers::kStackCapacity,
+                            &buffers.stack_allocator);
+    document.ParseInsitu(&(*content)[0]);
+    assert(!document.HasParseError());
+
+    JsonReader json_reader{&document};
+    error = Parse(json_reader, message);
+  }
+  // The message copied what it needs out of |document|.
+  buffers.value_allocator.Clear();
+  buffers.stack_allocator.Clear();
+  *parse_us = timer.ElapsedMicroseconds();
+  return error;
 }
 
 optional<std::string> MessageRegistry::Parse(
@@ -182,6 +203,52 @@ MessageRegistry* MessageRegistry::instance() {
 
 lsBaseOutMessage::~lsBaseOutMessage() = default;
 
+void lsBaseOutMessage::Write(std::ostream& out) {
+  std::string content;
+  Write(&content);
+  out.write(content.data(), content.size());
+  out.flush();
+}
+
+namespace {
+std::mutex g_output_buffers_mutex;
+std::vector<std::unique_ptr<rapidjson::StringBuffer>> g_output_buffers;
+
+// Buffers which grew larger than this are freed instead of kept.
+const size_t kMaxPooledOutputBufferSize = 1 << 20;
+const size_t kMaxPooledOutputBuffers = 8;
+}  // namespace
+
+std::unique_ptr<rapidjson::StringBuffer> TakeOutputBuffer() {
+  {
+    std::lock_guard<std::mutex> lock(g_output_buffers_mutex);
+    if (!g_output_buffers.empty()) {
+      std::unique_ptr<rapidjson::StringBuffer> buffer =
+          std::move(g_output_buffers.back());
+      g_output_buffers.pop_back();
+      return buffer;
+    }
+  }
+  return MakeUnique<rapidjson::StringBuffer>();
+}
+
+void ReturnOutputBuffer(std::unique_ptr<rapidjson::StringBuffer> buffer) {
+  if (buffer->GetSize() > kMaxPooledOutputBufferSize)
+    return;
+  buffer->Clear();
+  std::lock_guard<std::mutex> lock(g_output_buffers_mutex);
+  if (g_output_buffers.size() < kMaxPooledOutputBuffers)
+    g_output_buffers.push_back(std::move(buffer));
+}
+
+void AppendOutMessage(const char* body, size_t size, std::string* out) {
+  std::string header =
+      "Content-Length: " + std::to_string(size) + "\r\n\r\n";  // CRLFCRLF
+  out->reserve(out->size() + header.size() + size);
+  out->append(header);
+  out->append(body, size);
+}
+
 void lsResponseError::Write(Writer& visitor) {
   auto& value = *this;
   int code2 = static_cast<int>(this->code);
@@ -320,3 +387,43 @@ std::string Out_ShowLogMessage::method() {
     return "window/logMessage";
   return "window/showMessage";
 }
+
+TEST_SUITE("DirectJsonWriter") {
+  TEST_CASE("same output as Reflect") {
+    auto write = [](std::vector<lsCompletionItem>& items,
+                    std::vector<lsLocation>& locations) -> std::string {
+      rapidjson::StringBuffer output;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+      JsonWriter json_writer(&writer);
+      json_writer.StartArray(2);
+      Reflect(json_writer, items);
+      Reflect(json_writer, locations);
+      json_writer.EndArray();
+      return output.GetString();
+    };
+
+    std::vector<lsCompletionItem> items(2);
+    items[0].label = "a\"b";
+    items[0].kind = lsCompletionItemKind::Function;
+    items[1].textEdit = lsTextEdit();
+    items[1].textEdit->newText = "c";
+    std::vector<lsLocation> locations;
+    locations.emplace_back(lsDocumentUri::FromPath("/a.cc"),
+                           lsRange(lsPosition(1, 2), lsPosition(3, 4)));
+    std::string uri = locations[0].uri.raw_uri;
+
+    REQUIRE(write(items, locations) ==
+            "[[{\"label\":\"a\\\"b\",\"kind\":3,\"detail\":\"\","
+            "\"documentation\":\"\",\"sortText\":\"\",\"insertText\":\"\","
+            "\"filterText\":\"\",\"insertTextFormat\":1},"
+            "{\"label\":\"\",\"kind\":1,\"detail\":\"\","
+            "\"documentation\":\"\",\"sortText\":\"\",\"insertText\":\"\","
+            "\"filterText\":\"\",\"insertTextFormat\":1,\"textEdit\":"
+            "{\"range\":{\"start\":{\"line\":0,\"character\":0},"
+            "\"end\":{\"line\":0,\"character\":0}},\"newText\":\"c\"}}],"
+            "[{\"uri\":\"" +
+                uri +
+                "\",\"range\":{\"start\":{\"line\":1,\"character\":2},"
+                "\"end\":{\"line\":3,\"character\":4}}}]]");
+  }
+}
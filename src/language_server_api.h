@@ -2,6 +2,7 @@
 
 #include "config.h"
 #include "ipc.h"
+#include "memory_usage.h"
 #include "serializer.h"
 #include "serializers/json.h"
 #include "utils.h"
@@ -10,6 +11,7 @@
 #include <rapidjson/writer.h>
 #include <variant.h>
 
+#include <stdio.h>
 #include <algorithm>
 #include <iostream>
 #include <unordered_map>
@@ -42,9 +44,11 @@ struct MessageRegistry {
       std::function<void(Reader& visitor, std::unique_ptr<BaseIpcMessage>*)>;
   std::unordered_map<std::string, Allocator> allocators;
 
+  // Sets |parse_us| to the time spent parsing the message.
   optional<std::string> ReadMessageFromStdin(
       bool log_stdin_to_stderr,
-      std::unique_ptr<BaseIpcMessage>* message);
+      std::unique_ptr<BaseIpcMessage>* message,
+      long long* parse_us);
   optional<std::string> Parse(Reader& visitor,
                               std::unique_ptr<BaseIpcMessage>* message);
 };
@@ -64,26 +68,39 @@ struct MessageRegistryRegister {
 
 struct lsBaseOutMessage {
   virtual ~lsBaseOutMessage();
-  virtual void Write(std::ostream& out) = 0;
-};
+  // Appends the message, including its header, to |out|.
+  virtual void Write(std::string* out) = 0;
+  void Write(std::ostream& out);
+};
+
+// Serialization buffers are reused between messages, so large responses do
+// not grow a new buffer every time.
+std::unique_ptr<rapidjson::StringBuffer> TakeOutputBuffer();
+void ReturnOutputBuffer(std::unique_ptr<rapidjson::StringBuffer> buffer);
+// Appends the header for a message of |size| bytes and |body| to |out|.
+void AppendOutMessage(const char* body, size_t size, std::string* out);
+// Reads the content of the next JsonRpc message from |file|. Returns nullopt
+// at the end of input or if the message is malformed. If |headers| is set, the
+// header lines other than Content-Length are appended to it.
+optional<std::string> ReadJsonRpcContentFrom(
+    FILE* file,
+    std::vector<std::string>* headers = nullptr);
 
 template <typename TDerived>
 struct lsOutMessage : lsBaseOutMessage {
   // All derived types need to reflect on the |jsonrpc| member.
   std::string jsonrpc = "2.0";
 
-  // Send the message to the language client by writing it to stdout.
-  void Write(std::ostream& out) override {
-    rapidjson::StringBuffer output;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+  using lsBaseOutMessage::Write;
+  void Write(std::string* out) override {
+    std::unique_ptr<rapidjson::StringBuffer> output = TakeOutputBuffer();
+    rapidjson::Writer<rapidjson::StringBuffer> writer(*output);
     JsonWriter json_writer(&writer);
     auto that = static_cast<TDerived*>(this);
     Reflect(json_writer, *that);
 
-    out << "Content-Length: " << output.GetSize();
-    out << (char)13 << char(10) << char(13) << char(10);  // CRLFCRLF
-    out << output.GetString();
-    out.flush();
+    AppendOutMessage(output->GetString(), output->GetSize(), out);
+    ReturnOutputBuffer(std::move(output));
   }
 };
 
@@ -137,6 +154,10 @@ template <typename TVisitor>
 void Reflect(TVisitor& visitor, lsDocumentUri& value) {
   Reflect(visitor, value.raw_uri);
 }
+inline void WriteDirectJson(DirectJsonWriter& writer,
+                            const lsDocumentUri& value) {
+  WriteDirectJson(writer, value.raw_uri);
+}
 
 struct lsPosition {
   lsPosition();
@@ -153,7 +174,7 @@ struct lsPosition {
   static const lsPosition kZeroPosition;
 };
 MAKE_HASHABLE(lsPosition, t.line, t.character);
-MAKE_REFLECT_STRUCT(lsPosition, line, character);
+MAKE_REFLECT_STRUCT_DIRECT_JSON(lsPosition, line, character);
 
 struct lsRange {
   lsRange();
@@ -165,7 +186,7 @@ struct lsRange {
   lsPosition end;
 };
 MAKE_HASHABLE(lsRange, t.start, t.end);
-MAKE_REFLECT_STRUCT(lsRange, start, end);
+MAKE_REFLECT_STRUCT_DIRECT_JSON(lsRange, start, end);
 
 struct lsLocation {
   lsLocation();
@@ -177,7 +198,7 @@ struct lsLocation {
   lsRange range;
 };
 MAKE_HASHABLE(lsLocation, t.uri, t.range);
-MAKE_REFLECT_STRUCT(lsLocation, uri, range);
+MAKE_REFLECT_STRUCT_DIRECT_JSON(lsLocation, uri, range);
 
 enum class lsSymbolKind : int {
   File = 1,
@@ -282,7 +303,7 @@ struct lsTextEdit {
 
   bool operator==(const lsTextEdit& that);
 };
-MAKE_REFLECT_STRUCT(lsTextEdit, range, newText);
+MAKE_REFLECT_STRUCT_DIRECT_JSON(lsTextEdit, range, newText);
 
 // Defines whether the insert text in a completion item should be interpreted as
 // plain text or a snippet.
@@ -400,16 +421,16 @@ struct lsCompletionItem {
   // |label|.
   const std::string& InsertedContent() const;
 };
-MAKE_REFLECT_STRUCT(lsCompletionItem,
-                    label,
-                    kind,
-                    detail,
-                    documentation,
-                    sortText,
-                    insertText,
-                    filterText,
-                    insertTextFormat,
-                    textEdit);
+MAKE_REFLECT_STRUCT_DIRECT_JSON(lsCompletionItem,
+                                label,
+                                kind,
+                                detail,
+                                documentation,
+                                sortText,
+                                insertText,
+                                filterText,
+                                insertTextFormat,
+                                textEdit);
 
 struct lsTextDocumentItem {
   // The text document's URI.
@@ -552,10 +573,16 @@ MAKE_REFLECT_STRUCT(Out_Error::lsResponseError, code, message);
 MAKE_REFLECT_STRUCT(Out_Error, jsonrpc, id, error);
 
 // Cancel an existing request.
-struct Ipc_CancelRequest : public RequestMessage<Ipc_CancelRequest> {
+struct Ipc_CancelRequest : public NotificationMessage<Ipc_CancelRequest> {
   static const IpcId kIpcId = IpcId::CancelRequest;
+  struct Params {
+    // The request id to cancel.
+    lsRequestId id;
+  };
+  Params params;
 };
-MAKE_REFLECT_STRUCT(Ipc_CancelRequest, id);
+MAKE_REFLECT_STRUCT(Ipc_CancelRequest::Params, id);
+MAKE_REFLECT_STRUCT(Ipc_CancelRequest, params);
 
 // Diagnostics
 struct Out_TextDocumentPublishDiagnostics
@@ -654,6 +681,13 @@ struct Out_Progress : public lsOutMessage<Out_Progress> {
     int onIdMappedCount = 0;
     int onIndexedCount = 0;
     int activeThreads = 0;
+    // Whether parsing is paused because later stages are backed up, and the
+    // total time it has been paused in milliseconds.
+    bool parseStalled = false;
+    long long stallMs = 0;
+    // See GetMemoryUsage. The querydb entries are refreshed every few
+    // seconds while importing.
+    std::vector<MemoryUsage> memoryUsage;
   };
   std::string method = "$cquery/progress";
   Params params;
@@ -664,7 +698,10 @@ MAKE_REFLECT_STRUCT(Out_Progress::Params,
                     loadPreviousIndexCount,
                     onIdMappedCount,
                     onIndexedCount,
-                    activeThreads);
+                    activeThreads,
+                    parseStalled,
+                    stallMs,
+                    memoryUsage);
 MAKE_REFLECT_STRUCT(Out_Progress, jsonrpc, method, params);
 
 struct Out_CquerySetInactiveRegion
@@ -682,5 +719,8 @@ MAKE_REFLECT_STRUCT(Out_CquerySetInactiveRegion, jsonrpc, method, params);
 struct Out_LocationList : public lsOutMessage<Out_LocationList> {
   lsRequestId id;
   std::vector<lsLocation> result;
+  // cquery extension: set if |result| may be incomplete because files which
+  // may add to it are still being indexed, see CountPendingFiles.
+  optional<int> pendingFiles;
 };
-MAKE_REFLECT_STRUCT(Out_LocationList, jsonrpc, id, result);
+MAKE_REFLECT_STRUCT(Out_LocationList, jsonrpc, id, result, pendingFiles);
@@ -84,7 +84,7 @@ void DecorateIncludePaths(const std::smatch& match,
 }
 
 // TODO: eliminate |line_number| param.
-optional<lsRange> ExtractQuotedRange(int line_number, const std::string& line) {
+optional<lsRange> ExtractQuotedRange(int line_number, std::string_view line) {
   // Find starting and ending quote.
   int start = 0;
   while (start < line.size()) {
@@ -96,7 +96,7 @@ optional<lsRange> ExtractQuotedRange(int line_number, const std::string& line) {
   if (start == line.size())
     return nullopt;
 
-  int end = (int)line.size();
+  int end = (int)line.size() - 1;
   while (end > 0) {
     char c = line[end];
     if (c == '"' || c == '>')
@@ -220,6 +220,92 @@ std::string LexWordAroundPos(lsPosition position, const std::string& content) {
   return content.substr(start, end - start + 1);
 }
 
+std::vector<std::string> LexScopesAroundPos(lsPosition position,
+                                            const std::string& content) {
+  auto is_identifier_char = [](char c) { return isalnum(c) || c == '_'; };
+  int start = std::min(GetOffsetForPosition(position, content),
+                       int(content.size()));
+  while (start > 0 && is_identifier_char(content[start - 1]))
+    start--;
+
+  // The qualifier written before the word, ie, "b::" for "b::foo".
+  std::string qualifier;
+  while (start >= 2 && content[start - 1] == ':' && content[start - 2] == ':') {
+    int name_start = start - 2;
+    while (name_start > 0 && is_identifier_char(content[name_start - 1]))
+      name_start--;
+    qualifier = content.substr(name_start, start - name_start) + qualifier;
+    start = name_start;
+    // "::foo" is only looked up in the global namespace.
+    if (qualifier.compare(0, 2, "::") == 0)
+      return {qualifier.substr(2)};
+  }
+
+  // |names| has the namespace opened by each enclosing brace, which is empty
+  // for other braces. |usings| has the namespaces of using-directives with
+  // the number of braces enclosing them.
+  std::vector<std::string> names;
+  std::vector<std::pair<size_t, std::string>> usings;
+  enum { kNone, kUsing, kNamespace, kUsingNamespace } state = kNone;
+  std::string name;
+  for (int i = 0; i < start;) {
+    char c = content[i];
+    if (is_identifier_char(c)) {
+      int word_start = i;
+      while (i < start && is_identifier_char(content[i]))
+        i++;
+      std::string word = content.substr(word_start, i - word_start);
+      if (word == "using") {
+        state = kUsing;
+      } else if (word == "namespace") {
+        state = state == kUsing ? kUsingNamespace : kNamespace;
+        name.clear();
+      } else if (state == kNamespace || state == kUsingNamespace) {
+        name += word + "::";
+      } else if (word != "inline") {
+        state = kNone;
+      }
+      continue;
+    }
+
+    if (c == '{') {
+      names.push_back(state == kNamespace ? name : "");
+      state = kNone;
+    } else if (c == '}') {
+      if (!names.empty())
+        names.pop_back();
+      while (!usings.empty() && usings.back().first > names.size())
+        usings.pop_back();
+      state = kNone;
+    } else if (c == ';') {
+      if (state == kUsingNamespace && !name.empty())
+        usings.emplace_back(names.size(), name);
+      state = kNone;
+    } else if (c != ':' && !isspace(c)) {
+      state = kNone;
+    }
+    i++;
+  }
+
+  std::vector<std::string> enclosing(1);
+  for (const std::string& enclosing_name : names) {
+    if (!enclosing_name.empty())
+      enclosing.push_back(enclosing.back() + enclosing_name);
+  }
+  std::vector<std::string> scopes(enclosing.rbegin(), enclosing.rend() - 1);
+  for (auto it = usings.rbegin(); it != usings.rend(); ++it)
+    scopes.push_back(it->second);
+  scopes.push_back("");
+
+  std::vector<std::string> result;
+  for (const std::string& scope : scopes) {
+    std::string qualified = scope + qualifier;
+    if (std::find(result.begin(), result.end(), qualified) == result.end())
+      result.push_back(qualified);
+  }
+  return result;
+}
+
 bool SubsequenceMatch(std::string_view search, std::string_view content) {
   size_t j = 0;
   for (size_t i = 0; i < search.size(); i++) {
@@ -317,6 +403,40 @@ TEST_SUITE("Substring") {
   }
 }
 
+TEST_SUITE("LexScopesAroundPos") {
+  TEST_CASE("enclosing namespaces") {
+    std::string content =
+        "namespace a {\n"
+        "namespace b {\n"
+        "void f() {\n"
+        "  if (x) { qux(); }\n"
+        "  zed();\n";
+    REQUIRE(LexScopesAroundPos(CharPos(content, 'q'), content) ==
+            std::vector<std::string>({"a::b::", "a::", ""}));
+    REQUIRE(LexScopesAroundPos(CharPos(content, 'z'), content) ==
+            std::vector<std::string>({"a::b::", "a::", ""}));
+  }
+
+  TEST_CASE("using-directives") {
+    std::string content =
+        "namespace a::b { using namespace c; }\n"
+        "using namespace std;\n"
+        "namespace {\n"
+        "using std::string;\n"
+        "foo";
+    REQUIRE(LexScopesAroundPos(CharPos(content, 'f'), content) ==
+            std::vector<std::string>({"std::", ""}));
+  }
+
+  TEST_CASE("qualifiers") {
+    std::string content = "namespace a { x::y::foo ::z::bar";
+    REQUIRE(LexScopesAroundPos(CharPos(content, 'f'), content) ==
+            std::vector<std::string>({"a::x::y::", "x::y::"}));
+    REQUIRE(LexScopesAroundPos(CharPos(content, 'r'), content) ==
+            std::vector<std::string>({"z::"}));
+  }
+}
+
 TEST_SUITE("LexFunctionDeclaration") {
   TEST_CASE("simple") {
     std::string buffer_content = " void Foo(); ";
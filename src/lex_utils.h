@@ -7,6 +7,7 @@
 #include <regex>
 #include <string>
 #include <tuple>
+#include <vector>
 
 // Utility method to map |position| to an offset inside of |content|.
 int GetOffsetForPosition(lsPosition position, std::string_view content);
@@ -28,7 +29,7 @@ void DecorateIncludePaths(const std::smatch& match,
                           std::vector<lsCompletionItem>* items);
 
 // TODO: eliminate |line_number| param.
-optional<lsRange> ExtractQuotedRange(int line_number, const std::string& line);
+optional<lsRange> ExtractQuotedRange(int line_number, std::string_view line);
 
 void LexFunctionDeclaration(const std::string& buffer_content,
                             lsPosition declaration_spelling,
@@ -38,6 +39,15 @@ void LexFunctionDeclaration(const std::string& buffer_content,
 
 std::string LexWordAroundPos(lsPosition position, const std::string& content);
 
+// Returns the scopes in which the word at |position| may be declared, most
+// likely first, as qualifiers ending with "::" ("" being the global scope).
+// They are the namespaces enclosing |position| and the namespaces of the
+// using-directives before it, each followed by the qualifier written before
+// the word. Only braces and namespace keywords are lexed, so this is a guess
+// for buffers which are not indexed.
+std::vector<std::string> LexScopesAroundPos(lsPosition position,
+                                            const std::string& content);
+
 // Case-insensitive subsequence matching.
 bool SubsequenceMatch(std::string_view search, std::string_view content);
 
@@ -1,13 +1,13 @@
 #pragma once
 
-#include <algorithm>
 #include <cassert>
-#include <limits>
+#include <list>
 #include <memory>
-#include <vector>
+#include <unordered_map>
 
-// Cache that evicts old entries which have not been used recently. Implemented
-// using array/linear search so this works well for small array sizes.
+// Cache that evicts old entries which have not been used recently. Entries are
+// kept in a list ordered by last use and indexed by a hash map, so every
+// operation besides iteration takes constant time.
 template <typename TKey, typename TValue>
 struct LruCache {
   explicit LruCache(int max_entries);
@@ -21,33 +21,31 @@ struct LruCache {
   std::shared_ptr<TValue> TryGet(const TKey& key);
   // TryGetEntry, except the entry is removed from the cache.
   std::shared_ptr<TValue> TryTake(const TKey& key);
-  // Inserts an entry. Evicts the oldest unused entry if there is no space.
+  // Removes and returns the least recently used entry, or null if the cache is
+  // empty.
+  std::shared_ptr<TValue> TryTakeOldest();
+  // Inserts an entry, replacing any existing entry for |key|. Evicts the
+  // oldest unused entry if there is no space.
   void Insert(const TKey& key, const std::shared_ptr<TValue>& value);
 
-  // Call |func| on existing entries. If |func| returns false iteration
-  // temrinates early.
+  // Call |func| on existing entries, most recently used first. If |func|
+  // returns false iteration temrinates early.
   template <typename TFunc>
   void IterateValues(TFunc func);
 
+  size_t size() const { return entries_.size(); }
+
  private:
-  // There is a global score counter, when we access an element we increase
-  // its score to the current global value, so it has the highest overall
-  // score. This means that the oldest/least recently accessed value has the
-  // lowest score.
-  //
-  // There is a bit of special logic to handle score overlow.
   struct Entry {
-    uint32_t score = 0;
     TKey key;
     std::shared_ptr<TValue> value;
-    bool operator<(const Entry& other) const { return score < other.score; }
   };
+  using EntryList = std::list<Entry>;
 
-  void IncrementScore();
-
-  std::vector<Entry> entries_;
-  int max_entries_ = 1;
-  uint32_t next_score_ = 0;
+  // Most recently used entry first.
+  EntryList entries_;
+  std::unordered_map<TKey, typename EntryList::iterator> index_;
+  size_t max_entries_ = 1;
 };
 
 template <typename TKey, typename TValue>
@@ -67,43 +65,56 @@ std::shared_ptr<TValue> LruCache<TKey, TValue>::Get(const TKey& key,
 
 template <typename TKey, typename TValue>
 std::shared_ptr<TValue> LruCache<TKey, TValue>::TryGet(const TKey& key) {
-  // Assign new score.
-  for (Entry& entry : entries_) {
-    if (entry.key == key) {
-      entry.score = next_score_;
-      IncrementScore();
-      return entry.value;
-    }
-  }
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return nullptr;
 
-  return nullptr;
+  // Move the entry to the front.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->value;
 }
 
 template <typename TKey, typename TValue>
 std::shared_ptr<TValue> LruCache<TKey, TValue>::TryTake(const TKey& key) {
-  for (size_t i = 0; i < entries_.size(); ++i) {
-    if (entries_[i].key == key) {
-      std::shared_ptr<TValue> copy = entries_[i].value;
-      entries_.erase(entries_.begin() + i);
-      return copy;
-    }
-  }
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return nullptr;
+
+  std::shared_ptr<TValue> copy = it->second->value;
+  entries_.erase(it->second);
+  index_.erase(it);
+  return copy;
+}
 
-  return nullptr;
+template <typename TKey, typename TValue>
+std::shared_ptr<TValue> LruCache<TKey, TValue>::TryTakeOldest() {
+  if (entries_.empty())
+    return nullptr;
+
+  std::shared_ptr<TValue> copy = entries_.back().value;
+  index_.erase(entries_.back().key);
+  entries_.pop_back();
+  return copy;
 }
 
 template <typename TKey, typename TValue>
 void LruCache<TKey, TValue>::Insert(const TKey& key,
                                     const std::shared_ptr<TValue>& value) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    it->second->value = value;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+
   if (entries_.size() >= max_entries_)
-    entries_.erase(std::min_element(entries_.begin(), entries_.end()));
+    TryTakeOldest();
 
   Entry entry;
-  entry.score = next_score_;
-  IncrementScore();
   entry.key = key;
   entry.value = value;
-  entries_.push_back(entry);
+  entries_.push_front(entry);
+  index_[key] = entries_.begin();
 }
 
 template <typename TKey, typename TValue>
@@ -114,13 +125,3 @@ void LruCache<TKey, TValue>::IterateValues(TFunc func) {
       break;
   }
 }
-
-template <typename TKey, typename TValue>
-void LruCache<TKey, TValue>::IncrementScore() {
-  // Overflow.
-  if (++next_score_ == 0) {
-    std::sort(entries_.begin(), entries_.end());
-    for (Entry& entry : entries_)
-      entry.score = next_score_++;
-  }
-}
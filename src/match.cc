@@ -2,10 +2,82 @@
 
 #include "language_server_api.h"
 #include "queue_manager.h"
+#include "utils.h"
 
 #include <doctest/doctest.h>
+
+#include <cctype>
+#include <cstring>
 #include <iostream>
 
+namespace {
+
+std::string ToLower(std::string s) {
+  for (char& c : s)
+    c = char(tolower((unsigned char)c));
+  return s;
+}
+
+// Returns true if |lower| equals |value|, ignoring the case of |value|.
+bool EqualsLower(const char* value, const std::string& lower) {
+  for (size_t i = 0; i < lower.size(); i++) {
+    if (tolower((unsigned char)value[i]) != lower[i])
+      return false;
+  }
+  return true;
+}
+
+// Returns the string |pattern| matches if it has no special regex characters,
+// ie, "\.cc" is ".cc".
+optional<std::string> GetLiteral(const std::string& pattern) {
+  std::string result;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if (c == '\\') {
+      // Escaped punctuation is literal; escapes such as \d or \b are not.
+      if (i + 1 == pattern.size() || isalnum((unsigned char)pattern[i + 1]))
+        return nullopt;
+      result += pattern[++i];
+    } else if (strchr(".[]()*+?{}|^$", c)) {
+      return nullopt;
+    } else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+void SetLiteral(Matcher* m) {
+  std::string pattern = m->regex_string;
+  if (pattern.empty() || pattern == ".*") {
+    m->literal_kind = Matcher::Literal::Any;
+    return;
+  }
+  bool anchor_start = pattern[0] == '^';
+  if (anchor_start)
+    pattern.erase(0, 1);
+  // A trailing $ is an anchor unless it is escaped.
+  bool anchor_end =
+      !pattern.empty() && pattern.back() == '$' &&
+      (pattern.size() < 2 || pattern[pattern.size() - 2] != '\\');
+  if (anchor_end)
+    pattern.pop_back();
+  optional<std::string> literal = GetLiteral(pattern);
+  if (!literal)
+    return;
+  m->literal = ToLower(*literal);
+  if (anchor_start && anchor_end)
+    m->literal_kind = Matcher::Literal::Exact;
+  else if (anchor_start)
+    m->literal_kind = Matcher::Literal::Prefix;
+  else if (anchor_end)
+    m->literal_kind = Matcher::Literal::Suffix;
+  else
+    m->literal_kind = Matcher::Literal::Substring;
+}
+
+}  // namespace
+
 // static
 optional<Matcher> Matcher::Create(const std::string& search) {
   /*
@@ -21,6 +93,9 @@ optional<Matcher> Matcher::Create(const std::string& search) {
   try {
     Matcher m;
     m.regex_string = search;
+    SetLiteral(&m);
+    if (m.literal_kind != Literal::None)
+      return m;
     m.regex = std::regex(
         search, std::regex_constants::ECMAScript | std::regex_constants::icase |
                     std::regex_constants::optimize
@@ -39,6 +114,31 @@ optional<Matcher> Matcher::Create(const std::string& search) {
 }
 
 bool Matcher::IsMatch(const std::string& value) const {
+  if (literal_kind == Literal::Any)
+    return true;
+  if (literal_kind != Literal::None) {
+    if (value.size() < literal.size())
+      return false;
+    size_t last = value.size() - literal.size();
+    switch (literal_kind) {
+      case Literal::Substring: {
+        // Find candidates by the first character in either case.
+        const char first[] = {literal[0], char(toupper(literal[0])), '\0'};
+        for (size_t i = value.find_first_of(first); i <= last;
+             i = value.find_first_of(first, i + 1)) {
+          if (EqualsLower(value.c_str() + i, literal))
+            return true;
+        }
+        return false;
+      }
+      case Literal::Prefix:
+        return EqualsLower(value.c_str(), literal);
+      case Literal::Suffix:
+        return EqualsLower(value.c_str() + last, literal);
+      default:
+        return last == 0 && EqualsLower(value.c_str(), literal);
+    }
+  }
   // std::smatch match;
   // return std::regex_match(value, match, regex);
   return std::regex_search(value, regex, std::regex_constants::match_any);
@@ -77,6 +177,27 @@ bool GroupMatch::IsMatch(const std::string& value,
 }
 
 TEST_SUITE("Matcher") {
+  TEST_CASE("literal patterns") {
+    std::vector<std::string> paths = {"/w/src/Foo.cc", "/w/src/foo.h",
+                                      "/w/third_party/a.cc", "foo.cc", ""};
+    for (std::string pattern :
+         {"", ".*", "src", "\\.cc", "\\.cc$", "^/w/src/", "^foo\\.cc$",
+          "FOO", "third_party/.*\\.cc", "s.c"}) {
+      optional<Matcher> m = Matcher::Create(pattern);
+      REQUIRE(m);
+      std::regex regex(pattern, std::regex_constants::ECMAScript |
+                                    std::regex_constants::icase);
+      for (const std::string& path : paths) {
+        REQUIRE(m->IsMatch(path) ==
+                std::regex_search(path, regex,
+                                  std::regex_constants::match_any));
+      }
+    }
+    REQUIRE(Matcher::Create("\\.cc$")->literal_kind ==
+            Matcher::Literal::Suffix);
+    REQUIRE(Matcher::Create("s.c")->literal_kind == Matcher::Literal::None);
+  }
+
   TEST_CASE("sanity") {
     // Matcher m("abc");
     // TODO: check case
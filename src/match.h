@@ -11,8 +11,16 @@ struct Matcher {
 
   bool IsMatch(const std::string& value) const;
 
+  // Patterns which are a plain string, optionally anchored with ^ and $, are
+  // matched without running |regex|; most whitelist and blacklist entries are
+  // directory names or file extensions.
+  enum class Literal { None, Any, Substring, Prefix, Suffix, Exact };
+
   std::string regex_string;
   std::regex regex;
+  Literal literal_kind = Literal::None;
+  // Lower case, since patterns are case insensitive.
+  std::string literal;
 };
 
 // Check multiple |Matcher| instances at the same time.
@@ -0,0 +1,173 @@
+#include "memory_governor.h"
+
+#include "config.h"
+#include "platform.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <chrono>
+
+namespace {
+
+const long long kCheckIntervalMs = 1000;
+// How often the shedders run again while the pressure does not rise.
+const long long kShedIntervalMs = 10000;
+
+long long GetCurrentTimeInMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             Timer::Clock::now().time_since_epoch())
+      .count();
+}
+
+const char* ToString(MemoryPressure pressure) {
+  switch (pressure) {
+    case MemoryPressure::None:
+      break;
+    case MemoryPressure::Soft:
+      return "soft";
+    case MemoryPressure::Hard:
+      return "hard";
+  }
+  return "no";
+}
+
+}  // namespace
+
+// static
+MemoryPressure MemoryGovernor::ComputePressure(Config* config,
+                                               const Signals& signals) {
+  auto is_past = [&](int limit_mb, MemoryPressure level) {
+    if (limit_mb < 1)
+      return false;
+    double limit = signals.pressure >= level ? limit_mb * 0.9 : limit_mb;
+    return signals.memory_mb >= limit;
+  };
+  if (is_past(config->memoryHardLimitMb, MemoryPressure::Hard))
+    return MemoryPressure::Hard;
+  if (is_past(config->memorySoftLimitMb, MemoryPressure::Soft))
+    return MemoryPressure::Soft;
+  if (config->memoryStallPercent > 0 &&
+      signals.stall_percent >= config->memoryStallPercent) {
+    return MemoryPressure::Soft;
+  }
+  return MemoryPressure::None;
+}
+
+void MemoryGovernor::Init(Config* config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  config_ = config;
+}
+
+void MemoryGovernor::AddShedder(const Shedder& shedder) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  shedders_.push_back(shedder);
+}
+
+MemoryPressure MemoryGovernor::CheckPressure() {
+  long long now = GetCurrentTimeInMilliseconds();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!config_ || now < next_check_ms_)
+    return pressure_;
+  next_check_ms_ = now + kCheckIntervalMs;
+  if (config_->memorySoftLimitMb < 1 && config_->memoryHardLimitMb < 1 &&
+      config_->memoryStallPercent < 1) {
+    return pressure_;
+  }
+
+  Signals signals;
+  signals.memory_mb = GetProcessMemoryUsedInMb();
+  signals.stall_percent = GetMemoryStallPercent().value_or(-1);
+  signals.pressure = pressure_;
+  MemoryPressure pressure = ComputePressure(config_, signals);
+  if (pressure != signals.pressure) {
+    LOG_S(INFO) << "Memory pressure changed from " << ToString(signals.pressure)
+                << " to " << ToString(pressure) << " at "
+                << int(signals.memory_mb) << "MB, "
+                << signals.stall_percent << "% stalled";
+  }
+  memory_mb_ = signals.memory_mb;
+  stall_percent_ = signals.stall_percent;
+  pressure_ = pressure;
+  return pressure;
+}
+
+void MemoryGovernor::ShedIfNeeded() {
+  MemoryPressure pressure = CheckPressure();
+  long long now = GetCurrentTimeInMilliseconds();
+  std::vector<Shedder> shedders;
+  double memory_mb, stall_percent;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pressure == MemoryPressure::None) {
+      shed_pressure_ = pressure;
+      return;
+    }
+    if (pressure <= shed_pressure_ && now < next_shed_ms_)
+      return;
+    shed_pressure_ = pressure;
+    next_shed_ms_ = now + kShedIntervalMs;
+    shedders = shedders_;
+    memory_mb = memory_mb_;
+    stall_percent = stall_percent_;
+  }
+
+  std::string shed;
+  for (const Shedder& shedder : shedders) {
+    std::string freed = shedder(pressure);
+    if (!freed.empty())
+      shed += (shed.empty() ? "" : ", ") + freed;
+  }
+  FreeUnusedMemory();
+  LOG_S(WARNING) << "Under " << ToString(pressure) << " memory pressure at "
+                 << int(memory_mb) << "MB (soft limit "
+                 << config_->memorySoftLimitMb << "MB, hard limit "
+                 << config_->memoryHardLimitMb << "MB, " << stall_percent
+                 << "% stalled); dropped " << (shed.empty() ? "nothing" : shed)
+                 << ", now at " << int(GetProcessMemoryUsedInMb()) << "MB";
+}
+
+TEST_SUITE("MemoryGovernor") {
+  TEST_CASE("pressure") {
+    Config config;
+    MemoryGovernor::Signals signals;
+    signals.memory_mb = 5000;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::None);
+
+    config.memorySoftLimitMb = 1000;
+    config.memoryHardLimitMb = 2000;
+    signals.memory_mb = 900;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::None);
+    signals.memory_mb = 1500;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::Soft);
+    signals.memory_mb = 2000;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::Hard);
+
+    // Pressure only ends below 90% of the limit.
+    signals.pressure = MemoryPressure::Hard;
+    signals.memory_mb = 1850;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::Hard);
+    signals.memory_mb = 1750;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::Soft);
+    signals.pressure = MemoryPressure::Soft;
+    signals.memory_mb = 950;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::Soft);
+    signals.memory_mb = 850;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::None);
+
+    config.memoryStallPercent = 10;
+    signals.stall_percent = 20;
+    REQUIRE(MemoryGovernor::ComputePressure(&config, signals) ==
+            MemoryPressure::Soft);
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Config;
+
+enum class MemoryPressure { None = 0, Soft = 1, Hard = 2 };
+
+// Sheds memory when cquery gets close to running out of it, so that it does
+// not lose all of its state to the OOM killer; see Config::memorySoftLimitMb
+// and Config::memoryHardLimitMb. The subsystems which can rebuild their data
+// register shedders, and indexers stop parsing new files while there is any
+// pressure, which stops the import queues from growing.
+class MemoryGovernor {
+ public:
+  // What ComputePressure bases its decision on.
+  struct Signals {
+    // Resident memory of the process, see GetProcessMemoryUsedInMb.
+    double memory_mb = 0;
+    // Share of time the cgroup of the process stalled on memory, see
+    // GetMemoryStallPercent, or a negative value if unknown.
+    double stall_percent = -1;
+    // The pressure at the previous check.
+    MemoryPressure pressure = MemoryPressure::None;
+  };
+  // Returns the pressure for |signals|. A limit counts as passed until memory
+  // drops below 90% of it, so that the pressure does not flip on every check.
+  static MemoryPressure ComputePressure(Config* config,
+                                        const Signals& signals);
+
+  // Frees memory for |pressure|, which is never None. Returns what it freed,
+  // for the log, or an empty string if there was nothing to free.
+  using Shedder = std::function<std::string(MemoryPressure pressure)>;
+
+  void Init(Config* config);
+  // Shedders run on the thread which calls ShedIfNeeded.
+  void AddShedder(const Shedder& shedder);
+  // Checks the memory of the process at most once a second and returns the
+  // pressure. Safe to call from any thread.
+  MemoryPressure CheckPressure();
+  // Runs the shedders when the pressure rises, and again every few seconds
+  // while it lasts, since the subsystems keep allocating.
+  void ShedIfNeeded();
+
+  // The pressure at the last check.
+  MemoryPressure pressure() const { return pressure_; }
+
+ private:
+  Config* config_ = nullptr;
+  std::atomic<MemoryPressure> pressure_{MemoryPressure::None};
+
+  std::mutex mutex_;
+  // Guarded by |mutex_|.
+  std::vector<Shedder> shedders_;
+  long long next_check_ms_ = 0;
+  double memory_mb_ = 0;
+  double stall_percent_ = -1;
+  // The pressure the shedders last ran for, and when they run again.
+  MemoryPressure shed_pressure_ = MemoryPressure::None;
+  long long next_shed_ms_ = 0;
+};
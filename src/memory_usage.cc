@@ -0,0 +1,321 @@
+#include "memory_usage.h"
+
+#include "indexer.h"
+#include "query.h"
+#include "utils.h"
+#include "working_files.h"
+
+#include <doctest/doctest.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+// Strings this short are stored inline by common standard libraries.
+const size_t kInlineStringCapacity = 15;
+
+std::mutex& GetRegistryMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::map<std::string, std::unique_ptr<MemoryGauge>>& GetRegistry() {
+  static std::map<std::string, std::unique_ptr<MemoryGauge>> registry;
+  return registry;
+}
+
+// The overloads below would hide the ones from the header.
+using ::HeapBytes;
+
+// The overloads below call each other, so declare them all first.
+size_t HeapBytes(const InternedString&);
+size_t HeapBytes(const IndexInclude& include);
+size_t HeapBytes(const lsDiagnostic& diagnostic);
+size_t HeapBytes(const IndexFunc::Declaration& declaration);
+size_t HeapBytes(const QueryFile::Def& def);
+size_t HeapBytes(const QueryFile::DefUpdate& update);
+size_t HeapBytes(const IndexType& type);
+size_t HeapBytes(const IndexFunc& func);
+size_t HeapBytes(const IndexVar& var);
+size_t HeapBytes(const QueryFile& file);
+size_t HeapBytes(const QueryType& type);
+size_t HeapBytes(const QueryFunc& func);
+size_t HeapBytes(const QueryVar& var);
+template <typename... T>
+size_t HeapBytes(const TypeDefDefinitionData<T...>& def);
+template <typename... T>
+size_t HeapBytes(const FuncDefDefinitionData<T...>& def);
+template <typename... T>
+size_t HeapBytes(const VarDefDefinitionData<T...>& def);
+template <typename T>
+size_t HeapBytes(const optional<T>& value);
+template <typename T>
+size_t HeapBytes(const WithUsr<T>& value);
+template <typename TId, typename TValue>
+size_t HeapBytes(const MergeableUpdate<TId, TValue>& update);
+
+// Node based maps allocate every entry separately, with a next pointer and a
+// cached hash, besides the bucket array.
+template <typename TMap>
+size_t NodeMapBytes(const TMap& map) {
+  return map.bucket_count() * sizeof(void*) +
+         map.size() * (sizeof(typename TMap::value_type) + 2 * sizeof(void*));
+}
+
+// sparsepp keeps the entries in groups with a few bits of bookkeeping per
+// bucket.
+template <typename TMap>
+size_t SparseMapBytes(const TMap& map) {
+  return map.size() * sizeof(typename TMap::value_type) +
+         map.bucket_count() / 4;
+}
+
+// Interned names are shared, see the "interned_strings" gauge.
+size_t HeapBytes(const InternedString&) {
+  return 0;
+}
+
+size_t HeapBytes(const IndexInclude& include) {
+  return HeapBytes(include.resolved_path);
+}
+
+size_t HeapBytes(const lsDiagnostic& diagnostic) {
+  size_t bytes = HeapBytes(diagnostic.source) +
+                 HeapBytes(diagnostic.message) +
+                 HeapBytes(diagnostic.fixits_);
+  for (const lsTextEdit& fixit : diagnostic.fixits_)
+    bytes += HeapBytes(fixit.newText);
+  return bytes;
+}
+
+size_t HeapBytes(const IndexFunc::Declaration& declaration) {
+  return HeapBytes(declaration.content) +
+         HeapBytes(declaration.param_spellings);
+}
+
+template <typename T>
+size_t DeepHeapBytes(const std::vector<T>& values) {
+  size_t bytes = HeapBytes(values);
+  for (const T& value : values)
+    bytes += HeapBytes(value);
+  return bytes;
+}
+
+template <typename... T>
+size_t HeapBytes(const TypeDefDefinitionData<T...>& def) {
+  return HeapBytes(def.detailed_name) + HeapBytes(def.hover) +
+         HeapBytes(def.comments) + HeapBytes(def.parents) +
+         HeapBytes(def.types) + HeapBytes(def.funcs) + HeapBytes(def.vars);
+}
+
+template <typename... T>
+size_t HeapBytes(const FuncDefDefinitionData<T...>& def) {
+  return HeapBytes(def.detailed_name) + HeapBytes(def.hover) +
+         HeapBytes(def.comments) + HeapBytes(def.base) +
+         HeapBytes(def.locals) + HeapBytes(def.callees);
+}
+
+template <typename... T>
+size_t HeapBytes(const VarDefDefinitionData<T...>& def) {
+  return HeapBytes(def.detailed_name) + HeapBytes(def.hover) +
+         HeapBytes(def.comments);
+}
+
+template <typename T>
+size_t HeapBytes(const optional<T>& value) {
+  return value ? HeapBytes(*value) : 0;
+}
+
+template <typename T>
+size_t HeapBytes(const WithUsr<T>& value) {
+  return HeapBytes(value.value);
+}
+
+template <typename TId, typename TValue>
+size_t HeapBytes(const MergeableUpdate<TId, TValue>& update) {
+  return HeapBytes(update.to_add) + HeapBytes(update.to_remove);
+}
+
+size_t HeapBytes(const QueryFile::Def& def) {
+  return HeapBytes(def.path) + HeapBytes(def.language) +
+         HeapBytes(def.includes) + HeapBytes(def.outline) +
+         HeapBytes(def.all_symbols) + HeapBytes(def.inactive_regions) +
+         HeapBytes(def.dependencies);
+}
+
+size_t HeapBytes(const QueryFile::DefUpdate& update) {
+  return HeapBytes(update.value) +
+         (update.file_content ? HeapBytes(*update.file_content) : 0);
+}
+
+size_t HeapBytes(const IndexType& type) {
+  return HeapBytes(type.def) + HeapBytes(type.derived) +
+         HeapBytes(type.instances) + HeapBytes(type.uses);
+}
+
+size_t HeapBytes(const IndexFunc& func) {
+  return HeapBytes(func.def) + DeepHeapBytes(func.declarations) +
+         HeapBytes(func.derived) + HeapBytes(func.callers);
+}
+
+size_t HeapBytes(const IndexVar& var) {
+  return HeapBytes(var.def) + HeapBytes(var.declarations) +
+         HeapBytes(var.uses);
+}
+
+size_t HeapBytes(const QueryFile& file) {
+  return HeapBytes(file.path) + HeapBytes(file.def) +
+         HeapBytes(file.symbols_max_end) + HeapBytes(file.symbols_by_idx);
+}
+
+size_t HeapBytes(const QueryType& type) {
+  return HeapBytes(type.def) + HeapBytes(type.derived) +
+         HeapBytes(type.instances) + HeapBytes(type.uses) +
+         HeapBytes(type.members);
+}
+
+size_t HeapBytes(const QueryFunc& func) {
+  return HeapBytes(func.def) + HeapBytes(func.declarations) +
+         HeapBytes(func.derived) + HeapBytes(func.callers);
+}
+
+size_t HeapBytes(const QueryVar& var) {
+  return HeapBytes(var.def) + HeapBytes(var.declarations) +
+         HeapBytes(var.uses);
+}
+
+template <typename T>
+void SetGauge(const char* name, const std::vector<T>& values) {
+  GetMemoryGauge(name)->Set(values.size(), DeepHeapBytes(values));
+}
+
+}  // namespace
+
+MemoryGauge* GetMemoryGauge(const std::string& name) {
+  std::lock_guard<std::mutex> lock(GetRegistryMutex());
+  std::unique_ptr<MemoryGauge>& gauge = GetRegistry()[name];
+  if (!gauge)
+    gauge.reset(new MemoryGauge());
+  return gauge.get();
+}
+
+std::vector<MemoryUsage> GetMemoryUsage() {
+  std::vector<MemoryUsage> result;
+  std::lock_guard<std::mutex> lock(GetRegistryMutex());
+  for (const auto& entry : GetRegistry()) {
+    MemoryUsage usage;
+    usage.name = entry.first;
+    usage.count = entry.second->count();
+    usage.bytes = entry.second->bytes();
+    result.push_back(usage);
+  }
+
+  MemoryUsage process;
+  process.name = "process";
+  process.count = 1;
+  process.bytes = int64_t(GetProcessMemoryUsedInMb() * 1000000);
+  result.push_back(process);
+  return result;
+}
+
+size_t HeapBytes(const std::string& value) {
+  return value.capacity() > kInlineStringCapacity ? value.capacity() + 1 : 0;
+}
+
+size_t HeapBytes(const std::vector<std::string>& value) {
+  size_t bytes = value.capacity() * sizeof(std::string);
+  for (const std::string& s : value)
+    bytes += HeapBytes(s);
+  return bytes;
+}
+
+size_t EstimateMemoryUsage(const IndexFile& file) {
+  const IdCache& ids = file.id_cache;
+  return sizeof(IndexFile) + HeapBytes(ids.primary_file) +
+         ids.usr_to_type_id.HeapBytes() + ids.usr_to_func_id.HeapBytes() +
+         ids.usr_to_var_id.HeapBytes() + HeapBytes(ids.type_id_to_usr) +
+         HeapBytes(ids.func_id_to_usr) + HeapBytes(ids.var_id_to_usr) +
+         HeapBytes(file.path) + HeapBytes(file.args) +
+         HeapBytes(file.import_file) +
+         HeapBytes(file.skipped_by_preprocessor) +
+         DeepHeapBytes(file.includes) + HeapBytes(file.dependencies) +
+         DeepHeapBytes(file.types) + DeepHeapBytes(file.funcs) +
+         DeepHeapBytes(file.vars) + DeepHeapBytes(file.diagnostics_) +
+         HeapBytes(file.file_contents) + NodeMapBytes(file.decl_to_usr);
+}
+
+size_t EstimateMemoryUsage(const IndexUpdate& update) {
+  return sizeof(IndexUpdate) + HeapBytes(update.files_removed) +
+         DeepHeapBytes(update.files_def_update) +
+         HeapBytes(update.types_removed) +
+         DeepHeapBytes(update.types_def_update) +
+         DeepHeapBytes(update.types_derived) +
+         DeepHeapBytes(update.types_instances) +
+         DeepHeapBytes(update.types_uses) + HeapBytes(update.funcs_removed) +
+         DeepHeapBytes(update.funcs_def_update) +
+         DeepHeapBytes(update.funcs_declarations) +
+         DeepHeapBytes(update.funcs_derived) +
+         DeepHeapBytes(update.funcs_callers) +
+         HeapBytes(update.vars_removed) +
+         DeepHeapBytes(update.vars_def_update) +
+         DeepHeapBytes(update.vars_declarations) +
+         DeepHeapBytes(update.vars_uses);
+}
+
+void UpdateQueryDbMemoryGauges(QueryDatabase* db) {
+  SetGauge("querydb.files", db->files);
+  SetGauge("querydb.types", db->types);
+  SetGauge("querydb.funcs", db->funcs);
+  SetGauge("querydb.vars", db->vars);
+
+  // Lookup tables from names, usrs and paths.
+  size_t bytes = HeapBytes(db->symbols) +
+                 db->symbol_search_index.EstimateMemoryUsage() +
+                 SparseMapBytes(db->usr_to_file) +
+                 SparseMapBytes(db->impl_file_by_stem) +
+                 SparseMapBytes(db->impl_file_by_header) +
+                 db->usr_to_type.EstimateMemoryUsage() +
+                 db->usr_to_func.EstimateMemoryUsage() +
+                 db->usr_to_var.EstimateMemoryUsage();
+  for (const auto& entry : db->usr_to_file)
+    bytes += HeapBytes(entry.first.path);
+  for (const auto& entry : db->impl_file_by_stem)
+    bytes += HeapBytes(entry.first);
+  for (const auto& entry : db->impl_file_by_header)
+    bytes += HeapBytes(entry.first);
+  GetMemoryGauge("querydb.symbols")->Set(db->symbols.size(), bytes);
+}
+
+void UpdateWorkingFilesMemoryGauge(WorkingFiles* working_files) {
+  int64_t count = 0;
+  int64_t bytes = 0;
+  working_files->DoAction([&]() {
+    for (const std::unique_ptr<WorkingFile>& file : working_files->files) {
+      count++;
+      bytes += sizeof(WorkingFile) + file->EstimateMemoryUsage();
+    }
+  });
+  GetMemoryGauge("working_files")->Set(count, bytes);
+}
+
+TEST_SUITE("MemoryUsage") {
+  TEST_CASE("strings") {
+    REQUIRE(HeapBytes(std::string()) == 0);
+    std::string long_string(100, 'a');
+    REQUIRE(HeapBytes(long_string) >= 101);
+    std::vector<std::string> strings(4, long_string);
+    REQUIRE(HeapBytes(strings) >=
+            4 * (sizeof(std::string) + HeapBytes(long_string)));
+  }
+
+  TEST_CASE("gauges") {
+    MemoryGauge* gauge = GetMemoryGauge("test.gauge");
+    REQUIRE(gauge == GetMemoryGauge("test.gauge"));
+    gauge->Set(2, 100);
+    gauge->Add(-1, -40);
+    REQUIRE(gauge->count() == 1);
+    REQUIRE(gauge->bytes() == 60);
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "serializer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct IndexFile;
+struct IndexUpdate;
+struct QueryDatabase;
+struct WorkingFiles;
+
+// Approximate memory used by one part of the server.
+struct MemoryUsage {
+  std::string name;
+  // Number of objects, eg. files or completion sessions.
+  int64_t count = 0;
+  int64_t bytes = 0;
+};
+MAKE_REFLECT_STRUCT(MemoryUsage, name, count, bytes);
+
+// Memory usage of a subsystem, published by the threads which own its data so
+// that it can be reported from any thread.
+class MemoryGauge {
+ public:
+  void Set(int64_t count, int64_t bytes) {
+    count_ = count;
+    bytes_ = bytes;
+  }
+  void Add(int64_t count, int64_t bytes) {
+    count_ += count;
+    bytes_ += bytes;
+  }
+
+  int64_t count() const { return count_; }
+  int64_t bytes() const { return bytes_; }
+
+ private:
+  std::atomic<int64_t> count_{0};
+  std::atomic<int64_t> bytes_{0};
+};
+
+// Returns the process wide gauge called |name|, creating it if needed. Like
+// GetLatencyHistogram, the gauge lives as long as the process.
+MemoryGauge* GetMemoryGauge(const std::string& name);
+
+// Returns the value of every gauge sorted by name, followed by the resident
+// memory of the process as "process".
+std::vector<MemoryUsage> GetMemoryUsage();
+
+// Approximate heap memory owned by |value|, not counting sizeof(value).
+size_t HeapBytes(const std::string& value);
+size_t HeapBytes(const std::vector<std::string>& value);
+// Only counts the elements themselves, not what they own.
+template <typename T, typename TAllocator>
+size_t HeapBytes(const std::vector<T, TAllocator>& value) {
+  return value.capacity() * sizeof(T);
+}
+
+size_t EstimateMemoryUsage(const IndexFile& file);
+size_t EstimateMemoryUsage(const IndexUpdate& update);
+
+// Publishes the "querydb.*" gauges. The caller must hold |db->mutex|.
+void UpdateQueryDbMemoryGauges(QueryDatabase* db);
+// Publishes the "working_files" gauge.
+void UpdateWorkingFilesMemoryGauge(WorkingFiles* working_files);
@@ -1,14 +1,30 @@
 #include "message_handler.h"
 
+#include "clang_complete.h"
+#include "import_pipeline.h"
+#include "indexer_throttle.h"
 #include "lex_utils.h"
 #include "project.h"
 #include "query_utils.h"
 #include "queue_manager.h"
 #include "semantic_highlight_symbol_cache.h"
+#include "shared_mutex.h"
+#include "threaded_queue.h"
+#include "timer.h"
+#include "timestamp_manager.h"
+#include "trace.h"
+#include "work_thread.h"
 
 #include <loguru.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace {
 struct ScanLineEvent {
@@ -21,6 +37,71 @@ struct ScanLineEvent {
     return !(pos == other.pos) ? pos < other.pos : other.end_pos < end_pos;
   }
 };
+
+using SemanticSymbol = Out_CqueryPublishSemanticHighlighting::Symbol;
+
+// Orders symbols by how they are highlighted; symbols which compare equal are
+// published as one.
+bool SemanticSymbolLess(const SemanticSymbol& a, const SemanticSymbol& b) {
+  return std::tie(a.stableId, a.parentKind, a.kind, a.storage) <
+         std::tie(b.stableId, b.parentKind, b.kind, b.storage);
+}
+
+bool RangeLess(const lsRange& a, const lsRange& b) {
+  return !(a.start == b.start) ? a.start < b.start : a.end < b.end;
+}
+
+// Ranges of |a| which are not in |b|. Both must be sorted.
+std::vector<lsRange> RangeDifference(const std::vector<lsRange>& a,
+                                     const std::vector<lsRange>& b) {
+  std::vector<lsRange> result;
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+                      std::back_inserter(result), RangeLess);
+  return result;
+}
+
+Out_CqueryPublishSemanticHighlightingDelta::Symbol MakeDeltaSymbol(
+    const SemanticSymbol& symbol) {
+  Out_CqueryPublishSemanticHighlightingDelta::Symbol result;
+  result.stableId = symbol.stableId;
+  result.parentKind = symbol.parentKind;
+  result.kind = symbol.kind;
+  result.storage = symbol.storage;
+  return result;
+}
+
+// Changes from |previous| to |current|, which are sorted by
+// SemanticSymbolLess.
+std::vector<Out_CqueryPublishSemanticHighlightingDelta::Symbol>
+GetSemanticHighlightingDelta(const std::vector<SemanticSymbol>& previous,
+                             const std::vector<SemanticSymbol>& current) {
+  std::vector<Out_CqueryPublishSemanticHighlightingDelta::Symbol> result;
+  size_t i = 0, j = 0;
+  while (i < current.size() || j < previous.size()) {
+    if (j == previous.size() ||
+        (i < current.size() && SemanticSymbolLess(current[i], previous[j]))) {
+      result.push_back(MakeDeltaSymbol(current[i]));
+      result.back().added = current[i++].ranges;
+    } else if (i == current.size() ||
+               SemanticSymbolLess(previous[j], current[i])) {
+      result.push_back(MakeDeltaSymbol(previous[j]));
+      result.back().removed = previous[j++].ranges;
+    } else {
+      std::vector<lsRange> added =
+          RangeDifference(current[i].ranges, previous[j].ranges);
+      std::vector<lsRange> removed =
+          RangeDifference(previous[j].ranges, current[i].ranges);
+      if (!added.empty() || !removed.empty()) {
+        result.push_back(MakeDeltaSymbol(current[i]));
+        result.back().added = std::move(added);
+        result.back().removed = std::move(removed);
+      }
+      i++;
+      j++;
+    }
+  }
+  return result;
+}
 }  // namespace
 
 MessageHandler::MessageHandler() {
@@ -34,6 +115,171 @@ MessageHandler::MessageHandler() {
 // static
 std::vector<MessageHandler*>* MessageHandler::message_handlers = nullptr;
 
+MessageHandler* FindMessageHandler(IpcId id) {
+  for (MessageHandler* handler : *MessageHandler::message_handlers) {
+    if (handler->GetId() == id)
+      return handler;
+  }
+  return nullptr;
+}
+
+namespace {
+std::atomic<int> num_querydb_readers{0};
+
+// The handler running on this thread and the message it handles, and the
+// event it suspended the message until.
+thread_local MessageHandler* current_handler = nullptr;
+thread_local BaseIpcMessage* current_message = nullptr;
+thread_local std::string awaited_event;
+thread_local bool awaited_event_holds_back = false;
+
+std::mutex suspended_mutex;
+// Suspended messages by the event they wait for.
+std::unordered_map<std::string, std::vector<std::unique_ptr<BaseIpcMessage>>>
+    suspended;
+// The message suspended by SuspendRequestAndLaterOnesUntil, and the messages
+// received after it in order. Guarded by |suspended_mutex|.
+BaseIpcMessage* holding_back_for = nullptr;
+std::vector<std::unique_ptr<BaseIpcMessage>> held_back;
+
+// Queues the suspended |messages| again, followed by the messages held back
+// behind one of them.
+void RunAgain(std::vector<std::unique_ptr<BaseIpcMessage>> messages) {
+  std::vector<std::unique_ptr<BaseIpcMessage>> held;
+  {
+    std::lock_guard<std::mutex> lock(suspended_mutex);
+    for (const std::unique_ptr<BaseIpcMessage>& message : messages) {
+      if (message.get() == holding_back_for) {
+        holding_back_for = nullptr;
+        held.swap(held_back);
+      }
+    }
+  }
+
+  auto* queue = QueueManager::instance();
+  for (std::unique_ptr<BaseIpcMessage>& message : messages) {
+    queue->StartRequest(message->GetRequestId());
+    queue->for_querydb.PriorityEnqueue(std::move(message));
+  }
+  // The held back requests were started when they were received.
+  for (std::unique_ptr<BaseIpcMessage>& message : held)
+    queue->for_querydb.PriorityEnqueue(std::move(message));
+}
+
+// Returns true if |path| is going to be imported: it is in the project, or it
+// was indexed before as a dependency of a translation unit. Any file may be
+// in a project which is still loading.
+bool WillBeImported(MessageHandler* handler, const std::string& path) {
+  const Project* project = handler->project;
+  return !project->is_loaded ||
+         project->absolute_path_to_entry_index_.find(path) !=
+             project->absolute_path_to_entry_index_.end() ||
+         handler->timestamp_manager->GetCheapestImporter(path);
+}
+}  // namespace
+
+void BeginHandlingMessage(MessageHandler* handler, BaseIpcMessage* message) {
+  current_handler = handler;
+  current_message = message;
+  awaited_event.clear();
+  awaited_event_holds_back = false;
+}
+
+void EndHandlingMessage(std::unique_ptr<BaseIpcMessage> message) {
+  current_handler = nullptr;
+  current_message = nullptr;
+  if (awaited_event.empty())
+    return;
+  std::lock_guard<std::mutex> lock(suspended_mutex);
+  if (awaited_event_holds_back)
+    holding_back_for = message.get();
+  suspended[awaited_event].push_back(std::move(message));
+  awaited_event.clear();
+}
+
+std::string ImportedEvent(const std::string& path) {
+  return "imported:" + NormalizedPath(path).path;
+}
+
+const char kIdleEvent[] = "idle";
+
+bool SuspendRequestUntil(const std::string& event) {
+  if (!current_message)
+    return false;
+  awaited_event = event;
+  return true;
+}
+
+bool SuspendRequestAndLaterOnesUntil(const std::string& event) {
+  if (!SuspendRequestUntil(event))
+    return false;
+  awaited_event_holds_back = true;
+  return true;
+}
+
+bool HoldBackBehindSuspendedRequest(std::unique_ptr<BaseIpcMessage>* message) {
+  std::lock_guard<std::mutex> lock(suspended_mutex);
+  if (!holding_back_for)
+    return false;
+  held_back.push_back(std::move(*message));
+  return true;
+}
+
+void ResumeRequestsWaitingFor(const std::string& event) {
+  std::vector<std::unique_ptr<BaseIpcMessage>> messages;
+  {
+    std::lock_guard<std::mutex> lock(suspended_mutex);
+    auto it = suspended.find(event);
+    if (it == suspended.end())
+      return;
+    messages = std::move(it->second);
+    suspended.erase(it);
+  }
+  RunAgain(std::move(messages));
+}
+
+bool ResumeAllSuspendedRequests() {
+  std::unordered_map<std::string, std::vector<std::unique_ptr<BaseIpcMessage>>>
+      waiting;
+  {
+    std::lock_guard<std::mutex> lock(suspended_mutex);
+    waiting.swap(suspended);
+  }
+  for (auto& entry : waiting)
+    RunAgain(std::move(entry.second));
+  return !waiting.empty();
+}
+
+void StartQueryDbReaders(QueryDatabase* db,
+                         IndexerThrottle* throttle,
+                         int count) {
+  for (int i = 0; i < count; i++) {
+    WorkThread::StartThread(
+        "querydb_reader" + std::to_string(num_querydb_readers++),
+        ThreadKind::Serving, [db, throttle]() {
+          auto* queue = QueueManager::instance();
+          while (true) {
+            std::unique_ptr<BaseIpcMessage> message =
+                queue->for_querydb_readers.Dequeue();
+            lsRequestId id = message->GetRequestId();
+            if (!EmitIfRequestCancelled(id)) {
+              Timer time;
+              SharedLock lock(db->mutex);
+              ScopedTrace trace("querydb", IpcIdToString(message->method_id));
+              ScopedRequestTrace request_trace(id);
+              FindMessageHandler(message->method_id)->Run(std::move(message));
+              throttle->OnRequest(time.ElapsedMicroseconds());
+            }
+            queue->FinishRequest(id);
+          }
+        });
+  }
+}
+
+bool HasQueryDbReaders() {
+  return num_querydb_readers > 0;
+}
+
 bool FindFileOrFail(QueryDatabase* db,
                     const Project* project,
                     optional<lsRequestId> id,
@@ -56,6 +302,17 @@ bool FindFileOrFail(QueryDatabase* db,
   if (out_file_id)
     *out_file_id = QueryFileId();
 
+  // Answer once the file is imported instead of failing while the project is
+  // loaded. The request only waits once, in case the file fails to index.
+  if (id && current_message && !current_message->waited_for_import &&
+      WillBeImported(current_handler, absolute_path) &&
+      SuspendRequestUntil(ImportedEvent(absolute_path))) {
+    LOG_S(INFO) << "Waiting for \"" << absolute_path << "\" to be imported.";
+    PrioritizeIndexRequests(current_handler->timestamp_manager, absolute_path);
+    current_message->waited_for_import = true;
+    return false;
+  }
+
   bool indexing = project->absolute_path_to_entry_index_.find(absolute_path) !=
                   project->absolute_path_to_entry_index_.end();
   if (indexing)
@@ -86,106 +343,307 @@ bool FindFileOrFail(QueryDatabase* db,
   return false;
 }
 
-void EmitInactiveLines(WorkingFile* working_file,
-                       const std::vector<Range>& inactive_regions) {
-  Out_CquerySetInactiveRegion out;
-  out.params.uri = lsDocumentUri::FromPath(working_file->filename);
-  for (Range skipped : inactive_regions) {
-    optional<lsRange> ls_skipped = GetLsRange(working_file, skipped);
-    if (ls_skipped)
-      out.params.inactiveRegions.push_back(*ls_skipped);
+WorkingFile* GetUnimportedWorkingFile(QueryDatabase* db,
+                                      WorkingFiles* working_files,
+                                      const std::string& absolute_path) {
+  auto it = db->usr_to_file.find(NormalizedPath(absolute_path));
+  if (it != db->usr_to_file.end() && db->files[it->second.id].def)
+    return nullptr;
+  return working_files->GetFileByFilename(absolute_path);
+}
+
+bool EmitIfRequestCancelled(const lsRequestId& id) {
+  if (!QueueManager::instance()->IsRequestCancelled(id))
+    return false;
+  QueueManager::instance()->request_tracer.Forget(id);
+  Out_Error out;
+  out.id = id;
+  out.error.code = lsErrorCodes::RequestCancelled;
+  out.error.message = "Request cancelled";
+  QueueManager::WriteStdout(IpcId::Unknown, out);
+  return true;
+}
+
+void PrioritizeIndexRequests(TimestampManager* timestamp_manager,
+                             const std::string& path) {
+  std::vector<std::string> importers = timestamp_manager->GetImporters(path);
+  std::unordered_set<std::string> paths(importers.begin(), importers.end());
+  paths.insert(path);
+  size_t moved = QueueManager::instance()->index_request.Prioritize(
+      [&](const Index_Request& request) {
+        return paths.count(request.path) != 0;
+      });
+  LOG_IF_S(INFO, moved) << "Prioritized " << moved << " index requests for "
+                        << path;
+}
+
+int CountPendingFiles(QueryDatabase* db,
+                      ImportPipelineStatus* status,
+                      const SymbolIdx& symbol) {
+  auto* queue = QueueManager::instance();
+  std::vector<std::string> pending;
+  // Copy the paths so that indexers are not blocked on the queue meanwhile.
+  queue->index_request.ForEachFront(
+      queue->index_request.Size(),
+      [&](const Index_Request& request) { pending.push_back(request.path); });
+  if (status) {
+    std::lock_guard<std::mutex> lock(status->parsing_mutex);
+    for (const auto& entry : status->parsing)
+      pending.push_back(entry.first);
+  }
+  if (pending.empty())
+    return 0;
+  std::sort(pending.begin(), pending.end());
+  pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+  // Uses of |symbol| can only be in files which include its declarations. If
+  // none is known, any pending file may use it.
+  std::unordered_set<RawId> declaring;
+  for (const QueryLocation& location :
+       GetDeclarationsOfSymbolForGotoDefinition(db, symbol)) {
+    declaring.insert(location.path.id);
+  }
+  if (optional<QueryLocation> spelling =
+          GetDefinitionSpellingOfSymbol(db, symbol)) {
+    declaring.insert(spelling->path.id);
   }
-  QueueManager::WriteStdout(IpcId::CqueryPublishInactiveRegions, out);
+
+  int count = 0;
+  for (const std::string& path : pending) {
+    auto it = db->usr_to_file.find(NormalizedPath(path));
+    const QueryFile* file =
+        it != db->usr_to_file.end() ? &db->files[it->second.id] : nullptr;
+    if (!file || !file->def || declaring.empty() ||
+        declaring.count(it->second.id)) {
+      count++;
+      continue;
+    }
+    for (QueryFileId dependency : file->def->dependencies) {
+      if (declaring.count(dependency.id)) {
+        count++;
+        break;
+      }
+    }
+  }
+  return count;
 }
 
-void EmitSemanticHighlighting(QueryDatabase* db,
-                              SemanticHighlightSymbolCache* semantic_cache,
-                              WorkingFile* working_file,
-                              QueryFile* file) {
-  assert(file->def);
-  auto semantic_cache_for_file =
-      semantic_cache->GetCacheForFile(file->def->path);
+void PreloadRelatedCompletionSessions(QueryDatabase* db,
+                                      TimestampManager* timestamp_manager,
+                                      ClangCompleteManager* clang_complete,
+                                      QueryFile* file) {
+  if (!file->def || clang_complete->config_->completion.preloadRelatedFiles < 1)
+    return;
+  const std::string& path = file->def->path;
+  std::vector<std::string> related;
+  auto add = [&](const std::string& related_path) {
+    if (related_path != path &&
+        std::find(related.begin(), related.end(), related_path) ==
+            related.end())
+      related.push_back(related_path);
+  };
+
+  Maybe<QueryFileId> impl_id = db->GetImplementationFileFromPath(path);
+  if (impl_id) {
+    QueryFile& impl = db->files[impl_id->id];
+    if (impl.def)
+      add(impl.def->path);
+  }
+  std::string base_name = GetBaseName(StripFileType(path));
+  for (const QueryFile::Include& include : file->def->includes) {
+    const std::string& include_path = db->files[include.file.id].path;
+    if (GetBaseName(StripFileType(include_path)) == base_name)
+      add(include_path);
+  }
+  optional<std::string> importer =
+      timestamp_manager->GetCheapestImporter(path);
+  if (importer)
+    add(*importer);
+
+  clang_complete->PreloadRelatedFiles(related);
+}
+
+namespace {
+// Set by StartHighlightingThread.
+ThreadedQueue<std::function<void()>>* highlighting_queue = nullptr;
+QueryDatabase* highlighting_db = nullptr;
+WorkingFiles* highlighting_working_files = nullptr;
+
+// Runs |resolve| with |working_file| and then |publish| if it returns true.
+// Once the highlighting thread is started, both run there instead: |resolve|
+// with a shared lock on querydb, which keeps the working file from changing,
+// and |publish| without it. The file may have been closed meanwhile.
+void SchedulePublish(WorkingFile* working_file,
+                     std::function<bool(WorkingFile*)> resolve,
+                     std::function<void()> publish) {
+  if (!highlighting_queue) {
+    if (resolve(working_file))
+      publish();
+    return;
+  }
+  std::string filename = working_file->filename;
+  highlighting_queue->Enqueue([filename, resolve, publish]() {
+    {
+      SharedLock lock(highlighting_db->mutex);
+      WorkingFile* file =
+          highlighting_working_files->GetFileByFilename(filename);
+      if (!file || !resolve(file))
+        return;
+    }
+    publish();
+  });
+}
 
-  // Group symbols together.
-  std::unordered_map<SymbolIdx, Out_CqueryPublishSemanticHighlighting::Symbol>
-      grouped_symbols;
-  for (SymbolRef sym : file->def->all_symbols) {
-    std::string_view detailed_name;
+// The symbols of a file which are highlighted, looked up in querydb so that
+// the highlighting can be built without it.
+struct SemanticHighlightingSnapshot {
+  struct Symbol {
+    SymbolIdx idx;
+    Usr usr = 0;
     SymbolKind parent_kind = SymbolKind::Invalid;
     ClangSymbolKind kind = ClangSymbolKind::Unknown;
     StorageClass storage = StorageClass::Invalid;
-    // This switch statement also filters out symbols that are not highlighted.
-    switch (sym.idx.kind) {
-      case SymbolKind::Func: {
-        QueryFunc* func = &db->funcs[sym.idx.idx];
-        if (!func->def)
-          continue;  // applies to for loop
-        // Don't highlight overloadable operators or implicit lambda ->
-        // std::function constructor.
-        std::string_view short_name = func->def->ShortName();
-        if (short_name.compare(0, 8, "operator") == 0 ||
-            short_name.compare(0, 27, "function<type-parameter-0-0") == 0)
-          continue;  // applies to for loop
-        kind = func->def->kind;
-        detailed_name = short_name;
-
-        // Check whether the function name is actually there.
-        // If not, do not publish the semantic highlight.
-        // E.g. copy-initialization of constructors should not be highlighted
-        // but we still want to keep the range for jumping to definition.
-        std::string_view concise_name =
-            detailed_name.substr(0, detailed_name.find('<'));
-        int16_t start_line = sym.loc.range.start.line;
-        int16_t start_col = sym.loc.range.start.column;
-        if (start_line >= 0 && start_line < working_file->index_lines.size()) {
-          std::string_view line = working_file->index_lines[start_line];
-          sym.loc.range.end.line = start_line;
-          if (line.compare(start_col, concise_name.size(), concise_name) == 0)
-            sym.loc.range.end.column = start_col + concise_name.size();
-          else
-            continue;  // applies to for loop
-        }
-        break;
-      }
-      case SymbolKind::Var: {
-        QueryVar* var = &db->vars[sym.idx.idx];
-        if (!var->def)
-          continue;  // applies to for loop
-        parent_kind = var->def->parent_kind;
-        kind = var->def->kind;
-        storage = var->def->storage;
-        detailed_name = var->def->ShortName();
-        break;
-      }
-      case SymbolKind::Type: {
-        QueryType* type = &db->types[sym.idx.idx];
-        if (!type->def)
+    // Functions are only highlighted where their |name| is spelled out.
+    bool check_name = false;
+    std::string name;
+  };
+
+  std::string path;
+  Generation generation = 0;
+  SemanticHighlightingMode mode = SemanticHighlightingMode::Full;
+  optional<Range> index_window;
+  std::vector<Symbol> symbols;
+  // The range of each occurrence and its symbol in |symbols|.
+  std::vector<std::pair<Range, size_t>> occurrences;
+
+  // Filled in from the working file.
+  lsDocumentUri uri;
+  uint32_t change_count = 0;
+  std::unordered_map<SymbolIdx, SemanticSymbol> grouped_symbols;
+};
+
+// Looks up |sym| in |db|. Returns false if it is not highlighted.
+bool GetHighlightedSymbol(QueryDatabase* db,
+                          SymbolIdx sym,
+                          SemanticHighlightingSnapshot::Symbol* symbol) {
+  symbol->idx = sym;
+  switch (sym.kind) {
+    case SymbolKind::Func: {
+      QueryFunc* func = &db->funcs[sym.idx];
+      if (!func->def)
+        return false;
+      // Don't highlight overloadable operators or implicit lambda ->
+      // std::function constructor.
+      std::string_view short_name = func->def->ShortName();
+      if (short_name.compare(0, 8, "operator") == 0 ||
+          short_name.compare(0, 27, "function<type-parameter-0-0") == 0)
+        return false;
+      symbol->usr = func->usr;
+      symbol->kind = func->def->kind;
+      symbol->check_name = true;
+      symbol->name = std::string(short_name);
+      return true;
+    }
+    case SymbolKind::Var: {
+      QueryVar* var = &db->vars[sym.idx];
+      if (!var->def)
+        return false;
+      symbol->usr = var->usr;
+      symbol->parent_kind = var->def->parent_kind;
+      symbol->kind = var->def->kind;
+      symbol->storage = var->def->storage;
+      return true;
+    }
+    case SymbolKind::Type: {
+      QueryType* type = &db->types[sym.idx];
+      if (!type->def)
+        return false;
+      symbol->usr = type->usr;
+      symbol->kind = type->def->kind;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Converts the occurrences of |snapshot| to the ranges of |working_file| and
+// groups them by symbol. Returns false if nothing needs to be published.
+bool ResolveSemanticHighlighting(SemanticHighlightSymbolCache* semantic_cache,
+                                 SemanticHighlightingSnapshot* snapshot,
+                                 WorkingFile* working_file) {
+  auto semantic_cache_for_file =
+      semantic_cache->GetCacheForFile(snapshot->path);
+  optional<std::vector<SemanticSymbol>>& published =
+      semantic_cache_for_file->published_symbols;
+  snapshot->uri = lsDocumentUri::FromPath(working_file->filename);
+  snapshot->change_count = working_file->change_count;
+  if (!snapshot->index_window && published &&
+      semantic_cache_for_file->published_generation == snapshot->generation &&
+      semantic_cache_for_file->published_change_count ==
+          snapshot->change_count) {
+    if (snapshot->mode != SemanticHighlightingMode::Full)
+      return false;
+    if (!semantic_cache_for_file->published_content.empty()) {
+      QueueManager::WriteStdoutNotification(
+          IpcId::CqueryPublishSemanticHighlighting, snapshot->uri.raw_uri,
+          true, semantic_cache_for_file->published_content);
+      return false;
+    }
+  }
+
+  for (const std::pair<Range, size_t>& occurrence : snapshot->occurrences) {
+    const SemanticHighlightingSnapshot::Symbol& symbol =
+        snapshot->symbols[occurrence.second];
+    Range range = occurrence.first;
+    if (symbol.check_name) {
+      // Check whether the function name is actually there.
+      // If not, do not publish the semantic highlight.
+      // E.g. copy-initialization of constructors should not be highlighted
+      // but we still want to keep the range for jumping to definition.
+      std::string_view name = symbol.name;
+      std::string_view concise_name = name.substr(0, name.find('<'));
+      int start_line = range.start.line;
+      int start_col = range.start.column;
+      if (start_line >= 0 && start_line < working_file->index_lines.size()) {
+        std::string_view line = working_file->index_lines[start_line];
+        if (line.compare(start_col, concise_name.size(), concise_name) == 0)
+          range.end =
+              Position(start_line, start_col + int(concise_name.size()));
+        else
           continue;  // applies to for loop
-        kind = type->def->kind;
-        detailed_name = type->def->detailed_name;
-        break;
       }
-      default:
-        continue;  // applies to for loop
     }
 
-    optional<lsRange> loc = GetLsRange(working_file, sym.loc.range);
+    optional<lsRange> loc = GetLsRange(working_file, range);
     if (loc) {
-      auto it = grouped_symbols.find(sym.idx);
-      if (it != grouped_symbols.end()) {
+      auto it = snapshot->grouped_symbols.find(symbol.idx);
+      if (it != snapshot->grouped_symbols.end()) {
         it->second.ranges.push_back(*loc);
       } else {
-        Out_CqueryPublishSemanticHighlighting::Symbol symbol;
-        symbol.stableId = semantic_cache_for_file->GetStableId(
-            sym.idx.kind, std::string(detailed_name));
-        symbol.parentKind = parent_kind;
-        symbol.kind = kind;
-        symbol.storage = storage;
-        symbol.ranges.push_back(*loc);
-        grouped_symbols[sym.idx] = symbol;
+        SemanticSymbol out_symbol;
+        out_symbol.stableId =
+            semantic_cache_for_file->GetStableId(symbol.idx.kind, symbol.usr);
+        out_symbol.parentKind = symbol.parent_kind;
+        out_symbol.kind = symbol.kind;
+        out_symbol.storage = symbol.storage;
+        out_symbol.ranges.push_back(*loc);
+        snapshot->grouped_symbols[symbol.idx] = out_symbol;
       }
     }
   }
+  return true;
+}
+
+// Publishes the symbols ResolveSemanticHighlighting grouped, or their delta.
+void PublishSemanticHighlighting(SemanticHighlightSymbolCache* semantic_cache,
+                                 SemanticHighlightingSnapshot* snapshot) {
+  auto semantic_cache_for_file =
+      semantic_cache->GetCacheForFile(snapshot->path);
+  optional<std::vector<SemanticSymbol>>& published =
+      semantic_cache_for_file->published_symbols;
+  std::unordered_map<SymbolIdx, SemanticSymbol>& grouped_symbols =
+      snapshot->grouped_symbols;
 
   // Make ranges non-overlapping using a scan line algorithm.
   std::vector<ScanLineEvent> events;
@@ -226,13 +684,184 @@ void EmitSemanticHighlighting(QueryDatabase* db,
       deleted[~events[i].id] = 1;
   }
 
-  // Publish.
-  Out_CqueryPublishSemanticHighlighting out;
-  out.params.uri = lsDocumentUri::FromPath(working_file->filename);
+  // Sort symbols so they can be compared with the last published ones. The
+  // ranges of each symbol are already sorted by the scan.
+  std::vector<SemanticSymbol> symbols;
   for (auto& entry : grouped_symbols)
     if (entry.second.ranges.size())
-      out.params.symbols.push_back(entry.second);
-  QueueManager::WriteStdout(IpcId::CqueryPublishSemanticHighlighting, out);
+      symbols.push_back(std::move(entry.second));
+  std::sort(symbols.begin(), symbols.end(), SemanticSymbolLess);
+  size_t num_symbols = 0;
+  for (size_t i = 0; i < symbols.size(); i++) {
+    if (num_symbols &&
+        !SemanticSymbolLess(symbols[num_symbols - 1], symbols[i])) {
+      std::vector<lsRange>& ranges = symbols[num_symbols - 1].ranges;
+      ranges.insert(ranges.end(), symbols[i].ranges.begin(),
+                    symbols[i].ranges.end());
+      std::sort(ranges.begin(), ranges.end(), RangeLess);
+    } else {
+      symbols[num_symbols++] = std::move(symbols[i]);
+    }
+  }
+  symbols.resize(num_symbols);
+
+  // Publish.
+  Generation generation = snapshot->generation;
+  SemanticHighlightingMode mode = snapshot->mode;
+  if (snapshot->index_window) {
+    Out_CqueryPublishSemanticHighlighting out;
+    out.params.uri = snapshot->uri;
+    out.params.symbols = std::move(symbols);
+    QueueManager::WriteStdoutNotification(
+        IpcId::CqueryPublishSemanticHighlighting, snapshot->uri.raw_uri, true,
+        out);
+    return;
+  }
+  if (mode != SemanticHighlightingMode::Full && published) {
+    std::vector<Out_CqueryPublishSemanticHighlightingDelta::Symbol> delta =
+        GetSemanticHighlightingDelta(*published, symbols);
+    if (delta.empty()) {
+      semantic_cache_for_file->published_generation = generation;
+      semantic_cache_for_file->published_change_count =
+          snapshot->change_count;
+      return;
+    }
+    if (mode == SemanticHighlightingMode::Delta) {
+      Out_CqueryPublishSemanticHighlightingDelta out;
+      out.params.uri = snapshot->uri;
+      out.params.symbols = std::move(delta);
+      QueueManager::WriteStdoutNotification(
+          IpcId::CqueryPublishSemanticHighlighting, snapshot->uri.raw_uri,
+          false, out);
+      published = std::move(symbols);
+      semantic_cache_for_file->published_generation = generation;
+      semantic_cache_for_file->published_change_count =
+          snapshot->change_count;
+      semantic_cache_for_file->published_content.clear();
+      return;
+    }
+  }
+  Out_CqueryPublishSemanticHighlighting out;
+  out.params.uri = snapshot->uri;
+  out.params.symbols = symbols;
+  std::string content;
+  out.Write(&content);
+  semantic_cache_for_file->published_content = content;
+  QueueManager::WriteStdoutNotification(
+      IpcId::CqueryPublishSemanticHighlighting, snapshot->uri.raw_uri, true,
+      std::move(content));
+  published = std::move(symbols);
+  semantic_cache_for_file->published_generation = generation;
+  semantic_cache_for_file->published_change_count = snapshot->change_count;
+}
+}  // namespace
+
+void StartHighlightingThread(QueryDatabase* db, WorkingFiles* working_files) {
+  highlighting_db = db;
+  highlighting_working_files = working_files;
+  highlighting_queue =
+      new ThreadedQueue<std::function<void()>>("queue.highlighting");
+  WorkThread::StartThread("highlight", ThreadKind::Serving, []() {
+    while (true) {
+      std::function<void()> job = highlighting_queue->Dequeue();
+      job();
+    }
+  });
+}
+
+void DropPublishedSemanticHighlighting(
+    SemanticHighlightSymbolCache* semantic_cache) {
+  auto drop = [semantic_cache]() {
+    int count = semantic_cache->DropPublishedSymbols();
+    LOG_S(INFO) << "Dropped the published semantic highlighting of " << count
+                << " files";
+  };
+  if (highlighting_queue)
+    highlighting_queue->Enqueue(drop);
+  else
+    drop();
+}
+
+void EmitInactiveLines(WorkingFile* working_file,
+                       const std::vector<Range>& inactive_regions) {
+  auto out = std::make_shared<Out_CquerySetInactiveRegion>();
+  SchedulePublish(
+      working_file,
+      [out, inactive_regions](WorkingFile* working_file) -> bool {
+        out->params.uri = lsDocumentUri::FromPath(working_file->filename);
+        for (Range skipped : inactive_regions) {
+          optional<lsRange> ls_skipped = GetLsRange(working_file, skipped);
+          if (ls_skipped)
+            out->params.inactiveRegions.push_back(*ls_skipped);
+        }
+        return true;
+      },
+      [out]() {
+        QueueManager::WriteStdoutNotification(
+            IpcId::CqueryPublishInactiveRegions, out->params.uri.raw_uri,
+            true, *out);
+      });
+}
+
+void EmitSemanticHighlighting(QueryDatabase* db,
+                              SemanticHighlightSymbolCache* semantic_cache,
+                              WorkingFile* working_file,
+                              QueryFile* file,
+                              SemanticHighlightingMode mode,
+                              const optional<Range>& index_window) {
+  assert(file->def);
+  auto snapshot = std::make_shared<SemanticHighlightingSnapshot>();
+  snapshot->path = file->def->path;
+  snapshot->generation = db->generation;
+  snapshot->mode = mode;
+  snapshot->index_window = index_window;
+
+  // |all_symbols| is sorted by start position and |symbols_max_end| is
+  // non-decreasing, so the symbols overlapping |index_window| are contiguous.
+  const std::vector<SymbolRef>& all_symbols = file->def->all_symbols;
+  auto first = all_symbols.begin();
+  auto last = all_symbols.end();
+  if (index_window &&
+      file->symbols_max_end.size() == all_symbols.size()) {
+    first = all_symbols.begin() +
+            (std::upper_bound(file->symbols_max_end.begin(),
+                              file->symbols_max_end.end(),
+                              index_window->start) -
+             file->symbols_max_end.begin());
+    last = std::lower_bound(first, all_symbols.end(), index_window->end,
+                            [](const SymbolRef& ref, const Position& pos) {
+                              return ref.loc.range.start < pos;
+                            });
+  }
+
+  // Look up each symbol once; symbols which are not highlighted map to
+  // |kSkipped|.
+  const size_t kSkipped = size_t(-1);
+  std::unordered_map<SymbolIdx, size_t> symbol_indices;
+  for (auto it = first; it != last; ++it) {
+    auto found = symbol_indices.find(it->idx);
+    if (found == symbol_indices.end()) {
+      SemanticHighlightingSnapshot::Symbol symbol;
+      size_t index = kSkipped;
+      if (GetHighlightedSymbol(db, it->idx, &symbol)) {
+        index = snapshot->symbols.size();
+        snapshot->symbols.push_back(std::move(symbol));
+      }
+      found = symbol_indices.emplace(it->idx, index).first;
+    }
+    if (found->second != kSkipped)
+      snapshot->occurrences.emplace_back(it->loc.range, found->second);
+  }
+
+  SchedulePublish(working_file,
+                  [semantic_cache, snapshot](WorkingFile* working_file) {
+                    return ResolveSemanticHighlighting(
+                        semantic_cache, snapshot.get(), working_file);
+                  },
+                  [semantic_cache, snapshot]() {
+                    PublishSemanticHighlighting(semantic_cache,
+                                                snapshot.get());
+                  });
 }
 
 bool ShouldIgnoreFileForIndexing(const std::string& path) {
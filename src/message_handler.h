@@ -16,9 +16,11 @@ struct FileConsumerSharedState;
 struct ImportManager;
 struct ImportPipelineStatus;
 struct IncludeComplete;
+class IndexerThrottle;
 struct MultiQueueWaiter;
 struct Project;
 struct QueryDatabase;
+struct ResponseCache;
 struct SemanticHighlightSymbolCache;
 struct TimestampManager;
 struct WorkingFile;
@@ -40,12 +42,12 @@ struct Out_CqueryPublishSemanticHighlighting
   std::string method = "$cquery/publishSemanticHighlighting";
   Params params;
 };
-MAKE_REFLECT_STRUCT(Out_CqueryPublishSemanticHighlighting::Symbol,
-                    stableId,
-                    parentKind,
-                    kind,
-                    storage,
-                    ranges);
+MAKE_REFLECT_STRUCT_DIRECT_JSON(Out_CqueryPublishSemanticHighlighting::Symbol,
+                                stableId,
+                                parentKind,
+                                kind,
+                                storage,
+                                ranges);
 MAKE_REFLECT_STRUCT(Out_CqueryPublishSemanticHighlighting::Params,
                     uri,
                     symbols);
@@ -54,6 +56,50 @@ MAKE_REFLECT_STRUCT(Out_CqueryPublishSemanticHighlighting,
                     method,
                     params);
 
+// Ranges added to and removed from the symbols of the last
+// $cquery/publishSemanticHighlighting, or delta, for |uri|.
+struct Out_CqueryPublishSemanticHighlightingDelta
+    : public lsOutMessage<Out_CqueryPublishSemanticHighlightingDelta> {
+  struct Symbol {
+    int stableId = 0;
+    SymbolKind parentKind;
+    ClangSymbolKind kind;
+    StorageClass storage;
+    std::vector<lsRange> added;
+    std::vector<lsRange> removed;
+  };
+  struct Params {
+    lsDocumentUri uri;
+    std::vector<Symbol> symbols;
+  };
+  std::string method = "$cquery/publishSemanticHighlightingDelta";
+  Params params;
+};
+MAKE_REFLECT_STRUCT_DIRECT_JSON(
+    Out_CqueryPublishSemanticHighlightingDelta::Symbol,
+    stableId,
+    parentKind,
+    kind,
+    storage,
+    added,
+    removed);
+MAKE_REFLECT_STRUCT(Out_CqueryPublishSemanticHighlightingDelta::Params,
+                    uri,
+                    symbols);
+MAKE_REFLECT_STRUCT(Out_CqueryPublishSemanticHighlightingDelta,
+                    jsonrpc,
+                    method,
+                    params);
+
+enum class SemanticHighlightingMode {
+  // Publish every symbol.
+  Full,
+  // Publish every symbol, unless nothing changed since the last time.
+  IfChanged,
+  // Publish only the ranges which changed since the last time.
+  Delta,
+};
+
 // Usage:
 //
 //  struct FooHandler : MessageHandler {
@@ -77,6 +123,7 @@ struct MessageHandler {
   ImportPipelineStatus* import_pipeline_status = nullptr;
   TimestampManager* timestamp_manager = nullptr;
   SemanticHighlightSymbolCache* semantic_cache = nullptr;
+  ResponseCache* response_cache = nullptr;
   WorkingFiles* working_files = nullptr;
   ClangCompleteManager* clang_complete = nullptr;
   IncludeComplete* include_complete = nullptr;
@@ -85,6 +132,10 @@ struct MessageHandler {
   CodeCompleteCache* signature_cache = nullptr;
 
   virtual IpcId GetId() const = 0;
+  // Read-only handlers only read the QueryDatabase and state which is safe to
+  // access concurrently such as WorkingFiles, so they may run on querydb
+  // reader threads.
+  virtual bool IsReadOnly() const { return false; }
   virtual void Run(std::unique_ptr<BaseIpcMessage> message) = 0;
 
   static std::vector<MessageHandler*>* message_handlers;
@@ -93,6 +144,11 @@ struct MessageHandler {
   MessageHandler();
 };
 
+// Called around handlers so that they can suspend the message they handle,
+// see SuspendRequestUntil. Takes |message| if it was suspended.
+void BeginHandlingMessage(MessageHandler* handler, BaseIpcMessage* message);
+void EndHandlingMessage(std::unique_ptr<BaseIpcMessage> message);
+
 template <typename TMessage>
 struct BaseMessageHandler : MessageHandler {
   virtual void Run(TMessage* message) = 0;
@@ -100,10 +156,60 @@ struct BaseMessageHandler : MessageHandler {
   // MessageHandler:
   IpcId GetId() const override { return TMessage::kIpcId; }
   void Run(std::unique_ptr<BaseIpcMessage> message) override {
+    BeginHandlingMessage(this, message.get());
     Run(message->As<TMessage>());
+    EndHandlingMessage(std::move(message));
   }
 };
 
+// Handlers of a BaseMessageHandler can suspend the message they handle until
+// an event instead of blocking querydb or failing, ie, until the file of a
+// request is imported. The handler returns right after suspending, and once
+// the event is signaled the message is queued again in front of the others,
+// and the handler runs from the start on the data of then. Handlers suspend
+// before writing anything, so running them again is harmless; state which
+// should carry over lives in the message.
+//
+// Signaled by querydb while it holds |db->mutex| exclusively after importing
+// |path|.
+std::string ImportedEvent(const std::string& path);
+// Signaled by querydb once it and the indexers have nothing left to do. Every
+// suspended message is resumed then, see ResumeAllSuspendedRequests.
+extern const char kIdleEvent[];
+
+// Suspends the message handled on this thread until |event|. Returns false if
+// no message is handled by a BaseMessageHandler on this thread.
+bool SuspendRequestUntil(const std::string& event);
+// Like SuspendRequestUntil, but querydb also holds back the messages it
+// receives later until the suspended message is resumed, so that they are
+// still handled after it, ie, after $cquery/wait.
+bool SuspendRequestAndLaterOnesUntil(const std::string& event);
+// Takes |*message| if a message suspended by SuspendRequestAndLaterOnesUntil
+// is waiting; it is queued again behind that message once it resumes. Called
+// by querydb for every message it receives.
+bool HoldBackBehindSuspendedRequest(std::unique_ptr<BaseIpcMessage>* message);
+// Queues the messages suspended until |event| again.
+void ResumeRequestsWaitingFor(const std::string& event);
+// Queues every suspended message again, ie, requests waiting for files which
+// were not imported by the time indexing is done then fail. Returns true if
+// there were any.
+bool ResumeAllSuspendedRequests();
+
+// Returns the handler for messages of type |id|, or nullptr.
+MessageHandler* FindMessageHandler(IpcId id);
+
+// Starts |count| threads which run the read-only messages queued in
+// QueueManager::for_querydb_readers. Each reader holds |db->mutex| shared
+// while it runs a handler, and reports how long requests took to |throttle|.
+void StartQueryDbReaders(QueryDatabase* db,
+                         IndexerThrottle* throttle,
+                         int count);
+// Returns true if any reader thread has been started.
+bool HasQueryDbReaders();
+
+// Finds the imported file |absolute_path|. If it is not imported, emits an
+// error for request |id|, unless the file is queued for indexing: the request
+// then waits for the import, which is moved ahead of the others.
 bool FindFileOrFail(QueryDatabase* db,
                     const Project* project,
                     optional<lsRequestId> id,
@@ -111,12 +217,76 @@ bool FindFileOrFail(QueryDatabase* db,
                     QueryFile** out_query_file,
                     QueryFileId* out_file_id = nullptr);
 
+// Returns the working file of |absolute_path| if it is open but not imported
+// yet. Requests on it may then answer right away from FindSymbolsByLexedName,
+// instead of waiting for the import in FindFileOrFail. The client asks again
+// once the file is indexed, ie, on the next hover, and gets exact results.
+WorkingFile* GetUnimportedWorkingFile(QueryDatabase* db,
+                                      WorkingFiles* working_files,
+                                      const std::string& absolute_path);
+
+// Returns true if request |id| has been cancelled, in which case a
+// RequestCancelled error has been sent for it. Long running handlers should
+// poll this and return early when it becomes true.
+bool EmitIfRequestCancelled(const lsRequestId& id);
+
+// Merges each run of textDocument/didChange notifications in |messages| for
+// the same document into the first one of the run, so that a burst of
+// keystrokes is applied, and schedules a parse, once. The changes are kept in
+// order and the merged notification has the version of the last one.
+void CoalesceDidChangeNotifications(
+    std::vector<std::unique_ptr<BaseIpcMessage>>* messages);
+
+// Moves queued index requests for |path| and for the translation units which
+// include it ahead of the others, so that a file the user opens does not wait
+// for the rest of the project to be indexed.
+void PrioritizeIndexRequests(TimestampManager* timestamp_manager,
+                             const std::string& path);
+
+// Returns the number of files whose index may still add uses of |symbol|, ie,
+// while the project is indexed for the first time: the files queued for
+// indexing or being parsed which are not imported yet or include a file
+// declaring |symbol|. Responses listing uses report it as |pendingFiles|, so
+// that clients can tell the result is incomplete and ask again later. Called
+// with |db->mutex| held.
+int CountPendingFiles(QueryDatabase* db,
+                      ImportPipelineStatus* status,
+                      const SymbolIdx& symbol);
+
+// Preloads completion sessions for the files the user is likely to view after
+// |file|: the source file implementing a header, the headers with the base
+// name of a source file, and the cheapest translation unit including it.
+void PreloadRelatedCompletionSessions(QueryDatabase* db,
+                                      TimestampManager* timestamp_manager,
+                                      ClangCompleteManager* clang_complete,
+                                      QueryFile* file);
+
+// Starts the thread which converts semantic highlighting and inactive regions
+// to the ranges of the working files and publishes them, so that querydb only
+// collects the symbols. Until then they are published on the calling thread.
+void StartHighlightingThread(QueryDatabase* db, WorkingFiles* working_files);
+// Runs SemanticHighlightSymbolCache::DropPublishedSymbols on the thread which
+// publishes semantic highlighting, to free memory.
+void DropPublishedSemanticHighlighting(
+    SemanticHighlightSymbolCache* semantic_cache);
+
 void EmitInactiveLines(WorkingFile* working_file,
                        const std::vector<Range>& inactive_regions);
 
+// Emits semantic highlighting for |file|. If |index_window| is set, only the
+// symbols overlapping it are published, which is quicker for large files; the
+// published symbols are not remembered for later deltas. Once the
+// highlighting thread is started, only it uses |semantic_cache|.
 void EmitSemanticHighlighting(QueryDatabase* db,
                               SemanticHighlightSymbolCache* semantic_cache,
                               WorkingFile* working_file,
-                              QueryFile* file);
+                              QueryFile* file,
+                              SemanticHighlightingMode mode =
+                                  SemanticHighlightingMode::Full,
+                              const optional<Range>& index_window = nullopt);
+
+// Starts a thread which watches |directories| recursively and handles the
+// files changed in them like workspace/didChangeWatchedFiles.
+void StartFileWatcher(const std::vector<std::string>& directories);
 
 bool ShouldIgnoreFileForIndexing(const std::string& path);
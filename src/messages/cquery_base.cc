@@ -11,6 +11,7 @@ MAKE_REFLECT_STRUCT(Ipc_CqueryBase, id, params);
 REGISTER_IPC_MESSAGE(Ipc_CqueryBase);
 
 struct CqueryBaseHandler : BaseMessageHandler<Ipc_CqueryBase> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryBase* request) override {
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
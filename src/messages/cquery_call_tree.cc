@@ -70,13 +70,15 @@ std::vector<Out_CqueryCallTree::CallEntry> BuildInitialCallTree(
   return result;
 }
 
-std::vector<Out_CqueryCallTree::CallEntry> BuildExpandCallTree(
+// Returns nullopt if request |id| was cancelled while building the tree.
+optional<std::vector<Out_CqueryCallTree::CallEntry>> BuildExpandCallTree(
     QueryDatabase* db,
     WorkingFiles* working_files,
-    QueryFuncId root) {
+    QueryFuncId root,
+    const lsRequestId& id) {
   QueryFunc& root_func = db->funcs[root.id];
   if (!root_func.def)
-    return {};
+    return std::vector<Out_CqueryCallTree::CallEntry>();
 
   std::vector<Out_CqueryCallTree::CallEntry> result;
   std::unordered_set<QueryLocation> seen_locations;
@@ -108,7 +110,8 @@ std::vector<Out_CqueryCallTree::CallEntry> BuildExpandCallTree(
 
     if (caller.HasValue()) {
       QueryFunc& call_func = db->funcs[caller.id_.id];
-      if (!call_func.def)
+      // The id of a removed caller may describe another func by now.
+      if (!call_func.def || call_func.gen != caller.gen)
         return;
 
       Out_CqueryCallTree::CallEntry call_entry;
@@ -138,23 +141,32 @@ std::vector<Out_CqueryCallTree::CallEntry> BuildExpandCallTree(
   result.reserve(root_func.callers.size() + base_callers.size() +
                  derived_callers.size());
 
-  for (QueryFuncRef caller : root_func.callers)
+  for (QueryFuncRef caller : root_func.callers) {
+    if (EmitIfRequestCancelled(id))
+      return nullopt;
     handle_caller(caller, Out_CqueryCallTree::CallType::Direct);
+  }
   for (QueryFuncRef caller : base_callers) {
+    if (EmitIfRequestCancelled(id))
+      return nullopt;
     // Do not show calls to the base function coming from this function.
     if (caller.id_ == root)
       continue;
 
     handle_caller(caller, Out_CqueryCallTree::CallType::Base);
   }
-  for (QueryFuncRef caller : derived_callers)
+  for (QueryFuncRef caller : derived_callers) {
+    if (EmitIfRequestCancelled(id))
+      return nullopt;
     handle_caller(caller, Out_CqueryCallTree::CallType::Derived);
+  }
 
   return result;
 }
 
 struct CqueryCallTreeInitialHandler
     : BaseMessageHandler<Ipc_CqueryCallTreeInitial> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryCallTreeInitial* request) override {
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
@@ -184,6 +196,7 @@ REGISTER_MESSAGE_HANDLER(CqueryCallTreeInitialHandler);
 
 struct CqueryCallTreeExpandHandler
     : BaseMessageHandler<Ipc_CqueryCallTreeExpand> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryCallTreeExpand* request) override {
     Out_CqueryCallTree out;
     out.id = request->id;
@@ -191,8 +204,13 @@ struct CqueryCallTreeExpandHandler
     // FIXME
     Maybe<QueryFuncId> func_id =
         db->GetQueryFuncIdFromUsr(std::stoull(request->params.usr));
-    if (func_id)
-      out.result = BuildExpandCallTree(db, working_files, *func_id);
+    if (func_id) {
+      optional<std::vector<Out_CqueryCallTree::CallEntry>> result =
+          BuildExpandCallTree(db, working_files, *func_id, request->id);
+      if (!result)
+        return;
+      out.result = std::move(*result);
+    }
 
     QueueManager::WriteStdout(IpcId::CqueryCallTreeExpand, out);
   }
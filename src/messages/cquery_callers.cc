@@ -5,16 +5,33 @@
 namespace {
 struct Ipc_CqueryCallers : public RequestMessage<Ipc_CqueryCallers> {
   const static IpcId kIpcId = IpcId::CqueryCallers;
-  lsTextDocumentPositionParams params;
+  struct Params {
+    lsTextDocumentIdentifier textDocument;
+    lsPosition position;
+    // cquery extension: the locations are ordered by proximity to
+    // |textDocument|, the first |startIndex| ones are skipped and, if
+    // |maxResults| is positive, at most |maxResults| are returned.
+    int startIndex = 0;
+    int maxResults = 0;
+  };
+  Params params;
 };
+MAKE_REFLECT_STRUCT(Ipc_CqueryCallers::Params,
+                    textDocument,
+                    position,
+                    startIndex,
+                    maxResults);
 MAKE_REFLECT_STRUCT(Ipc_CqueryCallers, id, params);
 REGISTER_IPC_MESSAGE(Ipc_CqueryCallers);
 
 struct CqueryCallersHandler : BaseMessageHandler<Ipc_CqueryCallers> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryCallers* request) override {
+    QueryFileId file_id;
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
-                        request->params.textDocument.uri.GetPath(), &file)) {
+                        request->params.textDocument.uri.GetPath(), &file,
+                        &file_id)) {
       return;
     }
 
@@ -34,7 +51,13 @@ struct CqueryCallersHandler : BaseMessageHandler<Ipc_CqueryCallers> {
         for (QueryFuncRef func_ref : GetCallersForAllDerivedFunctions(db, func))
           locations.push_back(func_ref.loc);
 
-        out.result = GetLsLocations(db, working_files, locations);
+        out.result = GetLsLocationsByProximity(
+            db, working_files, file_id, std::move(locations),
+            request->params.startIndex, request->params.maxResults);
+        if (int pending = CountPendingFiles(db, import_pipeline_status,
+                                            ref.idx)) {
+          out.pendingFiles = pending;
+        }
       }
     }
     QueueManager::WriteStdout(IpcId::CqueryCallers, out);
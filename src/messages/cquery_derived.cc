@@ -11,6 +11,7 @@ MAKE_REFLECT_STRUCT(Ipc_CqueryDerived, id, params);
 REGISTER_IPC_MESSAGE(Ipc_CqueryDerived);
 
 struct CqueryDerivedHandler : BaseMessageHandler<Ipc_CqueryDerived> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryDerived* request) override {
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
@@ -34,19 +35,20 @@ struct CqueryDerivedHandler : BaseMessageHandler<Ipc_CqueryDerived> {
                               (b.role & SymbolRole::Definition);
                      });
     for (const SymbolRef& ref : refs) {
+      std::vector<QueryLocation> locations;
       if (ref.idx.kind == SymbolKind::Type) {
         QueryType& type = db->types[ref.idx.idx];
-        std::vector<QueryLocation> locations =
-            ToQueryLocation(db, &type.derived);
-        out.result = GetLsLocations(db, working_files, locations);
-        break;
+        locations = ToQueryLocation(db, &type.derived);
       } else if (ref.idx.kind == SymbolKind::Func) {
         QueryFunc& func = db->funcs[ref.idx.idx];
-        std::vector<QueryLocation> locations =
-            ToQueryLocation(db, &func.derived);
-        out.result = GetLsLocations(db, working_files, locations);
-        break;
+        locations = ToQueryLocation(db, &func.derived);
+      } else {
+        continue;
       }
+      out.result = GetLsLocations(db, working_files, locations);
+      if (int pending = CountPendingFiles(db, import_pipeline_status, ref.idx))
+        out.pendingFiles = pending;
+      break;
     }
     QueueManager::WriteStdout(IpcId::CqueryDerived, out);
   }
@@ -1,37 +1,112 @@
 #include "clang_complete.h"
 #include "message_handler.h"
+#include "queue_manager.h"
 #include "working_files.h"
 
+#include <mutex>
+#include <unordered_set>
+
 namespace {
 struct Ipc_CqueryTextDocumentDidView
     : public NotificationMessage<Ipc_CqueryTextDocumentDidView> {
   const static IpcId kIpcId = IpcId::CqueryTextDocumentDidView;
   struct Params {
     lsDocumentUri textDocumentUri;
+    // Lines shown by the editor. If set, highlighting and inactive regions of
+    // these lines are sent first and the rest of the file is sent later.
+    optional<lsRange> visibleRange;
   };
   Params params;
+  // Set on the message queued to send the rest of the file.
+  bool is_deferred = false;
 };
-MAKE_REFLECT_STRUCT(Ipc_CqueryTextDocumentDidView::Params, textDocumentUri);
+MAKE_REFLECT_STRUCT(Ipc_CqueryTextDocumentDidView::Params,
+                    textDocumentUri,
+                    visibleRange);
 MAKE_REFLECT_STRUCT(Ipc_CqueryTextDocumentDidView, params);
 REGISTER_IPC_MESSAGE(Ipc_CqueryTextDocumentDidView);
 
+// Paths which have a deferred request queued. Editors send a didView for every
+// scroll step, but the rest of a file only needs to be sent once.
+std::mutex g_deferred_paths_mutex;
+std::unordered_set<std::string> g_deferred_paths;
+
+// Returns true if there was no deferred request queued for |path|; the caller
+// then queues it.
+bool AddDeferredPath(const std::string& path) {
+  std::lock_guard<std::mutex> lock(g_deferred_paths_mutex);
+  return g_deferred_paths.insert(path).second;
+}
+
+void RemoveDeferredPath(const std::string& path) {
+  std::lock_guard<std::mutex> lock(g_deferred_paths_mutex);
+  g_deferred_paths.erase(path);
+}
+
+// Returns the index lines covering the buffer lines of |range|.
+optional<Range> GetIndexWindow(WorkingFile* working_file,
+                               const lsRange& range) {
+  int start_column = 0, end_column = 0;
+  optional<int> start = working_file->GetIndexPosFromBufferPos(
+      range.start.line, &start_column, false);
+  optional<int> end = working_file->GetIndexPosFromBufferPos(
+      range.end.line, &end_column, true);
+  if (!start || !end || *end < *start)
+    return nullopt;
+  return Range(Position(*start, 0), Position(*end + 1, 0));
+}
+
 struct CqueryDidViewHandler
     : BaseMessageHandler<Ipc_CqueryTextDocumentDidView> {
   void Run(Ipc_CqueryTextDocumentDidView* request) override {
     std::string path = request->params.textDocumentUri.GetPath();
+    // Views handled from now on queue a new deferred request.
+    if (request->is_deferred)
+      RemoveDeferredPath(path);
 
     WorkingFile* working_file = working_files->GetFileByFilename(path);
     if (!working_file)
       return;
+    if (!request->is_deferred)
+      PrioritizeIndexRequests(timestamp_manager, path);
     QueryFile* file = nullptr;
     if (!FindFileOrFail(db, project, nullopt, path, &file))
       return;
 
-    clang_complete->NotifyView(path);
-    if (file->def) {
+    if (!request->is_deferred) {
+      clang_complete->NotifyView(path);
+      PreloadRelatedCompletionSessions(db, timestamp_manager, clang_complete,
+                                       file);
+    }
+    if (!file->def)
+      return;
+
+    optional<Range> window;
+    if (request->params.visibleRange)
+      window = GetIndexWindow(working_file, *request->params.visibleRange);
+    if (!window) {
       EmitInactiveLines(working_file, file->def->inactive_regions);
       EmitSemanticHighlighting(db, semantic_cache, working_file, file);
+      return;
+    }
+
+    std::vector<Range> visible_inactive_regions;
+    for (const Range& region : file->def->inactive_regions) {
+      if (region.end.line >= window->start.line &&
+          region.start.line < window->end.line)
+        visible_inactive_regions.push_back(region);
     }
+    EmitInactiveLines(working_file, visible_inactive_regions);
+    EmitSemanticHighlighting(db, semantic_cache, working_file, file,
+                             SemanticHighlightingMode::Full, window);
+
+    // Send the whole file after the requests which are already queued.
+    if (!AddDeferredPath(path))
+      return;
+    auto deferred = MakeUnique<Ipc_CqueryTextDocumentDidView>();
+    deferred->params.textDocumentUri = request->params.textDocumentUri;
+    deferred->is_deferred = true;
+    QueueManager::instance()->for_querydb.Enqueue(std::move(deferred));
   }
 };
 REGISTER_MESSAGE_HANDLER(CqueryDidViewHandler);
@@ -42,20 +42,22 @@ struct CqueryFreshenIndexHandler : BaseMessageHandler<Ipc_CqueryFreshenIndex> {
     std::queue<const QueryFile*> q;
     // |need_index| stores every filename ever enqueued.
     std::unordered_set<std::string> need_index;
-    // Reverse dependency graph.
-    std::unordered_map<std::string, std::vector<std::string>> graph;
-    // filename -> QueryFile mapping for files haven't enqueued.
-    std::unordered_map<std::string, const QueryFile*> path_to_file;
+    // Reverse dependency graph, indexed by file id.
+    std::vector<std::vector<RawId>> graph(db->files.size());
+    // Whether each file with a def has been enqueued.
+    std::vector<bool> enqueued(db->files.size());
 
-    for (const auto& file : db->files)
+    for (RawId i = 0; i < db->files.size(); i++) {
+      const QueryFile& file = db->files[i];
       if (file.def) {
-        if (matcher.IsMatch(file.def->path))
+        if (matcher.IsMatch(file.def->path)) {
           q.push(&file);
-        else
-          path_to_file[file.def->path] = &file;
-        for (const std::string& dependency : file.def->dependencies)
-          graph[dependency].push_back(file.def->path);
+          enqueued[i] = true;
+        }
+        for (QueryFileId dependency : file.def->dependencies)
+          graph[dependency.id].push_back(i);
       }
+    }
 
     while (!q.empty()) {
       const QueryFile* file = q.front();
@@ -73,11 +75,10 @@ struct CqueryFreshenIndexHandler : BaseMessageHandler<Ipc_CqueryFreshenIndex> {
         file_consumer_shared->Reset(file->def->path);
 
       if (request->params.dependencies)
-        for (const std::string& path : graph[file->def->path]) {
-          auto it = path_to_file.find(path);
-          if (it != path_to_file.end()) {
-            q.push(it->second);
-            path_to_file.erase(it);
+        for (RawId dependent : graph[file - db->files.data()]) {
+          if (!enqueued[dependent]) {
+            q.push(&db->files[dependent]);
+            enqueued[dependent] = true;
           }
         }
     }
@@ -89,16 +90,10 @@ struct CqueryFreshenIndexHandler : BaseMessageHandler<Ipc_CqueryFreshenIndex> {
         config, [&](int i, const Project::Entry& entry) {
           if (!need_index.count(entry.filename))
             return;
-          optional<std::string> content = ReadContent(entry.filename);
-          if (!content) {
-            LOG_S(ERROR) << "When freshening index, cannot read file "
-                         << entry.filename;
-            return;
-          }
           bool is_interactive =
               working_files->GetFileByFilename(entry.filename) != nullptr;
           queue->index_request.Enqueue(Index_Request(entry.filename, entry.args,
-                                                     is_interactive, *content, ICacheManager::Make(config)));
+                                                     is_interactive, nullopt, ICacheManager::Make(config)));
         });
   }
 };
@@ -61,26 +61,42 @@ ExpandNode(QueryDatabase* db, WorkingFiles* working_files, QueryTypeId root) {
     return {};
 
   std::vector<Out_CqueryMemberHierarchy::Entry> ret;
-  EachWithGen<QueryVar>(db->vars, root_type.def->vars, [&](QueryVar& var) {
+  ret.reserve(root_type.members.size());
+  // Members are usually defined in the same file, so only look up the file
+  // when it changes.
+  QueryFileId file_id;
+  lsDocumentUri uri;
+  WorkingFile* working_file = nullptr;
+  for (const QueryType::Member& member : root_type.members) {
+    QueryVar& var = db->vars[member.var.id];
+    if (!var.def || var.gen != member.var_gen)
+      continue;
     Out_CqueryMemberHierarchy::Entry entry;
     entry.name = var.def->ShortName();
-    // FIXME WithGen
-    entry.type_id =
-        var.def->variable_type ? var.def->variable_type->value.id : RawId(-1);
-    if (var.def->definition_spelling) {
-      optional<lsLocation> loc =
-          GetLsLocation(db, working_files, *var.def->definition_spelling);
+    entry.type_id = RawId(-1);
+    if (member.type && db->types[member.type->id].gen == member.type_gen)
+      entry.type_id = member.type->id;
+    if (member.definition_spelling) {
+      const QueryLocation& spelling = *member.definition_spelling;
+      if (!(spelling.path == file_id)) {
+        std::string path;
+        file_id = spelling.path;
+        uri = GetLsDocumentUri(db, file_id, &path);
+        working_file = working_files->GetFileByFilename(path);
+      }
+      optional<lsRange> range = GetLsRange(working_file, spelling.range);
       // TODO invalid location
-      if (loc)
-        entry.location = *loc;
+      if (range)
+        entry.location = lsLocation(uri, *range);
     }
     ret.push_back(std::move(entry));
-  });
+  }
   return ret;
 }
 
 struct CqueryMemberHierarchyInitialHandler
     : BaseMessageHandler<Ipc_CqueryMemberHierarchyInitial> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryMemberHierarchyInitial* request) override {
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
@@ -113,6 +129,7 @@ REGISTER_MESSAGE_HANDLER(CqueryMemberHierarchyInitialHandler);
 
 struct CqueryMemberHierarchyExpandHandler
     : BaseMessageHandler<Ipc_CqueryMemberHierarchyExpand> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryMemberHierarchyExpand* request) override {
     Out_CqueryMemberHierarchy out;
     out.id = request->id;
@@ -0,0 +1,32 @@
+#include "memory_usage.h"
+#include "message_handler.h"
+#include "queue_manager.h"
+
+namespace {
+struct Ipc_CqueryMemory : public RequestMessage<Ipc_CqueryMemory> {
+  const static IpcId kIpcId = IpcId::CqueryMemory;
+};
+MAKE_REFLECT_STRUCT(Ipc_CqueryMemory, id);
+REGISTER_IPC_MESSAGE(Ipc_CqueryMemory);
+
+struct Out_CqueryMemory : public lsOutMessage<Out_CqueryMemory> {
+  lsRequestId id;
+  std::vector<MemoryUsage> result;
+};
+MAKE_REFLECT_STRUCT(Out_CqueryMemory, jsonrpc, id, result);
+
+struct CqueryMemoryHandler : BaseMessageHandler<Ipc_CqueryMemory> {
+  bool IsReadOnly() const override { return true; }
+  void Run(Ipc_CqueryMemory* request) override {
+    // Readers hold |db->mutex|, so the querydb gauges can be made current.
+    UpdateQueryDbMemoryGauges(db);
+    UpdateWorkingFilesMemoryGauge(working_files);
+
+    Out_CqueryMemory out;
+    out.id = request->id;
+    out.result = GetMemoryUsage();
+    QueueManager::WriteStdout(IpcId::CqueryMemory, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(CqueryMemoryHandler);
+}  // namespace
@@ -0,0 +1,96 @@
+#include "cache_manager.h"
+#include "message_handler.h"
+#include "platform.h"
+#include "profiler.h"
+#include "queue_manager.h"
+
+#include <time.h>
+
+namespace {
+void EmitProfilerError(const lsRequestId& id, const std::string& message) {
+  Out_Error out;
+  out.id = id;
+  out.error.code = lsErrorCodes::InvalidRequest;
+  out.error.message = message;
+  QueueManager::WriteStdout(IpcId::Unknown, out);
+}
+
+struct Ipc_CqueryProfileStart
+    : public RequestMessage<Ipc_CqueryProfileStart> {
+  const static IpcId kIpcId = IpcId::CqueryProfileStart;
+  struct Params {
+    // Samples per second of CPU time.
+    int frequencyHz = 100;
+  };
+  Params params;
+};
+MAKE_REFLECT_STRUCT(Ipc_CqueryProfileStart::Params, frequencyHz);
+MAKE_REFLECT_STRUCT(Ipc_CqueryProfileStart, id, params);
+REGISTER_IPC_MESSAGE(Ipc_CqueryProfileStart);
+
+struct Out_CqueryProfileStart : public lsOutMessage<Out_CqueryProfileStart> {
+  lsRequestId id;
+  bool result = true;
+};
+MAKE_REFLECT_STRUCT(Out_CqueryProfileStart, jsonrpc, id, result);
+
+struct CqueryProfileStartHandler
+    : BaseMessageHandler<Ipc_CqueryProfileStart> {
+  bool IsReadOnly() const override { return true; }
+  void Run(Ipc_CqueryProfileStart* request) override {
+    optional<std::string> error = StartProfiler(request->params.frequencyHz);
+    if (error) {
+      EmitProfilerError(request->id, *error);
+      return;
+    }
+    Out_CqueryProfileStart out;
+    out.id = request->id;
+    QueueManager::WriteStdout(IpcId::CqueryProfileStart, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(CqueryProfileStartHandler);
+
+struct Ipc_CqueryProfileStop : public RequestMessage<Ipc_CqueryProfileStop> {
+  const static IpcId kIpcId = IpcId::CqueryProfileStop;
+};
+MAKE_REFLECT_STRUCT(Ipc_CqueryProfileStop, id);
+REGISTER_IPC_MESSAGE(Ipc_CqueryProfileStop);
+
+struct Out_CqueryProfileStop : public lsOutMessage<Out_CqueryProfileStop> {
+  struct Result {
+    // Profile in the folded stacks format, see StopProfiler.
+    std::string path;
+    size_t samples = 0;
+    size_t dropped = 0;
+  };
+  lsRequestId id;
+  Result result;
+};
+MAKE_REFLECT_STRUCT(Out_CqueryProfileStop::Result, path, samples, dropped);
+MAKE_REFLECT_STRUCT(Out_CqueryProfileStop, jsonrpc, id, result);
+
+struct CqueryProfileStopHandler : BaseMessageHandler<Ipc_CqueryProfileStop> {
+  bool IsReadOnly() const override { return true; }
+  void Run(Ipc_CqueryProfileStop* request) override {
+    std::string directory =
+        config->cacheDirectory + ICacheManager::kProfileDirectory + '/';
+    MakeDirectoryRecursive(directory);
+    std::string path =
+        directory + "cquery-" + std::to_string(time(nullptr)) + ".folded";
+
+    ProfileSummary summary;
+    optional<std::string> error = StopProfiler(path, &summary);
+    if (error) {
+      EmitProfilerError(request->id, *error);
+      return;
+    }
+    Out_CqueryProfileStop out;
+    out.id = request->id;
+    out.result.path = path;
+    out.result.samples = summary.samples;
+    out.result.dropped = summary.dropped;
+    QueueManager::WriteStdout(IpcId::CqueryProfileStop, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(CqueryProfileStopHandler);
+}  // namespace
@@ -0,0 +1,148 @@
+#include "cache_manager.h"
+#include "message_handler.h"
+#include "platform.h"
+#include "project.h"
+#include "queue_manager.h"
+#include "timer.h"
+#include "working_files.h"
+
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace {
+struct Ipc_CqueryReloadIndex
+    : public NotificationMessage<Ipc_CqueryReloadIndex> {
+  const static IpcId kIpcId = IpcId::CqueryReloadIndex;
+  // Set on the message the reload thread queues after installing the new
+  // database. |reindex| are the files imported into the old database while
+  // the new one was loading.
+  bool is_finished = false;
+  std::vector<std::string> reindex;
+};
+MAKE_REFLECT_EMPTY_STRUCT(Ipc_CqueryReloadIndex);
+REGISTER_IPC_MESSAGE(Ipc_CqueryReloadIndex);
+
+std::atomic<bool> g_reload_in_progress{false};
+
+// Runs |fn| on |num_threads| threads, including the calling one.
+template <typename Fn>
+void RunOnThreads(int num_threads, Fn fn) {
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.emplace_back(fn);
+  fn();
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+// Builds a database from the cached indexes of |paths| and swaps it with |db|.
+// Returns the files imported into |db| meanwhile.
+std::vector<std::string> ReloadFromCache(Config* config,
+                                         QueryDatabase* db,
+                                         const std::vector<std::string>& paths,
+                                         int num_threads) {
+  Timer time;
+  QueryDatabase reloaded;
+  {
+    std::vector<std::unique_ptr<IndexFile>> files(paths.size());
+    std::vector<std::unique_ptr<IdMap>> id_maps(paths.size());
+    std::vector<optional<IndexUpdate>> updates(paths.size());
+    std::atomic<size_t> next{0};
+    RunOnThreads(num_threads, [&]() {
+      std::shared_ptr<ICacheManager> cache_manager =
+          ICacheManager::Make(config);
+      for (size_t i = next++; i < paths.size(); i = next++) {
+        files[i] = cache_manager->TryTakeOrLoad(paths[i]);
+        if (!files[i])
+          continue;
+        id_maps[i] = MakeUnique<IdMap>(&reloaded, files[i]->id_cache);
+        updates[i] = IndexUpdate::CreateDelta(nullptr, id_maps[i].get(),
+                                              nullptr, files[i].get());
+      }
+    });
+
+    std::lock_guard<SharedMutex> lock(reloaded.mutex);
+    for (optional<IndexUpdate>& update : updates) {
+      if (update)
+        reloaded.ApplyIndexUpdate(&*update);
+    }
+  }
+  LOG_S(INFO) << "Loaded " << reloaded.files.size() << " files from the cache"
+              << " in " << time.ElapsedMicroseconds() / 1000 << "ms";
+
+  // IdMaps of the old database refer to its ids, so wait until there are
+  // none. Holding the lease mutex keeps new ones from being created.
+  std::vector<std::string> reindex;
+  {
+    std::unique_lock<std::mutex> lease_lock(db->id_lease_mutex);
+    db->id_leases_released.wait(lease_lock,
+                                [db]() { return db->id_leases == 0; });
+    std::lock_guard<SharedMutex> lock(db->mutex);
+    db->Swap(&reloaded);
+    reindex = std::move(*db->imported_files);
+    db->imported_files = nullopt;
+  }
+  // |reloaded| now holds the old database, which is freed on this thread.
+  return reindex;
+}
+
+struct CqueryReloadIndexHandler : BaseMessageHandler<Ipc_CqueryReloadIndex> {
+  void Run(Ipc_CqueryReloadIndex* request) override {
+    if (request->is_finished) {
+      Reindex(request->reindex);
+      g_reload_in_progress = false;
+      return;
+    }
+    if (g_reload_in_progress.exchange(true)) {
+      LOG_S(INFO) << "Ignoring $cquery/reloadIndex, a reload is in progress";
+      return;
+    }
+
+    std::vector<std::string> paths;
+    for (const QueryFile& file : db->files) {
+      if (file.def)
+        paths.push_back(file.def->path);
+    }
+    db->imported_files = std::vector<std::string>();
+    LOG_S(INFO) << "Reloading " << paths.size() << " files from the cache";
+
+    Config* config = this->config;
+    QueryDatabase* db = this->db;
+    int num_threads =
+        std::max(config->indexerCount,
+                 std::max<int>(std::thread::hardware_concurrency(), 1));
+    std::thread([config, db, paths, num_threads]() {
+      SetCurrentThreadName("reload");
+      auto message = MakeUnique<Ipc_CqueryReloadIndex>();
+      message->is_finished = true;
+      message->reindex = ReloadFromCache(config, db, paths, num_threads);
+      QueueManager::instance()->for_querydb.Enqueue(std::move(message));
+    }).detach();
+  }
+
+  // Reindexes the files which were imported into the old database while the
+  // new one was loading, since the cache may not have had their changes.
+  void Reindex(std::vector<std::string> paths) {
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    LOG_S(INFO) << "Reloaded the index; reindexing " << paths.size()
+                << " files which changed meanwhile";
+    for (const std::string& path : paths) {
+      optional<std::string> content = ReadContent(path);
+      if (!content)
+        continue;
+      Project::Entry entry = project->FindCompilationEntryForFile(path);
+      bool is_interactive = working_files->GetFileByFilename(path) != nullptr;
+      Index_Request index_request(entry.filename, entry.args, is_interactive,
+                                  *content, ICacheManager::Make(config));
+      index_request.is_inferred = entry.is_inferred;
+      QueueManager::instance()->index_request.Enqueue(
+          std::move(index_request));
+    }
+  }
+};
+REGISTER_MESSAGE_HANDLER(CqueryReloadIndexHandler);
+}  // namespace
@@ -0,0 +1,36 @@
+#include "message_handler.h"
+#include "metrics.h"
+#include "queue_manager.h"
+
+namespace {
+struct Ipc_CqueryStats : public RequestMessage<Ipc_CqueryStats> {
+  const static IpcId kIpcId = IpcId::CqueryStats;
+};
+MAKE_REFLECT_STRUCT(Ipc_CqueryStats, id);
+REGISTER_IPC_MESSAGE(Ipc_CqueryStats);
+
+struct Out_CqueryStats : public lsOutMessage<Out_CqueryStats> {
+  lsRequestId id;
+  std::vector<LatencyHistogram::Summary> result;
+};
+MAKE_REFLECT_STRUCT(LatencyHistogram::Summary,
+                    name,
+                    count,
+                    total_us,
+                    max_us,
+                    p50_us,
+                    p90_us,
+                    p99_us);
+MAKE_REFLECT_STRUCT(Out_CqueryStats, jsonrpc, id, result);
+
+struct CqueryStatsHandler : BaseMessageHandler<Ipc_CqueryStats> {
+  bool IsReadOnly() const override { return true; }
+  void Run(Ipc_CqueryStats* request) override {
+    Out_CqueryStats out;
+    out.id = request->id;
+    out.result = SummarizeLatencyHistograms();
+    QueueManager::WriteStdout(IpcId::CqueryStats, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(CqueryStatsHandler);
+}  // namespace
@@ -2,6 +2,8 @@
 #include "query_utils.h"
 #include "queue_manager.h"
 
+#include <unordered_map>
+
 namespace {
 struct Ipc_CqueryTypeHierarchyTree
     : public RequestMessage<Ipc_CqueryTypeHierarchyTree> {
@@ -27,10 +29,23 @@ MAKE_REFLECT_STRUCT(Out_CqueryTypeHierarchyTree::TypeEntry,
                     children);
 MAKE_REFLECT_STRUCT(Out_CqueryTypeHierarchyTree, jsonrpc, id, result);
 
+// Base entries of each type or function already built for a request. Every
+// derived entry lists the bases of its symbol, so the bases shared by a large
+// hierarchy are only built once.
+using ParentEntriesMemo =
+    std::unordered_map<RawId,
+                       std::vector<Out_CqueryTypeHierarchyTree::TypeEntry>>;
+
 std::vector<Out_CqueryTypeHierarchyTree::TypeEntry>
 BuildParentInheritanceHierarchyForType(QueryDatabase* db,
                                        WorkingFiles* working_files,
-                                       QueryType& root_type) {
+                                       QueryType& root_type,
+                                       ParentEntriesMemo* memo) {
+  RawId root_id = RawId(&root_type - db->types.data());
+  auto it = memo->find(root_id);
+  if (it != memo->end())
+    return it->second;
+
   std::vector<Out_CqueryTypeHierarchyTree::TypeEntry> parent_entries;
   parent_entries.reserve(root_type.def->parents.size());
 
@@ -42,18 +57,20 @@ BuildParentInheritanceHierarchyForType(QueryDatabase* db,
           parent_entry.location = GetLsLocation(
               db, working_files, *parent_type.def->definition_spelling);
         parent_entry.children = BuildParentInheritanceHierarchyForType(
-            db, working_files, parent_type);
+            db, working_files, parent_type, memo);
 
         parent_entries.push_back(parent_entry);
       });
 
+  (*memo)[root_id] = parent_entries;
   return parent_entries;
 }
 
 optional<Out_CqueryTypeHierarchyTree::TypeEntry>
 BuildInheritanceHierarchyForType(QueryDatabase* db,
                                  WorkingFiles* working_files,
-                                 QueryType& root_type) {
+                                 QueryType& root_type,
+                                 ParentEntriesMemo* memo) {
   Out_CqueryTypeHierarchyTree::TypeEntry entry;
 
   // Name and location.
@@ -69,14 +86,14 @@ BuildInheritanceHierarchyForType(QueryDatabase* db,
   base.name = "[[Base]]";
   base.location = entry.location;
   base.children =
-    BuildParentInheritanceHierarchyForType(db, working_files, root_type);
+      BuildParentInheritanceHierarchyForType(db, working_files, root_type, memo);
   if (!base.children.empty())
     entry.children.push_back(base);
 
   // Add derived.
   EachWithGen<QueryType>(db->types, root_type.derived, [&](QueryType& type) {
     auto derived_entry =
-        BuildInheritanceHierarchyForType(db, working_files, type);
+        BuildInheritanceHierarchyForType(db, working_files, type, memo);
     if (derived_entry)
       entry.children.push_back(*derived_entry);
   });
@@ -87,12 +104,16 @@ BuildInheritanceHierarchyForType(QueryDatabase* db,
 std::vector<Out_CqueryTypeHierarchyTree::TypeEntry>
 BuildParentInheritanceHierarchyForFunc(QueryDatabase* db,
                                        WorkingFiles* working_files,
-                                       QueryFuncId root) {
+                                       QueryFuncId root,
+                                       ParentEntriesMemo* memo) {
   std::vector<Out_CqueryTypeHierarchyTree::TypeEntry> entries;
 
   QueryFunc& root_func = db->funcs[root.id];
   if (!root_func.def || root_func.def->base.empty())
     return {};
+  auto it = memo->find(root.id);
+  if (it != memo->end())
+    return it->second;
 
   // FIXME WithGen
   for (auto parent_id : root_func.def->base) {
@@ -105,19 +126,21 @@ BuildParentInheritanceHierarchyForFunc(QueryDatabase* db,
     if (parent_func.def->definition_spelling)
       parent_entry.location = GetLsLocation(
           db, working_files, *parent_func.def->definition_spelling);
-    parent_entry.children =
-        BuildParentInheritanceHierarchyForFunc(db, working_files, parent_id.value);
+    parent_entry.children = BuildParentInheritanceHierarchyForFunc(
+        db, working_files, parent_id.value, memo);
 
     entries.push_back(parent_entry);
   }
 
+  (*memo)[root.id] = entries;
   return entries;
 }
 
 optional<Out_CqueryTypeHierarchyTree::TypeEntry>
 BuildInheritanceHierarchyForFunc(QueryDatabase* db,
                                  WorkingFiles* working_files,
-                                 QueryFuncId root_id) {
+                                 QueryFuncId root_id,
+                                 ParentEntriesMemo* memo) {
   QueryFunc& root_func = db->funcs[root_id.id];
   if (!root_func.def)
     return nullopt;
@@ -137,15 +160,15 @@ BuildInheritanceHierarchyForFunc(QueryDatabase* db,
   base.name = "[[Base]]";
   base.location = entry.location;
   base.children =
-      BuildParentInheritanceHierarchyForFunc(db, working_files, root_id);
+      BuildParentInheritanceHierarchyForFunc(db, working_files, root_id, memo);
   if (!base.children.empty())
     entry.children.push_back(base);
 
   // Add derived.
   // FIXME WithGen
   for (auto derived : root_func.derived) {
-    auto derived_entry =
-        BuildInheritanceHierarchyForFunc(db, working_files, derived.value);
+    auto derived_entry = BuildInheritanceHierarchyForFunc(
+        db, working_files, derived.value, memo);
     if (derived_entry)
       entry.children.push_back(*derived_entry);
   }
@@ -155,6 +178,7 @@ BuildInheritanceHierarchyForFunc(QueryDatabase* db,
 
 struct CqueryTypeHierarchyTreeHandler
     : BaseMessageHandler<Ipc_CqueryTypeHierarchyTree> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryTypeHierarchyTree* request) override {
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
@@ -166,6 +190,7 @@ struct CqueryTypeHierarchyTreeHandler
 
     Out_CqueryTypeHierarchyTree out;
     out.id = request->id;
+    ParentEntriesMemo memo;
 
     for (const SymbolRef& ref :
          FindSymbolsAtLocation(working_file, file, request->params.position)) {
@@ -173,12 +198,12 @@ struct CqueryTypeHierarchyTreeHandler
         QueryType& type = db->types[ref.idx.idx];
         if (type.def)
           out.result =
-              BuildInheritanceHierarchyForType(db, working_files, type);
+              BuildInheritanceHierarchyForType(db, working_files, type, &memo);
         break;
       }
       if (ref.idx.kind == SymbolKind::Func) {
-        out.result = BuildInheritanceHierarchyForFunc(db, working_files,
-                                                      QueryFuncId(ref.idx.idx));
+        out.result = BuildInheritanceHierarchyForFunc(
+            db, working_files, QueryFuncId(ref.idx.idx), &memo);
         break;
       }
     }
@@ -5,16 +5,33 @@
 namespace {
 struct Ipc_CqueryVars : public RequestMessage<Ipc_CqueryVars> {
   const static IpcId kIpcId = IpcId::CqueryVars;
-  lsTextDocumentPositionParams params;
+  struct Params {
+    lsTextDocumentIdentifier textDocument;
+    lsPosition position;
+    // cquery extension: the locations are ordered by proximity to
+    // |textDocument|, the first |startIndex| ones are skipped and, if
+    // |maxResults| is positive, at most |maxResults| are returned.
+    int startIndex = 0;
+    int maxResults = 0;
+  };
+  Params params;
 };
+MAKE_REFLECT_STRUCT(Ipc_CqueryVars::Params,
+                    textDocument,
+                    position,
+                    startIndex,
+                    maxResults);
 MAKE_REFLECT_STRUCT(Ipc_CqueryVars, id, params);
 REGISTER_IPC_MESSAGE(Ipc_CqueryVars);
 
 struct CqueryVarsHandler : BaseMessageHandler<Ipc_CqueryVars> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_CqueryVars* request) override {
+    QueryFileId file_id;
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
-                        request->params.textDocument.uri.GetPath(), &file)) {
+                        request->params.textDocument.uri.GetPath(), &file,
+                        &file_id)) {
       return;
     }
 
@@ -38,9 +55,9 @@ struct CqueryVarsHandler : BaseMessageHandler<Ipc_CqueryVars> {
         // fallthrough
         case SymbolKind::Type: {
           QueryType& type = db->types[id];
-          std::vector<QueryLocation> locations =
-              ToQueryLocation(db, &type.instances);
-          out.result = GetLsLocations(db, working_files, locations);
+          out.result = GetLsLocationsByProximity(
+              db, working_files, file_id, ToQueryLocation(db, &type.instances),
+              request->params.startIndex, request->params.maxResults);
           break;
         }
       }
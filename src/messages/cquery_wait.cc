@@ -1,6 +1,6 @@
-#include "import_manager.h"
 #include "import_pipeline.h"
 #include "message_handler.h"
+#include "project.h"
 #include "queue_manager.h"
 
 #include <loguru.hpp>
@@ -8,34 +8,34 @@
 namespace {
 struct Ipc_CqueryWait : public NotificationMessage<Ipc_CqueryWait> {
   static constexpr IpcId kIpcId = IpcId::CqueryWait;
+  // Number of times in a row querydb was found idle, kept while the message
+  // is suspended.
+  int idle_count = 0;
 };
 MAKE_REFLECT_EMPTY_STRUCT(Ipc_CqueryWait);
 REGISTER_IPC_MESSAGE(Ipc_CqueryWait);
 
-struct CqueryWaitHandler : MessageHandler {
-  IpcId GetId() const override { return IpcId::CqueryWait; }
-  void Run(std::unique_ptr<BaseIpcMessage> request) override {
-    // TODO: use status message system here, then run querydb as normal? Maybe
-    // this cannot be a normal message, ie, it needs to be re-entrant.
+struct CqueryWaitHandler : BaseMessageHandler<Ipc_CqueryWait> {
+  void Run(Ipc_CqueryWait* request) override {
+    // querydb imports while the message is suspended, and resumes it once it
+    // is idle. Messages received after it are held back meanwhile, so that
+    // they see the complete index. The project is installed and indexed only
+    // after it is loaded.
+    bool has_work = !project->is_loaded;
+    has_work |= import_pipeline_status->num_active_threads != 0;
+    has_work |= QueueManager::instance()->HasWork();
+    if (!has_work)
+      ++request->idle_count;
+    else
+      request->idle_count = 0;
 
-    LOG_S(INFO) << "Waiting for idle";
-    int idle_count = 0;
-    while (true) {
-      bool has_work = false;
-      has_work |= import_pipeline_status->num_active_threads != 0;
-      has_work |= QueueManager::instance()->HasWork();
-      has_work |=
-          QueryDb_ImportMain(config, db, import_manager, import_pipeline_status,
-                             semantic_cache, working_files);
-      if (!has_work)
-        ++idle_count;
-      else
-        idle_count = 0;
-
-      // There are race conditions between each of the three checks above,
-      // so we retry a bunch of times to try to avoid any.
-      if (idle_count > 10)
-        break;
+    // There are race conditions between each of the checks above, so we
+    // retry a bunch of times to try to avoid any.
+    if (request->idle_count <= 10) {
+      if (request->idle_count == 0)
+        LOG_S(INFO) << "Waiting for idle";
+      SuspendRequestAndLaterOnesUntil(kIdleEvent);
+      return;
     }
     LOG_S(INFO) << "Done waiting for idle";
   }
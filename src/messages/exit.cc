@@ -1,4 +1,6 @@
+#include "import_pipeline.h"
 #include "message_handler.h"
+#include "packed_cache_store.h"
 
 #include <loguru.hpp>
 
@@ -14,6 +16,10 @@ struct ExitHandler : MessageHandler {
 
   void Run(std::unique_ptr<BaseIpcMessage> request) override {
     LOG_S(INFO) << "Exiting; got IpcId::Exit";
+    // Finish the queued cache writes before the packed caches write their
+    // indexes and close.
+    CacheWriter_Stop();
+    PackedCacheStore::CloseAll();
     exit(0);
   }
 };
@@ -1,22 +1,31 @@
+#include "cache_collector.h"
 #include "cache_manager.h"
+#include "clang_complete.h"
+#include "import_manager.h"
 #include "import_pipeline.h"
 #include "include_complete.h"
+#include "indexer.h"
 #include "message_handler.h"
+#include "paged_allocator.h"
 #include "platform.h"
 #include "project.h"
 #include "queue_manager.h"
 #include "serializer.h"
 #include "serializers/json.h"
 #include "timer.h"
+#include "timestamp_manager.h"
 #include "working_files.h"
 
 #include <loguru.hpp>
 
+#include <algorithm>
 #include <stdexcept>
+#include <thread>
 
 // TODO Cleanup global variables
 extern std::string g_init_options;
 int g_index_comments;
+bool g_index_lazy_comments;
 
 namespace {
 
@@ -373,6 +382,15 @@ MAKE_REFLECT_STRUCT(lsClientCapabilities, workspace, textDocument);
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 
+struct lsWorkspaceFolder {
+  // The associated URI for this workspace folder.
+  lsDocumentUri uri;
+  // The name of the workspace folder, used to refer to it in the user
+  // interface.
+  std::string name;
+};
+MAKE_REFLECT_STRUCT(lsWorkspaceFolder, uri, name);
+
 struct lsInitializeParams {
   // The process Id of the parent process that started
   // the server. Is null if the process has not been started by another process.
@@ -391,6 +409,10 @@ struct lsInitializeParams {
   // `rootUri` wins.
   optional<lsDocumentUri> rootUri;
 
+  // The workspace folders configured in the client when the server starts.
+  // If set, |rootUri| is one of them.
+  optional<std::vector<lsWorkspaceFolder>> workspaceFolders;
+
   // User provided initialization options.
   optional<Config> initializationOptions;
 
@@ -442,6 +464,7 @@ MAKE_REFLECT_STRUCT(lsInitializeParams,
                     processId,
                     rootPath,
                     rootUri,
+                    workspaceFolders,
                     initializationOptions,
                     capabilities,
                     trace);
@@ -457,6 +480,10 @@ MAKE_REFLECT_STRUCT(lsInitializeError, retry);
 struct Ipc_InitializeRequest : public RequestMessage<Ipc_InitializeRequest> {
   const static IpcId kIpcId = IpcId::Initialize;
   lsInitializeParams params;
+  // Set on the message the project loading thread queues once the project of
+  // the workspace is loaded. |initialize_id| is the id of the request.
+  std::shared_ptr<Project> loaded_project;
+  lsRequestId initialize_id;
 };
 MAKE_REFLECT_STRUCT(Ipc_InitializeRequest, id, params);
 REGISTER_IPC_MESSAGE(Ipc_InitializeRequest);
@@ -473,6 +500,11 @@ MAKE_REFLECT_STRUCT(Out_InitializeResponse, jsonrpc, id, result);
 
 struct InitializeHandler : BaseMessageHandler<Ipc_InitializeRequest> {
   void Run(Ipc_InitializeRequest* request) override {
+    if (request->loaded_project) {
+      OnProjectLoaded(request);
+      return;
+    }
+
     // Log initialization parameters.
     rapidjson::StringBuffer output;
     rapidjson::Writer<rapidjson::StringBuffer> writer(output);
@@ -490,6 +522,9 @@ struct InitializeHandler : BaseMessageHandler<Ipc_InitializeRequest> {
           *config = *request->params.initializationOptions;
         else
           *config = Config();
+        // Worker commands run on this machine, so the client cannot set them;
+        // see Config::Index::workerCommands.
+        config->index.workerCommands.clear();
         rapidjson::Document reader;
         reader.Parse(g_init_options.c_str());
         if (!reader.HasParseError()) {
@@ -503,6 +538,19 @@ struct InitializeHandler : BaseMessageHandler<Ipc_InitializeRequest> {
         }
 
         g_index_comments = config->index.comments;
+        g_index_lazy_comments = config->index.lazyComments;
+        g_fast_usr_hash = config->fastUsrHash;
+        if (!GetIndexProfile(config->index.profile)) {
+          LOG_S(WARNING) << "Unknown index.profile \"" << config->index.profile
+                         << "\", indexing everything";
+          config->index.profile = "full";
+        }
+        if (!IsCacheCodecSupported(config->cacheCompression)) {
+          LOG_S(WARNING) << "cquery was built without support for the "
+                            "cacheCompression codec, storing the cache "
+                            "uncompressed";
+          config->cacheCompression = CacheCodec::None;
+        }
         if (config->cacheDirectory.empty()) {
           LOG_S(ERROR) << "cacheDirectory cannot be empty.";
           exit(1);
@@ -510,6 +558,17 @@ struct InitializeHandler : BaseMessageHandler<Ipc_InitializeRequest> {
           config->cacheDirectory = NormalizePath(config->cacheDirectory);
           EnsureEndsInSlash(config->cacheDirectory);
         }
+        if (!config->querydbPagedStorageDirectory.empty()) {
+          EnsureEndsInSlash(config->querydbPagedStorageDirectory);
+          if (!EnablePagedStorage(config->querydbPagedStorageDirectory)) {
+            LOG_S(ERROR) << "Unable to use querydbPagedStorageDirectory "
+                         << config->querydbPagedStorageDirectory;
+          }
+        }
+        if (!config->sharedCacheDirectory.empty())
+          EnsureEndsInSlash(config->sharedCacheDirectory);
+        if (!config->sharedCacheProjectRoot.empty())
+          EnsureEndsInSlash(config->sharedCacheProjectRoot);
       }
 
       // Client capabilities
@@ -562,9 +621,18 @@ struct InitializeHandler : BaseMessageHandler<Ipc_InitializeRequest> {
       // out.result.capabilities.textDocumentSync->willSaveWaitUntil =
       // true;
 
+      out.result.capabilities.codeLensProvider.resolveProvider =
+          config->codeLensResolve;
 #if USE_CLANG_CXX
       out.result.capabilities.documentFormattingProvider = true;
       out.result.capabilities.documentRangeFormattingProvider = true;
+      if (config->formatOnType) {
+        lsDocumentOnTypeFormattingOptions on_type_formatting;
+        on_type_formatting.firstTriggerCharacter = "}";
+        on_type_formatting.moreTriggerCharacter = {";"};
+        out.result.capabilities.documentOnTypeFormattingProvider =
+            on_type_formatting;
+      }
 #endif
 
       QueueManager::WriteStdout(IpcId::Initialize, out);
@@ -572,65 +640,216 @@ struct InitializeHandler : BaseMessageHandler<Ipc_InitializeRequest> {
       // Set project root.
       config->projectRoot = NormalizePath(request->params.rootUri->GetPath());
       EnsureEndsInSlash(config->projectRoot);
+      // Every workspace folder feeds the same querydb and cache. Folders
+      // other than projectRoot are cached like files outside of the project.
+      config->workspaceFolders = {config->projectRoot};
+      if (request->params.workspaceFolders) {
+        for (const lsWorkspaceFolder& folder :
+             *request->params.workspaceFolders) {
+          std::string root = NormalizePath(folder.uri.GetPath());
+          EnsureEndsInSlash(root);
+          if (std::find(config->workspaceFolders.begin(),
+                        config->workspaceFolders.end(),
+                        root) == config->workspaceFolders.end()) {
+            LOG_S(INFO) << "Adding workspace folder " << root;
+            config->workspaceFolders.push_back(root);
+          }
+        }
+      }
       // Create two cache directories for files inside and outside of the project.
+      std::string project_directory =
+          ICacheManager::GetProjectDirectoryName(config);
+      MakeDirectoryRecursive(config->cacheDirectory + project_directory);
+      MakeDirectoryRecursive(config->cacheDirectory + '@' + project_directory);
       MakeDirectoryRecursive(config->cacheDirectory +
-                             EscapeFileName(config->projectRoot));
-      MakeDirectoryRecursive(config->cacheDirectory +
-                             '@' + EscapeFileName(config->projectRoot));
+                             ICacheManager::kContentsBlobDirectory);
+      // Other checkouts sharing the indexes under projectCacheKey rewrite them
+      // without updating the timestamps saved for this one.
+      timestamp_manager->Load(config->cacheDirectory +
+                                  EscapeFileName(config->projectRoot) +
+                                  ".include_graph",
+                              config->projectCacheKey.empty());
 
       Timer time;
+      import_pipeline_status->snapshot.Init(config);
+      if (import_pipeline_status->snapshot.Load(db)) {
+        for (const QueryFile& file : db->files) {
+          if (file.def)
+            import_manager->MarkLoadedFromSnapshot(file.def->path);
+        }
+        time.ResetAndPrint("[perf] Loaded querydb snapshot (" +
+                           std::to_string(db->files.size()) + " files)");
+      }
 
-      // Open up / load the project.
-      project->Load(config, config->extraClangArguments,
-                    config->compilationDatabaseDirectory, project_path,
-                    config->resourceDirectory);
-      time.ResetAndPrint("[perf] Loaded compilation entries (" +
-                         std::to_string(project->entries.size()) + " files)");
-
-      // Start indexer threads. Start this after loading the project, as that
-      // may take a long time. Indexer threads will emit status/progress
-      // reports.
-      if (config->indexerCount == 0) {
-        // If the user has not specified how many indexers to run, try to
-        // guess an appropriate value. Default to 80% utilization.
-        const float kDefaultTargetUtilization = 0.8f;
-        config->indexerCount = (int)(std::thread::hardware_concurrency() *
-                                     kDefaultTargetUtilization);
-        if (config->indexerCount <= 0)
-          config->indexerCount = 1;
+      // Loading the project, ie, reading compile_commands.json or listing the
+      // workspace folders, may take a long time. Load it in the background so
+      // that requests which do not need it are served meanwhile; indexing
+      // starts once it is loaded.
+      Config* config = this->config;
+      TimestampManager* timestamp_manager = this->timestamp_manager;
+      lsRequestId id = request->id;
+      project->is_loading = true;
+      std::thread([config, timestamp_manager, id]() {
+        SetCurrentThreadName("project_load");
+        Timer time;
+        timestamp_manager->PrefetchModificationTimes();
+        time.ResetAndPrint("[perf] Prefetched modification times");
+
+        auto message = MakeUnique<Ipc_InitializeRequest>();
+        message->loaded_project = std::make_shared<Project>();
+        message->loaded_project->Load(
+            config, config->extraClangArguments,
+            config->compilationDatabaseDirectory, config->workspaceFolders,
+            config->resourceDirectory);
+        time.ResetAndPrint(
+            "[perf] Loaded compilation entries (" +
+            std::to_string(message->loaded_project->entries.size()) +
+            " files)");
+        message->initialize_id = id;
+        QueueManager::instance()->for_querydb.Enqueue(std::move(message));
+      }).detach();
+    }
+  }
+
+  // Installs the project loaded in the background, starts the indexers and
+  // dispatches the project files.
+  void OnProjectLoaded(Ipc_InitializeRequest* request) {
+    project->Swap(request->loaded_project.get());
+    project->is_loading = false;
+    Timer time;
+
+    // Start indexer threads. Start this after loading the project, as that
+    // may take a long time. Indexer threads will emit status/progress
+    // reports.
+    if (config->indexerCount == 0) {
+      // If the user has not specified how many indexers to run, try to
+      // guess an appropriate value. Default to 80% utilization.
+      const float kDefaultTargetUtilization = 0.8f;
+      config->indexerCount = (int)(std::thread::hardware_concurrency() *
+                                   kDefaultTargetUtilization);
+      if (config->indexerCount <= 0)
+        config->indexerCount = 1;
+    }
+    LOG_S(INFO) << "Starting " << config->indexerCount << " indexers";
+    import_pipeline_status->throttle.Init(config);
+    import_pipeline_status->memory_governor.Init(config);
+    import_pipeline_status->diagnostics_publisher.Init(config);
+    for (int i = 0; i < config->indexerCount; ++i) {
+      WorkThread::StartThread(
+          "indexer" + std::to_string(i), ThreadKind::Indexer, [=]() {
+            Indexer_Main(i, config, db, file_consumer_shared,
+                         timestamp_manager, import_manager,
+                         import_pipeline_status, project, working_files,
+                         waiter);
+          });
+    }
+
+    if (config->querydbReaderThreads > 0) {
+      LOG_S(INFO) << "Starting " << config->querydbReaderThreads
+                  << " querydb readers";
+      StartQueryDbReaders(db, &import_pipeline_status->throttle,
+                          config->querydbReaderThreads);
+    }
+
+    WorkThread::StartThread("cache_writer", [=]() {
+      CacheWriter_Main(timestamp_manager, import_pipeline_status);
+    });
+
+    if (config->cacheCollectGarbage) {
+      std::vector<std::string> project_files;
+      for (const Project::Entry& entry : project->entries)
+        project_files.push_back(entry.filename);
+      WorkThread::StartThread("cache_collector", [=]() {
+        SetCurrentThreadLowPriority();
+        CollectCacheGarbage(config, timestamp_manager, project_files);
+      });
+    }
+
+    // Start scanning include directories before dispatching project
+    // files, because that takes a long time.
+    include_complete->Rescan();
+
+    if (config->index.watchFiles) {
+      // Include directories inside of a workspace folder are already
+      // watched.
+      std::vector<std::string> watched = config->workspaceFolders;
+      std::vector<std::string> directories =
+          project->quote_include_directories;
+      // A change of the compilation database reloads the project.
+      if (!config->compilationDatabaseDirectory.empty()) {
+        std::string directory =
+            NormalizePath(config->compilationDatabaseDirectory);
+        EnsureEndsInSlash(directory);
+        directories.push_back(directory);
       }
-      LOG_S(INFO) << "Starting " << config->indexerCount << " indexers";
-      for (int i = 0; i < config->indexerCount; ++i) {
-        WorkThread::StartThread("indexer" + std::to_string(i), [=]() {
-          Indexer_Main(config, file_consumer_shared, timestamp_manager,
-                       import_manager, import_pipeline_status, project,
-                       working_files, waiter);
-        });
+      for (const std::string& directory : directories) {
+        bool inside = false;
+        for (const std::string& folder : config->workspaceFolders)
+          inside = inside || StartsWith(directory, folder);
+        if (!inside)
+          watched.push_back(directory);
       }
+      StartFileWatcher(watched);
+    }
 
-      // Start scanning include directories before dispatching project
-      // files, because that takes a long time.
-      include_complete->Rescan();
-
-      auto* queue = QueueManager::instance();
-      time.Reset();
-      project->ForAllFilteredFiles(config, [&](int i,
-                                               const Project::Entry& entry) {
-        optional<std::string> content = ReadContent(entry.filename);
-        if (!content) {
-          LOG_S(ERROR) << "When loading project, canont read file "
-                       << entry.filename;
-          return;
-        }
-        bool is_interactive =
-            working_files->GetFileByFilename(entry.filename) != nullptr;
-        queue->index_request.Enqueue(Index_Request(
-            entry.filename, entry.args, is_interactive, *content, ICacheManager::Make(config), request->id));
-      });
+    // Completion sessions of the files opened meanwhile were created without
+    // the project, and their index requests were not sent. Open project files
+    // are dispatched first below, the others are indexed right away.
+    auto* queue = QueueManager::instance();
+    std::vector<std::string> open_files;
+    working_files->DoAction([&]() {
+      for (const std::unique_ptr<WorkingFile>& file : working_files->files)
+        open_files.push_back(file->filename);
+    });
+    for (const std::string& path : open_files) {
+      clang_complete->NotifyClose(path);
+      clang_complete->NotifyView(path);
+      Project::Entry entry = project->FindCompilationEntryForFile(path);
+      if (!entry.is_inferred)
+        continue;
+      Index_Request index_request(entry.filename, entry.args,
+                                  true /*is_interactive*/, nullopt,
+                                  ICacheManager::Make(config));
+      index_request.is_inferred = true;
+      queue->index_request.PriorityEnqueue(std::move(index_request));
+    }
+
+    // Dispatch the translation units which took longest to index last time
+    // first, so that a single huge translation unit does not end up being
+    // indexed by one thread while the others are idle. Files without a
+    // recorded time keep their order, after the others. Open files still
+    // go first. The indexers read the files, and only those which are not
+    // up to date in the cache.
+    std::vector<std::pair<uint64_t, const Project::Entry*>> entries;
+    project->ForAllFilteredFiles(config, [&](int i,
+                                             const Project::Entry& entry) {
+      entries.emplace_back(
+          timestamp_manager->GetParseTime(entry.filename).value_or(0),
+          &entry);
+    });
+    std::stable_sort(
+        entries.begin(), entries.end(),
+        [](const std::pair<uint64_t, const Project::Entry*>& a,
+           const std::pair<uint64_t, const Project::Entry*>& b) {
+          return a.first > b.first;
+        });
 
-      // We need to support multiple concurrent index processes.
-      time.ResetAndPrint("[perf] Dispatched initial index requests");
+    time.Reset();
+    for (const auto& pair : entries) {
+      const Project::Entry& entry = *pair.second;
+      bool is_interactive =
+          working_files->GetFileByFilename(entry.filename) != nullptr;
+      Index_Request index_request(entry.filename, entry.args, is_interactive,
+                                  nullopt, ICacheManager::Make(config),
+                                  request->initialize_id);
+      if (is_interactive)
+        queue->index_request.PriorityEnqueue(std::move(index_request));
+      else
+        queue->index_request.Enqueue(std::move(index_request));
     }
+
+    // We need to support multiple concurrent index processes.
+    time.ResetAndPrint("[perf] Dispatched initial index requests");
   }
 };
 REGISTER_MESSAGE_HANDLER(InitializeHandler);
@@ -1,3 +1,4 @@
+#include "import_pipeline.h"
 #include "message_handler.h"
 #include "queue_manager.h"
 
@@ -16,6 +17,7 @@ MAKE_REFLECT_STRUCT(Out_Shutdown, jsonrpc, id, result);
 
 struct ShutdownHandler : BaseMessageHandler<Ipc_Shutdown> {
   void Run(Ipc_Shutdown* request) override {
+    import_pipeline_status->snapshot.MaybeSave(db, true /*force*/);
     Out_Shutdown out;
     out.id = request->id;
     QueueManager::WriteStdout(IpcId::TextDocumentDefinition, out);
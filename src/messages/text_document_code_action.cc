@@ -11,7 +11,9 @@
 
 namespace {
 
-optional<int> FindIncludeLine(const std::vector<std::string>& lines,
+// |Lines| is std::vector<std::string> or TextLines.
+template <typename Lines>
+optional<int> FindIncludeLine(const Lines& lines,
                               const std::string& full_include_line) {
   //
   // This returns an include line. For example,
@@ -35,7 +37,7 @@ optional<int> FindIncludeLine(const std::vector<std::string>& lines,
   int last_line_compare = 1;
 
   for (int line = 0; line < (int)lines.size(); ++line) {
-    std::string text = Trim(lines[line]);
+    std::string text = Trim(std::string(lines[line]));
     if (!StartsWith(text, "#include")) {
       last_line_compare = 1;
       continue;
@@ -93,29 +95,11 @@ optional<QueryFileId> GetImplementationFile(QueryDatabase* db,
     }
   }
 
-  // No associated definition, scan the project for a file in the same
-  // directory with the same base-name.
-  NormalizedPath original_path(file->def->path);
-  std::string target_path = original_path.path;
-  size_t last = target_path.find_last_of('.');
-  if (last != std::string::npos) {
-    target_path = target_path.substr(0, last);
-  }
-
-  LOG_S(INFO) << "!! Looking for impl file that starts with " << target_path;
-
-  for (auto& entry : db->usr_to_file) {
-    const NormalizedPath& path = entry.first;
-
-    // Do not consider header files for implementation files.
-    // TODO: make file extensions configurable.
-    if (EndsWith(path.path, ".h") || EndsWith(path.path, ".hpp"))
-      continue;
-
-    if (StartsWith(path.path, target_path) && path != original_path) {
-      return entry.second;
-    }
-  }
+  // No associated definition, use the source file with the same base name.
+  Maybe<QueryFileId> impl_file_id =
+      db->GetImplementationFileFromPath(file->def->path);
+  if (impl_file_id)
+    return *impl_file_id;
 
   return nullopt;
 }
@@ -134,9 +118,9 @@ void EnsureImplFile(QueryDatabase* db,
 
     QueryFile& impl_file = db->files[impl_file_id->id];
     if (impl_file.def)
-      impl_uri = lsDocumentUri::FromPath(impl_file.def->path);
+      impl_uri = impl_file.GetUri();
     else
-      impl_uri = lsDocumentUri::FromPath(file.def->path);
+      impl_uri = file.GetUri();
   }
 }
 
@@ -448,10 +432,17 @@ struct TextDocumentCodeActionHandler
 
         std::unordered_set<std::string> include_absolute_paths;
 
-        // Find include candidate strings.
-        for (int i = 0; i < db->symbols.size(); ++i) {
+        // Find include candidate strings. Only the symbols which the name
+        // index returns can match, unless the query is too short for it. The
+        // index is case insensitive and may be stale, so check each one.
+        optional<std::vector<uint32_t>> candidates =
+            db->symbol_search_index.SubstringCandidates(include_query);
+        size_t num_candidates =
+            candidates ? candidates->size() : db->symbols.size();
+        for (size_t j = 0; j < num_candidates; ++j) {
           if (include_absolute_paths.size() > kMaxResults)
             break;
+          RawId i = candidates ? (*candidates)[j] : RawId(j);
           if (db->GetSymbolDetailedName(i).find(include_query) ==
               std::string::npos)
             continue;
@@ -2,6 +2,7 @@
 #include "message_handler.h"
 #include "query_utils.h"
 #include "queue_manager.h"
+#include "response_cache.h"
 
 namespace {
 struct lsDocumentCodeLensParams {
@@ -9,8 +10,31 @@ struct lsDocumentCodeLensParams {
 };
 MAKE_REFLECT_STRUCT(lsDocumentCodeLensParams, textDocument);
 
-struct lsCodeLensUserData {};
-MAKE_REFLECT_EMPTY_STRUCT(lsCodeLensUserData);
+// Locations shown by a code lens.
+enum class CodeLensKind : uint8_t {
+  Refs,
+  Derived,
+  Vars,
+  Calls,
+  DirectCalls,
+  BaseCalls,
+  DerivedCalls,
+  Base,
+  // Jumps to the only base of a function.
+  GotoBase
+};
+MAKE_REFLECT_TYPE_PROXY(CodeLensKind);
+
+// Identifies the locations of a code lens, so codeLens/resolve can compute
+// them.
+struct lsCodeLensUserData {
+  lsDocumentUri uri;
+  SymbolKind symbolKind = SymbolKind::Invalid;
+  int id = -1;
+  Generation gen = 0;
+  CodeLensKind kind = CodeLensKind::Refs;
+};
+MAKE_REFLECT_STRUCT(lsCodeLensUserData, uri, symbolKind, id, gen, kind);
 
 struct lsCodeLensCommandArguments {
   lsDocumentUri uri;
@@ -24,16 +48,9 @@ void Reflect(Writer& visitor, lsCodeLensCommandArguments& value) {
   Reflect(visitor, value.locations);
   visitor.EndArray();
 }
-#if false
-void Reflect(Reader& visitor, lsCodeLensCommandArguments& value) {
-  auto it = visitor.Begin();
-  Reflect(*it, value.uri);
-  ++it;
-  Reflect(*it, value.position);
-  ++it;
-  Reflect(*it, value.locations);
-}
-#endif
+// Lens are resolved before they have a command, so the arguments are never
+// read.
+void Reflect(Reader& visitor, lsCodeLensCommandArguments& value) {}
 
 using TCodeLens = lsCodeLens<lsCodeLensUserData, lsCodeLensCommandArguments>;
 struct Ipc_TextDocumentCodeLens
@@ -52,11 +69,8 @@ struct Out_TextDocumentCodeLens
 };
 MAKE_REFLECT_STRUCT(Out_TextDocumentCodeLens, jsonrpc, id, result);
 
-#if false
-struct Ipc_CodeLensResolve : public IpcMessage<Ipc_CodeLensResolve> {
+struct Ipc_CodeLensResolve : public RequestMessage<Ipc_CodeLensResolve> {
   const static IpcId kIpcId = IpcId::CodeLensResolve;
-
-  lsRequestId id;
   TCodeLens params;
 };
 MAKE_REFLECT_STRUCT(Ipc_CodeLensResolve, id, params);
@@ -67,56 +81,273 @@ struct Out_CodeLensResolve : public lsOutMessage<Out_CodeLensResolve> {
   TCodeLens result;
 };
 MAKE_REFLECT_STRUCT(Out_CodeLensResolve, jsonrpc, id, result);
-#endif
 
-struct CommonCodeLensParams {
-  std::vector<TCodeLens>* result;
-  QueryDatabase* db;
-  WorkingFiles* working_files;
-  WorkingFile* working_file;
-};
+void GetCodeLensNames(CodeLensKind kind,
+                      const char** singular,
+                      const char** plural) {
+  switch (kind) {
+    case CodeLensKind::Refs:
+      *singular = "ref";
+      *plural = "refs";
+      return;
+    case CodeLensKind::Derived:
+      *singular = *plural = "derived";
+      return;
+    case CodeLensKind::Vars:
+      *singular = "var";
+      *plural = "vars";
+      return;
+    case CodeLensKind::Calls:
+      *singular = "call";
+      *plural = "calls";
+      return;
+    case CodeLensKind::DirectCalls:
+      *singular = "direct call";
+      *plural = "direct calls";
+      return;
+    case CodeLensKind::BaseCalls:
+      *singular = "base call";
+      *plural = "base calls";
+      return;
+    case CodeLensKind::DerivedCalls:
+      *singular = "derived call";
+      *plural = "derived calls";
+      return;
+    case CodeLensKind::Base:
+      *singular = *plural = "base";
+      return;
+    case CodeLensKind::GotoBase:
+      *singular = *plural = "Base";
+      return;
+  }
+}
 
-void AddCodeLens(const char* singular,
-                 const char* plural,
-                 CommonCodeLensParams* common,
-                 QueryLocation loc,
-                 const std::vector<QueryLocation>& uses,
-                 optional<QueryLocation> excluded,
-                 bool force_display) {
-  TCodeLens code_lens;
-  optional<lsRange> range = GetLsRange(common->working_file, loc.range);
-  if (!range)
-    return;
-  code_lens.range = *range;
-  code_lens.command = lsCommand<lsCodeLensCommandArguments>();
-  code_lens.command->command = "cquery.showReferences";
-  code_lens.command->arguments.uri = GetLsDocumentUri(common->db, loc.path);
-  code_lens.command->arguments.position = code_lens.range.start;
+template <typename Q>
+Q* GetCodeLensSymbol(std::vector<Q>& symbols, const lsCodeLensUserData& data) {
+  if (data.id < 0 || size_t(data.id) >= symbols.size())
+    return nullptr;
+  Q* symbol = &symbols[data.id];
+  if (symbol->gen != data.gen || !symbol->def)
+    return nullptr;
+  return symbol;
+}
+
+// Returns true if the lens described by |data| has any location. This does
+// not build the locations, so lens which are hidden when empty are cheap.
+bool HasCodeLensUses(QueryDatabase* db, const lsCodeLensUserData& data) {
+  switch (data.symbolKind) {
+    case SymbolKind::Type: {
+      QueryType* type = GetCodeLensSymbol(db->types, data);
+      if (!type)
+        return false;
+      if (data.kind == CodeLensKind::Derived)
+        return !type->derived.empty();
+      if (data.kind == CodeLensKind::Vars)
+        return !type->instances.empty();
+      break;
+    }
+    case SymbolKind::Func: {
+      QueryFunc* func = GetCodeLensSymbol(db->funcs, data);
+      if (!func)
+        return false;
+      if (data.kind == CodeLensKind::Calls ||
+          data.kind == CodeLensKind::DirectCalls)
+        return !func->callers.empty();
+      if (data.kind == CodeLensKind::BaseCalls)
+        return HasCallersForAllBaseFunctions(db, *func);
+      if (data.kind == CodeLensKind::DerivedCalls)
+        return HasCallersForAllDerivedFunctions(db, *func);
+      if (data.kind == CodeLensKind::Derived)
+        return !func->derived.empty();
+      if (data.kind == CodeLensKind::Base ||
+          data.kind == CodeLensKind::GotoBase)
+        return !func->def->base.empty();
+      break;
+    }
+    case SymbolKind::Var: {
+      QueryVar* var = GetCodeLensSymbol(db->vars, data);
+      if (!var)
+        return false;
+      if (data.kind == CodeLensKind::Refs) {
+        const Maybe<QueryLocation>& spelling = var->def->definition_spelling;
+        for (const QueryLocation& use : var->uses)
+          if (!spelling || !(use == *spelling))
+            return true;
+        return false;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return true;
+}
+
+// Returns the locations of the lens described by |data|. |excluded| is set to
+// a location which should not be shown.
+std::vector<QueryLocation> GetCodeLensUses(QueryDatabase* db,
+                                           const lsCodeLensUserData& data,
+                                           optional<QueryLocation>* excluded) {
+  switch (data.symbolKind) {
+    case SymbolKind::Type: {
+      QueryType* type = GetCodeLensSymbol(db->types, data);
+      if (!type)
+        break;
+      if (data.kind == CodeLensKind::Refs) {
+        if (type->def->definition_spelling)
+          *excluded = *type->def->definition_spelling;
+        return std::vector<QueryLocation>(type->uses.begin(), type->uses.end());
+      }
+      if (data.kind == CodeLensKind::Derived)
+        return ToQueryLocation(db, &type->derived);
+      if (data.kind == CodeLensKind::Vars)
+        return ToQueryLocation(db, &type->instances);
+      break;
+    }
+    case SymbolKind::Func: {
+      QueryFunc* func = GetCodeLensSymbol(db->funcs, data);
+      if (!func)
+        break;
+      if (data.kind == CodeLensKind::Calls ||
+          data.kind == CodeLensKind::DirectCalls)
+        return ToQueryLocation(db, func->callers);
+      if (data.kind == CodeLensKind::BaseCalls)
+        return ToQueryLocation(db, GetCallersForAllBaseFunctions(db, *func));
+      if (data.kind == CodeLensKind::DerivedCalls)
+        return ToQueryLocation(db,
+                               GetCallersForAllDerivedFunctions(db, *func));
+      if (data.kind == CodeLensKind::Derived)
+        return ToQueryLocation(db, &func->derived);
+      if (data.kind == CodeLensKind::Base)
+        return ToQueryLocation(db, &func->def->base);
+      break;
+    }
+    case SymbolKind::Var: {
+      QueryVar* var = GetCodeLensSymbol(db->vars, data);
+      if (!var || data.kind != CodeLensKind::Refs)
+        break;
+      if (var->def->definition_spelling)
+        *excluded = *var->def->definition_spelling;
+      return std::vector<QueryLocation>(var->uses.begin(), var->uses.end());
+    }
+    default:
+      break;
+  }
+  return {};
+}
+
+// Sets the command of a CodeLensKind::GotoBase lens. Returns false if the
+// base has no definition.
+bool ResolveGotoBaseCodeLens(QueryDatabase* db,
+                             WorkingFiles* working_files,
+                             TCodeLens* code_lens) {
+  code_lens->command = lsCommand<lsCodeLensCommandArguments>();
+  code_lens->command->title = "Base";
+  code_lens->command->command = "cquery.goto";
+  code_lens->command->arguments.uri = code_lens->data.uri;
+  code_lens->command->arguments.position = code_lens->range.start;
+
+  QueryFunc* func = GetCodeLensSymbol(db->funcs, code_lens->data);
+  if (!func || func->def->base.empty())
+    return false;
+  // FIXME WithGen
+  optional<QueryLocation> base_loc =
+      GetDefinitionSpellingOfSymbol(db, func->def->base[0].value);
+  if (!base_loc)
+    return false;
+  optional<lsLocation> ls_base = GetLsLocation(db, working_files, *base_loc);
+  if (!ls_base)
+    return false;
+  code_lens->command->arguments.uri = ls_base->uri;
+  code_lens->command->arguments.position = ls_base->range.start;
+  return true;
+}
+
+// Sets the command of |code_lens| from its data. Returns the number of
+// locations.
+size_t ResolveCodeLens(QueryDatabase* db,
+                       WorkingFiles* working_files,
+                       TCodeLens* code_lens) {
+  if (code_lens->data.kind == CodeLensKind::GotoBase)
+    return ResolveGotoBaseCodeLens(db, working_files, code_lens) ? 1 : 0;
+
+  optional<QueryLocation> excluded;
+  std::vector<QueryLocation> uses =
+      GetCodeLensUses(db, code_lens->data, &excluded);
+
+  code_lens->command = lsCommand<lsCodeLensCommandArguments>();
+  code_lens->command->command = "cquery.showReferences";
+  code_lens->command->arguments.uri = code_lens->data.uri;
+  code_lens->command->arguments.position = code_lens->range.start;
 
   // Add unique uses.
   std::unordered_set<lsLocation> unique_uses;
   for (const QueryLocation& use : uses) {
     if (excluded == use)
       continue;
-    optional<lsLocation> location =
-        GetLsLocation(common->db, common->working_files, use);
+    optional<lsLocation> location = GetLsLocation(db, working_files, use);
     if (!location)
       continue;
     unique_uses.insert(*location);
   }
-  code_lens.command->arguments.locations.assign(unique_uses.begin(),
-                                                unique_uses.end());
+  code_lens->command->arguments.locations.assign(unique_uses.begin(),
+                                                 unique_uses.end());
 
   // User visible label
+  const char* singular = "";
+  const char* plural = "";
+  GetCodeLensNames(code_lens->data.kind, &singular, &plural);
   size_t num_usages = unique_uses.size();
-  code_lens.command->title = std::to_string(num_usages) + " ";
+  code_lens->command->title = std::to_string(num_usages) + " ";
   if (num_usages == 1)
-    code_lens.command->title += singular;
+    code_lens->command->title += singular;
   else
-    code_lens.command->title += plural;
+    code_lens->command->title += plural;
+  return num_usages;
+}
 
-  if (force_display || unique_uses.size() > 0)
-    common->result->push_back(code_lens);
+struct CommonCodeLensParams {
+  std::vector<TCodeLens>* result;
+  QueryDatabase* db;
+  WorkingFiles* working_files;
+  WorkingFile* working_file;
+  // If true, lens are sent without a command and resolved by
+  // codeLens/resolve.
+  bool resolve;
+  // Uri of |uri_file|; lens are almost always in the requested file.
+  QueryFileId uri_file;
+  lsDocumentUri uri;
+};
+
+void AddCodeLens(CommonCodeLensParams* common,
+                 QueryLocation loc,
+                 SymbolIdx symbol,
+                 Generation gen,
+                 CodeLensKind kind,
+                 bool force_display) {
+  TCodeLens code_lens;
+  code_lens.data.symbolKind = symbol.kind;
+  code_lens.data.id = int(symbol.idx);
+  code_lens.data.gen = gen;
+  code_lens.data.kind = kind;
+  if (!force_display && !HasCodeLensUses(common->db, code_lens.data))
+    return;
+
+  optional<lsRange> range = GetLsRange(common->working_file, loc.range);
+  if (!range)
+    return;
+  code_lens.range = *range;
+  if (common->uri_file.id != loc.path.id) {
+    common->uri_file = loc.path;
+    common->uri = GetLsDocumentUri(common->db, loc.path);
+  }
+  code_lens.data.uri = common->uri;
+
+  if (!common->resolve &&
+      !ResolveCodeLens(common->db, common->working_files, &code_lens) &&
+      !force_display)
+    return;
+  common->result->push_back(code_lens);
 }
 
 struct TextDocumentCodeLensHandler
@@ -135,12 +366,19 @@ struct TextDocumentCodeLensHandler
                         request->params.textDocument.uri.GetPath(), &file)) {
       return;
     }
+    ResponseCache::Key cache_key =
+        ResponseCache::GetKey(db, working_files, file->def->path);
+    if (response_cache->TryWrite(IpcId::TextDocumentCodeLens, file->def->path,
+                                 cache_key, request->id)) {
+      return;
+    }
 
     CommonCodeLensParams common;
     common.result = &out.result;
     common.db = db;
     common.working_files = working_files;
     common.working_file = working_files->GetFileByFilename(file->def->path);
+    common.resolve = config->codeLensResolve;
 
     for (SymbolRef ref : file->def->outline) {
       // NOTE: We OffsetColumn so that the code lens always show up in a
@@ -154,16 +392,12 @@ struct TextDocumentCodeLensHandler
             continue;
           if (type.def->kind == ClangSymbolKind::Namespace)
             continue;
-          AddCodeLens("ref", "refs", &common, ref.loc.OffsetStartColumn(0),
-                      type.uses, type.def->definition_spelling,
-                      true /*force_display*/);
-          AddCodeLens("derived", "derived", &common,
-                      ref.loc.OffsetStartColumn(1),
-                      ToQueryLocation(db, &type.derived), nullopt,
-                      false /*force_display*/);
-          AddCodeLens("var", "vars", &common, ref.loc.OffsetStartColumn(2),
-                      ToQueryLocation(db, &type.instances), nullopt,
-                      false /*force_display*/);
+          AddCodeLens(&common, ref.loc.OffsetStartColumn(0), symbol, type.gen,
+                      CodeLensKind::Refs, true /*force_display*/);
+          AddCodeLens(&common, ref.loc.OffsetStartColumn(1), symbol, type.gen,
+                      CodeLensKind::Derived, false /*force_display*/);
+          AddCodeLens(&common, ref.loc.OffsetStartColumn(2), symbol, type.gen,
+                      CodeLensKind::Vars, false /*force_display*/);
           break;
         }
         case SymbolKind::Func: {
@@ -186,67 +420,40 @@ struct TextDocumentCodeLensHandler
             return *def;
           };
 
-          std::vector<QueryFuncRef> base_callers =
-              GetCallersForAllBaseFunctions(db, func);
-          std::vector<QueryFuncRef> derived_callers =
-              GetCallersForAllDerivedFunctions(db, func);
-          if (base_callers.empty() && derived_callers.empty()) {
+          bool has_base_callers = HasCallersForAllBaseFunctions(db, func);
+          bool has_derived_callers =
+              HasCallersForAllDerivedFunctions(db, func);
+          if (!has_base_callers && !has_derived_callers) {
             QueryLocation loc = try_ensure_spelling(ref);
-            AddCodeLens("call", "calls", &common,
-                        loc.OffsetStartColumn(offset++),
-                        ToQueryLocation(db, func.callers), nullopt,
-                        true /*force_display*/);
+            AddCodeLens(&common, loc.OffsetStartColumn(offset++), symbol,
+                        func.gen, CodeLensKind::Calls, true /*force_display*/);
           } else {
             QueryLocation loc = try_ensure_spelling(ref);
-            AddCodeLens("direct call", "direct calls", &common,
-                        loc.OffsetStartColumn(offset++),
-                        ToQueryLocation(db, func.callers), nullopt,
+            AddCodeLens(&common, loc.OffsetStartColumn(offset++), symbol,
+                        func.gen, CodeLensKind::DirectCalls,
                         false /*force_display*/);
-            if (!base_callers.empty())
-              AddCodeLens("base call", "base calls", &common,
-                          loc.OffsetStartColumn(offset++),
-                          ToQueryLocation(db, base_callers), nullopt,
+            if (has_base_callers)
+              AddCodeLens(&common, loc.OffsetStartColumn(offset++), symbol,
+                          func.gen, CodeLensKind::BaseCalls,
                           false /*force_display*/);
-            if (!derived_callers.empty())
-              AddCodeLens("derived call", "derived calls", &common,
-                          loc.OffsetStartColumn(offset++),
-                          ToQueryLocation(db, derived_callers), nullopt,
+            if (has_derived_callers)
+              AddCodeLens(&common, loc.OffsetStartColumn(offset++), symbol,
+                          func.gen, CodeLensKind::DerivedCalls,
                           false /*force_display*/);
           }
 
-          AddCodeLens("derived", "derived", &common,
-                      ref.loc.OffsetStartColumn(offset++),
-                      ToQueryLocation(db, &func.derived), nullopt,
+          AddCodeLens(&common, ref.loc.OffsetStartColumn(offset++), symbol,
+                      func.gen, CodeLensKind::Derived,
                       false /*force_display*/);
 
           // "Base"
           if (func.def->base.size() == 1) {
-            // FIXME WithGen
-            optional<QueryLocation> base_loc =
-                GetDefinitionSpellingOfSymbol(db, func.def->base[0].value);
-            if (base_loc) {
-              optional<lsLocation> ls_base =
-                  GetLsLocation(db, working_files, *base_loc);
-              if (ls_base) {
-                optional<lsRange> range =
-                    GetLsRange(common.working_file, ref.loc.range);
-                if (range) {
-                  TCodeLens code_lens;
-                  code_lens.range = *range;
-                  code_lens.range.start.character += offset++;
-                  code_lens.command = lsCommand<lsCodeLensCommandArguments>();
-                  code_lens.command->title = "Base";
-                  code_lens.command->command = "cquery.goto";
-                  code_lens.command->arguments.uri = ls_base->uri;
-                  code_lens.command->arguments.position = ls_base->range.start;
-                  out.result.push_back(code_lens);
-                }
-              }
-            }
-          } else {
-            AddCodeLens("base", "base", &common, ref.loc.OffsetStartColumn(1),
-                        ToQueryLocation(db, &func.def->base), nullopt,
+            AddCodeLens(&common, ref.loc.OffsetStartColumn(offset++), symbol,
+                        func.gen, CodeLensKind::GotoBase,
                         false /*force_display*/);
+          } else {
+            AddCodeLens(&common, ref.loc.OffsetStartColumn(1), symbol,
+                        func.gen, CodeLensKind::Base, false /*force_display*/);
           }
 
           break;
@@ -265,8 +472,8 @@ struct TextDocumentCodeLensHandler
           if (var.def->is_macro())
             force_display = false;
 
-          AddCodeLens("ref", "refs", &common, ref.loc.OffsetStartColumn(0),
-                      var.uses, var.def->definition_spelling, force_display);
+          AddCodeLens(&common, ref.loc.OffsetStartColumn(0), symbol, var.gen,
+                      CodeLensKind::Refs, force_display);
           break;
         }
         case SymbolKind::File:
@@ -277,8 +484,21 @@ struct TextDocumentCodeLensHandler
       };
     }
 
-    QueueManager::WriteStdout(IpcId::TextDocumentCodeLens, out);
+    response_cache->WriteAndStore(IpcId::TextDocumentCodeLens,
+                                  file->def->path, cache_key, out.id,
+                                  out.result);
   }
 };
 REGISTER_MESSAGE_HANDLER(TextDocumentCodeLensHandler);
+
+struct CodeLensResolveHandler : BaseMessageHandler<Ipc_CodeLensResolve> {
+  void Run(Ipc_CodeLensResolve* request) override {
+    Out_CodeLensResolve out;
+    out.id = request->id;
+    out.result = request->params;
+    ResolveCodeLens(db, working_files, &out.result);
+    QueueManager::WriteStdout(IpcId::CodeLensResolve, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(CodeLensResolveHandler);
 }  // namespace
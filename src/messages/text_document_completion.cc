@@ -78,6 +78,19 @@ bool CompareLsCompletionItem(const lsCompletionItem& lhs,
                          rhs.label.length(), std::cref(rhs.label));
 }
 
+// Without a path to filter with, only this many include completions are sent.
+const size_t kMaxIncludeResults = 100u;
+
+// The order |CompareLsCompletionItem| gives include completions which are all
+// matched by an empty path.
+bool CompareIncludeCompletionItem(const lsCompletionItem* lhs,
+                                  const lsCompletionItem* rhs) {
+  return std::make_tuple(lhs->priority_, lhs->label.length(),
+                         std::cref(lhs->label)) <
+         std::make_tuple(rhs->priority_, rhs->label.length(),
+                         std::cref(rhs->label));
+}
+
 template <typename T>
 char* tofixedbase64(T input, char* out) {
   const char* digits =
@@ -93,13 +106,35 @@ char* tofixedbase64(T input, char* out) {
   return out;
 }
 
+// Remembers |items|, filtered for |complete_text|, so the next completion
+// can narrow them. Results filtered with no text are truncated, so they are
+// not kept. Must be called under |cache->WithLock|.
+void SetCachedFilteredResults(CodeCompleteCache* cache,
+                              const std::string& complete_text,
+                              const std::vector<lsCompletionItem>& items,
+                              bool enable) {
+  if (enable && !complete_text.empty()) {
+    cache->cached_filter_text_ = complete_text;
+    cache->cached_filtered_results_ = items;
+  } else {
+    cache->cached_filter_text_ = nullopt;
+    cache->cached_filtered_results_.clear();
+  }
+}
+
 // Pre-filters completion responses before sending to vscode. This results in a
 // significantly snappier completion experience as vscode is easily overloaded
 // when given 1000+ completion items.
+//
+// If |narrow| is true, the items are the output of a previous call whose
+// |complete_text| was a non-empty prefix of this one. Items which did not
+// match then cannot match now, so only the matching ones are rescored and
+// sorted; the others keep their order at the end.
 void FilterAndSortCompletionResponse(
     Out_TextDocumentComplete* complete_response,
     const std::string& complete_text,
-    bool enable) {
+    bool enable,
+    bool narrow = false) {
   ScopedPerfTimer timer("FilterAndSortCompletionResponse");
 
 // Used to inject more completions.
@@ -127,9 +162,11 @@ void FilterAndSortCompletionResponse(
   }
 
   // Make sure all items have |filterText| set, code that follow needs it.
-  for (auto& item : items) {
-    if (item.filterText.empty()) {
-      item.filterText = item.label;
+  if (!narrow) {
+    for (auto& item : items) {
+      if (item.filterText.empty()) {
+        item.filterText = item.label;
+      }
     }
   }
 
@@ -143,24 +180,48 @@ void FilterAndSortCompletionResponse(
                 items.end());
   }
 
-  // Fuzzy match.
-  for (auto& item : items)
-    std::tie(item.found_, item.skip_) =
-        SubsequenceCountSkip(complete_text, item.filterText);
+  // Fuzzy match. Previous matches are sorted first.
+  auto end = items.end();
+  if (narrow) {
+    end = std::partition_point(
+        items.begin(), items.end(),
+        [](const lsCompletionItem& item) { return item.found_; });
+  }
+  for (auto it = items.begin(); it != end; ++it)
+    std::tie(it->found_, it->skip_) =
+        SubsequenceCountSkip(complete_text, it->filterText);
+
+  // Order all items. If there are too many results and nothing to filter
+  // with, only the first ones are sent.
+  const size_t kMaxResultSize = 100u;
+  if (complete_text.empty() && items.size() > kMaxResultSize) {
+    std::partial_sort(items.begin(), items.begin() + kMaxResultSize,
+                      items.end(), CompareLsCompletionItem);
+    items.resize(kMaxResultSize);
+  } else {
+    std::sort(items.begin(), end, CompareLsCompletionItem);
+  }
 
-  // Order all items and set |sortText|.
-  std::sort(items.begin(), items.end(), CompareLsCompletionItem);
+  // Set |sortText|.
   char buf[16];
   for (size_t i = 0; i < items.size(); ++i)
     items[i].sortText = tofixedbase64(i, buf);
+}
 
-  // If there are too many results...
-  const size_t kMaxResultSize = 100u;
-  if (items.size() > kMaxResultSize) {
-    if (complete_text.empty()) {
-      items.resize(kMaxResultSize);
-    }
-  }
+// Emits the results cached in |cache| for |complete_text|, narrowing the
+// previously filtered results if possible. Must be called under
+// |cache->WithLock|.
+void EmitCachedCompletionResponse(Out_TextDocumentComplete* out,
+                                  CodeCompleteCache* cache,
+                                  const std::string& complete_text,
+                                  bool enable) {
+  bool narrow = enable && cache->cached_filter_text_ &&
+                StartsWith(complete_text, *cache->cached_filter_text_);
+  out->result.items =
+      narrow ? cache->cached_filtered_results_ : cache->cached_results_;
+  FilterAndSortCompletionResponse(out, complete_text, enable, narrow);
+  QueueManager::WriteStdout(IpcId::TextDocumentCompletion, *out);
+  SetCachedFilteredResults(cache, complete_text, out->result.items, enable);
 }
 
 struct TextDocumentCompletionHandler : MessageHandler {
@@ -188,7 +249,8 @@ struct TextDocumentCompletionHandler : MessageHandler {
     std::string buffer_line;
     if (request->params.position.line >= 0 &&
         request->params.position.line < file->buffer_lines.size()) {
-      buffer_line = file->buffer_lines[request->params.position.line];
+      buffer_line =
+          std::string(file->buffer_lines[request->params.position.line]);
     }
 
     // Check for - and : before completing -> or ::, since vscode does not
@@ -248,10 +310,31 @@ struct TextDocumentCompletionHandler : MessageHandler {
             include_complete->completion_items_mutex, std::defer_lock);
         if (include_complete->is_scanning)
           lock.lock();
-        out.result.items.assign(include_complete->completion_items.begin(),
-                                include_complete->completion_items.end());
-        if (lock)
-          lock.unlock();
+        // Only copy the items which can be in the response.
+        std::string include_path = result.match[6].str();
+        std::vector<const lsCompletionItem*> items =
+            include_complete->GetCompletionItemsInDirectoryOf(include_path);
+        if (config->completion.filterAndSort) {
+          if (!include_path.empty()) {
+            items.erase(
+                std::remove_if(items.begin(), items.end(),
+                               [&](const lsCompletionItem* item) {
+                                 return !SubsequenceMatch(include_path,
+                                                          item->label);
+                               }),
+                items.end());
+          } else if (items.size() > kMaxIncludeResults) {
+            std::partial_sort(items.begin(),
+                              items.begin() + kMaxIncludeResults, items.end(),
+                              CompareIncludeCompletionItem);
+            items.resize(kMaxIncludeResults);
+          }
+          // Typing more of the path has to query the items again.
+          out.result.isIncomplete = true;
+        }
+        out.result.items.reserve(items.size());
+        for (const lsCompletionItem* item : items)
+          out.result.items.push_back(*item);
       }
 
       // Needed by |FilterAndSortCompletionResponse|.
@@ -302,19 +385,18 @@ struct TextDocumentCompletionHandler : MessageHandler {
             // Cache completion results.
             if (!is_cached_result) {
               std::string path = request->params.textDocument.uri.GetPath();
-              if (is_global_completion) {
-                global_code_complete_cache->WithLock([&]() {
-                  global_code_complete_cache->cached_path_ = path;
-                  global_code_complete_cache->cached_results_ = results;
-                });
-              } else {
-                non_global_code_complete_cache->WithLock([&]() {
-                  non_global_code_complete_cache->cached_path_ = path;
-                  non_global_code_complete_cache->cached_completion_position_ =
-                      request->params.position;
-                  non_global_code_complete_cache->cached_results_ = results;
-                });
-              }
+              CodeCompleteCache* cache = is_global_completion
+                                             ? global_code_complete_cache
+                                             : non_global_code_complete_cache;
+              cache->WithLock([&]() {
+                cache->cached_path_ = path;
+                if (!is_global_completion)
+                  cache->cached_completion_position_ = request->params.position;
+                cache->cached_results_ = results;
+                SetCachedFilteredResults(cache, existing_completion,
+                                         out.result.items,
+                                         config->completion.filterAndSort);
+              });
             }
           },
           std::placeholders::_1, std::placeholders::_2);
@@ -334,19 +416,27 @@ struct TextDocumentCompletionHandler : MessageHandler {
               // note: path is updated in the normal completion handler.
               global_code_complete_cache->WithLock([&]() {
                 global_code_complete_cache->cached_results_ = results;
+                global_code_complete_cache->cached_filter_text_ = nullopt;
+                global_code_complete_cache->cached_filtered_results_.clear();
               });
             };
 
         global_code_complete_cache->WithLock([&]() {
-          callback(global_code_complete_cache->cached_results_,
-                   true /*is_cached_result*/);
+          Out_TextDocumentComplete out;
+          out.id = request->id;
+          EmitCachedCompletionResponse(&out, global_code_complete_cache,
+                                       existing_completion,
+                                       config->completion.filterAndSort);
         });
         clang_complete->CodeComplete(request->params, freshen_global);
       } else if (non_global_code_complete_cache->IsCacheValid(
                      request->params)) {
         non_global_code_complete_cache->WithLock([&]() {
-          callback(non_global_code_complete_cache->cached_results_,
-                   true /*is_cached_result*/);
+          Out_TextDocumentComplete out;
+          out.id = request->id;
+          EmitCachedCompletionResponse(&out, non_global_code_complete_cache,
+                                       existing_completion,
+                                       config->completion.filterAndSort);
         });
       } else {
         clang_complete->CodeComplete(request->params, callback);
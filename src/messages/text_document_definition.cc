@@ -46,9 +46,41 @@ std::vector<QueryLocation> GetGotoDefinitionTargets(QueryDatabase* db,
   }
 }
 
+// Adds the definitions of |symbols|, or their declarations if they are not
+// defined.
+void AddDefinitionsOrDeclarations(QueryDatabase* db,
+                                  WorkingFiles* working_files,
+                                  const std::vector<SymbolIdx>& symbols,
+                                  std::vector<lsLocation>* result) {
+  for (const SymbolIdx& symbol : symbols) {
+    optional<QueryLocation> def_loc = GetDefinitionSpellingOfSymbol(db, symbol);
+    if (def_loc) {
+      PushBack(result, GetLsLocation(db, working_files, *def_loc));
+      continue;
+    }
+    for (const QueryLocation& target : GetGotoDefinitionTargets(db, symbol))
+      PushBack(result, GetLsLocation(db, working_files, target));
+  }
+}
+
 struct TextDocumentDefinitionHandler
     : BaseMessageHandler<Ipc_TextDocumentDefinition> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_TextDocumentDefinition* request) override {
+    if (WorkingFile* unimported = GetUnimportedWorkingFile(
+            db, working_files, request->params.textDocument.uri.GetPath())) {
+      Out_TextDocumentDefinition out;
+      out.id = request->id;
+      AddDefinitionsOrDeclarations(
+          db, working_files,
+          FindSymbolsByLexedName(db, unimported, request->params.position),
+          &out.result);
+      if (!out.result.empty()) {
+        QueueManager::WriteStdout(IpcId::TextDocumentDefinition, out);
+        return;
+      }
+    }
+
     QueryFileId file_id;
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
@@ -118,10 +150,10 @@ struct TextDocumentDefinitionHandler
 
     // No symbols - check for includes.
     if (out.result.empty()) {
-      for (const IndexInclude& include : file->def->includes) {
+      for (const QueryFile::Include& include : file->def->includes) {
         if (include.line == target_line) {
           lsLocation result;
-          result.uri = lsDocumentUri::FromPath(include.resolved_path);
+          result.uri = lsDocumentUri::FromPath(db->files[include.file.id].path);
           out.result.push_back(result);
           break;
         }
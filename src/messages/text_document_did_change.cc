@@ -1,7 +1,10 @@
 #include "clang_complete.h"
+#include "code_complete_cache.h"
 #include "message_handler.h"
 #include "working_files.h"
 
+#include <loguru.hpp>
+
 namespace {
 struct Ipc_TextDocumentDidChange
     : public NotificationMessage<Ipc_TextDocumentDidChange> {
@@ -12,15 +15,114 @@ struct Ipc_TextDocumentDidChange
 MAKE_REFLECT_STRUCT(Ipc_TextDocumentDidChange, params);
 REGISTER_IPC_MESSAGE(Ipc_TextDocumentDidChange);
 
+// Returns the position just after the text inserted by the last change of
+// |params|, if it is known.
+optional<lsPosition> GetLastEditPosition(
+    const lsTextDocumentDidChangeParams& params) {
+  if (params.contentChanges.empty() || !params.contentChanges.back().range)
+    return nullopt;
+  const lsTextDocumentContentChangeEvent& change = params.contentChanges.back();
+  lsPosition position = change.range->start;
+  for (char c : change.text) {
+    if (c == '\n') {
+      position.line++;
+      position.character = 0;
+    } else {
+      position.character++;
+    }
+  }
+  return position;
+}
+
+// Appends the changes of |next|, which is a later notification for the same
+// document, to |merged|.
+void AppendChanges(lsTextDocumentDidChangeParams* merged,
+                   lsTextDocumentDidChangeParams&& next) {
+  merged->textDocument.version = next.textDocument.version;
+  for (lsTextDocumentContentChangeEvent& change : next.contentChanges) {
+    // A change without a range replaces the whole document.
+    if (!change.range)
+      merged->contentChanges.clear();
+    merged->contentChanges.push_back(std::move(change));
+  }
+}
+
 struct TextDocumentDidChangeHandler
     : BaseMessageHandler<Ipc_TextDocumentDidChange> {
   void Run(Ipc_TextDocumentDidChange* request) override {
     std::string path = request->params.textDocument.uri.GetPath();
-    working_files->OnChange(request->params);
+    working_files->OnChange(&request->params);
     clang_complete->NotifyEdit(path);
+    if (config->completion.speculative)
+      StartSpeculativeCompletion(request->params);
     clang_complete->DiagnosticsUpdate(
         request->params.textDocument.AsTextDocumentIdentifier());
   }
+
+  // Starts a member completion for the edited position if the user is typing
+  // after ., -> or :: and it is not cached yet. The results are cached as if
+  // the client requested them.
+  void StartSpeculativeCompletion(const lsTextDocumentDidChangeParams& params) {
+    std::string path = params.textDocument.uri.GetPath();
+    optional<lsPosition> edit_position = GetLastEditPosition(params);
+    WorkingFile* file = working_files->GetFileByFilename(path);
+    if (!edit_position || !file)
+      return;
+
+    bool is_global_completion = false;
+    std::string existing_completion;
+    lsTextDocumentPositionParams completion_location;
+    completion_location.textDocument =
+        params.textDocument.AsTextDocumentIdentifier();
+    completion_location.position = file->FindStableCompletionSource(
+        *edit_position, &is_global_completion, &existing_completion);
+    if (is_global_completion ||
+        non_global_code_complete_cache->IsCacheValid(completion_location))
+      return;
+
+    CodeCompleteCache* cache = non_global_code_complete_cache;
+    lsPosition position = completion_location.position;
+    clang_complete->CodeComplete(
+        completion_location,
+        [cache, path, position](const std::vector<lsCompletionItem>& results,
+                                bool is_cached_result) {
+          cache->WithLock([&]() {
+            cache->cached_path_ = path;
+            cache->cached_completion_position_ = position;
+            cache->cached_results_ = results;
+            cache->cached_filter_text_ = nullopt;
+            cache->cached_filtered_results_.clear();
+          });
+        });
+  }
 };
 REGISTER_MESSAGE_HANDLER(TextDocumentDidChangeHandler);
 }  // namespace
+
+void CoalesceDidChangeNotifications(
+    std::vector<std::unique_ptr<BaseIpcMessage>>* messages) {
+  std::vector<std::unique_ptr<BaseIpcMessage>> result;
+  Ipc_TextDocumentDidChange* run = nullptr;
+  size_t merged = 0;
+  for (std::unique_ptr<BaseIpcMessage>& message : *messages) {
+    if (message->method_id != IpcId::TextDocumentDidChange) {
+      run = nullptr;
+      result.push_back(std::move(message));
+      continue;
+    }
+    auto* change = message->As<Ipc_TextDocumentDidChange>();
+    if (run &&
+        run->params.textDocument.uri == change->params.textDocument.uri) {
+      AppendChanges(&run->params, std::move(change->params));
+      merged++;
+      continue;
+    }
+    run = change;
+    result.push_back(std::move(message));
+  }
+  if (merged) {
+    LOG_S(INFO) << "Merged " << merged << " textDocument/didChange into "
+                << "previous ones";
+  }
+  *messages = std::move(result);
+}
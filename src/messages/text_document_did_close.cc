@@ -1,6 +1,6 @@
 #include "clang_complete.h"
+#include "import_pipeline.h"
 #include "message_handler.h"
-#include "queue_manager.h"
 #include "working_files.h"
 
 namespace {
@@ -22,9 +22,7 @@ struct TextDocumentDidCloseHandler
     std::string path = request->params.textDocument.uri.GetPath();
 
     // Clear any diagnostics for the file.
-    Out_TextDocumentPublishDiagnostics out;
-    out.params.uri = request->params.textDocument.uri;
-    QueueManager::WriteStdout(IpcId::TextDocumentPublishDiagnostics, out);
+    import_pipeline_status->diagnostics_publisher.Clear(path);
 
     // Remove internal state.
     working_files->OnClose(request->params.textDocument);
@@ -34,11 +34,13 @@ struct TextDocumentDidOpenHandler
 
     std::shared_ptr<ICacheManager> cache_manager = ICacheManager::Make(config);
     WorkingFile* working_file =
-        working_files->OnOpen(request->params.textDocument);
+        working_files->OnOpen(std::move(request->params.textDocument));
     optional<std::string> cached_file_contents =
         cache_manager->LoadCachedFileContents(path);
-    if (cached_file_contents)
-      working_file->SetIndexContent(*cached_file_contents);
+    if (cached_file_contents) {
+      uint64_t hash = HashStorageKey(*cached_file_contents);
+      working_file->SetIndexContent(std::move(*cached_file_contents), hash);
+    }
 
     QueryFile* file = nullptr;
     FindFileOrFail(db, project, nullopt, path, &file);
@@ -53,12 +55,22 @@ struct TextDocumentDidOpenHandler
 
     include_complete->AddFile(working_file->filename);
     clang_complete->NotifyView(path);
+    if (file)
+      PreloadRelatedCompletionSessions(db, timestamp_manager, clang_complete,
+                                       file);
+
+    // Until the project is loaded the file cannot be given its arguments;
+    // initialize indexes the open files first once it is.
+    if (!project->is_loaded)
+      return;
 
-    // Submit new index request.
+    // Submit new index request, and move up the translation units including
+    // the file if they are still waiting to be indexed.
+    PrioritizeIndexRequests(timestamp_manager, path);
     const Project::Entry& entry = project->FindCompilationEntryForFile(path);
     QueueManager::instance()->index_request.PriorityEnqueue(
         Index_Request(entry.filename, entry.args, true /*is_interactive*/,
-                      request->params.textDocument.text, cache_manager));
+                      working_file->buffer_content, cache_manager));
   }
 };
 REGISTER_MESSAGE_HANDLER(TextDocumentDidOpenHandler);
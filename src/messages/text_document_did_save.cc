@@ -3,6 +3,7 @@
 #include "message_handler.h"
 #include "project.h"
 #include "queue_manager.h"
+#include "timestamp_manager.h"
 
 #include <loguru/loguru.hpp>
 
@@ -30,6 +31,7 @@ struct TextDocumentDidSaveHandler
     std::string path = request->params.textDocument.uri.GetPath();
     if (ShouldIgnoreFileForIndexing(path))
       return;
+    timestamp_manager->DropPrefetchedModificationTime(path);
 
     // Send out an index request, and copy the current buffer state so we
     // can update the cached index contents when the index is done.
@@ -49,8 +51,11 @@ struct TextDocumentDidSaveHandler
       LOG_S(ERROR) << "Unable to read file content after saving " << path;
     } else {
       Project::Entry entry = project->FindCompilationEntryForFile(path);
-      QueueManager::instance()->index_request.Enqueue(Index_Request(
-          entry.filename, entry.args, true /*is_interactive*/, *content, ICacheManager::Make(config)));
+      Index_Request index_request(entry.filename, entry.args,
+                                  true /*is_interactive*/, *content,
+                                  ICacheManager::Make(config));
+      index_request.is_inferred = entry.is_inferred;
+      QueueManager::instance()->index_request.Enqueue(std::move(index_request));
     }
 
     clang_complete->NotifySave(path);
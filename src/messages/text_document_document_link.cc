@@ -1,6 +1,7 @@
 #include "lex_utils.h"
 #include "message_handler.h"
 #include "queue_manager.h"
+#include "response_cache.h"
 #include "working_files.h"
 
 #include <loguru.hpp>
@@ -56,7 +57,14 @@ struct TextDocumentDocumentLinkHandler
                        << request->params.textDocument.uri.GetPath();
         return;
       }
-      for (const IndexInclude& include : file->def->includes) {
+      ResponseCache::Key cache_key =
+          ResponseCache::GetKey(db, working_files, file->def->path);
+      if (response_cache->TryWrite(IpcId::TextDocumentDocumentLink,
+                                   file->def->path, cache_key, request->id)) {
+        return;
+      }
+
+      for (const QueryFile::Include& include : file->def->includes) {
         optional<int> buffer_line = working_file->GetBufferPosFromIndexPos(
             include.line, nullptr, false);
         if (!buffer_line)
@@ -70,10 +78,14 @@ struct TextDocumentDocumentLinkHandler
           continue;
 
         lsDocumentLink link;
-        link.target = lsDocumentUri::FromPath(include.resolved_path);
+        link.target = lsDocumentUri::FromPath(db->files[include.file.id].path);
         link.range = *between_quotes;
         out.result.push_back(link);
       }
+      response_cache->WriteAndStore(IpcId::TextDocumentDocumentLink,
+                                    file->def->path, cache_key, out.id,
+                                    out.result);
+      return;
     }
 
     QueueManager::WriteStdout(IpcId::TextDocumentDocumentLink, out);
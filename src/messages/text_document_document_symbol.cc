@@ -1,6 +1,7 @@
 #include "message_handler.h"
 #include "query_utils.h"
 #include "queue_manager.h"
+#include "response_cache.h"
 
 namespace {
 struct lsDocumentSymbolParams {
@@ -25,6 +26,7 @@ MAKE_REFLECT_STRUCT(Out_TextDocumentDocumentSymbol, jsonrpc, id, result);
 
 struct TextDocumentDocumentSymbolHandler
     : BaseMessageHandler<Ipc_TextDocumentDocumentSymbol> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_TextDocumentDocumentSymbol* request) override {
     Out_TextDocumentDocumentSymbol out;
     out.id = request->id;
@@ -34,6 +36,12 @@ struct TextDocumentDocumentSymbolHandler
                         request->params.textDocument.uri.GetPath(), &file)) {
       return;
     }
+    ResponseCache::Key cache_key =
+        ResponseCache::GetKey(db, working_files, file->def->path);
+    if (response_cache->TryWrite(IpcId::TextDocumentDocumentSymbol,
+                                 file->def->path, cache_key, request->id)) {
+      return;
+    }
 
     for (SymbolRef ref : file->def->outline) {
       optional<lsSymbolInformation> info =
@@ -48,7 +56,9 @@ struct TextDocumentDocumentSymbolHandler
       out.result.push_back(*info);
     }
 
-    QueueManager::WriteStdout(IpcId::TextDocumentDocumentSymbol, out);
+    response_cache->WriteAndStore(IpcId::TextDocumentDocumentSymbol,
+                                  file->def->path, cache_key, out.id,
+                                  out.result);
   }
 };
 REGISTER_MESSAGE_HANDLER(TextDocumentDocumentSymbolHandler);
@@ -20,12 +20,11 @@ MAKE_REFLECT_STRUCT(Out_TextDocumentDocumentHighlight, jsonrpc, id, result);
 
 struct TextDocumentDocumentHighlightHandler
     : BaseMessageHandler<Ipc_TextDocumentDocumentHighlight> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_TextDocumentDocumentHighlight* request) override {
-    QueryFileId file_id;
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
-                        request->params.textDocument.uri.GetPath(), &file,
-                        &file_id)) {
+                        request->params.textDocument.uri.GetPath(), &file)) {
       return;
     }
 
@@ -37,21 +36,19 @@ struct TextDocumentDocumentHighlightHandler
 
     for (const SymbolRef& ref :
          FindSymbolsAtLocation(working_file, file, request->params.position)) {
-      // Found symbol. Return references to highlight.
-      std::vector<QueryLocation> uses = GetUsesOfSymbol(db, ref.idx, true);
-      out.result.reserve(uses.size());
-      for (const QueryLocation& use : uses) {
-        if (use.path != file_id)
-          continue;
-
-        optional<lsLocation> ls_location =
-            GetLsLocation(db, working_files, use);
-        if (!ls_location)
+      // Found symbol. Return references to highlight. The occurrences of
+      // the file are enough, so the uses in other files are not looked at.
+      std::vector<SymbolRef> occurrences = file->GetOccurrences(ref.idx);
+      out.result.reserve(occurrences.size());
+      for (const SymbolRef& occurrence : occurrences) {
+        optional<lsRange> ls_range =
+            GetLsRange(working_file, occurrence.loc.range);
+        if (!ls_range)
           continue;
 
         lsDocumentHighlight highlight;
         highlight.kind = lsDocumentHighlightKind::Text;
-        highlight.range = ls_location->range;
+        highlight.range = *ls_range;
         out.result.push_back(highlight);
       }
       break;
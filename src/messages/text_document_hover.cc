@@ -1,35 +1,128 @@
+#include "lru_cache.h"
 #include "message_handler.h"
 #include "query_utils.h"
 #include "queue_manager.h"
+#include "working_files.h"
+
+#include <mutex>
 
 namespace {
 
-std::pair<std::string_view, std::string_view> GetCommentsAndHover(
+// Comments read from files for Config::Index::lazyComments, by path and range.
+// Entries remember the QueryDatabase::generation they were read at, as the
+// file may have been indexed again since.
+struct LazyComments {
+  Generation generation = 0;
+  std::string text;
+};
+const int kLazyCommentsCacheSize = 256;
+std::mutex g_lazy_comments_mutex;
+LruCache<std::string, LazyComments> g_lazy_comments(kLazyCommentsCacheSize);
+
+// Returns the comment at |range| of |path| as it was indexed: from the
+// working file if it is open, else from disk.
+optional<std::string> ReadIndexedComment(WorkingFiles* working_files,
+                                         const std::string& path,
+                                         Range range) {
+  std::vector<std::string> lines;
+  bool is_open = false;
+  auto take_lines = [&](const TextLines& all_lines) {
+    for (int i = range.start.line;
+         i <= range.end.line && i < int(all_lines.size()); i++)
+      lines.push_back(std::string(all_lines[i]));
+  };
+  working_files->DoActionOnFile(path, [&](WorkingFile* file) {
+    if (file) {
+      is_open = true;
+      take_lines(file->index_lines);
+    }
+  });
+  if (!is_open) {
+    optional<std::string> content = ReadContent(path);
+    if (!content)
+      return nullopt;
+    TextLines content_lines(&*content);
+    content_lines.Update();
+    take_lines(content_lines);
+  }
+  if (lines.size() != size_t(range.end.line - range.start.line + 1))
+    return nullopt;
+
+  if (size_t(range.start.column) > lines[0].size())
+    return nullopt;
+  lines[0].erase(0, range.start.column);
+  std::string text = StringJoin(lines, "\n");
+  // Line comments run to the end of their lines, but code may follow a block
+  // comment. Its end is found in the text, as libclang does not say whether
+  // the end of the range is inclusive.
+  if (StartsWith(text, "/*")) {
+    size_t end = text.find("*/", 2);
+    if (end != std::string::npos)
+      text.resize(end + 2);
+  }
+  return text;
+}
+
+// Returns the comments of |def|, which are read from the file if only their
+// range is stored.
+template <typename TDef>
+std::string GetComments(QueryDatabase* db,
+                        WorkingFiles* working_files,
+                        const TDef& def) {
+  if (!def.comments_range)
+    return def.comments;
+  QueryLocation loc = *def.comments_range;
+  QueryFile& file = db->files[loc.path.id];
+  if (!file.def)
+    return "";
+
+  std::string key = file.def->path + ":" + loc.range.ToString();
+  Generation generation = db->generation;
+  {
+    std::lock_guard<std::mutex> lock(g_lazy_comments_mutex);
+    std::shared_ptr<LazyComments> cached = g_lazy_comments.TryGet(key);
+    if (cached && cached->generation == generation)
+      return cached->text;
+  }
+
+  auto comments = std::make_shared<LazyComments>();
+  comments->generation = generation;
+  optional<std::string> raw =
+      ReadIndexedComment(working_files, file.def->path, loc.range);
+  if (raw)
+    comments->text = FormatComment(*raw, loc.range.start.column);
+  std::lock_guard<std::mutex> lock(g_lazy_comments_mutex);
+  g_lazy_comments.Insert(key, comments);
+  return comments->text;
+}
+
+std::pair<std::string, std::string_view> GetCommentsAndHover(
     QueryDatabase* db,
+    WorkingFiles* working_files,
     const SymbolIdx& symbol) {
   switch (symbol.kind) {
     case SymbolKind::Type: {
       QueryType& type = db->types[symbol.idx];
       if (type.def)
-        return {type.def->comments, type.def->hover.size()
-                                        ? type.def->hover
-                                        : type.def->detailed_name};
+        return {GetComments(db, working_files, *type.def),
+                type.def->hover.size() ? type.def->hover
+                                       : type.def->detailed_name.str()};
       break;
     }
     case SymbolKind::Func: {
       QueryFunc& func = db->funcs[symbol.idx];
       if (func.def)
-        return {func.def->comments, func.def->hover.size()
-                                        ? func.def->hover
-                                        : func.def->detailed_name};
+        return {GetComments(db, working_files, *func.def),
+                func.def->hover.size() ? func.def->hover
+                                       : func.def->detailed_name.str()};
       break;
     }
     case SymbolKind::Var: {
       QueryVar& var = db->vars[symbol.idx];
       if (var.def)
-        return {var.def->comments, var.def->hover.size()
-                                       ? var.def->hover
-                                       : var.def->detailed_name};
+        return {GetComments(db, working_files, *var.def),
+                var.def->hover.size() ? var.def->hover
+                                      : var.def->detailed_name.str()};
       break;
     }
     case SymbolKind::File:
@@ -74,7 +167,36 @@ void Reflect(Writer& visitor, Out_TextDocumentHover& value) {
 }
 
 struct TextDocumentHoverHandler : BaseMessageHandler<Ipc_TextDocumentHover> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_TextDocumentHover* request) override {
+    if (WorkingFile* unimported = GetUnimportedWorkingFile(
+            db, working_files, request->params.textDocument.uri.GetPath())) {
+      Out_TextDocumentHover out;
+      out.id = request->id;
+      std::pair<std::string, std::string_view> comments_hover;
+      for (const SymbolIdx& symbol :
+           FindSymbolsByLexedName(db, unimported, request->params.position)) {
+        optional<QueryFileId> declaration_file =
+            GetDeclarationFileForSymbol(db, symbol);
+        QueryFile* file =
+            declaration_file ? &db->files[declaration_file->id] : nullptr;
+        comments_hover = GetCommentsAndHover(db, working_files, symbol);
+        if (!file || !file->def || comments_hover.second.empty())
+          continue;
+        // There is no range, as the word is only lexed.
+        out.result = Out_TextDocumentHover::Result();
+        if (comments_hover.first.size())
+          out.result->contents.emplace_back(comments_hover.first);
+        out.result->contents.emplace_back(lsMarkedString1{
+            std::string_view(file->def->language), comments_hover.second});
+        break;
+      }
+      if (out.result) {
+        QueueManager::WriteStdout(IpcId::TextDocumentHover, out);
+        return;
+      }
+    }
+
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
                         request->params.textDocument.uri.GetPath(), &file)) {
@@ -87,6 +209,8 @@ struct TextDocumentHoverHandler : BaseMessageHandler<Ipc_TextDocumentHover> {
     Out_TextDocumentHover out;
     out.id = request->id;
 
+    // Outlives the loop, as |out| refers to the comments until it is written.
+    std::pair<std::string, std::string_view> comments_hover;
     for (const SymbolRef& ref :
          FindSymbolsAtLocation(working_file, file, request->params.position)) {
       // Found symbol. Return hover.
@@ -95,8 +219,7 @@ struct TextDocumentHoverHandler : BaseMessageHandler<Ipc_TextDocumentHover> {
       if (!ls_range)
         continue;
 
-      std::pair<std::string_view, std::string_view> comments_hover =
-          GetCommentsAndHover(db, ref.idx);
+      comments_hover = GetCommentsAndHover(db, working_files, ref.idx);
       if (comments_hover.first.size() || comments_hover.second.size()) {
         out.result = Out_TextDocumentHover::Result();
         if (comments_hover.first.size()) {
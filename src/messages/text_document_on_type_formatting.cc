@@ -0,0 +1,75 @@
+#include "clang_format.h"
+#include "lex_utils.h"
+#include "message_handler.h"
+#include "queue_manager.h"
+#include "working_files.h"
+
+#include <loguru.hpp>
+
+namespace {
+
+struct lsDocumentOnTypeFormattingParams {
+  lsTextDocumentIdentifier textDocument;
+  // The position at which the character was typed.
+  lsPosition position;
+  // The character that has been typed.
+  std::string ch;
+  lsFormattingOptions options;
+};
+MAKE_REFLECT_STRUCT(lsDocumentOnTypeFormattingParams,
+                    textDocument,
+                    position,
+                    ch,
+                    options);
+
+struct Ipc_TextDocumentOnTypeFormatting
+    : public RequestMessage<Ipc_TextDocumentOnTypeFormatting> {
+  const static IpcId kIpcId = IpcId::TextDocumentOnTypeFormatting;
+  lsDocumentOnTypeFormattingParams params;
+};
+MAKE_REFLECT_STRUCT(Ipc_TextDocumentOnTypeFormatting, id, params);
+REGISTER_IPC_MESSAGE(Ipc_TextDocumentOnTypeFormatting);
+
+struct Out_TextDocumentOnTypeFormatting
+    : public lsOutMessage<Out_TextDocumentOnTypeFormatting> {
+  lsRequestId id;
+  std::vector<lsTextEdit> result;
+};
+MAKE_REFLECT_STRUCT(Out_TextDocumentOnTypeFormatting, jsonrpc, id, result);
+
+struct TextDocumentOnTypeFormattingHandler
+    : BaseMessageHandler<Ipc_TextDocumentOnTypeFormatting> {
+  void Run(Ipc_TextDocumentOnTypeFormatting* request) override {
+    Out_TextDocumentOnTypeFormatting response;
+    response.id = request->id;
+#if USE_CLANG_CXX
+    QueryFile* file;
+    if (!FindFileOrFail(db, project, request->id,
+                        request->params.textDocument.uri.GetPath(), &file)) {
+      return;
+    }
+
+    WorkingFile* working_file =
+        working_files->GetFileByFilename(file->def->path);
+
+    // Only the line of the typed character is formatted; ClangFormatDocument
+    // then does not need the rest of large files.
+    lsPosition line_start = request->params.position;
+    line_start.character = 0;
+    int start = GetOffsetForPosition(line_start, working_file->buffer_content);
+    int end = GetOffsetForPosition(request->params.position,
+                                   working_file->buffer_content);
+    response.result = ConvertClangReplacementsIntoTextEdits(
+        working_file->buffer_content,
+        ClangFormatDocument(working_file, start, end, request->params.options));
+#else
+    LOG_S(WARNING) << "You must compile cquery with --use-clang-cxx to use "
+                      "textDocument/onTypeFormatting.";
+    response.result = {};
+#endif
+
+    QueueManager::WriteStdout(IpcId::TextDocumentOnTypeFormatting, response);
+  }
+};
+REGISTER_MESSAGE_HANDLER(TextDocumentOnTypeFormattingHandler);
+}  // namespace
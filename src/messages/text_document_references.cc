@@ -4,7 +4,13 @@
 
 #include <loguru.hpp>
 
+#include <algorithm>
+#include <limits>
+
 namespace {
+// Number of locations sent in each partial result notification.
+const size_t kPartialResultBatchSize = 1000;
+
 struct Ipc_TextDocumentReferences
     : public RequestMessage<Ipc_TextDocumentReferences> {
   const static IpcId kIpcId = IpcId::TextDocumentReferences;
@@ -16,6 +22,12 @@ struct Ipc_TextDocumentReferences
     lsTextDocumentIdentifier textDocument;
     lsPosition position;
     lsReferenceContext context;
+    // If set, locations are sent in $/progress notifications for this token
+    // and the response itself is empty.
+    lsRequestId partialResultToken;
+    // cquery extension: number of locations to skip, used to continue a
+    // response which was cut at |maxReferencesResults|.
+    int startIndex = 0;
   };
 
   Params params;
@@ -25,7 +37,9 @@ MAKE_REFLECT_STRUCT(Ipc_TextDocumentReferences::lsReferenceContext,
 MAKE_REFLECT_STRUCT(Ipc_TextDocumentReferences::Params,
                     textDocument,
                     position,
-                    context);
+                    context,
+                    partialResultToken,
+                    startIndex);
 MAKE_REFLECT_STRUCT(Ipc_TextDocumentReferences, id, params);
 REGISTER_IPC_MESSAGE(Ipc_TextDocumentReferences);
 
@@ -33,12 +47,121 @@ struct Out_TextDocumentReferences
     : public lsOutMessage<Out_TextDocumentReferences> {
   lsRequestId id;
   std::vector<lsLocation> result;
+  // cquery extension, see Out_LocationList::pendingFiles.
+  optional<int> pendingFiles;
+};
+MAKE_REFLECT_STRUCT(Out_TextDocumentReferences,
+                    jsonrpc,
+                    id,
+                    result,
+                    pendingFiles);
+
+struct Out_TextDocumentReferencesPartialResult
+    : public lsOutMessage<Out_TextDocumentReferencesPartialResult> {
+  struct Params {
+    lsRequestId token;
+    std::vector<lsLocation> value;
+  };
+  std::string method = "$/progress";
+  Params params;
+};
+MAKE_REFLECT_STRUCT(Out_TextDocumentReferencesPartialResult::Params,
+                    token,
+                    value);
+MAKE_REFLECT_STRUCT(Out_TextDocumentReferencesPartialResult,
+                    jsonrpc,
+                    method,
+                    params);
+
+// Collects the locations of a response, skipping the first |startIndex| ones
+// and stopping at |maxReferencesResults|. With a partial result token,
+// locations are streamed to the client in batches as they are found.
+class ReferencesOutput {
+ public:
+  ReferencesOutput(Config* config, Ipc_TextDocumentReferences* request)
+      : token_(request->params.partialResultToken),
+        streaming_(!std::holds_alternative<std::monostate>(token_)),
+        skip_(std::max(request->params.startIndex, 0)),
+        remaining_(config->maxReferencesResults > 0
+                       ? size_t(config->maxReferencesResults)
+                       : std::numeric_limits<size_t>::max()) {}
+
+  bool full() const { return remaining_ == 0; }
+  bool empty() const { return empty_; }
+  // Reported with the response, see Out_LocationList::pendingFiles.
+  void AddPendingFiles(int pending_files) {
+    pending_files_ = std::max(pending_files_, pending_files);
+  }
+
+  // Returns false once no more locations are accepted.
+  bool Add(lsLocation location) {
+    if (full())
+      return false;
+    empty_ = false;
+    if (skip_ > 0) {
+      skip_--;
+      return true;
+    }
+    locations_.push_back(std::move(location));
+    remaining_--;
+    if (streaming_ && locations_.size() >= kPartialResultBatchSize)
+      Flush();
+    return !full();
+  }
+
+  // Sends the locations which have not been sent yet and the response.
+  void Finish(const lsRequestId& id) {
+    if (full())
+      LOG_S(INFO) << "References were cut at maxReferencesResults";
+    if (streaming_)
+      Flush();
+    Out_TextDocumentReferences out;
+    out.id = id;
+    out.result = std::move(locations_);
+    if (pending_files_ > 0)
+      out.pendingFiles = pending_files_;
+    QueueManager::WriteStdout(IpcId::TextDocumentReferences, out);
+  }
+
+ private:
+  void Flush() {
+    if (locations_.empty())
+      return;
+    Out_TextDocumentReferencesPartialResult out;
+    out.params.token = token_;
+    out.params.value = std::move(locations_);
+    locations_.clear();
+    QueueManager::WriteStdout(IpcId::TextDocumentReferences, out);
+  }
+
+  lsRequestId token_;
+  bool streaming_;
+  size_t skip_;
+  size_t remaining_;
+  bool empty_ = true;
+  int pending_files_ = 0;
+  std::vector<lsLocation> locations_;
 };
-MAKE_REFLECT_STRUCT(Out_TextDocumentReferences, jsonrpc, id, result);
 
 struct TextDocumentReferencesHandler
     : BaseMessageHandler<Ipc_TextDocumentReferences> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_TextDocumentReferences* request) override {
+    if (WorkingFile* unimported = GetUnimportedWorkingFile(
+            db, working_files, request->params.textDocument.uri.GetPath())) {
+      std::vector<SymbolIdx> symbols =
+          FindSymbolsByLexedName(db, unimported, request->params.position);
+      if (!symbols.empty()) {
+        ReferencesOutput out(config, request);
+        for (const SymbolIdx& symbol : symbols) {
+          if (!AddUses(request, symbol, &out))
+            return;
+        }
+        out.Finish(request->id);
+        return;
+      }
+    }
+
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
                         request->params.textDocument.uri.GetPath(), &file)) {
@@ -48,44 +171,58 @@ struct TextDocumentReferencesHandler
     WorkingFile* working_file =
         working_files->GetFileByFilename(file->def->path);
 
-    Out_TextDocumentReferences out;
-    out.id = request->id;
+    ReferencesOutput out(config, request);
 
     for (const SymbolRef& ref :
          FindSymbolsAtLocation(working_file, file, request->params.position)) {
       // Found symbol. Return references.
-      std::vector<QueryLocation> uses = GetUsesOfSymbol(
-          db, ref.idx, request->params.context.includeDeclaration);
-      out.result.reserve(uses.size());
-      for (const QueryLocation& use : uses) {
-        optional<lsLocation> ls_location =
-            GetLsLocation(db, working_files, use);
-        if (ls_location)
-          out.result.push_back(*ls_location);
-      }
+      if (!AddUses(request, ref.idx, &out))
+        return;
       break;
     }
 
-    if (out.result.empty())
-      for (const IndexInclude& include : file->def->includes)
+    if (out.empty())
+      for (const QueryFile::Include& include : file->def->includes)
         if (include.line == request->params.position.line) {
           // |include| is the line the cursor is on.
-          for (QueryFile& file1 : db->files)
+          for (QueryFile& file1 : db->files) {
+            if (EmitIfRequestCancelled(request->id))
+              return;
             if (file1.def)
-              for (const IndexInclude& include1 : file1.def->includes)
-                if (include1.resolved_path == include.resolved_path) {
+              for (const QueryFile::Include& include1 : file1.def->includes)
+                if (include1.file == include.file) {
                   // Another file |file1| has the same include line.
                   lsLocation result;
-                  result.uri = lsDocumentUri::FromPath(file1.def->path);
+                  result.uri = file1.GetUri();
                   result.range.start.line = result.range.end.line =
                       include1.line;
-                  out.result.push_back(std::move(result));
+                  out.Add(std::move(result));
                   break;
                 }
+          }
           break;
         }
 
-    QueueManager::WriteStdout(IpcId::TextDocumentReferences, out);
+    out.Finish(request->id);
+  }
+
+ private:
+  // Adds the uses of |symbol| to |out|. Returns false if the request has been
+  // cancelled.
+  bool AddUses(Ipc_TextDocumentReferences* request,
+               const SymbolIdx& symbol,
+               ReferencesOutput* out) {
+    std::vector<QueryLocation> uses = GetUsesOfSymbol(
+        db, symbol, request->params.context.includeDeclaration);
+    for (const QueryLocation& use : uses) {
+      if (EmitIfRequestCancelled(request->id))
+        return false;
+      optional<lsLocation> ls_location = GetLsLocation(db, working_files, use);
+      if (ls_location && !out->Add(*ls_location))
+        break;
+    }
+    out->AddPendingFiles(CountPendingFiles(db, import_pipeline_status, symbol));
+    return true;
   }
 };
 REGISTER_MESSAGE_HANDLER(TextDocumentReferencesHandler);
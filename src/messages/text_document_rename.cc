@@ -2,50 +2,107 @@
 #include "query_utils.h"
 #include "queue_manager.h"
 
-namespace {
-
-lsWorkspaceEdit BuildWorkspaceEdit(QueryDatabase* db,
-                                   WorkingFiles* working_files,
-                                   const std::vector<QueryLocation>& locations,
-                                   const std::string& new_text) {
-  std::unordered_map<QueryFileId, lsTextDocumentEdit> path_to_edit;
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
-  for (auto& location : locations) {
-    optional<lsLocation> ls_location =
-        GetLsLocation(db, working_files, location);
-    if (!ls_location)
-      continue;
-
-    if (path_to_edit.find(location.path) == path_to_edit.end()) {
-      path_to_edit[location.path] = lsTextDocumentEdit();
+namespace {
 
-      QueryFile& file = db->files[location.path.id];
-      if (!file.def)
-        continue;
+// Renames with fewer uses than this per thread are converted on one thread.
+const size_t kMinUsesPerThread = 1000;
 
-      const std::string& path = file.def->path;
-      path_to_edit[location.path].textDocument.uri =
-          lsDocumentUri::FromPath(path);
+bool EditLess(const lsTextEdit& a, const lsTextEdit& b) {
+  if (!(a.range.start == b.range.start))
+    return a.range.start < b.range.start;
+  return a.range.end < b.range.end;
+}
 
-      WorkingFile* working_file = working_files->GetFileByFilename(path);
-      if (working_file)
-        path_to_edit[location.path].textDocument.version =
-            working_file->version;
-    }
+bool SameEditRange(const lsTextEdit& a, const lsTextEdit& b) {
+  return a.range == b.range;
+}
 
+// Converts the uses of a single file to text edits. Returns false if none of
+// them could be mapped to the file.
+bool BuildTextDocumentEdit(QueryDatabase* db,
+                           WorkingFiles* working_files,
+                           std::vector<QueryLocation>::const_iterator begin,
+                           std::vector<QueryLocation>::const_iterator end,
+                           const std::string& new_text,
+                           lsTextDocumentEdit* out) {
+  QueryFile& file = db->files[begin->path.id];
+  if (!file.def)
+    return false;
+
+  const std::string& path = file.def->path;
+  WorkingFile* working_file = working_files->GetFileByFilename(path);
+  for (auto it = begin; it != end; ++it) {
+    optional<lsRange> range = GetLsRange(working_file, it->range);
+    if (!range)
+      continue;
     lsTextEdit edit;
-    edit.range = ls_location->range;
+    edit.range = *range;
     edit.newText = new_text;
+    out->edits.push_back(std::move(edit));
+  }
+  if (out->edits.empty())
+    return false;
+
+  // vscode complains if we submit overlapping text edits.
+  std::sort(out->edits.begin(), out->edits.end(), EditLess);
+  out->edits.erase(
+      std::unique(out->edits.begin(), out->edits.end(), SameEditRange),
+      out->edits.end());
+
+  out->textDocument.uri = lsDocumentUri::FromPath(path);
+  if (working_file)
+    out->textDocument.version = working_file->version;
+  return true;
+}
 
-    // vscode complains if we submit overlapping text edits.
-    auto& edits = path_to_edit[location.path].edits;
-    if (std::find(edits.begin(), edits.end(), edit) == edits.end())
-      edits.push_back(edit);
+lsWorkspaceEdit BuildWorkspaceEdit(QueryDatabase* db,
+                                   WorkingFiles* working_files,
+                                   std::vector<QueryLocation> locations,
+                                   const std::string& new_text) {
+  // Group the uses by file, so each file is looked up once and files can be
+  // converted in parallel.
+  std::stable_sort(locations.begin(), locations.end(),
+                   [](const QueryLocation& a, const QueryLocation& b) {
+                     return a.path.id < b.path.id;
+                   });
+  std::vector<size_t> file_starts;
+  for (size_t i = 0; i < locations.size(); i++) {
+    if (i == 0 || locations[i].path.id != locations[i - 1].path.id)
+      file_starts.push_back(i);
   }
+  file_starts.push_back(locations.size());
+  size_t num_files = file_starts.size() - 1;
+
+  std::vector<lsTextDocumentEdit> edits(num_files);
+  std::vector<uint8_t> has_edits(num_files, 0);
+  std::atomic<size_t> next_file{0};
+  auto convert_files = [&]() {
+    for (size_t i = next_file++; i < num_files; i = next_file++) {
+      has_edits[i] = BuildTextDocumentEdit(
+          db, working_files, locations.begin() + file_starts[i],
+          locations.begin() + file_starts[i + 1], new_text, &edits[i]);
+    }
+  };
+
+  size_t num_threads = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1u),
+      std::min(num_files, locations.size() / kMinUsesPerThread));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++)
+    threads.emplace_back(convert_files);
+  convert_files();
+  for (std::thread& thread : threads)
+    thread.join();
 
   lsWorkspaceEdit edit;
-  for (const auto& changes : path_to_edit)
-    edit.documentChanges.push_back(changes.second);
+  for (size_t i = 0; i < num_files; i++) {
+    if (has_edits[i])
+      edit.documentChanges.push_back(std::move(edits[i]));
+  }
   return edit;
 }
 
@@ -79,6 +136,7 @@ struct Out_TextDocumentRename : public lsOutMessage<Out_TextDocumentRename> {
 MAKE_REFLECT_STRUCT(Out_TextDocumentRename, jsonrpc, id, result);
 
 struct TextDocumentRenameHandler : BaseMessageHandler<Ipc_TextDocumentRename> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_TextDocumentRename* request) override {
     QueryFileId file_id;
     QueryFile* file;
@@ -6,6 +6,8 @@
 
 #include <stdint.h>
 
+#include <unordered_set>
+
 namespace {
 struct Ipc_TextDocumentSignatureHelp
     : public RequestMessage<Ipc_TextDocumentSignatureHelp> {
@@ -82,6 +84,93 @@ struct Out_TextDocumentSignatureHelp
 };
 MAKE_REFLECT_STRUCT(Out_TextDocumentSignatureHelp, jsonrpc, id, result);
 
+// Upper bound on the signatures found in the index, for names which many
+// unrelated functions share.
+const size_t kMaxIndexedSignatures = 20;
+
+// Prefer the signature with least parameter count but still larger than
+// |active_param|.
+void SetActiveSignature(lsSignatureHelp* help, int active_param) {
+  help->activeSignature = 0;
+  size_t num_parameters = SIZE_MAX;
+  for (size_t i = 0; i < help->signatures.size(); ++i) {
+    size_t t = help->signatures[i].parameters.size();
+    if (active_param < t && t < num_parameters) {
+      help->activeSignature = int(i);
+      num_parameters = t;
+    }
+  }
+}
+
+// Returns the parameters in the parameter list which starts at
+// |detailed_name[open_paren]|, eg, "int a" and "std::map<int, int> b".
+std::vector<std::string> ParseParameters(std::string_view detailed_name,
+                                         size_t open_paren) {
+  std::vector<std::string> parameters;
+  int depth = 0;
+  size_t start = open_paren + 1;
+  for (size_t i = open_paren; i < detailed_name.size(); i++) {
+    char c = detailed_name[i];
+    if (c == '(' || c == '<' || c == '[' || c == '{') {
+      depth++;
+    } else if (c == ')' || c == '>' || c == ']' || c == '}') {
+      if (--depth == 0) {
+        std::string parameter = Trim(
+            std::string(detailed_name.substr(start, i - start)));
+        if (!parameter.empty() && parameter != "void")
+          parameters.push_back(parameter);
+        break;
+      }
+    } else if (c == ',' && depth == 1) {
+      parameters.push_back(
+          Trim(std::string(detailed_name.substr(start, i - start))));
+      start = i + 1;
+    }
+  }
+  return parameters;
+}
+
+// Returns the signatures of the functions named |name| in the index. They
+// answer signature help while the completion session of the file is not
+// parsed yet, which may take seconds. Unlike code completion, this does not
+// know the type of the object a method is called on.
+std::vector<lsSignatureInformation> GetIndexedSignatures(
+    QueryDatabase* db,
+    const std::string& name) {
+  std::vector<lsSignatureInformation> signatures;
+  optional<std::vector<uint32_t>> candidates =
+      db->symbol_search_index.SubstringCandidates(name);
+  if (!candidates)
+    return signatures;
+  std::unordered_set<std::string> labels;
+  for (uint32_t i : *candidates) {
+    if (signatures.size() >= kMaxIndexedSignatures)
+      break;
+    SymbolIdx symbol = db->symbols[i];
+    if (symbol.kind != SymbolKind::Func ||
+        db->GetSymbolShortName(i) != std::string_view(name))
+      continue;
+    QueryFunc& func = db->funcs[symbol.idx];
+    if (!func.def)
+      continue;
+    const std::string& detailed_name = func.def->detailed_name.str();
+    size_t open_paren = detailed_name.find(
+        '(', func.def->short_name_offset + func.def->short_name_size);
+    if (open_paren == std::string::npos || !labels.insert(detailed_name).second)
+      continue;
+
+    lsSignatureInformation signature;
+    signature.label = detailed_name;
+    for (std::string& parameter : ParseParameters(detailed_name, open_paren)) {
+      lsParameterInformation ls_param;
+      ls_param.label = std::move(parameter);
+      signature.parameters.push_back(ls_param);
+    }
+    signatures.push_back(signature);
+  }
+  return signatures;
+}
+
 struct TextDocumentSignatureHelpHandler : MessageHandler {
   IpcId GetId() const override { return IpcId::TextDocumentSignatureHelp; }
 
@@ -101,6 +190,41 @@ struct TextDocumentSignatureHelpHandler : MessageHandler {
     if (search.empty())
       return;
 
+    // Parsing the file for code completion may take seconds, so answer from
+    // the index meanwhile. The completion still runs to parse the file and
+    // caches its results, which answer the next request at this call.
+    if (!signature_cache->IsCacheValid(params) &&
+        !clang_complete->HasParsedSession(params.textDocument.uri.GetPath())) {
+      std::vector<lsSignatureInformation> signatures =
+          GetIndexedSignatures(db, search);
+      if (!signatures.empty()) {
+        Out_TextDocumentSignatureHelp out;
+        out.id = request->id;
+        out.result.signatures = std::move(signatures);
+        SetActiveSignature(&out.result, active_param);
+        out.result.activeParameter = active_param;
+        QueueManager::WriteStdout(IpcId::TextDocumentSignatureHelp, out);
+
+        lsTextDocumentPositionParams completion_params = params;
+        clang_complete->CodeComplete(
+            completion_params,
+            [this, completion_params](
+                const std::vector<lsCompletionItem>& results,
+                bool is_cached_result) {
+              if (is_cached_result)
+                return;
+              signature_cache->WithLock([&]() {
+                signature_cache->cached_path_ =
+                    completion_params.textDocument.uri.GetPath();
+                signature_cache->cached_completion_position_ =
+                    completion_params.position;
+                signature_cache->cached_results_ = results;
+              });
+            });
+        return;
+      }
+    }
+
     ClangCompleteManager::OnComplete callback = std::bind(
         [this](BaseIpcMessage* message, std::string search, int active_param,
                const std::vector<lsCompletionItem>& results,
@@ -124,19 +248,7 @@ struct TextDocumentSignatureHelpHandler : MessageHandler {
             out.result.signatures.push_back(signature);
           }
 
-          // Prefer the signature with least parameter count but still larger
-          // than active_param.
-          out.result.activeSignature = 0;
-          if (out.result.signatures.size()) {
-            size_t num_parameters = SIZE_MAX;
-            for (size_t i = 0; i < out.result.signatures.size(); ++i) {
-              size_t t = out.result.signatures[i].parameters.size();
-              if (active_param < t && t < num_parameters) {
-                out.result.activeSignature = int(i);
-                num_parameters = t;
-              }
-            }
-          }
+          SetActiveSignature(&out.result, active_param);
 
           // Set signature to what we parsed from the working file.
           out.result.activeParameter = active_param;
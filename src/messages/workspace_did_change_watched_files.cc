@@ -1,13 +1,26 @@
 #include "cache_manager.h"
 #include "clang_complete.h"
+#include "include_complete.h"
+#include "match.h"
 #include "message_handler.h"
+#include "platform.h"
 #include "project.h"
 #include "queue_manager.h"
+#include "timestamp_manager.h"
+#include "work_thread.h"
 #include "working_files.h"
 
 #include <loguru/loguru.hpp>
 
+#include <atomic>
+#include <thread>
+
 namespace {
+// Changes seen by the native file watcher are handled once no further change
+// happened for this long, since editors and build tools write files in
+// several steps.
+const int kFileWatcherDebounceMs = 500;
+
 enum class lsFileChangeType {
   Created = 1,
   Changed = 2,
@@ -30,18 +43,104 @@ struct Ipc_WorkspaceDidChangeWatchedFiles
     : public NotificationMessage<Ipc_WorkspaceDidChangeWatchedFiles> {
   const static IpcId kIpcId = IpcId::WorkspaceDidChangeWatchedFiles;
   lsDidChangeWatchedFilesParams params;
+  // Set on the message the project loading thread queues once the project is
+  // loaded again after a change of its compilation database.
+  std::shared_ptr<Project> loaded_project;
 };
 MAKE_REFLECT_STRUCT(Ipc_WorkspaceDidChangeWatchedFiles, params);
 REGISTER_IPC_MESSAGE(Ipc_WorkspaceDidChangeWatchedFiles);
 
+// Set while the project is loaded again in the background. Changes seen
+// meanwhile set |g_project_reload_pending| to load it once more afterwards,
+// since the loading thread may have read the database before they happened.
+std::atomic<bool> g_project_reload_in_progress{false};
+bool g_project_reload_pending = false;
+
+// Returns true if |path| is a file Project::Load reads the entries of the
+// project from, ie, compile_commands.json or .cquery in a workspace folder or
+// in Config::compilationDatabaseDirectory.
+bool IsCompilationDatabase(Config* config, const std::string& path) {
+  std::string name = GetBaseName(path);
+  if (name != "compile_commands.json" && name != ".cquery")
+    return false;
+  std::string directory = path.substr(0, path.size() - name.size());
+  if (!config->compilationDatabaseDirectory.empty()) {
+    std::string database_directory =
+        NormalizePath(config->compilationDatabaseDirectory);
+    EnsureEndsInSlash(database_directory);
+    if (directory == database_directory)
+      return true;
+  }
+  return std::find(config->workspaceFolders.begin(),
+                   config->workspaceFolders.end(),
+                   directory) != config->workspaceFolders.end();
+}
+
+// Loads the project again on a thread of its own, and queues it back to
+// querydb.
+void StartProjectReload(Config* config) {
+  if (g_project_reload_in_progress.exchange(true)) {
+    g_project_reload_pending = true;
+    return;
+  }
+  LOG_S(INFO) << "Compilation database changed; reloading the project";
+  std::thread([config]() {
+    SetCurrentThreadName("project_load");
+    Timer time;
+    auto message = MakeUnique<Ipc_WorkspaceDidChangeWatchedFiles>();
+    message->loaded_project = std::make_shared<Project>();
+    message->loaded_project->Load(
+        config, config->extraClangArguments,
+        config->compilationDatabaseDirectory, config->workspaceFolders,
+        config->resourceDirectory);
+    time.ResetAndPrint(
+        "[perf] Reloaded compilation entries (" +
+        std::to_string(message->loaded_project->entries.size()) + " files)");
+    QueueManager::instance()->for_querydb.Enqueue(std::move(message));
+  }).detach();
+}
+
 struct WorkspaceDidChangeWatchedFilesHandler
     : BaseMessageHandler<Ipc_WorkspaceDidChangeWatchedFiles> {
   void Run(Ipc_WorkspaceDidChangeWatchedFiles* request) override {
+    if (request->loaded_project) {
+      OnProjectReloaded(request->loaded_project.get());
+      return;
+    }
+
     for (lsFileEvent& event : request->params.changes) {
       std::string path = event.uri.GetPath();
+      // The initial load of the project reads the database once it is done.
+      if (project->is_loaded && IsCompilationDatabase(config, path)) {
+        StartProjectReload(config);
+        continue;
+      }
+      timestamp_manager->DropPrefetchedModificationTime(path);
+      if (event.type == lsFileChangeType::Created)
+        include_complete->AddFile(path);
+      else if (event.type == lsFileChangeType::Deleted)
+        include_complete->RemoveFiles({path});
+
       auto it = project->absolute_path_to_entry_index_.find(path);
-      if (it == project->absolute_path_to_entry_index_.end())
+      if (it == project->absolute_path_to_entry_index_.end()) {
+        // Headers are not project entries. If the include graph knows a
+        // translation unit including it, reindex the header through it.
+        if (event.type != lsFileChangeType::Deleted &&
+            !timestamp_manager->GetImporters(path).empty()) {
+          Project::Entry entry = project->FindCompilationEntryForFile(path);
+          optional<std::string> content = ReadContent(path);
+          if (content) {
+            Index_Request index_request(
+                path, entry.args,
+                working_files->GetFileByFilename(path) != nullptr, *content,
+                ICacheManager::Make(config));
+            index_request.is_inferred = true;
+            QueueManager::instance()->index_request.Enqueue(
+                std::move(index_request));
+          }
+        }
         continue;
+      }
       const Project::Entry& entry = project->entries[it->second];
       bool is_interactive =
           working_files->GetFileByFilename(entry.filename) != nullptr;
@@ -66,6 +165,92 @@ struct WorkspaceDidChangeWatchedFilesHandler
       }
     }
   }
+
+  // Updates the project with the entries loaded again, and indexes only the
+  // files which were added or whose arguments changed. The index of the other
+  // files stays as it is.
+  void OnProjectReloaded(Project* loaded_project) {
+    std::vector<std::string> removed;
+    std::vector<Project::Entry> changed =
+        project->Update(loaded_project, &removed);
+    LOG_S(INFO) << "Reloaded the project: " << changed.size()
+                << " files added or changed, " << removed.size()
+                << " files removed";
+
+    GroupMatch matcher(config->indexWhitelist, config->indexBlacklist);
+    for (const Project::Entry& entry : changed) {
+      if (!matcher.IsMatch(entry.filename))
+        continue;
+      bool is_interactive =
+          working_files->GetFileByFilename(entry.filename) != nullptr;
+      if (is_interactive) {
+        // Recreate the completion session with the new arguments.
+        clang_complete->NotifyClose(entry.filename);
+        clang_complete->NotifyView(entry.filename);
+      }
+      Index_Request index_request(entry.filename, entry.args, is_interactive,
+                                  nullopt, ICacheManager::Make(config));
+      if (is_interactive)
+        QueueManager::instance()->index_request.PriorityEnqueue(
+            std::move(index_request));
+      else
+        QueueManager::instance()->index_request.Enqueue(
+            std::move(index_request));
+    }
+
+    // Like a deleted file, a file which left the project is indexed as if it
+    // were empty, which removes its symbols from querydb. Files open in the
+    // editor are indexed again with inferred arguments instead.
+    for (const std::string& path : removed) {
+      if (working_files->GetFileByFilename(path)) {
+        Project::Entry entry = project->FindCompilationEntryForFile(path);
+        Index_Request index_request(path, entry.args, true /*is_interactive*/,
+                                    nullopt, ICacheManager::Make(config));
+        index_request.is_inferred = true;
+        QueueManager::instance()->index_request.PriorityEnqueue(
+            std::move(index_request));
+        continue;
+      }
+      QueueManager::instance()->index_request.Enqueue(
+          Index_Request(path, {}, false /*is_interactive*/, std::string(),
+                        ICacheManager::Make(config)));
+    }
+
+    g_project_reload_in_progress = false;
+    if (g_project_reload_pending) {
+      g_project_reload_pending = false;
+      StartProjectReload(config);
+    }
+  }
 };
 REGISTER_MESSAGE_HANDLER(WorkspaceDidChangeWatchedFilesHandler);
 }  // namespace
+
+void StartFileWatcher(const std::vector<std::string>& directories) {
+  WorkThread::StartThread("file_watcher", [directories]() {
+    bool supported = WatchDirectories(
+        directories, kFileWatcherDebounceMs,
+        [](std::vector<FileChange> changes) {
+          auto message = MakeUnique<Ipc_WorkspaceDidChangeWatchedFiles>();
+          for (const FileChange& change : changes) {
+            lsFileEvent event;
+            event.uri = lsDocumentUri::FromPath(change.path);
+            switch (change.type) {
+              case FileChangeType::Created:
+                event.type = lsFileChangeType::Created;
+                break;
+              case FileChangeType::Changed:
+                event.type = lsFileChangeType::Changed;
+                break;
+              case FileChangeType::Deleted:
+                event.type = lsFileChangeType::Deleted;
+                break;
+            }
+            message->params.changes.push_back(event);
+          }
+          QueueManager::instance()->for_querydb.Enqueue(std::move(message));
+        });
+    LOG_IF_S(WARNING, !supported)
+        << "index.watchFiles is not supported on this platform";
+  });
+}
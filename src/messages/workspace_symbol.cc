@@ -1,3 +1,4 @@
+#include "fuzzy_match.h"
 #include "lex_utils.h"
 #include "message_handler.h"
 #include "query_utils.h"
@@ -6,9 +7,10 @@
 #include <loguru.hpp>
 
 #include <ctype.h>
-#include <limits.h>
 #include <algorithm>
 #include <functional>
+#include <mutex>
+#include <thread>
 
 namespace {
 
@@ -56,134 +58,150 @@ struct Out_WorkspaceSymbol : public lsOutMessage<Out_WorkspaceSymbol> {
 };
 MAKE_REFLECT_STRUCT(Out_WorkspaceSymbol, jsonrpc, id, result);
 
-///// Fuzzy matching
-
-// Negative but far from INT_MIN so that intermediate results are hard to
-// overflow
-constexpr int kMinScore = INT_MIN / 2;
-// Penalty of dropping a leading character in str
-constexpr int kLeadingGapScore = -4;
-// Penalty of dropping a non-leading character in str
-constexpr int kGapScore = -5;
-// Bonus of aligning with an initial character of a word in pattern. Must be
-// greater than 1
-constexpr int kPatternStartMultiplier = 2;
-
-constexpr int kWordStartScore = 50;
-constexpr int kNonWordScore = 40;
-constexpr int kCaseMatchScore = 2;
-
-// Less than kWordStartScore
-constexpr int kConsecutiveScore = kWordStartScore + kGapScore;
-// Slightly less than kConsecutiveScore
-constexpr int kCamelScore = kWordStartScore + kGapScore - 1;
-
-enum class CharClass { Lower, Upper, Digit, NonWord };
-
-static CharClass GetCharClass(int c) {
-  if (islower(c))
-    return CharClass::Lower;
-  if (isupper(c))
-    return CharClass::Upper;
-  if (isdigit(c))
-    return CharClass::Digit;
-  return CharClass::NonWord;
-}
+// Each ranking thread handles at least this many candidates; spawning threads
+// for smaller candidate lists costs more than it saves.
+constexpr int kMinCandidatesPerThread = 4096;
+
+// Number of candidates scanned between two checks for request cancellation.
+constexpr int kCancellationCheckInterval = 4096;
+
+// Matches of a phase are not kept for narrowing if there are more.
+constexpr size_t kMaxNarrowingMatches = 1 << 20;
+
+// The symbols which matched the last query in each phase of the search. Symbol
+// pickers send a request per keystroke, each query extending the last one.
+// Symbols which match the extended query in a phase matched the last one as
+// well, so while the database is at the same generation only those are
+// considered again. A phase only has matches if it considered all of its
+// candidates. Scores depend on the query and are computed again.
+class SymbolNarrowing {
+ public:
+  struct Matches {
+    // Sorted symbol indices whose detailed name contains the query.
+    optional<std::vector<uint32_t>> substring;
+    // Sorted symbol indices whose short name contains the query as a
+    // subsequence.
+    optional<std::vector<uint32_t>> subsequence;
+  };
 
-static int GetScoreFor(CharClass prev, CharClass curr) {
-  if (prev == CharClass::NonWord && curr != CharClass::NonWord)
-    return kWordStartScore;
-  if ((prev == CharClass::Lower && curr == CharClass::Upper) ||
-      (prev != CharClass::Digit && curr == CharClass::Digit))
-    return kCamelScore;
-  if (curr == CharClass::NonWord)
-    return kNonWordScore;
-  return 0;
-}
+  // Returns the matches of the last query if |query| extends it.
+  Matches Take(const std::string& query, Generation generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Matches matches;
+    if (generation == generation_ &&
+        query.compare(0, query_.size(), query_) == 0)
+      matches = std::move(matches_);
+    matches_ = Matches();
+    return matches;
+  }
 
-/*
-fuzzyEvaluate implements a global sequence alignment algorithm to find the
-maximum accumulated score by aligning `pattern` to `str`. It applies when
-`pattern` is a subsequence of `str`.
-
-Scoring criteria
-- Prefer matches at the start of a word, or the start of subwords in
-CamelCase/camelCase/camel123 words. See kWordStartScore/kCamelScore
-- Non-word characters matter. See kNonWordScore
-- The first characters of words of `pattern` receive bonus because they usually
-have more significance than the rest. See kPatternStartMultiplier
-- Superfluous characters in `str` will reduce the score (gap penalty). See
-kGapScore
-- Prefer early occurrence of the first character. See kLeadingGapScore/kGapScore
-
-The recurrence of the dynamic programming:
-dp[i][j]: maximum accumulated score by aligning pattern[0..i] to str[0..j]
-dp[0][j] = leading_gap_penalty(0, j) + score[j]
-dp[i][j] = max(dp[i-1][j-1] + CONSECUTIVE_SCORE, max(dp[i-1][k] +
-gap_penalty(k+1, j) + score[j] : k < j))
-The first dimension can be suppressed since we do not need a matching scheme,
-which reduces the space complexity from O(N*M) to O(M)
-*/
-int FuzzyEvaluate(std::string_view pattern,
-                  std::string_view str,
-                  std::vector<int>& score,
-                  std::vector<int>& dp) {
-  bool pfirst = true,  // aligning the first character of pattern
-      pstart = true;   // whether we are aligning the start of a word in pattern
-  int uleft = 0,       // value of the upper left cell
-      ulefts = 0,      // maximum value of uleft and cells on the left
-      left, lefts;     // similar to uleft/ulefts, but for the next row
-
-  // Calculate position score for each character in str.
-  CharClass prev = CharClass::NonWord;
-  for (int i = 0; i < int(str.size()); i++) {
-    CharClass cur = GetCharClass(str[i]);
-    score[i] = GetScoreFor(prev, cur);
-    prev = cur;
+  void Store(const std::string& query,
+             Generation generation,
+             Matches matches) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    query_ = query;
+    generation_ = generation;
+    matches_ = std::move(matches);
   }
-  std::fill_n(dp.begin(), str.size(), kMinScore);
 
-  // Align each character of pattern.
-  for (unsigned char pc : pattern) {
-    if (isspace(pc)) {
-      pstart = true;
-      continue;
-    }
-    lefts = kMinScore;
-    // Enumerate the character in str to be aligned with pc.
-    for (int i = 0; i < int(str.size()); i++) {
-      left = dp[i];
-      lefts = std::max(lefts + kGapScore, left);
-      // Use lower() if case-insensitive
-      if (tolower(pc) == tolower(str[i])) {
-        int t = score[i] * (pstart ? kPatternStartMultiplier : 1);
-        dp[i] = (pfirst ? kLeadingGapScore * i + t
-                        : std::max(uleft + kConsecutiveScore, ulefts + t)) +
-                (pc == str[i] ? kCaseMatchScore : 0);
-      } else
-        dp[i] = kMinScore;
-      uleft = left;
-      ulefts = lefts;
+ private:
+  std::mutex mutex_;
+  std::string query_;
+  Generation generation_ = 0;
+  Matches matches_;
+};
+
+// Keeps |found|, the matches of a phase which considered all of its
+// candidates, in |*matches| unless there are too many.
+void KeepMatches(std::vector<uint32_t> found,
+                 optional<std::vector<uint32_t>>* matches) {
+  if (found.size() <= kMaxNarrowingMatches)
+    *matches = std::move(found);
+}
+
+// Returns (score, -symbol index) of the |max_results| best candidates whose
+// short name contains |query_without_space| as a subsequence, best first.
+// Ties are broken in favor of the smaller symbol index.
+//
+// The candidate list is split into contiguous chunks which are ranked on up to
+// |num_threads| threads, each keeping a bounded min-heap of its best
+// candidates. The heaps are merged at the end. |db| is only read, and the
+// caller holds it locked in this function, so the threads can share it.
+// Ranking stops early if request |id| is cancelled. Otherwise every matching
+// symbol index is appended to |matches| in candidate order.
+std::vector<std::pair<int, int>> RankSubsequenceMatches(
+    const lsRequestId& id,
+    QueryDatabase* db,
+    std::string_view query,
+    std::string_view query_without_space,
+    const optional<std::vector<uint32_t>>& candidates,
+    int num_candidates,
+    int max_results,
+    int num_threads,
+    std::vector<uint32_t>* matches) {
+  if (num_threads <= 0)
+    num_threads = std::thread::hardware_concurrency();
+  num_threads = std::min(num_threads, num_candidates / kMinCandidatesPerThread);
+  num_threads = std::max(num_threads, 1);
+
+  using Entry = std::pair<int, int>;
+  std::vector<std::vector<Entry>> heaps(num_threads);
+  std::vector<std::vector<uint32_t>> chunk_matches(num_threads);
+  auto rank_chunk = [&](int thread) {
+    int begin = int(int64_t(num_candidates) * thread / num_threads);
+    int end = int(int64_t(num_candidates) * (thread + 1) / num_threads);
+    std::vector<Entry>& heap = heaps[thread];
+    heap.reserve(max_results);
+    std::vector<int> score, dp;
+    for (int j = begin; j < end; ++j) {
+      if ((j - begin) % kCancellationCheckInterval == 0 &&
+          QueueManager::instance()->IsRequestCancelled(id))
+        return;
+      int i = candidates ? int((*candidates)[j]) : j;
+      if (!SubsequenceMatch(query_without_space,
+                            db->symbol_search_index.LowerShortName(i)))
+        continue;
+      chunk_matches[thread].push_back(i);
+      std::string_view short_name = db->GetSymbolShortName(i);
+      if (score.size() < short_name.size()) {
+        score.resize(short_name.size());
+        dp.resize(short_name.size());
+      }
+      Entry entry(FuzzyEvaluate(query, short_name, score, dp), -i);
+      if (int(heap.size()) < max_results) {
+        heap.push_back(entry);
+        std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+      } else if (max_results > 0 && heap.front() < entry) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+        heap.back() = entry;
+        std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+      }
     }
-    pfirst = pstart = false;
-  }
+  };
 
-  // Enumerate the end position of the match in str. Each removed trailing
-  // character has a penulty of kGapScore.
-  lefts = kMinScore;
-  for (int i = 0; i < int(str.size()); i++)
-    lefts = std::max(lefts + kGapScore, dp[i]);
-  return lefts;
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < num_threads; ++thread)
+    threads.emplace_back(rank_chunk, thread);
+  rank_chunk(0);
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (std::vector<uint32_t>& chunk : chunk_matches)
+    matches->insert(matches->end(), chunk.begin(), chunk.end());
+
+  std::vector<Entry> result;
+  for (std::vector<Entry>& heap : heaps)
+    result.insert(result.end(), heap.begin(), heap.end());
+  std::sort(result.begin(), result.end(), std::greater<Entry>());
+  return result;
 }
 
 struct WorkspaceSymbolHandler : BaseMessageHandler<Ipc_WorkspaceSymbol> {
+  bool IsReadOnly() const override { return true; }
   void Run(Ipc_WorkspaceSymbol* request) override {
     Out_WorkspaceSymbol out;
     out.id = request->id;
 
-    LOG_S(INFO) << "[querydb] Considering " << db->symbols.size()
-                << " candidates for query " << request->params.query;
-
     std::string query = request->params.query;
 
     std::unordered_set<std::string> inserted_results;
@@ -200,10 +218,34 @@ struct WorkspaceSymbolHandler : BaseMessageHandler<Ipc_WorkspaceSymbol> {
     // introduce additional metadata) so that we can do fuzzy search with
     // detailed_names.
 
+    // Candidates are the matches of the last query if this one extends it,
+    // see SymbolNarrowing. Otherwise they are read from
+    // db->symbol_search_index when the query can be filtered by it, or else
+    // every symbol is a candidate. The index may return stale candidates, so
+    // each one is still checked below.
+    Generation generation = db->generation;
+    SymbolNarrowing::Matches narrowed = narrowing_.Take(query, generation);
+    SymbolNarrowing::Matches matches;
+    optional<std::vector<uint32_t>> candidates =
+        narrowed.substring ? std::move(narrowed.substring)
+                           : db->symbol_search_index.SubstringCandidates(query);
+    int num_candidates =
+        candidates ? int(candidates->size()) : int(db->symbols.size());
+
+    LOG_S(INFO) << "[querydb] Considering " << num_candidates
+                << " candidates for query " << query;
+
     // Find exact substring matches.
-    for (int i = 0; i < db->symbols.size(); ++i) {
+    std::vector<uint32_t> substring_found;
+    bool substring_complete = true;
+    for (int j = 0; j < num_candidates; ++j) {
+      if (j % kCancellationCheckInterval == 0 &&
+          EmitIfRequestCancelled(request->id))
+        return;
+      int i = candidates ? int((*candidates)[j]) : j;
       std::string_view detailed_name = db->GetSymbolDetailedName(i);
       if (detailed_name.find(query) != std::string::npos) {
+        substring_found.push_back(i);
         // Do not show the same entry twice.
         if (!inserted_results.insert(std::string(detailed_name)).second)
           continue;
@@ -211,11 +253,15 @@ struct WorkspaceSymbolHandler : BaseMessageHandler<Ipc_WorkspaceSymbol> {
         if (InsertSymbolIntoResult(db, working_files, db->symbols[i],
                                    &unsorted_results)) {
           result_indices.push_back(i);
-          if (unsorted_results.size() >= config->maxWorkspaceSearchResults)
+          if (unsorted_results.size() >= config->maxWorkspaceSearchResults) {
+            substring_complete = false;
             break;
+          }
         }
       }
     }
+    if (substring_complete)
+      KeepMatches(std::move(substring_found), &matches.substring);
 
     // Find subsequence matches.
     if (unsorted_results.size() < config->maxWorkspaceSearchResults) {
@@ -225,21 +271,60 @@ struct WorkspaceSymbolHandler : BaseMessageHandler<Ipc_WorkspaceSymbol> {
         if (!isspace(c))
           query_without_space += c;
 
-      for (int i = 0; i < db->symbols.size(); ++i) {
-        if (SubsequenceMatch(query_without_space, db->GetSymbolShortName(i))) {
-          // Do not show the same entry twice.
-          if (!inserted_results.insert(std::string(db->GetSymbolDetailedName(i))).second)
-            continue;
-
-          if (InsertSymbolIntoResult(db, working_files, db->symbols[i],
-                                     &unsorted_results)) {
-            result_indices.push_back(i);
-            if (unsorted_results.size() >= config->maxWorkspaceSearchResults)
+      candidates = narrowed.subsequence
+                       ? std::move(narrowed.subsequence)
+                       : db->symbol_search_index.SubsequenceCandidates(
+                             query_without_space);
+      num_candidates =
+          candidates ? int(candidates->size()) : int(db->symbols.size());
+      auto try_insert = [&](int i) {
+        // Do not show the same entry twice.
+        if (!inserted_results.insert(std::string(db->GetSymbolDetailedName(i))).second)
+          return;
+        if (InsertSymbolIntoResult(db, working_files, db->symbols[i],
+                                   &unsorted_results))
+          result_indices.push_back(i);
+      };
+
+      if (config->sortWorkspaceSearchResults) {
+        // Rank every match instead of taking the first ones in index order,
+        // so the best matches are returned even if there are many.
+        std::vector<uint32_t> found;
+        std::vector<std::pair<int, int>> ranked = RankSubsequenceMatches(
+            request->id, db, query, query_without_space, candidates,
+            num_candidates, config->maxWorkspaceSearchResults,
+            config->workspaceSymbolThreads, &found);
+        if (EmitIfRequestCancelled(request->id))
+          return;
+        KeepMatches(std::move(found), &matches.subsequence);
+        for (const std::pair<int, int>& entry : ranked) {
+          try_insert(-entry.second);
+          if (unsorted_results.size() >= config->maxWorkspaceSearchResults)
+            break;
+        }
+      } else {
+        std::vector<uint32_t> found;
+        bool complete = true;
+        for (int j = 0; j < num_candidates; ++j) {
+          if (j % kCancellationCheckInterval == 0 &&
+              EmitIfRequestCancelled(request->id))
+            return;
+          int i = candidates ? int((*candidates)[j]) : j;
+          if (SubsequenceMatch(query_without_space,
+                               db->symbol_search_index.LowerShortName(i))) {
+            found.push_back(i);
+            try_insert(i);
+            if (unsorted_results.size() >= config->maxWorkspaceSearchResults) {
+              complete = false;
               break;
+            }
           }
         }
+        if (complete)
+          KeepMatches(std::move(found), &matches.subsequence);
       }
     }
+    narrowing_.Store(query, generation, std::move(matches));
 
     if (config->sortWorkspaceSearchResults) {
       // Sort results with a fuzzy matching algorithm.
@@ -272,6 +357,9 @@ struct WorkspaceSymbolHandler : BaseMessageHandler<Ipc_WorkspaceSymbol> {
                 << " results for query " << query;
     QueueManager::WriteStdout(IpcId::WorkspaceSymbol, out);
   }
+
+ private:
+  SymbolNarrowing narrowing_;
 };
 REGISTER_MESSAGE_HANDLER(WorkspaceSymbolHandler);
 }  // namespace
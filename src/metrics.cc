@@ -0,0 +1,107 @@
+#include "metrics.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+std::mutex& GetRegistryMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::map<std::string, std::unique_ptr<LatencyHistogram>>& GetRegistry() {
+  static std::map<std::string, std::unique_ptr<LatencyHistogram>> registry;
+  return registry;
+}
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram() : count_(0), total_(0), max_(0) {
+  for (std::atomic<uint64_t>& bucket : buckets_)
+    bucket = 0;
+}
+
+void LatencyHistogram::Record(uint64_t microseconds) {
+  int bucket = 0;
+  while (bucket < kNumBuckets - 1 && (uint64_t(1) << bucket) <= microseconds)
+    bucket++;
+  buckets_[bucket]++;
+  count_++;
+  total_ += microseconds;
+  uint64_t max = max_;
+  while (microseconds > max && !max_.compare_exchange_weak(max, microseconds))
+    ;
+}
+
+LatencyHistogram::Summary LatencyHistogram::Summarize() const {
+  Summary summary;
+  uint64_t counts[kNumBuckets];
+  for (int i = 0; i < kNumBuckets; i++) {
+    counts[i] = buckets_[i];
+    summary.count += counts[i];
+  }
+  summary.total_us = total_;
+  summary.max_us = max_;
+
+  auto percentile = [&](uint64_t percent) -> uint64_t {
+    // Rank of the value, starting at 1.
+    uint64_t rank = (summary.count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; i++) {
+      seen += counts[i];
+      if (seen >= rank && seen > 0)
+        return std::min(uint64_t(1) << i, summary.max_us);
+    }
+    return summary.max_us;
+  };
+  summary.p50_us = percentile(50);
+  summary.p90_us = percentile(90);
+  summary.p99_us = percentile(99);
+  return summary;
+}
+
+LatencyHistogram* GetLatencyHistogram(const std::string& name) {
+  std::lock_guard<std::mutex> lock(GetRegistryMutex());
+  std::unique_ptr<LatencyHistogram>& histogram = GetRegistry()[name];
+  if (!histogram)
+    histogram.reset(new LatencyHistogram());
+  return histogram.get();
+}
+
+std::vector<LatencyHistogram::Summary> SummarizeLatencyHistograms() {
+  std::vector<LatencyHistogram::Summary> result;
+  std::lock_guard<std::mutex> lock(GetRegistryMutex());
+  for (const auto& entry : GetRegistry()) {
+    LatencyHistogram::Summary summary = entry.second->Summarize();
+    if (summary.count == 0)
+      continue;
+    summary.name = entry.first;
+    result.push_back(summary);
+  }
+  return result;
+}
+
+TEST_SUITE("LatencyHistogram") {
+  TEST_CASE("percentiles") {
+    LatencyHistogram histogram;
+    REQUIRE(histogram.Summarize().count == 0);
+    REQUIRE(histogram.Summarize().p50_us == 0);
+
+    for (int i = 0; i < 90; i++)
+      histogram.Record(3);
+    for (int i = 0; i < 10; i++)
+      histogram.Record(1000);
+    LatencyHistogram::Summary summary = histogram.Summarize();
+    REQUIRE(summary.count == 100);
+    REQUIRE(summary.total_us == 90 * 3 + 10 * 1000);
+    REQUIRE(summary.max_us == 1000);
+    REQUIRE(summary.p50_us == 4);
+    REQUIRE(summary.p90_us == 4);
+    REQUIRE(summary.p99_us == 1000);
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Histogram of durations in microseconds. Values are counted in power of two
+// buckets, so recording is a few atomic increments and can always be enabled.
+class LatencyHistogram {
+ public:
+  struct Summary {
+    std::string name;
+    uint64_t count = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+    // Percentiles are the upper bound of the bucket they fall in, so they are
+    // at most twice the real value.
+    uint64_t p50_us = 0;
+    uint64_t p90_us = 0;
+    uint64_t p99_us = 0;
+  };
+
+  LatencyHistogram();
+
+  void Record(uint64_t microseconds);
+  Summary Summarize() const;
+
+ private:
+  // Bucket i counts values below 2^i microseconds; the last one counts the
+  // rest.
+  static const int kNumBuckets = 40;
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> total_;
+  std::atomic<uint64_t> max_;
+};
+
+// Returns the process wide histogram called |name|, creating it if needed.
+// The histogram lives as long as the process, so callers can keep it in a
+// static:
+//
+//   static LatencyHistogram* parse = GetLatencyHistogram("index.parse");
+//   parse->Record(time);
+LatencyHistogram* GetLatencyHistogram(const std::string& name);
+
+// Returns the summaries of all histograms which recorded a value, sorted by
+// name.
+std::vector<LatencyHistogram::Summary> SummarizeLatencyHistograms();
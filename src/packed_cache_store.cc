@@ -0,0 +1,480 @@
+#include "packed_cache_store.h"
+
+#include "platform.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+constexpr uint32_t kRecordMagic = 0x43515243;   // "CRQC"
+constexpr uint32_t kTrailerMagic = 0x43515254;  // "TRQC"
+constexpr size_t kRecordHeaderSize = 4 + 4 + 4 + 8;
+constexpr size_t kTrailerSize = 8 + 4;
+// Do not bother compacting shards with less dead space than this.
+constexpr uint64_t kMinCompactBytes = 64 * 1024 * 1024;
+
+enum class RecordKind : uint32_t { Entry = 0, Index = 1 };
+
+bool Seek(FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+  return _fseeki64(file, int64_t(offset), SEEK_SET) == 0;
+#else
+  return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+uint64_t FileSize(FILE* file) {
+#if defined(_WIN32)
+  _fseeki64(file, 0, SEEK_END);
+  return uint64_t(_ftelli64(file));
+#else
+  fseeko(file, 0, SEEK_END);
+  return uint64_t(ftello(file));
+#endif
+}
+
+template <typename T>
+void Append(std::string* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool Consume(const char*& p, const char* end, T* value) {
+  if (size_t(end - p) < sizeof(T))
+    return false;
+  memcpy(value, p, sizeof(T));
+  p += sizeof(T);
+  return true;
+}
+
+// Writes a record at the end of |file|. Returns the number of bytes written,
+// or 0 on failure.
+size_t WriteRecord(FILE* file,
+                   RecordKind kind,
+                   const std::string& key,
+                   const std::string& value) {
+  std::string header;
+  Append(&header, kRecordMagic);
+  Append(&header, uint32_t(kind));
+  Append(&header, uint32_t(key.size()));
+  Append(&header, uint64_t(value.size()));
+  if (fwrite(header.data(), 1, header.size(), file) != header.size() ||
+      fwrite(key.data(), 1, key.size(), file) != key.size() ||
+      fwrite(value.data(), 1, value.size(), file) != value.size())
+    return 0;
+  return kRecordHeaderSize + key.size() + value.size();
+}
+
+// The stores returned by PackedCacheStore::Get(). They are never destroyed,
+// since threads may still use them while the process exits; CloseAll() closes
+// them instead.
+struct StoreRegistry {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<PackedCacheStore>> stores;
+};
+
+StoreRegistry* GetStoreRegistry() {
+  static StoreRegistry* registry = new StoreRegistry();
+  return registry;
+}
+
+}  // namespace
+
+struct PackedCacheStore::Shard {
+  struct Entry {
+    // Offset of the value in the shard file.
+    uint64_t offset;
+    uint64_t size;
+    // Size of the whole record.
+    uint64_t RecordSize(const std::string& key) const {
+      return kRecordHeaderSize + key.size() + size;
+    }
+  };
+
+  std::mutex mutex;
+  std::string path;
+  FILE* file = nullptr;
+  std::unordered_map<std::string, Entry> entries;
+  // Size of the shard file.
+  uint64_t end = 0;
+  // Total size of the records in |entries|.
+  uint64_t live_bytes = 0;
+  // True if there are records which are not covered by an index record.
+  bool dirty = false;
+
+  explicit Shard(const std::string& path) : path(path) {
+    file = fopen(path.c_str(), "a+b");
+    if (!file) {
+      LOG_S(ERROR) << "Cannot open cache shard " << path;
+      return;
+    }
+    end = FileSize(file);
+    if (end && !LoadIndex() && !Scan()) {
+      LOG_S(WARNING) << "Cache shard " << path
+                     << " is corrupted; dropping its trailing records";
+      Compact();
+    }
+  }
+
+  ~Shard() { Close(); }
+
+  void Close() {
+    if (file) {
+      WriteIndex();
+      fclose(file);
+      file = nullptr;
+    }
+  }
+
+  bool ReadAt(uint64_t offset, size_t size, char* out) {
+    return Seek(file, offset) && fread(out, 1, size, file) == size;
+  }
+
+  // Reads the index record referenced by the trailer.
+  bool LoadIndex() {
+    if (end < kTrailerSize + kRecordHeaderSize)
+      return false;
+    char trailer[kTrailerSize];
+    if (!ReadAt(end - kTrailerSize, kTrailerSize, trailer))
+      return false;
+    const char* p = trailer;
+    uint64_t index_offset;
+    uint32_t magic;
+    Consume(p, trailer + kTrailerSize, &index_offset);
+    Consume(p, trailer + kTrailerSize, &magic);
+    if (magic != kTrailerMagic ||
+        index_offset + kRecordHeaderSize > end - kTrailerSize)
+      return false;
+
+    char header[kRecordHeaderSize];
+    if (!ReadAt(index_offset, kRecordHeaderSize, header))
+      return false;
+    uint32_t kind, key_size;
+    uint64_t value_size;
+    p = header;
+    Consume(p, header + kRecordHeaderSize, &magic);
+    Consume(p, header + kRecordHeaderSize, &kind);
+    Consume(p, header + kRecordHeaderSize, &key_size);
+    Consume(p, header + kRecordHeaderSize, &value_size);
+    if (magic != kRecordMagic || kind != uint32_t(RecordKind::Index) ||
+        index_offset + kRecordHeaderSize + key_size + value_size !=
+            end - kTrailerSize)
+      return false;
+
+    std::string index(value_size, '\0');
+    if (!ReadAt(index_offset + kRecordHeaderSize + key_size, index.size(),
+                &index[0]))
+      return false;
+    std::unordered_map<std::string, Entry> result;
+    uint64_t result_bytes = 0;
+    p = index.data();
+    const char* index_end = index.data() + index.size();
+    uint32_t count;
+    if (!Consume(p, index_end, &count))
+      return false;
+    result.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+      Entry entry;
+      if (!Consume(p, index_end, &key_size) ||
+          size_t(index_end - p) < key_size)
+        return false;
+      std::string key(p, key_size);
+      p += key_size;
+      if (!Consume(p, index_end, &entry.offset) ||
+          !Consume(p, index_end, &entry.size) ||
+          entry.offset + entry.size > index_offset)
+        return false;
+      result_bytes += entry.RecordSize(key);
+      result[std::move(key)] = entry;
+    }
+
+    entries = std::move(result);
+    live_bytes = result_bytes;
+    dirty = false;
+    return true;
+  }
+
+  // Rebuilds |entries| from the record headers. Returns false if the shard
+  // ends with a truncated or corrupted record.
+  bool Scan() {
+    entries.clear();
+    live_bytes = 0;
+    dirty = true;
+    uint64_t offset = 0;
+    while (offset + kRecordHeaderSize <= end) {
+      char header[kRecordHeaderSize];
+      if (!ReadAt(offset, kRecordHeaderSize, header))
+        return false;
+      const char* p = header;
+      uint32_t magic, kind, key_size;
+      uint64_t value_size;
+      Consume(p, header + kRecordHeaderSize, &magic);
+      Consume(p, header + kRecordHeaderSize, &kind);
+      Consume(p, header + kRecordHeaderSize, &key_size);
+      Consume(p, header + kRecordHeaderSize, &value_size);
+      if (magic != kRecordMagic)
+        return false;
+      uint64_t record_end = offset + kRecordHeaderSize + key_size + value_size;
+      if (record_end > end)
+        return false;
+
+      if (kind == uint32_t(RecordKind::Entry)) {
+        std::string key(key_size, '\0');
+        if (key_size &&
+            !ReadAt(offset + kRecordHeaderSize, key_size, &key[0]))
+          return false;
+        Entry entry{offset + kRecordHeaderSize + key_size, value_size};
+        auto it = entries.find(key);
+        if (it != entries.end())
+          live_bytes -= it->second.RecordSize(key);
+        live_bytes += entry.RecordSize(key);
+        entries[std::move(key)] = entry;
+      }
+
+      offset = record_end;
+      // Skip the trailer of an index record.
+      if (kind == uint32_t(RecordKind::Index) && offset + kTrailerSize <= end)
+        offset += kTrailerSize;
+    }
+    return offset == end;
+  }
+
+  optional<std::string> Read(const std::string& key) {
+    auto it = entries.find(key);
+    if (it == entries.end() || !file)
+      return nullopt;
+    std::string value(it->second.size, '\0');
+    if (!value.empty() && !ReadAt(it->second.offset, value.size(), &value[0]))
+      return nullopt;
+    return value;
+  }
+
+  void Write(const std::string& key, const std::string& value) {
+    if (!file)
+      return;
+    // Writes always go to the end of the file, but switching from reading to
+    // writing requires a seek.
+    Seek(file, end);
+    size_t written = WriteRecord(file, RecordKind::Entry, key, value);
+    fflush(file);
+    if (!written) {
+      LOG_S(ERROR) << "Cannot write to cache shard " << path;
+      return;
+    }
+    auto it = entries.find(key);
+    if (it != entries.end())
+      live_bytes -= it->second.RecordSize(key);
+    Entry entry{end + kRecordHeaderSize + key.size(), value.size()};
+    entries[key] = entry;
+    live_bytes += entry.RecordSize(key);
+    end += written;
+    dirty = true;
+
+    uint64_t dead_bytes = end - live_bytes;
+    if (dead_bytes > kMinCompactBytes && dead_bytes > live_bytes)
+      Compact();
+  }
+
+  // Appends an index record and trailer to |out|, which is |out_end| bytes
+  // long. Returns the number of bytes written, or 0 on failure.
+  size_t WriteIndexTo(FILE* out,
+                      uint64_t out_end,
+                      const std::unordered_map<std::string, Entry>& index) {
+    std::string value;
+    Append(&value, uint32_t(index.size()));
+    for (auto& entry : index) {
+      Append(&value, uint32_t(entry.first.size()));
+      value += entry.first;
+      Append(&value, entry.second.offset);
+      Append(&value, entry.second.size);
+    }
+    size_t written = WriteRecord(out, RecordKind::Index, "", value);
+    if (!written)
+      return 0;
+    std::string trailer;
+    Append(&trailer, out_end);
+    Append(&trailer, kTrailerMagic);
+    if (fwrite(trailer.data(), 1, trailer.size(), out) != trailer.size())
+      return 0;
+    return written + trailer.size();
+  }
+
+  void WriteIndex() {
+    if (!dirty || !file)
+      return;
+    Seek(file, end);
+    size_t written = WriteIndexTo(file, end, entries);
+    fflush(file);
+    end += written;
+    dirty = !written;
+  }
+
+  // Copies the live records to a new file which then replaces the shard.
+  void Compact() {
+    std::string tmp_path = path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (!out) {
+      LOG_S(ERROR) << "Cannot compact cache shard " << path;
+      return;
+    }
+    std::unordered_map<std::string, Entry> compacted;
+    uint64_t out_end = 0;
+    bool ok = true;
+    for (auto& entry : entries) {
+      optional<std::string> value = Read(entry.first);
+      if (!value)
+        continue;
+      size_t written = WriteRecord(out, RecordKind::Entry, entry.first, *value);
+      if (!written) {
+        ok = false;
+        break;
+      }
+      compacted[entry.first] = Entry{
+          out_end + kRecordHeaderSize + entry.first.size(), value->size()};
+      out_end += written;
+    }
+    uint64_t compacted_bytes = out_end;
+    size_t index_size = ok ? WriteIndexTo(out, out_end, compacted) : 0;
+    ok = fclose(out) == 0 && ok && index_size;
+    if (!ok) {
+      LOG_S(ERROR) << "Cannot compact cache shard " << path;
+      remove(tmp_path.c_str());
+      return;
+    }
+
+    LOG_S(INFO) << "Compacted cache shard " << path << " from " << end
+                << " to " << out_end + index_size << " bytes";
+    fclose(file);
+    remove(path.c_str());
+    rename(tmp_path.c_str(), path.c_str());
+    file = fopen(path.c_str(), "a+b");
+    if (!file) {
+      LOG_S(ERROR) << "Cannot open cache shard " << path;
+      entries.clear();
+      return;
+    }
+    entries = std::move(compacted);
+    live_bytes = compacted_bytes;
+    end = out_end + index_size;
+    dirty = false;
+  }
+};
+
+// static
+std::shared_ptr<PackedCacheStore> PackedCacheStore::Get(
+    const std::string& directory,
+    int num_shards) {
+  static bool registered_close = (atexit(&PackedCacheStore::CloseAll), true);
+  (void)registered_close;
+
+  StoreRegistry* registry = GetStoreRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  std::shared_ptr<PackedCacheStore>& store = registry->stores[directory];
+  if (!store)
+    store.reset(new PackedCacheStore(directory, num_shards));
+  return store;
+}
+
+// static
+void PackedCacheStore::CloseAll() {
+  StoreRegistry* registry = GetStoreRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  for (auto& entry : registry->stores)
+    entry.second->Close();
+}
+
+PackedCacheStore::PackedCacheStore(const std::string& directory,
+                                   int num_shards) {
+  MakeDirectoryRecursive(directory);
+  for (int i = 0; i < num_shards; i++) {
+    shards_.push_back(MakeUnique<Shard>(directory + "/shard" +
+                                        std::to_string(i) + ".pack"));
+  }
+}
+
+PackedCacheStore::~PackedCacheStore() = default;
+
+optional<std::string> PackedCacheStore::Read(const std::string& key) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  return shard.Read(key);
+}
+
+void PackedCacheStore::Write(const std::string& key,
+                             const std::string& value) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.Write(key, value);
+}
+
+bool PackedCacheStore::Exists(const std::string& key) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  return shard.file && shard.entries.count(key);
+}
+
+void PackedCacheStore::Compact() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    if (shard->file)
+      shard->Compact();
+  }
+}
+
+void PackedCacheStore::Close() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->Close();
+  }
+}
+
+PackedCacheStore::Shard& PackedCacheStore::GetShard(const std::string& key) {
+  return *shards_[HashStorageKey(key) % shards_.size()];
+}
+
+TEST_SUITE("PackedCacheStore") {
+  TEST_CASE("read write reopen") {
+    std::string directory =
+        GetTemporaryDirectory() + "cquery_packed_cache_store_test";
+    for (int i = 0; i < 2; i++)
+      remove((directory + "/shard" + std::to_string(i) + ".pack").c_str());
+
+    {
+      PackedCacheStore store(directory, 2);
+      REQUIRE(!store.Exists("a"));
+      store.Write("a", "1");
+      store.Write("b", "22");
+      store.Write("a", "333");
+      REQUIRE(*store.Read("a") == "333");
+      REQUIRE(*store.Read("b") == "22");
+      REQUIRE(!store.Read("c"));
+    }
+    // Reopen from the index written on close.
+    {
+      PackedCacheStore store(directory, 2);
+      REQUIRE(*store.Read("a") == "333");
+      REQUIRE(*store.Read("b") == "22");
+      store.Write("c", "");
+      store.Compact();
+      REQUIRE(*store.Read("a") == "333");
+      REQUIRE(*store.Read("c") == "");
+    }
+    {
+      PackedCacheStore store(directory, 2);
+      REQUIRE(*store.Read("a") == "333");
+      REQUIRE(*store.Read("c") == "");
+    }
+
+    for (int i = 0; i < 2; i++)
+      remove((directory + "/shard" + std::to_string(i) + ".pack").c_str());
+    remove(directory.c_str());
+  }
+}
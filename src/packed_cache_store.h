@@ -0,0 +1,57 @@
+#pragma once
+
+#include <optional.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Key/value store for cache entries backed by a small number of append-only
+// shard files. Loading a large project's cache then needs a few large files
+// instead of one (or two) small files per indexed file.
+//
+// Each shard is a sequence of records:
+//   uint32_t magic, uint32_t kind, uint32_t key size, uint64_t value size,
+//   key, value.
+// Writing a key appends a new record; the record it replaces becomes dead
+// space which is reclaimed by compaction once it outweighs the live records.
+//
+// When a shard is closed or compacted an index record listing every live
+// entry is appended, followed by a trailer (uint64_t index offset, uint32_t
+// magic), so that the next open only reads the index. If a shard does not end
+// with a trailer (more records were appended, or cquery crashed) the record
+// headers are scanned instead.
+//
+// Only one process may use a store directory at a time.
+class PackedCacheStore {
+ public:
+  // Returns the store in |directory| using |num_shards| shard files. Stores are
+  // shared by every cache manager of the process and live until exit.
+  static std::shared_ptr<PackedCacheStore> Get(const std::string& directory,
+                                               int num_shards);
+  // Closes every store returned by Get(), see Close(). Runs on exit; call it
+  // earlier once the cache writers stopped so the indexes are written first.
+  static void CloseAll();
+
+  // Opens (or creates) the store in |directory|. Use Get() instead, a
+  // directory must not be opened twice.
+  PackedCacheStore(const std::string& directory, int num_shards);
+  ~PackedCacheStore();
+
+  optional<std::string> Read(const std::string& key);
+  void Write(const std::string& key, const std::string& value);
+  bool Exists(const std::string& key);
+
+  // Rewrites every shard so that it only contains live records.
+  void Compact();
+  // Writes the index of every shard and closes the shard files. Later reads
+  // find nothing and later writes are dropped.
+  void Close();
+
+ private:
+  struct Shard;
+
+  Shard& GetShard(const std::string& key);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
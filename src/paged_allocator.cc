@@ -0,0 +1,130 @@
+#include "paged_allocator.h"
+
+#include "platform.h"
+
+#include <loguru.hpp>
+
+#include <map>
+#include <mutex>
+#include <new>
+
+namespace {
+
+// Blocks are carved out of chunks of this size. Larger blocks get a chunk of
+// their own.
+const size_t kChunkBytes = 64 << 20;
+// Blocks are powers of two from this size on, and freed blocks are reused for
+// blocks of the same size.
+const size_t kMinBlockBytes = 16;
+const int kNumSizeClasses = 64;
+
+struct PagedStore {
+  std::mutex mutex;
+  // Empty until paged storage is enabled.
+  std::string directory;
+  // Start and end of every mapped chunk, to tell paged blocks from heap
+  // blocks which were allocated before paged storage was enabled, or when
+  // mapping failed.
+  std::map<char*, char*> chunks;
+  // Unused part of the most recent chunk.
+  char* next = nullptr;
+  char* end = nullptr;
+  std::vector<void*> free_blocks[kNumSizeClasses];
+};
+
+PagedStore& GetPagedStore() {
+  // Never destroyed, as containers may be freed after static destructors ran.
+  static PagedStore* store = new PagedStore();
+  return *store;
+}
+
+int GetSizeClass(size_t bytes) {
+  int size_class = 0;
+  while ((kMinBlockBytes << size_class) < bytes)
+    size_class++;
+  return size_class;
+}
+
+bool IsPaged(PagedStore& store, void* p) {
+  char* c = static_cast<char*>(p);
+  auto it = store.chunks.upper_bound(c);
+  if (it == store.chunks.begin())
+    return false;
+  --it;
+  return c < it->second;
+}
+
+char* MapChunk(PagedStore& store, size_t bytes) {
+  char* chunk = static_cast<char*>(MapTemporaryFile(store.directory, bytes));
+  if (chunk)
+    store.chunks[chunk] = chunk + bytes;
+  return chunk;
+}
+
+}  // namespace
+
+bool EnablePagedStorage(const std::string& directory) {
+  PagedStore& store = GetPagedStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+  store.directory = directory;
+  // Check that files can be mapped at all.
+  char* chunk = MapChunk(store, kChunkBytes);
+  if (!chunk) {
+    store.directory.clear();
+    return false;
+  }
+  store.next = chunk;
+  store.end = chunk + kChunkBytes;
+  return true;
+}
+
+void* PagedAllocate(size_t bytes) {
+  PagedStore& store = GetPagedStore();
+  {
+    std::lock_guard<std::mutex> lock(store.mutex);
+    if (!store.directory.empty()) {
+      int size_class = GetSizeClass(bytes);
+      std::vector<void*>& free_blocks = store.free_blocks[size_class];
+      if (!free_blocks.empty()) {
+        void* result = free_blocks.back();
+        free_blocks.pop_back();
+        return result;
+      }
+
+      size_t size = kMinBlockBytes << size_class;
+      char* result = nullptr;
+      if (size > kChunkBytes / 4) {
+        result = MapChunk(store, size);
+      } else {
+        // The rest of the previous chunk is given up.
+        if (size_t(store.end - store.next) < size) {
+          char* chunk = MapChunk(store, kChunkBytes);
+          if (chunk) {
+            store.next = chunk;
+            store.end = chunk + kChunkBytes;
+          }
+        }
+        if (size_t(store.end - store.next) >= size) {
+          result = store.next;
+          store.next += size;
+        }
+      }
+      if (result)
+        return result;
+      LOG_S(WARNING) << "Unable to map paged storage in " << store.directory;
+    }
+  }
+  return ::operator new(bytes);
+}
+
+void PagedDeallocate(void* p, size_t bytes) {
+  PagedStore& store = GetPagedStore();
+  {
+    std::lock_guard<std::mutex> lock(store.mutex);
+    if (IsPaged(store, p)) {
+      store.free_blocks[GetSizeClass(bytes)].push_back(p);
+      return;
+    }
+  }
+  ::operator delete(p);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Memory for the reference lists of querydb, which make up most of it. Once
+// paged storage is enabled, the memory is mapped from files which are deleted
+// right away, so the kernel can write cold parts of the database out and
+// fault them back in when a query reads them, instead of keeping everything
+// resident. See Config::querydbPagedStorageDirectory.
+
+// Backs paged allocations by files in |directory| from now on. Memory
+// allocated before stays on the heap. Returns false if the platform does not
+// support it.
+bool EnablePagedStorage(const std::string& directory);
+
+void* PagedAllocate(size_t bytes);
+void PagedDeallocate(void* p, size_t bytes);
+
+template <typename T>
+struct PagedAllocator {
+  using value_type = T;
+
+  PagedAllocator() = default;
+  template <typename U>
+  PagedAllocator(const PagedAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(PagedAllocate(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) { PagedDeallocate(p, n * sizeof(T)); }
+};
+template <typename T, typename U>
+bool operator==(const PagedAllocator<T>&, const PagedAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const PagedAllocator<T>&, const PagedAllocator<U>&) {
+  return false;
+}
+
+template <typename T>
+using PagedVector = std::vector<T, PagedAllocator<T>>;
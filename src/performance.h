@@ -4,6 +4,18 @@
 
 #include <cstdint>
 
+// Cost of one optional feature of the indexer, see Config::Index::profile.
+struct IndexFeatureCost {
+  // Microseconds spent on the feature, which are part of index_build. The
+  // features of an entity nested in another one, ie, the comments of a local
+  // variable, are counted in both.
+  uint64_t time = 0;
+  // Declarations and references the feature added to the index, or bytes of
+  // comment text for comments. 0 if the profile turned the feature off.
+  uint64_t size = 0;
+};
+MAKE_REFLECT_STRUCT(IndexFeatureCost, time, size);
+
 // Contains timing information for the entire pipeline for importing a file
 // into the querydb.
 struct PerformanceImportFile {
@@ -11,11 +23,20 @@ struct PerformanceImportFile {
 
   // [indexer] clang parsing the file
   uint64_t index_parse = 0;
+  // [indexer] estimated parse time saved by reusing a precompiled preamble
+  uint64_t index_preamble_saved = 0;
   // [indexer] build the IndexFile object from clang parse
   uint64_t index_build = 0;
-  // [querydb] create IdMap object from IndexFile
+  // [indexer] share of index_build spent on each optional feature
+  IndexFeatureCost index_macros;
+  IndexFeatureCost index_comments;
+  IndexFeatureCost index_locals;
+  IndexFeatureCost index_implicit_calls;
+  IndexFeatureCost index_template_usages;
+  IndexFeatureCost index_initializer_usages;
+  // [indexer] create IdMap object from IndexFile
   uint64_t querydb_id_map = 0;
-  // [indexer] save the IndexFile to disk
+  // [cache writer] save the IndexFile to disk
   uint64_t index_save_to_disk = 0;
   // [indexer] loading previously cached index
   uint64_t index_load_cached = 0;
@@ -28,7 +49,14 @@ struct PerformanceImportFile {
 };
 MAKE_REFLECT_STRUCT(PerformanceImportFile,
                     index_parse,
+                    index_preamble_saved,
                     index_build,
+                    index_macros,
+                    index_comments,
+                    index_locals,
+                    index_implicit_calls,
+                    index_template_usages,
+                    index_initializer_usages,
                     querydb_id_map,
                     index_save_to_disk,
                     index_load_cached,
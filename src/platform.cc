@@ -51,6 +51,12 @@ PlatformScopedMutexLock::~PlatformScopedMutexLock() = default;
 
 PlatformSharedMemory::~PlatformSharedMemory() = default;
 
+PlatformProcess::~PlatformProcess() = default;
+
+PlatformConnection::~PlatformConnection() = default;
+
+PlatformListener::~PlatformListener() = default;
+
 void MakeDirectoryRecursive(std::string path) {
   path = NormalizePath(path);
 
@@ -2,6 +2,9 @@
 
 #include <optional.h>
 
+#include <stdio.h>
+
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -18,11 +21,46 @@ struct PlatformSharedMemory {
   size_t capacity;
   std::string name;
 };
+// Child process whose stdin and stdout are connected to the parent.
+struct PlatformProcess {
+  // Closes the connection and waits for the process to exit.
+  virtual ~PlatformProcess();
+  // Writes or reads exactly |size| bytes. Returns false if the process exited
+  // or closed its end of the connection.
+  virtual bool Write(const void* data, size_t size) = 0;
+  virtual bool Read(void* data, size_t size) = 0;
+  // Makes a Read which waits longer than |timeout_ms| for data fail. 0 waits
+  // forever, which is the default.
+  virtual void SetReadTimeout(int timeout_ms) = 0;
+};
+
+// Stream connection to another process over a local socket.
+struct PlatformConnection {
+  // Closes the connection.
+  virtual ~PlatformConnection();
+  // Writes exactly |size| bytes. Returns false if the peer closed the
+  // connection.
+  virtual bool Write(const void* data, size_t size) = 0;
+  // Returns a stream which reads from the connection. Owned by the connection.
+  virtual FILE* GetReadStream() = 0;
+  // Makes pending and later reads and writes fail, ie, to stop a thread which
+  // is blocked reading from the connection.
+  virtual void Shutdown() = 0;
+};
+// Local socket which other processes connect to.
+struct PlatformListener {
+  // Stops listening and removes the socket.
+  virtual ~PlatformListener();
+  // Waits for the next connection. Returns nullptr if listening failed.
+  virtual std::unique_ptr<PlatformConnection> Accept() = 0;
+};
 
 void PlatformInit();
 
 std::string GetExecutablePath();
 std::string GetWorkingDirectory();
+// Returns the absolute directory for temporary files, ending in a slash.
+std::string GetTemporaryDirectory();
 std::string NormalizePath(const std::string& path);
 // Creates a directory at |path|. Creates directories recursively if needed.
 void MakeDirectoryRecursive(std::string path);
@@ -31,15 +69,111 @@ void MakeDirectoryRecursive(std::string path);
 // does not attempt to recursively create directories.
 bool TryMakeDirectory(const std::string& absolute_path);
 
+// Starts the executable |args[0]| with the arguments |args|. stderr is
+// inherited. Returns nullptr if the process cannot be started or the platform
+// does not support it.
+std::unique_ptr<PlatformProcess> StartProcess(
+    const std::vector<std::string>& args);
+
+// Starts |args| like StartProcess, but in a new session which outlives this
+// process and its terminal. stdin, stdout and stderr are /dev/null.
+bool StartDetachedProcess(const std::vector<std::string>& args);
+
+// Returns a directory which only the current user can access, ending in a
+// slash, to create local sockets in. Returns "" if the platform does not
+// support local sockets.
+std::string GetLocalSocketDirectory();
+// Listens on the local socket |path|. Returns nullptr if another process is
+// listening on it or if the socket cannot be created.
+std::unique_ptr<PlatformListener> ListenOnLocalSocket(const std::string& path);
+// Returns nullptr if nobody is listening on |path|.
+std::unique_ptr<PlatformConnection> ConnectToLocalSocket(
+    const std::string& path);
+// Replaces stdin and stdout of this process, so that what is written to
+// |*stdin_writer| is read from stdin, and what is written to stdout is read
+// from |*stdout_reader|.
+bool RedirectStandardStreams(
+    std::unique_ptr<PlatformConnection>* stdin_writer,
+    std::unique_ptr<PlatformConnection>* stdout_reader);
+
+// Maps |size| bytes of a new file in |directory|, which is deleted right away
+// so that only the mapping keeps it alive. The mapping is never unmapped.
+// Returns nullptr on failure or if the platform does not support it.
+void* MapTemporaryFile(const std::string& directory, size_t size);
+
 void SetCurrentThreadName(const std::string& thread_name);
+// Lowers the CPU and, where supported, IO priority of the calling thread so
+// that it yields to interactive work.
+void SetCurrentThreadLowPriority();
+
+// Returns the CPUs of each NUMA node which this process may run on, ordered by
+// node. A machine which does not report its nodes has one node with every CPU.
+// Returns nothing if the platform does not support placing threads.
+std::vector<std::vector<int>> GetNumaNodeCpus();
+// Restricts the calling thread to |cpus|, and makes it allocate memory on the
+// NUMA node it runs on. Returns false if that failed or is not supported.
+bool SetCurrentThreadCpus(const std::vector<int>& cpus);
+
+// Returns the one minute load average of the system, or nullopt if the
+// platform does not report it.
+optional<double> GetSystemLoadAverage();
+// Returns true if the machine is known to be running on battery.
+bool IsOnBatteryPower();
+// Returns the share of the last ten seconds, in percent, in which some task
+// of the cgroup of this process stalled waiting for memory, or nullopt if the
+// platform does not report it.
+optional<double> GetMemoryStallPercent();
 
 optional<int64_t> GetLastModificationTime(const std::string& absolute_path);
+struct FileInfo {
+  int64_t size = 0;
+  int64_t last_access_time = 0;
+  int64_t last_modification_time = 0;
+};
+// Returns the size and times of |absolute_path|, in seconds since the epoch
+// like GetLastModificationTime, or nullopt if it does not exist.
+optional<FileInfo> GetFileInfo(const std::string& absolute_path);
+// Asks the OS to start reading |absolute_path| into the page cache in the
+// background, so that reading it later does not block on the disk. Does
+// nothing if the file does not exist or the platform does not support it.
+void PrefetchFile(const std::string& absolute_path);
 
 void MoveFileTo(const std::string& destination, const std::string& source);
 void CopyFileTo(const std::string& destination, const std::string& source);
 
 bool IsSymLink(const std::string& path);
 
+// Returns the id of the current process.
+int GetCurrentPid();
+// Returns true if a process with id |pid| is running. Ids are reused, so this
+// may be another process than the one which had the id before.
+bool IsProcessRunning(int pid);
+
+struct DirectoryEntry {
+  std::string name;
+  bool is_dir = false;
+};
+// Lists the entries of |directory| other than "." and "..", using the entry
+// types reported by the directory listing where possible instead of calling
+// stat on every entry. Symbolic links to directories are not reported since
+// they are never followed. Returns false if |directory| cannot be read.
+bool ListDirectory(const std::string& directory,
+                   std::vector<DirectoryEntry>* entries);
+
+enum class FileChangeType { Created, Changed, Deleted };
+struct FileChange {
+  std::string path;
+  FileChangeType type;
+};
+// Watches |directories| and their subdirectories, and calls |on_changes| with
+// the files which changed once no change happened for |debounce_ms|
+// milliseconds. Blocks until watching fails. Returns false right away if the
+// platform has no native file watcher.
+bool WatchDirectories(
+    const std::vector<std::string>& directories,
+    int debounce_ms,
+    const std::function<void(std::vector<FileChange>)>& on_changes);
+
 // Returns any clang arguments that are specific to the current platform.
 std::vector<std::string> GetPlatformClangArguments();
 
@@ -1,6 +1,8 @@
 #if defined(__unix__) || defined(__APPLE__)
 #include "platform.h"
 
+#include "profiler.h"
+#include "trace.h"
 #include "utils.h"
 
 #include "loguru.hpp"
@@ -26,23 +28,38 @@
 
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>  // required for stat.h
 
 #include <errno.h>
 #include <fcntl.h>
 
 #include <semaphore.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #if defined(__FreeBSD__)
 #include <sys/param.h>   // MAXPATHLEN
 #include <sys/sysctl.h>  // sysctl
 #elif defined(__linux__)
 #include <malloc.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <pthread/qos.h>
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 
 namespace {
 
@@ -109,6 +126,146 @@ optional<std::string> RealPathNotExpandSymlink(std::string path) {
   return resolved;
 }
 
+// Sends |size| bytes over the socket |fd|. Returns false if the peer is gone.
+bool SendAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+#if defined(MSG_NOSIGNAL)
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+#else
+    ssize_t n = send(fd, p, size, 0);
+#endif
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Keeps |fd| from being inherited by child processes, and from raising
+// SIGPIPE where send cannot be told not to.
+void PrepareSocket(int fd) {
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+// Talks to the child over one end of a socket pair, since unlike pipes sockets
+// can be written without raising SIGPIPE once the child is gone.
+struct PosixProcess : PlatformProcess {
+  PosixProcess(pid_t pid, int fd) : pid_(pid), fd_(fd) {}
+  ~PosixProcess() override {
+    close(fd_);
+    // The child is either idle, and exits on its own once it reads EOF, or
+    // busy with work nobody waits for anymore.
+    kill(pid_, SIGKILL);
+    while (waitpid(pid_, nullptr, 0) == -1 && errno == EINTR) {
+    }
+  }
+
+  bool Write(const void* data, size_t size) override {
+    return SendAll(fd_, data, size);
+  }
+
+  bool Read(void* data, size_t size) override {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+      // Fails with EAGAIN once the timeout of SetReadTimeout passes.
+      ssize_t n = read(fd_, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  void SetReadTimeout(int timeout_ms) override {
+    timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+
+  pid_t pid_;
+  int fd_;
+};
+
+// Connection over a stream socket. Reads go through a stdio stream on a
+// duplicate of the socket, so that closing the stream does not close |fd_|.
+struct PosixConnection : PlatformConnection {
+  PosixConnection(int fd, FILE* read_stream)
+      : fd_(fd), read_stream_(read_stream) {}
+  ~PosixConnection() override {
+    fclose(read_stream_);
+    close(fd_);
+  }
+
+  bool Write(const void* data, size_t size) override {
+    return SendAll(fd_, data, size);
+  }
+  FILE* GetReadStream() override { return read_stream_; }
+  void Shutdown() override { shutdown(fd_, SHUT_RDWR); }
+
+  int fd_;
+  FILE* read_stream_;
+};
+
+// Takes ownership of the socket |fd|.
+std::unique_ptr<PlatformConnection> MakeConnection(int fd) {
+  PrepareSocket(fd);
+  int read_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  FILE* read_stream = read_fd == -1 ? nullptr : fdopen(read_fd, "rb");
+  if (!read_stream) {
+    if (read_fd != -1)
+      close(read_fd);
+    close(fd);
+    return nullptr;
+  }
+  return MakeUnique<PosixConnection>(fd, read_stream);
+}
+
+struct PosixListener : PlatformListener {
+  PosixListener(int fd, int lock_fd, const std::string& path)
+      : fd_(fd), lock_fd_(lock_fd), path_(path) {}
+  ~PosixListener() override {
+    close(fd_);
+    // Remove the socket while still holding the lock, so that it does not
+    // remove the socket of a newer listener.
+    unlink(path_.c_str());
+    close(lock_fd_);
+  }
+
+  std::unique_ptr<PlatformConnection> Accept() override {
+    int fd;
+    while ((fd = accept(fd_, nullptr, nullptr)) == -1 && errno == EINTR) {
+    }
+    if (fd == -1)
+      return nullptr;
+    return MakeConnection(fd);
+  }
+
+  int fd_;
+  int lock_fd_;
+  std::string path_;
+};
+
+bool MakeSocketAddress(const std::string& path, sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  if (path.size() >= sizeof(address->sun_path))
+    return false;
+  address->sun_family = AF_UNIX;
+  memcpy(address->sun_path, path.c_str(), path.size());
+  return true;
+}
+
 }  // namespace
 
 void PlatformInit() {}
@@ -159,6 +316,13 @@ std::string GetWorkingDirectory() {
   return working_dir;
 }
 
+std::string GetTemporaryDirectory() {
+  const char* tmp_dir = getenv("TMPDIR");
+  std::string result = tmp_dir && *tmp_dir ? tmp_dir : "/tmp";
+  EnsureEndsInSlash(result);
+  return result;
+}
+
 std::string NormalizePath(const std::string& path) {
   optional<std::string> resolved = RealPathNotExpandSymlink(path);
   return resolved ? *resolved : path;
@@ -173,8 +337,190 @@ bool TryMakeDirectory(const std::string& absolute_path) {
   return true;
 }
 
+std::unique_ptr<PlatformProcess> StartProcess(
+    const std::vector<std::string>& args) {
+  if (args.empty())
+    return nullptr;
+  // Only async-signal-safe functions may be called in the child of a
+  // multithreaded process, so build argv before forking.
+  std::vector<char*> argv;
+  for (const std::string& arg : args)
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return nullptr;
+  // Keep other children started concurrently from inheriting the sockets,
+  // which would hide the exit of this one.
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+  int on = 1;
+  setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // dup2 clears FD_CLOEXEC on the new descriptors.
+    if (dup2(fds[1], STDIN_FILENO) == -1 ||
+        dup2(fds[1], STDOUT_FILENO) == -1) {
+      _exit(127);
+    }
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  close(fds[1]);
+  if (pid == -1) {
+    close(fds[0]);
+    return nullptr;
+  }
+  return MakeUnique<PosixProcess>(pid, fds[0]);
+}
+
+bool StartDetachedProcess(const std::vector<std::string>& args) {
+  if (args.empty())
+    return false;
+  std::vector<char*> argv;
+  for (const std::string& arg : args)
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Fork again so that init adopts the process, which then never becomes a
+    // zombie of this one.
+    setsid();
+    if (fork() != 0)
+      _exit(0);
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd == -1 || dup2(null_fd, STDIN_FILENO) == -1 ||
+        dup2(null_fd, STDOUT_FILENO) == -1 ||
+        dup2(null_fd, STDERR_FILENO) == -1) {
+      _exit(127);
+    }
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  if (pid == -1)
+    return false;
+  while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+  }
+  return true;
+}
+
+std::string GetLocalSocketDirectory() {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && *runtime_dir) {
+    std::string result = runtime_dir;
+    EnsureEndsInSlash(result);
+    return result;
+  }
+
+  // The temporary directory is shared, so use a private subdirectory.
+  std::string result =
+      GetTemporaryDirectory() + "cquery-" + std::to_string(getuid());
+  struct stat info;
+  if ((mkdir(result.c_str(), 0700) != 0 && errno != EEXIST) ||
+      lstat(result.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+      info.st_uid != getuid() || (info.st_mode & 077) != 0) {
+    return "";
+  }
+  return result + '/';
+}
+
+std::unique_ptr<PlatformListener> ListenOnLocalSocket(const std::string& path) {
+  sockaddr_un address;
+  if (!MakeSocketAddress(path, &address))
+    return nullptr;
+  // The lock is held for as long as the listener lives, so a socket without
+  // it is stale and can be replaced.
+  int lock_fd =
+      open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1)
+    return nullptr;
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(lock_fd);
+    return nullptr;
+  }
+
+  unlink(path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 ||
+      bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(fd, 16) != 0) {
+    if (fd != -1)
+      close(fd);
+    close(lock_fd);
+    return nullptr;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return MakeUnique<PosixListener>(fd, lock_fd, path);
+}
+
+std::unique_ptr<PlatformConnection> ConnectToLocalSocket(
+    const std::string& path) {
+  sockaddr_un address;
+  if (!MakeSocketAddress(path, &address))
+    return nullptr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return nullptr;
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+      0) {
+    close(fd);
+    return nullptr;
+  }
+  return MakeConnection(fd);
+}
+
+bool RedirectStandardStreams(
+    std::unique_ptr<PlatformConnection>* stdin_writer,
+    std::unique_ptr<PlatformConnection>* stdout_reader) {
+  int in_fds[2], out_fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, in_fds) != 0)
+    return false;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, out_fds) != 0) {
+    close(in_fds[0]);
+    close(in_fds[1]);
+    return false;
+  }
+  fflush(stdout);
+  bool ok = dup2(in_fds[1], STDIN_FILENO) != -1 &&
+            dup2(out_fds[1], STDOUT_FILENO) != -1;
+  close(in_fds[1]);
+  close(out_fds[1]);
+  if (!ok) {
+    close(in_fds[0]);
+    close(out_fds[0]);
+    return false;
+  }
+  *stdin_writer = MakeConnection(in_fds[0]);
+  *stdout_reader = MakeConnection(out_fds[0]);
+  return *stdin_writer && *stdout_reader;
+}
+
+void* MapTemporaryFile(const std::string& directory, size_t size) {
+  std::string path = directory + "cquery_paged_XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd == -1)
+    return nullptr;
+  unlink(path.c_str());
+  void* result = nullptr;
+  // The file is sparse, so disk space is only used for pages written out.
+  if (ftruncate(fd, size) == 0) {
+    result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (result == MAP_FAILED)
+      result = nullptr;
+  }
+  close(fd);
+  return result;
+}
+
 void SetCurrentThreadName(const std::string& thread_name) {
   loguru::set_thread_name(thread_name.c_str());
+  SetTraceThreadName(thread_name);
+  SetProfilerThreadName(thread_name);
 #if defined(__APPLE__)
   pthread_setname_np(thread_name.c_str());
 #elif defined(__FreeBSD__) || defined(__OpenBSD__)
@@ -184,6 +530,179 @@ void SetCurrentThreadName(const std::string& thread_name) {
 #endif
 }
 
+void SetCurrentThreadLowPriority() {
+#if defined(__linux__)
+  // Linux gives every thread its own nice value and IO priority.
+  pid_t tid = pid_t(syscall(SYS_gettid));
+  if (setpriority(PRIO_PROCESS, tid, 10) != 0)
+    LOG_S(WARNING) << "Failed to lower thread priority: " << strerror(errno);
+#if defined(SYS_ioprio_set)
+  // IOPRIO_CLASS_BE with the lowest priority, 7.
+  const int kIoprioWhoProcess = 1;
+  const int kIoprioLowestBestEffort = (2 << 13) | 7;
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, kIoprioLowestBestEffort);
+#endif
+#elif defined(__APPLE__)
+  pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+  setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+#endif
+}
+
+#if defined(__linux__)
+namespace {
+
+// Parses a list of CPUs in the format of sysfs, ie, "0-3,8,10-11".
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  const char* p = list.c_str();
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back(int(cpu));
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cpus;
+}
+
+}  // namespace
+#endif
+
+std::vector<std::vector<int>> GetNumaNodeCpus() {
+  std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+  // Only the CPUs this process may run on, ie, within taskset or a cpuset.
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return nodes;
+
+  // Node numbers may have gaps.
+  const std::string kNodes = "/sys/devices/system/node/";
+  std::vector<DirectoryEntry> entries;
+  std::vector<int> node_numbers;
+  if (ListDirectory(kNodes, &entries)) {
+    for (const DirectoryEntry& entry : entries) {
+      if (StartsWith(entry.name, "node") && entry.name.size() > 4 &&
+          entry.name[4] >= '0' && entry.name[4] <= '9') {
+        node_numbers.push_back(atoi(entry.name.c_str() + 4));
+      }
+    }
+  }
+  std::sort(node_numbers.begin(), node_numbers.end());
+  for (int node : node_numbers) {
+    optional<std::string> list =
+        ReadContent(kNodes + "node" + std::to_string(node) + "/cpulist");
+    if (!list)
+      continue;
+    std::vector<int> cpus;
+    for (int cpu : ParseCpuList(*list)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+    if (!cpus.empty())
+      nodes.push_back(std::move(cpus));
+  }
+
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed))
+        nodes.back().push_back(cpu);
+    }
+  }
+#endif
+  return nodes;
+}
+
+bool SetCurrentThreadCpus(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  }
+  // On Linux, pid 0 is the calling thread rather than the whole process.
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    LOG_S(WARNING) << "Failed to set thread affinity: " << strerror(errno);
+    return false;
+  }
+#if defined(SYS_set_mempolicy)
+  // MPOL_LOCAL of <numaif.h>, which is not always installed: allocate on the
+  // node the thread runs on, even if the process was started with another
+  // policy, ie, by numactl --interleave.
+  const int kMpolLocal = 4;
+  syscall(SYS_set_mempolicy, kMpolLocal, nullptr, 0);
+#endif
+  return true;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+optional<double> GetSystemLoadAverage() {
+  double load;
+  if (getloadavg(&load, 1) != 1)
+    return nullopt;
+  return load;
+}
+
+bool IsOnBatteryPower() {
+#if defined(__linux__)
+  // The entries are symbolic links to directories, which ListDirectory does
+  // not report.
+  const std::string kPowerSupplies = "/sys/class/power_supply/";
+  DIR* dir = opendir(kPowerSupplies.c_str());
+  if (!dir)
+    return false;
+  bool discharging = false;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.')
+      continue;
+    std::string path = kPowerSupplies + entry->d_name + "/";
+    optional<std::string> type = ReadContent(path + "type");
+    if (!type || !StartsWith(*type, "Battery"))
+      continue;
+    optional<std::string> status = ReadContent(path + "status");
+    if (status && StartsWith(*status, "Discharging")) {
+      discharging = true;
+      break;
+    }
+  }
+  closedir(dir);
+  return discharging;
+#else
+  return false;
+#endif
+}
+
+optional<double> GetMemoryStallPercent() {
+#if defined(__linux__)
+  // With cgroup v2, the entry of /proc/self/cgroup is "0::<cgroup path>".
+  // Fall back to the stalls of the whole system.
+  std::vector<std::string> files;
+  optional<std::string> cgroup = ReadContent("/proc/self/cgroup");
+  if (cgroup && StartsWith(*cgroup, "0::")) {
+    std::string path = cgroup->substr(3, cgroup->find('\n') - 3);
+    files.push_back("/sys/fs/cgroup" + path + "/memory.pressure");
+  }
+  files.push_back("/proc/pressure/memory");
+  for (const std::string& file : files) {
+    // The first line is "some avg10=1.23 avg60=... avg300=... total=...".
+    optional<std::string> content = ReadContent(file);
+    if (!content || !StartsWith(*content, "some avg10="))
+      continue;
+    return atof(content->c_str() + strlen("some avg10="));
+  }
+#endif
+  return nullopt;
+}
+
 optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   struct stat buf;
   if (stat(absolute_path.c_str(), &buf) != 0) {
@@ -206,6 +725,35 @@ optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   return buf.st_mtime;
 }
 
+optional<FileInfo> GetFileInfo(const std::string& absolute_path) {
+  struct stat buf;
+  if (stat(absolute_path.c_str(), &buf) != 0)
+    return nullopt;
+  FileInfo info;
+  info.size = buf.st_size;
+  info.last_access_time = buf.st_atime;
+  info.last_modification_time = buf.st_mtime;
+  return info;
+}
+
+void PrefetchFile(const std::string& absolute_path) {
+  int fd = open(absolute_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  struct stat buf;
+  if (fstat(fd, &buf) == 0) {
+    struct radvisory advisory;
+    advisory.ra_offset = 0;
+    advisory.ra_count = int(std::min<off_t>(buf.st_size, INT_MAX));
+    fcntl(fd, F_RDADVISE, &advisory);
+  }
+#endif
+  close(fd);
+}
+
 void MoveFileTo(const std::string& dest, const std::string& source) {
   // TODO/FIXME - do a real move.
   CopyFileTo(dest, source);
@@ -259,6 +807,223 @@ bool IsSymLink(const std::string& path) {
   return lstat(path.c_str(), &buf) == 0 && S_ISLNK(buf.st_mode);
 }
 
+int GetCurrentPid() {
+  return int(getpid());
+}
+
+bool IsProcessRunning(int pid) {
+  // EPERM: the process exists but belongs to another user.
+  return kill(pid_t(pid), 0) == 0 || errno == EPERM;
+}
+
+bool ListDirectory(const std::string& directory,
+                   std::vector<DirectoryEntry>* entries) {
+  DIR* dir = opendir(directory.c_str());
+  if (!dir)
+    return false;
+
+  std::string path = directory;
+  if (path.empty() || path.back() != '/')
+    path += '/';
+  size_t path_size = path.size();
+  while (struct dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    DirectoryEntry result;
+    result.name = entry->d_name;
+    if (entry->d_type == DT_DIR) {
+      result.is_dir = true;
+    } else if (entry->d_type != DT_REG) {
+      // The file system did not report the type, or |entry| is a symbolic
+      // link.
+      path.resize(path_size);
+      path += entry->d_name;
+      struct stat buf;
+      if (lstat(path.c_str(), &buf) != 0)
+        continue;
+      if (S_ISLNK(buf.st_mode)) {
+        if (stat(path.c_str(), &buf) != 0 || S_ISDIR(buf.st_mode))
+          continue;
+      } else {
+        result.is_dir = S_ISDIR(buf.st_mode);
+      }
+    }
+    entries->push_back(std::move(result));
+  }
+  closedir(dir);
+  return true;
+}
+
+#if defined(__linux__)
+namespace {
+
+struct InotifyWatcher {
+  int fd = -1;
+  // Watched directories by watch descriptor. Paths end in a slash.
+  std::unordered_map<int, std::string> directories;
+  bool out_of_watches = false;
+
+  // Watches |root| and its subdirectories. Files found in them are added to
+  // |created| if it is not null.
+  void AddRecursive(const std::string& root, std::vector<FileChange>* created) {
+    std::vector<std::string> pending{root};
+    std::vector<DirectoryEntry> entries;
+    while (!pending.empty()) {
+      std::string directory = std::move(pending.back());
+      pending.pop_back();
+      int wd = inotify_add_watch(
+          fd, directory.c_str(),
+          IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+              IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+      if (wd < 0) {
+        if (errno == ENOSPC && !out_of_watches) {
+          LOG_S(WARNING) << "Unable to watch " << directory
+                         << " and further directories; consider raising "
+                            "fs.inotify.max_user_watches";
+          out_of_watches = true;
+        }
+        continue;
+      }
+      directories[wd] = directory;
+
+      entries.clear();
+      ListDirectory(directory, &entries);
+      for (const DirectoryEntry& entry : entries) {
+        if (!IsIndexedDirectoryEntry(entry.name))
+          continue;
+        if (entry.is_dir)
+          pending.push_back(directory + entry.name + "/");
+        else if (created)
+          created->push_back({directory + entry.name, FileChangeType::Created});
+      }
+    }
+  }
+};
+
+}  // namespace
+#endif
+
+bool WatchDirectories(
+    const std::vector<std::string>& directories,
+    int debounce_ms,
+    const std::function<void(std::vector<FileChange>)>& on_changes) {
+#if defined(__linux__)
+  InotifyWatcher watcher;
+  watcher.fd = inotify_init1(IN_CLOEXEC);
+  if (watcher.fd < 0)
+    return false;
+  for (std::string directory : directories) {
+    EnsureEndsInSlash(directory);
+    watcher.AddRecursive(directory, nullptr);
+  }
+  LOG_S(INFO) << "Watching " << watcher.directories.size() << " directories";
+
+  // Latest change of each path since the last call to |on_changes|.
+  std::unordered_map<std::string, FileChangeType> changes;
+  auto add_change = [&](const std::string& path, FileChangeType type) {
+    auto it = changes.find(path);
+    if (it == changes.end())
+      changes[path] = type;
+    else if (type == FileChangeType::Deleted)
+      it->second = FileChangeType::Deleted;
+    else if (it->second == FileChangeType::Deleted)
+      it->second = FileChangeType::Changed;
+  };
+
+  // Changes are delivered once there are none for |debounce_ms|, but are not
+  // held back longer than |max_delay| by a steady stream of changes.
+  using Clock = std::chrono::steady_clock;
+  const std::chrono::milliseconds debounce(debounce_ms);
+  const std::chrono::milliseconds max_delay(debounce_ms * 10);
+  Clock::time_point first_change, last_change;
+
+  alignas(struct inotify_event) char buffer[64 * 1024];
+  while (true) {
+    int timeout = -1;
+    if (!changes.empty()) {
+      Clock::time_point deadline =
+          std::min(last_change + debounce, first_change + max_delay);
+      timeout = int(std::max<int64_t>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                 deadline - Clock::now())
+                 .count()));
+    }
+    struct pollfd pfd = {watcher.fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      break;
+    if (ready == 0) {
+      std::vector<FileChange> result;
+      for (auto& change : changes)
+        result.push_back({change.first, change.second});
+      changes.clear();
+      on_changes(std::move(result));
+      continue;
+    }
+
+    ssize_t size = read(watcher.fd, buffer, sizeof(buffer));
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size <= 0)
+      break;
+    if (changes.empty())
+      first_change = Clock::now();
+    last_change = Clock::now();
+
+    for (char* p = buffer; p < buffer + size;) {
+      struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+      p += sizeof(struct inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG_S(WARNING) << "File changes were lost, the watch queue overflowed";
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        watcher.directories.erase(event->wd);
+        continue;
+      }
+      auto it = watcher.directories.find(event->wd);
+      if (it == watcher.directories.end() || event->len == 0 ||
+          !IsIndexedDirectoryEntry(event->name))
+        continue;
+      std::string path = it->second + event->name;
+
+      if (event->mask & IN_ISDIR) {
+        // A directory which is moved away keeps its watches, which would
+        // report changes under the old path. Files of new directories may
+        // have been created before the directory is watched.
+        if (event->mask & IN_MOVED_FROM) {
+          std::string prefix = path + "/";
+          for (const auto& directory : watcher.directories) {
+            if (StartsWith(directory.second, prefix))
+              inotify_rm_watch(watcher.fd, directory.first);
+          }
+        } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          std::vector<FileChange> created;
+          watcher.AddRecursive(path + "/", &created);
+          for (const FileChange& change : created)
+            add_change(change.path, change.type);
+        }
+      } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        add_change(path, FileChangeType::Deleted);
+      } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        add_change(path, FileChangeType::Created);
+      } else if (event->mask & IN_CLOSE_WRITE) {
+        add_change(path, FileChangeType::Changed);
+      }
+    }
+  }
+
+  LOG_S(WARNING) << "Stopped watching files: " << strerror(errno);
+  close(watcher.fd);
+  return true;
+#else
+  return false;
+#endif
+}
+
 std::vector<std::string> GetPlatformClangArguments() {
   return {};
 }
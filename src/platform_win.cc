@@ -1,6 +1,8 @@
 #if defined(_WIN32)
 #include "platform.h"
 
+#include "profiler.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <loguru.hpp>
@@ -15,6 +17,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <string>
 
@@ -41,6 +44,14 @@ std::string GetWorkingDirectory() {
   return binary_path.substr(0, binary_path.find_last_of("\\/") + 1);
 }
 
+std::string GetTemporaryDirectory() {
+  char result[MAX_PATH + 1];
+  std::string temp_dir(result, GetTempPath(MAX_PATH + 1, result));
+  std::replace(temp_dir.begin(), temp_dir.end(), '\\', '/');
+  EnsureEndsInSlash(temp_dir);
+  return temp_dir;
+}
+
 std::string NormalizePath(const std::string& path) {
   DWORD retval = 0;
   TCHAR buffer[MAX_PATH] = TEXT("");
@@ -65,6 +76,38 @@ bool TryMakeDirectory(const std::string& absolute_path) {
   return true;
 }
 
+std::unique_ptr<PlatformProcess> StartProcess(
+    const std::vector<std::string>& args) {
+  return nullptr;
+}
+
+bool StartDetachedProcess(const std::vector<std::string>& args) {
+  return false;
+}
+
+std::string GetLocalSocketDirectory() {
+  return "";
+}
+
+std::unique_ptr<PlatformListener> ListenOnLocalSocket(const std::string& path) {
+  return nullptr;
+}
+
+std::unique_ptr<PlatformConnection> ConnectToLocalSocket(
+    const std::string& path) {
+  return nullptr;
+}
+
+bool RedirectStandardStreams(
+    std::unique_ptr<PlatformConnection>* stdin_writer,
+    std::unique_ptr<PlatformConnection>* stdout_reader) {
+  return false;
+}
+
+void* MapTemporaryFile(const std::string& directory, size_t size) {
+  return nullptr;
+}
+
 // See https://msdn.microsoft.com/en-us/library/xcb2z8hs.aspx
 const DWORD MS_VC_EXCEPTION = 0x406D1388;
 #pragma pack(push, 8)
@@ -77,6 +120,8 @@ typedef struct tagTHREADNAME_INFO {
 #pragma pack(pop)
 void SetCurrentThreadName(const std::string& thread_name) {
   loguru::set_thread_name(thread_name.c_str());
+  SetTraceThreadName(thread_name);
+  SetProfilerThreadName(thread_name);
 
   THREADNAME_INFO info;
   info.dwType = 0x1000;
@@ -95,6 +140,32 @@ void SetCurrentThreadName(const std::string& thread_name) {
   }
 }
 
+void SetCurrentThreadLowPriority() {
+  // Lowers both the CPU and the IO priority.
+  SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+}
+
+std::vector<std::vector<int>> GetNumaNodeCpus() {
+  return {};
+}
+
+bool SetCurrentThreadCpus(const std::vector<int>& cpus) {
+  return false;
+}
+
+optional<double> GetSystemLoadAverage() {
+  return nullopt;
+}
+
+bool IsOnBatteryPower() {
+  SYSTEM_POWER_STATUS status;
+  return GetSystemPowerStatus(&status) && status.ACLineStatus == 0;
+}
+
+optional<double> GetMemoryStallPercent() {
+  return nullopt;
+}
+
 optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   struct _stat buf;
   if (_stat(absolute_path.c_str(), &buf) != 0) {
@@ -117,6 +188,19 @@ optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   return buf.st_mtime;
 }
 
+optional<FileInfo> GetFileInfo(const std::string& absolute_path) {
+  struct _stat buf;
+  if (_stat(absolute_path.c_str(), &buf) != 0)
+    return nullopt;
+  FileInfo info;
+  info.size = buf.st_size;
+  info.last_access_time = buf.st_atime;
+  info.last_modification_time = buf.st_mtime;
+  return info;
+}
+
+void PrefetchFile(const std::string& absolute_path) {}
+
 void MoveFileTo(const std::string& destination, const std::string& source) {
   MoveFile(source.c_str(), destination.c_str());
 }
@@ -129,6 +213,52 @@ bool IsSymLink(const std::string& path) {
   return false;
 }
 
+int GetCurrentPid() {
+  return int(GetCurrentProcessId());
+}
+
+bool IsProcessRunning(int pid) {
+  HANDLE process =
+      OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, DWORD(pid));
+  if (!process)
+    return GetLastError() == ERROR_ACCESS_DENIED;
+  DWORD exit_code = 0;
+  bool running =
+      GetExitCodeProcess(process, &exit_code) && exit_code == STILL_ACTIVE;
+  CloseHandle(process);
+  return running;
+}
+
+bool ListDirectory(const std::string& directory,
+                   std::vector<DirectoryEntry>* entries) {
+  std::string pattern = directory;
+  if (pattern.empty() || (pattern.back() != '/' && pattern.back() != '\\'))
+    pattern += '/';
+  pattern += '*';
+
+  WIN32_FIND_DATA data;
+  HANDLE handle = FindFirstFile(pattern.c_str(), &data);
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+  do {
+    if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0)
+      continue;
+    DirectoryEntry entry;
+    entry.name = data.cFileName;
+    entry.is_dir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    entries->push_back(std::move(entry));
+  } while (FindNextFile(handle, &data));
+  FindClose(handle);
+  return true;
+}
+
+bool WatchDirectories(
+    const std::vector<std::string>& directories,
+    int debounce_ms,
+    const std::function<void(std::vector<FileChange>)>& on_changes) {
+  return false;
+}
+
 std::vector<std::string> GetPlatformClangArguments() {
   //
   // Found by executing
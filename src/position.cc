@@ -1,6 +1,12 @@
 #include "position.h"
+#include "serializers/binary.h"
 #include "serializers/msgpack.h"
 
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <stdexcept>
+
 namespace {
 // Skips until the character immediately following |skip_after|.
 const char* SkipAfter(const char* input, char skip_after) {
@@ -9,19 +15,52 @@ const char* SkipAfter(const char* input, char skip_after) {
   ++input;
   return input;
 }
+
+void AppendVarint(std::string* out, int value) {
+  // Zigzag encode so that small negative deltas stay small.
+  uint32_t x = (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+  while (x >= 0x80) {
+    out->push_back(char(x | 0x80));
+    x >>= 7;
+  }
+  out->push_back(char(x));
+}
+
+int ReadVarint(const char*& p, const char* end) {
+  uint32_t x = 0;
+  for (int shift = 0;; shift += 7) {
+    if (p == end || shift > 28)
+      throw std::invalid_argument("varint");
+    uint8_t byte = uint8_t(*p++);
+    x |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return int(x >> 1) ^ -int(x & 1);
+}
 }  // namespace
 
+const int Position::kMaxLine;
+const int Position::kMaxColumn;
+
 Position::Position() : line(-1), column(-1) {}
 
-Position::Position(int16_t line, int16_t column) : line(line), column(column) {}
+Position::Position(int line, int column)
+    : line(std::min(line, kMaxLine)), column(std::min(column, kMaxColumn)) {}
+
+void Position::AddColumn(int delta) {
+  if (!HasValue() || column == kMaxColumn)
+    return;
+  column = std::max(0, std::min(column + delta, kMaxColumn));
+}
 
 Position::Position(const char* encoded) {
   assert(encoded);
-  line = (int16_t)atoi(encoded) - 1;
+  line = std::min(atoi(encoded) - 1, kMaxLine);
 
   encoded = SkipAfter(encoded, ':');
   assert(encoded);
-  column = (int16_t)atoi(encoded) - 1;
+  column = std::min(atoi(encoded) - 1, kMaxColumn);
 }
 
 std::string Position::ToString() {
@@ -79,17 +118,19 @@ Range::Range(Position start, Position end) : start(start), end(end) {}
 
 Range::Range(const char* encoded) {
   char* p = const_cast<char*>(encoded);
-  start.line = int16_t(strtol(p, &p, 10)) - 1;
+  int start_line = int(strtol(p, &p, 10)) - 1;
   assert(*p == ':');
   p++;
-  start.column = int16_t(strtol(p, &p, 10)) - 1;
+  int start_column = int(strtol(p, &p, 10)) - 1;
   assert(*p == '-');
   p++;
 
-  end.line = int16_t(strtol(p, &p, 10)) - 1;
+  int end_line = int(strtol(p, &p, 10)) - 1;
   assert(*p == ':');
   p++;
-  end.column = int16_t(strtol(p, nullptr, 10)) - 1;
+  int end_column = int(strtol(p, nullptr, 10)) - 1;
+  start = Position(start_line, start_column);
+  end = Position(end_line, end_column);
 }
 
 bool Range::Contains(int line, int column) const {
@@ -152,8 +193,10 @@ void Reflect(Reader& visitor, Position& value) {
     std::string s = visitor.GetString();
     value = Position(s.c_str());
   } else {
-    Reflect(visitor, value.line);
-    Reflect(visitor, value.column);
+    int line, column;
+    Reflect(visitor, line);
+    Reflect(visitor, column);
+    value = Position(line, column);
   }
 }
 void Reflect(Writer& visitor, Position& value) {
@@ -161,8 +204,9 @@ void Reflect(Writer& visitor, Position& value) {
     std::string output = value.ToString();
     visitor.String(output.c_str(), output.size());
   } else {
-    Reflect(visitor, value.line);
-    Reflect(visitor, value.column);
+    int line = value.line, column = value.column;
+    Reflect(visitor, line);
+    Reflect(visitor, column);
   }
 }
 
@@ -172,10 +216,8 @@ void Reflect(Reader& visitor, Range& value) {
     std::string s = visitor.GetString();
     value = Range(s.c_str());
   } else {
-    Reflect(visitor, value.start.line);
-    Reflect(visitor, value.start.column);
-    Reflect(visitor, value.end.line);
-    Reflect(visitor, value.end.column);
+    Reflect(visitor, value.start);
+    Reflect(visitor, value.end);
   }
 }
 void Reflect(Writer& visitor, Range& value) {
@@ -183,9 +225,120 @@ void Reflect(Writer& visitor, Range& value) {
     std::string output = value.ToString();
     visitor.String(output.c_str(), output.size());
   } else {
-    Reflect(visitor, value.start.line);
-    Reflect(visitor, value.start.column);
-    Reflect(visitor, value.end.line);
-    Reflect(visitor, value.end.column);
+    Reflect(visitor, value.start);
+    Reflect(visitor, value.end);
+  }
+}
+
+// std::vector<Range>
+//
+// Range lists (uses, declarations, ...) make up most of a cache file. Instead
+// of four integers per range, non-JSON formats store them as a single string
+// of varints: the count, then for each range the start line as a delta from
+// the previous start line, the start column, and the end position relative
+// to the start. Ranges are mostly sorted and short, so the typical range
+// takes four bytes.
+void Reflect(Reader& visitor, std::vector<Range>& values) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    visitor.IterArray([&](Reader& entry) {
+      Range range;
+      Reflect(entry, range);
+      values.push_back(range);
+    });
+    return;
+  }
+  std::string storage;
+  std::string_view encoded = visitor.GetStringView(&storage);
+  const char* p = encoded.data();
+  const char* end = p + encoded.size();
+  int n = ReadVarint(p, end);
+  if (n < 0 || n > end - p)
+    throw std::invalid_argument("std::vector<Range>");
+  values.reserve(values.size() + n);
+  int line = 0;
+  for (int i = 0; i < n; i++) {
+    line += ReadVarint(p, end);
+    int column = ReadVarint(p, end);
+    int end_line = line + ReadVarint(p, end);
+    int end_column = column + ReadVarint(p, end);
+    values.push_back(
+        Range(Position(line, column), Position(end_line, end_column)));
+  }
+}
+void Reflect(Writer& visitor, std::vector<Range>& values) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    visitor.StartArray(values.size());
+    for (Range& range : values)
+      Reflect(visitor, range);
+    visitor.EndArray();
+    return;
+  }
+  std::string encoded;
+  encoded.reserve(1 + 4 * values.size());
+  AppendVarint(&encoded, int(values.size()));
+  int line = 0;
+  for (const Range& range : values) {
+    AppendVarint(&encoded, range.start.line - line);
+    AppendVarint(&encoded, range.start.column);
+    AppendVarint(&encoded, range.end.line - range.start.line);
+    AppendVarint(&encoded, range.end.column - range.start.column);
+    line = range.start.line;
+  }
+  visitor.String(encoded.data(), encoded.size());
+}
+
+TEST_SUITE("Range") {
+  TEST_CASE("vector round trip") {
+    std::vector<Range> ranges = {
+        Range(Position(0, 4), Position(0, 7)),
+        Range(Position(300, 1), Position(302, 0)),
+        Range(Position(12, 200), Position(12, 210)),
+        Range(Position(40000, 0), Position(40001, 2000)),
+        Range()};
+    std::string buf;
+    BinaryWriter writer(&buf);
+    Reflect(writer, ranges);
+    REQUIRE(buf.size() < ranges.size() * sizeof(Range));
+
+    std::vector<Range> result;
+    BinaryReader reader(buf);
+    Reflect(reader, result);
+    REQUIRE(result == ranges);
+  }
+
+  TEST_CASE("saturate") {
+    Position position(Position::kMaxLine + 10, Position::kMaxColumn + 10);
+    REQUIRE(position.line == Position::kMaxLine);
+    REQUIRE(position.column == Position::kMaxColumn);
+    REQUIRE(!Position().HasValue());
+    REQUIRE(Range("40000:1-40000:3").start.line == 39999);
+  }
+
+  TEST_CASE("long lines") {
+    Position position(0, 3000);
+    REQUIRE(position.column == Position::kMaxColumn);
+    position.AddColumn(1);
+    REQUIRE(position.column == Position::kMaxColumn);
+    position.AddColumn(-1);
+    REQUIRE(position.column == Position::kMaxColumn);
+
+    position = Position(0, Position::kMaxColumn - 1);
+    position.AddColumn(5);
+    REQUIRE(position.column == Position::kMaxColumn);
+    position = Position(0, 0);
+    position.AddColumn(-1);
+    REQUIRE(position.column == 0);
+
+    std::vector<Range> ranges = {Range(Position(1, 2040), Position(1, 3000)),
+                                 Range(Position(2, 2500), Position(2, 2600))};
+    std::string buf;
+    BinaryWriter writer(&buf);
+    Reflect(writer, ranges);
+    std::vector<Range> result;
+    BinaryReader reader(buf);
+    Reflect(reader, result);
+    REQUIRE(result == ranges);
+    REQUIRE(result[0].start.column == 2040);
+    REQUIRE(result[1].end.column == Position::kMaxColumn);
   }
 }
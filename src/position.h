@@ -6,16 +6,29 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 struct Position {
-  int16_t line;
-  int16_t column;
+  // Line and column are packed into 32 bits so that ranges stay small; lines
+  // past 32767 are common in generated files, long lines are not. Values past
+  // the limits saturate at kMaxLine/kMaxColumn, which then means "at or past
+  // the limit". -1 means no value. Assigning to the fields directly wraps, so
+  // use the constructor or AddColumn.
+  int32_t line : 20;
+  int32_t column : 12;
+
+  static const int kMaxLine = (1 << 19) - 1;
+  static const int kMaxColumn = (1 << 11) - 1;
 
   Position();
-  Position(int16_t line, int16_t column);
+  Position(int line, int column);
   explicit Position(const char* encoded);
 
   bool HasValue() const { return line >= 0; }
+  // Moves the position by |delta| columns, staying at or past column 0. A
+  // column saturated at kMaxColumn is past the limit by an unknown amount, so
+  // it stays there.
+  void AddColumn(int delta);
   std::string ToString();
   std::string ToPrettyString(const std::string& filename);
 
@@ -56,3 +69,5 @@ void Reflect(Reader& visitor, Position& value);
 void Reflect(Writer& visitor, Position& value);
 void Reflect(Reader& visitor, Range& value);
 void Reflect(Writer& visitor, Range& value);
+void Reflect(Reader& visitor, std::vector<Range>& values);
+void Reflect(Writer& visitor, std::vector<Range>& values);
@@ -0,0 +1,295 @@
+#include "preamble_cache.h"
+
+#include "clang_index.h"
+#include "clang_translation_unit.h"
+#include "clang_utils.h"
+#include "file_consumer.h"
+#include "platform.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+
+namespace {
+
+bool IsSourceFile(const std::string& arg) {
+  return EndsWithAny(arg, {".c", ".cc", ".cpp", ".cxx", ".m", ".mm"});
+}
+
+// Returns the -x language of a translation unit with |args| parsing |file|.
+std::string GetLanguage(const std::vector<std::string>& args,
+                        const std::string& file) {
+  std::string language;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-x" && i + 1 < args.size())
+      language = args[++i];
+    else if (StartsWith(args[i], "-x"))
+      language = args[i].substr(2);
+  }
+  if (!language.empty())
+    return language;
+  if (EndsWith(file, ".c"))
+    return "c";
+  if (EndsWith(file, ".m"))
+    return "objective-c";
+  if (EndsWith(file, ".mm"))
+    return "objective-c++";
+  return "c++";
+}
+
+// Returns |args| with the source file replaced by |header|, to be parsed as a
+// header of the same language.
+std::vector<std::string> GetPreambleArgs(const std::vector<std::string>& args,
+                                         const std::string& file,
+                                         const std::string& header) {
+  std::string language = GetLanguage(args, file);
+  if (!EndsWith(language, "-header"))
+    language += "-header";
+
+  std::vector<std::string> result;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-x") {
+      i++;
+      continue;
+    }
+    if (StartsWith(args[i], "-x") || (i > 0 && IsSourceFile(args[i])))
+      continue;
+    result.push_back(args[i]);
+  }
+  result.push_back("-x" + language);
+  result.push_back(header);
+  return result;
+}
+
+void CollectInclusion(CXFile included_file,
+                      CXSourceLocation* inclusion_stack,
+                      unsigned include_len,
+                      CXClientData client_data) {
+  // The preamble header itself is the only file which is not included.
+  if (include_len == 0)
+    return;
+  static_cast<std::vector<std::string>*>(client_data)
+      ->push_back(FileName(included_file));
+}
+
+}  // namespace
+
+PreambleCache::Preamble::~Preamble() {
+  if (!pch_path.empty())
+    std::remove(pch_path.c_str());
+}
+
+PreambleCache::PreambleCache(const std::string& directory, int capacity)
+    : directory_(directory), preambles_(capacity) {
+  MakeDirectoryRecursive(directory_);
+  static std::mutex mutex;
+  static std::unordered_set<std::string> cleaned_directories;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (cleaned_directories.insert(directory_).second)
+    RemoveStaleFiles(directory_);
+}
+
+// static
+void PreambleCache::RemoveStaleFiles(const std::string& directory) {
+  std::vector<DirectoryEntry> entries;
+  if (!ListDirectory(directory, &entries))
+    return;
+  int removed = 0;
+  for (const DirectoryEntry& entry : entries) {
+    if (entry.is_dir)
+      continue;
+    // Files without a pid were written before pids were part of the name.
+    size_t pid_start = entry.name.find('-');
+    size_t pid_end = pid_start == std::string::npos
+                         ? std::string::npos
+                         : entry.name.find('-', pid_start + 1);
+    if (pid_end != std::string::npos) {
+      int pid = atoi(entry.name.c_str() + pid_start + 1);
+      if (pid == GetCurrentPid() || IsProcessRunning(pid))
+        continue;
+    }
+    if (std::remove((directory + entry.name).c_str()) == 0)
+      removed++;
+  }
+  if (removed)
+    LOG_S(INFO) << "Removed " << removed << " stale preamble files";
+}
+
+std::shared_ptr<PreambleCache::Preamble> PreambleCache::Get(
+    ClangIndex* index,
+    FileConsumerSharedState* file_consumer_shared,
+    const std::string& file,
+    const std::string& contents,
+    const std::vector<std::string>& args) {
+  optional<uint64_t> key = GetKey(contents, args);
+  if (!key)
+    return nullptr;
+
+  std::shared_ptr<Preamble> preamble = preambles_.TryGet(*key);
+  if (!preamble) {
+    // The first translation unit with these includes indexes the headers, so
+    // a preamble is only worth building once a second one shows up.
+    if (++seen_[*key] < 2)
+      return nullptr;
+    seen_.erase(*key);
+    preamble = Build(index, *key, file, GetLeadingIncludes(contents), args);
+    if (!preamble)
+      return nullptr;
+    preambles_.Insert(*key, preamble);
+  }
+
+  // Rebuild the preamble if one of its files changed.
+  for (size_t i = 0; i < preamble->files.size(); i++) {
+    if (GetLastModificationTime(preamble->files[i]).value_or(0) !=
+        preamble->modification_times[i]) {
+      LOG_S(INFO) << "Preamble for " << file << " is outdated; "
+                  << preamble->files[i] << " changed";
+      preambles_.TryTake(*key);
+      seen_[*key] = 1;
+      return nullptr;
+    }
+  }
+
+  // Declarations from the preamble are not indexed; use it only if every file
+  // in it has already been indexed by some translation unit.
+  for (const std::string& included : preamble->files) {
+    if (!file_consumer_shared->IsUsed(included))
+      return nullptr;
+  }
+  return preamble;
+}
+
+void PreambleCache::Drop(const std::string& contents,
+                         const std::vector<std::string>& args) {
+  optional<uint64_t> key = GetKey(contents, args);
+  if (key)
+    preambles_.TryTake(*key);
+}
+
+// static
+std::string PreambleCache::GetLeadingIncludes(const std::string& contents) {
+  std::string result;
+  bool in_comment = false;
+  size_t line_start = 0;
+  while (line_start < contents.size()) {
+    size_t line_end = contents.find('\n', line_start);
+    if (line_end == std::string::npos)
+      line_end = contents.size();
+    std::string line =
+        Trim(contents.substr(line_start, line_end - line_start));
+    line_start = line_end + 1;
+
+    if (in_comment) {
+      size_t end = line.find("*/");
+      if (end == std::string::npos)
+        continue;
+      in_comment = false;
+      line = Trim(line.substr(end + 2));
+    }
+    if (StartsWith(line, "/*")) {
+      size_t end = line.find("*/", 2);
+      if (end == std::string::npos) {
+        in_comment = true;
+        continue;
+      }
+      line = Trim(line.substr(end + 2));
+    }
+    if (line.empty() || StartsWith(line, "//"))
+      continue;
+
+    if (line[0] != '#')
+      break;
+    std::string directive = Trim(line.substr(1));
+    if (!StartsWith(directive, "include"))
+      break;
+    std::string path = Trim(directive.substr(strlen("include")));
+    size_t close = path.find('>');
+    if (path.empty() || path[0] != '<' || close == std::string::npos)
+      break;
+    result += "#include " + path.substr(0, close + 1) + "\n";
+  }
+  return result;
+}
+
+optional<uint64_t> PreambleCache::GetKey(const std::string& contents,
+                                         const std::vector<std::string>& args) {
+  std::string includes = GetLeadingIncludes(contents);
+  if (includes.empty())
+    return nullopt;
+  return HashStorageKey(includes) ^ (GetArgsFingerprint(args) * 31);
+}
+
+std::shared_ptr<PreambleCache::Preamble> PreambleCache::Build(
+    ClangIndex* index,
+    uint64_t key,
+    const std::string& file,
+    const std::string& includes,
+    const std::vector<std::string>& args) {
+  // Other processes sharing the directory may build the same key.
+  static std::atomic<int> next_id;
+  std::string name = std::to_string(key) + '-' +
+                     std::to_string(GetCurrentPid()) + '-' +
+                     std::to_string(next_id++);
+  std::string header = directory_ + name + ".h";
+
+  Timer timer;
+  std::vector<CXUnsavedFile> unsaved(1);
+  unsaved[0].Filename = header.c_str();
+  unsaved[0].Contents = includes.c_str();
+  unsaved[0].Length = (unsigned long)includes.size();
+  std::unique_ptr<ClangTranslationUnit> tu = ClangTranslationUnit::Create(
+      index, header, GetPreambleArgs(args, file, header), unsaved,
+      CXTranslationUnit_ForSerialization | CXTranslationUnit_Incomplete);
+  if (!tu)
+    return nullptr;
+
+  auto preamble = std::make_shared<Preamble>();
+  preamble->parse_time = timer.ElapsedMicrosecondsAndReset();
+  std::string pch_path = directory_ + name + ".pch";
+  if (clang_saveTranslationUnit(tu->cx_tu, pch_path.c_str(),
+                                clang_defaultSaveOptions(tu->cx_tu)) !=
+      CXSaveError_None) {
+    LOG_S(WARNING) << "Unable to save preamble for " << file;
+    std::remove(pch_path.c_str());
+    return nullptr;
+  }
+  preamble->pch_path = pch_path;
+
+  clang_getInclusions(tu->cx_tu, &CollectInclusion, &preamble->files);
+  for (const std::string& included : preamble->files) {
+    preamble->modification_times.push_back(
+        GetLastModificationTime(included).value_or(0));
+  }
+  LOG_S(INFO) << "Built preamble of " << preamble->files.size()
+              << " files for " << file << " in "
+              << FormatMicroseconds(preamble->parse_time);
+  return preamble;
+}
+
+TEST_SUITE("PreambleCache") {
+  TEST_CASE("leading includes") {
+    REQUIRE(PreambleCache::GetLeadingIncludes("") == "");
+    REQUIRE(PreambleCache::GetLeadingIncludes(
+                "// Copyright\n"
+                "/* multi\n"
+                "   line */\n"
+                "#include <vector>\n"
+                "\n"
+                "#  include  <string>  // strings\n"
+                "#include \"foo.h\"\n"
+                "#include <map>\n") ==
+            "#include <vector>\n#include <string>\n");
+    REQUIRE(PreambleCache::GetLeadingIncludes("#define X\n#include <map>\n") ==
+            "");
+    REQUIRE(PreambleCache::GetLeadingIncludes("int x;\n#include <map>\n") ==
+            "");
+  }
+}
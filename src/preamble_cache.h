@@ -0,0 +1,80 @@
+#pragma once
+
+#include "lru_cache.h"
+
+#include <optional.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class ClangIndex;
+struct FileConsumerSharedState;
+
+// Precompiled headers for the leading block of `#include <...>` directives of
+// translation units. Many translation units of a project start with the same
+// includes and flags; parsing them with -include-pch skips reparsing those
+// headers every time.
+//
+// Declarations in a precompiled preamble are not indexed, so a preamble is
+// only used once every file it includes has been indexed by another
+// translation unit (see FileConsumerSharedState). Each indexer thread owns
+// one PreambleCache.
+class PreambleCache {
+ public:
+  struct Preamble {
+    ~Preamble();
+
+    std::string pch_path;
+    // Files included by the preamble and their modification times when it was
+    // built. Translation units parsed with the preamble do not see these
+    // includes, so they are added to their dependencies.
+    std::vector<std::string> files;
+    std::vector<int64_t> modification_times;
+    // Time it took to parse the preamble on its own, ie, roughly the parse
+    // time saved by each translation unit which uses it.
+    uint64_t parse_time = 0;
+  };
+
+  // Precompiled headers are written to |directory|, which other processes may
+  // share. At most |capacity| of them are kept. The first cache of a
+  // directory in the process removes the files of processes which exited
+  // without removing them, see RemoveStaleFiles.
+  PreambleCache(const std::string& directory, int capacity);
+
+  // Returns a preamble to parse |file| with, or null. Builds a preamble the
+  // second time the same leading includes and |args| are seen.
+  std::shared_ptr<Preamble> Get(ClangIndex* index,
+                                FileConsumerSharedState* file_consumer_shared,
+                                const std::string& file,
+                                const std::string& contents,
+                                const std::vector<std::string>& args);
+
+  // Forgets the preamble of |file|, ie, after parsing with it failed.
+  void Drop(const std::string& contents, const std::vector<std::string>& args);
+
+  // Returns the leading `#include <...>` lines of |contents|, skipping blank
+  // lines and comments. Quoted includes end the block, since they resolve
+  // relative to the including file.
+  static std::string GetLeadingIncludes(const std::string& contents);
+
+  // Removes the files in |directory| which were written by processes which
+  // are not running anymore. Files are named <key>-<pid>-<id>.
+  static void RemoveStaleFiles(const std::string& directory);
+
+ private:
+  optional<uint64_t> GetKey(const std::string& contents,
+                            const std::vector<std::string>& args);
+  std::shared_ptr<Preamble> Build(ClangIndex* index,
+                                  uint64_t key,
+                                  const std::string& file,
+                                  const std::string& includes,
+                                  const std::vector<std::string>& args);
+
+  std::string directory_;
+  LruCache<uint64_t, Preamble> preambles_;
+  // Number of times each key has been seen without a preamble.
+  std::unordered_map<uint64_t, int> seen_;
+};
@@ -0,0 +1,286 @@
+#include "profiler.h"
+
+#include "platform.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__)
+#define HAS_SAMPLING_PROFILER
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+namespace {
+
+// Joins the frames of a stack, outermost first, in the folded stacks format.
+// |frames| are innermost first, like backtrace() returns them.
+std::string FoldStack(const std::string& thread_name,
+                      const std::vector<std::string>& frames) {
+  std::string result = thread_name;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    result += ';';
+    // ';' separates frames.
+    for (char c : *it)
+      result += c == ';' ? ':' : c;
+  }
+  return result;
+}
+
+thread_local const char* t_thread_name = nullptr;
+
+#if defined(HAS_SAMPLING_PROFILER)
+
+const int kMaxFrames = 64;
+// The signal handler and the signal trampoline.
+const int kSkippedFrames = 2;
+// Samples taken but not collected yet. At 1000Hz on 32 busy threads the
+// collector has about 128ms to catch up.
+const size_t kNumSlots = 4096;
+const int kCollectIntervalMs = 20;
+
+enum SlotState { kEmpty, kWriting, kFull };
+
+struct Sample {
+  std::atomic<int> state{kEmpty};
+  const char* thread_name;
+  int depth;
+  void* frames[kMaxFrames];
+};
+
+// Allocated on first use and never freed, since a signal may still be handled
+// while the profiler stops.
+Sample* g_slots = nullptr;
+std::atomic<size_t> g_next_slot{0};
+std::atomic<size_t> g_dropped{0};
+std::atomic<bool> g_sampling{false};
+
+// Held while starting or stopping the profiler.
+std::mutex g_control_mutex;
+std::thread g_collector;
+std::atomic<bool> g_stop_collector{false};
+
+using StackKey = std::pair<std::string, std::vector<void*>>;
+std::mutex g_stacks_mutex;
+// Guarded by |g_stacks_mutex|. Sample counts by thread name and stack.
+std::map<StackKey, size_t> g_stacks;
+
+// Only async-signal-safe code may run here. backtrace() is safe once it was
+// called outside of a signal handler.
+void OnProfilingSignal(int) {
+  if (!g_sampling.load(std::memory_order_relaxed))
+    return;
+  int saved_errno = errno;
+  size_t slot = g_next_slot.fetch_add(1, std::memory_order_relaxed);
+  Sample& sample = g_slots[slot % kNumSlots];
+  int expected = kEmpty;
+  if (sample.state.compare_exchange_strong(expected, kWriting,
+                                           std::memory_order_acquire)) {
+    sample.thread_name = t_thread_name;
+    sample.depth = backtrace(sample.frames, kMaxFrames);
+    sample.state.store(kFull, std::memory_order_release);
+  } else {
+    g_dropped++;
+  }
+  errno = saved_errno;
+}
+
+void CollectSamples() {
+  std::lock_guard<std::mutex> lock(g_stacks_mutex);
+  for (size_t i = 0; i < kNumSlots; i++) {
+    Sample& sample = g_slots[i];
+    if (sample.state.load(std::memory_order_acquire) != kFull)
+      continue;
+    StackKey key;
+    key.first = sample.thread_name ? sample.thread_name : "unnamed";
+    for (int j = kSkippedFrames; j < sample.depth; j++)
+      key.second.push_back(sample.frames[j]);
+    sample.state.store(kEmpty, std::memory_order_release);
+    g_stacks[key]++;
+  }
+}
+
+std::string Symbolize(void* address) {
+  Dl_info info;
+  if (dladdr(address, &info)) {
+    if (info.dli_sname) {
+      int status = 0;
+      char* demangled =
+          abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      std::string result = status == 0 ? demangled : info.dli_sname;
+      free(demangled);
+      return result;
+    }
+    if (info.dli_fname) {
+      std::string module = info.dli_fname;
+      size_t slash = module.rfind('/');
+      if (slash != std::string::npos)
+        module = module.substr(slash + 1);
+      char offset[32];
+      snprintf(offset, sizeof(offset), "+0x%zx",
+               size_t(static_cast<char*>(address) -
+                      static_cast<char*>(info.dli_fbase)));
+      return module + offset;
+    }
+  }
+  char printed[32];
+  snprintf(printed, sizeof(printed), "%p", address);
+  return printed;
+}
+
+#endif
+
+}  // namespace
+
+optional<std::string> StartProfiler(int frequency_hz) {
+#if defined(HAS_SAMPLING_PROFILER)
+  std::lock_guard<std::mutex> lock(g_control_mutex);
+  if (g_sampling)
+    return std::string("The profiler is already running");
+  if (frequency_hz < 1 || frequency_hz > 1000)
+    return std::string("frequencyHz must be between 1 and 1000");
+
+  if (!g_slots)
+    g_slots = new Sample[kNumSlots];
+  for (size_t i = 0; i < kNumSlots; i++)
+    g_slots[i].state = kEmpty;
+  g_dropped = 0;
+  {
+    std::lock_guard<std::mutex> stacks_lock(g_stacks_mutex);
+    g_stacks.clear();
+  }
+
+  // The first call of backtrace() loads libgcc, which is not safe in a
+  // signal handler.
+  void* frame;
+  backtrace(&frame, 1);
+
+  // The handler stays installed once the profiler stops, since a signal may
+  // still be pending and SIGPROF terminates the process by default.
+  struct sigaction action = {};
+  action.sa_handler = &OnProfilingSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, nullptr) != 0)
+    return std::string("Unable to install the SIGPROF handler");
+
+  g_sampling = true;
+  g_stop_collector = false;
+  g_collector = std::thread([]() {
+    SetCurrentThreadName("profiler");
+    while (!g_stop_collector) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(kCollectIntervalMs));
+      CollectSamples();
+    }
+  });
+
+  struct itimerval timer = {};
+  timer.it_interval.tv_sec = 1 / frequency_hz;
+  timer.it_interval.tv_usec = 1000000 / frequency_hz % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    g_sampling = false;
+    g_stop_collector = true;
+    g_collector.join();
+    return std::string("Unable to start the profiling timer");
+  }
+  LOG_S(INFO) << "Started the profiler at " << frequency_hz << "Hz";
+  return nullopt;
+#else
+  return std::string("The profiler is not supported on this platform");
+#endif
+}
+
+bool IsProfiling() {
+#if defined(HAS_SAMPLING_PROFILER)
+  return g_sampling;
+#else
+  return false;
+#endif
+}
+
+optional<std::string> StopProfiler(const std::string& path,
+                                   ProfileSummary* summary) {
+#if defined(HAS_SAMPLING_PROFILER)
+  std::lock_guard<std::mutex> lock(g_control_mutex);
+  if (!g_sampling)
+    return std::string("The profiler is not running");
+  struct itimerval timer = {};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  g_sampling = false;
+  g_stop_collector = true;
+  g_collector.join();
+  CollectSamples();
+
+  std::map<StackKey, size_t> stacks;
+  {
+    std::lock_guard<std::mutex> stacks_lock(g_stacks_mutex);
+    stacks.swap(g_stacks);
+  }
+  *summary = ProfileSummary();
+  summary->dropped = g_dropped;
+
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file)
+    return "Unable to write the profile to " + path;
+  // Stacks which only differ in the instruction within a function are merged.
+  std::unordered_map<void*, std::string> symbols;
+  std::map<std::string, size_t> folded;
+  for (const auto& entry : stacks) {
+    std::vector<std::string> frames;
+    for (void* address : entry.first.second) {
+      auto it = symbols.find(address);
+      if (it == symbols.end())
+        it = symbols.emplace(address, Symbolize(address)).first;
+      frames.push_back(it->second);
+    }
+    folded[FoldStack(entry.first.first, frames)] += entry.second;
+    summary->samples += entry.second;
+  }
+  for (const auto& entry : folded) {
+    std::string line = entry.first + ' ' + std::to_string(entry.second) + '\n';
+    fwrite(line.data(), 1, line.size(), file);
+  }
+  fclose(file);
+  LOG_S(INFO) << "Wrote " << summary->samples << " profile samples to "
+              << path << " (" << summary->dropped << " dropped)";
+  return nullopt;
+#else
+  return std::string("The profiler is not supported on this platform");
+#endif
+}
+
+void SetProfilerThreadName(const std::string& name) {
+  // Signal handlers cannot copy strings, so names are kept forever. There is
+  // one per kind of thread.
+  static std::mutex mutex;
+  static std::set<std::string>* names = new std::set<std::string>();
+  std::lock_guard<std::mutex> lock(mutex);
+  t_thread_name = names->insert(name).first->c_str();
+}
+
+TEST_SUITE("Profiler") {
+  TEST_CASE("folded stacks") {
+    REQUIRE(FoldStack("indexer0", {"inner", "outer"}) ==
+            "indexer0;outer;inner");
+    REQUIRE(FoldStack("querydb", {"operator;"}) == "querydb;operator:");
+    REQUIRE(FoldStack("stdin", {}) == "stdin");
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <optional.h>
+
+#include <string>
+
+// Sampling profiler for the whole process, controlled by $cquery/profile/start
+// and $cquery/profile/stop. While running, threads are interrupted by SIGPROF
+// at a fixed rate of CPU time and their call stack is recorded, so threads
+// which wait are not sampled. Only supported where glibc style backtrace() is
+// available.
+
+struct ProfileSummary {
+  size_t samples = 0;
+  // Samples lost since they were taken faster than they were collected.
+  size_t dropped = 0;
+};
+
+// Starts sampling |frequency_hz| times per second of CPU time. Returns an
+// error message if the profiler is already running or unsupported.
+optional<std::string> StartProfiler(int frequency_hz);
+bool IsProfiling();
+
+// Stops the profiler and writes the samples to |path| as folded stacks, ie,
+// one "thread;outer_function;...;inner_function count" line per stack, which
+// flamegraph.pl, speedscope and pprof read. Functions which are not exported
+// are written as "module+0xoffset", which addr2line resolves.
+optional<std::string> StopProfiler(const std::string& path,
+                                   ProfileSummary* summary);
+
+// Names the current thread in the profile. Called by SetCurrentThreadName.
+void SetProfilerThreadName(const std::string& name);
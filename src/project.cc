@@ -1,6 +1,7 @@
 #include "project.h"
 
 #include "clang_utils.h"
+#include "directory_walker.h"
 #include "match.h"
 #include "platform.h"
 #include "serializer.h"
@@ -11,9 +12,11 @@
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
 #include <sstream>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
@@ -124,6 +127,7 @@ Project::Entry GetCompilationEntryFromCompileCommandEntry(
 
   Project::Entry result;
   result.filename = NormalizePathWithTestOptOut(entry.file);
+  std::vector<std::string> args;
   std::string base_name = GetBaseName(entry.file);
 
   size_t i = 0;
@@ -148,32 +152,32 @@ Project::Entry GetCompilationEntryFromCompileCommandEntry(
     ++i;
   // Include the compiler in the args.
   if (i > 0)
-    result.args.push_back(entry.args[i - 1]);
+    args.push_back(entry.args[i - 1]);
   else {
     // TODO Drop this back compatibility
     // Args probably came from a /.cquery file, which likely has just flags.
     // clang_parseTranslationUnit2FullArgv() expects the binary path as the
     // first arg, so the first flag would end up being ignored. Add a dummy.
-    result.args.push_back("clang++");
+    args.push_back("clang++");
   }
 
   // Add -working-directory if not provided.
   if (!AnyStartsWith(entry.args, "-working-directory")) {
-    result.args.emplace_back("-working-directory");
-    result.args.push_back(entry.directory);
+    args.emplace_back("-working-directory");
+    args.push_back(entry.directory);
   }
 
   // Clang does not have good hueristics for determining source language, we
   // should explicitly specify it.
   if (optional<std::string> file_type = SourceFileType(entry.file)) {
     if (!AnyStartsWith(entry.args, "-x")) {
-      result.args.push_back("-x" + *file_type);
+      args.push_back("-x" + *file_type);
     }
     if (!AnyStartsWith(entry.args, "-std=")) {
       if (*file_type == "c")
-        result.args.push_back("-std=gnu11");
+        args.push_back("-std=gnu11");
       else if (*file_type == "c++")
-        result.args.push_back("-std=c++14");
+        args.push_back("-std=c++14");
     }
   }
 
@@ -184,7 +188,7 @@ Project::Entry GetCompilationEntryFromCompileCommandEntry(
   // Note that when processing paths, some arguments support multiple forms, ie,
   // {"-Ifoo"} or {"-I", "foo"}.  Support both styles.
 
-  result.args.reserve(entry.args.size() + config->extra_flags.size());
+  args.reserve(entry.args.size() + config->extra_flags.size());
   for (; i < entry.args.size(); ++i) {
     std::string arg = entry.args[i];
 
@@ -243,30 +247,73 @@ Project::Entry GetCompilationEntryFromCompileCommandEntry(
         arg = cleanup_maybe_relative_path(arg);
     }
 
-    result.args.push_back(arg);
+    args.push_back(arg);
   }
 
   // We don't do any special processing on user-given extra flags.
   for (const auto& flag : config->extra_flags)
-    result.args.push_back(flag);
+    args.push_back(flag);
 
   // Add -resource-dir so clang can correctly resolve system includes like
   // <cstddef>
-  if (!AnyStartsWith(result.args, "-resource-dir"))
-    result.args.push_back("-resource-dir=" + config->resource_dir);
+  if (!AnyStartsWith(args, "-resource-dir"))
+    args.push_back("-resource-dir=" + config->resource_dir);
 
   // There could be a clang version mismatch between what the project uses and
   // what cquery uses. Make sure we do not emit warnings for mismatched options.
-  if (!AnyStartsWith(result.args, "-Wno-unknown-warning-option"))
-    result.args.push_back("-Wno-unknown-warning-option");
+  if (!AnyStartsWith(args, "-Wno-unknown-warning-option"))
+    args.push_back("-Wno-unknown-warning-option");
 
   // Using -fparse-all-comments enables documententation in the indexer and in
   // code completion.
   if (init_opts->index.comments > 1 &&
-      !AnyStartsWith(result.args, "-fparse-all-comments")) {
-    result.args.push_back("-fparse-all-comments");
+      !AnyStartsWith(args, "-fparse-all-comments")) {
+    args.push_back("-fparse-all-comments");
   }
 
+  result.args = std::move(args);
+  return result;
+}
+
+// Converts |commands| on several threads, as normalizing the paths of a large
+// compilation database takes a while. Each thread collects include
+// directories in its own ProjectConfig; they are merged into |config| once all
+// entries are converted.
+std::vector<Project::Entry> GetCompilationEntriesFromCompileCommandEntries(
+    Config* init_opts,
+    ProjectConfig* config,
+    const std::vector<CompileCommandsEntry>& commands) {
+  const int kMinEntriesPerThread = 256;
+  int num_commands = int(commands.size());
+  int num_threads = std::thread::hardware_concurrency();
+  num_threads = std::min(num_threads, num_commands / kMinEntriesPerThread);
+  num_threads = std::max(num_threads, 1);
+
+  std::vector<Project::Entry> result(commands.size());
+  std::vector<ProjectConfig> configs(num_threads, *config);
+  auto convert_chunk = [&](int thread) {
+    int begin = int(int64_t(num_commands) * thread / num_threads);
+    int end = int(int64_t(num_commands) * (thread + 1) / num_threads);
+    ProjectConfig* thread_config = &configs[thread];
+    for (int i = begin; i < end; ++i) {
+      result[i] = GetCompilationEntryFromCompileCommandEntry(
+          init_opts, thread_config, commands[i]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < num_threads; ++thread)
+    threads.emplace_back(convert_chunk, thread);
+  convert_chunk(0);
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (const ProjectConfig& thread_config : configs) {
+    config->quote_dirs.insert(thread_config.quote_dirs.begin(),
+                              thread_config.quote_dirs.end());
+    config->angle_dirs.insert(thread_config.angle_dirs.begin(),
+                              thread_config.angle_dirs.end());
+  }
   return result;
 }
 
@@ -294,8 +341,12 @@ std::vector<Project::Entry> LoadFromDirectoryListing(Config* init_opts,
   std::unordered_map<std::string, std::vector<std::string>> folder_args;
   std::vector<std::string> files;
 
-  GetFilesInFolder(
-      config->project_dir, true /*recursive*/, true /*add_folder_to_path*/,
+  // Listing directories is mostly waiting on the file system, so use more
+  // threads than there are cores.
+  Timer timer;
+  int num_threads = std::max(std::thread::hardware_concurrency(), 1u) * 2;
+  WalkProjectDirectory(
+      config->project_dir, num_threads,
       [&folder_args, &files](const std::string& path) {
         if (SourceFileType(path)) {
           files.push_back(path);
@@ -305,6 +356,10 @@ std::vector<Project::Entry> LoadFromDirectoryListing(Config* init_opts,
                               ReadCompilerArgumentsFromFile(path));
         }
       });
+  // Files are found in no particular order.
+  std::sort(files.begin(), files.end());
+  timer.ResetAndPrint("[perf] Listed " + std::to_string(files.size()) +
+                      " files in " + config->project_dir);
 
   const auto& project_dir_args = folder_args[config->project_dir];
   LOG_IF_S(INFO, !project_dir_args.empty())
@@ -322,17 +377,18 @@ std::vector<Project::Entry> LoadFromDirectoryListing(Config* init_opts,
     return folder_args[config->project_dir];
   };
 
+  std::vector<CompileCommandsEntry> commands;
   for (const std::string& file : files) {
     CompileCommandsEntry e;
     e.directory = config->project_dir;
     e.file = file;
     e.args = GetCompilerArgumentForFile(file);
     e.args.push_back(e.file);
-    result.push_back(
-        GetCompilationEntryFromCompileCommandEntry(init_opts, config, e));
+    commands.push_back(std::move(e));
   }
 
-  return result;
+  return GetCompilationEntriesFromCompileCommandEntries(init_opts, config,
+                                                        commands);
 }
 
 std::vector<Project::Entry> LoadCompilationEntriesFromDirectory(
@@ -368,7 +424,8 @@ std::vector<Project::Entry> LoadCompilationEntriesFromDirectory(
   unsigned int num_commands = clang_CompileCommands_getSize(cx_commands);
   clang_time.Pause();
 
-  std::vector<Project::Entry> result;
+  std::vector<CompileCommandsEntry> commands;
+  commands.reserve(num_commands);
   for (unsigned int i = 0; i < num_commands; i++) {
     clang_time.Resume();
     CXCompileCommand cx_command =
@@ -389,19 +446,14 @@ std::vector<Project::Entry> LoadCompilationEntriesFromDirectory(
     clang_time.Pause();  // TODO: don't call ToString in this block.
     // LOG_S(INFO) << "Got args " << StringJoin(entry.args);
 
-    our_time.Resume();
     entry.directory = directory;
-    std::string absolute_filename;
+    // GetCompilationEntryFromCompileCommandEntry normalizes the path.
     if (IsUnixAbsolutePath(relative_filename) ||
         IsWindowsAbsolutePath(relative_filename))
-      absolute_filename = relative_filename;
+      entry.file = relative_filename;
     else
-      absolute_filename = directory + "/" + relative_filename;
-    entry.file = NormalizePathWithTestOptOut(absolute_filename);
-
-    result.push_back(
-        GetCompilationEntryFromCompileCommandEntry(init_opts, config, entry));
-    our_time.Pause();
+      entry.file = directory + "/" + relative_filename;
+    commands.push_back(std::move(entry));
   }
 
   clang_time.Resume();
@@ -409,6 +461,12 @@ std::vector<Project::Entry> LoadCompilationEntriesFromDirectory(
   clang_CompilationDatabase_dispose(cx_db);
   clang_time.Pause();
 
+  our_time.Resume();
+  std::vector<Project::Entry> result =
+      GetCompilationEntriesFromCompileCommandEntries(init_opts, config,
+                                                     commands);
+  our_time.Pause();
+
   clang_time.ResetAndPrint("compile_commands.json clang time");
   our_time.ResetAndPrint("compile_commands.json our time");
 
@@ -453,26 +511,89 @@ int ComputeGuessScore(const std::string& a, const std::string& b) {
   return score;
 }
 
+// Returns the index of the first of |preferred_args| which an argument of
+// |entry| matches, or the size of |preferred_args| if none does.
+size_t GetPreferenceRank(const Project::Entry& entry,
+                         const std::vector<Matcher>& preferred_args) {
+  std::vector<std::string> args = entry.args.Get();
+  for (size_t i = 0; i < preferred_args.size(); i++) {
+    for (const std::string& arg : args) {
+      if (preferred_args[i].IsMatch(arg))
+        return i;
+    }
+  }
+  return preferred_args.size();
+}
+
+// Appends |root_entries| to |entries|, keeping one entry per file. Among the
+// entries of one root, which are the build configurations of the file, the
+// one ranked first by GetPreferenceRank is kept; a file listed by several
+// roots keeps the entry of the first. |entry_index| locates the files in
+// |entries|. Returns the number of entries which were dropped.
+size_t AddRootEntries(std::vector<Project::Entry> root_entries,
+                      const std::vector<Matcher>& preferred_args,
+                      std::vector<Project::Entry>* entries,
+                      std::unordered_map<std::string, size_t>* entry_index) {
+  size_t root_begin = entries->size();
+  size_t dropped = 0;
+  for (Project::Entry& entry : root_entries) {
+    auto it = entry_index->find(entry.filename);
+    if (it == entry_index->end()) {
+      (*entry_index)[entry.filename] = entries->size();
+      entries->push_back(std::move(entry));
+      continue;
+    }
+    dropped++;
+    Project::Entry& kept = (*entries)[it->second];
+    if (it->second >= root_begin && !preferred_args.empty() &&
+        GetPreferenceRank(entry, preferred_args) <
+            GetPreferenceRank(kept, preferred_args)) {
+      kept = std::move(entry);
+    }
+  }
+  return dropped;
+}
+
 }  // namespace
 
 void Project::Load(Config* init_opts,
                    const std::vector<std::string>& extra_flags,
                    const std::string& opt_compilation_db_dir,
-                   const std::string& root_directory,
+                   const std::vector<std::string>& root_directories,
                    const std::string& resource_directory) {
   // Load data.
-  ProjectConfig config;
-  config.extra_flags = extra_flags;
-  config.project_dir = root_directory;
-  config.resource_dir = resource_directory;
-  entries = LoadCompilationEntriesFromDirectory(init_opts, &config,
-                                                opt_compilation_db_dir);
+  entries.clear();
+  std::unordered_set<std::string> quote_dirs;
+  std::unordered_set<std::string> angle_dirs;
+  std::vector<Matcher> preferred_args;
+  for (const std::string& pattern :
+       init_opts->compilationDatabasePreferredArgs) {
+    optional<Matcher> matcher = Matcher::Create(pattern);
+    if (matcher)
+      preferred_args.push_back(*matcher);
+  }
+  std::unordered_map<std::string, size_t> entry_index;
+  size_t dropped = 0;
+  for (size_t i = 0; i < root_directories.size(); ++i) {
+    ProjectConfig config;
+    config.extra_flags = extra_flags;
+    config.project_dir = root_directories[i];
+    config.resource_dir = resource_directory;
+    dropped += AddRootEntries(
+        LoadCompilationEntriesFromDirectory(
+            init_opts, &config, i == 0 ? opt_compilation_db_dir : ""),
+        preferred_args, &entries, &entry_index);
+    quote_dirs.insert(config.quote_dirs.begin(), config.quote_dirs.end());
+    angle_dirs.insert(config.angle_dirs.begin(), config.angle_dirs.end());
+  }
+  if (dropped) {
+    LOG_S(INFO) << "Skipped " << dropped
+                << " compilation entries of files which are already listed";
+  }
 
   // Cleanup / postprocess include directories.
-  quote_include_directories.assign(config.quote_dirs.begin(),
-                                   config.quote_dirs.end());
-  angle_include_directories.assign(config.angle_dirs.begin(),
-                                   config.angle_dirs.end());
+  quote_include_directories.assign(quote_dirs.begin(), quote_dirs.end());
+  angle_include_directories.assign(angle_dirs.begin(), angle_dirs.end());
   for (std::string& path : quote_include_directories) {
     EnsureEndsInSlash(path);
     LOG_S(INFO) << "quote_include_dir: " << path;
@@ -486,50 +607,195 @@ void Project::Load(Config* init_opts,
   absolute_path_to_entry_index_.resize(entries.size());
   for (int i = 0; i < entries.size(); ++i)
     absolute_path_to_entry_index_[entries[i].filename] = i;
+
+  CompileArgsInterner interner;
+  for (Entry& entry : entries)
+    entry.args.Intern(entry.filename, &interner);
+  LOG_S(INFO) << "Compilation entries use " << interner.args.size()
+              << " distinct argument lists";
+
+  is_loaded = true;
+  std::lock_guard<std::mutex> lock(inferred_mutex_);
+  inferred_entry_index_.clear();
+  inferred_entries_size_ = entries.size();
+}
+
+void Project::Swap(Project* other) {
+  std::lock_guard<SharedMutex> lock(entries_mutex_);
+  quote_include_directories.swap(other->quote_include_directories);
+  angle_include_directories.swap(other->angle_include_directories);
+  entries.swap(other->entries);
+  absolute_path_to_entry_index_.swap(other->absolute_path_to_entry_index_);
+  std::swap(is_loaded, other->is_loaded);
+
+  std::lock_guard<std::mutex> inferred_lock(inferred_mutex_);
+  inferred_entry_index_.clear();
+  inferred_entries_size_ = entries.size();
+}
+
+std::vector<Project::Entry> Project::Update(
+    Project* other,
+    std::vector<std::string>* removed) {
+  std::lock_guard<SharedMutex> lock(entries_mutex_);
+  quote_include_directories.swap(other->quote_include_directories);
+  angle_include_directories.swap(other->angle_include_directories);
+
+  // Drop the entries which are gone, shifting the others down.
+  size_t kept = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    const std::string& filename = entries[i].filename;
+    if (!other->absolute_path_to_entry_index_.count(filename)) {
+      removed->push_back(filename);
+      absolute_path_to_entry_index_.erase(filename);
+      continue;
+    }
+    if (kept != i) {
+      absolute_path_to_entry_index_[filename] = kept;
+      entries[kept] = std::move(entries[i]);
+    }
+    kept++;
+  }
+  entries.resize(kept);
+
+  std::vector<Entry> changed;
+  for (Entry& entry : other->entries) {
+    auto it = absolute_path_to_entry_index_.find(entry.filename);
+    if (it == absolute_path_to_entry_index_.end()) {
+      absolute_path_to_entry_index_[entry.filename] = entries.size();
+      changed.push_back(entry);
+      entries.push_back(std::move(entry));
+    } else if (GetArgsFingerprint(entries[it->second].args) !=
+               GetArgsFingerprint(entry.args)) {
+      changed.push_back(entry);
+      entries[it->second] = std::move(entry);
+    }
+  }
+
+  // Inferred arguments may come from an entry which changed or moved.
+  std::lock_guard<std::mutex> inferred_lock(inferred_mutex_);
+  inferred_entry_index_.clear();
+  inferred_entries_size_ = entries.size();
+  return changed;
 }
 
 Project::Entry Project::FindCompilationEntryForFile(
     const std::string& filename) {
+  SharedLock entries_lock(entries_mutex_);
   auto it = absolute_path_to_entry_index_.find(filename);
   if (it != absolute_path_to_entry_index_.end())
     return entries[it->second];
 
   // We couldn't find the file. Try to infer it.
-  // TODO: Cache inferred file in a separate array (using a lock or similar)
-  Entry* best_entry = nullptr;
-  int best_score = std::numeric_limits<int>::min();
-  for (Entry& entry : entries) {
-    int score = ComputeGuessScore(filename, entry.filename);
-    if (score > best_score) {
-      best_score = score;
-      best_entry = &entry;
+  optional<int> best_index;
+  {
+    std::lock_guard<std::mutex> lock(inferred_mutex_);
+    if (inferred_entries_size_ != entries.size()) {
+      inferred_entry_index_.clear();
+      inferred_entries_size_ = entries.size();
+    }
+    auto inferred = inferred_entry_index_.find(filename);
+    if (inferred != inferred_entry_index_.end())
+      best_index = inferred->second;
+  }
+  if (!best_index) {
+    best_index = -1;
+    int best_score = std::numeric_limits<int>::min();
+    for (int i = 0; i < entries.size(); ++i) {
+      int score = ComputeGuessScore(filename, entries[i].filename);
+      if (score > best_score) {
+        best_score = score;
+        best_index = i;
+      }
     }
+    std::lock_guard<std::mutex> lock(inferred_mutex_);
+    if (inferred_entries_size_ == entries.size())
+      inferred_entry_index_[filename] = *best_index;
   }
+  const Entry* best_entry = *best_index >= 0 ? &entries[*best_index] : nullptr;
 
   Project::Entry result;
   result.is_inferred = true;
   result.filename = filename;
   if (!best_entry) {
     // FIXME
-    result.args.push_back("clang++");
-    result.args.push_back(filename);
+    result.args = {"clang++", filename};
   } else {
-    result.args = best_entry->args;
+    std::vector<std::string> args = best_entry->args;
 
     // |best_entry| probably has its own path in the arguments. We need to remap
     // that path to the new filename.
     std::string best_entry_base_name = GetBaseName(best_entry->filename);
-    for (std::string& arg : result.args) {
+    for (std::string& arg : args) {
       if (arg == best_entry->filename ||
           GetBaseName(arg) == best_entry_base_name) {
         arg = filename;
       }
     }
+    result.args = std::move(args);
   }
 
   return result;
 }
 
+bool Project::IsUnityBuildSource(const std::string& filename,
+                                 const std::string& contents) {
+  const std::vector<std::string> kSourceEndings = {".c",  ".cc", ".cpp",
+                                                   ".cxx", ".m", ".mm"};
+  std::string directory = GetDirName(filename) + '/';
+  std::vector<std::string> sources;
+  std::istringstream stream(contents);
+  std::string line;
+  bool in_comment = false;
+  while (std::getline(stream, line)) {
+    TrimInPlace(line);
+    if (in_comment) {
+      size_t end = line.find("*/");
+      if (end == std::string::npos)
+        continue;
+      in_comment = false;
+      line = Trim(line.substr(end + 2));
+    }
+    if (line.empty() || StartsWith(line, "//"))
+      continue;
+    if (StartsWith(line, "/*")) {
+      size_t end = line.find("*/", 2);
+      if (end == std::string::npos)
+        in_comment = true;
+      else if (!Trim(line.substr(end + 2)).empty())
+        return false;
+      continue;
+    }
+    if (line[0] != '#')
+      return false;
+
+    // # include "foo.cc"
+    line = Trim(line.substr(1));
+    if (!StartsWith(line, "include"))
+      continue;
+    size_t start = line.find('"');
+    if (start == std::string::npos)
+      continue;
+    size_t end = line.find('"', start + 1);
+    if (end == std::string::npos)
+      continue;
+    std::string name = line.substr(start + 1, end - start - 1);
+    if (!EndsWithAny(name, kSourceEndings))
+      continue;
+    if (name[0] != '/')
+      name = directory + name;
+    sources.push_back(NormalizePath(name));
+  }
+  if (sources.empty())
+    return false;
+
+  SharedLock entries_lock(entries_mutex_);
+  for (const std::string& source : sources) {
+    if (source == filename || !absolute_path_to_entry_index_.count(source))
+      return false;
+  }
+  return true;
+}
+
 void Project::ForAllFilteredFiles(
     Config* config,
     std::function<void(int i, const Entry& entry)> action) {
@@ -565,21 +831,22 @@ TEST_SUITE("Project") {
     entry.file = file;
     Project::Entry result =
         GetCompilationEntryFromCompileCommandEntry(&init_opts, &config, entry);
+    std::vector<std::string> args = result.args;
 
-    if (result.args != expected) {
+    if (args != expected) {
       std::cout << "Raw:      " << StringJoin(raw) << std::endl;
       std::cout << "Expected: " << StringJoin(expected) << std::endl;
-      std::cout << "Actual:   " << StringJoin(result.args) << std::endl;
+      std::cout << "Actual:   " << StringJoin(args) << std::endl;
     }
-    for (int i = 0; i < std::min(result.args.size(), expected.size()); ++i) {
-      if (result.args[i] != expected[i]) {
+    for (int i = 0; i < std::min(args.size(), expected.size()); ++i) {
+      if (args[i] != expected[i]) {
         std::cout << std::endl;
         std::cout << "mismatch at " << i << std::endl;
         std::cout << "  expected: " << expected[i] << std::endl;
-        std::cout << "  actual:   " << result.args[i] << std::endl;
+        std::cout << "  actual:   " << args[i] << std::endl;
       }
     }
-    REQUIRE(result.args == expected);
+    REQUIRE(args == expected);
   }
 
   void CheckFlags(std::vector<std::string> raw,
@@ -1411,6 +1678,18 @@ TEST_SUITE("Project") {
       REQUIRE(entry.has_value());
       REQUIRE(entry->args == std::vector<std::string>{"arg2"});
     }
+
+    // Inferred entries are cached until the project entries change.
+    REQUIRE(p.FindCompilationEntryForFile("/a/b/c/new/new.cc").args ==
+            std::vector<std::string>{"arg2"});
+    {
+      Project::Entry e;
+      e.args = {"arg3"};
+      e.filename = "/a/b/c/new/baz.cc";
+      p.entries.push_back(e);
+    }
+    REQUIRE(p.FindCompilationEntryForFile("/a/b/c/new/new.cc").args ==
+            std::vector<std::string>{"arg3"});
   }
 
   TEST_CASE("Entry inference remaps file names") {
@@ -1484,4 +1763,84 @@ TEST_SUITE("Project") {
       REQUIRE(entry->args == std::vector<std::string>{"arg3"});
     }
   }
+
+  TEST_CASE("one entry per file") {
+    auto make = [](const std::string& filename, const std::string& arg) {
+      Project::Entry e;
+      e.filename = filename;
+      e.args = {arg, filename};
+      return e;
+    };
+    std::vector<Matcher> preferred_args = {*Matcher::Create("^-DRELEASE$")};
+    std::vector<Project::Entry> entries;
+    std::unordered_map<std::string, size_t> entry_index;
+    REQUIRE(AddRootEntries({make("a.cc", "-DDEBUG"), make("b.cc", "-DDEBUG"),
+                            make("a.cc", "-DRELEASE")},
+                           preferred_args, &entries, &entry_index) == 1);
+    // Other roots do not replace the entries of the first.
+    REQUIRE(AddRootEntries({make("b.cc", "-DRELEASE")}, preferred_args,
+                           &entries, &entry_index) == 1);
+    REQUIRE(entries.size() == 2);
+    REQUIRE(entries[0].args == std::vector<std::string>{"-DRELEASE", "a.cc"});
+    REQUIRE(entries[1].args == std::vector<std::string>{"-DDEBUG", "b.cc"});
+  }
+
+  TEST_CASE("Update keeps unchanged entries") {
+    auto add = [](Project* p, const std::string& filename,
+                  const std::string& arg) {
+      Project::Entry e;
+      e.filename = filename;
+      e.args = {arg, filename};
+      p->absolute_path_to_entry_index_[filename] = p->entries.size();
+      p->entries.push_back(e);
+    };
+    Project p;
+    add(&p, "a.cc", "-DA");
+    add(&p, "b.cc", "-DB");
+    add(&p, "c.cc", "-DC");
+    Project loaded;
+    add(&loaded, "c.cc", "-DC2");
+    add(&loaded, "a.cc", "-DA");
+    add(&loaded, "d.cc", "-DD");
+
+    std::vector<std::string> removed;
+    std::vector<Project::Entry> changed = p.Update(&loaded, &removed);
+    REQUIRE(removed == std::vector<std::string>{"b.cc"});
+    REQUIRE(changed.size() == 2);
+    REQUIRE(changed[0].filename == "c.cc");
+    REQUIRE(changed[1].filename == "d.cc");
+    REQUIRE(p.entries.size() == 3);
+    REQUIRE(p.absolute_path_to_entry_index_.size() == 3);
+    for (const auto& pair : p.absolute_path_to_entry_index_)
+      REQUIRE(p.entries[pair.second].filename == pair.first);
+    REQUIRE(p.FindCompilationEntryForFile("c.cc").args ==
+            std::vector<std::string>{"-DC2", "c.cc"});
+  }
+
+  TEST_CASE("unity build sources") {
+    Project p;
+    for (const char* filename : {"/unity/a.cc", "/unity/sub/b.cc"}) {
+      Project::Entry e;
+      e.filename = filename;
+      p.absolute_path_to_entry_index_[filename] = p.entries.size();
+      p.entries.push_back(e);
+    }
+    const std::string kUnity = "/unity/unity_0.cc";
+    REQUIRE(p.IsUnityBuildSource(kUnity,
+                                 "// Generated.\n"
+                                 "/* Do not\n   edit. */\n"
+                                 "#include \"a.cc\"\r\n"
+                                 "\n"
+                                 "# include \"/unity/sub/b.cc\"\n"));
+    // Headers and other directives do not matter.
+    REQUIRE(p.IsUnityBuildSource(kUnity,
+                                 "#pragma once\n"
+                                 "#include \"a.h\"\n"
+                                 "#include \"sub/b.cc\"\n"));
+    // Code of its own, or a source which is not indexed on its own.
+    REQUIRE(!p.IsUnityBuildSource(kUnity, "#include \"a.cc\"\nint x;\n"));
+    REQUIRE(!p.IsUnityBuildSource(kUnity, "#include \"c.cc\"\n"));
+    REQUIRE(!p.IsUnityBuildSource(kUnity, "#include \"a.h\"\n"));
+    REQUIRE(!p.IsUnityBuildSource("/unity/a.cc", "#include \"a.cc\"\n"));
+  }
 }
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "compile_args.h"
 #include "config.h"
+#include "shared_mutex.h"
 
 #include <optional.h>
 #include <sparsepp/spp.h>
@@ -8,12 +10,13 @@
 #include <functional>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct Project {
   struct Entry {
     std::string filename;
-    std::vector<std::string> args;
+    CompileArgs args;
     // If true, this entry is inferred and was not read from disk.
     bool is_inferred = false;
   };
@@ -26,26 +29,66 @@ struct Project {
   std::vector<Entry> entries;
   spp::sparse_hash_map<std::string, int> absolute_path_to_entry_index_;
 
-  // Loads a project for the given |directory|.
+  // False until the project has been loaded. initialize loads the project of
+  // the workspace in the background, and requests see an empty project
+  // meanwhile; |is_loading| is set until it is installed.
+  bool is_loaded = false;
+  bool is_loading = false;
+
+  // Loads a project for the given |root_directories|, which are the folders
+  // of one workspace. The first one is the primary root.
   //
   // If |opt_compilation_db_dir| is not empty, the compile_commands.json
-  // file in it will be used to discover all files and args. If it's empty and
-  // |root_directory| contains a compile_commands.json file, that one will be
-  // used instead. Otherwise, a recursive directory listing of all *.cpp, *.cc,
-  // *.h, and *.hpp files will be used. clang arguments can be specified in a
-  // .cquery file located inside of |root_directory|.
+  // file in it will be used to discover all files and args of the primary
+  // root. Otherwise, if a root directory contains a compile_commands.json
+  // file, that one will be used instead. Otherwise, a recursive directory
+  // listing of all *.cpp, *.cc, *.h, and *.hpp files will be used. clang
+  // arguments can be specified in a .cquery file located inside of each root
+  // directory. A file listed by several roots uses the entry of the first.
   void Load(Config* init_opts,
             const std::vector<std::string>& extra_flags,
             const std::string& opt_compilation_db_dir,
-            const std::string& root_directory,
+            const std::vector<std::string>& root_directories,
             const std::string& resource_directory);
 
+  // Exchanges the contents of the projects. Other members are only used on
+  // the querydb thread, which this runs on, but FindCompilationEntryForFile
+  // may run concurrently on the completion threads.
+  void Swap(Project* other);
+
+  // Updates the project with the entries of |other|, the project of the same
+  // workspace loaded again after its compilation database changed. Entries
+  // whose arguments did not change are kept as they are. Returns the entries
+  // which were added or whose arguments changed; the files which are not part
+  // of the project anymore are appended to |removed|. Like Swap, this runs on
+  // the querydb thread.
+  std::vector<Entry> Update(Project* other, std::vector<std::string>* removed);
+
   // Lookup the CompilationEntry for |filename|. If no entry was found this
   // will infer one based on existing project structure.
   Entry FindCompilationEntryForFile(const std::string& filename);
 
+  // Returns true if |contents|, the contents of the entry |filename|, is the
+  // source of a unity build, ie, a unity_N.cc or jumbo file which does nothing
+  // but #include other source files which are entries of the project
+  // themselves. The check is lexical: anything but comments and preprocessor
+  // directives, or an included source which is not an entry, makes it false.
+  bool IsUnityBuildSource(const std::string& filename,
+                          const std::string& contents);
+
   // Run |action| on every file in the project.
   void ForAllFilteredFiles(
       Config* config,
       std::function<void(int i, const Entry& entry)> action);
+
+  // Index of the entry FindCompilationEntryForFile inferred the arguments of
+  // a file from, or -1 if there was none. Inferring scores every entry, and
+  // the same headers are looked up over and over. Cleared by Load, or when
+  // |entries| changes size.
+  std::mutex inferred_mutex_;
+  std::unordered_map<std::string, int> inferred_entry_index_;
+  size_t inferred_entries_size_ = 0;
+  // Held exclusively by Swap and shared by FindCompilationEntryForFile and
+  // IsUnityBuildSource.
+  SharedMutex entries_mutex_;
 };
@@ -7,11 +7,15 @@
 #include <optional.h>
 #include <loguru.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -19,8 +23,8 @@
 
 namespace {
 
-template <typename T>
-void VerifyUnique(const std::vector<T>& values0) {
+template <typename T, typename TAllocator>
+void VerifyUnique(const std::vector<T, TAllocator>& values0) {
 // FIXME: Run on a big code-base for a while and verify no assertions are
 // triggered.
 #if false
@@ -42,6 +46,7 @@ optional<QueryType::Def> ToQuery(const IdMap& id_map,
   result.kind = type.kind;
   result.hover = type.hover;
   result.comments = type.comments;
+  result.comments_range = id_map.ToQuery(type.comments_range);
   result.definition_spelling = id_map.ToQuery(type.definition_spelling);
   result.definition_extent = id_map.ToQuery(type.definition_extent);
   result.alias_of = id_map.ToQuery(type.alias_of,0);
@@ -65,6 +70,7 @@ optional<QueryFunc::Def> ToQuery(const IdMap& id_map,
   result.storage = func.storage;
   result.hover = func.hover;
   result.comments = func.comments;
+  result.comments_range = id_map.ToQuery(func.comments_range);
   result.definition_spelling = id_map.ToQuery(func.definition_spelling);
   result.definition_extent = id_map.ToQuery(func.definition_extent);
   result.declaring_type = id_map.ToQuery(func.declaring_type,0);
@@ -84,6 +90,7 @@ optional<QueryVar::Def> ToQuery(const IdMap& id_map, const IndexVar::Def& var) {
   result.short_name_size = var.short_name_size;
   result.hover = var.hover;
   result.comments = var.comments;
+  result.comments_range = id_map.ToQuery(var.comments_range);
   result.definition_spelling = id_map.ToQuery(var.definition_spelling);
   result.definition_extent = id_map.ToQuery(var.definition_extent);
   result.variable_type = id_map.ToQuery(var.variable_type,0);
@@ -94,6 +101,41 @@ optional<QueryVar::Def> ToQuery(const IdMap& id_map, const IndexVar::Def& var) {
   return result;
 }
 
+// Removes the values which are in both |a| and |b| from both vectors. The
+// remaining values keep their order.
+template <typename T>
+void RemoveCommonValues(std::vector<T>* a, std::vector<T>* b) {
+  if (a->empty() || b->empty())
+    return;
+  std::vector<T> sorted_a = *a, sorted_b = *b, common;
+  std::sort(sorted_a.begin(), sorted_a.end());
+  std::sort(sorted_b.begin(), sorted_b.end());
+  std::set_intersection(sorted_a.begin(), sorted_a.end(), sorted_b.begin(),
+                        sorted_b.end(), std::back_inserter(common));
+  if (common.empty())
+    return;
+  auto is_common = [&](const T& value) {
+    return std::binary_search(common.begin(), common.end(), value);
+  };
+  a->erase(std::remove_if(a->begin(), a->end(), is_common), a->end());
+  b->erase(std::remove_if(b->begin(), b->end(), is_common), b->end());
+}
+
+// Combines |dest| with |source|, which applies after it. Values which
+// |source| adds back after |dest| removed them, or removes after |dest| added
+// them, cancel out; ApplyIndexUpdate adds before it removes, so keeping both
+// would drop values which should be present.
+template <typename TId, typename TValue>
+void MergeInto(MergeableUpdate<TId, TValue>* dest,
+               const MergeableUpdate<TId, TValue>& source) {
+  std::vector<TValue> to_add = source.to_add;
+  std::vector<TValue> to_remove = source.to_remove;
+  RemoveCommonValues(&dest->to_remove, &to_add);
+  RemoveCommonValues(&dest->to_add, &to_remove);
+  AddRange(&dest->to_add, to_add);
+  AddRange(&dest->to_remove, to_remove);
+}
+
 // Adds the mergeable updates in |source| to |dest|. If a mergeable update for
 // the destination type already exists, it will be combined. This makes merging
 // updates take longer but reduces import time on the querydb thread.
@@ -114,8 +156,7 @@ void AddMergeableRange(
   for (const auto& entry : source) {
     auto it = id_to_index.find(entry.id);
     if (it != id_to_index.end()) {
-      AddRange(&(*dest)[it->second].to_add, entry.to_add);
-      AddRange(&(*dest)[it->second].to_remove, entry.to_remove);
+      MergeInto(&(*dest)[it->second], entry);
     } else {
       dest->push_back(entry);
     }
@@ -126,6 +167,15 @@ void AddMergeableRange(
 // in |previous| but not |current| to |removed|, and all elements
 // that are in |current| but not |previous| to |added|.
 //
+// Sorts |values| unless it is already sorted. Reference lists are mostly
+// emitted in source order and the output of ComputeDifferenceForUpdate is
+// sorted, so the linear check usually saves the sort.
+template <typename T>
+void SortIfNeeded(std::vector<T>* values) {
+  if (!std::is_sorted(values->begin(), values->end()))
+    std::sort(values->begin(), values->end());
+}
+
 // Returns true iff |removed| or |added| are non-empty.
 template <typename T>
 bool ComputeDifferenceForUpdate(std::vector<T>& previous,
@@ -133,8 +183,8 @@ bool ComputeDifferenceForUpdate(std::vector<T>& previous,
                                 std::vector<T>* removed,
                                 std::vector<T>* added) {
   // We need to sort to use std::set_difference.
-  std::sort(previous.begin(), previous.end());
-  std::sort(current.begin(), current.end());
+  SortIfNeeded(&previous);
+  SortIfNeeded(&current);
 
   auto it0 = previous.begin(), it1 = current.begin();
   while (it0 != previous.end() && it1 != current.end()) {
@@ -155,47 +205,63 @@ bool ComputeDifferenceForUpdate(std::vector<T>& previous,
   return !removed->empty() || !added->empty();
 }
 
+// Returns the entries of |data| ordered by usr. |data| itself stays in id
+// order, since ids are indices into it.
+template <typename T>
+std::vector<T*> SortByUsr(std::vector<T>& data) {
+  std::vector<T*> result;
+  result.reserve(data.size());
+  for (T& value : data)
+    result.push_back(&value);
+  auto usr_less = [](const T* a, const T* b) { return a->usr < b->usr; };
+  if (!std::is_sorted(result.begin(), result.end(), usr_less))
+    std::sort(result.begin(), result.end(), usr_less);
+  return result;
+}
+
 template <typename T>
 void CompareGroups(std::vector<T>& previous_data,
                    std::vector<T>& current_data,
                    std::function<void(T*)> on_removed,
                    std::function<void(T*)> on_added,
                    std::function<void(T*, T*)> on_found) {
-  std::sort(previous_data.begin(), previous_data.end());
-  std::sort(current_data.begin(), current_data.end());
-
-  auto prev_it = previous_data.begin();
-  auto curr_it = current_data.begin();
-  while (prev_it != previous_data.end() && curr_it != current_data.end()) {
+  // Sorting the entries themselves would move every IndexType/IndexFunc/
+  // IndexVar, so walk pointers to them instead.
+  std::vector<T*> previous_sorted = SortByUsr(previous_data);
+  std::vector<T*> current_sorted = SortByUsr(current_data);
+
+  auto prev_it = previous_sorted.begin();
+  auto curr_it = current_sorted.begin();
+  while (prev_it != previous_sorted.end() && curr_it != current_sorted.end()) {
     // same id
-    if (prev_it->usr == curr_it->usr) {
-      on_found(&*prev_it, &*curr_it);
+    if ((*prev_it)->usr == (*curr_it)->usr) {
+      on_found(*prev_it, *curr_it);
       ++prev_it;
       ++curr_it;
     }
 
     // prev_id is smaller - prev_it has data curr_it does not have.
-    else if (prev_it->usr < curr_it->usr) {
-      on_removed(&*prev_it);
+    else if ((*prev_it)->usr < (*curr_it)->usr) {
+      on_removed(*prev_it);
       ++prev_it;
     }
 
     // prev_id is bigger - curr_it has data prev_it does not have.
     else {
-      on_added(&*curr_it);
+      on_added(*curr_it);
       ++curr_it;
     }
   }
 
   // if prev_it still has data, that means it is not in curr_it and was removed.
-  while (prev_it != previous_data.end()) {
-    on_removed(&*prev_it);
+  while (prev_it != previous_sorted.end()) {
+    on_removed(*prev_it);
     ++prev_it;
   }
 
   // if curr_it still has data, that means it is not in prev_it and was added.
-  while (curr_it != current_data.end()) {
-    on_added(&*curr_it);
+  while (curr_it != current_sorted.end()) {
+    on_added(*curr_it);
     ++curr_it;
   }
 }
@@ -203,9 +269,20 @@ void CompareGroups(std::vector<T>& previous_data,
 QueryFile::DefUpdate BuildFileDefUpdate(const IdMap& id_map, const IndexFile& indexed) {
   QueryFile::Def def;
   def.path = indexed.path;
-  def.includes = indexed.includes;
   def.inactive_regions = indexed.skipped_by_preprocessor;
-  def.dependencies = indexed.dependencies;
+
+  // Resolve the dependencies and the included files in one batch.
+  std::vector<std::string> paths = indexed.dependencies;
+  for (const IndexInclude& include : indexed.includes)
+    paths.push_back(include.resolved_path);
+  std::vector<QueryFileId> file_ids = id_map.ToQueryFiles(paths);
+  def.dependencies.assign(file_ids.begin(),
+                          file_ids.begin() + indexed.dependencies.size());
+  def.includes.resize(indexed.includes.size());
+  for (size_t i = 0; i < indexed.includes.size(); i++) {
+    def.includes[i].line = indexed.includes[i].line;
+    def.includes[i].file = file_ids[indexed.dependencies.size() + i];
+  }
 
   // Convert enum to markdown compatible strings
   def.language = [indexed]() {
@@ -257,9 +334,8 @@ QueryFile::DefUpdate BuildFileDefUpdate(const IdMap& id_map, const IndexFile& in
       // 42;` will take you to the constructor.
       Range range = caller.loc;
       if (caller.is_implicit) {
-        if (range.start.column > 0)
-          range.start.column--;
-        range.end.column++;
+        range.start.AddColumn(-1);
+        range.end.AddColumn(1);
       }
       add_all_symbols(id_map.ToSymbol(func.id),
                       caller.is_implicit
@@ -291,7 +367,11 @@ QueryFile::DefUpdate BuildFileDefUpdate(const IdMap& id_map, const IndexFile& in
               return a.loc.range.start < b.loc.range.start;
             });
 
-  return QueryFile::DefUpdate(def, indexed.file_contents);
+  std::shared_ptr<const std::string> file_content;
+  if (!indexed.file_contents.empty())
+    file_content = std::make_shared<const std::string>(indexed.file_contents);
+  return QueryFile::DefUpdate(def, std::move(file_content),
+                              indexed.file_contents_hash);
 }
 
 Maybe<QueryFileId> GetQueryFileIdFromPath(QueryDatabase* query_db,
@@ -313,64 +393,185 @@ Maybe<QueryFileId> GetQueryFileIdFromPath(QueryDatabase* query_db,
 Maybe<QueryTypeId> GetQueryTypeIdFromUsr(QueryDatabase* query_db,
                                          Usr usr,
                                          bool create_if_missing) {
-  auto it = query_db->usr_to_type.find(usr);
-  if (it != query_db->usr_to_type.end())
-    return QueryTypeId(it->second.id);
-  if (!create_if_missing)
-    return {};
-
-  RawId idx = query_db->types.size();
-  query_db->usr_to_type[usr] = QueryTypeId(idx);
-  query_db->types.push_back(QueryType(usr));
-  return QueryTypeId(idx);
+  if (create_if_missing)
+    return query_db->usr_to_type.GetOrAllocate(usr);
+  return query_db->usr_to_type.Get(usr);
 }
 
 Maybe<QueryFuncId> GetQueryFuncIdFromUsr(QueryDatabase* query_db,
                                          Usr usr,
                                          bool create_if_missing) {
-  auto it = query_db->usr_to_func.find(usr);
-  if (it != query_db->usr_to_func.end())
-    return QueryFuncId(it->second.id);
-  if (!create_if_missing)
-    return {};
-
-  RawId idx = query_db->funcs.size();
-  query_db->usr_to_func[usr] = QueryFuncId(idx);
-  query_db->funcs.push_back(QueryFunc(usr));
-  return QueryFuncId(idx);
+  if (create_if_missing)
+    return query_db->usr_to_func.GetOrAllocate(usr);
+  return query_db->usr_to_func.Get(usr);
 }
 
 Maybe<QueryVarId> GetQueryVarIdFromUsr(QueryDatabase* query_db,
                                        Usr usr,
                                        bool create_if_missing) {
-  auto it = query_db->usr_to_var.find(usr);
-  if (it != query_db->usr_to_var.end())
-    return QueryVarId(it->second.id);
-  if (!create_if_missing)
-    return {};
-
-  RawId idx = query_db->vars.size();
-  query_db->usr_to_var[usr] = QueryVarId(idx);
-  query_db->vars.push_back(QueryVar(usr));
-  return QueryVarId(idx);
+  if (create_if_missing)
+    return query_db->usr_to_var.GetOrAllocate(usr);
+  return query_db->usr_to_var.Get(usr);
 }
 
+// Reference lists are ordered by the referenced value; WithGen entries ignore
+// their generation, which UpdateGen refreshes afterwards.
+template <typename T>
+const T& GetMergeKey(const T& value) {
+  return value;
+}
 template <typename T>
-void AddRangeWithGen(std::vector<WithGen<T>>* dest, const std::vector<T>& to_add, Generation gen) {
-  for (auto& x : to_add)
-    dest->push_back(WithGen<T>{gen, x});
+const T& GetMergeKey(const WithGen<T>& value) {
+  return value.value;
+}
+
+template <typename T, typename TAllocator>
+bool IsSortedByMergeKey(const std::vector<T, TAllocator>& values) {
+  for (size_t i = 1; i < values.size(); i++) {
+    if (GetMergeKey(values[i]) < GetMergeKey(values[i - 1]))
+      return false;
+  }
+  return true;
+}
+
+// Applies |to_add| and then |to_remove| to |dest|, which is kept sorted so that
+// this is a linear merge instead of a search of |to_remove| for every value.
+// |to_add| and |to_remove| are sorted in place and their values are moved
+// into |dest| after being wrapped by |make|.
+//
+// Locations sort by file first, so the references of a file are a contiguous
+// run of |dest|. An update usually comes from reindexing a single file and
+// only the run between its smallest and largest value is merged; the rest of
+// |dest| is at most shifted.
+template <typename TStored,
+          typename TAllocator,
+          typename TValue,
+          typename TMake>
+void MergeSortedRange(std::vector<TStored, TAllocator>* dest,
+                      std::vector<TValue>* to_add,
+                      std::vector<TValue>* to_remove,
+                      TMake make) {
+  if (to_add->empty() && to_remove->empty())
+    return;
+  assert(IsSortedByMergeKey(*dest));
+  SortIfNeeded(to_add);
+  SortIfNeeded(to_remove);
+
+  // While the cache is imported, updates only add references and each new
+  // file gets a larger id than the files before it, so the values usually go
+  // after everything in |dest| and can be appended without merging.
+  if (to_remove->empty() &&
+      (dest->empty() || GetMergeKey(dest->back()) < to_add->front())) {
+    size_t size = dest->size() + to_add->size();
+    if (size > dest->capacity())
+      dest->reserve(size + size / 8);
+    for (TValue& value : *to_add)
+      dest->push_back(make(std::move(value)));
+    return;
+  }
+
+  const TValue* lowest = nullptr;
+  const TValue* highest = nullptr;
+  for (const std::vector<TValue>* values : {to_add, to_remove}) {
+    if (values->empty())
+      continue;
+    if (!lowest || values->front() < *lowest)
+      lowest = &values->front();
+    if (!highest || *highest < values->back())
+      highest = &values->back();
+  }
+  auto key_less = [](const TStored& stored, const TValue& value) {
+    return GetMergeKey(stored) < value;
+  };
+  auto value_less = [](const TValue& value, const TStored& stored) {
+    return value < GetMergeKey(stored);
+  };
+  size_t first =
+      std::lower_bound(dest->begin(), dest->end(), *lowest, key_less) -
+      dest->begin();
+  size_t last =
+      std::upper_bound(dest->begin() + first, dest->end(), *highest,
+                       value_less) -
+      dest->begin();
+
+  // The run of |dest| and |to_add| are both walked in order, so each keeps
+  // its own position in |to_remove|.
+  using Iterator = typename std::vector<TValue>::const_iterator;
+  auto is_removed = [&](Iterator* it, const TValue& value) -> bool {
+    while (*it != to_remove->cend() && **it < value)
+      ++*it;
+    return *it != to_remove->cend() && !(value < **it);
+  };
+  Iterator dest_removed = to_remove->cbegin();
+  Iterator add_removed = to_remove->cbegin();
+
+  std::vector<TStored> merged;
+  merged.reserve(last - first + to_add->size());
+  size_t i = first, j = 0;
+  while (i < last || j < to_add->size()) {
+    if (j == to_add->size() ||
+        (i < last && !((*to_add)[j] < GetMergeKey((*dest)[i])))) {
+      if (!is_removed(&dest_removed, GetMergeKey((*dest)[i])))
+        merged.push_back(std::move((*dest)[i]));
+      i++;
+    } else {
+      if (!is_removed(&add_removed, (*to_add)[j]))
+        merged.push_back(make(std::move((*to_add)[j])));
+      j++;
+    }
+  }
+
+  size_t size = dest->size() - (last - first) + merged.size();
+  if (size > dest->capacity()) {
+    // Leave some room so that the next update which grows the list does not
+    // move all of it again.
+    std::vector<TStored, TAllocator> result;
+    result.reserve(size + size / 8);
+    std::move(dest->begin(), dest->begin() + first,
+              std::back_inserter(result));
+    std::move(merged.begin(), merged.end(), std::back_inserter(result));
+    std::move(dest->begin() + last, dest->end(), std::back_inserter(result));
+    *dest = std::move(result);
+    return;
+  }
+  size_t common = std::min(last - first, merged.size());
+  std::move(merged.begin(), merged.begin() + common, dest->begin() + first);
+  if (common < last - first) {
+    dest->erase(dest->begin() + first + common, dest->begin() + last);
+  } else {
+    dest->insert(dest->begin() + last,
+                 std::make_move_iterator(merged.begin() + common),
+                 std::make_move_iterator(merged.end()));
+  }
+}
+
+template <typename T, typename TAllocator>
+void MergeSortedRange(std::vector<T, TAllocator>* dest,
+                      std::vector<T>* to_add,
+                      std::vector<T>* to_remove) {
+  MergeSortedRange(dest, to_add, to_remove,
+                   [](T&& value) -> T { return std::move(value); });
 }
 
 template <typename T>
-void RemoveRangeWithGen(std::vector<WithGen<T>>* dest, const std::vector<T>& to_remove) {
-  dest->erase(std::remove_if(dest->begin(), dest->end(),
-                             [&](const WithGen<T>& t) {
-                               // TODO: make to_remove a set?
-                               return std::find(to_remove.begin(),
-                                                to_remove.end(),
-                                                t.value) != to_remove.end();
-                             }),
-              dest->end());
+void MergeSortedRangeWithGen(std::vector<WithGen<T>>* dest,
+                             std::vector<T>* to_add,
+                             std::vector<T>* to_remove,
+                             Generation gen) {
+  MergeSortedRange(dest, to_add, to_remove, [&](T&& value) -> WithGen<T> {
+    return WithGen<T>(gen, value);
+  });
+}
+
+// Drops the spare capacity of a reference list once a batch of merge updates,
+// which may update the same list many times, is applied. Most lists are not
+// modified again for a long time, and the slack left by removals can add up.
+// The room MergeSortedRange leaves to grow is kept, so that not every update
+// which grows a list reallocates all of it.
+template <typename T, typename TAllocator>
+void TrimCapacity(std::vector<T, TAllocator>* values) {
+  if (values->capacity() > values->size() + values->size() / 4)
+    values->shrink_to_fit();
 }
 
 void UpdateGen(QueryDatabase* db, WithGen<QueryFuncId>& ref) {
@@ -383,6 +584,11 @@ void UpdateGen(QueryDatabase* db, WithGen<QueryVarId>& ref) {
   ref.gen = db->vars[ref.value.id].gen;
 }
 
+void UpdateGen(QueryDatabase* db, QueryFuncRef& ref) {
+  if (ref.HasValue())
+    ref.gen = db->funcs[ref.id_.id].gen;
+}
+
 template <typename T>
 void UpdateGen(QueryDatabase* db, Maybe<T>& ref) {
   if (ref)
@@ -399,6 +605,7 @@ void UpdateGen(QueryDatabase* db, QueryFunc::Def& def) {
     UpdateGen(db, def.declaring_type);
     UpdateGen(db, def.base);
     UpdateGen(db, def.locals);
+    UpdateGen(db, def.callees);
 }
 
 void UpdateGen(QueryDatabase* db, QueryType::Def& def) {
@@ -413,50 +620,292 @@ void UpdateGen(QueryDatabase* db, QueryVar::Def& def) {
   UpdateGen(db, def.variable_type);
 }
 
+bool IsUnused(const QueryType& type) {
+  return !type.def && !type.symbol_idx && type.derived.empty() &&
+         type.instances.empty() && type.uses.empty();
+}
+bool IsUnused(const QueryFunc& func) {
+  return !func.def && !func.symbol_idx && func.declarations.empty() &&
+         func.derived.empty() && func.callers.empty();
+}
+bool IsUnused(const QueryVar& var) {
+  return !var.def && !var.symbol_idx && var.declarations.empty() &&
+         var.uses.empty();
+}
+
+// Releases |id| if |entry| is unused and still owns it. Returns true if it
+// was released.
+template <typename TId, typename TEntry>
+bool ReleaseIfUnused(UsrIdTable<TId>* table, TId id, const TEntry& entry) {
+  if (!IsUnused(entry))
+    return false;
+  // Released ids are unused until they are reused, so skip those.
+  Maybe<TId> owner = table->Get(entry.usr);
+  if (!owner || *owner != id)
+    return false;
+  table->Release(entry.usr);
+  return true;
+}
+
+// Makes the entry of a reused id describe |usr|. References to the previous
+// symbol become stale since the generation changes.
+template <typename TEntry>
+void ResetEntry(TEntry* entry, Usr usr) {
+  Generation gen = entry->gen + 1;
+  *entry = TEntry(usr);
+  entry->gen = gen;
+}
+
 }  // namespace
 
+FuncHierarchyCache::Closure FuncHierarchyCache::GetBases(QueryDatabase* db,
+                                                         QueryFuncId id) {
+  return Get(db, id, true);
+}
+
+FuncHierarchyCache::Closure FuncHierarchyCache::GetDerived(QueryDatabase* db,
+                                                           QueryFuncId id) {
+  return Get(db, id, false);
+}
+
+void FuncHierarchyCache::Invalidate(QueryFuncId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Table* table : {&bases_, &derived_}) {
+    auto it = table->dependents.find(id.id);
+    if (it == table->dependents.end())
+      continue;
+    for (RawId key : it->second)
+      table->closures.erase(key);
+    table->dependents.erase(it);
+  }
+}
+
+void FuncHierarchyCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  bases_ = Table();
+  derived_ = Table();
+}
+
+FuncHierarchyCache::Closure FuncHierarchyCache::Get(QueryDatabase* db,
+                                                    QueryFuncId id,
+                                                    bool bases) {
+  // Bounds the memory used by the closures of hierarchies which are not
+  // browsed anymore.
+  const size_t kMaxClosures = 8192;
+
+  Table& table = bases ? bases_ : derived_;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = table.closures.find(id.id);
+    if (it != table.closures.end())
+      return it->second;
+  }
+
+  // Readers hold |db->mutex| shared, so the links do not change while they
+  // are walked.
+  auto closure = std::make_shared<std::vector<QueryFuncId>>();
+  std::unordered_set<RawId> seen{id.id};
+  auto visit = [&](const QueryFunc& func) {
+    const std::vector<WithGen<QueryFuncId>>* links = &func.derived;
+    if (bases) {
+      if (!func.def)
+        return;
+      links = &func.def->base;
+    }
+    // Functions without a definition are not walked, but the closure still
+    // depends on them in case they get one.
+    for (const WithGen<QueryFuncId>& link : *links) {
+      if (seen.insert(link.value.id).second && db->funcs[link.value.id].def)
+        closure->push_back(link.value);
+    }
+  };
+  visit(db->funcs[id.id]);
+  for (size_t i = 0; i < closure->size(); i++)
+    visit(db->funcs[(*closure)[i].id]);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (table.closures.size() >= kMaxClosures) {
+    table.closures.clear();
+    table.dependents.clear();
+  }
+  table.closures[id.id] = closure;
+  for (RawId func_id : seen)
+    table.dependents[func_id].push_back(id.id);
+  return closure;
+}
+
+void QueryFile::BuildSymbolIndex() {
+  symbols_max_end.clear();
+  symbols_by_idx.clear();
+  if (!def)
+    return;
+
+  // Encode the uri here, on the querydb thread, so readers never write it.
+  uri = lsDocumentUri::FromPath(def->path);
+
+  std::vector<SymbolRef>& all_symbols = def->all_symbols;
+  auto by_start = [](const SymbolRef& a, const SymbolRef& b) {
+    return a.loc.range.start < b.loc.range.start;
+  };
+  if (!std::is_sorted(all_symbols.begin(), all_symbols.end(), by_start))
+    std::stable_sort(all_symbols.begin(), all_symbols.end(), by_start);
+
+  symbols_max_end.reserve(all_symbols.size());
+  for (const SymbolRef& ref : all_symbols) {
+    if (symbols_max_end.empty() || symbols_max_end.back() < ref.loc.range.end)
+      symbols_max_end.push_back(ref.loc.range.end);
+    else
+      symbols_max_end.push_back(symbols_max_end.back());
+  }
+
+  symbols_by_idx.resize(all_symbols.size());
+  for (size_t i = 0; i < all_symbols.size(); i++)
+    symbols_by_idx[i] = uint32_t(i);
+  std::stable_sort(symbols_by_idx.begin(), symbols_by_idx.end(),
+                   [&](uint32_t a, uint32_t b) {
+                     return all_symbols[a].idx < all_symbols[b].idx;
+                   });
+}
+
+std::vector<SymbolRef> QueryFile::GetOccurrences(
+    const SymbolIdx& symbol) const {
+  std::vector<SymbolRef> result;
+  if (!def || symbols_by_idx.size() != def->all_symbols.size())
+    return result;
+  const std::vector<SymbolRef>& all_symbols = def->all_symbols;
+  auto it = std::lower_bound(symbols_by_idx.begin(), symbols_by_idx.end(),
+                             symbol, [&](uint32_t i, const SymbolIdx& idx) {
+                               return all_symbols[i].idx < idx;
+                             });
+  for (; it != symbols_by_idx.end() && all_symbols[*it].idx == symbol; ++it)
+    result.push_back(all_symbols[*it]);
+  return result;
+}
+
 template <>
 bool Maybe<QueryLocation>::has_value() const {
   return storage.range.start.line >= 0;
 }
 
+Maybe<QueryFileId> QueryDatabase::GetImplementationFileFromPath(
+    const std::string& header_path) {
+  std::string path = NormalizedPath(header_path).path;
+  auto is_impl = [&](QueryFileId id) {
+    const QueryFile& file = files[id.id];
+    return file.def && NormalizedPath(file.def->path).path != path;
+  };
+  auto it = impl_file_by_header.find(path);
+  if (it != impl_file_by_header.end() && is_impl(it->second))
+    return it->second;
+  it = impl_file_by_stem.find(StripFileType(path));
+  if (it != impl_file_by_stem.end() && is_impl(it->second))
+    return it->second;
+  return nullopt;
+}
+
 Maybe<QueryFileId> QueryDatabase::GetQueryFileIdFromPath(
     const std::string& path) {
   return ::GetQueryFileIdFromPath(this, path, false);
 }
 
 Maybe<QueryTypeId> QueryDatabase::GetQueryTypeIdFromUsr(Usr usr) {
-  return ::GetQueryTypeIdFromUsr(this, usr, false);
+  Maybe<QueryTypeId> id = ::GetQueryTypeIdFromUsr(this, usr, false);
+  if (id && id->id >= types.size())
+    return nullopt;
+  return id;
 }
 
 Maybe<QueryFuncId> QueryDatabase::GetQueryFuncIdFromUsr(Usr usr) {
-  return ::GetQueryFuncIdFromUsr(this, usr, false);
+  Maybe<QueryFuncId> id = ::GetQueryFuncIdFromUsr(this, usr, false);
+  if (id && id->id >= funcs.size())
+    return nullopt;
+  return id;
 }
 
 Maybe<QueryVarId> QueryDatabase::GetQueryVarIdFromUsr(Usr usr) {
-  return ::GetQueryVarIdFromUsr(this, usr, false);
+  Maybe<QueryVarId> id = ::GetQueryVarIdFromUsr(this, usr, false);
+  if (id && id->id >= vars.size())
+    return nullopt;
+  return id;
 }
 
 IdMap::IdMap(QueryDatabase* query_db, const IdCache& local_ids)
-    : local_ids(local_ids) {
+    : query_db(query_db),
+      local_ids(local_ids),
+      id_lease(query_db->LeaseIds()) {
   // LOG_S(INFO) << "Creating IdMap for " << local_ids.primary_file;
-  primary_file =
-      *GetQueryFileIdFromPath(query_db, local_ids.primary_file, true);
 
-  cached_type_ids_.resize(local_ids.type_id_to_usr.size());
-  for (const auto& entry : local_ids.type_id_to_usr)
-    cached_type_ids_[entry.first] =
-        *GetQueryTypeIdFromUsr(query_db, entry.second, true);
+  // IdMaps are built on indexer threads while querydb serves requests. Files
+  // are looked up under a shared lock, and only a new file takes the
+  // exclusive lock.
+  {
+    SharedLock lock(query_db->mutex);
+    Maybe<QueryFileId> file =
+        GetQueryFileIdFromPath(query_db, local_ids.primary_file, false);
+    if (file)
+      primary_file = *file;
+  }
+  if (!primary_file.HasValue()) {
+    std::lock_guard<SharedMutex> lock(query_db->mutex);
+    primary_file =
+        *GetQueryFileIdFromPath(query_db, local_ids.primary_file, true);
+  }
 
-  cached_func_ids_.resize(local_ids.func_id_to_usr.size());
-  for (const auto& entry : local_ids.func_id_to_usr)
-    cached_func_ids_[entry.first] =
-        *GetQueryFuncIdFromUsr(query_db, entry.second, true);
+  // Symbol ids come from the concurrent usr tables and do not need the lock.
+  // All usrs of the file are looked up in one batch per table.
+  std::vector<QueryTypeId> type_ids;
+  query_db->usr_to_type.GetOrAllocateAll(local_ids.type_id_to_usr, &type_ids);
+  cached_type_ids_.reserve(type_ids.size());
+  for (size_t i = 0; i < type_ids.size(); i++)
+    cached_type_ids_[IndexTypeId(i)] = type_ids[i];
+
+  std::vector<QueryFuncId> func_ids;
+  query_db->usr_to_func.GetOrAllocateAll(local_ids.func_id_to_usr, &func_ids);
+  cached_func_ids_.reserve(func_ids.size());
+  for (size_t i = 0; i < func_ids.size(); i++)
+    cached_func_ids_[IndexFuncId(i)] = func_ids[i];
+
+  std::vector<QueryVarId> var_ids;
+  query_db->usr_to_var.GetOrAllocateAll(local_ids.var_id_to_usr, &var_ids);
+  cached_var_ids_.reserve(var_ids.size());
+  for (size_t i = 0; i < var_ids.size(); i++)
+    cached_var_ids_[IndexVarId(i)] = var_ids[i];
+}
 
-  cached_var_ids_.resize(local_ids.var_id_to_usr.size());
-  for (const auto& entry : local_ids.var_id_to_usr)
-    cached_var_ids_[entry.first] =
-        *GetQueryVarIdFromUsr(query_db, entry.second, true);
+std::vector<QueryFileId> IdMap::ToQueryFiles(
+    const std::vector<std::string>& paths) const {
+  // Like the primary file, which the constructor looks up, only files which
+  // are not known yet take the exclusive lock.
+  std::vector<QueryFileId> result(paths.size());
+  bool has_new_files = false;
+  {
+    SharedLock lock(query_db->mutex);
+    for (size_t i = 0; i < paths.size(); i++) {
+      Maybe<QueryFileId> file =
+          GetQueryFileIdFromPath(query_db, paths[i], false);
+      if (file)
+        result[i] = *file;
+      else
+        has_new_files = true;
+    }
+  }
+  if (!has_new_files)
+    return result;
+
+  std::lock_guard<SharedMutex> lock(query_db->mutex);
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (result[i].HasValue())
+      continue;
+    // Another thread may have created the file in between.
+    Maybe<QueryFileId> file = GetQueryFileIdFromPath(query_db, paths[i], false);
+    if (!file) {
+      file = GetQueryFileIdFromPath(query_db, paths[i], true);
+      // The file has no def until it is indexed itself.
+      query_db->files[file->id].def = nullopt;
+    }
+    result[i] = *file;
+  }
+  return result;
 }
 
 QueryLocation IdMap::ToQuery(Range range) const {
@@ -532,6 +981,9 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
                          IndexFile& previous_file,
                          IndexFile& current_file) {
 // This function runs on an indexer thread.
+  id_leases.push_back(previous_id_map.id_lease);
+  if (&previous_id_map != &current_id_map)
+    id_leases.push_back(current_id_map.id_lease);
 
 // |query_name| is the name of the variable on the query type.
 // |index_name| is the name of the variable on the index type.
@@ -759,10 +1211,32 @@ void IndexUpdate::Merge(const IndexUpdate& update) {
   INDEX_UPDATE_MERGE(vars_declarations);
   INDEX_UPDATE_MERGE(vars_uses);
 
+  INDEX_UPDATE_APPEND(id_leases);
+
 #undef INDEX_UPDATE_APPEND
 #undef INDEX_UPDATE_MERGE
 }
 
+size_t IndexUpdate::EstimateApplyCost() const {
+  size_t cost = files_removed.size() + files_def_update.size() +
+                types_removed.size() + types_def_update.size() +
+                funcs_removed.size() + funcs_def_update.size() +
+                vars_removed.size() + vars_def_update.size();
+#define INDEX_UPDATE_COST(name)                                         \
+  for (const auto& merge_update : name)                                 \
+    cost += merge_update.to_add.size() + merge_update.to_remove.size();
+  INDEX_UPDATE_COST(types_derived);
+  INDEX_UPDATE_COST(types_instances);
+  INDEX_UPDATE_COST(types_uses);
+  INDEX_UPDATE_COST(funcs_declarations);
+  INDEX_UPDATE_COST(funcs_derived);
+  INDEX_UPDATE_COST(funcs_callers);
+  INDEX_UPDATE_COST(vars_declarations);
+  INDEX_UPDATE_COST(vars_uses);
+#undef INDEX_UPDATE_COST
+  return cost;
+}
+
 std::string IndexUpdate::ToString() {
   rapidjson::StringBuffer output;
   rapidjson::Writer<rapidjson::StringBuffer> writer;
@@ -787,27 +1261,46 @@ bool NormalizedPath::operator!=(const NormalizedPath& rhs) const {
 // QUERYDB THREAD FUNCTIONS
 // ------------------------
 
+void QueryDatabase::Swap(QueryDatabase* other) {
+  symbols.swap(other->symbols);
+  symbol_search_index.Swap(other->symbol_search_index);
+  files.swap(other->files);
+  types.swap(other->types);
+  funcs.swap(other->funcs);
+  vars.swap(other->vars);
+  usr_to_file.swap(other->usr_to_file);
+  impl_file_by_stem.swap(other->impl_file_by_stem);
+  impl_file_by_header.swap(other->impl_file_by_header);
+  usr_to_type.Swap(other->usr_to_type);
+  usr_to_func.Swap(other->usr_to_func);
+  usr_to_var.Swap(other->usr_to_var);
+  free_symbols.swap(other->free_symbols);
+  func_hierarchy.Clear();
+  other->func_hierarchy.Clear();
+  reclaim_cursor = other->reclaim_cursor = 0;
+  reclaim_pending = other->reclaim_pending = true;
+  reclaimed_ids = other->reclaimed_ids = 0;
+  // Results cached at an older generation describe the other database.
+  generation = std::max(generation.load(), other->generation.load()) + 1;
+}
+
 void QueryDatabase::RemoveUsrs(SymbolKind usr_kind,
                                const std::vector<Usr>& to_remove) {
   // This function runs on the querydb thread.
 
   // When we remove an element, we just erase the state from the storage. We do
   // not update array indices because that would take a huge amount of time for
-  // a very large index.
-  //
-  // There means that there is some memory growth that will never be reclaimed,
-  // but it should be pretty minimal and is solved by simply restarting the
-  // indexer and loading from cache, which is a fast operation.
-  //
-  // TODO: Add "cquery: Reload Index" command which unloads all querydb state
-  // and fully reloads from cache. This will address the memory leak above.
+  // a very large index. The symbol is freed right away; the entry itself may
+  // still have references and is reused by ReclaimUnusedIds once it has none.
 
   switch (usr_kind) {
     case SymbolKind::Type: {
       for (const Usr& usr : to_remove) {
-        QueryType& type = types[usr_to_type[usr].id];
-        if (type.symbol_idx)
-          symbols[type.symbol_idx->id].kind = SymbolKind::Invalid;
+        Maybe<QueryTypeId> id = usr_to_type.Get(usr);
+        if (!id)
+          continue;
+        QueryType& type = types[id->id];
+        FreeSymbol(&type.symbol_idx);
         type.gen++;
         //type.def = QueryType::Def();
         type.def = nullopt;
@@ -816,9 +1309,11 @@ void QueryDatabase::RemoveUsrs(SymbolKind usr_kind,
     }
     case SymbolKind::Func: {
       for (const Usr& usr : to_remove) {
-        QueryFunc& func = funcs[usr_to_func[usr].id];
-        if (func.symbol_idx)
-          symbols[func.symbol_idx->id].kind = SymbolKind::Invalid;
+        Maybe<QueryFuncId> id = usr_to_func.Get(usr);
+        if (!id)
+          continue;
+        QueryFunc& func = funcs[id->id];
+        FreeSymbol(&func.symbol_idx);
         func.gen++;
         //func.def = QueryFunc::Def();
         func.def = nullopt;
@@ -827,9 +1322,11 @@ void QueryDatabase::RemoveUsrs(SymbolKind usr_kind,
     }
     case SymbolKind::Var: {
       for (const Usr& usr : to_remove) {
-        QueryVar& var = vars[usr_to_var[usr].id];
-        if (var.symbol_idx)
-          symbols[var.symbol_idx->id].kind = SymbolKind::Invalid;
+        Maybe<QueryVarId> id = usr_to_var.Get(usr);
+        if (!id)
+          continue;
+        QueryVar& var = vars[id->id];
+        FreeSymbol(&var.symbol_idx);
         var.gen++;
         //var.def = QueryVar::Def();
         var.def = nullopt;
@@ -842,6 +1339,21 @@ void QueryDatabase::RemoveUsrs(SymbolKind usr_kind,
   }
 }
 
+namespace {
+// Updates with at least this many entries are applied in parallel; below it
+// starting the threads costs more than it saves.
+const size_t kParallelApplyWorkSize = 20000;
+
+size_t GetApplyWorkSize(const IndexUpdate& update) {
+  return update.files_def_update.size() + update.types_def_update.size() +
+         update.types_derived.size() + update.types_instances.size() +
+         update.types_uses.size() + update.funcs_def_update.size() +
+         update.funcs_declarations.size() + update.funcs_derived.size() +
+         update.funcs_callers.size() + update.vars_def_update.size() +
+         update.vars_declarations.size() + update.vars_uses.size();
+}
+}  // namespace
+
 void QueryDatabase::ApplyIndexUpdate(IndexUpdate* update) {
 // This function runs on the querydb thread.
 
@@ -851,47 +1363,144 @@ void QueryDatabase::ApplyIndexUpdate(IndexUpdate* update) {
 //  MergeableUpdate<QueryTypeId, QueryTypeId> def                =>  QueryType
 //  def->def_var_name  =>  std::vector<QueryTypeId>
 #define HANDLE_MERGEABLE(update_var_name, def_var_name, storage_name) \
-  for (auto merge_update : update->update_var_name) {                 \
+  for (auto& merge_update : update->update_var_name) {                \
     auto& def = storage_name[merge_update.id.id];                     \
-    AddRange(&def.def_var_name, merge_update.to_add);                 \
-    RemoveRange(&def.def_var_name, merge_update.to_remove);           \
+    MergeSortedRange(&def.def_var_name, &merge_update.to_add,         \
+                     &merge_update.to_remove);                        \
     VerifyUnique(def.def_var_name);                                   \
-  }
+  }                                                                   \
+  for (auto& merge_update : update->update_var_name)                  \
+    TrimCapacity(&storage_name[merge_update.id.id].def_var_name);
 #define HANDLE_MERGEABLE_WITH_GEN(update_var_name, def_var_name, storage_name) \
-  for (auto merge_update : update->update_var_name) {                          \
+  for (auto& merge_update : update->update_var_name) {                         \
     auto& def = storage_name[merge_update.id.id];                              \
-    AddRangeWithGen(&def.def_var_name, merge_update.to_add, def.gen);          \
-    RemoveRangeWithGen(&def.def_var_name, merge_update.to_remove);             \
+    MergeSortedRangeWithGen(&def.def_var_name, &merge_update.to_add,           \
+                            &merge_update.to_remove, def.gen);                 \
     VerifyUnique(def.def_var_name);                                            \
     UpdateGen(this, def.def_var_name);                                         \
+  }                                                                            \
+  for (auto& merge_update : update->update_var_name)                           \
+    TrimCapacity(&storage_name[merge_update.id.id].def_var_name);
+
+  // |update| may refer to ids which IdMaps allocated since the last update.
+  CreateEntriesForNewIds();
+  reclaim_pending = true;
+  if (imported_files) {
+    for (const QueryFile::DefUpdate& def : update->files_def_update)
+      imported_files->push_back(def.value.path);
   }
 
-  for (const std::string& filename : update->files_removed)
-    files[usr_to_file[NormalizedPath(filename)].id].def = nullopt;
-  ImportOrUpdate(update->files_def_update);
+  for (const std::string& filename : update->files_removed) {
+    QueryFile& file = files[usr_to_file[NormalizedPath(filename)].id];
+    file.def = nullopt;
+    file.symbols_max_end.clear();
+    file.symbols_by_idx.clear();
+  }
 
   RemoveUsrs(SymbolKind::Type, update->types_removed);
-  ImportOrUpdate(update->types_def_update);
-  HANDLE_MERGEABLE_WITH_GEN(types_derived, derived, types);
-  HANDLE_MERGEABLE_WITH_GEN(types_instances, instances, types);
-  HANDLE_MERGEABLE(types_uses, uses, types);
-
   RemoveUsrs(SymbolKind::Func, update->funcs_removed);
-  ImportOrUpdate(update->funcs_def_update);
-  HANDLE_MERGEABLE(funcs_declarations, declarations, funcs);
-  HANDLE_MERGEABLE_WITH_GEN(funcs_derived, derived, funcs);
-  HANDLE_MERGEABLE(funcs_callers, callers, funcs);
-
   RemoveUsrs(SymbolKind::Var, update->vars_removed);
-  ImportOrUpdate(update->vars_def_update);
-  HANDLE_MERGEABLE(vars_declarations, declarations, vars);
-  HANDLE_MERGEABLE(vars_uses, uses, vars);
+
+  // Past the removals, the file defs and each of the type, func and var
+  // families only write their own storage and read the generations of the
+  // others, so large updates apply them in parallel. The symbol table is
+  // shared, so the symbols of the imported defs are updated afterwards.
+  std::vector<RawId> imported_file_ids;
+  std::vector<RawId> imported_type_ids;
+  std::vector<RawId> imported_func_ids;
+  std::vector<RawId> imported_var_ids;
+  std::function<void()> tasks[] = {
+      [&]() {
+        ImportOrUpdate(update->files_def_update, &imported_file_ids);
+      },
+      [&]() {
+        ImportOrUpdate(update->types_def_update, &imported_type_ids);
+        HANDLE_MERGEABLE_WITH_GEN(types_derived, derived, types);
+        HANDLE_MERGEABLE_WITH_GEN(types_instances, instances, types);
+        HANDLE_MERGEABLE(types_uses, uses, types);
+      },
+      [&]() {
+        ImportOrUpdate(update->funcs_def_update, &imported_func_ids);
+        HANDLE_MERGEABLE(funcs_declarations, declarations, funcs);
+        HANDLE_MERGEABLE_WITH_GEN(funcs_derived, derived, funcs);
+        for (auto& merge_update : update->funcs_callers)
+          UpdateGen(this, merge_update.to_add);
+        HANDLE_MERGEABLE(funcs_callers, callers, funcs);
+      },
+      [&]() {
+        ImportOrUpdate(update->vars_def_update, &imported_var_ids);
+        HANDLE_MERGEABLE(vars_declarations, declarations, vars);
+        HANDLE_MERGEABLE(vars_uses, uses, vars);
+      }};
+  if (GetApplyWorkSize(*update) >= kParallelApplyWorkSize) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::extent<decltype(tasks)>::value; i++)
+      threads.emplace_back(tasks[i]);
+    tasks[0]();
+    for (std::thread& thread : threads)
+      thread.join();
+  } else {
+    for (const std::function<void()>& task : tasks)
+      task();
+  }
+
+  for (RawId id : imported_file_ids) {
+    UpdateSymbols(&files[id].symbol_idx, SymbolKind::File, id);
+    UpdateImplementationFiles(QueryFileId(id));
+  }
+  for (RawId id : imported_type_ids)
+    UpdateSymbols(&types[id].symbol_idx, SymbolKind::Type, id);
+  for (RawId id : imported_func_ids)
+    UpdateSymbols(&funcs[id].symbol_idx, SymbolKind::Func, id);
+  for (RawId id : imported_var_ids)
+    UpdateSymbols(&vars[id].symbol_idx, SymbolKind::Var, id);
+
+  // Callers are not part of the memoized hierarchies; definitions (bases)
+  // and derived links are.
+  for (const Usr& usr : update->funcs_removed) {
+    if (Maybe<QueryFuncId> id = usr_to_func.Get(usr))
+      func_hierarchy.Invalidate(*id);
+  }
+  for (const QueryFunc::DefUpdate& def : update->funcs_def_update) {
+    if (Maybe<QueryFuncId> id = usr_to_func.Get(def.usr))
+      func_hierarchy.Invalidate(*id);
+  }
+  for (const QueryFunc::DerivedUpdate& derived : update->funcs_derived)
+    func_hierarchy.Invalidate(derived.id);
 
 #undef HANDLE_MERGEABLE
+#undef HANDLE_MERGEABLE_WITH_GEN
+
+  // Member tables depend on the definitions of the types and of their vars.
+  std::vector<RawId> member_types;
+  for (const Usr& usr : update->types_removed) {
+    if (Maybe<QueryTypeId> id = usr_to_type.Get(usr))
+      member_types.push_back(id->id);
+  }
+  for (const QueryType::DefUpdate& def : update->types_def_update) {
+    if (Maybe<QueryTypeId> id = usr_to_type.Get(def.usr))
+      member_types.push_back(id->id);
+  }
+  for (const QueryVar::DefUpdate& def : update->vars_def_update) {
+    Maybe<QueryVarId> id = usr_to_var.Get(def.usr);
+    if (!id)
+      continue;
+    const QueryVar& var = vars[id->id];
+    if (var.member_of)
+      member_types.push_back(var.member_of->id);
+  }
+  std::sort(member_types.begin(), member_types.end());
+  member_types.erase(std::unique(member_types.begin(), member_types.end()),
+                     member_types.end());
+  for (RawId id : member_types)
+    UpdateMembers(QueryTypeId(id));
+
+  generation++;
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryFile::DefUpdate>& updates) {
+    const std::vector<QueryFile::DefUpdate>& updates,
+    std::vector<RawId>* imported) {
   // This function runs on the querydb thread.
 
   for (auto& def : updates) {
@@ -901,79 +1510,134 @@ void QueryDatabase::ImportOrUpdate(
     QueryFile& existing = files[it->second.id];
 
     existing.def = def.value;
-    UpdateSymbols(&existing.symbol_idx, SymbolKind::File,
-                        it->second.id);
+    existing.BuildSymbolIndex();
+    imported->push_back(it->second.id);
+  }
+}
+
+namespace {
+// TODO: make file extensions configurable.
+bool IsHeaderFile(const std::string& path) {
+  return EndsWith(path, ".h") || EndsWith(path, ".hpp") ||
+         EndsWith(path, ".hh");
+}
+}  // namespace
+
+void QueryDatabase::UpdateImplementationFiles(QueryFileId id) {
+  const QueryFile::Def& def = *files[id.id].def;
+  std::string path = NormalizedPath(def.path).path;
+  if (IsHeaderFile(path))
+    return;
+  std::string stem = StripFileType(path);
+  impl_file_by_stem[stem] = id;
+
+  // Pair headers in other directories by their base name, eg. foo.cc with
+  // include/foo.h.
+  std::string base_name = GetBaseName(stem);
+  for (const QueryFile::Include& include : def.includes) {
+    std::string header = NormalizedPath(files[include.file.id].path).path;
+    if (IsHeaderFile(header) && GetBaseName(StripFileType(header)) == base_name)
+      impl_file_by_header[header] = id;
+  }
+}
+
+void QueryDatabase::UpdateMembers(QueryTypeId id) {
+  QueryType& type = types[id.id];
+  type.members.clear();
+  if (!type.def)
+    return;
+  type.members.reserve(type.def->vars.size());
+  for (const WithGen<QueryVarId>& var_id : type.def->vars) {
+    QueryVar& var = vars[var_id.value.id];
+    if (!var.def)
+      continue;
+    var.member_of = id;
+    QueryType::Member member;
+    member.var = var_id.value;
+    member.var_gen = var.gen;
+    if (var.def->variable_type) {
+      member.type = var.def->variable_type->value;
+      member.type_gen = types[member.type->id].gen;
+    }
+    member.definition_spelling = var.def->definition_spelling;
+    type.members.push_back(member);
   }
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryType::DefUpdate>& updates) {
+    const std::vector<QueryType::DefUpdate>& updates,
+    std::vector<RawId>* imported) {
   // This function runs on the querydb thread.
 
   for (auto& def : updates) {
     assert(!def.value.detailed_name.empty());
 
-    auto it = usr_to_type.find(def.usr);
-    assert(it != usr_to_type.end());
-
-    assert(it->second.id >= 0 && it->second.id < types.size());
-    QueryType& existing = types[it->second.id];
+    Maybe<QueryTypeId> maybe_id = usr_to_type.Get(def.usr);
+    assert(maybe_id);
+    if (!maybe_id)
+      continue;
+    RawId id = maybe_id->id;
+    assert(id < types.size());
+    QueryType& existing = types[id];
 
     // Keep the existing definition if it is higher quality.
     if (!(existing.def && existing.def->definition_spelling &&
           !def.value.definition_spelling)) {
       existing.def = def.value;
-      UpdateSymbols(&existing.symbol_idx, SymbolKind::Type,
-                    it->second.id);
+      imported->push_back(id);
     }
     UpdateGen(this, *existing.def);
   }
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryFunc::DefUpdate>& updates) {
+    const std::vector<QueryFunc::DefUpdate>& updates,
+    std::vector<RawId>* imported) {
   // This function runs on the querydb thread.
 
   for (auto& def : updates) {
     assert(!def.value.detailed_name.empty());
 
-    auto it = usr_to_func.find(def.usr);
-    assert(it != usr_to_func.end());
-
-    assert(it->second.id >= 0 && it->second.id < funcs.size());
-    QueryFunc& existing = funcs[it->second.id];
+    Maybe<QueryFuncId> maybe_id = usr_to_func.Get(def.usr);
+    assert(maybe_id);
+    if (!maybe_id)
+      continue;
+    RawId id = maybe_id->id;
+    assert(id < funcs.size());
+    QueryFunc& existing = funcs[id];
 
     // Keep the existing definition if it is higher quality.
     if (!(existing.def && existing.def->definition_spelling &&
           !def.value.definition_spelling)) {
       existing.def = def.value;
-      UpdateSymbols(&existing.symbol_idx, SymbolKind::Func,
-                    it->second.id);
+      imported->push_back(id);
     }
     UpdateGen(this, *existing.def);
   }
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryVar::DefUpdate>& updates) {
+    const std::vector<QueryVar::DefUpdate>& updates,
+    std::vector<RawId>* imported) {
   // This function runs on the querydb thread.
 
   for (auto& def : updates) {
     assert(!def.value.detailed_name.empty());
 
-    auto it = usr_to_var.find(def.usr);
-    assert(it != usr_to_var.end());
-
-    assert(it->second.id >= 0 && it->second.id < vars.size());
-    QueryVar& existing = vars[it->second.id];
+    Maybe<QueryVarId> maybe_id = usr_to_var.Get(def.usr);
+    assert(maybe_id);
+    if (!maybe_id)
+      continue;
+    RawId id = maybe_id->id;
+    assert(id < vars.size());
+    QueryVar& existing = vars[id];
 
     // Keep the existing definition if it is higher quality.
     if (!(existing.def && existing.def->definition_spelling &&
           !def.value.definition_spelling)) {
       existing.def = def.value;
       if (!def.value.is_local())
-        UpdateSymbols(&existing.symbol_idx, SymbolKind::Var,
-                      it->second.id);
+        imported->push_back(id);
     }
     UpdateGen(this, *existing.def);
   }
@@ -983,9 +1647,102 @@ void QueryDatabase::UpdateSymbols(Maybe<Id<void>>* symbol_idx,
                                   SymbolKind kind,
                                   RawId idx) {
   if (!symbol_idx->has_value()) {
-    *symbol_idx = Id<void>(symbols.size());
-    symbols.push_back(SymbolIdx(kind, idx));
+    if (!free_symbols.empty()) {
+      *symbol_idx = Id<void>(free_symbols.back());
+      free_symbols.pop_back();
+      symbols[(*symbol_idx)->id] = SymbolIdx(kind, idx);
+    } else {
+      *symbol_idx = Id<void>(symbols.size());
+      symbols.push_back(SymbolIdx(kind, idx));
+    }
   }
+  // The definition may have been replaced, so refresh the name index. This is
+  // cheap if the names did not change.
+  RawId id = (*symbol_idx)->id;
+  symbol_search_index.Update(id, GetSymbolDetailedName(id),
+                             GetSymbolShortName(id));
+}
+
+void QueryDatabase::FreeSymbol(Maybe<Id<void>>* symbol_idx) {
+  if (!symbol_idx->has_value())
+    return;
+  RawId id = (*symbol_idx)->id;
+  symbols[id].kind = SymbolKind::Invalid;
+  symbol_search_index.Remove(id);
+  free_symbols.push_back(id);
+  *symbol_idx = Maybe<Id<void>>();
+}
+
+void QueryDatabase::CreateEntriesForNewIds() {
+  usr_to_type.ForEachAllocated(
+      types.size(), [&](Usr usr) { types.push_back(QueryType(usr)); });
+  usr_to_func.ForEachAllocated(
+      funcs.size(), [&](Usr usr) { funcs.push_back(QueryFunc(usr)); });
+  usr_to_var.ForEachAllocated(
+      vars.size(), [&](Usr usr) { vars.push_back(QueryVar(usr)); });
+
+  usr_to_type.TakeReused(
+      [&](QueryTypeId id, Usr usr) { ResetEntry(&types[id.id], usr); });
+  usr_to_func.TakeReused([&](QueryFuncId id, Usr usr) {
+    ResetEntry(&funcs[id.id], usr);
+    func_hierarchy.Invalidate(id);
+  });
+  usr_to_var.TakeReused(
+      [&](QueryVarId id, Usr usr) { ResetEntry(&vars[id.id], usr); });
+}
+
+std::shared_ptr<void> QueryDatabase::LeaseIds() {
+  std::lock_guard<std::mutex> lock(id_lease_mutex);
+  id_leases++;
+  return std::shared_ptr<void>(this, [](void* self) {
+    QueryDatabase* db = static_cast<QueryDatabase*>(self);
+    std::lock_guard<std::mutex> lock(db->id_lease_mutex);
+    if (--db->id_leases == 0)
+      db->id_leases_released.notify_all();
+  });
+}
+
+bool QueryDatabase::ReclaimUnusedIds() {
+  // Holding the lease mutex keeps IdMaps from looking up ids meanwhile.
+  std::lock_guard<std::mutex> lease_lock(id_lease_mutex);
+  if (id_leases > 0 || (!reclaim_pending && reclaim_cursor == 0))
+    return false;
+  std::lock_guard<SharedMutex> lock(mutex);
+  // Entries of reused ids still describe the previous usr until they are
+  // reset, and must not be released again.
+  CreateEntriesForNewIds();
+  if (reclaim_cursor == 0)
+    reclaim_pending = false;
+
+  // Small batches, so that requests arriving meanwhile are not delayed.
+  const size_t kBatchSize = 20000;
+  size_t end = std::min(reclaim_cursor + kBatchSize,
+                        types.size() + funcs.size() + vars.size());
+  for (size_t i = reclaim_cursor; i < end; i++) {
+    if (i < types.size()) {
+      reclaimed_ids += ReleaseIfUnused(&usr_to_type, QueryTypeId(i), types[i]);
+      continue;
+    }
+    size_t func = i - types.size();
+    if (func < funcs.size()) {
+      if (ReleaseIfUnused(&usr_to_func, QueryFuncId(func), funcs[func])) {
+        func_hierarchy.Invalidate(QueryFuncId(func));
+        reclaimed_ids++;
+      }
+      continue;
+    }
+    size_t var = func - funcs.size();
+    reclaimed_ids += ReleaseIfUnused(&usr_to_var, QueryVarId(var), vars[var]);
+  }
+
+  reclaim_cursor = end;
+  if (end < types.size() + funcs.size() + vars.size())
+    return true;
+  if (reclaimed_ids)
+    LOG_S(INFO) << "Released " << reclaimed_ids << " unused symbol ids";
+  reclaim_cursor = 0;
+  reclaimed_ids = 0;
+  return false;
 }
 
 std::string_view QueryDatabase::GetSymbolDetailedName(RawId symbol_idx) const {
@@ -1044,8 +1801,11 @@ TEST_SUITE("query") {
     QueryDatabase db;
     IdMap previous_map(&db, previous.id_cache);
     IdMap current_map(&db, current.id_cache);
-    return IndexUpdate::CreateDelta(&previous_map, &current_map, &previous,
-                                    &current);
+    IndexUpdate update = IndexUpdate::CreateDelta(&previous_map, &current_map,
+                                                  &previous, &current);
+    // The leases refer to |db|, which does not outlive this function.
+    update.id_leases.clear();
+    return update;
   }
 
   TEST_CASE("remove defs") {
@@ -1131,6 +1891,52 @@ TEST_SUITE("query") {
     REQUIRE(update.types_uses[0].to_add[0].range == Range(Position(2, 0)));
   }
 
+  TEST_CASE("merge cancels re-added values") {
+    IndexFile a("foo.cc", "<empty>");
+    IndexFile b("foo.cc", "<empty>");
+    a.Resolve(a.ToTypeId(HashUsr("usr")))
+        ->uses.push_back(Range(Position(1, 0)));
+    b.Resolve(b.ToTypeId(HashUsr("usr")))
+        ->uses.push_back(Range(Position(2, 0)));
+
+    IndexUpdate update = GetDelta(a, b);
+    update.Merge(GetDelta(b, a));
+    REQUIRE(update.types_uses.size() == 1);
+    REQUIRE(update.types_uses[0].to_add.empty());
+    REQUIRE(update.types_uses[0].to_remove.empty());
+  }
+
+  TEST_CASE("merge sorted range") {
+    auto loc = [](int line) {
+      return QueryLocation(QueryFileId(0), Range(Position(line, 0)));
+    };
+    std::vector<QueryLocation> dest;
+    std::vector<QueryLocation> to_add = {loc(5), loc(1), loc(3)};
+    std::vector<QueryLocation> to_remove;
+    MergeSortedRange(&dest, &to_add, &to_remove);
+    REQUIRE(dest == std::vector<QueryLocation>({loc(1), loc(3), loc(5)}));
+
+    // Values which are both added and removed end up removed.
+    to_add = {loc(4), loc(2)};
+    to_remove = {loc(5), loc(2), loc(1)};
+    MergeSortedRange(&dest, &to_add, &to_remove);
+    REQUIRE(dest == std::vector<QueryLocation>({loc(3), loc(4)}));
+
+    // Only the run of the updated file changes.
+    std::vector<QueryLocation> other = {
+        QueryLocation(QueryFileId(1), Range(Position(1, 0))),
+        QueryLocation(QueryFileId(1), Range(Position(2, 0)))};
+    to_remove.clear();
+    MergeSortedRange(&dest, &other, &to_remove);
+    to_add = {loc(6)};
+    to_remove = {loc(3)};
+    MergeSortedRange(&dest, &to_add, &to_remove);
+    REQUIRE(dest.size() == 4);
+    REQUIRE(dest[0] == loc(4));
+    REQUIRE(dest[1] == loc(6));
+    REQUIRE(dest[3].path == QueryFileId(1));
+  }
+
   TEST_CASE("apply delta") {
     IndexFile previous("foo.cc", "<empty>");
     IndexFile current("foo.cc", "<empty>");
@@ -1149,7 +1955,10 @@ TEST_SUITE("query") {
     QueryDatabase db;
     IdMap previous_map(&db, previous.id_cache);
     IdMap current_map(&db, current.id_cache);
-    REQUIRE(db.funcs.size() == 1);
+    // IdMaps only allocate ids, the storage is created by ApplyIndexUpdate.
+    REQUIRE(db.funcs.empty());
+    REQUIRE(previous_map.ToQuery(IndexFuncId(0)) ==
+            current_map.ToQuery(IndexFuncId(0)));
 
     IndexUpdate import_update =
         IndexUpdate::CreateDelta(nullptr, &previous_map, nullptr, &previous);
@@ -1157,6 +1966,7 @@ TEST_SUITE("query") {
         &previous_map, &current_map, &previous, &current);
 
     db.ApplyIndexUpdate(&import_update);
+    REQUIRE(db.funcs.size() == 1);
     REQUIRE(db.funcs[0].callers.size() == 2);
     REQUIRE(db.funcs[0].callers[0].loc.range == Range(Position(1, 0)));
     REQUIRE(db.funcs[0].callers[1].loc.range == Range(Position(2, 0)));
@@ -1166,4 +1976,103 @@ TEST_SUITE("query") {
     REQUIRE(db.funcs[0].callers[0].loc.range == Range(Position(4, 0)));
     REQUIRE(db.funcs[0].callers[1].loc.range == Range(Position(5, 0)));
   }
+
+  TEST_CASE("file occurrences") {
+    QueryFile file("foo.cc");
+    SymbolIdx a(SymbolKind::Func, 0);
+    SymbolIdx b(SymbolKind::Var, 1);
+    QueryFileId file_id(0);
+    for (int line : {3, 1, 2}) {
+      file.def->all_symbols.push_back(
+          SymbolRef(line == 2 ? b : a, SymbolRole::Reference,
+                    QueryLocation(file_id, Range(Position(line, 0)))));
+    }
+    file.BuildSymbolIndex();
+
+    std::vector<SymbolRef> occurrences = file.GetOccurrences(a);
+    REQUIRE(occurrences.size() == 2);
+    REQUIRE(occurrences[0].loc.range == Range(Position(1, 0)));
+    REQUIRE(occurrences[1].loc.range == Range(Position(3, 0)));
+    REQUIRE(file.GetOccurrences(b).size() == 1);
+    REQUIRE(file.GetOccurrences(SymbolIdx(SymbolKind::Type, 0)).empty());
+  }
+
+  TEST_CASE("file uri") {
+    QueryFile file("/foo/a b.cc");
+    file.BuildSymbolIndex();
+    REQUIRE(file.uri == lsDocumentUri::FromPath("/foo/a b.cc"));
+    file.def->path = "/foo/c.cc";
+    file.BuildSymbolIndex();
+    REQUIRE(file.GetUri() == lsDocumentUri::FromPath("/foo/c.cc"));
+  }
+
+  TEST_CASE("usr id table") {
+    UsrIdTable<QueryTypeId> table;
+    REQUIRE(!table.Get(1));
+    QueryTypeId a = table.GetOrAllocate(1);
+    QueryTypeId b = table.GetOrAllocate(uint64_t(1) << 63);
+    REQUIRE(a == QueryTypeId(0));
+    REQUIRE(b == QueryTypeId(1));
+    REQUIRE(table.GetOrAllocate(1) == a);
+    REQUIRE(*table.Get(uint64_t(1) << 63) == b);
+
+    std::vector<uint64_t> allocated;
+    table.ForEachAllocated(1, [&](uint64_t usr) { allocated.push_back(usr); });
+    REQUIRE(allocated == std::vector<uint64_t>{uint64_t(1) << 63});
+
+    table.Release(1);
+    REQUIRE(!table.Get(1));
+    REQUIRE(table.GetOrAllocate(2) == a);
+    std::vector<uint64_t> reused;
+    table.TakeReused([&](QueryTypeId id, uint64_t usr) {
+      REQUIRE(id == a);
+      reused.push_back(usr);
+    });
+    REQUIRE(reused == std::vector<uint64_t>{2});
+
+    std::vector<QueryTypeId> ids;
+    table.GetOrAllocateAll({3, uint64_t(1) << 63, 2, 3}, &ids);
+    REQUIRE(ids == std::vector<QueryTypeId>({QueryTypeId(2), b, a,
+                                             QueryTypeId(2)}));
+    REQUIRE(*table.Get(3) == QueryTypeId(2));
+  }
+
+  TEST_CASE("reclaim unused ids") {
+    IndexFile previous("foo.cc", "<empty>");
+    IndexFile current("foo.cc", "<empty>");
+    IndexType* type = previous.Resolve(previous.ToTypeId(HashUsr("usr1")));
+    type->def.detailed_name = "a";
+    type->def.short_name_size = 1;
+    type->def.definition_spelling = Range(Position(1, 0));
+
+    QueryDatabase db;
+    {
+      IdMap previous_map(&db, previous.id_cache);
+      IdMap current_map(&db, current.id_cache);
+      IndexUpdate import_update =
+          IndexUpdate::CreateDelta(nullptr, &previous_map, nullptr, &previous);
+      IndexUpdate delta_update = IndexUpdate::CreateDelta(
+          &previous_map, &current_map, &previous, &current);
+      db.ApplyIndexUpdate(&import_update);
+      REQUIRE(db.types[0].symbol_idx);
+      db.ApplyIndexUpdate(&delta_update);
+      REQUIRE(!db.types[0].def);
+      // Nothing is released while an IdMap may still refer to the id.
+      REQUIRE(!db.ReclaimUnusedIds());
+      REQUIRE(db.usr_to_type.Get(HashUsr("usr1")));
+    }
+    REQUIRE(!db.ReclaimUnusedIds());
+    REQUIRE(!db.usr_to_type.Get(HashUsr("usr1")));
+    REQUIRE(db.free_symbols.size() == 1);
+
+    IndexFile other("bar.cc", "<empty>");
+    other.Resolve(other.ToTypeId(HashUsr("usr2")));
+    IdMap other_map(&db, other.id_cache);
+    REQUIRE(other_map.ToQuery(IndexTypeId(0)) == QueryTypeId(0));
+    IndexUpdate other_update =
+        IndexUpdate::CreateDelta(nullptr, &other_map, nullptr, &other);
+    db.ApplyIndexUpdate(&other_update);
+    REQUIRE(db.types.size() == 1);
+    REQUIRE(db.types[0].usr == HashUsr("usr2"));
+  }
 }
@@ -1,11 +1,21 @@
 #pragma once
 
 #include "indexer.h"
+#include "interned_string.h"
+#include "paged_allocator.h"
 #include "serializer.h"
+#include "shared_mutex.h"
+#include "symbol_search_index.h"
+#include "usr_id_table.h"
 
 #include <sparsepp/spp.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 struct QueryFile;
 struct QueryType;
@@ -44,6 +54,10 @@ struct WithGen {
 
 template <typename TVisitor, typename T>
 void Reflect(TVisitor& visitor, WithGen<T>& value) {
+  // Only the binary format, which querydb snapshots use, keeps the generation
+  // so that stale references stay stale after a restart.
+  if (visitor.Format() == SerializeFormat::Binary)
+    Reflect(visitor, value.gen);
   Reflect(visitor, value.value);
 }
 
@@ -56,7 +70,7 @@ struct QueryLocation {
 
   QueryLocation OffsetStartColumn(int16_t offset) const {
     QueryLocation result = *this;
-    result.range.start.column += offset;
+    result.range.start.AddColumn(offset);
     return result;
   }
 
@@ -127,13 +141,17 @@ struct SymbolRef {
     return loc < that.loc;
   }
 };
-MAKE_REFLECT_STRUCT(SymbolRef, idx, loc);
+MAKE_REFLECT_STRUCT(SymbolRef, idx, role, loc);
 
 struct QueryFuncRef {
   // NOTE: id_ can be -1 if the function call is not coming from a function.
   QueryFuncId id_;
   QueryLocation loc;
   bool is_implicit = false;
+  // Generation of |id_| when the ref was added to querydb. Ids of removed
+  // funcs are reused, so the ref is stale if the generations differ. Not part
+  // of the identity of the ref.
+  Generation gen = Generation(-1);
 
   bool HasValue() const { return id_.HasValue(); }
 
@@ -146,15 +164,17 @@ struct QueryFuncRef {
            is_implicit == that.is_implicit;
   }
   bool operator!=(const QueryFuncRef& that) const { return !(*this == that); }
+  // Ordered by location first so that the callers from one file are
+  // contiguous in sorted lists.
   bool operator<(const QueryFuncRef& that) const {
-    if (id_ != that.id_)
-      return id_ < that.id_;
     if (loc != that.loc)
       return loc < that.loc;
+    if (id_ != that.id_)
+      return id_ < that.id_;
     return is_implicit < that.is_implicit;
   }
 };
-MAKE_REFLECT_STRUCT(QueryFuncRef, id_, loc, is_implicit);
+MAKE_REFLECT_STRUCT(QueryFuncRef, id_, loc, is_implicit, gen);
 
 // There are two sources of reindex updates: the (single) definition of a
 // symbol has changed, or one of many users of the symbol has changed.
@@ -221,25 +241,40 @@ void Reflect(TVisitor& visitor, WithUsr<T>& value) {
 template <typename T>
 struct WithFileContent {
   T value;
-  std::string file_content;
-
-  WithFileContent(const T& value, const std::string& file_content) : value(value), file_content(file_content) {}
+  // Shared by the merged updates and the working file, since the content is
+  // only read. Null for indexes loaded from the cache, which do not carry
+  // their content.
+  std::shared_ptr<const std::string> file_content;
+  // HashStorageKey of the content, or 0 if unknown.
+  uint64_t file_content_hash = 0;
+
+  WithFileContent(const T& value,
+                  std::shared_ptr<const std::string> file_content,
+                  uint64_t file_content_hash)
+      : value(value),
+        file_content(std::move(file_content)),
+        file_content_hash(file_content_hash) {}
 };
 template <typename TVisitor, typename T>
 void Reflect(TVisitor& visitor, WithFileContent<T>& value) {
   REFLECT_MEMBER_START();
   REFLECT_MEMBER(value);
-  REFLECT_MEMBER(file_content);
+  REFLECT_MEMBER(file_content_hash);
   REFLECT_MEMBER_END();
 }
 
 struct QueryFile {
+  // IndexInclude with the included file resolved to its id.
+  struct Include {
+    int line = 0;
+    QueryFileId file;
+  };
   struct Def {
     std::string path;
     // Language identifier
     std::string language;
     // Includes in the file.
-    std::vector<IndexInclude> includes;
+    std::vector<Include> includes;
     // Outline of the file (ie, for code lens).
     std::vector<SymbolRef> outline;
     // Every symbol found in the file (ie, for goto definition)
@@ -247,22 +282,48 @@ struct QueryFile {
     // Parts of the file which are disabled.
     std::vector<Range> inactive_regions;
     // Used by |$cquery/freshenIndex|.
-    std::vector<std::string> dependencies;
+    std::vector<QueryFileId> dependencies;
   };
 
   using DefUpdate = WithFileContent<Def>;
 
+  // Also known while there is no |def|, ie, for files which were removed or
+  // which indexed files only depend on. |def->path| is the same.
+  std::string path;
   optional<Def> def;
   Maybe<Id<void>> symbol_idx;
-
-  explicit QueryFile(const std::string& path) {
+  // |symbols_max_end[i]| is the maximum end position of
+  // |def->all_symbols[0..i]|. Together with |all_symbols| being sorted by start
+  // position this forms an interval index, so FindSymbolsAtLocation can find
+  // the symbols containing a position without scanning the whole file. Rebuilt
+  // by |BuildSymbolIndex| whenever |def| is replaced.
+  std::vector<Position> symbols_max_end;
+  // Indices of |def->all_symbols| ordered by symbol, and then by position, so
+  // the occurrences of a symbol in this file are found without going through
+  // the uses of the symbol in every file. Rebuilt with |symbols_max_end|.
+  std::vector<uint32_t> symbols_by_idx;
+  // |def->path| as a uri, which most location results refer to. Only the
+  // querydb thread writes it, when |def| is replaced; see BuildSymbolIndex.
+  lsDocumentUri uri;
+
+  explicit QueryFile(const std::string& path) : path(path) {
     def = Def();
     def->path = path;
+    uri = lsDocumentUri::FromPath(path);
   }
+
+  void BuildSymbolIndex();
+  // Returns the uri of |def->path|. Read-only, so it is safe from reader
+  // threads holding a shared lock on the database.
+  const lsDocumentUri& GetUri() const { return uri; }
+  // Returns the occurrences of |symbol| in this file, ordered by position.
+  std::vector<SymbolRef> GetOccurrences(const SymbolIdx& symbol) const;
 };
+MAKE_REFLECT_STRUCT(QueryFile::Include, line, file);
 MAKE_REFLECT_STRUCT(QueryFile::Def,
                     path,
                     language,
+                    includes,
                     outline,
                     all_symbols,
                     inactive_regions,
@@ -272,7 +333,8 @@ struct QueryType {
   using Def = TypeDefDefinitionData<WithGen<QueryTypeId>,
                                     WithGen<QueryFuncId>,
                                     WithGen<QueryVarId>,
-                                    QueryLocation>;
+                                    QueryLocation,
+                                    InternedString>;
   using DefUpdate = WithUsr<Def>;
   using DerivedUpdate = MergeableUpdate<QueryTypeId, QueryTypeId>;
   using InstancesUpdate = MergeableUpdate<QueryTypeId, QueryVarId>;
@@ -284,7 +346,24 @@ struct QueryType {
   optional<Def> def;
   std::vector<WithGen<QueryTypeId>> derived;
   std::vector<WithGen<QueryVarId>> instances;
-  std::vector<QueryLocation> uses;
+  // The reference lists of every entity are the bulk of querydb, and are kept
+  // in paged storage.
+  PagedVector<QueryLocation> uses;
+
+  // |def->vars| flattened with the type and definition of each var, so that
+  // member hierarchies are expanded without resolving every member. Rebuilt
+  // by QueryDatabase::UpdateMembers.
+  struct Member {
+    QueryVarId var;
+    // Generation of |var| when the entry was made. The entry is stale if the
+    // var has been removed since.
+    Generation var_gen;
+    Maybe<QueryTypeId> type;
+    // Generation of |type|, which is stale like |var|.
+    Generation type_gen;
+    Maybe<QueryLocation> definition_spelling;
+  };
+  std::vector<Member> members;
 
   explicit QueryType(const Usr& usr) : usr(usr), gen(0) {}
 };
@@ -294,7 +373,8 @@ struct QueryFunc {
                                     WithGen<QueryFuncId>,
                                     WithGen<QueryVarId>,
                                     QueryFuncRef,
-                                    QueryLocation>;
+                                    QueryLocation,
+                                    InternedString>;
   using DefUpdate = WithUsr<Def>;
   using DeclarationsUpdate = MergeableUpdate<QueryFuncId, QueryLocation>;
   using DerivedUpdate = MergeableUpdate<QueryFuncId, QueryFuncId>;
@@ -306,7 +386,7 @@ struct QueryFunc {
   optional<Def> def;
   std::vector<QueryLocation> declarations;
   std::vector<WithGen<QueryFuncId>> derived;
-  std::vector<QueryFuncRef> callers;
+  PagedVector<QueryFuncRef> callers;
 
   explicit QueryFunc(const Usr& usr) : usr(usr), gen(0) {}
 };
@@ -315,7 +395,8 @@ struct QueryVar {
   using Def = VarDefDefinitionData<WithGen<QueryTypeId>,
                                    WithGen<QueryFuncId>,
                                    WithGen<QueryVarId>,
-                                   QueryLocation>;
+                                   QueryLocation,
+                                   InternedString>;
   using DefUpdate = WithUsr<Def>;
   using DeclarationsUpdate = MergeableUpdate<QueryVarId, QueryLocation>;
   using UsesUpdate = MergeableUpdate<QueryVarId, QueryLocation>;
@@ -325,7 +406,10 @@ struct QueryVar {
   Maybe<Id<void>> symbol_idx;
   optional<Def> def;
   std::vector<QueryLocation> declarations;
-  std::vector<QueryLocation> uses;
+  PagedVector<QueryLocation> uses;
+  // Type whose QueryType::members contain this var, which are rebuilt when
+  // the definition of the var changes.
+  Maybe<QueryTypeId> member_of;
 
   explicit QueryVar(const Usr& usr) : usr(usr), gen(0) {}
 };
@@ -342,6 +426,10 @@ struct IndexUpdate {
   // work can be parallelized.
   void Merge(const IndexUpdate& update);
 
+  // Rough measure of the work ApplyIndexUpdate does for this update: the
+  // number of defs and references it adds or removes.
+  size_t EstimateApplyCost() const;
+
   // Dump the update to a string.
   std::string ToString();
 
@@ -369,6 +457,10 @@ struct IndexUpdate {
   std::vector<QueryVar::DeclarationsUpdate> vars_declarations;
   std::vector<QueryVar::UsesUpdate> vars_uses;
 
+  // Leases of the IdMaps the update was built with, see
+  // QueryDatabase::LeaseIds.
+  std::vector<std::shared_ptr<void>> id_leases;
+
  private:
   // Creates an index update assuming that |previous| is already
   // in the index, so only the delta between |previous| and |current|
@@ -405,11 +497,50 @@ struct NormalizedPath {
 };
 MAKE_HASHABLE(NormalizedPath, t.path);
 
+// Memoized transitive closures of the base and derived links of functions, so
+// browsing a call or type hierarchy does not walk it again for every entry.
+// A closure lists the functions with a definition reachable from a function,
+// breadth-first and without duplicates or the function itself. Safe to use
+// from querydb reader threads.
+struct FuncHierarchyCache {
+  using Closure = std::shared_ptr<const std::vector<QueryFuncId>>;
+
+  Closure GetBases(QueryDatabase* db, QueryFuncId id);
+  Closure GetDerived(QueryDatabase* db, QueryFuncId id);
+  // Drops the closures which go through |id|. Called when the links or the
+  // definition of |id| change.
+  void Invalidate(QueryFuncId id);
+  void Clear();
+
+ private:
+  struct Table {
+    std::unordered_map<RawId, Closure> closures;
+    // Keys of |closures| going through each function, including the key.
+    std::unordered_map<RawId, std::vector<RawId>> dependents;
+  };
+  Closure Get(QueryDatabase* db, QueryFuncId id, bool bases);
+
+  std::mutex mutex_;
+  Table bases_;
+  Table derived_;
+};
+
 // The query database is heavily optimized for fast queries. It is stored
 // in-memory.
 struct QueryDatabase {
+  // Read-only message handlers running on querydb reader threads hold this
+  // shared. The querydb thread holds it exclusively while it handles the
+  // other messages, and for each index update it imports.
+  SharedMutex mutex;
+  // Incremented after each ApplyIndexUpdate. A reader holding |mutex| sees a
+  // single generation; results computed from the database can be cached and
+  // reused as long as the generation they were computed at is current.
+  std::atomic<Generation> generation{0};
+
   // All File/Func/Type/Var symbols.
   std::vector<SymbolIdx> symbols;
+  // Name index over |symbols| for workspace/symbol.
+  SymbolSearchIndex symbol_search_index;
 
   // Raw data storage. Accessible via SymbolIdx instances.
   std::vector<QueryFile> files;
@@ -417,26 +548,86 @@ struct QueryDatabase {
   std::vector<QueryFunc> funcs;
   std::vector<QueryVar> vars;
 
-  // Lookup symbol based on a usr.
+  // Lookup symbol based on a usr. Symbol ids are allocated by IdMaps on
+  // indexer threads without holding |mutex|; the entries for them are created
+  // by ApplyIndexUpdate, so an id may not have storage yet.
   spp::sparse_hash_map<NormalizedPath, QueryFileId> usr_to_file;
-  spp::sparse_hash_map<Usr, QueryTypeId> usr_to_type;
-  spp::sparse_hash_map<Usr, QueryFuncId> usr_to_func;
-  spp::sparse_hash_map<Usr, QueryVarId> usr_to_var;
+  UsrIdTable<QueryTypeId> usr_to_type;
+  UsrIdTable<QueryFuncId> usr_to_func;
+  UsrIdTable<QueryVarId> usr_to_var;
+
+  // Implementation files of headers, for code actions which add definitions.
+  // Source files are found by their normalized path without the extension,
+  // and by the headers with the same base name which they include. Entries
+  // may be stale, so check that the file still has a def.
+  spp::sparse_hash_map<std::string, QueryFileId> impl_file_by_stem;
+  spp::sparse_hash_map<std::string, QueryFileId> impl_file_by_header;
+
+  FuncHierarchyCache func_hierarchy;
+
+  // Symbol ids which RemoveUsrs freed and UpdateSymbols reuses.
+  std::vector<RawId> free_symbols;
+
+  // Type, func and var ids are reused once the symbol has neither a
+  // definition nor references, so that a long running server does not grow
+  // without bound. IdMaps and the IndexUpdates built from them refer to ids
+  // without holding |mutex|, so they hold a lease and no id is released while
+  // any lease exists.
+  std::mutex id_lease_mutex;
+  int id_leases = 0;
+  // Notified when |id_leases| drops to 0.
+  std::condition_variable id_leases_released;
+  // Position of ReclaimUnusedIds in types, funcs and vars, and whether updates
+  // were applied since it last started.
+  size_t reclaim_cursor = 0;
+  bool reclaim_pending = false;
+  size_t reclaimed_ids = 0;
+
+  // While set, ApplyIndexUpdate adds the path of every file it imports. Used
+  // by $cquery/reloadIndex to catch up on files imported while it loads.
+  optional<std::vector<std::string>> imported_files;
+
+  std::shared_ptr<void> LeaseIds();
+  // Releases the ids of a batch of unused symbols. Runs on the querydb thread
+  // while it is idle; returns true if it should be called again.
+  bool ReclaimUnusedIds();
+
+  // Exchanges the symbols of the databases. The caller holds |mutex|
+  // exclusively and makes sure neither database has an id lease.
+  void Swap(QueryDatabase* other);
 
   // Marks the given Usrs as invalid.
   void RemoveUsrs(SymbolKind usr_kind, const std::vector<Usr>& to_remove);
   // Insert the contents of |update| into |db|.
   void ApplyIndexUpdate(IndexUpdate* update);
-  void ImportOrUpdate(const std::vector<QueryFile::DefUpdate>& updates);
-  void ImportOrUpdate(const std::vector<QueryType::DefUpdate>& updates);
-  void ImportOrUpdate(const std::vector<QueryFunc::DefUpdate>& updates);
-  void ImportOrUpdate(const std::vector<QueryVar::DefUpdate>& updates);
+  // Sets the definitions of |updates| and adds the ids whose symbol needs to
+  // be updated to |imported|. The symbol table is left alone, so the
+  // overloads can run in parallel.
+  void ImportOrUpdate(const std::vector<QueryFile::DefUpdate>& updates,
+                      std::vector<RawId>* imported);
+  void ImportOrUpdate(const std::vector<QueryType::DefUpdate>& updates,
+                      std::vector<RawId>* imported);
+  void ImportOrUpdate(const std::vector<QueryFunc::DefUpdate>& updates,
+                      std::vector<RawId>* imported);
+  void ImportOrUpdate(const std::vector<QueryVar::DefUpdate>& updates,
+                      std::vector<RawId>* imported);
   void UpdateSymbols(Maybe<Id<void>>* symbol_idx, SymbolKind kind, RawId idx);
+  void FreeSymbol(Maybe<Id<void>>* symbol_idx);
+  // Creates the storage for ids which IdMaps allocated or reused.
+  void CreateEntriesForNewIds();
+  // Adds the imported file |id| to |impl_file_by_stem| and
+  // |impl_file_by_header| if it is a source file.
+  void UpdateImplementationFiles(QueryFileId id);
+  // Rebuilds QueryType::members of |id|.
+  void UpdateMembers(QueryTypeId id);
   std::string_view GetSymbolDetailedName(RawId symbol_idx) const;
   std::string_view GetSymbolShortName(RawId symbol_idx) const;
 
   // Query the indexing structure to look up symbol id for given Usr.
   Maybe<QueryFileId> GetQueryFileIdFromPath(const std::string& path);
+  // Returns the source file which implements |header_path|, if any.
+  Maybe<QueryFileId> GetImplementationFileFromPath(
+      const std::string& header_path);
   Maybe<QueryTypeId> GetQueryTypeIdFromUsr(Usr usr);
   Maybe<QueryFuncId> GetQueryFuncIdFromUsr(Usr usr);
   Maybe<QueryVarId> GetQueryVarIdFromUsr(Usr usr);
@@ -461,8 +652,11 @@ template <typename I> struct IndexToQuery<std::vector<I>> {
 // clang-format on
 
 struct IdMap {
+  QueryDatabase* query_db;
   const IdCache& local_ids;
   QueryFileId primary_file;
+  // Keeps the ids of this map from being reused, see QueryDatabase::LeaseIds.
+  std::shared_ptr<void> id_lease;
 
   IdMap(QueryDatabase* query_db, const IdCache& local_ids);
 
@@ -510,6 +704,10 @@ struct IdMap {
   SymbolIdx ToSymbol(IndexTypeId id) const;
   SymbolIdx ToSymbol(IndexFuncId id) const;
   SymbolIdx ToSymbol(IndexVarId id) const;
+  // Looks up the ids of the files at |paths| in one batch. Files which are not
+  // known yet are created without a def.
+  std::vector<QueryFileId> ToQueryFiles(
+      const std::vector<std::string>& paths) const;
 
  private:
   spp::sparse_hash_map<IndexTypeId, QueryTypeId> cached_type_ids_;
@@ -0,0 +1,443 @@
+#include "query_snapshot.h"
+
+#include "config.h"
+#include "indexer.h"
+#include "query.h"
+#include "serializers/binary.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+namespace {
+
+// Bump when the layout of the snapshot changes.
+const int kSnapshotVersion = 3;
+// Written after everything else, so that a truncated file is rejected.
+const uint32_t kSnapshotTrailer = 0x53514443;  // "CDQS"
+
+// A snapshot describes the indexes in the cache, so it is only usable with the
+// cache settings it was saved with.
+struct SnapshotHeader {
+  int version = 0;
+  int index_major_version = 0;
+  SerializeFormat cache_format = SerializeFormat::Json;
+  int cache_shard_count = 0;
+
+  bool operator==(const SnapshotHeader& o) const {
+    return version == o.version &&
+           index_major_version == o.index_major_version &&
+           cache_format == o.cache_format &&
+           cache_shard_count == o.cache_shard_count;
+  }
+};
+MAKE_REFLECT_STRUCT(SnapshotHeader,
+                    version,
+                    index_major_version,
+                    cache_format,
+                    cache_shard_count);
+
+SnapshotHeader GetHeader(Config* config) {
+  SnapshotHeader header;
+  header.version = kSnapshotVersion;
+  header.index_major_version = IndexFile::GetMajorVersion();
+  header.cache_format = config->cacheFormat;
+  header.cache_shard_count = config->cacheShardCount;
+  return header;
+}
+
+// Storage entries are written without the derived state which Load rebuilds:
+// the usr tables, the name index, the implementation files, the symbol index
+// of each file (QueryFile::BuildSymbolIndex) and the member tables of types.
+template <typename TVisitor>
+void ReflectEntity(TVisitor& visitor, QueryFile& file) {
+  Reflect(visitor, file.path);
+  Reflect(visitor, file.def);
+  Reflect(visitor, file.symbol_idx);
+}
+template <typename TVisitor>
+void ReflectEntity(TVisitor& visitor, QueryType& type) {
+  Reflect(visitor, type.usr);
+  Reflect(visitor, type.gen);
+  Reflect(visitor, type.symbol_idx);
+  Reflect(visitor, type.def);
+  Reflect(visitor, type.derived);
+  Reflect(visitor, type.instances);
+  Reflect(visitor, type.uses);
+}
+template <typename TVisitor>
+void ReflectEntity(TVisitor& visitor, QueryFunc& func) {
+  Reflect(visitor, func.usr);
+  Reflect(visitor, func.gen);
+  Reflect(visitor, func.symbol_idx);
+  Reflect(visitor, func.def);
+  Reflect(visitor, func.declarations);
+  Reflect(visitor, func.derived);
+  Reflect(visitor, func.callers);
+}
+template <typename TVisitor>
+void ReflectEntity(TVisitor& visitor, QueryVar& var) {
+  Reflect(visitor, var.usr);
+  Reflect(visitor, var.gen);
+  Reflect(visitor, var.symbol_idx);
+  Reflect(visitor, var.def);
+  Reflect(visitor, var.declarations);
+  Reflect(visitor, var.uses);
+}
+
+template <typename T>
+void WriteEntities(Writer& visitor, std::vector<T>& entities) {
+  visitor.StartArray(entities.size());
+  for (T& entity : entities)
+    ReflectEntity(visitor, entity);
+  visitor.EndArray();
+}
+// The entities have no default constructor, so each starts as a copy of
+// |empty|.
+template <typename T>
+void ReadEntities(Reader& visitor, std::vector<T>* entities, const T& empty) {
+  visitor.IterArray([&](Reader& entry) {
+    entities->push_back(empty);
+    ReflectEntity(entry, entities->back());
+  });
+}
+
+template <typename T>
+std::vector<Usr> GetUsrs(const std::vector<T>& entities) {
+  std::vector<Usr> usrs;
+  usrs.reserve(entities.size());
+  for (const T& entity : entities)
+    usrs.push_back(entity.usr);
+  return usrs;
+}
+
+template <typename TId>
+void DropUnsavedIds(std::vector<TId>* ids, size_t size) {
+  ids->erase(std::remove_if(ids->begin(), ids->end(),
+                            [&](TId id) { return id.id >= size; }),
+             ids->end());
+}
+
+template <typename TId>
+void CheckIds(const std::vector<TId>& ids, size_t size) {
+  for (TId id : ids) {
+    if (id.id >= size)
+      throw std::invalid_argument("id out of range");
+  }
+}
+
+// The caller holds |db->mutex|, shared is enough.
+std::string SerializeSnapshot(Config* config, QueryDatabase* db) {
+  std::string content;
+  BinaryWriter writer(&content);
+  SnapshotHeader header = GetHeader(config);
+  Reflect(writer, header);
+
+  WriteEntities(writer, db->files);
+  WriteEntities(writer, db->types);
+  WriteEntities(writer, db->funcs);
+  WriteEntities(writer, db->vars);
+  Reflect(writer, db->symbols);
+  Reflect(writer, db->free_symbols);
+
+  std::vector<std::string> file_paths;
+  std::vector<QueryFileId> file_ids;
+  for (const auto& entry : db->usr_to_file) {
+    file_paths.push_back(entry.first.path);
+    file_ids.push_back(entry.second);
+  }
+  Reflect(writer, file_paths);
+  Reflect(writer, file_ids);
+
+  // Ids which IdMaps allocated after the entries were created are not saved;
+  // nothing in the snapshot refers to them.
+  std::vector<QueryTypeId> free_types = db->usr_to_type.GetFreeIds();
+  std::vector<QueryFuncId> free_funcs = db->usr_to_func.GetFreeIds();
+  std::vector<QueryVarId> free_vars = db->usr_to_var.GetFreeIds();
+  DropUnsavedIds(&free_types, db->types.size());
+  DropUnsavedIds(&free_funcs, db->funcs.size());
+  DropUnsavedIds(&free_vars, db->vars.size());
+  Reflect(writer, free_types);
+  Reflect(writer, free_funcs);
+  Reflect(writer, free_vars);
+
+  uint32_t trailer = kSnapshotTrailer;
+  Reflect(writer, trailer);
+  return content;
+}
+
+// Fills |db|, which is empty and not used by anyone else. Throws
+// std::invalid_argument if |content| is not a usable snapshot.
+void DeserializeSnapshot(Config* config,
+                         const std::string& content,
+                         QueryDatabase* db) {
+  BinaryReader reader(content);
+  SnapshotHeader header;
+  Reflect(reader, header);
+  if (!(header == GetHeader(config)))
+    throw std::invalid_argument("saved with other settings");
+
+  QueryFile empty_file("");
+  empty_file.def = nullopt;
+  ReadEntities(reader, &db->files, empty_file);
+  ReadEntities(reader, &db->types, QueryType(0));
+  ReadEntities(reader, &db->funcs, QueryFunc(0));
+  ReadEntities(reader, &db->vars, QueryVar(0));
+  Reflect(reader, db->symbols);
+  Reflect(reader, db->free_symbols);
+
+  std::vector<std::string> file_paths;
+  std::vector<QueryFileId> file_ids;
+  Reflect(reader, file_paths);
+  Reflect(reader, file_ids);
+  std::vector<QueryTypeId> free_types;
+  std::vector<QueryFuncId> free_funcs;
+  std::vector<QueryVarId> free_vars;
+  Reflect(reader, free_types);
+  Reflect(reader, free_funcs);
+  Reflect(reader, free_vars);
+  uint32_t trailer = 0;
+  Reflect(reader, trailer);
+  if (trailer != kSnapshotTrailer)
+    throw std::invalid_argument("truncated");
+
+  if (file_paths.size() != file_ids.size())
+    throw std::invalid_argument("file ids");
+  CheckIds(file_ids, db->files.size());
+  for (const QueryFile& file : db->files) {
+    if (!file.def)
+      continue;
+    CheckIds(file.def->dependencies, db->files.size());
+    for (const QueryFile::Include& include : file.def->includes) {
+      if (include.file.id >= db->files.size())
+        throw std::invalid_argument("include out of range");
+    }
+  }
+  CheckIds(free_types, db->types.size());
+  CheckIds(free_funcs, db->funcs.size());
+  CheckIds(free_vars, db->vars.size());
+  for (const SymbolIdx& symbol : db->symbols) {
+    size_t size = 0;
+    switch (symbol.kind) {
+      case SymbolKind::File:
+        size = db->files.size();
+        break;
+      case SymbolKind::Type:
+        size = db->types.size();
+        break;
+      case SymbolKind::Func:
+        size = db->funcs.size();
+        break;
+      case SymbolKind::Var:
+        size = db->vars.size();
+        break;
+      default:
+        continue;
+    }
+    if (symbol.idx >= size)
+      throw std::invalid_argument("symbol out of range");
+  }
+
+  for (size_t i = 0; i < file_paths.size(); i++)
+    db->usr_to_file[NormalizedPath(file_paths[i])] = file_ids[i];
+  db->usr_to_type.Reset(GetUsrs(db->types), free_types);
+  db->usr_to_func.Reset(GetUsrs(db->funcs), free_funcs);
+  db->usr_to_var.Reset(GetUsrs(db->vars), free_vars);
+  for (RawId i = 0; i < db->symbols.size(); i++) {
+    if (db->symbols[i].kind != SymbolKind::Invalid) {
+      db->symbol_search_index.Update(i, db->GetSymbolDetailedName(i),
+                                     db->GetSymbolShortName(i));
+    }
+  }
+  for (size_t i = 0; i < db->files.size(); i++) {
+    if (db->files[i].def) {
+      db->files[i].BuildSymbolIndex();
+      db->UpdateImplementationFiles(QueryFileId(i));
+    }
+  }
+  for (size_t i = 0; i < db->types.size(); i++) {
+    if (db->types[i].def)
+      db->UpdateMembers(QueryTypeId(i));
+  }
+}
+
+}  // namespace
+
+void QueryDbSnapshot::Init(Config* config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  config_ = config;
+  path_ = config->cacheDirectory + EscapeFileName(config->projectRoot) +
+          ".querydb";
+  on_disk_ = FileExists(path_);
+  if (!IsEnabled())
+    DeleteLocked();
+}
+
+bool QueryDbSnapshot::IsEnabled() const {
+  // Other checkouts sharing the cache under Config::projectCacheKey write
+  // indexes without deleting the snapshot of this one.
+  return config_ && config_->querydbSnapshotIntervalMs > 0 &&
+         config_->projectCacheKey.empty();
+}
+
+bool QueryDbSnapshot::Load(QueryDatabase* db) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!IsEnabled())
+    return false;
+  Timer time;
+  optional<std::string> content = ReadContent(path_);
+  if (!content)
+    return false;
+
+  QueryDatabase loaded;
+  try {
+    DeserializeSnapshot(config_, *content, &loaded);
+  } catch (std::invalid_argument& e) {
+    LOG_S(INFO) << "Cannot load querydb snapshot " << path_ << ": "
+                << e.what();
+    DeleteLocked();
+    return false;
+  }
+
+  std::lock_guard<SharedMutex> db_lock(db->mutex);
+  db->Swap(&loaded);
+  saved_generation_ = db->generation;
+  since_save_.Reset();
+  LOG_S(INFO) << "Loaded querydb snapshot with " << db->files.size()
+              << " files from " << path_ << " in "
+              << FormatMicroseconds(time.ElapsedMicroseconds());
+  return true;
+}
+
+bool QueryDbSnapshot::MaybeSave(QueryDatabase* db, bool force) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!IsEnabled() || unapplied_updates_ > 0 || unwritten_caches_ > 0 ||
+      db->generation == saved_generation_) {
+    return false;
+  }
+  if (!force && since_save_.ElapsedMicroseconds() <
+                    config_->querydbSnapshotIntervalMs * 1000ll) {
+    return false;
+  }
+
+  Timer time;
+  std::string content;
+  uint32_t generation;
+  {
+    SharedLock db_lock(db->mutex);
+    content = SerializeSnapshot(config_, db);
+    generation = db->generation;
+  }
+
+  // Write to another file first, so that a crash does not leave a partial
+  // snapshot behind.
+  std::string tmp_path = path_ + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  bool ok = file &&
+            fwrite(content.data(), 1, content.size(), file) == content.size();
+  if (file)
+    ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    LOG_S(ERROR) << "Cannot write querydb snapshot " << tmp_path;
+    remove(tmp_path.c_str());
+    return false;
+  }
+  remove(path_.c_str());
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    LOG_S(ERROR) << "Cannot write querydb snapshot " << path_;
+    remove(tmp_path.c_str());
+    on_disk_ = false;
+    return false;
+  }
+
+  on_disk_ = true;
+  saved_generation_ = generation;
+  since_save_.Reset();
+  LOG_S(INFO) << "Saved querydb snapshot (" << content.size() / 1024
+              << " KiB) to " << path_ << " in "
+              << FormatMicroseconds(time.ElapsedMicroseconds());
+  return true;
+}
+
+void QueryDbSnapshot::OnUpdateCreated(bool writes_cache) {
+  unapplied_updates_++;
+  if (writes_cache)
+    unwritten_caches_++;
+}
+
+void QueryDbSnapshot::OnUpdatesApplied(int count) {
+  unapplied_updates_ -= count;
+}
+
+void QueryDbSnapshot::BeginCacheWrite() {
+  // Waits for a save in progress, which may include updates whose caches are
+  // about to be written.
+  std::lock_guard<std::mutex> lock(mutex_);
+  DeleteLocked();
+}
+
+void QueryDbSnapshot::EndCacheWrite(int count) {
+  unwritten_caches_ -= count;
+}
+
+void QueryDbSnapshot::DeleteLocked() {
+  if (!on_disk_)
+    return;
+  remove(path_.c_str());
+  on_disk_ = false;
+}
+
+TEST_SUITE("QueryDbSnapshot") {
+  TEST_CASE("save and load") {
+    IndexFile file("foo.cc", "<empty>");
+    IndexType* type = file.Resolve(file.ToTypeId(HashUsr("usr1")));
+    type->def.detailed_name = "a";
+    type->def.short_name_size = 1;
+    type->def.definition_spelling = Range(Position(1, 0));
+    type->uses.push_back(Range(Position(2, 0)));
+    file.dependencies.push_back("foo.h");
+
+    QueryDatabase db;
+    {
+      IdMap id_map(&db, file.id_cache);
+      IndexUpdate update =
+          IndexUpdate::CreateDelta(nullptr, &id_map, nullptr, &file);
+      db.ApplyIndexUpdate(&update);
+    }
+    db.types[0].gen = 3;
+
+    Config config;
+    QueryDatabase loaded;
+    DeserializeSnapshot(&config, SerializeSnapshot(&config, &db), &loaded);
+    REQUIRE(loaded.files.size() == db.files.size());
+    REQUIRE(loaded.symbols == db.symbols);
+    REQUIRE(loaded.GetQueryFileIdFromPath("foo.cc") ==
+            db.GetQueryFileIdFromPath("foo.cc"));
+    // Files which are only depended on keep their path without a def.
+    Maybe<QueryFileId> header = loaded.GetQueryFileIdFromPath("foo.h");
+    REQUIRE(header);
+    REQUIRE(loaded.files[header->id].path == "foo.h");
+    REQUIRE(!loaded.files[header->id].def);
+    Maybe<QueryFileId> foo = loaded.GetQueryFileIdFromPath("foo.cc");
+    REQUIRE(loaded.files[foo->id].def->dependencies ==
+            std::vector<QueryFileId>{*header});
+    Maybe<QueryTypeId> id = loaded.usr_to_type.Get(HashUsr("usr1"));
+    REQUIRE(id);
+    REQUIRE(loaded.types[id->id].def->detailed_name == "a");
+    REQUIRE(loaded.types[id->id].uses == db.types[id->id].uses);
+    REQUIRE(loaded.types[id->id].gen == 3);
+
+    // Truncated snapshots and snapshots of another cache format are rejected.
+    std::string content = SerializeSnapshot(&config, &db);
+    QueryDatabase truncated;
+    REQUIRE_THROWS(DeserializeSnapshot(
+        &config, content.substr(0, content.size() - 1), &truncated));
+    config.cacheFormat = SerializeFormat::Binary;
+    QueryDatabase other_format;
+    REQUIRE_THROWS(DeserializeSnapshot(&config, content, &other_format));
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "timer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+struct Config;
+struct QueryDatabase;
+
+// Snapshot of a whole QueryDatabase in the cache directory, so that a restart
+// does not need to import every cached index again before the project can be
+// queried.
+//
+// When a file changes, its update is computed against the cached index of the
+// file (see IndexMain_LoadPreviousIndex), so the snapshot must describe
+// exactly the indexes in the cache. It is only saved once every index update
+// which was created has been applied by querydb and written to the cache, and
+// it is deleted before the cache writer writes anything newer. Files which
+// changed while cquery was not running are found by the usual timestamp
+// checks of the indexer and reimported.
+class QueryDbSnapshot {
+ public:
+  // Sets up the snapshot of |config->projectRoot|. If snapshots are disabled,
+  // an existing snapshot is deleted, as it would be stale by the time they
+  // are enabled again.
+  void Init(Config* config);
+  bool IsEnabled() const;
+
+  // Loads the snapshot into |db|, which must be empty. Returns false if there
+  // is no usable snapshot.
+  bool Load(QueryDatabase* db);
+  // Saves |db| if it changed since the last save and the index updates have
+  // settled. Unless |force| is set, saves at most every
+  // Config::querydbSnapshotIntervalMs.
+  // Called on the querydb thread. Returns true if the snapshot was written.
+  bool MaybeSave(QueryDatabase* db, bool force);
+
+  // An index update was created by an indexer. If |writes_cache| is set, it
+  // will also be written to the cache.
+  void OnUpdateCreated(bool writes_cache);
+  // querydb applied |count| index updates, which may have been merged.
+  void OnUpdatesApplied(int count);
+  // The cache writer writes |count| queued caches between these.
+  void BeginCacheWrite();
+  void EndCacheWrite(int count);
+
+ private:
+  void DeleteLocked();
+
+  Config* config_ = nullptr;
+  // Guards the snapshot file.
+  std::mutex mutex_;
+  std::string path_;
+  bool on_disk_ = false;
+  // Created index updates which querydb did not apply yet, and caches which
+  // were not written yet.
+  std::atomic<int> unapplied_updates_{0};
+  std::atomic<int> unwritten_caches_{0};
+  // QueryDatabase::generation of the last save or load. Only used by querydb.
+  uint32_t saved_generation_ = 0;
+  Timer since_save_;
+};
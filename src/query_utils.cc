@@ -1,11 +1,29 @@
 #include "query_utils.h"
 
+#include "lex_utils.h"
 #include "queue_manager.h"
 
+#include <algorithm>
 #include <climits>
+#include <numeric>
+#include <tuple>
+#include <unordered_map>
 
 namespace {
 
+// Maximum number of symbols returned by FindSymbolsByLexedName.
+const size_t kMaxLexedSymbols = 8;
+
+// Returns the number of directories at the start of both |a| and |b|.
+int CountCommonDirectories(const std::string& a, const std::string& b) {
+  int count = 0;
+  for (size_t i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++) {
+    if (a[i] == '/')
+      count++;
+  }
+  return count;
+}
+
 // Computes roughly how long |range| is.
 int ComputeRangeSize(const Range& range) {
   if (range.start.line != range.end.line)
@@ -36,6 +54,26 @@ std::vector<QueryLocation> ToQueryLocation(
   return locs;
 }
 
+QueryFuncId GetQueryFuncId(QueryDatabase* db, const QueryFunc& func) {
+  return QueryFuncId(RawId(&func - db->funcs.data()));
+}
+
+bool HasCallers(QueryDatabase* db, const FuncHierarchyCache::Closure& funcs) {
+  for (QueryFuncId id : *funcs) {
+    if (!db->funcs[id.id].callers.empty())
+      return true;
+  }
+  return false;
+}
+
+std::vector<QueryFuncRef> GetCallers(QueryDatabase* db,
+                                     const FuncHierarchyCache::Closure& funcs) {
+  std::vector<QueryFuncRef> callers;
+  for (QueryFuncId id : *funcs)
+    AddRange(&callers, db->funcs[id.id].callers);
+  return callers;
+}
+
 }  // namespace
 
 optional<QueryLocation> GetDefinitionSpellingOfSymbol(QueryDatabase* db,
@@ -168,6 +206,15 @@ std::vector<QueryLocation> ToQueryLocation(
     locs.push_back(ref.loc);
   return locs;
 }
+std::vector<QueryLocation> ToQueryLocation(
+    QueryDatabase* db,
+    const PagedVector<QueryFuncRef>& refs) {
+  std::vector<QueryLocation> locs;
+  locs.reserve(refs.size());
+  for (const QueryFuncRef& ref : refs)
+    locs.push_back(ref.loc);
+  return locs;
+}
 std::vector<QueryLocation> ToQueryLocation(
     QueryDatabase* db,
     const std::vector<QueryTypeId>& ids) {
@@ -215,7 +262,7 @@ std::vector<QueryLocation> GetUsesOfSymbol(QueryDatabase* db,
   switch (symbol.kind) {
     case SymbolKind::Type: {
       QueryType& type = db->types[symbol.idx];
-      std::vector<QueryLocation> ret = type.uses;
+      std::vector<QueryLocation> ret(type.uses.begin(), type.uses.end());
       if (include_decl && type.def && type.def->definition_spelling)
         ret.push_back(*type.def->definition_spelling);
       return ret;
@@ -233,7 +280,7 @@ std::vector<QueryLocation> GetUsesOfSymbol(QueryDatabase* db,
     }
     case SymbolKind::Var: {
       QueryVar& var = db->vars[symbol.idx];
-      std::vector<QueryLocation> ret = var.uses;
+      std::vector<QueryLocation> ret(var.uses.begin(), var.uses.end());
       if (include_decl) {
         if (var.def && var.def->definition_spelling)
           ret.push_back(*var.def->definition_spelling);
@@ -282,87 +329,30 @@ std::vector<QueryLocation> GetDeclarationsOfSymbolForGotoDefinition(
 }
 
 bool HasCallersOnSelfOrBaseOrDerived(QueryDatabase* db, QueryFunc& root) {
-  // Check self.
-  if (!root.callers.empty())
-    return true;
-
-  // Check for base calls.
-  std::queue<QueryFunc*> queue;
-  EachWithGen<QueryFunc>(db->funcs, root.def->base, [&](QueryFunc& func) {
-    queue.push(&func);
-  });
-  while (!queue.empty()) {
-    QueryFunc& func = *queue.front();
-    queue.pop();
-    if (!func.callers.empty())
-      return true;
-    if (func.def)
-      EachWithGen<QueryFunc>(db->funcs, func.def->base, [&](QueryFunc& func1) {
-        queue.push(&func1);
-      });
-  }
+  return !root.callers.empty() || HasCallersForAllBaseFunctions(db, root) ||
+         HasCallersForAllDerivedFunctions(db, root);
+}
 
-  // Check for derived calls.
-  EachWithGen<QueryFunc>(db->funcs, root.derived, [&](QueryFunc& func1) {
-    queue.push(&func1);
-  });
-  while (!queue.empty()) {
-    QueryFunc& func = *queue.front();
-    queue.pop();
-    if (!func.callers.empty())
-      return true;
-    EachWithGen<QueryFunc>(db->funcs, func.derived, [&](QueryFunc& func1) {
-      queue.push(&func1);
-    });
-  }
+bool HasCallersForAllBaseFunctions(QueryDatabase* db, QueryFunc& root) {
+  return HasCallers(
+      db, db->func_hierarchy.GetBases(db, GetQueryFuncId(db, root)));
+}
 
-  return false;
+bool HasCallersForAllDerivedFunctions(QueryDatabase* db, QueryFunc& root) {
+  return HasCallers(
+      db, db->func_hierarchy.GetDerived(db, GetQueryFuncId(db, root)));
 }
 
 std::vector<QueryFuncRef> GetCallersForAllBaseFunctions(QueryDatabase* db,
                                                         QueryFunc& root) {
-  std::vector<QueryFuncRef> callers;
-  if (!root.def)
-    return callers;
-
-  std::queue<QueryFunc*> queue;
-  EachWithGen<QueryFunc>(db->funcs, root.def->base, [&](QueryFunc& func1) {
-    queue.push(&func1);
-  });
-  while (!queue.empty()) {
-    QueryFunc& func = *queue.front();
-    queue.pop();
-
-    AddRange(&callers, func.callers);
-    if (func.def)
-      EachWithGen<QueryFunc>(db->funcs, func.def->base, [&](QueryFunc& func1) {
-        queue.push(&func1);
-      });
-  }
-
-  return callers;
+  return GetCallers(
+      db, db->func_hierarchy.GetBases(db, GetQueryFuncId(db, root)));
 }
 
 std::vector<QueryFuncRef> GetCallersForAllDerivedFunctions(QueryDatabase* db,
                                                            QueryFunc& root) {
-  std::vector<QueryFuncRef> callers;
-
-  std::queue<QueryFunc*> queue;
-  EachWithGen<QueryFunc>(db->funcs, root.derived, [&](QueryFunc& func) {
-    queue.push(&func);
-  });
-
-  while (!queue.empty()) {
-    QueryFunc& func = *queue.front();
-    queue.pop();
-
-    EachWithGen<QueryFunc>(db->funcs, func.derived, [&](QueryFunc& func1) {
-      queue.push(&func1);
-    });
-    AddRange(&callers, func.callers);
-  }
-
-  return callers;
+  return GetCallers(
+      db, db->func_hierarchy.GetDerived(db, GetQueryFuncId(db, root)));
 }
 
 optional<lsPosition> GetLsPosition(WorkingFile* working_file,
@@ -379,17 +369,15 @@ optional<lsPosition> GetLsPosition(WorkingFile* working_file,
   return lsPosition(*start, column);
 }
 
-optional<lsRange> GetLsRange(WorkingFile* working_file, const Range& location) {
-  if (!working_file) {
-    return lsRange(lsPosition(location.start.line, location.start.column),
-                   lsPosition(location.end.line, location.end.column));
-  }
+namespace {
 
-  int start_column = location.start.column, end_column = location.end.column;
-  optional<int> start = working_file->GetBufferPosFromIndexPos(
-      location.start.line, &start_column, false);
-  optional<int> end = working_file->GetBufferPosFromIndexPos(location.end.line,
-                                                             &end_column, true);
+// Builds the buffer range of |location| from the buffer positions of its
+// start and end, see GetLsRange.
+optional<lsRange> MakeBufferRange(const Range& location,
+                                  optional<int> start,
+                                  int start_column,
+                                  optional<int> end,
+                                  int end_column) {
   if (!start || !end)
     return nullopt;
 
@@ -408,13 +396,74 @@ optional<lsRange> GetLsRange(WorkingFile* working_file, const Range& location) {
                  lsPosition(*end, end_column));
 }
 
+}  // namespace
+
+optional<lsRange> GetLsRange(WorkingFile* working_file, const Range& location) {
+  if (!working_file) {
+    return lsRange(lsPosition(location.start.line, location.start.column),
+                   lsPosition(location.end.line, location.end.column));
+  }
+
+  int start_column = location.start.column, end_column = location.end.column;
+  optional<int> start = working_file->GetBufferPosFromIndexPos(
+      location.start.line, &start_column, false);
+  optional<int> end = working_file->GetBufferPosFromIndexPos(location.end.line,
+                                                             &end_column, true);
+  return MakeBufferRange(location, start, start_column, end, end_column);
+}
+
+std::vector<optional<lsRange>> GetLsRanges(
+    WorkingFile* working_file,
+    const std::vector<Range>& locations) {
+  std::vector<optional<lsRange>> result;
+  result.reserve(locations.size());
+  if (!working_file) {
+    for (const Range& location : locations)
+      result.push_back(GetLsRange(nullptr, location));
+    return result;
+  }
+
+  std::vector<int> lines;
+  lines.reserve(locations.size() * 2);
+  for (const Range& location : locations) {
+    lines.push_back(location.start.line);
+    lines.push_back(location.end.line);
+  }
+  std::sort(lines.begin(), lines.end());
+  lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+  std::vector<optional<int>> buffer_lines =
+      working_file->GetBufferLinesFromIndexLines(lines);
+  auto get_buffer_line = [&](int line) -> optional<int> {
+    return buffer_lines[std::lower_bound(lines.begin(), lines.end(), line) -
+                        lines.begin()];
+  };
+
+  for (const Range& location : locations) {
+    int start_column = location.start.column;
+    int end_column = location.end.column;
+    optional<int> start = get_buffer_line(location.start.line);
+    optional<int> end = get_buffer_line(location.end.line);
+    if (start) {
+      start_column = working_file->AlignBufferColumn(
+          location.start.line, start_column, *start, false);
+    }
+    if (end) {
+      end_column = working_file->AlignBufferColumn(location.end.line,
+                                                   end_column, *end, true);
+    }
+    result.push_back(
+        MakeBufferRange(location, start, start_column, end, end_column));
+  }
+  return result;
+}
+
 lsDocumentUri GetLsDocumentUri(QueryDatabase* db,
                                QueryFileId file_id,
                                std::string* path) {
   QueryFile& file = db->files[file_id.id];
   if (file.def) {
     *path = file.def->path;
-    return lsDocumentUri::FromPath(*path);
+    return file.GetUri();
   } else {
     *path = "";
     return lsDocumentUri::FromPath("");
@@ -424,7 +473,7 @@ lsDocumentUri GetLsDocumentUri(QueryDatabase* db,
 lsDocumentUri GetLsDocumentUri(QueryDatabase* db, QueryFileId file_id) {
   QueryFile& file = db->files[file_id.id];
   if (file.def) {
-    return lsDocumentUri::FromPath(file.def->path);
+    return file.GetUri();
   } else {
     return lsDocumentUri::FromPath("");
   }
@@ -442,17 +491,46 @@ optional<lsLocation> GetLsLocation(QueryDatabase* db,
   return lsLocation(uri, *range);
 }
 
+std::vector<optional<lsLocation>> GetLsLocationsBatch(
+    QueryDatabase* db,
+    WorkingFiles* working_files,
+    const std::vector<QueryLocation>& locations) {
+  std::vector<size_t> order(locations.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return locations[a].path.id < locations[b].path.id;
+  });
+
+  std::vector<optional<lsLocation>> result(locations.size());
+  std::vector<Range> ranges;
+  for (size_t begin = 0, end; begin < order.size(); begin = end) {
+    QueryFileId file_id = locations[order[begin]].path;
+    ranges.clear();
+    for (end = begin;
+         end < order.size() && locations[order[end]].path == file_id; end++)
+      ranges.push_back(locations[order[end]].range);
+
+    std::string path;
+    lsDocumentUri uri = GetLsDocumentUri(db, file_id, &path);
+    std::vector<optional<lsRange>> ls_ranges =
+        GetLsRanges(working_files->GetFileByFilename(path), ranges);
+    for (size_t i = begin; i < end; i++) {
+      if (ls_ranges[i - begin])
+        result[order[i]] = lsLocation(uri, *ls_ranges[i - begin]);
+    }
+  }
+  return result;
+}
+
 std::vector<lsLocation> GetLsLocations(
     QueryDatabase* db,
     WorkingFiles* working_files,
     const std::vector<QueryLocation>& locations) {
   std::unordered_set<lsLocation> unique_locations;
-  for (const QueryLocation& query_location : locations) {
-    optional<lsLocation> location =
-        GetLsLocation(db, working_files, query_location);
-    if (!location)
-      continue;
-    unique_locations.insert(*location);
+  for (optional<lsLocation>& location :
+       GetLsLocationsBatch(db, working_files, locations)) {
+    if (location)
+      unique_locations.insert(std::move(*location));
   }
 
   std::vector<lsLocation> result;
@@ -461,6 +539,72 @@ std::vector<lsLocation> GetLsLocations(
   return result;
 }
 
+std::vector<lsLocation> GetLsLocationsByProximity(
+    QueryDatabase* db,
+    WorkingFiles* working_files,
+    QueryFileId file_id,
+    std::vector<QueryLocation> locations,
+    int start_index,
+    int max_results) {
+  // Files come after |file_id| by decreasing number of directories shared
+  // with it, then by path. Files which are not indexed are dropped.
+  struct FileOrder {
+    int rank;
+    const std::string* path;
+  };
+  const QueryFile& origin = db->files[file_id.id];
+  std::unordered_map<RawId, FileOrder> file_orders;
+  auto get_order = [&](QueryFileId id) -> const FileOrder& {
+    auto it = file_orders.find(id.id);
+    if (it != file_orders.end())
+      return it->second;
+    FileOrder order{INT_MAX, nullptr};
+    const QueryFile& file = db->files[id.id];
+    if (file.def) {
+      order.path = &file.def->path;
+      if (id == file_id)
+        order.rank = INT_MIN;
+      else if (origin.def)
+        order.rank = -CountCommonDirectories(origin.def->path, file.def->path);
+      else
+        order.rank = 0;
+    }
+    return file_orders[id.id] = order;
+  };
+  locations.erase(std::remove_if(locations.begin(), locations.end(),
+                                 [&](const QueryLocation& location) {
+                                   return !get_order(location.path).path;
+                                 }),
+                  locations.end());
+  std::sort(locations.begin(), locations.end(),
+            [&](const QueryLocation& a, const QueryLocation& b) {
+              if (a.path == b.path)
+                return a.range < b.range;
+              const FileOrder& a_order = get_order(a.path);
+              const FileOrder& b_order = get_order(b.path);
+              return std::tie(a_order.rank, *a_order.path) <
+                     std::tie(b_order.rank, *b_order.path);
+            });
+  locations.erase(std::unique(locations.begin(), locations.end()),
+                  locations.end());
+
+  // Only the requested page is converted.
+  size_t start = std::min(size_t(std::max(start_index, 0)), locations.size());
+  size_t end = locations.size();
+  if (max_results > 0)
+    end = std::min(end, start + size_t(max_results));
+  std::vector<QueryLocation> page(locations.begin() + start,
+                                  locations.begin() + end);
+  std::vector<lsLocation> result;
+  result.reserve(page.size());
+  for (optional<lsLocation>& location :
+       GetLsLocationsBatch(db, working_files, page)) {
+    if (location)
+      result.push_back(std::move(*location));
+  }
+  return result;
+}
+
 // Returns a symbol. The symbol will have *NOT* have a location assigned.
 optional<lsSymbolInformation> GetSymbolInfo(QueryDatabase* db,
                                             WorkingFiles* working_files,
@@ -560,7 +704,20 @@ std::vector<SymbolRef> FindSymbolsAtLocation(WorkingFile* working_file,
       target_line = *index_line;
   }
 
-  for (const SymbolRef& ref : file->def->all_symbols) {
+  // |all_symbols| is sorted by start position and |symbols_max_end| holds the
+  // running maximum of end positions, so only the symbols starting at or
+  // before the target need to be looked at, and we can stop walking backwards
+  // as soon as no earlier symbol can extend past the target.
+  const std::vector<SymbolRef>& all_symbols = file->def->all_symbols;
+  assert(file->symbols_max_end.size() == all_symbols.size());
+  Position target(target_line, target_column);
+  size_t i = std::upper_bound(all_symbols.begin(), all_symbols.end(), target,
+                              [](const Position& pos, const SymbolRef& ref) {
+                                return pos < ref.loc.range.start;
+                              }) -
+             all_symbols.begin();
+  while (i > 0 && target < file->symbols_max_end[i - 1]) {
+    const SymbolRef& ref = all_symbols[--i];
     if (ref.loc.range.Contains(target_line, target_column))
       symbols.push_back(ref);
   }
@@ -594,18 +751,50 @@ std::vector<SymbolRef> FindSymbolsAtLocation(WorkingFile* working_file,
   return symbols;
 }
 
-void EmitDiagnostics(WorkingFiles* working_files,
-                     std::string path,
-                     std::vector<lsDiagnostic> diagnostics) {
-  // Emit diagnostics.
-  Out_TextDocumentPublishDiagnostics out;
-  out.params.uri = lsDocumentUri::FromPath(path);
-  out.params.diagnostics = diagnostics;
-  QueueManager::WriteStdout(IpcId::TextDocumentPublishDiagnostics, out);
+std::vector<SymbolIdx> FindSymbolsByLexedName(QueryDatabase* db,
+                                              WorkingFile* working_file,
+                                              lsPosition position) {
+  std::vector<SymbolIdx> symbols;
+  const std::string& content = working_file->buffer_content;
+  std::string name = LexWordAroundPos(position, content);
+  if (name.empty() || !(isalpha(name[0]) || name[0] == '_'))
+    return symbols;
+  // Names too short to be filtered by the index would match too many symbols
+  // to be useful anyway.
+  optional<std::vector<uint32_t>> candidates =
+      db->symbol_search_index.SubstringCandidates(name);
+  if (!candidates)
+    return symbols;
+
+  // Symbols declared in an earlier scope of |scopes| are preferred, and only
+  // the symbols of the best scope are returned.
+  std::vector<std::string> scopes = LexScopesAroundPos(position, content);
+  size_t best_rank = scopes.size();
+  for (uint32_t i : *candidates) {
+    SymbolIdx symbol = db->symbols[i];
+    if (symbol.kind == SymbolKind::File ||
+        db->GetSymbolShortName(i) != std::string_view(name))
+      continue;
 
-  // Cache diagnostics so we can show fixits.
-  working_files->DoActionOnFile(path, [&](WorkingFile* working_file) {
-    if (working_file)
-      working_file->diagnostics_ = diagnostics;
-  });
+    // The qualifier is the part of the detailed name before the short name,
+    // without the return or variable type.
+    std::string_view detailed_name = db->GetSymbolDetailedName(i);
+    size_t end = db->GetSymbolShortName(i).data() - detailed_name.data();
+    size_t start = end;
+    while (start > 0 && (isalnum(detailed_name[start - 1]) ||
+                         detailed_name[start - 1] == '_' ||
+                         detailed_name[start - 1] == ':'))
+      start--;
+    std::string qualifier(detailed_name.substr(start, end - start));
+    size_t rank =
+        std::find(scopes.begin(), scopes.end(), qualifier) - scopes.begin();
+
+    if (rank < best_rank) {
+      best_rank = rank;
+      symbols.clear();
+    }
+    if (rank == best_rank && symbols.size() < kMaxLexedSymbols)
+      symbols.push_back(symbol);
+  }
+  return symbols;
 }
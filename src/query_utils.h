@@ -22,6 +22,9 @@ optional<QueryFileId> GetDeclarationFileForSymbol(QueryDatabase* db,
 std::vector<QueryLocation> ToQueryLocation(
     QueryDatabase* db,
     const std::vector<QueryFuncRef>& refs);
+std::vector<QueryLocation> ToQueryLocation(
+    QueryDatabase* db,
+    const PagedVector<QueryFuncRef>& refs);
 std::vector<QueryLocation> ToQueryLocation(
     QueryDatabase* db,
     const std::vector<QueryTypeId>& refs);
@@ -41,6 +44,9 @@ std::vector<QueryLocation> GetDeclarationsOfSymbolForGotoDefinition(
     const SymbolIdx& symbol);
 
 bool HasCallersOnSelfOrBaseOrDerived(QueryDatabase* db, QueryFunc& root);
+// Like GetCallersFor*Functions, but stops at the first caller.
+bool HasCallersForAllBaseFunctions(QueryDatabase* db, QueryFunc& root);
+bool HasCallersForAllDerivedFunctions(QueryDatabase* db, QueryFunc& root);
 std::vector<QueryFuncRef> GetCallersForAllBaseFunctions(QueryDatabase* db,
                                                         QueryFunc& root);
 std::vector<QueryFuncRef> GetCallersForAllDerivedFunctions(QueryDatabase* db,
@@ -48,6 +54,11 @@ std::vector<QueryFuncRef> GetCallersForAllDerivedFunctions(QueryDatabase* db,
 optional<lsPosition> GetLsPosition(WorkingFile* working_file,
                                    const Position& position);
 optional<lsRange> GetLsRange(WorkingFile* working_file, const Range& location);
+// Same as GetLsRange for each of |locations|, but the lines of
+// |working_file| are mapped together.
+std::vector<optional<lsRange>> GetLsRanges(
+    WorkingFile* working_file,
+    const std::vector<Range>& locations);
 lsDocumentUri GetLsDocumentUri(QueryDatabase* db,
                                QueryFileId file_id,
                                std::string* path);
@@ -55,10 +66,29 @@ lsDocumentUri GetLsDocumentUri(QueryDatabase* db, QueryFileId file_id);
 optional<lsLocation> GetLsLocation(QueryDatabase* db,
                                    WorkingFiles* working_files,
                                    const QueryLocation& location);
+// Same as GetLsLocation for each of |locations|, in the same order, but each
+// file is resolved and its uri built only once, and the locations of a
+// working file are converted together; see GetLsRanges.
+std::vector<optional<lsLocation>> GetLsLocationsBatch(
+    QueryDatabase* db,
+    WorkingFiles* working_files,
+    const std::vector<QueryLocation>& locations);
 std::vector<lsLocation> GetLsLocations(
     QueryDatabase* db,
     WorkingFiles* working_files,
     const std::vector<QueryLocation>& locations);
+// Returns the page [start_index, start_index + max_results) of |locations|,
+// deduplicated and ordered by proximity to |file_id|: the locations in the
+// file first, then those in the files sharing the most directories with it.
+// Only the page is converted to lsLocation. All of the locations are returned
+// if |max_results| is not positive.
+std::vector<lsLocation> GetLsLocationsByProximity(
+    QueryDatabase* db,
+    WorkingFiles* working_files,
+    QueryFileId file_id,
+    std::vector<QueryLocation> locations,
+    int start_index,
+    int max_results);
 // Returns a symbol. The symbol will have *NOT* have a location assigned.
 optional<lsSymbolInformation> GetSymbolInfo(QueryDatabase* db,
                                             WorkingFiles* working_files,
@@ -68,10 +98,12 @@ optional<lsSymbolInformation> GetSymbolInfo(QueryDatabase* db,
 std::vector<SymbolRef> FindSymbolsAtLocation(WorkingFile* working_file,
                                              QueryFile* file,
                                              lsPosition position);
-
-void EmitDiagnostics(WorkingFiles* working_files,
-                     std::string path,
-                     std::vector<lsDiagnostic> diagnostics);
+// Guesses the symbols at |position| of |working_file| when it is not indexed
+// yet, by looking up the word at |position| by name in the scopes given by
+// LexScopesAroundPos. The results are best-effort until the file is indexed.
+std::vector<SymbolIdx> FindSymbolsByLexedName(QueryDatabase* db,
+                                              WorkingFile* working_file,
+                                              lsPosition position);
 
 template <typename Q>
 void EachWithGen(std::vector<Q>& collection, WithGen<Id<Q>> x, std::function<void(Q&)> fn) {
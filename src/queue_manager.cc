@@ -4,12 +4,15 @@
 #include "language_server_api.h"
 #include "query.h"
 
-#include <sstream>
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <set>
 
 Index_Request::Index_Request(const std::string& path,
-                             const std::vector<std::string>& args,
+                             const CompileArgs& args,
                              bool is_interactive,
-                             const std::string& contents,
+                             const optional<std::string>& contents,
                              const std::shared_ptr<ICacheManager>& cache_manager,
                              lsRequestId id)
     : path(path),
@@ -49,6 +52,12 @@ Index_OnIndexed::Index_OnIndexed(IndexUpdate& update,
                                  PerformanceImportFile perf)
     : update(update), perf(perf) {}
 
+Index_OnWriteCache::Index_OnWriteCache(
+    const std::string& path,
+    const std::shared_ptr<ICacheManager>& cache_manager,
+    PerformanceImportFile perf)
+    : path(path), cache_manager(cache_manager), perf(perf) {}
+
 QueueManager* QueueManager::instance_ = nullptr;
 
 // static
@@ -65,31 +74,193 @@ void QueueManager::CreateInstance(MultiQueueWaiter* querydb_waiter,
   instance_ = new QueueManager(querydb_waiter, indexer_waiter, stdout_waiter);
 }
 
+StdoutPriority GetStdoutPriority(IpcId id) {
+  switch (id) {
+    case IpcId::TextDocumentPublishDiagnostics:
+      return StdoutPriority::Diagnostics;
+    case IpcId::CqueryPublishInactiveRegions:
+    case IpcId::CqueryPublishSemanticHighlighting:
+    case IpcId::CqueryProgress:
+      return StdoutPriority::Notification;
+    default:
+      return StdoutPriority::Response;
+  }
+}
+
 // static
 void QueueManager::WriteStdout(IpcId id, lsBaseOutMessage& response) {
-  std::ostringstream sstream;
-  response.Write(sstream);
+  WriteStdoutNotification(id, std::string(), false, response);
+}
 
+// static
+void QueueManager::WriteStdout(IpcId id, std::string content) {
+  WriteStdoutNotification(id, std::string(), false, std::move(content));
+}
+
+// static
+void QueueManager::WriteStdoutNotification(IpcId id,
+                                           const std::string& document,
+                                           bool supersedes,
+                                           lsBaseOutMessage& notification) {
   Stdout_Request out;
-  out.content = sstream.str();
+  long long start = RequestTracer::NowMicroseconds();
+  notification.Write(&out.content);
   out.id = id;
+  out.document = document;
+  out.supersedes = supersedes;
+  out.serialize_us = RequestTracer::NowMicroseconds() - start;
+  EnqueueStdout(std::move(out));
+}
+
+// static
+void QueueManager::WriteStdoutNotification(IpcId id,
+                                           const std::string& document,
+                                           bool supersedes,
+                                           std::string content) {
+  Stdout_Request out;
+  out.content = std::move(content);
+  out.id = id;
+  out.document = document;
+  out.supersedes = supersedes;
+  EnqueueStdout(std::move(out));
+}
+
+// static
+void QueueManager::EnqueueStdout(Stdout_Request out) {
+  out.priority = GetStdoutPriority(out.id);
+  out.request_id = RequestTracer::CurrentRequest();
+  out.queued_us = RequestTracer::NowMicroseconds();
   instance()->for_stdout.Enqueue(std::move(out));
 }
 
+// static
+void QueueManager::PrioritizeStdout(std::vector<Stdout_Request>* messages) {
+  // Walk back from the newest message so each superseding one drops what was
+  // queued before it.
+  std::set<std::pair<IpcId, std::string>> superseded;
+  std::vector<bool> keep(messages->size(), true);
+  for (size_t i = messages->size(); i-- > 0;) {
+    const Stdout_Request& message = (*messages)[i];
+    if (message.document.empty() && !message.supersedes)
+      continue;
+    std::pair<IpcId, std::string> key(message.id, message.document);
+    if (superseded.count(key))
+      keep[i] = false;
+    else if (message.supersedes)
+      superseded.insert(key);
+  }
+
+  std::vector<Stdout_Request> result;
+  result.reserve(messages->size());
+  for (size_t i = 0; i < messages->size(); i++) {
+    if (keep[i])
+      result.push_back(std::move((*messages)[i]));
+  }
+  std::stable_sort(result.begin(), result.end(),
+                   [](const Stdout_Request& a, const Stdout_Request& b) {
+                     return a.priority < b.priority;
+                   });
+  *messages = std::move(result);
+}
+
 QueueManager::QueueManager(MultiQueueWaiter* querydb_waiter,
                            MultiQueueWaiter* indexer_waiter,
                            MultiQueueWaiter* stdout_waiter)
-    : for_stdout(stdout_waiter),
-      for_querydb(querydb_waiter),
-      do_id_map(querydb_waiter),
-      index_request(indexer_waiter),
-      load_previous_index(indexer_waiter),
-      on_id_mapped(indexer_waiter),
+    : for_stdout("queue.for_stdout", stdout_waiter),
+      for_querydb("queue.for_querydb", querydb_waiter),
+      for_querydb_readers("queue.for_querydb_readers"),
+      index_request("queue.index_request", indexer_waiter),
+      do_id_map("queue.do_id_map", indexer_waiter),
+      load_previous_index("queue.load_previous_index", indexer_waiter),
+      on_id_mapped("queue.on_id_mapped", indexer_waiter),
       // TODO on_indexed is shared by "querydb" and "indexer"
-      on_indexed(querydb_waiter, indexer_waiter) {}
+      on_indexed("queue.on_indexed", querydb_waiter, indexer_waiter),
+      write_cache("queue.write_cache") {}
 
 bool QueueManager::HasWork() {
   return !index_request.IsEmpty() || !do_id_map.IsEmpty() ||
          !load_previous_index.IsEmpty() || !on_id_mapped.IsEmpty() ||
-         !on_indexed.IsEmpty();
+         !on_indexed.IsEmpty() || !write_cache.IsEmpty() ||
+         !for_querydb_readers.IsEmpty();
+}
+
+void QueueManager::StartRequest(const lsRequestId& id) {
+  if (std::holds_alternative<std::monostate>(id))
+    return;
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  requests_.emplace(id, false);
+}
+
+void QueueManager::FinishRequest(const lsRequestId& id) {
+  if (std::holds_alternative<std::monostate>(id))
+    return;
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  auto it = requests_.find(id);
+  if (it == requests_.end())
+    return;
+  if (it->second)
+    num_cancelled_--;
+  requests_.erase(it);
+}
+
+void QueueManager::CancelRequest(const lsRequestId& id) {
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  auto it = requests_.find(id);
+  if (it != requests_.end() && !it->second) {
+    it->second = true;
+    num_cancelled_++;
+  }
+}
+
+size_t QueueManager::NumRequestsInFlight() {
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  return requests_.size();
+}
+
+bool QueueManager::IsRequestCancelled(const lsRequestId& id) {
+  if (!num_cancelled_ || std::holds_alternative<std::monostate>(id))
+    return false;
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  auto it = requests_.find(id);
+  return it != requests_.end() && it->second;
+}
+
+TEST_SUITE("QueueManager") {
+  TEST_CASE("prioritize stdout") {
+    auto make = [](IpcId id, const std::string& content,
+                   const std::string& document,
+                   bool supersedes) -> Stdout_Request {
+      Stdout_Request out;
+      out.id = id;
+      out.content = content;
+      out.priority = GetStdoutPriority(id);
+      out.document = document;
+      out.supersedes = supersedes;
+      return out;
+    };
+    std::vector<Stdout_Request> messages;
+    messages.push_back(
+        make(IpcId::CqueryPublishSemanticHighlighting, "full a", "a", true));
+    messages.push_back(make(IpcId::CqueryPublishSemanticHighlighting,
+                            "delta a", "a", false));
+    messages.push_back(
+        make(IpcId::TextDocumentPublishDiagnostics, "diag a", "a", true));
+    messages.push_back(make(IpcId::CqueryPublishSemanticHighlighting,
+                            "full a 2", "a", true));
+    messages.push_back(make(IpcId::CqueryPublishSemanticHighlighting,
+                            "delta a 2", "a", false));
+    messages.push_back(
+        make(IpcId::CqueryPublishSemanticHighlighting, "full b", "b", true));
+    messages.push_back(make(IpcId::TextDocumentHover, "hover", "", false));
+    messages.push_back(
+        make(IpcId::TextDocumentPublishDiagnostics, "diag a 2", "a", true));
+
+    QueueManager::PrioritizeStdout(&messages);
+    std::vector<std::string> contents;
+    for (const Stdout_Request& message : messages)
+      contents.push_back(message.content);
+    std::vector<std::string> expected = {"hover", "diag a 2", "full a 2",
+                                         "delta a 2", "full b"};
+    REQUIRE(contents == expected);
+  }
 }
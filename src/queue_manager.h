@@ -1,34 +1,78 @@
 #pragma once
 
+#include "compile_args.h"
 #include "ipc.h"
 #include "performance.h"
 #include "query.h"
+#include "request_tracer.h"
 #include "threaded_queue.h"
+#include "timer.h"
 
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 struct ICacheManager;
 struct lsBaseOutMessage;
 
+// Order in which the stdout thread writes the messages which are queued when
+// it gets to them. Messages of the same priority keep the order they were
+// queued in. This way a completion or hover response does not wait for the
+// semantic highlighting of a big file.
+enum class StdoutPriority {
+  // Responses to requests, and everything else the client waits for.
+  Response,
+  Diagnostics,
+  // Semantic highlighting, inactive regions and progress.
+  Notification,
+};
+
+// Returns the priority of the messages written with |id|.
+StdoutPriority GetStdoutPriority(IpcId id);
+
 struct Stdout_Request {
   IpcId id;
   std::string content;
+  StdoutPriority priority = StdoutPriority::Response;
+  // The document a notification is about. A notification which |supersedes|
+  // replaces all the queued messages with the same |id| and |document|, so
+  // only the newest of them is written. Semantic highlighting deltas apply on
+  // top of the previous update, so they do not supersede anything, but are
+  // dropped along with it in favour of a newer full update.
+  std::string document;
+  bool supersedes = false;
+  // The request whose handler wrote this, see RequestTracer.
+  lsRequestId request_id;
+  long long serialize_us = 0;
+  // RequestTracer::NowMicroseconds() when this was queued.
+  long long queued_us = 0;
 };
 
 struct Index_Request {
   std::string path;
-  // TODO: make |args| a string that is parsed lazily.
-  std::vector<std::string> args;
+  CompileArgs args;
   bool is_interactive;
-  std::string contents;  // Preloaded contents.
+  // Preloaded contents. If not set, the indexer reads the file once it knows
+  // that the file needs to be parsed.
+  optional<std::string> contents;
   std::shared_ptr<ICacheManager> cache_manager;
   lsRequestId id;
-
+  // True if |path| is not part of the project, ie, a header. It is then
+  // indexed through a translation unit which includes it.
+  bool is_inferred = false;
+  // True once the cache entries of the request were prefetched, see
+  // Config::cachePrefetchCount.
+  bool is_prefetched = false;
+  // Started when the request is created; measures time spent in the queue.
+  Timer queued_time;
 
   Index_Request(const std::string& path,
-                const std::vector<std::string>& args,
+                const CompileArgs& args,
                 bool is_interactive,
-                const std::string& contents,
+                const optional<std::string>& contents,
                 const std::shared_ptr<ICacheManager>& cache_manager,
                 lsRequestId id = {});
 };
@@ -42,6 +86,9 @@ struct Index_DoIdMap {
   bool is_interactive = false;
   bool write_to_disk = false;
   bool load_previous = false;
+  // Set when the request was handed over by ImportManager::DoneQueryDbImport,
+  // so the import of the file is already started on its behalf.
+  bool owns_querydb_import = false;
 
   Index_DoIdMap(std::unique_ptr<IndexFile> current,
                 const std::shared_ptr<ICacheManager>& cache_manager,
@@ -75,28 +122,75 @@ struct Index_OnIdMapped {
 struct Index_OnIndexed {
   IndexUpdate update;
   PerformanceImportFile perf;
+  // Started when indexing finished; measures time until querydb applies the
+  // update.
+  Timer queued_time;
+  // Estimated memory used by |update|, counted in the "queue.on_indexed"
+  // memory gauge while it is queued.
+  size_t memory_bytes = 0;
 
   Index_OnIndexed(IndexUpdate& update, PerformanceImportFile perf);
 };
 
+// The index of |path| itself waits in the pending indexes of the import
+// pipeline until it is written, so that it can still be read meanwhile.
+struct Index_OnWriteCache {
+  std::string path;
+  std::shared_ptr<ICacheManager> cache_manager;
+  PerformanceImportFile perf;
+
+  Index_OnWriteCache(const std::string& path,
+                     const std::shared_ptr<ICacheManager>& cache_manager,
+                     PerformanceImportFile perf);
+};
+
 struct QueueManager {
   static QueueManager* instance();
   static void CreateInstance(MultiQueueWaiter* querydb_waiter,
                              MultiQueueWaiter* indexer_waiter,
                              MultiQueueWaiter* stdout_waiter);
   static void WriteStdout(IpcId id, lsBaseOutMessage& response);
+  // Writes a message which is already serialized, including its header.
+  static void WriteStdout(IpcId id, std::string content);
+  // Writes a notification about |document|, see Stdout_Request::document.
+  static void WriteStdoutNotification(IpcId id,
+                                      const std::string& document,
+                                      bool supersedes,
+                                      lsBaseOutMessage& notification);
+  static void WriteStdoutNotification(IpcId id,
+                                      const std::string& document,
+                                      bool supersedes,
+                                      std::string content);
+  // Drops the messages of |messages|, in the order they were queued, which a
+  // later one supersedes, and sorts the rest by priority.
+  static void PrioritizeStdout(std::vector<Stdout_Request>* messages);
 
   bool HasWork();
 
+  // Request cancellation. A request is in flight from the time the stdin
+  // thread queues it until querydb has run its handler. $/cancelRequest only
+  // marks in-flight requests; requests without an id are never tracked.
+  void StartRequest(const lsRequestId& id);
+  void FinishRequest(const lsRequestId& id);
+  void CancelRequest(const lsRequestId& id);
+  // Cheap enough to be polled from loops when nothing is cancelled.
+  bool IsRequestCancelled(const lsRequestId& id);
+  // Number of requests querydb did not run the handler of yet.
+  size_t NumRequestsInFlight();
+
+  RequestTracer request_tracer;
+
   // Runs on stdout thread.
   ThreadedQueue<Stdout_Request> for_stdout;
 
   // Runs on querydb thread.
   ThreadedQueue<std::unique_ptr<BaseIpcMessage>> for_querydb;
-  ThreadedQueue<Index_DoIdMap> do_id_map;
+  // Runs on querydb reader threads.
+  ThreadedQueue<std::unique_ptr<BaseIpcMessage>> for_querydb_readers;
 
   // Runs on indexer threads.
   ThreadedQueue<Index_Request> index_request;
+  ThreadedQueue<Index_DoIdMap> do_id_map;
   ThreadedQueue<Index_DoIdMap> load_previous_index;
   ThreadedQueue<Index_OnIdMapped> on_id_mapped;
 
@@ -104,10 +198,20 @@ struct QueueManager {
   // TODO split on_indexed
   ThreadedQueue<Index_OnIndexed> on_indexed;
 
+  // Runs on the cache writer thread.
+  ThreadedQueue<Index_OnWriteCache> write_cache;
+
  private:
   explicit QueueManager(MultiQueueWaiter* querydb_waiter,
                         MultiQueueWaiter* indexer_waiter,
                         MultiQueueWaiter* stdout_waiter);
 
   static QueueManager* instance_;
+
+  static void EnqueueStdout(Stdout_Request out);
+
+  std::mutex requests_mutex_;
+  // In-flight request ids, mapped to whether they have been cancelled.
+  std::map<lsRequestId, bool> requests_;
+  std::atomic<int> num_cancelled_{0};
 };
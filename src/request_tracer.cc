@@ -0,0 +1,235 @@
+#include "request_tracer.h"
+
+#include "config.h"
+#include "metrics.h"
+#include "queue_manager.h"
+#include "timer.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+// Traces without a response after this long are dropped; some requests are
+// answered by nothing but an error, or not at all.
+const long long kStaleTraceUs = 10 * 60 * 1000 * 1000LL;
+// Stale traces are looked for every this many requests.
+const size_t kStaleTraceCheckInterval = 256;
+
+thread_local lsRequestId g_current_request;
+
+std::string FormatMilliseconds(long long microseconds) {
+  return std::to_string(microseconds / 1000) + "." +
+         std::to_string(microseconds % 1000 / 100) + "ms";
+}
+
+}  // namespace
+
+long long RequestTracer::Stages::TotalMicroseconds() const {
+  return parse_us + queue_us + handler_us + async_us + serialize_us +
+         stdout_queue_us + write_us;
+}
+
+std::string RequestTracer::Stages::ToString() const {
+  std::string result = "parse " + FormatMilliseconds(parse_us) + ", queue " +
+                       FormatMilliseconds(queue_us) + ", handler " +
+                       FormatMilliseconds(handler_us);
+  if (async_us > 0)
+    result += ", async " + FormatMilliseconds(async_us);
+  result += ", serialize " + FormatMilliseconds(serialize_us) +
+            ", stdout_queue " + FormatMilliseconds(stdout_queue_us) +
+            ", write " + FormatMilliseconds(write_us);
+  return result;
+}
+
+// static
+RequestTracer::Stages RequestTracer::ComputeStages(const Timeline& timeline) {
+  Stages stages;
+  stages.parse_us = timeline.parse_us;
+  stages.serialize_us = timeline.serialize_us;
+
+  // The handler may return before or after the response is serialized. Only
+  // the time until then delays the response.
+  long long serialize_start =
+      timeline.response_queued_us - timeline.serialize_us;
+  long long handler_start = serialize_start;
+  if (timeline.handler_start_us >= 0)
+    handler_start = std::min(timeline.handler_start_us, serialize_start);
+  long long handler_end = serialize_start;
+  if (timeline.handler_end_us >= 0)
+    handler_end = std::min(timeline.handler_end_us, serialize_start);
+  handler_end = std::max(handler_end, handler_start);
+
+  stages.queue_us = std::max(0LL, handler_start - timeline.received_us);
+  stages.handler_us = handler_end - handler_start;
+  stages.async_us = serialize_start - handler_end;
+  stages.stdout_queue_us =
+      std::max(0LL, timeline.write_start_us - timeline.response_queued_us);
+  stages.write_us =
+      std::max(0LL, timeline.write_end_us - timeline.write_start_us);
+  return stages;
+}
+
+// static
+long long RequestTracer::NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             Timer::Clock::now().time_since_epoch())
+      .count();
+}
+
+// static
+lsRequestId RequestTracer::CurrentRequest() {
+  return g_current_request;
+}
+
+void RequestTracer::Init(Config* config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  config_ = config;
+}
+
+void RequestTracer::OnReceived(const lsRequestId& id,
+                               IpcId method,
+                               long long parse_us) {
+  if (std::holds_alternative<std::monostate>(id))
+    return;
+  long long now = NowMicroseconds();
+  std::lock_guard<std::mutex> lock(mutex_);
+  Trace& trace = traces_[id];
+  trace.method = method;
+  trace.timeline = Timeline();
+  trace.timeline.received_us = now;
+  trace.timeline.parse_us = parse_us;
+  if (++num_received_ % kStaleTraceCheckInterval == 0)
+    ForgetStaleTraces(now);
+}
+
+void RequestTracer::OnHandlerStarted(const lsRequestId& id) {
+  if (std::holds_alternative<std::monostate>(id))
+    return;
+  long long now = NowMicroseconds();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = traces_.find(id);
+  if (it != traces_.end())
+    it->second.timeline.handler_start_us = now;
+}
+
+void RequestTracer::OnHandlerFinished(const lsRequestId& id) {
+  if (std::holds_alternative<std::monostate>(id))
+    return;
+  long long now = NowMicroseconds();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = traces_.find(id);
+  if (it != traces_.end())
+    it->second.timeline.handler_end_us = now;
+}
+
+void RequestTracer::OnWritten(const Stdout_Request& response,
+                              long long write_start_us,
+                              long long write_end_us) {
+  Timeline timeline;
+  lsRequestId id;
+  int threshold_ms = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = traces_.end();
+    if (!std::holds_alternative<std::monostate>(response.request_id)) {
+      it = traces_.find(response.request_id);
+      if (it != traces_.end() && it->second.method != response.id)
+        it = traces_.end();
+    } else {
+      // Written by a thread which does not know the request, ie, a code
+      // completion worker.
+      for (auto i = traces_.begin(); i != traces_.end(); ++i) {
+        if (i->second.method == response.id &&
+            (it == traces_.end() || i->second.timeline.received_us <
+                                        it->second.timeline.received_us)) {
+          it = i;
+        }
+      }
+    }
+    if (it == traces_.end())
+      return;
+    id = it->first;
+    timeline = it->second.timeline;
+    traces_.erase(it);
+    if (config_)
+      threshold_ms = config_->slowRequestThresholdMs;
+  }
+  timeline.serialize_us = response.serialize_us;
+  timeline.response_queued_us = response.queued_us;
+  timeline.write_start_us = write_start_us;
+  timeline.write_end_us = write_end_us;
+
+  Stages stages = ComputeStages(timeline);
+  long long total_us = stages.TotalMicroseconds();
+  std::string method = IpcIdToString(response.id);
+  GetLatencyHistogram("request." + method)->Record(total_us);
+  LOG_S(INFO) << "[e2e] Running " << method << " took "
+              << FormatMilliseconds(total_us);
+  if (threshold_ms > 0 && total_us >= threshold_ms * 1000LL) {
+    GetLatencyHistogram("request_slow." + method)->Record(total_us);
+    std::string printed_id = std::holds_alternative<int64_t>(id)
+                                 ? std::to_string(std::get<int64_t>(id))
+                                 : std::get<std::string>(id);
+    LOG_S(WARNING) << "[e2e] Slow request " << method << " (id " << printed_id
+                   << ") took " << FormatMilliseconds(total_us) << ": "
+                   << stages.ToString();
+  }
+}
+
+void RequestTracer::Forget(const lsRequestId& id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  traces_.erase(id);
+}
+
+void RequestTracer::ForgetStaleTraces(long long now_us) {
+  for (auto it = traces_.begin(); it != traces_.end();) {
+    if (now_us - it->second.timeline.received_us > kStaleTraceUs)
+      it = traces_.erase(it);
+    else
+      ++it;
+  }
+}
+
+ScopedRequestTrace::ScopedRequestTrace(const lsRequestId& id)
+    : id_(id), previous_(g_current_request) {
+  g_current_request = id;
+  QueueManager::instance()->request_tracer.OnHandlerStarted(id);
+}
+
+ScopedRequestTrace::~ScopedRequestTrace() {
+  QueueManager::instance()->request_tracer.OnHandlerFinished(id_);
+  g_current_request = previous_;
+}
+
+TEST_SUITE("RequestTracer") {
+  TEST_CASE("stages") {
+    RequestTracer::Timeline timeline;
+    timeline.received_us = 1000;
+    timeline.parse_us = 50;
+    timeline.handler_start_us = 3000;
+    timeline.handler_end_us = 9000;
+    timeline.serialize_us = 500;
+    timeline.response_queued_us = 8000;
+    timeline.write_start_us = 8200;
+    timeline.write_end_us = 8300;
+    RequestTracer::Stages stages = RequestTracer::ComputeStages(timeline);
+    REQUIRE(stages.queue_us == 2000);
+    // The handler kept running after serializing its response.
+    REQUIRE(stages.handler_us == 4500);
+    REQUIRE(stages.async_us == 0);
+    REQUIRE(stages.stdout_queue_us == 200);
+    REQUIRE(stages.write_us == 100);
+    REQUIRE(stages.TotalMicroseconds() == 50 + 8300 - 1000);
+
+    // The response was computed on another thread after the handler returned.
+    timeline.handler_end_us = 4000;
+    stages = RequestTracer::ComputeStages(timeline);
+    REQUIRE(stages.handler_us == 1000);
+    REQUIRE(stages.async_us == 3500);
+    REQUIRE(stages.TotalMicroseconds() == 50 + 8300 - 1000);
+  }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "ipc.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+
+struct Config;
+struct Stdout_Request;
+
+// Follows each request from reading it on stdin until its response is written
+// to stdout. The time is split into these stages:
+//   parse: reading the JSON of the request into a BaseIpcMessage.
+//   queue: waiting in for_querydb and for_querydb_readers for its handler.
+//   handler: running the handler until it serialized the response.
+//   async: waiting for work the handler handed to another thread, ie, code
+//     completion, once the handler returned.
+//   serialize: serializing the response, see QueueManager::WriteStdout.
+//   stdout_queue: waiting in for_stdout for the stdout thread.
+//   write: writing the response to stdout.
+// Requests slower than |Config::slowRequestThresholdMs| log their stages, and
+// are counted in the "request_slow.<method>" latency histograms next to the
+// "request.<method>" ones.
+//
+// Only requests with an id are traced. A response belongs to the request
+// whose handler runs on the thread serializing it, see ScopedRequestTrace, or
+// else to the oldest traced request of the same method.
+class RequestTracer {
+ public:
+  // Timestamps of a request in microseconds; -1 if not reached.
+  struct Timeline {
+    long long received_us = -1;
+    long long parse_us = 0;
+    long long handler_start_us = -1;
+    long long handler_end_us = -1;
+    long long serialize_us = 0;
+    long long response_queued_us = -1;
+    long long write_start_us = -1;
+    long long write_end_us = -1;
+  };
+
+  struct Stages {
+    long long parse_us = 0;
+    long long queue_us = 0;
+    long long handler_us = 0;
+    long long async_us = 0;
+    long long serialize_us = 0;
+    long long stdout_queue_us = 0;
+    long long write_us = 0;
+
+    long long TotalMicroseconds() const;
+    // Returns ie "parse 0.1ms, queue 1200.0ms, handler 35.2ms, ...".
+    std::string ToString() const;
+  };
+
+  // Splits |timeline| of a written response into stages.
+  static Stages ComputeStages(const Timeline& timeline);
+  // Returns the current time as used by Timeline.
+  static long long NowMicroseconds();
+  // Returns the request whose handler runs on this thread, if any.
+  static lsRequestId CurrentRequest();
+
+  void Init(Config* config);
+
+  // Called by the stdin thread once |id| took |parse_us| to parse.
+  void OnReceived(const lsRequestId& id, IpcId method, long long parse_us);
+  void OnHandlerStarted(const lsRequestId& id);
+  void OnHandlerFinished(const lsRequestId& id);
+  // Called by the stdout thread once |response| was written. Finishes the
+  // trace of the request |response| belongs to.
+  void OnWritten(const Stdout_Request& response,
+                 long long write_start_us,
+                 long long write_end_us);
+  // Stops tracing |id|, ie, if it was cancelled.
+  void Forget(const lsRequestId& id);
+
+ private:
+  struct Trace {
+    IpcId method;
+    Timeline timeline;
+  };
+
+  // Drops traces which never got a response.
+  void ForgetStaleTraces(long long now_us);
+
+  // Read when a request finishes, since the config is only known once the
+  // client initialized cquery.
+  Config* config_ = nullptr;
+
+  std::mutex mutex_;
+  // Guarded by |mutex_|.
+  std::map<lsRequestId, Trace> traces_;
+  size_t num_received_ = 0;
+};
+
+// Makes the calling thread run the handler of |id| while in scope, and traces
+// the time spent in the handler.
+class ScopedRequestTrace {
+ public:
+  explicit ScopedRequestTrace(const lsRequestId& id);
+  ~ScopedRequestTrace();
+
+ private:
+  lsRequestId id_;
+  lsRequestId previous_;
+};
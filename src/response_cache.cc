@@ -0,0 +1,77 @@
+#include "response_cache.h"
+
+#include "queue_manager.h"
+#include "working_files.h"
+
+namespace {
+// Number of files whose results are kept.
+const int kResponseCacheSize = 32;
+}  // namespace
+
+ResponseCache::ResponseCache() : entries_(kResponseCacheSize) {}
+
+// static
+ResponseCache::Key ResponseCache::GetKey(QueryDatabase* db,
+                                         WorkingFiles* working_files,
+                                         const std::string& path) {
+  Key key;
+  key.generation = db->generation;
+  WorkingFile* working_file = working_files->GetFileByFilename(path);
+  if (working_file)
+    key.change_count = working_file->change_count;
+  return key;
+}
+
+bool ResponseCache::TryWrite(IpcId ipc_id,
+                             const std::string& path,
+                             const Key& key,
+                             const lsRequestId& id) {
+  std::string json;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Entry> entry = entries_.TryGet(path);
+    if (!entry)
+      return false;
+    auto it = entry->results.find(int(ipc_id));
+    if (it == entry->results.end() || !(it->second.key == key))
+      return false;
+    json = it->second.json;
+  }
+  Write(ipc_id, id, json);
+  return true;
+}
+
+// static
+void ResponseCache::Write(IpcId ipc_id,
+                          const lsRequestId& id,
+                          const std::string& result_json) {
+  // The members are in the order of the Out_* messages: jsonrpc, id, result.
+  std::unique_ptr<rapidjson::StringBuffer> output = TakeOutputBuffer();
+  rapidjson::Writer<rapidjson::StringBuffer> writer(*output);
+  JsonWriter json_writer(&writer);
+  lsRequestId id_copy = id;
+  Reflect(json_writer, id_copy);
+
+  std::string body = "{\"jsonrpc\":\"2.0\",\"id\":";
+  body.append(output->GetString(), output->GetSize());
+  body += ",\"result\":";
+  body += result_json;
+  body += '}';
+  ReturnOutputBuffer(std::move(output));
+
+  std::string content;
+  AppendOutMessage(body.data(), body.size(), &content);
+  QueueManager::WriteStdout(ipc_id, std::move(content));
+}
+
+void ResponseCache::Store(IpcId ipc_id,
+                          const std::string& path,
+                          const Key& key,
+                          std::string result_json) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<Entry> entry =
+      entries_.Get(path, []() { return std::make_shared<Entry>(); });
+  Result& result = entry->results[int(ipc_id)];
+  result.key = key;
+  result.json = std::move(result_json);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "language_server_api.h"
+#include "lru_cache.h"
+#include "query.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct WorkingFiles;
+
+// Serialized results of requests which are computed from a single file, like
+// textDocument/documentSymbol. Editors send several of them whenever a file
+// gets focus, so a result is written again as is while neither querydb nor
+// the working file changed.
+struct ResponseCache {
+  // What a result was computed from. |change_count| is the
+  // WorkingFile::change_count of the file, or -1 if it is not open.
+  struct Key {
+    Generation generation = 0;
+    int64_t change_count = -1;
+
+    bool operator==(const Key& o) const {
+      return generation == o.generation && change_count == o.change_count;
+    }
+  };
+
+  ResponseCache();
+
+  // Must be called while holding |db->mutex|.
+  static Key GetKey(QueryDatabase* db,
+                    WorkingFiles* working_files,
+                    const std::string& path);
+
+  // Writes the result of the last |ipc_id| request on |path| as the response
+  // to request |id|, if it was computed at |key|. Returns false otherwise.
+  bool TryWrite(IpcId ipc_id,
+                const std::string& path,
+                const Key& key,
+                const lsRequestId& id);
+  // Writes |result| as the response to request |id| and caches it.
+  template <typename TResult>
+  void WriteAndStore(IpcId ipc_id,
+                     const std::string& path,
+                     const Key& key,
+                     const lsRequestId& id,
+                     TResult& result) {
+    std::unique_ptr<rapidjson::StringBuffer> output = TakeOutputBuffer();
+    rapidjson::Writer<rapidjson::StringBuffer> writer(*output);
+    JsonWriter json_writer(&writer);
+    Reflect(json_writer, result);
+    std::string json(output->GetString(), output->GetSize());
+    ReturnOutputBuffer(std::move(output));
+
+    Write(ipc_id, id, json);
+    Store(ipc_id, path, key, std::move(json));
+  }
+
+ private:
+  struct Result {
+    Key key;
+    std::string json;
+  };
+  // Results for one path, by IpcId.
+  struct Entry {
+    std::unordered_map<int, Result> results;
+  };
+
+  static void Write(IpcId ipc_id,
+                    const lsRequestId& id,
+                    const std::string& result_json);
+  void Store(IpcId ipc_id,
+             const std::string& path,
+             const Key& key,
+             std::string result_json);
+
+  // Read-only handlers use the cache from querydb reader threads.
+  std::mutex mutex_;
+  LruCache<std::string, Entry> entries_;
+};
@@ -1,31 +1,31 @@
 #include "semantic_highlight_symbol_cache.h"
 
+#include <doctest/doctest.h>
+
 SemanticHighlightSymbolCache::Entry::Entry(
     SemanticHighlightSymbolCache* all_caches,
     const std::string& path)
     : all_caches_(all_caches), path(path) {}
 
 optional<int> SemanticHighlightSymbolCache::Entry::TryGetStableId(
-    SymbolKind kind,
-    const std::string& detailed_name) {
-  TNameToId* map = GetMapForSymbol_(kind);
-  auto it = map->find(detailed_name);
+    SymbolKind kind, Usr usr) {
+  TUsrToId* map = GetMapForSymbol_(kind);
+  auto it = map->find(usr);
   if (it != map->end())
     return it->second;
 
   return nullopt;
 }
 
-int SemanticHighlightSymbolCache::Entry::GetStableId(
-    SymbolKind kind,
-    const std::string& detailed_name) {
-  optional<int> id = TryGetStableId(kind, detailed_name);
+int SemanticHighlightSymbolCache::Entry::GetStableId(SymbolKind kind,
+                                                     Usr usr) {
+  optional<int> id = TryGetStableId(kind, usr);
   if (id)
     return *id;
 
   // Create a new id. First try to find a key in another map.
   all_caches_->cache_.IterateValues([&](const std::shared_ptr<Entry>& entry) {
-    optional<int> other_id = entry->TryGetStableId(kind, detailed_name);
+    optional<int> other_id = entry->TryGetStableId(kind, usr);
     if (other_id) {
       id = other_id;
       return false;
@@ -34,21 +34,21 @@ int SemanticHighlightSymbolCache::Entry::GetStableId(
   });
 
   // Create a new id.
-  TNameToId* map = GetMapForSymbol_(kind);
+  TUsrToId* map = GetMapForSymbol_(kind);
   if (!id)
     id = all_caches_->next_stable_id_++;
-  return (*map)[detailed_name] = *id;
+  return (*map)[usr] = *id;
 }
 
-SemanticHighlightSymbolCache::Entry::TNameToId*
+SemanticHighlightSymbolCache::Entry::TUsrToId*
 SemanticHighlightSymbolCache::Entry::GetMapForSymbol_(SymbolKind kind) {
   switch (kind) {
     case SymbolKind::Type:
-      return &detailed_type_name_to_stable_id;
+      return &type_usr_to_stable_id;
     case SymbolKind::Func:
-      return &detailed_func_name_to_stable_id;
+      return &func_usr_to_stable_id;
     case SymbolKind::Var:
-      return &detailed_var_name_to_stable_id;
+      return &var_usr_to_stable_id;
     case SymbolKind::File:
     case SymbolKind::Invalid:
       break;
@@ -65,3 +65,30 @@ SemanticHighlightSymbolCache::GetCacheForFile(const std::string& path) {
   return cache_.Get(
       path, [&, this]() { return std::make_shared<Entry>(this, path); });
 }
+
+int SemanticHighlightSymbolCache::DropPublishedSymbols() {
+  int count = 0;
+  cache_.IterateValues([&](const std::shared_ptr<Entry>& entry) {
+    if (entry->published_symbols)
+      count++;
+    entry->published_symbols = nullopt;
+    entry->published_content.clear();
+    entry->published_content.shrink_to_fit();
+    return true;
+  });
+  return count;
+}
+
+TEST_SUITE("SemanticHighlightSymbolCache") {
+  TEST_CASE("stable ids") {
+    SemanticHighlightSymbolCache cache;
+    auto a = cache.GetCacheForFile("a.cc");
+    auto b = cache.GetCacheForFile("b.cc");
+    int id = a->GetStableId(SymbolKind::Func, 1);
+    REQUIRE(a->GetStableId(SymbolKind::Func, 1) == id);
+    // Other files reuse the id of a symbol.
+    REQUIRE(b->GetStableId(SymbolKind::Func, 1) == id);
+    REQUIRE(b->GetStableId(SymbolKind::Var, 1) != id);
+    REQUIRE(a->GetStableId(SymbolKind::Func, 2) != id);
+  }
+}
@@ -1,12 +1,14 @@
 #pragma once
 
 #include "lru_cache.h"
+#include "message_handler.h"
 #include "query.h"
 
 #include <optional.h>
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 // Caches symbols for a single file for semantic highlighting to provide
 // relatively stable ids. Only supports xxx files at a time.
@@ -16,26 +18,41 @@ struct SemanticHighlightSymbolCache {
 
     // The path this cache belongs to.
     std::string path;
-    // Detailed symbol name to stable id.
-    using TNameToId = std::unordered_map<std::string, int>;
-    TNameToId detailed_type_name_to_stable_id;
-    TNameToId detailed_func_name_to_stable_id;
-    TNameToId detailed_var_name_to_stable_id;
+    // Symbol usr to stable id.
+    using TUsrToId = std::unordered_map<Usr, int>;
+    TUsrToId type_usr_to_stable_id;
+    TUsrToId func_usr_to_stable_id;
+    TUsrToId var_usr_to_stable_id;
+    // Symbols of the last semantic highlighting published for |path|, sorted
+    // by stable id.
+    optional<std::vector<Out_CqueryPublishSemanticHighlighting::Symbol>>
+        published_symbols;
+    // QueryDatabase::generation and WorkingFile::change_count which
+    // |published_symbols| were computed at. If they did not change, the
+    // symbols are the same and |published_content| is sent again as is.
+    Generation published_generation = 0;
+    uint32_t published_change_count = 0;
+    // The last full message for |published_symbols|, or empty if a delta was
+    // published since.
+    std::string published_content;
 
     Entry(SemanticHighlightSymbolCache* all_caches, const std::string& path);
 
-    optional<int> TryGetStableId(SymbolKind kind,
-                                 const std::string& detailed_name);
-    int GetStableId(SymbolKind kind, const std::string& detailed_name);
+    optional<int> TryGetStableId(SymbolKind kind, Usr usr);
+    int GetStableId(SymbolKind kind, Usr usr);
 
-    TNameToId* GetMapForSymbol_(SymbolKind kind);
+    TUsrToId* GetMapForSymbol_(SymbolKind kind);
   };
 
-  constexpr static int kCacheSize = 10;
+  constexpr static int kCacheSize = 128;
   LruCache<std::string, Entry> cache_;
   uint32_t next_stable_id_ = 0;
 
   SemanticHighlightSymbolCache();
 
   std::shared_ptr<Entry> GetCacheForFile(const std::string& path);
+  // Forgets the published symbols of every file to free memory; the next
+  // highlighting of a file is published in full. The stable ids stay. Returns
+  // the number of files which had published symbols.
+  int DropPublishedSymbols();
 };
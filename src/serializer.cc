@@ -1,5 +1,6 @@
 #include "serializer.h"
 
+#include "serializers/binary.h"
 #include "serializers/json.h"
 #include "serializers/msgpack.h"
 
@@ -9,6 +10,7 @@
 #include <loguru.hpp>
 
 #include <stdexcept>
+#include <thread>
 
 namespace {
 bool gTestOutputMode = false;
@@ -125,6 +127,16 @@ void Reflect(Writer& visitor, std::string_view& data) {
     visitor.String(&data[0], (rapidjson::SizeType)data.size());
 }
 
+void Reflect(Reader& visitor, InternedString& value) {
+  if (!visitor.IsString())
+    throw std::invalid_argument("InternedString");
+  std::string storage;
+  value = InternedString(visitor.GetStringView(&storage));
+}
+void Reflect(Writer& visitor, InternedString& value) {
+  visitor.String(value.c_str(), (rapidjson::SizeType)value.size());
+}
+
 
 // TODO: Move this to indexer.cc
 void Reflect(Reader& visitor, IndexInclude& value) {
@@ -254,34 +266,139 @@ void Reflect(TVisitor& visitor, IndexVar& value) {
 // IndexFile
 bool ReflectMemberStart(Writer& visitor, IndexFile& value) {
   // FIXME
-  auto it = value.id_cache.usr_to_type_id.find(HashUsr(""));
-  if (it != value.id_cache.usr_to_type_id.end()) {
-    value.Resolve(it->second)->def.detailed_name = "<fundamental>";
-    assert(value.Resolve(it->second)->uses.size() == 0);
+  if (const IndexTypeId* id =
+          value.id_cache.usr_to_type_id.Find(HashUsr(""))) {
+    value.Resolve(*id)->def.detailed_name = "<fundamental>";
+    assert(value.Resolve(*id)->uses.size() == 0);
   }
 
   DefaultReflectMemberStart(visitor);
   return true;
 }
+// Everything besides the symbols, which binary caches store separately.
 template <typename TVisitor>
-void Reflect(TVisitor& visitor, IndexFile& value) {
-  REFLECT_MEMBER_START();
+void ReflectFileHeader(TVisitor& visitor, IndexFile& value) {
   if (!gTestOutputMode) {
     REFLECT_MEMBER(last_modification_time);
+    REFLECT_MEMBER(file_contents_hash);
     REFLECT_MEMBER(language);
     REFLECT_MEMBER(import_file);
+    REFLECT_MEMBER(import_file_parse_time);
     REFLECT_MEMBER(args);
   }
   REFLECT_MEMBER(includes);
   if (!gTestOutputMode)
     REFLECT_MEMBER(dependencies);
   REFLECT_MEMBER(skipped_by_preprocessor);
+}
+template <typename TVisitor>
+void Reflect(TVisitor& visitor, IndexFile& value) {
+  REFLECT_MEMBER_START();
+  ReflectFileHeader(visitor, value);
   REFLECT_MEMBER(types);
   REFLECT_MEMBER(funcs);
   REFLECT_MEMBER(vars);
   REFLECT_MEMBER_END();
 }
 
+namespace {
+
+// Binary caches end with the types, funcs and vars of the file in sections of
+// their own, preceded by a table of the section sizes. The sections of large
+// files are read on separate threads, as single cache files of generated code
+// can take seconds to read.
+const size_t kNumSections = 3;
+// Files with fewer bytes of sections are not worth starting threads for.
+const size_t kParallelSectionBytes = 4 << 20;
+
+void WriteBinarySections(BinaryWriter& writer, IndexFile& file) {
+  std::string sections[kNumSections];
+  BinaryWriter types(&sections[0]);
+  Reflect(types, file.types);
+  BinaryWriter funcs(&sections[1]);
+  Reflect(funcs, file.funcs);
+  BinaryWriter vars(&sections[2]);
+  Reflect(vars, file.vars);
+  for (std::string& section : sections) {
+    uint32_t size = uint32_t(section.size());
+    Reflect(writer, size);
+  }
+  for (std::string& section : sections)
+    writer.Append(section);
+}
+
+template <typename T>
+void ReadBinarySection(std::string_view section,
+                       int minor,
+                       std::vector<T>* values) {
+  BinaryReader reader(section);
+  reader.SetMinorVersion(minor);
+  Reflect(reader, *values);
+  if (!reader.AtEnd())
+    throw std::invalid_argument("section size");
+}
+
+// |content| is the whole cache file, |reader| is positioned at the table of
+// section sizes.
+void ReadBinarySections(BinaryReader& reader,
+                        const std::string& content,
+                        IndexFile* file) {
+  uint32_t sizes[kNumSections];
+  size_t total = 0;
+  for (uint32_t& size : sizes) {
+    Reflect(reader, size);
+    total += size;
+  }
+  if (total != reader.Remaining())
+    throw std::invalid_argument("section sizes");
+  int minor = reader.MinorVersion();
+  const char* start = content.data() + content.size() - total;
+  std::string_view types(start, sizes[0]);
+  std::string_view funcs(start + sizes[0], sizes[1]);
+  std::string_view vars(start + sizes[0] + sizes[1], sizes[2]);
+
+  if (total < kParallelSectionBytes) {
+    ReadBinarySection(types, minor, &file->types);
+    ReadBinarySection(funcs, minor, &file->funcs);
+    ReadBinarySection(vars, minor, &file->vars);
+    return;
+  }
+  // Exceptions must not escape the threads, so they are passed back as
+  // messages.
+  std::string errors[kNumSections];
+  auto read = [&](size_t section) {
+    try {
+      if (section == 0)
+        ReadBinarySection(types, minor, &file->types);
+      else if (section == 1)
+        ReadBinarySection(funcs, minor, &file->funcs);
+      else
+        ReadBinarySection(vars, minor, &file->vars);
+    } catch (std::invalid_argument& e) {
+      errors[section] = e.what();
+    }
+  };
+  std::thread types_thread(read, 0);
+  std::thread funcs_thread(read, 1);
+  read(2);
+  types_thread.join();
+  funcs_thread.join();
+  for (const std::string& error : errors) {
+    if (!error.empty())
+      throw std::invalid_argument(error);
+  }
+}
+
+// Returns true if caches of the schema version |major|.|minor| can be read,
+// see IndexFile::kMinorVersion.
+bool IsReadableVersion(int major, int minor) {
+  return major == IndexFile::GetMajorVersion() &&
+         minor >= IndexFile::kMinimumMinorVersion &&
+         minor <= IndexFile::kMinorVersion;
+}
+
+}  // namespace
+
 void Reflect(Reader& visitor, std::monostate&) {
   visitor.GetNull();
 }
@@ -292,7 +409,12 @@ void Reflect(Writer& visitor, std::monostate&) {
 
 void Reflect(Reader& visitor, SerializeFormat& value) {
   std::string fmt = visitor.GetString();
-  value = fmt[0] == 'm' ? SerializeFormat::MessagePack : SerializeFormat::Json;
+  if (fmt == "binary")
+    value = SerializeFormat::Binary;
+  else if (!fmt.empty() && fmt[0] == 'm')
+    value = SerializeFormat::MessagePack;
+  else
+    value = SerializeFormat::Json;
 }
 
 void Reflect(Writer& visitor, SerializeFormat& value) {
@@ -303,6 +425,9 @@ void Reflect(Writer& visitor, SerializeFormat& value) {
     case SerializeFormat::MessagePack:
       visitor.String("msgpack");
       break;
+    case SerializeFormat::Binary:
+      visitor.String("binary");
+      break;
   }
 }
 
@@ -316,7 +441,7 @@ std::string Serialize(SerializeFormat format, IndexFile& file) {
       writer.SetIndent(' ', 2);
       JsonWriter json_writer(&writer);
       if (!gTestOutputMode) {
-        std::string version = std::to_string(IndexFile::kMajorVersion);
+        std::string version = std::to_string(IndexFile::GetMajorVersion());
         for (char c : version)
           output.Put(c);
         output.Put('\n');
@@ -328,13 +453,25 @@ std::string Serialize(SerializeFormat format, IndexFile& file) {
       msgpack::sbuffer buf;
       msgpack::packer<msgpack::sbuffer> pk(&buf);
       MessagePackWriter msgpack_writer(&pk);
-      uint64_t magic = IndexFile::kMajorVersion;
+      uint64_t magic = IndexFile::GetMajorVersion();
       int version = IndexFile::kMinorVersion;
       Reflect(msgpack_writer, magic);
       Reflect(msgpack_writer, version);
       Reflect(msgpack_writer, file);
       return std::string(buf.data(), buf.size());
     }
+    case SerializeFormat::Binary: {
+      std::string buf;
+      BinaryWriter binary_writer(&buf);
+      int major = IndexFile::GetMajorVersion();
+      int minor = IndexFile::kMinorVersion;
+      Reflect(binary_writer, major);
+      Reflect(binary_writer, minor);
+      ReflectMemberStart(binary_writer, file);
+      ReflectFileHeader(binary_writer, file);
+      WriteBinarySections(binary_writer, file);
+      return buf;
+    }
   }
   return "";
 }
@@ -389,9 +526,9 @@ std::unique_ptr<IndexFile> Deserialize(SerializeFormat format,
         MessagePackReader reader(&upk);
         Reflect(reader, major);
         Reflect(reader, minor);
-        if (major != IndexFile::kMajorVersion ||
-            minor != IndexFile::kMinorVersion)
+        if (!IsReadableVersion(major, minor))
           throw std::invalid_argument("Invalid version");
+        reader.SetMinorVersion(minor);
         Reflect(reader, *file);
       } catch (std::invalid_argument& e) {
         LOG_S(INFO) << "Failed to deserialize msgpack '" << path
@@ -400,22 +537,51 @@ std::unique_ptr<IndexFile> Deserialize(SerializeFormat format,
       }
       break;
     }
+
+    case SerializeFormat::Binary: {
+      try {
+        int major, minor;
+        BinaryReader reader(serialized_index_content);
+        Reflect(reader, major);
+        Reflect(reader, minor);
+        if (!IsReadableVersion(major, minor))
+          throw std::invalid_argument("Invalid version");
+        reader.SetMinorVersion(minor);
+        file = MakeUnique<IndexFile>(path, file_content);
+        ReflectFileHeader(reader, *file);
+        ReadBinarySections(reader, serialized_index_content, file.get());
+      } catch (std::invalid_argument& e) {
+        LOG_S(INFO) << "Failed to deserialize binary '" << path
+                    << "': " << e.what();
+        return nullptr;
+      }
+      break;
+    }
   }
 
   // Restore non-serialized state.
   file->path = path;
   file->id_cache.primary_file = file->path;
+  file->id_cache.usr_to_type_id.reserve(file->types.size());
+  file->id_cache.usr_to_func_id.reserve(file->funcs.size());
+  file->id_cache.usr_to_var_id.reserve(file->vars.size());
   for (const auto& type : file->types) {
-    file->id_cache.type_id_to_usr[type.id] = type.usr;
-    file->id_cache.usr_to_type_id[type.usr] = type.id;
+    if (file->id_cache.type_id_to_usr.size() <= size_t(type.id.id))
+      file->id_cache.type_id_to_usr.resize(type.id.id + 1);
+    file->id_cache.type_id_to_usr[type.id.id] = type.usr;
+    file->id_cache.usr_to_type_id.Set(type.usr, type.id);
   }
   for (const auto& func : file->funcs) {
-    file->id_cache.func_id_to_usr[func.id] = func.usr;
-    file->id_cache.usr_to_func_id[func.usr] = func.id;
+    if (file->id_cache.func_id_to_usr.size() <= size_t(func.id.id))
+      file->id_cache.func_id_to_usr.resize(func.id.id + 1);
+    file->id_cache.func_id_to_usr[func.id.id] = func.usr;
+    file->id_cache.usr_to_func_id.Set(func.usr, func.id);
   }
   for (const auto& var : file->vars) {
-    file->id_cache.var_id_to_usr[var.id] = var.usr;
-    file->id_cache.usr_to_var_id[var.usr] = var.id;
+    if (file->id_cache.var_id_to_usr.size() <= size_t(var.id.id))
+      file->id_cache.var_id_to_usr.resize(var.id.id + 1);
+    file->id_cache.var_id_to_usr[var.id.id] = var.usr;
+    file->id_cache.usr_to_var_id.Set(var.usr, var.id);
   }
 
   return file;
@@ -425,7 +591,56 @@ void SetTestOutputMode() {
   gTestOutputMode = true;
 }
 
+namespace {
+
+// Schema of version 6 of a struct whose version 5 was |old_member| and
+// |removed_member|.
+struct VersionedValue {
+  int old_member = 0;
+  int new_member = 0;
+};
+template <typename TVisitor>
+void Reflect(TVisitor& visitor, VersionedValue& value) {
+  REFLECT_MEMBER_START();
+  REFLECT_MEMBER(old_member);
+  REFLECT_REMOVED_MEMBER(6, std::string, removed_member);
+  REFLECT_MEMBER_SINCE(6, new_member);
+  REFLECT_MEMBER_END();
+}
+
+}  // namespace
+
 TEST_SUITE("Serializer utils") {
+  TEST_CASE("schema versions") {
+    std::string old_content;
+    BinaryWriter old_writer(&old_content);
+    int old_member = 1;
+    std::string removed_member = "removed";
+    Reflect(old_writer, old_member);
+    Reflect(old_writer, removed_member);
+
+    VersionedValue value;
+    BinaryReader old_reader(old_content);
+    old_reader.SetMinorVersion(5);
+    Reflect(old_reader, value);
+    REQUIRE(old_reader.AtEnd());
+    REQUIRE(value.old_member == 1);
+    REQUIRE(value.new_member == 0);
+
+    std::string content;
+    BinaryWriter writer(&content);
+    value.new_member = 2;
+    Reflect(writer, value);
+    VersionedValue read_value;
+    BinaryReader reader(content);
+    reader.SetMinorVersion(6);
+    Reflect(reader, read_value);
+    REQUIRE(reader.AtEnd());
+    REQUIRE(read_value.old_member == 1);
+    REQUIRE(read_value.new_member == 2);
+  }
+
+
   TEST_CASE("GetBaseName") {
     REQUIRE(GetBaseName("foo.cc") == "foo.cc");
     REQUIRE(GetBaseName("foo/foo.cc") == "foo.cc");
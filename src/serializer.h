@@ -1,5 +1,6 @@
 #pragma once
 
+#include "interned_string.h"
 #include "maybe.h"
 #include "port.h"
 
@@ -9,12 +10,13 @@
 #include <variant.h>
 
 #include <cassert>
+#include <climits>
 #include <memory>
 #include <string>
 #include <type_traits>
 #include <vector>
 
-enum class SerializeFormat { Json, MessagePack };
+enum class SerializeFormat { Json, MessagePack, Binary };
 
 class Reader {
  public:
@@ -38,12 +40,32 @@ class Reader {
   virtual uint64_t GetUint64() = 0;
   virtual double GetDouble() = 0;
   virtual std::string GetString() = 0;
+  // Like GetString, but returns a view into the serialized buffer if the
+  // format allows, and only otherwise stores the string in |*storage|.
+  virtual std::string_view GetStringView(std::string* storage) {
+    *storage = GetString();
+    return *storage;
+  }
+
+  // Returns the number of elements IterArray is going to visit if the format
+  // knows it up front, or 0. Only a hint for reserving space.
+  virtual size_t PeekArraySize() { return 0; }
 
   virtual bool HasMember(const char* x) = 0;
   virtual std::unique_ptr<Reader> operator[](const char* x) = 0;
 
   virtual void IterArray(std::function<void(Reader&)> fn) = 0;
   virtual void DoMember(const char* name, std::function<void(Reader&)> fn) = 0;
+
+  // Minor version of the cached index being read, see
+  // IndexFile::kMinorVersion. Formats which do not store member names only
+  // hold the members which existed in that version, see
+  // REFLECT_MEMBER_SINCE. Other data is always read with all members.
+  int MinorVersion() const { return minor_version_; }
+  void SetMinorVersion(int minor_version) { minor_version_ = minor_version; }
+
+ private:
+  int minor_version_ = INT_MAX;
 };
 
 class Writer {
@@ -74,6 +96,14 @@ struct IndexFile;
 #define REFLECT_MEMBER_END1(value) ReflectMemberEnd(visitor, value);
 #define REFLECT_MEMBER(name) ReflectMember(visitor, #name, value.name)
 #define REFLECT_MEMBER2(name, value) ReflectMember(visitor, name, value)
+// Reflects a member which was added in the minor version |minor| of the cache
+// schema. Older caches are still read, leaving the member at its default.
+#define REFLECT_MEMBER_SINCE(minor, name) \
+  ReflectMemberSince(visitor, minor, #name, value.name)
+// Skips a member of type |type| which was removed in the minor version
+// |minor|, when reading older caches.
+#define REFLECT_REMOVED_MEMBER(minor, type, name) \
+  ReflectRemovedMember<type>(visitor, minor, #name)
 
 #define MAKE_REFLECT_TYPE_PROXY(type_name) \
   MAKE_REFLECT_TYPE_PROXY2(type_name, std::underlying_type<type_name>::type)
@@ -160,6 +190,9 @@ void Reflect(Writer& visitor, std::string& value);
 void Reflect(Reader& visitor, std::string_view& view);
 void Reflect(Writer& visitor, std::string_view& view);
 
+void Reflect(Reader& visitor, InternedString& value);
+void Reflect(Writer& visitor, InternedString& value);
+
 // std::monostate is used to represent JSON null
 void Reflect(Reader& visitor, std::monostate&);
 void Reflect(Writer& visitor, std::monostate&);
@@ -186,10 +219,14 @@ void Reflect(Reader& visitor, optional<T>& value) {
 }
 template <typename T>
 void Reflect(Writer& visitor, optional<T>& value) {
-  if (value)
+  if (value) {
+    // BinaryReader cannot tell null from a value, so mark present values.
+    if (visitor.Format() == SerializeFormat::Binary)
+      visitor.Bool(true);
     Reflect(visitor, *value);
-  else
+  } else {
     visitor.Null();
+  }
 }
 
 // The same as std::optional
@@ -205,10 +242,13 @@ void Reflect(Reader& visitor, Maybe<T>& value) {
 }
 template <typename T>
 void Reflect(Writer& visitor, Maybe<T>& value) {
-  if (value)
+  if (value) {
+    if (visitor.Format() == SerializeFormat::Binary)
+      visitor.Bool(true);
     Reflect(visitor, *value);
-  else
+  } else {
     visitor.Null();
+  }
 }
 
 template <typename T>
@@ -298,16 +338,18 @@ void Reflect(TVisitor& visitor, std::variant<Ts...>& value) {
 }
 
 // std::vector
-template <typename T>
-void Reflect(Reader& visitor, std::vector<T>& values) {
+//
+// Elements are read in place, as copying them would copy everything they own.
+template <typename T, typename TAllocator>
+void Reflect(Reader& visitor, std::vector<T, TAllocator>& values) {
+  values.reserve(values.size() + visitor.PeekArraySize());
   visitor.IterArray([&](Reader& entry) {
-    T entry_value;
-    Reflect(entry, entry_value);
-    values.push_back(entry_value);
+    values.emplace_back();
+    Reflect(entry, values.back());
   });
 }
-template <typename T>
-void Reflect(Writer& visitor, std::vector<T>& values) {
+template <typename T, typename TAllocator>
+void Reflect(Writer& visitor, std::vector<T, TAllocator>& values) {
   visitor.StartArray(values.size());
   for (auto& value : values)
     Reflect(visitor, value);
@@ -348,6 +390,35 @@ void ReflectMember(Writer& visitor, const char* name, T& value) {
   Reflect(visitor, value);
 }
 
+template <typename T>
+void ReflectMemberSince(Reader& visitor,
+                        int minor,
+                        const char* name,
+                        T& value) {
+  if (visitor.Format() == SerializeFormat::Json ||
+      visitor.MinorVersion() >= minor) {
+    ReflectMember(visitor, name, value);
+  }
+}
+template <typename T>
+void ReflectMemberSince(Writer& visitor,
+                        int minor,
+                        const char* name,
+                        T& value) {
+  ReflectMember(visitor, name, value);
+}
+
+template <typename T>
+void ReflectRemovedMember(Reader& visitor, int minor, const char* name) {
+  if (visitor.Format() != SerializeFormat::Json &&
+      visitor.MinorVersion() < minor) {
+    T value;
+    ReflectMember(visitor, name, value);
+  }
+}
+template <typename T>
+void ReflectRemovedMember(Writer& visitor, int minor, const char* name) {}
+
 // API
 
 std::string Serialize(SerializeFormat format, IndexFile& file);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "serializer.h"
+
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+// Binary serialization format. Values are stored in struct member order
+// without type tags or keys, as fixed-width integers in host byte order.
+// Strings and arrays are prefixed with their uint32_t length. Nullable values
+// are prefixed with a presence byte, see Reflect(Writer&, optional<T>&).
+// Range lists are packed into a varint string, see
+// Reflect(Writer&, std::vector<Range>&).
+//
+// Readers work directly on the serialized buffer and never copy it.
+class BinaryReader final : public Reader {
+  const char* p_;
+  const char* end_;
+
+  template <typename T>
+  T Get() {
+    if (size_t(end_ - p_) < sizeof(T))
+      throw std::invalid_argument("truncated");
+    T ret;
+    memcpy(&ret, p_, sizeof(T));
+    p_ += sizeof(T);
+    return ret;
+  }
+
+ public:
+  BinaryReader(std::string_view buf)
+      : p_(buf.data()), end_(buf.data() + buf.size()) {}
+  SerializeFormat Format() const override { return SerializeFormat::Binary; }
+
+  // There are no type tags, the schema decides what comes next.
+  bool IsBool() override { return true; }
+  // Consumes the presence byte of a nullable value.
+  bool IsNull() override { return !Get<uint8_t>(); }
+  bool IsArray() override { return true; }
+  bool IsInt() override { return true; }
+  bool IsInt64() override { return true; }
+  bool IsUint64() override { return true; }
+  bool IsDouble() override { return true; }
+  bool IsString() override { return true; }
+
+  void GetNull() override {}
+  bool GetBool() override { return Get<uint8_t>() != 0; }
+  int GetInt() override { return Get<int32_t>(); }
+  uint32_t GetUint32() override { return Get<uint32_t>(); }
+  int64_t GetInt64() override { return Get<int64_t>(); }
+  uint64_t GetUint64() override { return Get<uint64_t>(); }
+  double GetDouble() override { return Get<double>(); }
+  std::string GetString() override {
+    uint32_t n = Get<uint32_t>();
+    if (size_t(end_ - p_) < n)
+      throw std::invalid_argument("truncated");
+    std::string ret(p_, n);
+    p_ += n;
+    return ret;
+  }
+  std::string_view GetStringView(std::string*) override {
+    uint32_t n = Get<uint32_t>();
+    if (size_t(end_ - p_) < n)
+      throw std::invalid_argument("truncated");
+    std::string_view ret(p_, n);
+    p_ += n;
+    return ret;
+  }
+
+  // Peeks at the length prefix. Elements take at least a byte each, so the
+  // hint is capped by what is left of a damaged buffer.
+  size_t PeekArraySize() override {
+    uint32_t n;
+    if (size_t(end_ - p_) < sizeof(n))
+      return 0;
+    memcpy(&n, p_, sizeof(n));
+    return std::min(size_t(n), size_t(end_ - p_));
+  }
+
+  bool HasMember(const char* x) override { return true; }
+  std::unique_ptr<Reader> operator[](const char* x) override { return {}; }
+
+  // Number of bytes which were not read yet.
+  size_t Remaining() const { return size_t(end_ - p_); }
+  bool AtEnd() const { return p_ == end_; }
+
+  void IterArray(std::function<void(Reader&)> fn) override {
+    for (uint32_t n = Get<uint32_t>(); n; n--)
+      fn(*this);
+  }
+
+  void DoMember(const char*, std::function<void(Reader&)> fn) override {
+    fn(*this);
+  }
+};
+
+class BinaryWriter final : public Writer {
+  std::string* buf_;
+
+  template <typename T>
+  void Pack(T x) {
+    buf_->append(reinterpret_cast<const char*>(&x), sizeof(T));
+  }
+
+ public:
+  BinaryWriter(std::string* buf) : buf_(buf) {}
+  SerializeFormat Format() const override { return SerializeFormat::Binary; }
+
+  void Null() override { Pack<uint8_t>(0); }
+  void Bool(bool x) override { Pack<uint8_t>(x); }
+  void Int(int x) override { Pack<int32_t>(x); }
+  void Uint32(uint32_t x) override { Pack(x); }
+  void Int64(int64_t x) override { Pack(x); }
+  void Uint64(uint64_t x) override { Pack(x); }
+  void Double(double x) override { Pack(x); }
+  void String(const char* x) override { String(x, strlen(x)); }
+  void String(const char* x, size_t len) override {
+    Pack<uint32_t>(uint32_t(len));
+    buf_->append(x, len);
+  }
+  void StartArray(size_t n) override { Pack<uint32_t>(uint32_t(n)); }
+  void EndArray() override {}
+  void StartObject() override {}
+  void EndObject() override {}
+  void Key(const char* name) override {}
+
+  // Appends |data| as is, eg. a section serialized by another writer.
+  void Append(const std::string& data) { buf_->append(data); }
+};
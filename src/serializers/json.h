@@ -30,6 +30,10 @@ class JsonReader : public Reader {
   uint64_t GetUint64() override { return m_->GetUint64(); }
   double GetDouble() override { return m_->GetDouble(); }
   std::string GetString() override { return m_->GetString(); }
+  std::string_view GetStringView(std::string*) override {
+    return std::string_view(m_->GetString(), m_->GetStringLength());
+  }
+  size_t PeekArraySize() override { return m_->IsArray() ? m_->Size() : 0; }
 
   bool HasMember(const char* x) override { return m_->HasMember(x); }
   std::unique_ptr<Reader> operator[](const char* x) override {
@@ -95,4 +99,115 @@ class JsonWriter : public Writer {
   void StartObject() override { m_->StartObject(); }
   void EndObject() override { m_->EndObject(); }
   void Key(const char* name) override { m_->Key(name); }
+
+  // The underlying writer, see DirectJsonWriter.
+  rapidjson::Writer<rapidjson::StringBuffer>* Get() const { return m_; }
 };
+
+// Writes JSON straight into the rapidjson writer of a JsonWriter, without the
+// virtual Writer calls of Reflect, and without escaping member names at
+// runtime as they are string literals which need none. Used for the types
+// which make up most of the output, ie, locations, completion items and
+// semantic highlighting symbols; see MAKE_REFLECT_STRUCT_DIRECT_JSON.
+class DirectJsonWriter {
+  rapidjson::Writer<rapidjson::StringBuffer>* m_;
+
+ public:
+  explicit DirectJsonWriter(rapidjson::Writer<rapidjson::StringBuffer>* m)
+      : m_(m) {}
+
+  // |quoted_name| is the member name in quotes, ie, "\"uri\"".
+  template <size_t N>
+  void Key(const char (&quoted_name)[N]) {
+    m_->RawValue(quoted_name, N - 1, rapidjson::kStringType);
+  }
+  void Bool(bool x) { m_->Bool(x); }
+  void Int(int x) { m_->Int(x); }
+  void String(const char* x, size_t len) {
+    m_->String(x, (rapidjson::SizeType)len);
+  }
+  void StartArray() { m_->StartArray(); }
+  void EndArray() { m_->EndArray(); }
+  void StartObject() { m_->StartObject(); }
+  void EndObject() { m_->EndObject(); }
+};
+
+inline void WriteDirectJson(DirectJsonWriter& writer, bool value) {
+  writer.Bool(value);
+}
+inline void WriteDirectJson(DirectJsonWriter& writer, int value) {
+  writer.Int(value);
+}
+inline void WriteDirectJson(DirectJsonWriter& writer,
+                            const std::string& value) {
+  writer.String(value.data(), value.size());
+}
+// Enums are written as integers, as MAKE_REFLECT_TYPE_PROXY does for the enums
+// of the types written directly.
+template <typename T>
+typename std::enable_if<std::is_enum<T>::value>::type WriteDirectJson(
+    DirectJsonWriter& writer,
+    T value) {
+  writer.Int(static_cast<int>(value));
+}
+template <typename T>
+void WriteDirectJson(DirectJsonWriter& writer, const std::vector<T>& values) {
+  writer.StartArray();
+  for (const T& value : values)
+    WriteDirectJson(writer, value);
+  writer.EndArray();
+}
+
+template <size_t N, typename T>
+void WriteDirectJsonMember(DirectJsonWriter& writer,
+                           const char (&quoted_name)[N],
+                           const T& value) {
+  writer.Key(quoted_name);
+  WriteDirectJson(writer, value);
+}
+// Omitted if not set, like ReflectMember.
+template <size_t N, typename T>
+void WriteDirectJsonMember(DirectJsonWriter& writer,
+                           const char (&quoted_name)[N],
+                           const optional<T>& value) {
+  if (value) {
+    writer.Key(quoted_name);
+    WriteDirectJson(writer, *value);
+  }
+}
+
+// Writes |value| through DirectJsonWriter and returns true if |visitor| is a
+// JsonWriter.
+template <typename T>
+bool ReflectDirectJson(Writer& visitor, T& value) {
+  if (visitor.Format() != SerializeFormat::Json)
+    return false;
+  DirectJsonWriter writer(static_cast<JsonWriter&>(visitor).Get());
+  WriteDirectJson(writer, value);
+  return true;
+}
+template <typename T>
+bool ReflectDirectJson(Reader& visitor, T& value) {
+  return false;
+}
+
+#define _MAPPABLE_WRITE_DIRECT_JSON_MEMBER(name) \
+  WriteDirectJsonMember(writer, "\"" #name "\"", value.name);
+
+// Same as MAKE_REFLECT_STRUCT, but a JsonWriter writes |type| through
+// DirectJsonWriter. Each member needs a WriteDirectJson overload.
+#define MAKE_REFLECT_STRUCT_DIRECT_JSON(type, ...)                        \
+  ATTRIBUTE_UNUSED inline void WriteDirectJson(DirectJsonWriter& writer,  \
+                                               const type& value) {       \
+    writer.StartObject();                                                 \
+    MACRO_MAP(_MAPPABLE_WRITE_DIRECT_JSON_MEMBER, __VA_ARGS__)            \
+    writer.EndObject();                                                   \
+  }                                                                       \
+  template <typename TVisitor>                                            \
+  void Reflect(TVisitor& visitor, type& value) {                          \
+    if (ReflectDirectJson(visitor, value))                                \
+      return;                                                             \
+    REFLECT_MEMBER_START();                                               \
+    MACRO_MAP(_MAPPABLE_REFLECT_MEMBER, __VA_ARGS__)                      \
+    REFLECT_MEMBER_END();                                                 \
+  }
@@ -0,0 +1,186 @@
+#include "session_recording.h"
+
+#include "language_server_api.h"
+#include "metrics.h"
+#include "queue_manager.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+#include <rapidjson/document.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const char kTimeHeader[] = "X-Cquery-Time: ";
+
+// The replay is done once cquery was idle for this long after the last
+// message, since the index requests of opened files are only queued a
+// little after the notification was handled.
+const int kReplayIdleMs = 1000;
+
+struct RecordedMessage {
+  long long time_us = 0;
+  std::string content;
+};
+
+FILE* g_recording = nullptr;
+Timer g_recording_time;
+
+bool g_replaying = false;
+bool g_replay_max_speed = false;
+std::vector<RecordedMessage> g_replay_messages;
+size_t g_next_replay_message = 0;
+Timer g_replay_time;
+
+std::string FormatRecordedMessage(long long time_us,
+                                  const std::string& content) {
+  return kTimeHeader + std::to_string(time_us) +
+         "\r\nContent-Length: " + std::to_string(content.size()) +
+         "\r\n\r\n" + content;
+}
+
+// Reads the messages of a recording from |file|.
+std::vector<RecordedMessage> ReadRecordedMessages(FILE* file) {
+  std::vector<RecordedMessage> messages;
+  while (true) {
+    std::vector<std::string> headers;
+    optional<std::string> content = ReadJsonRpcContentFrom(file, &headers);
+    if (!content)
+      break;
+    RecordedMessage message;
+    for (const std::string& header : headers) {
+      if (StartsWith(header, kTimeHeader))
+        message.time_us = atoll(header.c_str() + strlen(kTimeHeader));
+    }
+    message.content = std::move(*content);
+    messages.push_back(std::move(message));
+  }
+  return messages;
+}
+
+bool IsExitNotification(const std::string& content) {
+  rapidjson::Document document;
+  document.Parse(content.c_str());
+  if (document.HasParseError() || !document.IsObject())
+    return false;
+  auto method = document.FindMember("method");
+  return method != document.MemberEnd() && method->value.IsString() &&
+         strcmp(method->value.GetString(), "exit") == 0;
+}
+
+bool IsIdle() {
+  auto* queue = QueueManager::instance();
+  return queue->NumRequestsInFlight() == 0 && !queue->HasWork() &&
+         queue->for_querydb.IsEmpty() && queue->for_stdout.IsEmpty();
+}
+
+void FinishReplay() {
+  int idle_ms = 0;
+  while (idle_ms < kReplayIdleMs) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    idle_ms = IsIdle() ? idle_ms + 100 : 0;
+  }
+
+  std::cerr << "Replayed " << g_replay_messages.size() << " messages in "
+            << FormatMicroseconds(g_replay_time.ElapsedMicroseconds())
+            << std::endl;
+  for (const LatencyHistogram::Summary& summary :
+       SummarizeLatencyHistograms()) {
+    if (!StartsWith(summary.name, "request."))
+      continue;
+    std::cerr << summary.name << ": count=" << summary.count
+              << " avg=" << FormatMicroseconds(summary.total_us / summary.count)
+              << " p50=" << FormatMicroseconds(summary.p50_us)
+              << " p90=" << FormatMicroseconds(summary.p90_us)
+              << " p99=" << FormatMicroseconds(summary.p99_us)
+              << " max=" << FormatMicroseconds(summary.max_us) << std::endl;
+  }
+  exit(0);
+}
+
+}  // namespace
+
+bool StartSessionRecording(const std::string& path) {
+  g_recording = fopen(path.c_str(), "wb");
+  if (!g_recording)
+    return false;
+  g_recording_time.Reset();
+  return true;
+}
+
+void RecordSessionMessage(const std::string& content) {
+  if (!g_recording)
+    return;
+  std::string message = FormatRecordedMessage(
+      g_recording_time.ElapsedMicroseconds(), content);
+  // Flush every message, so the recording is complete if cquery crashes.
+  fwrite(message.data(), 1, message.size(), g_recording);
+  fflush(g_recording);
+}
+
+bool StartSessionReplay(const std::string& path, bool max_speed) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  for (RecordedMessage& message : ReadRecordedMessages(file)) {
+    if (!IsExitNotification(message.content))
+      g_replay_messages.push_back(std::move(message));
+  }
+  fclose(file);
+  LOG_S(INFO) << "Replaying " << g_replay_messages.size() << " messages from "
+              << path;
+  g_replaying = true;
+  g_replay_max_speed = max_speed;
+  g_replay_time.Reset();
+  return true;
+}
+
+bool IsReplayingSession() {
+  return g_replaying;
+}
+
+std::string ReadReplayedMessage() {
+  if (g_next_replay_message == g_replay_messages.size())
+    FinishReplay();
+  RecordedMessage& message = g_replay_messages[g_next_replay_message++];
+  if (!g_replay_max_speed) {
+    long long wait_us = message.time_us - g_replay_time.ElapsedMicroseconds();
+    if (wait_us > 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+  }
+  return std::move(message.content);
+}
+
+TEST_SUITE("SessionRecording") {
+  TEST_CASE("read recorded messages") {
+    FILE* file = tmpfile();
+    REQUIRE(file);
+    std::string recording = FormatRecordedMessage(0, "{}") +
+                            FormatRecordedMessage(1500, "{\"a\":1}");
+    fwrite(recording.data(), 1, recording.size(), file);
+    rewind(file);
+    std::vector<RecordedMessage> messages = ReadRecordedMessages(file);
+    fclose(file);
+    REQUIRE(messages.size() == 2);
+    REQUIRE(messages[0].time_us == 0);
+    REQUIRE(messages[0].content == "{}");
+    REQUIRE(messages[1].time_us == 1500);
+    REQUIRE(messages[1].content == "{\"a\":1}");
+  }
+
+  TEST_CASE("exit notification") {
+    REQUIRE(IsExitNotification("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}"));
+    REQUIRE(!IsExitNotification(
+        "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"shutdown\"}"));
+    REQUIRE(!IsExitNotification("[]"));
+  }
+}
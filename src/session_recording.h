@@ -0,0 +1,31 @@
+#pragma once
+
+#include <optional.h>
+
+#include <string>
+
+// Records the messages a client sends to cquery, and replays them later to
+// measure request latencies on a real session, see --record and --replay.
+//
+// A recording holds each JsonRpc message as it was read from stdin, with an
+// additional "X-Cquery-Time" header giving the microseconds since the first
+// message was recorded.
+
+// Appends every message read from stdin to |path| from now on. Returns false
+// if |path| cannot be written.
+bool StartSessionRecording(const std::string& path);
+// Called with the content of every message read from stdin.
+void RecordSessionMessage(const std::string& content);
+
+// Reads the messages recorded in |path|, which are then returned by
+// ReadReplayedMessage instead of reading stdin. The exit notification is
+// dropped, so that cquery keeps running until the replay is done. Returns
+// false if |path| cannot be read.
+bool StartSessionReplay(const std::string& path, bool max_speed);
+bool IsReplayingSession();
+// Returns the next recorded message once it is due: at the time it was
+// recorded, or right away if |max_speed| was set. After the last one, waits
+// until every request got its response and indexing is done, prints the
+// latency of each kind of request, from reading it to writing the response,
+// to stderr and exits.
+std::string ReadReplayedMessage();
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Reader/writer lock, as std::shared_mutex is not available in C++11.
+//
+// Writers are preferred: once a writer waits, new readers wait until it got
+// and released the lock, so a steady stream of queries cannot keep querydb
+// from importing. When the writer releases the lock, the readers which waited
+// meanwhile are let in before the next writer, so readers cannot starve
+// either.
+//
+// lock()/unlock() make this usable with std::lock_guard and std::unique_lock
+// for exclusive access. Use SharedLock for shared access. Exclusive access is
+// recursive, so that code which locks for a single update can also run from a
+// caller which already holds the lock; the holder may also take shared access.
+// Shared access is recursive as well, even while a writer waits.
+class SharedMutex {
+ public:
+  void lock() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (writer_depth_ && writer_ == std::this_thread::get_id()) {
+      writer_depth_++;
+      return;
+    }
+    waiting_writers_++;
+    cv_.wait(lock, [this] {
+      return !writer_depth_ && readers_ == 0 && !readers_turn_;
+    });
+    waiting_writers_--;
+    writer_ = std::this_thread::get_id();
+    writer_depth_ = 1;
+  }
+
+  void unlock() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--writer_depth_)
+        return;
+      readers_turn_ = waiting_readers_ > 0;
+    }
+    cv_.notify_all();
+  }
+
+  void lock_shared() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::thread::id id = std::this_thread::get_id();
+    int& depth = reader_depth_[id];
+    // Waiting for the writer would deadlock if this thread already holds the
+    // lock.
+    if (depth > 0 || (writer_depth_ && writer_ == id)) {
+      depth++;
+      readers_++;
+      return;
+    }
+    waiting_readers_++;
+    cv_.wait(lock, [this] {
+      return !writer_depth_ && (waiting_writers_ == 0 || readers_turn_);
+    });
+    if (--waiting_readers_ == 0)
+      readers_turn_ = false;
+    reader_depth_[id]++;
+    readers_++;
+  }
+
+  void unlock_shared() {
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = reader_depth_.find(std::this_thread::get_id());
+      if (--it->second == 0)
+        reader_depth_.erase(it);
+      last = --readers_ == 0;
+    }
+    if (last)
+      cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread::id writer_;
+  int writer_depth_ = 0;
+  int waiting_writers_ = 0;
+  int readers_ = 0;
+  int waiting_readers_ = 0;
+  // Set when a writer released the lock while readers waited, until they all
+  // got it.
+  bool readers_turn_ = false;
+  // Shared access held by each thread, to let it lock again.
+  std::unordered_map<std::thread::id, int> reader_depth_;
+};
+
+// RAII shared ownership of a SharedMutex.
+class SharedLock {
+ public:
+  explicit SharedLock(SharedMutex& mutex) : mutex_(mutex) {
+    mutex_.lock_shared();
+  }
+  ~SharedLock() { mutex_.unlock_shared(); }
+
+  SharedLock(const SharedLock&) = delete;
+  SharedLock& operator=(const SharedLock&) = delete;
+
+ private:
+  SharedMutex& mutex_;
+};
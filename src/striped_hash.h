@@ -0,0 +1,171 @@
+#pragma once
+
+#include "instrumented_mutex.h"
+
+#include <optional.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Number of separately locked parts of StripedHashSet and StripedHashMap.
+const size_t kHashStripes = 32;
+
+// Returns the stripe of a key with hash |hash|. The hash is mixed so that the
+// stripe does not depend on the same bits as the bucket inside of the stripe.
+inline size_t GetHashStripe(size_t hash) {
+  return size_t((uint64_t(hash) * 0x9E3779B97F4A7C15ull) >> 32) % kHashStripes;
+}
+
+// Hash set which is split into stripes with their own lock, so that threads
+// working on different keys rarely wait for each other. Every operation is
+// atomic, but operations on more than one key are not.
+template <typename TKey>
+class StripedHashSet {
+ public:
+  // The stripe locks record their statistics as |name|, see
+  // InstrumentedMutex.
+  explicit StripedHashSet(const char* name) {
+    for (size_t i = 0; i < kHashStripes; i++)
+      stripes_.emplace_back(name);
+  }
+
+  // Returns true if |key| was not in the set.
+  bool Insert(const TKey& key) {
+    Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    return stripe.keys.insert(key).second;
+  }
+  // Returns true if |key| was in the set.
+  bool Erase(const TKey& key) {
+    Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    return stripe.keys.erase(key) != 0;
+  }
+  bool Contains(const TKey& key) const {
+    const Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    return stripe.keys.count(key) != 0;
+  }
+  bool empty() const {
+    for (const Stripe& stripe : stripes_) {
+      std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+      if (!stripe.keys.empty())
+        return false;
+    }
+    return true;
+  }
+  // Returns a copy of all keys. Concurrent changes to other stripes may or may
+  // not be included.
+  std::vector<TKey> Snapshot() const {
+    std::vector<TKey> result;
+    for (const Stripe& stripe : stripes_) {
+      std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+      result.insert(result.end(), stripe.keys.begin(), stripe.keys.end());
+    }
+    return result;
+  }
+
+ private:
+  struct Stripe {
+    explicit Stripe(const char* name) : mutex(name) {}
+    mutable InstrumentedMutex mutex;
+    std::unordered_set<TKey> keys;
+  };
+
+  Stripe& GetStripe(const TKey& key) {
+    return stripes_[GetHashStripe(std::hash<TKey>()(key))];
+  }
+  const Stripe& GetStripe(const TKey& key) const {
+    return stripes_[GetHashStripe(std::hash<TKey>()(key))];
+  }
+
+  // A deque, since stripes cannot be moved.
+  std::deque<Stripe> stripes_;
+};
+
+// Hash map with the locking of StripedHashSet. Values are returned by copy,
+// or modified in place through Update().
+template <typename TKey, typename TValue>
+class StripedHashMap {
+ public:
+  // See StripedHashSet::StripedHashSet.
+  explicit StripedHashMap(const char* name) {
+    for (size_t i = 0; i < kHashStripes; i++)
+      stripes_.emplace_back(name);
+  }
+
+  optional<TValue> TryGet(const TKey& key) const {
+    const Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    auto it = stripe.map.find(key);
+    if (it == stripe.map.end())
+      return nullopt;
+    return it->second;
+  }
+  // Removes |key| and returns its value, if it was in the map.
+  optional<TValue> TryTake(const TKey& key) {
+    Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    auto it = stripe.map.find(key);
+    if (it == stripe.map.end())
+      return nullopt;
+    optional<TValue> result = std::move(it->second);
+    stripe.map.erase(it);
+    return result;
+  }
+  void Set(const TKey& key, TValue value) {
+    Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    stripe.map[key] = std::move(value);
+  }
+  // Calls |func| with the value of |key|, which is default constructed if it
+  // is not in the map. Must not access the map from |func|.
+  template <typename TFunc>
+  void Update(const TKey& key, TFunc func) {
+    Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    func(stripe.map[key]);
+  }
+  bool Erase(const TKey& key) {
+    Stripe& stripe = GetStripe(key);
+    std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+    return stripe.map.erase(key) != 0;
+  }
+  void Clear() {
+    for (Stripe& stripe : stripes_) {
+      std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+      std::unordered_map<TKey, TValue>().swap(stripe.map);
+    }
+  }
+  // Returns a copy of all entries. Concurrent changes to other stripes may or
+  // may not be included.
+  std::unordered_map<TKey, TValue> Snapshot() const {
+    std::unordered_map<TKey, TValue> result;
+    for (const Stripe& stripe : stripes_) {
+      std::lock_guard<InstrumentedMutex> lock(stripe.mutex);
+      result.insert(stripe.map.begin(), stripe.map.end());
+    }
+    return result;
+  }
+
+ private:
+  struct Stripe {
+    explicit Stripe(const char* name) : mutex(name) {}
+    mutable InstrumentedMutex mutex;
+    std::unordered_map<TKey, TValue> map;
+  };
+
+  Stripe& GetStripe(const TKey& key) {
+    return stripes_[GetHashStripe(std::hash<TKey>()(key))];
+  }
+  const Stripe& GetStripe(const TKey& key) const {
+    return stripes_[GetHashStripe(std::hash<TKey>()(key))];
+  }
+
+  std::deque<Stripe> stripes_;
+};
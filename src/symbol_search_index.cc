@@ -0,0 +1,312 @@
+#include "symbol_search_index.h"
+
+#include "utils.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <string>
+#include <utility>
+
+namespace {
+
+uint8_t Lower(char c) {
+  return uint8_t(tolower(uint8_t(c)));
+}
+
+uint32_t Trigram(std::string_view s, size_t i) {
+  return uint32_t(Lower(s[i])) << 16 | uint32_t(Lower(s[i + 1])) << 8 |
+         Lower(s[i + 2]);
+}
+
+// Invokes |fn| once for each distinct lowercased trigram of |s|.
+template <typename Fn>
+void ForEachTrigram(std::string_view s, Fn fn) {
+  if (s.size() < 3)
+    return;
+  std::vector<uint32_t> trigrams;
+  trigrams.reserve(s.size() - 2);
+  for (size_t i = 0; i + 2 < s.size(); i++)
+    trigrams.push_back(Trigram(s, i));
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                 trigrams.end());
+  for (uint32_t t : trigrams)
+    fn(t);
+}
+
+}  // namespace
+
+void SymbolSearchIndex::Postings::Add(uint32_t id) {
+  if (!ids.empty()) {
+    if (ids.back() == id)
+      return;
+    if (ids.back() > id)
+      sorted = false;
+  }
+  ids.push_back(id);
+}
+
+const std::vector<uint32_t>& SymbolSearchIndex::Postings::Get() const {
+  if (!sorted) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    sorted = true;
+  }
+  return ids;
+}
+
+void SymbolSearchIndex::Update(uint32_t symbol_idx,
+                               std::string_view detailed_name,
+                               std::string_view short_name) {
+  uint64_t hash = HashUsr(detailed_name.data(), detailed_name.size()) * 31 +
+                  HashUsr(short_name.data(), short_name.size());
+  if (hash == 0)
+    hash = 1;
+  if (symbol_idx >= indexed_hash_.size()) {
+    indexed_hash_.resize(symbol_idx + 1, 0);
+    char_masks_.resize(symbol_idx + 1, 0);
+    short_name_ranges_.resize(symbol_idx + 1);
+  }
+  if (indexed_hash_[symbol_idx] == hash)
+    return;
+  indexed_hash_[symbol_idx] = hash;
+  char_masks_[symbol_idx] = CharMask(short_name);
+
+  std::pair<uint32_t, uint32_t>& range = short_name_ranges_[symbol_idx];
+  live_short_name_bytes_ += short_name.size() - range.second;
+  range = std::make_pair(uint32_t(short_names_.size()),
+                         uint32_t(short_name.size()));
+  for (char c : short_name)
+    short_names_ += char(Lower(c));
+  if (short_names_.size() > 2 * live_short_name_bytes_ + 4096)
+    CompactShortNames();
+
+  ForEachTrigram(detailed_name,
+                 [&](uint32_t t) { trigrams_[t].Add(symbol_idx); });
+  bool seen[256] = {};
+  for (char c : short_name) {
+    uint8_t l = Lower(c);
+    if (!seen[l]) {
+      seen[l] = true;
+      chars_[l].Add(symbol_idx);
+    }
+  }
+}
+
+void SymbolSearchIndex::Remove(uint32_t symbol_idx) {
+  if (symbol_idx < indexed_hash_.size()) {
+    indexed_hash_[symbol_idx] = 0;
+    live_short_name_bytes_ -= short_name_ranges_[symbol_idx].second;
+    short_name_ranges_[symbol_idx] = std::make_pair(0, 0);
+  }
+}
+
+optional<std::vector<uint32_t>> SymbolSearchIndex::SubstringCandidates(
+    std::string_view query) const {
+  if (query.size() < 3)
+    return nullopt;
+  std::lock_guard<std::mutex> lock(lookup_mutex_);
+  std::vector<const Postings*> lists;
+  bool missing = false;
+  ForEachTrigram(query, [&](uint32_t t) {
+    auto it = trigrams_.find(t);
+    if (it == trigrams_.end())
+      missing = true;
+    else
+      lists.push_back(&it->second);
+  });
+  if (missing)
+    return std::vector<uint32_t>();
+  return Intersect(std::move(lists));
+}
+
+optional<std::vector<uint32_t>> SymbolSearchIndex::SubsequenceCandidates(
+    std::string_view query) const {
+  std::vector<const Postings*> lists;
+  bool seen[256] = {};
+  for (char c : query) {
+    if (isspace(uint8_t(c)))
+      continue;
+    uint8_t l = Lower(c);
+    if (!seen[l]) {
+      seen[l] = true;
+      lists.push_back(&chars_[l]);
+    }
+  }
+  if (lists.empty())
+    return nullopt;
+  std::lock_guard<std::mutex> lock(lookup_mutex_);
+
+  // Intersecting every list is expensive for long queries since the lists of
+  // common characters are huge. Intersect the two shortest lists and filter
+  // the result with the per-symbol character masks instead.
+  std::sort(lists.begin(), lists.end(),
+            [](const Postings* a, const Postings* b) {
+              return a->ids.size() < b->ids.size();
+            });
+  if (lists.size() > 2)
+    lists.resize(2);
+  std::vector<uint32_t> result = Intersect(std::move(lists));
+  uint64_t mask = CharMask(query);
+  result.erase(std::remove_if(result.begin(), result.end(),
+                              [&](uint32_t id) {
+                                return (mask & ~char_masks_[id]) != 0;
+                              }),
+               result.end());
+  return result;
+}
+
+void SymbolSearchIndex::CompactShortNames() {
+  std::string compacted;
+  compacted.reserve(live_short_name_bytes_);
+  for (std::pair<uint32_t, uint32_t>& range : short_name_ranges_) {
+    uint32_t offset = uint32_t(compacted.size());
+    compacted.append(short_names_, range.first, range.second);
+    range.first = offset;
+  }
+  short_names_.swap(compacted);
+}
+
+// static
+uint64_t SymbolSearchIndex::CharMask(std::string_view s) {
+  uint64_t mask = 0;
+  for (char c : s) {
+    uint8_t l = Lower(c);
+    int bit;
+    if (l >= 'a' && l <= 'z')
+      bit = l - 'a';
+    else if (l >= '0' && l <= '9')
+      bit = 26 + l - '0';
+    else if (l == '_')
+      bit = 36;
+    else if (isspace(l))
+      continue;
+    else
+      bit = 37 + l % 27;
+    mask |= uint64_t(1) << bit;
+  }
+  return mask;
+}
+
+size_t SymbolSearchIndex::EstimateMemoryUsage() const {
+  std::lock_guard<std::mutex> lock(lookup_mutex_);
+  size_t bytes = (indexed_hash_.capacity() + char_masks_.capacity()) *
+                 sizeof(uint64_t);
+  bytes += short_names_.capacity() +
+           short_name_ranges_.capacity() *
+               sizeof(std::pair<uint32_t, uint32_t>);
+  bytes += trigrams_.bucket_count() * sizeof(void*) +
+           trigrams_.size() *
+               (sizeof(std::pair<uint32_t, Postings>) + 2 * sizeof(void*));
+  for (const auto& entry : trigrams_)
+    bytes += entry.second.ids.capacity() * sizeof(uint32_t);
+  for (const Postings& postings : chars_)
+    bytes += postings.ids.capacity() * sizeof(uint32_t);
+  return bytes;
+}
+
+void SymbolSearchIndex::Swap(SymbolSearchIndex& other) {
+  std::lock(lookup_mutex_, other.lookup_mutex_);
+  std::lock_guard<std::mutex> lock(lookup_mutex_, std::adopt_lock);
+  std::lock_guard<std::mutex> other_lock(other.lookup_mutex_, std::adopt_lock);
+  indexed_hash_.swap(other.indexed_hash_);
+  char_masks_.swap(other.char_masks_);
+  short_names_.swap(other.short_names_);
+  short_name_ranges_.swap(other.short_name_ranges_);
+  std::swap(live_short_name_bytes_, other.live_short_name_bytes_);
+  trigrams_.swap(other.trigrams_);
+  chars_.swap(other.chars_);
+}
+
+// static
+std::vector<uint32_t> SymbolSearchIndex::Intersect(
+    std::vector<const Postings*> lists) {
+  // Start from the shortest list so the intermediate result stays small.
+  std::sort(lists.begin(), lists.end(),
+            [](const Postings* a, const Postings* b) {
+              return a->ids.size() < b->ids.size();
+            });
+  std::vector<uint32_t> result = lists[0]->Get(), tmp;
+  for (size_t i = 1; i < lists.size() && !result.empty(); i++) {
+    const std::vector<uint32_t>& ids = lists[i]->Get();
+    tmp.clear();
+    std::set_intersection(result.begin(), result.end(), ids.begin(),
+                          ids.end(), std::back_inserter(tmp));
+    result.swap(tmp);
+  }
+  return result;
+}
+
+TEST_SUITE("SymbolSearchIndex") {
+  TEST_CASE("substring") {
+    SymbolSearchIndex index;
+    index.Update(0, "void foo::Bar()", "Bar");
+    index.Update(1, "int baz", "baz");
+    index.Update(2, "class FooBar", "FooBar");
+
+    REQUIRE(!index.SubstringCandidates("fo"));
+    REQUIRE(*index.SubstringCandidates("foo") ==
+            std::vector<uint32_t>({0, 2}));
+    REQUIRE(*index.SubstringCandidates("oBar") ==
+            std::vector<uint32_t>({2}));
+    REQUIRE(index.SubstringCandidates("qux")->empty());
+  }
+
+  TEST_CASE("subsequence") {
+    SymbolSearchIndex index;
+    index.Update(0, "void foo::Bar()", "Bar");
+    index.Update(1, "int baz", "baz");
+    index.Update(2, "class FooBar", "FooBar");
+
+    REQUIRE(!index.SubsequenceCandidates(" "));
+    REQUIRE(*index.SubsequenceCandidates("b") ==
+            std::vector<uint32_t>({0, 1, 2}));
+    REQUIRE(*index.SubsequenceCandidates("F r") ==
+            std::vector<uint32_t>({2}));
+    REQUIRE(*index.SubsequenceCandidates("fobar") ==
+            std::vector<uint32_t>({2}));
+  }
+
+  TEST_CASE("char mask") {
+    REQUIRE(SymbolSearchIndex::CharMask("") == 0);
+    REQUIRE(SymbolSearchIndex::CharMask("aA") == 1);
+    REQUIRE(SymbolSearchIndex::CharMask("a b") ==
+            SymbolSearchIndex::CharMask("ab"));
+    uint64_t foo_bar = SymbolSearchIndex::CharMask("Foo_Bar9");
+    REQUIRE((SymbolSearchIndex::CharMask("fb9") & ~foo_bar) == 0);
+    REQUIRE((SymbolSearchIndex::CharMask("fz") & ~foo_bar) != 0);
+  }
+
+  TEST_CASE("reindex") {
+    SymbolSearchIndex index;
+    index.Update(1, "int baz", "baz");
+    index.Update(0, "int qux", "qux");
+    // Renamed symbols keep their old postings, but the character masks
+    // filter them out of subsequence candidates.
+    index.Update(1, "int quux", "quux");
+    REQUIRE(*index.SubsequenceCandidates("q") ==
+            std::vector<uint32_t>({0, 1}));
+    REQUIRE(index.SubsequenceCandidates("z")->empty());
+    REQUIRE(*index.SubstringCandidates("baz") == std::vector<uint32_t>({1}));
+  }
+
+  TEST_CASE("short names") {
+    SymbolSearchIndex index;
+    index.Update(0, "void foo::Bar()", "Bar");
+    index.Update(2, "class FooBar", "FooBar");
+    REQUIRE(index.LowerShortName(0) == "bar");
+    REQUIRE(index.LowerShortName(1).empty());
+    REQUIRE(index.LowerShortName(2) == "foobar");
+    REQUIRE(index.LowerShortName(3).empty());
+
+    for (int i = 0; i < 1000; i++)
+      index.Update(0, "int x" + std::to_string(i), "X" + std::to_string(i));
+    REQUIRE(index.LowerShortName(0) == "x999");
+    REQUIRE(index.LowerShortName(2) == "foobar");
+    index.Remove(2);
+    REQUIRE(index.LowerShortName(2).empty());
+  }
+}
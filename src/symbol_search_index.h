@@ -0,0 +1,102 @@
+#pragma once
+
+#include <optional.h>
+#include <string_view.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Inverted index over the names in QueryDatabase::symbols, used by
+// workspace/symbol so that a query does not need to scan every symbol.
+//
+// Postings are keyed by
+//  - lowercased trigrams of the detailed name, for substring matches, and
+//  - lowercased characters of the short name, for subsequence matches.
+//
+// The index is updated incrementally and is never pruned: when a symbol is
+// renamed or removed its old postings stay behind. Candidates returned by the
+// index are a superset of the real matches, so callers must still verify each
+// candidate against the current name.
+struct SymbolSearchIndex {
+  // (Re)index symbol |symbol_idx| under |detailed_name| and |short_name|.
+  // This is a no-op if the names did not change since the last call.
+  void Update(uint32_t symbol_idx,
+              std::string_view detailed_name,
+              std::string_view short_name);
+  // Forget the names |symbol_idx| was indexed with, so that the next Update
+  // indexes it again even if the names are the same.
+  void Remove(uint32_t symbol_idx);
+
+  // Returns the lowercased short name |symbol_idx| was last indexed with, or
+  // an empty string. The names are stored one after another, so checking
+  // every symbol is a sequential sweep instead of a lookup into the types,
+  // funcs, vars or files of each. Valid until the next Update.
+  std::string_view LowerShortName(uint32_t symbol_idx) const {
+    if (symbol_idx >= short_name_ranges_.size())
+      return std::string_view();
+    const std::pair<uint32_t, uint32_t>& range =
+        short_name_ranges_[symbol_idx];
+    return std::string_view(short_names_.data() + range.first, range.second);
+  }
+
+  // Returns the sorted ids of symbols whose detailed name may contain |query|.
+  // Returns nullopt if |query| is too short to be filtered by the index, in
+  // which case every symbol is a candidate.
+  optional<std::vector<uint32_t>> SubstringCandidates(
+      std::string_view query) const;
+  // Returns the sorted ids of symbols whose short name may contain |query| as
+  // a (case insensitive) subsequence. Whitespace in |query| is ignored.
+  // Returns nullopt if |query| is empty.
+  optional<std::vector<uint32_t>> SubsequenceCandidates(
+      std::string_view query) const;
+
+  // Returns a 64-bit mask of the (lowercased) characters in |s|. Letters,
+  // digits and '_' each get their own bit; other characters share the rest.
+  // If |a| is a case insensitive subsequence of |b| then
+  // |(CharMask(a) & ~CharMask(b)) == 0|.
+  static uint64_t CharMask(std::string_view s);
+
+  // Approximate heap memory used by the index.
+  size_t EstimateMemoryUsage() const;
+
+  void Swap(SymbolSearchIndex& other);
+
+ private:
+  // |ids| is normalized lazily on lookup, so it is mutable. Lookups may run
+  // concurrently on querydb reader threads and hold |lookup_mutex_|.
+  struct Postings {
+    mutable std::vector<uint32_t> ids;
+    // False if |ids| may contain duplicates or be out of order. Symbols are
+    // mostly indexed in increasing id order, so this is rarely needed.
+    mutable bool sorted = true;
+
+    void Add(uint32_t id);
+    const std::vector<uint32_t>& Get() const;
+  };
+
+  static std::vector<uint32_t> Intersect(
+      std::vector<const Postings*> lists);
+
+  // Drops the names replaced in |short_names_|.
+  void CompactShortNames();
+
+  // Hash of the names each symbol was last indexed with, 0 if not indexed.
+  std::vector<uint64_t> indexed_hash_;
+  // CharMask of the short name each symbol was last indexed with. Unlike the
+  // postings this is never stale, so it also rejects renamed symbols.
+  std::vector<uint64_t> char_masks_;
+  // The names returned by LowerShortName, and the offset and size of the name
+  // of each symbol. Replaced names are left behind until they take up most of
+  // |short_names_|.
+  std::string short_names_;
+  std::vector<std::pair<uint32_t, uint32_t>> short_name_ranges_;
+  size_t live_short_name_bytes_ = 0;
+  std::unordered_map<uint32_t, Postings> trigrams_;
+  mutable std::mutex lookup_mutex_;
+  std::array<Postings, 256> chars_;
+};
@@ -1,13 +1,25 @@
 #include "test.h"
 
+#include "cache_compression.h"
 #include "indexer.h"
 #include "platform.h"
+#include "query.h"
 #include "serializer.h"
+#include "serializers/json.h"
+#include "timer.h"
 #include "utils.h"
 
+#include <doctest/doctest.h>
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
 
 // The 'diff' utility is available and we can use dprintf(3).
 #if _POSIX_C_SOURCE >= 200809L
@@ -109,13 +121,16 @@ void DiffDocuments(std::string path,
 
 void VerifySerializeToFrom(IndexFile* file) {
   std::string expected = file->ToString();
-  std::unique_ptr<IndexFile> result = Deserialize(
-      SerializeFormat::Json, "--.cc", Serialize(SerializeFormat::Json, *file), "<empty>",
-      nullopt /*expected_version*/);
-  std::string actual = result->ToString();
-  if (expected != actual) {
-    std::cerr << "Serialization failure" << std::endl;
-    assert(false);
+  for (SerializeFormat format :
+       {SerializeFormat::Json, SerializeFormat::Binary}) {
+    std::unique_ptr<IndexFile> result =
+        Deserialize(format, "--.cc", Serialize(format, *file), "<empty>",
+                    nullopt /*expected_version*/);
+    std::string actual = result->ToString();
+    if (expected != actual) {
+      std::cerr << "Serialization failure" << std::endl;
+      assert(false);
+    }
   }
 }
 
@@ -143,7 +158,89 @@ IndexFile* FindDbForPathEnding(
   return nullptr;
 }
 
-bool RunIndexTests(const std::string& filter_path, bool enable_update) {
+namespace {
+
+const char kIndexTestBaselinePath[] = "index_tests/perf_baselines.txt";
+
+// Differences below this many microseconds are noise, since most tests index
+// in a few milliseconds.
+const uint64_t kMinTimeRegressionUs = 1000;
+
+// What RunIndexTests measures for each test file, summed over the indexes of
+// the files it includes. Times are in microseconds.
+struct IndexTestPerf {
+  uint64_t index_parse = 0;
+  uint64_t index_build = 0;
+  uint64_t index_make_delta = 0;
+  uint64_t serialized_bytes = 0;
+};
+
+// The baselines file has one line per test file: its path and then the values
+// of IndexTestPerf in order. Lines starting with '#' are comments.
+std::map<std::string, IndexTestPerf> ParseIndexTestBaselines(
+    std::istream& input) {
+  std::map<std::string, IndexTestPerf> baselines;
+  std::string line;
+  while (std::getline(input, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    std::string path;
+    IndexTestPerf perf;
+    if (fields >> path >> perf.index_parse >> perf.index_build >>
+        perf.index_make_delta >> perf.serialized_bytes) {
+      baselines[path] = perf;
+    }
+  }
+  return baselines;
+}
+
+void WriteIndexTestBaselines(
+    std::ostream& output,
+    const std::map<std::string, IndexTestPerf>& baselines) {
+  output << "# Written by cquery --test-index --test-index-update-baselines.\n"
+         << "# path index_parse_us index_build_us index_make_delta_us "
+            "serialized_bytes\n";
+  for (const auto& pair : baselines) {
+    const IndexTestPerf& perf = pair.second;
+    output << pair.first << " " << perf.index_parse << " " << perf.index_build
+           << " " << perf.index_make_delta << " " << perf.serialized_bytes
+           << "\n";
+  }
+}
+
+// Returns a description of each measurement of |actual| which exceeds
+// |baseline| by more than |margin_percent|.
+std::vector<std::string> FindIndexTestRegressions(
+    const IndexTestPerf& baseline,
+    const IndexTestPerf& actual,
+    int margin_percent) {
+  std::vector<std::string> result;
+  auto check = [&](const char* name, uint64_t base, uint64_t value,
+                   uint64_t min_difference) {
+    if (value <= base + min_difference ||
+        value * 100 <= base * (100 + margin_percent)) {
+      return;
+    }
+    result.push_back(std::string(name) + " " + std::to_string(value) +
+                     " exceeds its baseline " + std::to_string(base));
+  };
+  check("index_parse_us", baseline.index_parse, actual.index_parse,
+        kMinTimeRegressionUs);
+  check("index_build_us", baseline.index_build, actual.index_build,
+        kMinTimeRegressionUs);
+  check("index_make_delta_us", baseline.index_make_delta,
+        actual.index_make_delta, kMinTimeRegressionUs);
+  check("serialized_bytes", baseline.serialized_bytes,
+        actual.serialized_bytes, 0);
+  return result;
+}
+
+}  // namespace
+
+bool RunIndexTests(const std::string& filter_path,
+                   bool enable_update,
+                   const IndexTestPerfOptions& perf_options) {
   SetTestOutputMode();
 
   // Index tests change based on the version of clang used.
@@ -162,8 +259,18 @@ bool RunIndexTests(const std::string& filter_path, bool enable_update) {
   // this can be done by constructing ClangIndex index(1, 1);
   ClangIndex index;
 
+  std::map<std::string, IndexTestPerf> baselines;
+  {
+    std::ifstream input(kIndexTestBaselinePath);
+    baselines = ParseIndexTestBaselines(input);
+  }
+  std::map<std::string, IndexTestPerf> measured;
+  int num_regressions = 0;
+
   for (std::string path : GetFilesInFolder("index_tests", true /*recursive*/,
                                            true /*add_folder_to_path*/)) {
+    if (path == kIndexTestBaselinePath)
+      continue;
     if (!RunObjectiveCIndexTests() && EndsWithAny(path, {".m", ".mm"})) {
       std::cout << "Skipping \"" << path << "\" since this platform does not "
                 << "support running Objective-C tests." << std::endl;
@@ -206,6 +313,32 @@ bool RunIndexTests(const std::string& filter_path, bool enable_update) {
                      &index, false /*dump_ast*/);
     assert(dbs);
 
+    IndexTestPerf& test_perf = measured[path];
+    test_perf.index_parse = perf.index_parse;
+    test_perf.index_build = perf.index_build;
+    {
+      QueryDatabase query_db;
+      for (const std::unique_ptr<IndexFile>& file : *dbs) {
+        IdMap id_map(&query_db, file->id_cache);
+        Timer time;
+        IndexUpdate::CreateDelta(nullptr, &id_map, nullptr, file.get());
+        test_perf.index_make_delta += time.ElapsedMicroseconds();
+        test_perf.serialized_bytes +=
+            Serialize(config.cacheFormat, *file).size();
+      }
+    }
+    auto baseline = baselines.find(path);
+    if (baseline != baselines.end()) {
+      for (const std::string& regression : FindIndexTestRegressions(
+               baseline->second, test_perf, perf_options.margin_percent)) {
+        std::cout << (perf_options.fail_on_regression ? "[FAILED] "
+                                                      : "[WARNING] ")
+                  << path << ": " << regression << " by more than "
+                  << perf_options.margin_percent << "%" << std::endl;
+        num_regressions++;
+      }
+    }
+
     for (const auto& entry : all_expected_output) {
       const std::string& expected_path = entry.first;
       std::string expected_output = text_replacer.Apply(entry.second);
@@ -292,9 +425,416 @@ bool RunIndexTests(const std::string& filter_path, bool enable_update) {
     }
   }
 
+  if (num_regressions > 0) {
+    std::cout << num_regressions << " measurements exceed their baselines in "
+              << kIndexTestBaselinePath << std::endl;
+    if (perf_options.fail_on_regression)
+      success = false;
+  }
+  if (perf_options.update_baselines) {
+    for (const auto& pair : measured)
+      baselines[pair.first] = pair.second;
+    std::ofstream output(kIndexTestBaselinePath);
+    WriteIndexTestBaselines(output, baselines);
+    std::cout << "Updated " << measured.size() << " baselines in "
+              << kIndexTestBaselinePath << std::endl;
+  }
+
   return success;
 }
 
+TEST_SUITE("IndexTests") {
+  TEST_CASE("perf baselines") {
+    std::map<std::string, IndexTestPerf> baselines;
+    baselines["index_tests/a.cc"].index_parse = 2000;
+    baselines["index_tests/a.cc"].serialized_bytes = 100;
+    std::stringstream stream;
+    WriteIndexTestBaselines(stream, baselines);
+    std::map<std::string, IndexTestPerf> parsed =
+        ParseIndexTestBaselines(stream);
+    REQUIRE(parsed.size() == 1);
+    REQUIRE(parsed["index_tests/a.cc"].index_parse == 2000);
+    REQUIRE(parsed["index_tests/a.cc"].serialized_bytes == 100);
+
+    IndexTestPerf actual = parsed["index_tests/a.cc"];
+    REQUIRE(FindIndexTestRegressions(parsed["index_tests/a.cc"], actual, 50)
+                .empty());
+    // Small absolute differences in time are ignored.
+    actual.index_parse = 2900;
+    actual.index_build = 900;
+    REQUIRE(FindIndexTestRegressions(parsed["index_tests/a.cc"], actual, 10)
+                .empty());
+    actual.index_parse = 4000;
+    actual.serialized_bytes = 151;
+    REQUIRE(FindIndexTestRegressions(parsed["index_tests/a.cc"], actual, 50)
+                .size() == 2);
+  }
+}
+
 // TODO: ctor/dtor, copy ctor
 // TODO: Always pass IndexFile by pointer, ie, search and remove all IndexFile&
 // refs.
+
+namespace {
+
+// Size of the indexes of the benchmark corpus in one cache format, and the
+// time it takes to save and load all of them.
+struct CacheFormatResult {
+  std::string format;
+  size_t bytes = 0;
+  uint64_t save_us = 0;
+  uint64_t load_us = 0;
+};
+MAKE_REFLECT_STRUCT(CacheFormatResult, format, bytes, save_us, load_us);
+
+struct IndexBenchmarkResult {
+  IndexBenchmarkOptions options;
+
+  // Contents of querydb after the run; these only change with the indexer.
+  size_t files = 0;
+  size_t types = 0;
+  size_t funcs = 0;
+  size_t vars = 0;
+  // Uses of types and vars, and callers of funcs.
+  size_t references = 0;
+
+  // Wall time of each stage in microseconds.
+  uint64_t parse_us = 0;
+  uint64_t id_map_us = 0;
+  uint64_t delta_us = 0;
+  uint64_t apply_us = 0;
+  uint64_t total_us = 0;
+  // Sum of the parse and index build times of each translation unit, see
+  // PerformanceImportFile.
+  uint64_t index_parse_us = 0;
+  uint64_t index_build_us = 0;
+  // Sum of the cost of each optional feature of the indexer over the
+  // translation units, see IndexFeatureCost.
+  IndexFeatureCost macros;
+  IndexFeatureCost comments;
+  IndexFeatureCost locals;
+  IndexFeatureCost implicit_calls;
+  IndexFeatureCost template_usages;
+  IndexFeatureCost initializer_usages;
+  // Size and load time of the cached indexes in each cache format, see
+  // MeasureCacheFormat.
+  std::vector<CacheFormatResult> cache_formats;
+};
+MAKE_REFLECT_STRUCT(IndexBenchmarkResult,
+                    options,
+                    files,
+                    types,
+                    funcs,
+                    vars,
+                    references,
+                    parse_us,
+                    id_map_us,
+                    delta_us,
+                    apply_us,
+                    total_us,
+                    index_parse_us,
+                    index_build_us,
+                    macros,
+                    comments,
+                    locals,
+                    implicit_calls,
+                    template_usages,
+                    initializer_usages,
+                    cache_formats);
+
+void AddFeatureCost(const IndexFeatureCost& cost, IndexFeatureCost* total) {
+  total->time += cost.time;
+  total->size += cost.size;
+}
+
+// Serializes |files| in |format|, compressed by |compressor| with |codec|,
+// and loads them back like RealCacheManager does. The dictionary of
+// |compressor| is only used if |use_dictionary| is set.
+CacheFormatResult MeasureCacheFormat(
+    const std::string& name,
+    SerializeFormat format,
+    CacheCompressor* compressor,
+    CacheCodec codec,
+    bool use_dictionary,
+    const std::vector<std::unique_ptr<IndexFile>>& files) {
+  CacheFormatResult result;
+  result.format = name;
+  std::vector<std::string> entries;
+  Timer time;
+  for (const std::unique_ptr<IndexFile>& file : files) {
+    entries.push_back(
+        compressor->Compress(Serialize(format, *file), codec, use_dictionary));
+    result.bytes += entries.back().size();
+  }
+  result.save_us = time.ElapsedMicrosecondsAndReset();
+  for (size_t i = 0; i < files.size(); i++) {
+    optional<std::string> content = compressor->Decompress(entries[i]);
+    if (content) {
+      Deserialize(format, files[i]->path, *content, "",
+                  IndexFile::GetMajorVersion());
+    }
+  }
+  result.load_us = time.ElapsedMicroseconds();
+  return result;
+}
+
+std::string GenerateBenchmarkHeader(const IndexBenchmarkOptions& options,
+                                    int header) {
+  std::string n = std::to_string(header);
+  std::string out = "#pragma once\n\n";
+  for (int i = 0; i < options.macro_density; i++) {
+    out += "#define MACRO" + n + "_" + std::to_string(i) + "(x) ((x) * " +
+           std::to_string(i + 2) + " + " + n + ")\n";
+  }
+
+  out += "\ntemplate <typename T, int N>\n";
+  out += "struct Chain" + n + " {\n";
+  out += "  static T Get(T t) {\n";
+  out += "    return Chain" + n + "<T, N - 1>::Get(t) + N;\n";
+  out += "  }\n";
+  out += "};\n";
+  out += "template <typename T>\n";
+  out += "struct Chain" + n + "<T, 0> {\n";
+  out += "  static T Get(T t) { return t; }\n";
+  out += "};\n\n";
+
+  out += "struct Type" + n + " {\n";
+  for (int i = 0; i < 4; i++) {
+    std::string m = std::to_string(i);
+    out += "  int field" + m + " = " + m + ";\n";
+    out += "  int Method" + m + "(int x);\n";
+  }
+  out += "};\n\n";
+
+  out += "inline int Helper" + n + "(int x) {\n";
+  out += "  return Chain" + n + "<int, " +
+         std::to_string(options.template_depth) + ">::Get(x);\n";
+  out += "}\n";
+  return out;
+}
+
+std::string GenerateBenchmarkTranslationUnit(
+    const IndexBenchmarkOptions& options,
+    int tu) {
+  std::string n = std::to_string(tu);
+  int fan_out = std::min(options.header_fan_out, options.headers);
+  std::string out;
+  for (int i = 0; i < fan_out; i++) {
+    out += "#include \"header" + std::to_string((tu + i) % options.headers) +
+           ".h\"\n";
+  }
+  out += "\n";
+
+  // Each header's methods are defined by the first translation unit which
+  // includes it.
+  if (tu < options.headers && fan_out > 0) {
+    std::string type = "Type" + n;
+    for (int i = 0; i < 4; i++) {
+      std::string m = std::to_string(i);
+      out += "int " + type + "::Method" + m + "(int x) {\n";
+      out += "  return Helper" + n + "(x + field" + m + ");\n";
+      out += "}\n";
+    }
+    out += "\n";
+  }
+
+  for (int i = 0; i < fan_out; i++) {
+    std::string h = std::to_string((tu + i) % options.headers);
+    out += "int Function" + n + "_" + std::to_string(i) + "(int x) {\n";
+    out += "  Type" + h + " value;\n";
+    out += "  int result = value.Method0(x);\n";
+    for (int j = 0; j < options.macro_density; j++)
+      out += "  result += MACRO" + h + "_" + std::to_string(j) + "(result);\n";
+    out += "  return result + Helper" + h + "(value.field1);\n";
+    out += "}\n\n";
+  }
+
+  if (options.fan_in_uses > 0) {
+    // The first included header declares the type.
+    std::string type = "int";
+    if (fan_out > 0)
+      type = "Type" + std::to_string(tu % options.headers);
+    out += "static int fan_in" + n + " = 1;\n";
+    out += "int FanIn" + n + "() {\n";
+    out += "  int result = 0;\n";
+    for (int i = 0; i < options.fan_in_uses; i++)
+      out += "  result += fan_in" + n + " + sizeof(" + type + ");\n";
+    out += "  return result;\n";
+    out += "}\n";
+  }
+  return out;
+}
+
+// Runs |fn| on |num_threads| threads, including the current one.
+template <typename TFn>
+void RunOnThreads(int num_threads, TFn fn) {
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.emplace_back(fn);
+  fn();
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+}  // namespace
+
+bool RunIndexBenchmark(const IndexBenchmarkOptions& options) {
+  if (options.translation_units < 1 || options.headers < 1) {
+    std::cerr << "The benchmark needs at least one translation unit and one "
+                 "header"
+              << std::endl;
+    return false;
+  }
+
+  std::string directory = options.directory;
+  if (directory.empty() || (directory[0] != '/' &&
+                            directory.find(':') == std::string::npos)) {
+    directory = GetWorkingDirectory() + directory;
+  }
+  EnsureEndsInSlash(directory);
+  MakeDirectoryRecursive(directory);
+  for (int i = 0; i < options.headers; i++) {
+    WriteToFile(directory + "header" + std::to_string(i) + ".h",
+                GenerateBenchmarkHeader(options, i));
+  }
+  std::vector<std::string> paths;
+  for (int i = 0; i < options.translation_units; i++) {
+    paths.push_back(directory + "tu" + std::to_string(i) + ".cc");
+    WriteToFile(paths.back(), GenerateBenchmarkTranslationUnit(options, i));
+  }
+
+  IndexBenchmarkResult result;
+  result.options = options;
+  if (result.options.threads < 1) {
+    result.options.threads =
+        std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+  int num_threads = result.options.threads;
+
+  Config config;
+  config.index.foldTemplateSpecializations =
+      options.fold_template_specializations;
+  config.index.profile = options.profile;
+  if (!GetIndexProfile(config.index.profile)) {
+    std::cerr << "Unknown index profile " << config.index.profile
+              << std::endl;
+    return false;
+  }
+  FileConsumerSharedState file_consumer_shared;
+  std::vector<std::vector<std::unique_ptr<IndexFile>>> parsed(paths.size());
+  std::vector<PerformanceImportFile> perfs(paths.size());
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  Timer total_time;
+  Timer time;
+  RunOnThreads(num_threads, [&]() {
+    ClangIndex index;
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      std::vector<std::string> flags = {
+          "-xc++", "-std=c++14",
+          "-resource-dir=" + GetDefaultResourceDirectory(), paths[i]};
+      auto files = Parse(&config, &file_consumer_shared, paths[i], flags, {},
+                         &perfs[i], &index);
+      if (files)
+        parsed[i] = std::move(*files);
+      else
+        failed = true;
+    }
+  });
+  result.parse_us = time.ElapsedMicrosecondsAndReset();
+  if (failed) {
+    std::cerr << "Failed to index the benchmark corpus in " << directory
+              << std::endl;
+    return false;
+  }
+
+  // Keep the files in translation unit order so that querydb assigns the same
+  // ids on every run.
+  std::vector<std::unique_ptr<IndexFile>> files;
+  for (size_t i = 0; i < parsed.size(); i++) {
+    result.index_parse_us += perfs[i].index_parse;
+    result.index_build_us += perfs[i].index_build;
+    AddFeatureCost(perfs[i].index_macros, &result.macros);
+    AddFeatureCost(perfs[i].index_comments, &result.comments);
+    AddFeatureCost(perfs[i].index_locals, &result.locals);
+    AddFeatureCost(perfs[i].index_implicit_calls, &result.implicit_calls);
+    AddFeatureCost(perfs[i].index_template_usages, &result.template_usages);
+    AddFeatureCost(perfs[i].index_initializer_usages,
+                   &result.initializer_usages);
+    for (std::unique_ptr<IndexFile>& file : parsed[i])
+      files.push_back(std::move(file));
+  }
+
+  QueryDatabase db;
+  std::vector<std::unique_ptr<IdMap>> id_maps(files.size());
+  next = 0;
+  time.Reset();
+  RunOnThreads(num_threads, [&]() {
+    for (size_t i = next++; i < files.size(); i = next++)
+      id_maps[i] = MakeUnique<IdMap>(&db, files[i]->id_cache);
+  });
+  result.id_map_us = time.ElapsedMicrosecondsAndReset();
+
+  std::vector<optional<IndexUpdate>> updates(files.size());
+  next = 0;
+  RunOnThreads(num_threads, [&]() {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      updates[i] = IndexUpdate::CreateDelta(nullptr, id_maps[i].get(), nullptr,
+                                            files[i].get());
+    }
+  });
+  result.delta_us = time.ElapsedMicrosecondsAndReset();
+
+  {
+    std::lock_guard<SharedMutex> lock(db.mutex);
+    for (optional<IndexUpdate>& update : updates)
+      db.ApplyIndexUpdate(&*update);
+  }
+  result.apply_us = time.ElapsedMicroseconds();
+  result.total_us = total_time.ElapsedMicroseconds();
+
+  // The cache formats are measured after the pipeline so that they do not
+  // count in |total_us|.
+  CacheCompressor compressor(directory + "cache/", 3);
+  result.cache_formats.push_back(
+      MeasureCacheFormat("json", SerializeFormat::Json, &compressor,
+                         CacheCodec::None, false, files));
+  result.cache_formats.push_back(
+      MeasureCacheFormat("msgpack", SerializeFormat::MessagePack, &compressor,
+                         CacheCodec::None, false, files));
+  result.cache_formats.push_back(
+      MeasureCacheFormat("binary", SerializeFormat::Binary, &compressor,
+                         CacheCodec::None, false, files));
+  if (IsCacheCodecSupported(CacheCodec::Zstd)) {
+    result.cache_formats.push_back(
+        MeasureCacheFormat("msgpack+zstd", SerializeFormat::MessagePack,
+                           &compressor, CacheCodec::Zstd, false, files));
+    std::vector<std::string> samples;
+    for (const std::unique_ptr<IndexFile>& file : files)
+      samples.push_back(Serialize(SerializeFormat::MessagePack, *file));
+    if (compressor.TrainDictionary(samples)) {
+      result.cache_formats.push_back(MeasureCacheFormat(
+          "msgpack+zstd+dictionary", SerializeFormat::MessagePack,
+          &compressor, CacheCodec::Zstd, true, files));
+    }
+  }
+
+  result.files = db.files.size();
+  result.types = db.types.size();
+  result.funcs = db.funcs.size();
+  result.vars = db.vars.size();
+  for (const QueryType& type : db.types)
+    result.references += type.uses.size();
+  for (const QueryFunc& func : db.funcs)
+    result.references += func.callers.size();
+  for (const QueryVar& var : db.vars)
+    result.references += var.uses.size();
+
+  rapidjson::StringBuffer output;
+  rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(output);
+  writer.SetIndent(' ', 2);
+  JsonWriter json_writer(&writer);
+  Reflect(json_writer, result);
+  std::cout << output.GetString() << std::endl;
+  return true;
+}
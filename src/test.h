@@ -1,5 +1,64 @@
 #pragma once
 
+#include "serializer.h"
+
 #include <string>
 
-bool RunIndexTests(const std::string& filter_path, bool enable_update);
+// How RunIndexTests compares the time spent on each test file, and the size
+// of its index, to the baselines saved in index_tests/perf_baselines.txt.
+struct IndexTestPerfOptions {
+  // A measurement regresses if it exceeds its baseline by more than this.
+  int margin_percent = 50;
+  // If false, regressions are only reported.
+  bool fail_on_regression = false;
+  // Save the measurements of the tests which were run as their baselines.
+  bool update_baselines = false;
+};
+
+bool RunIndexTests(
+    const std::string& filter_path,
+    bool enable_update,
+    const IndexTestPerfOptions& perf_options = IndexTestPerfOptions());
+
+// Shape of the synthetic project indexed by RunIndexBenchmark. The generated
+// sources only depend on these values, so runs with the same options index
+// the same code.
+struct IndexBenchmarkOptions {
+  // Where the project is generated, relative to the working directory.
+  std::string directory = "benchmark_corpus";
+  int translation_units = 64;
+  int headers = 32;
+  // Number of headers included by each translation unit.
+  int header_fan_out = 8;
+  // Number of recursive instantiations of the class template in each header.
+  int template_depth = 8;
+  // Number of function-like macros defined in each header and expanded by
+  // each translation unit.
+  int macro_density = 8;
+  // Number of references to one variable and one type in each translation
+  // unit, for symbols with very long use lists.
+  int fan_in_uses = 0;
+  // Sets Config::Index::foldTemplateSpecializations.
+  bool fold_template_specializations = false;
+  // Sets Config::Index::profile.
+  std::string profile = "full";
+  // 0 to use one thread per core.
+  int threads = 0;
+};
+MAKE_REFLECT_STRUCT(IndexBenchmarkOptions,
+                    directory,
+                    translation_units,
+                    headers,
+                    header_fan_out,
+                    template_depth,
+                    macro_density,
+                    fan_in_uses,
+                    fold_template_specializations,
+                    profile,
+                    threads);
+
+// Generates the project described by |options| and runs it through the
+// import pipeline: parse, id map, delta and querydb apply. Each stage runs to
+// completion before the next one so that their times can be compared
+// between runs. Prints the results as JSON to stdout.
+bool RunIndexBenchmark(const IndexBenchmarkOptions& options);
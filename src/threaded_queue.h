@@ -1,5 +1,6 @@
 #pragma once
 
+#include "instrumented_mutex.h"
 #include "utils.h"
 #include "work_thread.h"
 
@@ -8,8 +9,8 @@
 #include <algorithm>
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
-#include <queue>
 #include <tuple>
 
 // TODO: cleanup includes.
@@ -95,7 +96,8 @@ struct MultiQueueWaiter {
 template <class T>
 struct ThreadedQueue : public BaseThreadQueue {
  public:
-  ThreadedQueue() : total_count_(0) {
+  // |mutex_| records its statistics as |name|, see InstrumentedMutex.
+  explicit ThreadedQueue(const char* name) : mutex_(name), total_count_(0) {
     owned_waiter_ = MakeUnique<MultiQueueWaiter>();
     waiter_ = owned_waiter_.get();
     owned_waiter1_ = MakeUnique<MultiQueueWaiter>();
@@ -103,31 +105,32 @@ struct ThreadedQueue : public BaseThreadQueue {
   }
 
   // TODO remove waiter1 after split of on_indexed
-  explicit ThreadedQueue(MultiQueueWaiter* waiter,
-                         MultiQueueWaiter* waiter1 = nullptr)
-      : total_count_(0), waiter_(waiter), waiter1_(waiter1) {}
+  ThreadedQueue(const char* name,
+                MultiQueueWaiter* waiter,
+                MultiQueueWaiter* waiter1 = nullptr)
+      : mutex_(name), total_count_(0), waiter_(waiter), waiter1_(waiter1) {}
 
   // Returns the number of elements in the queue. This is lock-free.
   size_t Size() const { return total_count_; }
 
   // Add an element to the front of the queue.
   void PriorityEnqueue(T&& t) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    priority_.push(std::move(t));
-    ++total_count_;
-    waiter_->cv.notify_one();
-    if (waiter1_)
-      waiter1_->cv.notify_one();
+    {
+      std::lock_guard<InstrumentedMutex> lock(mutex_);
+      priority_.push_back(std::move(t));
+      ++total_count_;
+    }
+    Notify(1);
   }
 
   // Add an element to the queue.
   void Enqueue(T&& t) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(std::move(t));
-    ++total_count_;
-    waiter_->cv.notify_one();
-    if (waiter1_)
-      waiter1_->cv.notify_one();
+    {
+      std::lock_guard<InstrumentedMutex> lock(mutex_);
+      queue_.push_back(std::move(t));
+      ++total_count_;
+    }
+    Notify(1);
   }
 
   // Add a set of elements to the queue.
@@ -135,21 +138,59 @@ struct ThreadedQueue : public BaseThreadQueue {
     if (elements.empty())
       return;
 
-    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = elements.size();
+    {
+      std::lock_guard<InstrumentedMutex> lock(mutex_);
 
-    total_count_ += elements.size();
+      total_count_ += n;
 
-    for (T& element : elements) {
-      queue_.push(std::move(element));
+      for (T& element : elements) {
+        queue_.push_back(std::move(element));
+      }
+      elements.clear();
     }
-    elements.clear();
 
-    waiter_->cv.notify_all();
+    Notify(n);
+  }
+
+  // Moves the elements for which |predicate| returns true to the front of the
+  // queue, keeping their order. Returns the number of elements moved.
+  template <typename TPredicate>
+  size_t Prioritize(TPredicate predicate) {
+    std::lock_guard<InstrumentedMutex> lock(mutex_);
+    size_t moved = 0;
+    std::deque<T> rest;
+    while (!queue_.empty()) {
+      if (predicate(queue_.front())) {
+        priority_.push_back(std::move(queue_.front()));
+        ++moved;
+      } else {
+        rest.push_back(std::move(queue_.front()));
+      }
+      queue_.pop_front();
+    }
+    queue_.swap(rest);
+    return moved;
+  }
+
+  // Calls |action| with each of the first |n| elements of the queue, in the
+  // order they would be dequeued, with an acquired |mutex_|.
+  template <typename TAction>
+  void ForEachFront(size_t n, TAction action) {
+    if (IsEmpty())
+      return;
+    std::lock_guard<InstrumentedMutex> lock(mutex_);
+    for (size_t i = 0; i < priority_.size() && n > 0; i++, n--)
+      action(priority_[i]);
+    for (size_t i = 0; i < queue_.size() && n > 0; i++, n--)
+      action(queue_[i]);
   }
 
   // Return all elements in the queue.
   std::vector<T> DequeueAll() {
-    std::lock_guard<std::mutex> lock(mutex_);
+    if (IsEmpty())
+      return {};
+    std::lock_guard<InstrumentedMutex> lock(mutex_);
 
     total_count_ = 0;
 
@@ -157,11 +198,11 @@ struct ThreadedQueue : public BaseThreadQueue {
     result.reserve(priority_.size() + queue_.size());
     while (!priority_.empty()) {
       result.emplace_back(std::move(priority_.front()));
-      priority_.pop();
+      priority_.pop_front();
     }
     while (!queue_.empty()) {
       result.emplace_back(std::move(queue_.front()));
-      queue_.pop();
+      queue_.pop_front();
     }
 
     return result;
@@ -177,13 +218,13 @@ struct ThreadedQueue : public BaseThreadQueue {
   // Executes |action| with an acquired |mutex_|.
   template <typename TAction>
   T DequeuePlusAction(TAction action) {
-    std::unique_lock<std::mutex> lock(mutex_);
+    std::unique_lock<InstrumentedMutex> lock(mutex_);
     waiter_->cv.wait(lock,
                      [&]() { return !priority_.empty() || !queue_.empty(); });
 
-    auto execute = [&](std::queue<T>* q) {
+    auto execute = [&](std::deque<T>* q) {
       auto val = std::move(q->front());
-      q->pop();
+      q->pop_front();
       --total_count_;
 
       action();
@@ -204,13 +245,19 @@ struct ThreadedQueue : public BaseThreadQueue {
   // value if the queue is empty.
   template <typename TAction>
   optional<T> TryDequeuePlusAction(TAction action) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    // Threads poll many queues which are usually empty; do not contend on the
+    // mutex (with producers and with each other) just to find that out. A
+    // concurrently added element may be missed, but callers wait through
+    // MultiQueueWaiter, which checks again under the locks.
+    if (IsEmpty())
+      return nullopt;
+    std::lock_guard<InstrumentedMutex> lock(mutex_);
     if (priority_.empty() && queue_.empty())
       return nullopt;
 
-    auto execute = [&](std::queue<T>* q) {
+    auto execute = [&](std::deque<T>* q) {
       auto val = std::move(q->front());
-      q->pop();
+      q->pop_front();
       --total_count_;
 
       action(val);
@@ -226,12 +273,49 @@ struct ThreadedQueue : public BaseThreadQueue {
     return TryDequeuePlusAction([](const T&) {});
   }
 
-  mutable std::mutex mutex_;
+  // Like TryDequeue, but only returns an element for which |predicate| is
+  // true. Every priority element is checked, which are few, but only the
+  // first of the others.
+  template <typename TPredicate>
+  optional<T> TryDequeueIf(TPredicate predicate) {
+    if (IsEmpty())
+      return nullopt;
+    std::lock_guard<InstrumentedMutex> lock(mutex_);
+    auto take = [&](std::deque<T>* q,
+                    typename std::deque<T>::iterator it) -> optional<T> {
+      T val = std::move(*it);
+      q->erase(it);
+      --total_count_;
+      return std::move(val);
+    };
+    for (auto it = priority_.begin(); it != priority_.end(); ++it) {
+      if (predicate(*it))
+        return take(&priority_, it);
+    }
+    if (!queue_.empty() && predicate(queue_.front()))
+      return take(&queue_, queue_.begin());
+    return nullopt;
+  }
+
+  mutable InstrumentedMutex mutex_;
 
  private:
+  // Wakes up to |n| waiting threads, one per new element. Waking all of them
+  // makes every idle thread contend for the queue locks, while at most |n| of
+  // them find work. Called without |mutex_| held so that woken threads do not
+  // immediately block on it; waiters check the queues under their locks, so
+  // the notification cannot be missed.
+  void Notify(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      waiter_->cv.notify_one();
+      if (waiter1_)
+        waiter1_->cv.notify_one();
+    }
+  }
+
   std::atomic<int> total_count_;
-  std::queue<T> priority_;
-  std::queue<T> queue_;
+  std::deque<T> priority_;
+  std::deque<T> queue_;
   MultiQueueWaiter* waiter_;
   std::unique_ptr<MultiQueueWaiter> owned_waiter_;
   // TODO remove waiter1 after split of on_indexed
@@ -57,7 +57,7 @@ void Timer::Resume() {
 }
 
 ScopedPerfTimer::ScopedPerfTimer(const std::string& message)
-    : message_(message) {}
+    : message_(message), trace_("perf", message) {}
 
 ScopedPerfTimer::~ScopedPerfTimer() {
   timer_.ResetAndPrint(message_);
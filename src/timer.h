@@ -1,5 +1,7 @@
 #pragma once
 
+#include "trace.h"
+
 #include <optional.h>
 
 #include <chrono>
@@ -36,4 +38,5 @@ struct ScopedPerfTimer {
 
   Timer timer_;
   std::string message_;
+  ScopedTrace trace_;
 };
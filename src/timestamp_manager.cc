@@ -2,26 +2,387 @@
 
 #include "cache_manager.h"
 #include "indexer.h"
+#include "platform.h"
+#include "serializers/binary.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace {
+
+// How long prefetched modification times are used. They serve the cache
+// checks right after startup; files checked later are read from disk again.
+const int64_t kPrefetchedTimeTtlMs = 60 * 1000;
+
+int64_t GetCurrentTimeInMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Bump when the layout of SavedState changes.
+const int kSavedStateVersion = 3;
+
+// The saved state describes cache entries, which are not shared between USR
+// hashes; see IndexFile::GetMajorVersion.
+int GetSavedStateVersion() {
+  return g_fast_usr_hash ? kSavedStateVersion + 1000 : kSavedStateVersion;
+}
+
+// Paths are stored once and referred to by their index in SavedState::paths.
+struct SavedTranslationUnit {
+  uint32_t path = 0;
+  uint64_t parse_time = 0;
+  std::vector<uint32_t> dependencies;
+};
+MAKE_REFLECT_STRUCT(SavedTranslationUnit, path, parse_time, dependencies);
+
+// Saved after an int holding kSavedStateVersion.
+struct SavedState {
+  std::vector<std::string> paths;
+  // Cached modification time, content hash and arguments fingerprint of each
+  // entry of |paths|.
+  std::vector<optional<int64_t>> timestamps;
+  std::vector<uint64_t> content_hashes;
+  std::vector<uint64_t> args_fingerprints;
+  std::vector<SavedTranslationUnit> translation_units;
+};
+MAKE_REFLECT_STRUCT(SavedState,
+                    paths,
+                    timestamps,
+                    content_hashes,
+                    args_fingerprints,
+                    translation_units);
+
+}  // namespace
+
+void TimestampManager::Load(const std::string& path, bool load_timestamps) {
+  std::lock_guard<InstrumentedMutex> guard(mutex_);
+  path_ = path;
+  optional<std::string> content = ReadContent(path);
+  if (!content)
+    return;
+
+  SavedState state;
+  try {
+    BinaryReader reader(*content);
+    int version;
+    Reflect(reader, version);
+    if (version != GetSavedStateVersion())
+      return;
+    Reflect(reader, state);
+  } catch (std::invalid_argument& e) {
+    LOG_S(INFO) << "Failed to load include graph from " << path << ": "
+                << e.what();
+    return;
+  }
+  if (state.timestamps.size() != state.paths.size() ||
+      state.content_hashes.size() != state.paths.size() ||
+      state.args_fingerprints.size() != state.paths.size())
+    return;
+
+  for (size_t i = 0; i < state.paths.size() && load_timestamps; i++) {
+    if (state.timestamps[i]) {
+      CachedFile file;
+      file.timestamp = *state.timestamps[i];
+      file.content_hash = state.content_hashes[i];
+      file.args_fingerprint = state.args_fingerprints[i];
+      timestamps_.Set(state.paths[i], file);
+    }
+  }
+  for (const SavedTranslationUnit& saved : state.translation_units) {
+    if (saved.path >= state.paths.size())
+      continue;
+    const std::string& tu_path = state.paths[saved.path];
+    TranslationUnit& tu = translation_units_[tu_path];
+    tu.parse_time = saved.parse_time;
+    for (uint32_t dependency : saved.dependencies) {
+      if (dependency >= state.paths.size())
+        continue;
+      tu.dependencies.push_back(state.paths[dependency]);
+      importers_[state.paths[dependency]].insert(tu_path);
+    }
+  }
+  LOG_S(INFO) << "Loaded include graph with " << translation_units_.size()
+              << " translation units from " << path;
+}
+
+void TimestampManager::Save() {
+  SavedState state;
+  std::string path;
+  {
+    std::lock_guard<InstrumentedMutex> guard(mutex_);
+    if (!dirty_ || path_.empty())
+      return;
+    dirty_ = false;
+    path = path_;
+
+    std::unordered_map<std::string, CachedFile> timestamps =
+        timestamps_.Snapshot();
+    std::unordered_map<std::string, uint32_t> path_to_index;
+    auto get_index = [&](const std::string& file) -> uint32_t {
+      auto it = path_to_index.find(file);
+      if (it != path_to_index.end())
+        return it->second;
+      uint32_t index = uint32_t(state.paths.size());
+      path_to_index[file] = index;
+      state.paths.push_back(file);
+      auto cached = timestamps.find(file);
+      if (cached != timestamps.end()) {
+        state.timestamps.push_back(cached->second.timestamp);
+        state.content_hashes.push_back(cached->second.content_hash);
+        state.args_fingerprints.push_back(cached->second.args_fingerprint);
+      } else {
+        state.timestamps.push_back(nullopt);
+        state.content_hashes.push_back(0);
+        state.args_fingerprints.push_back(0);
+      }
+      return index;
+    };
+    for (const auto& entry : timestamps)
+      get_index(entry.first);
+    for (const auto& entry : translation_units_) {
+      SavedTranslationUnit saved;
+      saved.path = get_index(entry.first);
+      saved.parse_time = entry.second.parse_time;
+      for (const std::string& dependency : entry.second.dependencies)
+        saved.dependencies.push_back(get_index(dependency));
+      state.translation_units.push_back(std::move(saved));
+    }
+  }
+
+  std::string content;
+  BinaryWriter writer(&content);
+  int version = GetSavedStateVersion();
+  Reflect(writer, version);
+  Reflect(writer, state);
+  WriteToFile(path, content);
+}
 
 optional<int64_t> TimestampManager::GetLastCachedModificationTime(
     ICacheManager* cache_manager,
     const std::string& path) {
+  optional<CachedFile> file = GetCachedFile(cache_manager, path);
+  if (!file)
+    return nullopt;
+  return file->timestamp;
+}
+
+optional<uint64_t> TimestampManager::GetLastCachedContentHash(
+    ICacheManager* cache_manager,
+    const std::string& path) {
+  optional<CachedFile> file = GetCachedFile(cache_manager, path);
+  if (!file || !file->content_hash)
+    return nullopt;
+  return file->content_hash;
+}
+
+optional<uint64_t> TimestampManager::GetLastCachedArgsFingerprint(
+    const std::string& path) {
+  optional<CachedFile> cached = timestamps_.TryGet(path);
+  if (!cached || !cached->args_fingerprint)
+    return nullopt;
+  return cached->args_fingerprint;
+}
+
+void TimestampManager::UpdateCachedModificationTime(
+    const std::string& path,
+    int64_t timestamp,
+    uint64_t content_hash,
+    optional<uint64_t> args_fingerprint) {
+  timestamps_.Update(path, [&](CachedFile& cached) {
+    if (cached.timestamp != timestamp || cached.content_hash != content_hash ||
+        (args_fingerprint && cached.args_fingerprint != *args_fingerprint)) {
+      cached.timestamp = timestamp;
+      cached.content_hash = content_hash;
+      if (args_fingerprint)
+        cached.args_fingerprint = *args_fingerprint;
+      dirty_ = true;
+    }
+  });
+}
+
+void TimestampManager::ForgetCachedFile(const std::string& path) {
+  if (timestamps_.Erase(path))
+    dirty_ = true;
+}
+
+void TimestampManager::UpdateTranslationUnit(
+    const std::string& path,
+    const std::vector<std::string>& dependencies,
+    uint64_t parse_time) {
+  std::lock_guard<InstrumentedMutex> guard(mutex_);
+  TranslationUnit& tu = translation_units_[path];
+  if (tu.parse_time == parse_time && tu.dependencies == dependencies)
+    return;
+  // Forget files which |path| no longer includes.
+  for (const std::string& dependency : tu.dependencies)
+    importers_[dependency].erase(path);
+  tu.parse_time = parse_time;
+  tu.dependencies = dependencies;
+  for (const std::string& dependency : dependencies)
+    importers_[dependency].insert(path);
+  dirty_ = true;
+}
+
+std::vector<std::string> TimestampManager::GetImporters(
+    const std::string& path) {
+  std::vector<std::string> result;
+  {
+    std::lock_guard<InstrumentedMutex> guard(mutex_);
+    auto it = importers_.find(path);
+    if (it != importers_.end())
+      result.assign(it->second.begin(), it->second.end());
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+optional<std::string> TimestampManager::GetCheapestImporter(
+    const std::string& path) {
+  std::lock_guard<InstrumentedMutex> guard(mutex_);
+  auto it = importers_.find(path);
+  if (it == importers_.end())
+    return nullopt;
+  optional<std::string> best;
+  uint64_t best_time = 0;
+  for (const std::string& importer : it->second) {
+    uint64_t time = translation_units_[importer].parse_time;
+    if (!best || time < best_time ||
+        (time == best_time && importer < *best)) {
+      best = importer;
+      best_time = time;
+    }
+  }
+  return best;
+}
+
+optional<uint64_t> TimestampManager::GetParseTime(const std::string& path) {
+  std::lock_guard<InstrumentedMutex> guard(mutex_);
+  auto it = translation_units_.find(path);
+  if (it == translation_units_.end())
+    return nullopt;
+  return it->second.parse_time;
+}
+
+optional<std::vector<std::string>> TimestampManager::GetDependencies(
+    const std::string& path) {
+  std::lock_guard<InstrumentedMutex> guard(mutex_);
+  auto it = translation_units_.find(path);
+  if (it == translation_units_.end())
+    return nullopt;
+  return it->second.dependencies;
+}
+
+void TimestampManager::PrefetchModificationTimes() {
+  std::vector<std::string> paths;
   {
-    std::lock_guard<std::mutex> guard(mutex_);
-    auto it = timestamps_.find(path);
-    if (it != timestamps_.end())
-      return it->second;
+    std::lock_guard<InstrumentedMutex> guard(mutex_);
+    for (const auto& entry : translation_units_)
+      paths.push_back(entry.first);
+    for (const auto& entry : importers_)
+      paths.push_back(entry.first);
+  }
+  std::sort(paths.begin(), paths.end());
+  paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+  // stat is mostly waiting on the file system, so use more threads than there
+  // are cores.
+  std::vector<optional<int64_t>> times(paths.size());
+  std::atomic<size_t> next_path{0};
+  auto stat_files = [&]() {
+    for (size_t i = next_path++; i < paths.size(); i = next_path++)
+      times[i] = GetLastModificationTime(paths[i]);
+  };
+  unsigned num_threads = std::max(std::thread::hardware_concurrency(), 1u) * 2;
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads && i * 64 < paths.size(); i++)
+    threads.emplace_back(stat_files);
+  stat_files();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (size_t i = 0; i < paths.size(); i++)
+    prefetched_times_.Set(paths[i], times[i]);
+  prefetch_expiry_ms_ = GetCurrentTimeInMilliseconds() + kPrefetchedTimeTtlMs;
+}
+
+optional<int64_t> TimestampManager::GetModificationTime(
+    const std::string& path) {
+  int64_t expiry = prefetch_expiry_ms_;
+  if (expiry && GetCurrentTimeInMilliseconds() >= expiry) {
+    // The first caller past the expiry frees the remaining times.
+    if (prefetch_expiry_ms_.compare_exchange_strong(expiry, 0))
+      prefetched_times_.Clear();
+  } else if (expiry) {
+    optional<optional<int64_t>> prefetched = prefetched_times_.TryTake(path);
+    if (prefetched)
+      return *prefetched;
   }
-  IndexFile* file = cache_manager->TryLoad(path);
+  return GetLastModificationTime(path);
+}
+
+void TimestampManager::DropPrefetchedModificationTime(const std::string& path) {
+  prefetched_times_.Erase(path);
+}
+
+optional<TimestampManager::CachedFile> TimestampManager::GetCachedFile(
+    ICacheManager* cache_manager,
+    const std::string& path) {
+  optional<CachedFile> cached = timestamps_.TryGet(path);
+  if (cached)
+    return cached;
+  const IndexFile* file = cache_manager->TryLoad(path);
   if (!file)
     return nullopt;
 
-  UpdateCachedModificationTime(path, file->last_modification_time);
-  return file->last_modification_time;
+  CachedFile result;
+  result.timestamp = file->last_modification_time;
+  result.content_hash = file->file_contents_hash;
+  result.args_fingerprint = GetArgsFingerprint(file->args);
+  UpdateCachedModificationTime(path, result.timestamp, result.content_hash,
+                               result.args_fingerprint);
+  return result;
 }
 
-void TimestampManager::UpdateCachedModificationTime(const std::string& path,
-                                                    int64_t timestamp) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  timestamps_[path] = timestamp;
+TEST_SUITE("TimestampManager") {
+  TEST_CASE("cheapest importer") {
+    TimestampManager manager;
+    REQUIRE(!manager.GetCheapestImporter("a.h"));
+    manager.UpdateTranslationUnit("slow.cc", {"a.h", "b.h"}, 300);
+    manager.UpdateTranslationUnit("fast.cc", {"a.h"}, 100);
+    REQUIRE(*manager.GetCheapestImporter("a.h") == "fast.cc");
+    REQUIRE(*manager.GetCheapestImporter("b.h") == "slow.cc");
+    REQUIRE(*manager.GetParseTime("slow.cc") == 300);
+    REQUIRE(!manager.GetParseTime("a.h"));
+    REQUIRE(manager.GetImporters("a.h") ==
+            std::vector<std::string>({"fast.cc", "slow.cc"}));
+
+    manager.UpdateTranslationUnit("fast.cc", {"a.h"}, 500);
+    REQUIRE(*manager.GetCheapestImporter("a.h") == "slow.cc");
+    manager.UpdateTranslationUnit("slow.cc", {"b.h"}, 300);
+    REQUIRE(manager.GetImporters("a.h") ==
+            std::vector<std::string>({"fast.cc"}));
+    REQUIRE(*manager.GetDependencies("slow.cc") ==
+            std::vector<std::string>({"b.h"}));
+    REQUIRE(!manager.GetDependencies("b.h"));
+  }
+
+  TEST_CASE("args fingerprint") {
+    TimestampManager manager;
+    REQUIRE(!manager.GetLastCachedArgsFingerprint("a.cc"));
+    manager.UpdateCachedModificationTime("a.cc", 1, 2, 3);
+    REQUIRE(*manager.GetLastCachedArgsFingerprint("a.cc") == 3);
+    // Validating the contents keeps the fingerprint.
+    manager.UpdateCachedModificationTime("a.cc", 4, 2);
+    REQUIRE(*manager.GetLastCachedArgsFingerprint("a.cc") == 3);
+    manager.UpdateCachedModificationTime("a.cc", 4, 2, 5);
+    REQUIRE(*manager.GetLastCachedArgsFingerprint("a.cc") == 5);
+  }
 }
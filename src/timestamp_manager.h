@@ -1,22 +1,125 @@
 #pragma once
 
+#include "instrumented_mutex.h"
+#include "striped_hash.h"
+
 #include <optional.h>
 
+#include <atomic>
+#include <cstdint>
 #include <mutex>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 struct ICacheManager;
 
 // Caches timestamps of cc files so we can avoid a filesystem reads. This is
 // important for import perf, as during dependency checking the same files are
 // checked over and over again if they are common headers.
+//
+// Also tracks the include graph of the project: the dependencies and parse
+// time of every translation unit, and the translation units which include
+// each file. Both are persisted next to the cache together with the content
+// hash and arguments of every cached file, so that a restart can check which
+// files are stale without loading the cached index of any file.
 struct TimestampManager {
+  // Loads the state saved at |path|, and saves to |path| from now on. Unless
+  // |load_timestamps| is set, only the include graph is loaded and cached
+  // timestamps are read from the cached indexes again.
+  void Load(const std::string& path, bool load_timestamps);
+  // Writes the state to the path given to Load() if it changed.
+  void Save();
+
   optional<int64_t> GetLastCachedModificationTime(ICacheManager* cache_manager,
                                                   const std::string& path);
+  // Returns the hash of the contents |path| had when its cache was written, if
+  // known. See IndexFile::file_contents_hash.
+  optional<uint64_t> GetLastCachedContentHash(ICacheManager* cache_manager,
+                                              const std::string& path);
+
+  // Returns the GetArgsFingerprint() of the arguments |path| was indexed with
+  // when its cache was written, if known. Unlike the getters above, this
+  // never loads the cache.
+  optional<uint64_t> GetLastCachedArgsFingerprint(const std::string& path);
+
+  // Records the state of the cache of |path| which was just written or
+  // validated. The arguments fingerprint is kept if |args_fingerprint| is
+  // not given.
+  void UpdateCachedModificationTime(
+      const std::string& path,
+      int64_t timestamp,
+      uint64_t content_hash,
+      optional<uint64_t> args_fingerprint = nullopt);
+
+  // Forgets the cached state of |path|, whose cache entry was removed, so
+  // that |path| and the translation units including it are parsed again.
+  void ForgetCachedFile(const std::string& path);
+
+  // Records that parsing and indexing the translation unit |path|, which
+  // includes |dependencies|, took |parse_time| microseconds.
+  void UpdateTranslationUnit(const std::string& path,
+                             const std::vector<std::string>& dependencies,
+                             uint64_t parse_time);
+
+  // Returns the translation units which include |path|, sorted. These need to
+  // be reparsed when |path| changes.
+  std::vector<std::string> GetImporters(const std::string& path);
+
+  // Returns the translation unit including |path| with the lowest recorded
+  // parse time, if any.
+  optional<std::string> GetCheapestImporter(const std::string& path);
+
+  // Returns the recorded parse time of the translation unit |path|, if any.
+  optional<uint64_t> GetParseTime(const std::string& path);
+
+  // Returns the recorded dependencies of the translation unit |path|, if
+  // any.
+  optional<std::vector<std::string>> GetDependencies(const std::string& path);
+
+  // Reads the modification time of every file in the loaded include graph on
+  // several threads, so checking the cache of each translation unit at
+  // startup does not stat its files one by one.
+  void PrefetchModificationTimes();
+  // Returns the current modification time of |path|. A prefetched time is
+  // only returned once, later calls read it from disk again. Prefetched times
+  // expire after a minute, since files may change without anyone
+  // telling cquery.
+  optional<int64_t> GetModificationTime(const std::string& path);
+  // Drops the prefetched time of |path|, which is known to have changed.
+  void DropPrefetchedModificationTime(const std::string& path);
+
+ private:
+  struct CachedFile {
+    int64_t timestamp = 0;
+    uint64_t content_hash = 0;
+    // 0 if unknown.
+    uint64_t args_fingerprint = 0;
+  };
+  struct TranslationUnit {
+    uint64_t parse_time = 0;
+    std::vector<std::string> dependencies;
+  };
+
+  // Returns the cached state of |path|, loading it from its cache if needed.
+  optional<CachedFile> GetCachedFile(ICacheManager* cache_manager,
+                                     const std::string& path);
 
-  void UpdateCachedModificationTime(const std::string& path, int64_t timestamp);
+  // Timestamps are read and updated by every indexer thread for every
+  // dependency, so they are striped instead of guarded by |mutex_|.
+  StripedHashMap<std::string, CachedFile> timestamps_{
+      "timestamp_manager.timestamps"};
+  // See PrefetchModificationTimes(). Cleared once |prefetch_expiry_ms_|, a
+  // steady clock time, has passed; 0 means there is nothing prefetched.
+  StripedHashMap<std::string, optional<int64_t>> prefetched_times_{
+      "timestamp_manager.prefetched_times"};
+  std::atomic<int64_t> prefetch_expiry_ms_{0};
 
-  // TODO: use std::shared_mutex so we can have multiple readers.
-  std::mutex mutex_;
-  std::unordered_map<std::string, int64_t> timestamps_;
-};
\ No newline at end of file
+  // Guards the include graph and |path_|.
+  InstrumentedMutex mutex_{"timestamp_manager"};
+  std::unordered_map<std::string, TranslationUnit> translation_units_;
+  std::unordered_map<std::string, std::unordered_set<std::string>> importers_;
+  std::string path_;
+  std::atomic<bool> dirty_{false};
+};
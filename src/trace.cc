@@ -0,0 +1,241 @@
+#include "trace.h"
+
+#include "timer.h"
+
+#include <doctest/doctest.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Events are buffered per thread and written once this many are pending, so
+// threads only contend on the file when flushing.
+const size_t kFlushEvents = 1024;
+
+struct TraceEvent {
+  const char* category;
+  std::string name;
+  std::string detail;
+  long long start;
+  long long duration;
+};
+
+struct ThreadBuffer {
+  // Only contended when another thread flushes at exit.
+  std::mutex mutex;
+  int tid = 0;
+  std::string thread_name;
+  bool thread_name_written = false;
+  std::vector<TraceEvent> events;
+};
+
+std::atomic<bool> g_tracing{false};
+Timer::Clock::time_point g_trace_start;
+
+// Guarded by GetTraceMutex().
+FILE* g_trace_file = nullptr;
+bool g_wrote_event = false;
+std::vector<std::shared_ptr<ThreadBuffer>>* g_buffers = nullptr;
+
+std::mutex& GetTraceMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+thread_local std::string t_thread_name;
+thread_local std::shared_ptr<ThreadBuffer> t_buffer;
+
+long long NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             Timer::Clock::now() - g_trace_start)
+      .count();
+}
+
+void AppendJsonString(const std::string& value, std::string* out) {
+  *out += '"';
+  for (char c : value) {
+    switch (c) {
+      case '"':
+        *out += "\\\"";
+        break;
+      case '\\':
+        *out += "\\\\";
+        break;
+      case '\n':
+        *out += "\\n";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          *out += escaped;
+        } else {
+          *out += c;
+        }
+        break;
+    }
+  }
+  *out += '"';
+}
+
+void AppendEvent(const TraceEvent& event, int tid, std::string* out) {
+  *out += "{\"name\":";
+  AppendJsonString(event.name, out);
+  *out += ",\"cat\":";
+  AppendJsonString(event.category, out);
+  *out += ",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(tid) +
+          ",\"ts\":" + std::to_string(event.start) +
+          ",\"dur\":" + std::to_string(event.duration);
+  if (!event.detail.empty()) {
+    *out += ",\"args\":{\"detail\":";
+    AppendJsonString(event.detail, out);
+    *out += '}';
+  }
+  *out += '}';
+}
+
+// Serializes the pending events of |buffer|, which must be locked.
+std::string TakeEvents(ThreadBuffer* buffer) {
+  std::string out;
+  if (!buffer->thread_name.empty() && !buffer->thread_name_written) {
+    buffer->thread_name_written = true;
+    out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+           std::to_string(buffer->tid) + ",\"args\":{\"name\":";
+    AppendJsonString(buffer->thread_name, &out);
+    out += "}},\n";
+  }
+  for (const TraceEvent& event : buffer->events) {
+    AppendEvent(event, buffer->tid, &out);
+    out += ",\n";
+  }
+  buffer->events.clear();
+  return out;
+}
+
+// Writes |events| to the trace. The JSON Array Format ignores a trailing
+// comma and a missing closing bracket, so a trace cut short by a crash can
+// still be loaded.
+void WriteEvents(const std::string& events) {
+  std::lock_guard<std::mutex> lock(GetTraceMutex());
+  if (!g_trace_file || events.empty())
+    return;
+  fwrite(events.data(), 1, events.size(), g_trace_file);
+  g_wrote_event = true;
+}
+
+void StopTracing() {
+  g_tracing = false;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(GetTraceMutex());
+    if (g_buffers)
+      buffers = *g_buffers;
+  }
+  for (const std::shared_ptr<ThreadBuffer>& buffer : buffers) {
+    std::string events;
+    {
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      events = TakeEvents(buffer.get());
+    }
+    WriteEvents(events);
+  }
+
+  std::lock_guard<std::mutex> lock(GetTraceMutex());
+  if (!g_trace_file)
+    return;
+  // Replace the trailing ",\n" with the end of the array.
+  if (g_wrote_event)
+    fseek(g_trace_file, -2, SEEK_CUR);
+  fputs("\n]\n", g_trace_file);
+  fclose(g_trace_file);
+  g_trace_file = nullptr;
+}
+
+ThreadBuffer* GetThreadBuffer() {
+  if (!t_buffer) {
+    t_buffer = std::make_shared<ThreadBuffer>();
+    t_buffer->thread_name = t_thread_name;
+    std::lock_guard<std::mutex> lock(GetTraceMutex());
+    if (!g_buffers)
+      g_buffers = new std::vector<std::shared_ptr<ThreadBuffer>>();
+    g_buffers->push_back(t_buffer);
+    t_buffer->tid = int(g_buffers->size());
+  }
+  return t_buffer.get();
+}
+
+}  // namespace
+
+bool StartTracing(const std::string& path) {
+  std::lock_guard<std::mutex> lock(GetTraceMutex());
+  if (g_trace_file)
+    return true;
+  g_trace_file = fopen(path.c_str(), "wb");
+  if (!g_trace_file)
+    return false;
+  fputs("[\n", g_trace_file);
+  g_trace_start = Timer::Clock::now();
+  g_tracing = true;
+  atexit(StopTracing);
+  return true;
+}
+
+bool IsTracing() {
+  return g_tracing.load(std::memory_order_relaxed);
+}
+
+void SetTraceThreadName(const std::string& name) {
+  t_thread_name = name;
+  if (t_buffer) {
+    std::lock_guard<std::mutex> lock(t_buffer->mutex);
+    t_buffer->thread_name = name;
+    t_buffer->thread_name_written = false;
+  }
+}
+
+ScopedTrace::ScopedTrace(const char* category,
+                         const std::string& name,
+                         const std::string& detail)
+    : category_(category) {
+  if (!IsTracing())
+    return;
+  active_ = true;
+  name_ = name;
+  detail_ = detail;
+  start_ = NowMicroseconds();
+}
+
+ScopedTrace::~ScopedTrace() {
+  if (!active_ || !IsTracing())
+    return;
+  TraceEvent event;
+  event.category = category_;
+  event.name = std::move(name_);
+  event.detail = std::move(detail_);
+  event.start = start_;
+  event.duration = NowMicroseconds() - start_;
+
+  ThreadBuffer* buffer = GetThreadBuffer();
+  std::string events;
+  {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->events.push_back(std::move(event));
+    if (buffer->events.size() >= kFlushEvents)
+      events = TakeEvents(buffer);
+  }
+  if (!events.empty())
+    WriteEvents(events);
+}
+
+TEST_SUITE("Trace") {
+  TEST_CASE("json string") {
+    std::string out;
+    AppendJsonString("a\"b\\c\n\t", &out);
+    REQUIRE(out == "\"a\\\"b\\\\c\\n\\u0009\"");
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+// Records spans of work from every thread in the Chrome trace event format,
+// which can be opened in chrome://tracing or Perfetto. Tracing is off unless
+// StartTracing() is called; a disabled ScopedTrace only checks a flag.
+
+// Starts writing events to |path|. The trace is finished when the process
+// exits. Returns false if |path| cannot be opened.
+bool StartTracing(const std::string& path);
+bool IsTracing();
+
+// Names the current thread in the trace. Called by SetCurrentThreadName.
+void SetTraceThreadName(const std::string& name);
+
+// Records the time from construction to destruction as an event called
+// |name|. |detail|, such as the file path or request method, is shown as an
+// argument of the event.
+class ScopedTrace {
+ public:
+  ScopedTrace(const char* category,
+              const std::string& name,
+              const std::string& detail = std::string());
+  ~ScopedTrace();
+
+ private:
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+  bool active_ = false;
+  const char* category_;
+  std::string name_;
+  std::string detail_;
+  long long start_ = 0;
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "maybe.h"
+
+#include <sparsepp/spp.h>
+
+#include <stdint.h>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Concurrent map from Usr to query id, so that IdMaps can be built on several
+// indexer threads at once.
+//
+// The table is split into shards which are locked independently. Usrs are
+// already hashes (see HashUsr), so the shard is picked from the top bits and
+// the shard maps still see well distributed low bits.
+//
+// Ids are allocated densely in allocation order, or reuse an id which the
+// owner released. The table only hands out ids; the owner creates the storage
+// for new ids and resets it for reused ones, see ForEachAllocated and
+// TakeReused.
+template <typename TId>
+class UsrIdTable {
+ public:
+  Maybe<TId> Get(uint64_t usr) {
+    Shard& shard = GetShard(usr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.ids.find(usr);
+    if (it == shard.ids.end())
+      return nullopt;
+    return it->second;
+  }
+
+  // Returns the id of |usr|, allocating a new one if there is none yet.
+  TId GetOrAllocate(uint64_t usr) {
+    Shard& shard = GetShard(usr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.ids.find(usr);
+    if (it != shard.ids.end())
+      return it->second;
+
+    std::lock_guard<std::mutex> allocated_lock(allocated_mutex_);
+    TId id = Allocate(usr);
+    shard.ids[usr] = id;
+    return id;
+  }
+
+  // GetOrAllocate for every usr of |usrs|, storing the ids in |ids| in the
+  // same order. Each shard is locked once, which is much cheaper than a lookup
+  // per usr when a whole file is imported at once.
+  void GetOrAllocateAll(const std::vector<uint64_t>& usrs,
+                        std::vector<TId>* ids) {
+    ids->resize(usrs.size());
+    // Bucket the usrs by shard, keeping their order within a shard.
+    std::vector<size_t> shard_begin((1 << kShardBits) + 1);
+    for (uint64_t usr : usrs)
+      shard_begin[GetShardIndex(usr) + 1]++;
+    for (int i = 0; i < (1 << kShardBits); i++)
+      shard_begin[i + 1] += shard_begin[i];
+    std::vector<size_t> order(usrs.size());
+    std::vector<size_t> next = shard_begin;
+    for (size_t i = 0; i < usrs.size(); i++)
+      order[next[GetShardIndex(usrs[i])]++] = i;
+
+    for (int i = 0; i < (1 << kShardBits); i++) {
+      if (shard_begin[i] == shard_begin[i + 1])
+        continue;
+      Shard& shard = shards_[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      std::unique_lock<std::mutex> allocated_lock(allocated_mutex_,
+                                                  std::defer_lock);
+      for (size_t j = shard_begin[i]; j < shard_begin[i + 1]; j++) {
+        uint64_t usr = usrs[order[j]];
+        auto it = shard.ids.find(usr);
+        if (it != shard.ids.end()) {
+          (*ids)[order[j]] = it->second;
+          continue;
+        }
+        if (!allocated_lock.owns_lock())
+          allocated_lock.lock();
+        TId id = Allocate(usr);
+        shard.ids[usr] = id;
+        (*ids)[order[j]] = id;
+      }
+    }
+  }
+
+  // Forgets |usr|, so that its id is handed out again for another usr. The
+  // caller must make sure nothing which still refers to the id by |usr|
+  // exists.
+  void Release(uint64_t usr) {
+    Shard& shard = GetShard(usr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.ids.find(usr);
+    if (it == shard.ids.end())
+      return;
+    std::lock_guard<std::mutex> allocated_lock(allocated_mutex_);
+    free_.push_back(it->second);
+    shard.ids.erase(it);
+  }
+
+  // Approximate heap memory used by the table.
+  size_t EstimateMemoryUsage() {
+    size_t bytes = 0;
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      bytes += shard.ids.size() * sizeof(std::pair<uint64_t, TId>) +
+               shard.ids.bucket_count() / 4;
+    }
+    std::lock_guard<std::mutex> lock(allocated_mutex_);
+    return bytes + allocated_.capacity() * sizeof(uint64_t);
+  }
+
+  // Exchanges the contents of the tables. Not atomic with respect to
+  // concurrent lookups, so nothing may use either table meanwhile.
+  void Swap(UsrIdTable& other) {
+    for (int i = 0; i < (1 << kShardBits); i++) {
+      std::lock(shards_[i].mutex, other.shards_[i].mutex);
+      std::lock_guard<std::mutex> lock(shards_[i].mutex, std::adopt_lock);
+      std::lock_guard<std::mutex> other_lock(other.shards_[i].mutex,
+                                             std::adopt_lock);
+      shards_[i].ids.swap(other.shards_[i].ids);
+    }
+    std::lock(allocated_mutex_, other.allocated_mutex_);
+    std::lock_guard<std::mutex> lock(allocated_mutex_, std::adopt_lock);
+    std::lock_guard<std::mutex> other_lock(other.allocated_mutex_,
+                                           std::adopt_lock);
+    allocated_.swap(other.allocated_);
+    free_.swap(other.free_);
+    reused_.swap(other.reused_);
+  }
+
+  // Returns the released ids which are not reused yet.
+  std::vector<TId> GetFreeIds() {
+    std::lock_guard<std::mutex> lock(allocated_mutex_);
+    return free_;
+  }
+
+  // Replaces the contents of the table, so that id i belongs to |usrs[i]|
+  // except for the ids in |free|, which are released. Used to restore a
+  // snapshot; nothing may use the table meanwhile.
+  void Reset(const std::vector<uint64_t>& usrs, const std::vector<TId>& free) {
+    std::vector<bool> is_free(usrs.size());
+    for (TId id : free)
+      is_free[id.id] = true;
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.ids.clear();
+    }
+    for (size_t i = 0; i < usrs.size(); i++) {
+      if (is_free[i])
+        continue;
+      Shard& shard = GetShard(usrs[i]);
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.ids[usrs[i]] = TId(i);
+    }
+    std::lock_guard<std::mutex> lock(allocated_mutex_);
+    allocated_ = usrs;
+    free_ = free;
+    reused_.clear();
+  }
+
+  // Invokes |fn| with the usr of each id starting at |begin|, in id order.
+  template <typename Fn>
+  void ForEachAllocated(size_t begin, Fn fn) {
+    std::lock_guard<std::mutex> lock(allocated_mutex_);
+    for (size_t i = begin; i < allocated_.size(); i++)
+      fn(allocated_[i]);
+  }
+
+  // Invokes |fn| with each id and usr which GetOrAllocate reused since the
+  // last call.
+  template <typename Fn>
+  void TakeReused(Fn fn) {
+    std::vector<std::pair<TId, uint64_t>> reused;
+    {
+      std::lock_guard<std::mutex> lock(allocated_mutex_);
+      for (TId id : reused_)
+        reused.push_back(std::make_pair(id, allocated_[id.id]));
+      reused_.clear();
+    }
+    for (const auto& entry : reused)
+      fn(entry.first, entry.second);
+  }
+
+ private:
+  static const int kShardBits = 6;
+
+  struct Shard {
+    std::mutex mutex;
+    spp::sparse_hash_map<uint64_t, TId> ids;
+  };
+
+  static size_t GetShardIndex(uint64_t usr) {
+    return size_t(usr >> (64 - kShardBits));
+  }
+  Shard& GetShard(uint64_t usr) { return shards_[GetShardIndex(usr)]; }
+
+  // Picks the id of a new |usr|. Requires |allocated_mutex_|.
+  TId Allocate(uint64_t usr) {
+    TId id;
+    if (!free_.empty()) {
+      id = free_.back();
+      free_.pop_back();
+      allocated_[id.id] = usr;
+      reused_.push_back(id);
+    } else {
+      id = TId(allocated_.size());
+      allocated_.push_back(usr);
+    }
+    return id;
+  }
+
+  Shard shards_[1 << kShardBits];
+
+  // Usr of each allocated id, released ids which are free to be reused, and
+  // ids which were reused but not yet taken by TakeReused.
+  std::mutex allocated_mutex_;
+  std::vector<uint64_t> allocated_;
+  std::vector<TId> free_;
+  std::vector<TId> reused_;
+};
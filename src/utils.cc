@@ -4,17 +4,18 @@
 
 #include <doctest/doctest.h>
 #include <siphash.h>
-#include <tinydir.h>
 #include <loguru/loguru.hpp>
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <locale>
+#include <random>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -57,6 +58,54 @@ void RemoveLastCR(std::string& s) {
     s.pop_back();
 }
 
+std::string FormatComment(const std::string& raw, int indent) {
+  int pad = -1;
+  std::string ret;
+  for (const char* p = raw.c_str(); *p;) {
+    // The first line starts with a comment marker, but the rest needs
+    // un-indenting.
+    int skip = indent;
+    for (; skip > 0 && (*p == ' ' || *p == '\t'); p++)
+      skip--;
+    const char* q = p;
+    while (*q != '\n' && *q)
+      q++;
+    if (*q)
+      q++;
+    // A minimalist approach to skip Doxygen comment markers.
+    // See https://www.stack.nl/~dimitri/doxygen/manual/docblocks.html
+    if (pad < 0) {
+      // First line, detect the length of comment marker and put into |pad|
+      const char* begin = p;
+      while (*p == '/' || *p == '*')
+        p++;
+      if (*p == '<' || *p == '!')
+        p++;
+      if (*p == ' ')
+        p++;
+      pad = int(p - begin);
+    } else {
+      // Other lines, skip |pad| bytes
+      int prefix = pad;
+      while (prefix > 0 &&
+             (*p == ' ' || *p == '/' || *p == '*' || *p == '<' || *p == '!'))
+        prefix--, p++;
+    }
+    ret.insert(ret.end(), p, q);
+    p = q;
+  }
+  while (ret.size() && isspace(ret.back()))
+    ret.pop_back();
+  if (EndsWith(ret, "*/")) {
+    ret.resize(ret.size() - 2);
+  } else if (EndsWith(ret, "\n/")) {
+    ret.resize(ret.size() - 2);
+  }
+  while (ret.size() && isspace(ret.back()))
+    ret.pop_back();
+  return ret;
+}
+
 uint64_t HashUsr(const std::string& s) {
   return HashUsr(s.c_str(), s.size());
 }
@@ -65,7 +114,72 @@ uint64_t HashUsr(const char* s) {
   return HashUsr(s, strlen(s));
 }
 
+uint64_t HashStorageKey(const std::string& s) {
+  return HashStorageKey(s.c_str(), s.size());
+}
+
+bool g_fast_usr_hash = false;
+
+namespace {
+
+// MurmurHash64A. USRs are not attacker controlled, so a hash which is not
+// cryptographically strong is fine.
+uint64_t FastHash(const char* s, size_t n) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = 0x6e3a61c3f00dba11ULL ^ (n * m);
+
+  const char* end = s + n / 8 * 8;
+  for (; s != end; s += 8) {
+    uint64_t k;
+    memcpy(&k, s, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  const uint8_t* tail = reinterpret_cast<const uint8_t*>(s);
+  switch (n & 7) {
+    case 7:
+      h ^= uint64_t(tail[6]) << 48;
+      // fallthrough
+    case 6:
+      h ^= uint64_t(tail[5]) << 40;
+      // fallthrough
+    case 5:
+      h ^= uint64_t(tail[4]) << 32;
+      // fallthrough
+    case 4:
+      h ^= uint64_t(tail[3]) << 24;
+      // fallthrough
+    case 3:
+      h ^= uint64_t(tail[2]) << 16;
+      // fallthrough
+    case 2:
+      h ^= uint64_t(tail[1]) << 8;
+      // fallthrough
+    case 1:
+      h ^= uint64_t(tail[0]);
+      h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+}  // namespace
+
 uint64_t HashUsr(const char* s, size_t n) {
+  if (g_fast_usr_hash)
+    return FastHash(s, n);
+  return HashStorageKey(s, n);
+}
+
+uint64_t HashStorageKey(const char* s, size_t n) {
   union {
     uint64_t ret;
     uint8_t out[8];
@@ -112,6 +226,20 @@ bool EndsWithAny(const std::string& value,
       [&value](const std::string& ending) { return EndsWith(value, ending); });
 }
 
+uint64_t GetArgsFingerprint(const std::vector<std::string>& args) {
+  std::string normalized;
+  for (const std::string& arg : args) {
+    // Arguments cannot contain NUL, so this keeps them apart. Source files
+    // are all replaced by one placeholder.
+    if (EndsWithAny(arg, {".h", ".c", ".cc", ".cpp", ".hpp", ".m", ".mm"}))
+      normalized += '\1';
+    else
+      normalized += arg;
+    normalized += '\0';
+  }
+  return HashStorageKey(normalized);
+}
+
 bool FindAnyPartial(const std::string& value,
                     const std::vector<std::string>& values) {
   return std::any_of(std::begin(values), std::end(values),
@@ -192,6 +320,12 @@ std::string LowerPathIfCaseInsensitive(const std::string& path) {
   return result;
 }
 
+bool IsIndexedDirectoryEntry(const std::string& name) {
+  // Skip all dot files except .cquery. This also skips the '.' and '..'
+  // directories, which would otherwise loop infinitely.
+  return name[0] != '.' || name == ".cquery";
+}
+
 static void GetFilesInFolderHelper(
     std::string folder,
     bool recursive,
@@ -199,49 +333,24 @@ static void GetFilesInFolderHelper(
     const std::function<void(const std::string&)>& handler) {
   std::queue<std::pair<std::string, std::string>> q;
   q.push(make_pair(folder, output_prefix));
+  std::vector<DirectoryEntry> entries;
   while (!q.empty()) {
-    tinydir_dir dir;
-    if (tinydir_open(&dir, q.front().first.c_str()) == -1) {
-      LOG_S(WARNING) << "Unable to open directory " << folder;
-      goto bail;
-    }
-
-    while (dir.has_next) {
-      tinydir_file file;
-      if (tinydir_readfile(&dir, &file) == -1) {
-        LOG_S(WARNING) << "Unable to read file " << file.name
-                       << " when reading directory " << folder;
-        goto bail;
-      }
+    entries.clear();
+    if (!ListDirectory(q.front().first, &entries))
+      LOG_S(WARNING) << "Unable to read directory " << q.front().first;
 
-      // Skip all dot files except .cquery.
-      //
-      // The nested ifs are intentional, branching order is subtle here.
-      //
-      // Note that in the future if we do support dot directories/files, we must
-      // always ignore the '.' and '..' directories otherwise this will loop
-      // infinitely.
-      if (file.name[0] != '.' || strcmp(file.name, ".cquery") == 0) {
-        if (file.is_dir) {
-          if (recursive) {
-            std::string child_dir = q.front().second + file.name + "/";
-            if (!IsSymLink(file.path))
-              q.push(make_pair(file.path, child_dir));
-          }
-        } else {
-          handler(q.front().second + file.name);
+    for (const DirectoryEntry& entry : entries) {
+      if (!IsIndexedDirectoryEntry(entry.name))
+        continue;
+      if (entry.is_dir) {
+        if (recursive) {
+          q.push(make_pair(q.front().first + entry.name + "/",
+                           q.front().second + entry.name + "/"));
         }
-      }
-
-      if (tinydir_next(&dir) == -1) {
-        LOG_S(WARNING) << "Unable to fetch next file when reading directory "
-                       << folder;
-        goto bail;
+      } else {
+        handler(q.front().second + entry.name);
       }
     }
-
-  bail:
-    tinydir_close(&dir);
     q.pop();
   }
 }
@@ -533,6 +642,34 @@ void WriteToFile(const std::string& filename, const std::string& content) {
   file << content;
 }
 
+bool WriteToFileAtomically(const std::string& filename,
+                           const std::string& content) {
+  // Several threads or processes may write the same file at once.
+  std::string tmp_filename =
+      filename + ".tmp" + std::to_string(std::random_device()());
+  {
+    std::ofstream file(tmp_filename,
+                       std::ios::out | std::ios::trunc | std::ios::binary);
+    if (file.good())
+      file << content;
+    if (!file.good()) {
+      LOG_S(ERROR) << "Cannot write to " << tmp_filename;
+      remove(tmp_filename.c_str());
+      return false;
+    }
+  }
+  if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    // Windows does not replace existing files.
+    remove(filename.c_str());
+    if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      LOG_S(ERROR) << "Cannot move " << tmp_filename << " to " << filename;
+      remove(tmp_filename.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
 float GetProcessMemoryUsedInMb() {
 #if defined(__APPLE__)
   return 0.f;
@@ -671,3 +808,15 @@ TEST_SUITE("StripFileType") {
     REQUIRE(StripFileType("foo/bar.cc") == "foo/bar");
   }
 }
+
+TEST_SUITE("FormatComment") {
+  TEST_CASE("line comments") {
+    REQUIRE(FormatComment("// foo\n  // bar\n", 2) == "foo\nbar");
+    REQUIRE(FormatComment("///< foo", 0) == "foo");
+  }
+
+  TEST_CASE("block comments") {
+    REQUIRE(FormatComment("/* foo */", 0) == "foo");
+    REQUIRE(FormatComment("/** foo\n    bar */", 4) == "foo\nbar");
+  }
+}
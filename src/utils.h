@@ -18,10 +18,24 @@ void TrimEndInPlace(std::string& s);
 void TrimInPlace(std::string& s);
 std::string Trim(std::string s);
 
+// If true, HashUsr uses a faster hash than siphash. Only USR ids depend on
+// it; see IndexFile::GetMajorVersion.
+extern bool g_fast_usr_hash;
+
 uint64_t HashUsr(const std::string& s);
 uint64_t HashUsr(const char* s);
 uint64_t HashUsr(const char* s, size_t n);
 
+// Hash for file contents and the keys of anything stored on disk (packed
+// cache shards, blob names, preamble files). Always siphash, so these stay
+// stable when |g_fast_usr_hash| is toggled.
+uint64_t HashStorageKey(const std::string& s);
+uint64_t HashStorageKey(const char* s, size_t n);
+
+// Returns a hash of the compiler arguments |args| which is the same for
+// arguments that only differ in the source files they name.
+uint64_t GetArgsFingerprint(const std::vector<std::string>& args);
+
 // Returns true if |value| starts/ends with |start| or |ending|.
 bool StartsWith(const std::string& value, const std::string& start);
 bool EndsWith(const std::string& value, const std::string& ending);
@@ -75,6 +89,9 @@ bool ContainsValue(const TCollection& collection, const TValue& value) {
   return collection.find(value) != collection.end();
 }
 
+// Returns true if directory scans should visit the file or directory |name|.
+bool IsIndexedDirectoryEntry(const std::string& name);
+
 // Finds all files in the given folder. This is recursive.
 std::vector<std::string> GetFilesInFolder(std::string folder,
                                           bool recursive,
@@ -97,6 +114,13 @@ optional<std::string> ReadContent(const std::string& filename);
 std::vector<std::string> ReadLinesWithEnding(std::string filename);
 std::vector<std::string> ToLines(const std::string& content,
                                  bool trim_whitespace);
+// Removes a trailing '\r' from |s|.
+void RemoveLastCR(std::string& s);
+
+// Returns the text of the comment |raw|, which starts at 0-based column
+// |indent|, without comment markers and without the indentation of the
+// following lines.
+std::string FormatComment(const std::string& raw, int indent);
 
 struct TextReplacer {
   struct Replacement {
@@ -121,6 +145,11 @@ void UpdateTestExpectation(const std::string& filename,
                            const std::string& actual);
 
 void WriteToFile(const std::string& filename, const std::string& content);
+// Writes |content| to a temporary file next to |filename| which then replaces
+// it, so that readers never see a partially written file. Returns false if
+// the file could not be written; |filename| is left as it was.
+bool WriteToFileAtomically(const std::string& filename,
+                           const std::string& content);
 
 // note: this implementation does not disable this overload for array types
 // See
@@ -130,8 +159,9 @@ std::unique_ptr<T> MakeUnique(Args&&... args) {
   return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
-template <typename T>
-void AddRange(std::vector<T>* dest, const std::vector<T>& to_add) {
+template <typename T, typename TAllocator>
+void AddRange(std::vector<T>* dest,
+              const std::vector<T, TAllocator>& to_add) {
   dest->insert(dest->end(), to_add.begin(), to_add.end());
 }
 
@@ -141,18 +171,6 @@ void PushRange(std::queue<T>* dest, const std::vector<T>& to_add) {
     dest->push(e);
 }
 
-template <typename T>
-void RemoveRange(std::vector<T>* dest, const std::vector<T>& to_remove) {
-  dest->erase(std::remove_if(dest->begin(), dest->end(),
-                             [&](const T& t) {
-                               // TODO: make to_remove a set?
-                               return std::find(to_remove.begin(),
-                                                to_remove.end(),
-                                                t) != to_remove.end();
-                             }),
-              dest->end());
-}
-
 // http://stackoverflow.com/a/38140932
 //
 //  struct SomeHashKey {
@@ -2,11 +2,90 @@
 
 #include "platform.h"
 
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+namespace {
+
+// Set by EnablePlacement before other threads start, and only read after.
+// Empty unless threads are placed.
+std::vector<std::vector<int>> g_numa_node_cpus;
+std::atomic<int> g_placed_indexers{0};
+
+// Formats |cpus| like sysfs does, ie, "0-3,8".
+std::string FormatCpuList(const std::vector<int>& cpus) {
+  std::string result;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t last = i;
+    while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1)
+      last++;
+    if (!result.empty())
+      result += ',';
+    result += std::to_string(cpus[i]);
+    if (last > i)
+      result += '-' + std::to_string(cpus[last]);
+    i = last + 1;
+  }
+  return result;
+}
+
+}  // namespace
+
+// static
+void WorkThread::StartThread(const std::string& thread_name,
+                             std::function<void()> entry_point) {
+  StartThread(thread_name, ThreadKind::Other, entry_point);
+}
+
 // static
 void WorkThread::StartThread(const std::string& thread_name,
+                             ThreadKind kind,
                              std::function<void()> entry_point) {
-  new std::thread([thread_name, entry_point]() {
+  new std::thread([thread_name, entry_point, kind]() {
     SetCurrentThreadName(thread_name);
+    PlaceCurrentThread(kind);
     entry_point();
   });
-}
\ No newline at end of file
+}
+
+// static
+void WorkThread::EnablePlacement() {
+  std::vector<std::vector<int>> nodes = GetNumaNodeCpus();
+  if (nodes.empty()) {
+    LOG_S(WARNING) << "Thread placement is not supported on this platform";
+    return;
+  }
+  if (nodes.size() == 1) {
+    // Every thread would run on every CPU anyway.
+    LOG_S(INFO) << "Not placing threads; there is one NUMA node with CPUs "
+                << FormatCpuList(nodes[0]);
+    return;
+  }
+  g_numa_node_cpus = std::move(nodes);
+  LOG_S(INFO) << "Placing querydb and serving threads on CPUs "
+              << FormatCpuList(g_numa_node_cpus[0])
+              << " and spreading indexers over " << g_numa_node_cpus.size()
+              << " NUMA nodes";
+  PlaceCurrentThread(ThreadKind::Serving);
+}
+
+// static
+void WorkThread::PlaceCurrentThread(ThreadKind kind) {
+  if (g_numa_node_cpus.empty() || kind == ThreadKind::Other)
+    return;
+  size_t node = 0;
+  if (kind == ThreadKind::Indexer)
+    node = (g_placed_indexers++ + 1) % g_numa_node_cpus.size();
+  if (SetCurrentThreadCpus(g_numa_node_cpus[node])) {
+    LOG_S(INFO) << "Running on NUMA node " << node << ", CPUs "
+                << FormatCpuList(g_numa_node_cpus[node]);
+  }
+}
+
+TEST_SUITE("WorkThread") {
+  TEST_CASE("cpu lists") {
+    REQUIRE(FormatCpuList({}) == "");
+    REQUIRE(FormatCpuList({3}) == "3");
+    REQUIRE(FormatCpuList({0, 1, 2, 3, 8, 10, 11}) == "0-3,8,10-11");
+  }
+}
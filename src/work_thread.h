@@ -3,9 +3,19 @@
 #include <atomic>
 #include <functional>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
+// What a thread does, which decides where it runs once placement is enabled,
+// see WorkThread::EnablePlacement.
+enum class ThreadKind {
+  Other,
+  // Reads requests, answers them from querydb, or writes the responses.
+  Serving,
+  Indexer,
+};
+
 // Helper methods for starting threads that do some work. Enables test code to
 // wait for all work to complete.
 struct WorkThread {
@@ -13,7 +23,23 @@ struct WorkThread {
   // return true if it there is still known work to be done.
   static void StartThread(const std::string& thread_name,
                           std::function<void()> entry_point);
+  // Launch a new thread which is placed as a thread of |kind|.
+  static void StartThread(const std::string& thread_name,
+                          ThreadKind kind,
+                          std::function<void()> entry_point);
+
+  // Places the threads started afterwards, see Config::threadPlacement, and
+  // the calling thread, which runs querydb, as a serving thread. Must be
+  // called before any other thread is started. Serving threads run on the
+  // CPUs of the first NUMA node, so that querydb memory is allocated on the
+  // node it is read from. Indexer threads are spread over the nodes starting
+  // with the second one, and allocate the memory of their translation units
+  // on their own node. Logs the placement.
+  static void EnablePlacement();
+  // Places the calling thread like StartThread does, for threads which are
+  // not started by it.
+  static void PlaceCurrentThread(ThreadKind kind);
 
   // Static-only class.
   WorkThread() = delete;
-};
\ No newline at end of file
+};
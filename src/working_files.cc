@@ -1,12 +1,14 @@
 #include "working_files.h"
 
 #include "lex_utils.h"
+#include "memory_usage.h"
 #include "position.h"
 
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
 #include <algorithm>
+#include <cassert>
 #include <climits>
 #include <numeric>
 
@@ -77,7 +79,7 @@ int MyersDiff(const char* a, int la, const char* b, int lb, int threshold) {
   return threshold + 1;
 }
 
-int MyersDiff(const std::string& a, const std::string& b, int threshold) {
+int MyersDiff(std::string_view a, std::string_view b, int threshold) {
   return MyersDiff(a.data(), a.size(), b.data(), b.size(), threshold);
 }
 
@@ -87,7 +89,7 @@ int MyersDiff(const std::string& a, const std::string& b, int threshold) {
 // Myers' diff algorithm is used to find best matching line while this one is
 // used to align a single column because Myers' needs some twiddling to return
 // distance vector.
-std::vector<int> EditDistanceVector(std::string a, std::string b) {
+std::vector<int> EditDistanceVector(std::string_view a, std::string_view b) {
   std::vector<int> d(b.size() + 1);
   std::iota(d.begin(), d.end(), 0);
   for (int i = 0; i < (int)a.size(); i++) {
@@ -104,7 +106,10 @@ std::vector<int> EditDistanceVector(std::string a, std::string b) {
 
 // Find matching position of |a[column]| in |b|.
 // This is actually a single step of Hirschberg's sequence alignment algorithm.
-int AlignColumn(const std::string& a, int column, std::string b, bool is_end) {
+int AlignColumn(std::string_view a,
+                int column,
+                std::string_view b,
+                bool is_end) {
   int head = 0, tail = 0;
   while (head < (int)a.size() && head < (int)b.size() && a[head] == b[head])
     head++;
@@ -126,10 +131,11 @@ int AlignColumn(const std::string& a, int column, std::string b, bool is_end) {
 
   // right[i] = cost of aligning a[column, a.size() - tail) to b[head + i,
   // b.size() - tail)
-  std::string a_rev = a.substr(column, a.size() - tail - column);
+  std::string a_rev(a.substr(column, a.size() - tail - column));
   std::reverse(a_rev.begin(), a_rev.end());
-  std::reverse(b.begin(), b.end());
-  std::vector<int> right = EditDistanceVector(a_rev, b);
+  std::string b_rev(b);
+  std::reverse(b_rev.begin(), b_rev.end());
+  std::vector<int> right = EditDistanceVector(a_rev, b_rev);
   std::reverse(right.begin(), right.end());
 
   int best = 0, best_cost = INT_MAX;
@@ -143,14 +149,31 @@ int AlignColumn(const std::string& a, int column, std::string b, bool is_end) {
   return head + best;
 }
 
+// Searches lines [up, down] and uses Myers's diff algorithm to find the best
+// match (least edit distance) of |needle|.
+int FindMostSimilarLine(std::string_view needle,
+                        const TextLines& lines,
+                        int up,
+                        int down) {
+  int best = up, best_dist = kMaxDiff + 1;
+  for (int i = up; i <= down; i++) {
+    int dist = MyersDiff(needle, lines[i], kMaxDiff);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = i;
+    }
+  }
+  return best;
+}
+
 // Find matching buffer line of index_lines[line].
 // By symmetry, this can also be used to find matching index line of a buffer
 // line.
-optional<int> FindMatchingLine(const std::vector<std::string>& index_lines,
+optional<int> FindMatchingLine(const TextLines& index_lines,
                                const std::vector<int>& index_to_buffer,
                                int line,
                                int* column,
-                               const std::vector<std::string>& buffer_lines,
+                               const TextLines& buffer_lines,
                                bool is_end) {
   // If this is a confident mapping, returns.
   if (index_to_buffer[line] >= 0) {
@@ -173,33 +196,83 @@ optional<int> FindMatchingLine(const std::vector<std::string>& index_lines,
   if (up > down)
     return nullopt;
 
-  // Search for lines [up,down] and use Myers's diff algorithm to find the best
-  // match (least edit distance).
-  int best = up, best_dist = kMaxDiff + 1;
-  const std::string& needle = index_lines[line];
-  for (int i = up; i <= down; i++) {
-    int dist = MyersDiff(needle, buffer_lines[i], kMaxDiff);
-    if (dist < best_dist) {
-      best_dist = dist;
-      best = i;
-    }
-  }
+  int best = FindMostSimilarLine(index_lines[line], buffer_lines, up, down);
   if (column)
     *column =
         AlignColumn(index_lines[line], *column, buffer_lines[best], is_end);
   return best;
 }
 
+// Same as HashUsr(Trim(line)), without copying |line|.
+uint64_t HashLine(std::string_view line) {
+  const char *begin = line.data(), *end = begin + line.size();
+  while (begin < end && isspace(*begin))
+    begin++;
+  while (begin < end && isspace(end[-1]))
+    end--;
+  return HashUsr(begin, end - begin);
+}
+
+std::vector<uint64_t> HashLines(const TextLines& lines) {
+  std::vector<uint64_t> result;
+  result.reserve(lines.size());
+  for (size_t i = 0; i < lines.size(); i++)
+    result.push_back(HashLine(lines[i]));
+  return result;
+}
+
+// Returns i for every unique line i of |hashes| and -1 for duplicated lines.
+// If |hash_to_unique| is not null, it is set to map every hash to its unique
+// line or -1.
+std::vector<int> GetUniqueLines(
+    const std::vector<uint64_t>& hashes,
+    std::unordered_map<uint64_t, int>* hash_to_unique) {
+  std::unordered_map<uint64_t, int> local;
+  if (!hash_to_unique)
+    hash_to_unique = &local;
+  hash_to_unique->reserve(hashes.size());
+  std::vector<int> result(hashes.size());
+  for (int i = 0; i < (int)hashes.size(); i++) {
+    auto it = hash_to_unique->find(hashes[i]);
+    if (it == hash_to_unique->end()) {
+      (*hash_to_unique)[hashes[i]] = i;
+      result[i] = i;
+    } else {
+      if (it->second >= 0)
+        result[it->second] = -1;
+      result[i] = it->second = -1;
+    }
+  }
+  return result;
+}
+
 }  // namespace
 
+void TextLines::Update() {
+  starts_.assign(1, 0);
+  for (size_t i = 0; i < text_->size(); i++) {
+    if ((*text_)[i] == '\n')
+      starts_.push_back(int(i) + 1);
+  }
+}
+
+std::string_view TextLines::operator[](size_t line) const {
+  size_t start = starts_[line];
+  size_t end =
+      line + 1 < starts_.size() ? starts_[line + 1] - 1 : text_->size();
+  if (end > start && (*text_)[end - 1] == '\r')
+    end--;
+  return std::string_view(*text_).substr(start, end - start);
+}
+
 std::vector<CXUnsavedFile> WorkingFiles::Snapshot::AsUnsavedFiles() const {
   std::vector<CXUnsavedFile> result;
   result.reserve(files.size());
   for (auto& file : files) {
     CXUnsavedFile unsaved;
     unsaved.Filename = file.filename.c_str();
-    unsaved.Contents = file.content.c_str();
-    unsaved.Length = (unsigned long)file.content.size();
+    unsaved.Contents = file.content->c_str();
+    unsaved.Length = (unsigned long)file.content->size();
 
     result.push_back(unsaved);
   }
@@ -207,22 +280,115 @@ std::vector<CXUnsavedFile> WorkingFiles::Snapshot::AsUnsavedFiles() const {
 }
 
 WorkingFile::WorkingFile(const std::string& filename,
-                         const std::string& buffer_content)
-    : filename(filename), buffer_content(buffer_content) {
+                         std::string buffer_content)
+    : filename(filename), buffer_content(std::move(buffer_content)) {
   OnBufferContentUpdated();
 
   // SetIndexContent gets called when the file is opened.
 }
 
-void WorkingFile::SetIndexContent(const std::string& index_content) {
-  index_lines = ToLines(index_content, false /*trim_whitespace*/);
+void WorkingFile::SetIndexContent(std::string index_content, uint64_t hash) {
+  change_count++;
+  index_content_hash = hash;
+  this->index_content = std::move(index_content);
+  index_lines.Update();
+  index_hashes_.clear();
+  index_unique_.clear();
 
   index_to_buffer.clear();
   buffer_to_index.clear();
 }
 
 void WorkingFile::OnBufferContentUpdated() {
-  buffer_lines = ToLines(buffer_content, false /*trim_whitespace*/);
+  change_count++;
+  buffer_lines.Update();
+  {
+    std::lock_guard<std::mutex> lock(line_mapping_mutex_);
+    buffer_hashes_.clear();
+  }
+  OnBufferChanged();
+}
+
+void WorkingFile::ApplyChange(int start_offset,
+                              int end_offset,
+                              const std::string& text) {
+  change_count++;
+  std::vector<int>& starts = buffer_lines.starts();
+  size_t num_lines = starts.size();
+  size_t num_visible_lines = buffer_lines.size();
+  // Lines which contain |start_offset| and |end_offset|.
+  size_t first_line =
+      std::upper_bound(starts.begin(), starts.end(), start_offset) -
+      starts.begin() - 1;
+  size_t last_line = std::upper_bound(starts.begin(), starts.end(), end_offset) -
+                     starts.begin() - 1;
+
+  buffer_content.replace(start_offset, end_offset - start_offset, text);
+
+  // Replace the starts of the removed lines with the inserted ones and shift
+  // the following lines.
+  std::vector<int> inserted_starts;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '\n')
+      inserted_starts.push_back(start_offset + int(i) + 1);
+  }
+  int delta = int(text.size()) - (end_offset - start_offset);
+  starts.erase(starts.begin() + first_line + 1,
+               starts.begin() + last_line + 1);
+  for (size_t i = first_line + 1; i < starts.size(); i++)
+    starts[i] += delta;
+  starts.insert(starts.begin() + first_line + 1, inserted_starts.begin(),
+                inserted_starts.end());
+
+  // Rehash the changed lines only. |buffer_lines| leaves out an empty last
+  // line; add its hash back while editing.
+  std::lock_guard<std::mutex> lock(line_mapping_mutex_);
+  if (buffer_hashes_.size() == num_visible_lines) {
+    if (num_visible_lines < num_lines)
+      buffer_hashes_.push_back(HashLine(""));
+    std::vector<uint64_t> changed_hashes;
+    for (size_t i = first_line; i <= first_line + inserted_starts.size(); i++)
+      changed_hashes.push_back(HashLine(buffer_lines[i]));
+    buffer_hashes_.erase(buffer_hashes_.begin() + first_line,
+                         buffer_hashes_.begin() + last_line + 1);
+    buffer_hashes_.insert(buffer_hashes_.begin() + first_line,
+                          changed_hashes.begin(), changed_hashes.end());
+    if (buffer_lines.size() < starts.size())
+      buffer_hashes_.pop_back();
+  } else {
+    buffer_hashes_.clear();
+  }
+
+  OnBufferChanged();
+}
+
+int WorkingFile::GetBufferOffset(lsPosition position) const {
+  const std::vector<int>& starts = buffer_lines.starts();
+  int line = std::max(position.line, 0);
+  if (line >= int(starts.size()))
+    return int(buffer_content.size());
+  int start = starts[line];
+  return start + GetOffsetForPosition(
+                     lsPosition(0, position.character),
+                     std::string_view(buffer_content).substr(start));
+}
+
+size_t WorkingFile::EstimateMemoryUsage() {
+  size_t bytes = HeapBytes(filename) + HeapBytes(buffer_content) +
+                 HeapBytes(index_content) + HeapBytes(index_lines.starts()) +
+                 HeapBytes(buffer_lines.starts()) + HeapBytes(index_to_buffer) +
+                 HeapBytes(buffer_to_index) + HeapBytes(diagnostics_);
+  for (const lsDiagnostic& diagnostic : diagnostics_)
+    bytes += HeapBytes(diagnostic.message);
+  if (buffer_snapshot_)
+    bytes += HeapBytes(*buffer_snapshot_);
+  std::lock_guard<std::mutex> lock(line_mapping_mutex_);
+  return bytes + HeapBytes(index_hashes_) + HeapBytes(index_unique_) +
+         HeapBytes(buffer_hashes_);
+}
+
+void WorkingFile::OnBufferChanged() {
+  buffer_snapshot_.reset();
 
   index_to_buffer.clear();
   buffer_to_index.clear();
@@ -235,52 +401,26 @@ void WorkingFile::OnBufferContentUpdated() {
 // buffer. And then using them as start points to extend upwards and downwards
 // to align other identical lines (but not unique).
 void WorkingFile::ComputeLineMapping() {
-  std::unordered_map<uint64_t, int> hash_to_unique;
-  std::vector<uint64_t> index_hashes(index_lines.size());
-  std::vector<uint64_t> buffer_hashes(buffer_lines.size());
-  index_to_buffer.resize(index_lines.size());
-  buffer_to_index.resize(buffer_lines.size());
-  hash_to_unique.reserve(
-      std::max(index_to_buffer.size(), buffer_to_index.size()));
-
-  // For index line i, set index_to_buffer[i] to -1 if line i is duplicated.
-  int i = 0;
-  for (auto& line : index_lines) {
-    std::string trimmed = Trim(line);
-    uint64_t h = HashUsr(trimmed);
-    auto it = hash_to_unique.find(h);
-    if (it == hash_to_unique.end()) {
-      hash_to_unique[h] = i;
-      index_to_buffer[i] = i;
-    } else {
-      if (it->second >= 0)
-        index_to_buffer[it->second] = -1;
-      index_to_buffer[i] = it->second = -1;
-    }
-    index_hashes[i++] = h;
-  }
-
-  // For buffer line i, set buffer_to_index[i] to -1 if line i is duplicated.
-  i = 0;
-  hash_to_unique.clear();
-  for (auto& line : buffer_lines) {
-    std::string trimmed = Trim(line);
-    uint64_t h = HashUsr(trimmed);
-    auto it = hash_to_unique.find(h);
-    if (it == hash_to_unique.end()) {
-      hash_to_unique[h] = i;
-      buffer_to_index[i] = i;
-    } else {
-      if (it->second >= 0)
-        buffer_to_index[it->second] = -1;
-      buffer_to_index[i] = it->second = -1;
-    }
-    buffer_hashes[i++] = h;
+  // Line hashes are kept between calls; only lines changed since the last
+  // call are hashed again.
+  if (index_hashes_.size() != index_lines.size()) {
+    index_hashes_ = HashLines(index_lines);
+    index_unique_ = GetUniqueLines(index_hashes_, nullptr);
   }
+  if (buffer_hashes_.size() != buffer_lines.size())
+    buffer_hashes_ = HashLines(buffer_lines);
+  const std::vector<uint64_t>& index_hashes = index_hashes_;
+  const std::vector<uint64_t>& buffer_hashes = buffer_hashes_;
+
+  // For index line i, index_to_buffer[i] is -1 if line i is duplicated. The
+  // same goes for buffer lines.
+  std::unordered_map<uint64_t, int> hash_to_unique;
+  index_to_buffer = index_unique_;
+  buffer_to_index = GetUniqueLines(buffer_hashes, &hash_to_unique);
 
   // If index line i is the identical to buffer line j, and they are both
   // unique, align them by pointing from_index[i] to j.
-  i = 0;
+  int i = 0;
   for (auto h : index_hashes) {
     if (index_to_buffer[i] >= 0) {
       auto it = hash_to_unique.find(h);
@@ -336,12 +476,74 @@ optional<int> WorkingFile::GetBufferPosFromIndexPos(int line,
     return nullopt;
   }
 
-  if (index_to_buffer.empty())
-    ComputeLineMapping();
+  {
+    std::lock_guard<std::mutex> lock(line_mapping_mutex_);
+    if (index_to_buffer.empty())
+      ComputeLineMapping();
+  }
   return FindMatchingLine(index_lines, index_to_buffer, line, column,
                           buffer_lines, is_end);
 }
 
+std::vector<optional<int>> WorkingFile::GetBufferLinesFromIndexLines(
+    const std::vector<int>& lines) {
+  {
+    std::lock_guard<std::mutex> lock(line_mapping_mutex_);
+    if (index_to_buffer.empty())
+      ComputeLineMapping();
+  }
+
+  // Same as FindMatchingLine for each line, but the nearest confident lines
+  // are found by one sweep over |index_to_buffer|. |up| is the last confident
+  // line before |scanned|, |down| the first one after the current line.
+  std::vector<optional<int>> result(lines.size());
+  int num_lines = int(index_to_buffer.size());
+  int up = -1, down = -1, scanned = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    int line = lines[i];
+    if (i > 0 && line == lines[i - 1]) {
+      result[i] = result[i - 1];
+      continue;
+    }
+    if (line < 0 || line >= num_lines) {
+      LOG_S(WARNING) << "Bad index_line (got " << line << ", expected [0, "
+                     << num_lines << ")) in " << filename;
+      continue;
+    }
+    assert(line >= scanned && "lines must be sorted");
+    for (; scanned < line; scanned++) {
+      if (index_to_buffer[scanned] >= 0)
+        up = scanned;
+    }
+    if (index_to_buffer[line] >= 0) {
+      result[i] = index_to_buffer[line];
+      continue;
+    }
+
+    if (down <= line) {
+      down = line + 1;
+      while (down < num_lines && index_to_buffer[down] < 0)
+        down++;
+    }
+    int buffer_up = up < 0 ? 0 : index_to_buffer[up];
+    int buffer_down = down >= num_lines ? int(buffer_lines.size()) - 1
+                                        : index_to_buffer[down];
+    if (buffer_up <= buffer_down) {
+      result[i] = FindMostSimilarLine(index_lines[line], buffer_lines,
+                                      buffer_up, buffer_down);
+    }
+  }
+  return result;
+}
+
+int WorkingFile::AlignBufferColumn(int index_line,
+                                   int column,
+                                   int buffer_line,
+                                   bool is_end) const {
+  return AlignColumn(index_lines[index_line], column, buffer_lines[buffer_line],
+                     is_end);
+}
+
 optional<int> WorkingFile::GetIndexPosFromBufferPos(int line,
                                                     int* column,
                                                     bool is_end) {
@@ -349,8 +551,11 @@ optional<int> WorkingFile::GetIndexPosFromBufferPos(int line,
   if (line < 0 || line >= (int)buffer_lines.size())
     return nullopt;
 
-  if (buffer_to_index.empty())
-    ComputeLineMapping();
+  {
+    std::lock_guard<std::mutex> lock(line_mapping_mutex_);
+    if (buffer_to_index.empty())
+      ComputeLineMapping();
+  }
   return FindMatchingLine(buffer_lines, buffer_to_index, line, column,
                           index_lines, is_end);
 }
@@ -361,7 +566,7 @@ std::string WorkingFile::FindClosestCallNameInBuffer(
     lsPosition* completion_position) const {
   *active_parameter = 0;
 
-  int offset = GetOffsetForPosition(position, buffer_content);
+  int offset = GetBufferOffset(position);
 
   // If vscode auto-inserts closing ')' we will begin on ')' token in foo()
   // which will make the below algorithm think it's a nested call.
@@ -410,7 +615,7 @@ lsPosition WorkingFile::FindStableCompletionSource(
     std::string* existing_completion) const {
   *is_global_completion = true;
 
-  int start_offset = GetOffsetForPosition(position, buffer_content);
+  int start_offset = GetBufferOffset(position);
   int offset = start_offset;
 
   while (offset > 0) {
@@ -438,54 +643,60 @@ lsPosition WorkingFile::FindStableCompletionSource(
 }
 
 WorkingFile* WorkingFiles::GetFileByFilename(const std::string& filename) {
-  std::lock_guard<std::mutex> lock(files_mutex);
-  return GetFileByFilenameNoLock(filename);
+  std::shared_ptr<const FileMap> file_map = std::atomic_load(&file_map_);
+  auto it = file_map->find(filename);
+  return it != file_map->end() ? it->second : nullptr;
 }
 
 WorkingFile* WorkingFiles::GetFileByFilenameNoLock(
     const std::string& filename) {
-  for (auto& file : files) {
-    if (file->filename == filename)
-      return file.get();
-  }
-  return nullptr;
+  auto it = file_map_->find(filename);
+  return it != file_map_->end() ? it->second : nullptr;
+}
+
+void WorkingFiles::UpdateFileMapNoLock() {
+  auto file_map = std::make_shared<FileMap>();
+  for (const std::unique_ptr<WorkingFile>& file : files)
+    (*file_map)[file->filename] = file.get();
+  std::atomic_store(&file_map_,
+                    std::shared_ptr<const FileMap>(std::move(file_map)));
 }
 
 void WorkingFiles::DoAction(const std::function<void()>& action) {
-  std::lock_guard<std::mutex> lock(files_mutex);
+  std::lock_guard<InstrumentedMutex> lock(files_mutex);
   action();
 }
 
 void WorkingFiles::DoActionOnFile(
     const std::string& filename,
     const std::function<void(WorkingFile* file)>& action) {
-  std::lock_guard<std::mutex> lock(files_mutex);
+  std::lock_guard<InstrumentedMutex> lock(files_mutex);
   WorkingFile* file = GetFileByFilenameNoLock(filename);
   action(file);
 }
 
-WorkingFile* WorkingFiles::OnOpen(const lsTextDocumentItem& open) {
-  std::lock_guard<std::mutex> lock(files_mutex);
+WorkingFile* WorkingFiles::OnOpen(lsTextDocumentItem open) {
+  std::lock_guard<InstrumentedMutex> lock(files_mutex);
 
   std::string filename = open.uri.GetPath();
-  std::string content = open.text;
 
   // The file may already be open.
   if (WorkingFile* file = GetFileByFilenameNoLock(filename)) {
     file->version = open.version;
-    file->buffer_content = content;
+    file->buffer_content = std::move(open.text);
     file->OnBufferContentUpdated();
     return file;
   }
 
-  files.push_back(MakeUnique<WorkingFile>(filename, content));
+  files.push_back(MakeUnique<WorkingFile>(filename, std::move(open.text)));
+  UpdateFileMapNoLock();
   return files[files.size() - 1].get();
 }
 
-void WorkingFiles::OnChange(const lsTextDocumentDidChangeParams& change) {
-  std::lock_guard<std::mutex> lock(files_mutex);
+void WorkingFiles::OnChange(lsTextDocumentDidChangeParams* change) {
+  std::lock_guard<InstrumentedMutex> lock(files_mutex);
 
-  std::string filename = change.textDocument.uri.GetPath();
+  std::string filename = change->textDocument.uri.GetPath();
   WorkingFile* file = GetFileByFilenameNoLock(filename);
   if (!file) {
     LOG_S(WARNING) << "Could not change " << filename
@@ -494,38 +705,39 @@ void WorkingFiles::OnChange(const lsTextDocumentDidChangeParams& change) {
   }
 
   // version: number | null
-  if (std::holds_alternative<int>(change.textDocument.version))
-    file->version = std::get<int>(change.textDocument.version);
+  if (std::holds_alternative<int>(change->textDocument.version))
+    file->version = std::get<int>(change->textDocument.version);
 
-  for (const lsTextDocumentContentChangeEvent& diff : change.contentChanges) {
+  for (lsTextDocumentContentChangeEvent& diff : change->contentChanges) {
     // Per the spec replace everything if the rangeLength and range are not set.
     // See https://github.com/Microsoft/language-server-protocol/issues/9.
     if (!diff.range) {
-      file->buffer_content = diff.text;
+      file->buffer_content = std::move(diff.text);
+      diff.text.clear();
       file->OnBufferContentUpdated();
     } else {
-      int start_offset =
-          GetOffsetForPosition(diff.range->start, file->buffer_content);
+      int start_offset = file->GetBufferOffset(diff.range->start);
       // Ignore TextDocumentContentChangeEvent.rangeLength which causes trouble
       // when UTF-16 surrogate pairs are used.
-      int end_offset =
-          GetOffsetForPosition(diff.range->end, file->buffer_content);
-      file->buffer_content.replace(file->buffer_content.begin() + start_offset,
-                                   file->buffer_content.begin() + end_offset,
-                                   diff.text);
-      file->OnBufferContentUpdated();
+      int end_offset = file->GetBufferOffset(diff.range->end);
+      // Guard against reversed ranges.
+      end_offset = std::max(end_offset, start_offset);
+      file->ApplyChange(start_offset, end_offset, diff.text);
     }
   }
 }
 
 void WorkingFiles::OnClose(const lsTextDocumentIdentifier& close) {
-  std::lock_guard<std::mutex> lock(files_mutex);
+  std::lock_guard<InstrumentedMutex> lock(files_mutex);
 
   std::string filename = close.uri.GetPath();
 
   for (int i = 0; i < files.size(); ++i) {
     if (files[i]->filename == filename) {
+      // Unpublish the file before freeing it.
+      std::unique_ptr<WorkingFile> closed = std::move(files[i]);
       files.erase(files.begin() + i);
+      UpdateFileMapNoLock();
       return;
     }
   }
@@ -536,13 +748,18 @@ void WorkingFiles::OnClose(const lsTextDocumentIdentifier& close) {
 
 WorkingFiles::Snapshot WorkingFiles::AsSnapshot(
     const std::vector<std::string>& filter_paths) {
-  std::lock_guard<std::mutex> lock(files_mutex);
+  std::lock_guard<InstrumentedMutex> lock(files_mutex);
 
   Snapshot result;
   result.files.reserve(files.size());
   for (const auto& file : files) {
-    if (filter_paths.empty() || FindAnyPartial(file->filename, filter_paths))
-      result.files.push_back({file->filename, file->buffer_content});
+    if (filter_paths.empty() || FindAnyPartial(file->filename, filter_paths)) {
+      if (!file->buffer_snapshot_) {
+        file->buffer_snapshot_ =
+            std::make_shared<const std::string>(file->buffer_content);
+      }
+      result.files.push_back({file->filename, file->buffer_snapshot_});
+    }
   }
   return result;
 }
@@ -553,6 +770,13 @@ lsPosition CharPos(const WorkingFile& file,
   return CharPos(file.buffer_content, character, character_offset);
 }
 
+std::vector<std::string> GetLines(const TextLines& lines) {
+  std::vector<std::string> result;
+  for (size_t i = 0; i < lines.size(); i++)
+    result.push_back(std::string(lines[i]));
+  return result;
+}
+
 TEST_SUITE("WorkingFile") {
   TEST_CASE("simple call") {
     WorkingFile f("foo.cc", "abcd(1, 2");
@@ -648,4 +872,64 @@ TEST_SUITE("WorkingFile") {
                                  &existing_completion);
     REQUIRE(existing_completion == "ABC_");
   }
+
+  TEST_CASE("lookup by filename") {
+    WorkingFiles working_files;
+    lsTextDocumentItem a;
+    a.uri = lsDocumentUri::FromPath("/a.cc");
+    a.version = 1;
+    lsTextDocumentItem b = a;
+    b.uri = lsDocumentUri::FromPath("/b.cc");
+    WorkingFile* file_a = working_files.OnOpen(a);
+    WorkingFile* file_b = working_files.OnOpen(b);
+    REQUIRE(working_files.GetFileByFilename(a.uri.GetPath()) == file_a);
+    REQUIRE(working_files.GetFileByFilename(b.uri.GetPath()) == file_b);
+    REQUIRE(working_files.OnOpen(a) == file_a);
+
+    lsTextDocumentIdentifier close;
+    close.uri = a.uri;
+    working_files.OnClose(close);
+    REQUIRE(!working_files.GetFileByFilename(a.uri.GetPath()));
+    REQUIRE(working_files.GetFileByFilename(b.uri.GetPath()) == file_b);
+  }
+
+  TEST_CASE("snapshots share unchanged buffers") {
+    WorkingFiles working_files;
+    working_files.files.push_back(MakeUnique<WorkingFile>("foo.cc", "abc"));
+    WorkingFile* f = working_files.files[0].get();
+
+    WorkingFiles::Snapshot a = working_files.AsSnapshot({});
+    WorkingFiles::Snapshot b = working_files.AsSnapshot({});
+    REQUIRE(a.files[0].content == b.files[0].content);
+
+    f->buffer_content = "abcd";
+    f->OnBufferContentUpdated();
+    WorkingFiles::Snapshot c = working_files.AsSnapshot({});
+    REQUIRE(*a.files[0].content == "abc");
+    REQUIRE(*c.files[0].content == "abcd");
+  }
+
+  TEST_CASE("lines") {
+    std::string text = "ab\r\n\ncd\n";
+    TextLines lines(&text);
+    lines.Update();
+    REQUIRE(GetLines(lines) == ToLines(text, false));
+    REQUIRE(lines[3] == "");
+    text = "ab";
+    lines.Update();
+    REQUIRE(GetLines(lines) == ToLines(text, false));
+  }
+
+  TEST_CASE("incremental change") {
+    WorkingFile f("foo.cc", "ab\r\ncd\nef");
+    f.ApplyChange(f.GetBufferOffset(lsPosition(0, 1)),
+                  f.GetBufferOffset(lsPosition(1, 1)), "X\nY");
+    REQUIRE(f.buffer_content == "aX\nYd\nef");
+    REQUIRE(GetLines(f.buffer_lines) == ToLines(f.buffer_content, false));
+    f.ApplyChange(f.GetBufferOffset(lsPosition(2, 2)),
+                  f.GetBufferOffset(lsPosition(2, 2)), "\n");
+    REQUIRE(GetLines(f.buffer_lines) == ToLines(f.buffer_content, false));
+    REQUIRE(f.GetBufferOffset(lsPosition(2, 1)) == 7);
+    REQUIRE(f.GetBufferOffset(lsPosition(9, 0)) == f.buffer_content.size());
+  }
 }
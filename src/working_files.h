@@ -1,23 +1,65 @@
 #pragma once
 
+#include "instrumented_mutex.h"
 #include "language_server_api.h"
 #include "utils.h"
 
 #include <clang-c/Index.h>
 #include <optional.h>
+#include <string_view.h>
 
+#include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+// The lines of a text as views into it. Like ToLines, a line does not include
+// its trailing '\r', and there is no empty line after a final '\n'. Only the
+// offset of each line is stored, so the lines are not copied; views are valid
+// until the text changes.
+class TextLines {
+ public:
+  explicit TextLines(const std::string* text) : text_(text) {}
+
+  // Recomputes the line starts. Must be called whenever the text has changed,
+  // unless |starts()| were updated to match.
+  void Update();
+
+  size_t size() const {
+    return starts_.size() - (size_t(starts_.back()) == text_->size());
+  }
+  // |line| may also be size() if the text ends with a '\n'; that last line is
+  // empty.
+  std::string_view operator[](size_t line) const;
+
+  // Offset in the text of the start of each line, ie, 0 and every offset after
+  // a '\n'. Unlike the lines this includes an empty last line.
+  const std::vector<int>& starts() const { return starts_; }
+  std::vector<int>& starts() { return starts_; }
+
+ private:
+  const std::string* text_;
+  std::vector<int> starts_{0};
+};
 
 struct WorkingFile {
   int version = 0;
+  // Incremented whenever the buffer or index content changes, so results
+  // computed from the file can be cached. Unlike |version|, which the client
+  // may leave unchanged, this always changes.
+  uint32_t change_count = 0;
   std::string filename;
 
   std::string buffer_content;
+  // The content of the file when it was indexed.
+  std::string index_content;
   // Note: This assumes 0-based lines (1-based lines are normally assumed).
-  std::vector<std::string> index_lines;
+  TextLines index_lines{&index_content};
+  // HashStorageKey of |index_content|, or 0 if unknown.
+  uint64_t index_content_hash = 0;
   // Note: This assumes 0-based lines (1-based lines are normally assumed).
-  std::vector<std::string> buffer_lines;
+  TextLines buffer_lines{&buffer_content};
   // Mappings between index line number and buffer line number.
   // Empty indicates either buffer or index has been changed and re-computation
   // is required.
@@ -30,19 +72,44 @@ struct WorkingFile {
   // NOTE: _ is appended because it must be accessed under the WorkingFiles
   // lock!
   std::vector<lsDiagnostic> diagnostics_;
+  // Immutable copy of |buffer_content| shared by every snapshot taken until the
+  // buffer changes, so snapshots of unchanged files do not copy them again.
+  // NOTE: Must be accessed under the WorkingFiles lock.
+  std::shared_ptr<const std::string> buffer_snapshot_;
 
-  WorkingFile(const std::string& filename, const std::string& buffer_content);
+  WorkingFile(const std::string& filename, std::string buffer_content);
 
-  // This should be called when the indexed content has changed.
-  void SetIndexContent(const std::string& index_content);
+  // This should be called when the indexed content has changed. |hash| is
+  // the HashStorageKey of |index_content|, or 0 if unknown.
+  void SetIndexContent(std::string index_content, uint64_t hash);
   // This should be called whenever |buffer_content| has changed.
   void OnBufferContentUpdated();
+  // Replaces [start_offset, end_offset) of |buffer_content| with |text|. Only
+  // the changed lines of |buffer_lines| are rebuilt.
+  void ApplyChange(int start_offset, int end_offset, const std::string& text);
+  // Same as GetOffsetForPosition(position, buffer_content), but only scans the
+  // line of |position|.
+  int GetBufferOffset(lsPosition position) const;
+
+  // Approximate heap memory owned by the file.
+  size_t EstimateMemoryUsage();
 
   // Finds the buffer line number which maps to index line number |line|.
   // Also resolves |column| if not NULL.
   // When resolving a range, use is_end = false for begin() and is_end =
   // true for end() to get a better alignment of |column|.
   optional<int> GetBufferPosFromIndexPos(int line, int* column, bool is_end);
+  // Finds the buffer line numbers which map to the index line numbers
+  // |lines| like GetBufferPosFromIndexPos, without resolving columns. |lines|
+  // must be sorted; the line mapping is checked once for all of them.
+  std::vector<optional<int>> GetBufferLinesFromIndexLines(
+      const std::vector<int>& lines);
+  // Resolves |column| of index line |index_line| on the buffer line
+  // |buffer_line| it maps to, see GetBufferPosFromIndexPos.
+  int AlignBufferColumn(int index_line,
+                        int column,
+                        int buffer_line,
+                        bool is_end) const;
   // Finds the index line number which maps to buffer line number |line|.
   // Also resolves |column| if not NULL.
   optional<int> GetIndexPosFromBufferPos(int line, int* column, bool is_end);
@@ -74,13 +141,27 @@ struct WorkingFile {
  private:
   // Compute index_to_buffer and buffer_to_index.
   void ComputeLineMapping();
+  // Clears state derived from |buffer_content| besides the lines.
+  void OnBufferChanged();
+
+  // Hashes of the trimmed |index_lines| and |buffer_lines|, and
+  // |index_to_buffer| before alignment, ie, i for unique index lines and -1
+  // for others. Recomputed by ComputeLineMapping when the sizes do not match
+  // the lines. Guarded by |line_mapping_mutex_|.
+  std::vector<uint64_t> index_hashes_;
+  std::vector<int> index_unique_;
+  std::vector<uint64_t> buffer_hashes_;
+
+  // The line mapping is computed lazily by the position lookups above, which
+  // may run concurrently on querydb reader threads.
+  std::mutex line_mapping_mutex_;
 };
 
 struct WorkingFiles {
   struct Snapshot {
     struct File {
       std::string filename;
-      std::string content;
+      std::shared_ptr<const std::string> content;
     };
 
     std::vector<CXUnsavedFile> AsUnsavedFiles() const;
@@ -91,7 +172,8 @@ struct WorkingFiles {
   // :: IMPORTANT :: All methods in this class are guarded by a single lock.
   //
 
-  // Find the file with the given filename.
+  // Find the file with the given filename. Does not take the lock, so it is
+  // cheap enough to call for each location of a result.
   WorkingFile* GetFileByFilename(const std::string& filename);
   WorkingFile* GetFileByFilenameNoLock(const std::string& filename);
 
@@ -102,8 +184,11 @@ struct WorkingFiles {
   void DoActionOnFile(const std::string& filename,
                       const std::function<void(WorkingFile* file)>& action);
 
-  WorkingFile* OnOpen(const lsTextDocumentItem& open);
-  void OnChange(const lsTextDocumentDidChangeParams& change);
+  // The text of the document is moved into the working file.
+  WorkingFile* OnOpen(lsTextDocumentItem open);
+  // Changes which replace the whole document are moved out of |change|, the
+  // others are left as they are.
+  void OnChange(lsTextDocumentDidChangeParams* change);
   void OnClose(const lsTextDocumentIdentifier& close);
 
   // If |filter_paths| is non-empty, only files which contain any of the given
@@ -114,5 +199,16 @@ struct WorkingFiles {
   // Use unique_ptrs so we can handout WorkingFile ptrs and not have them
   // invalidated if we resize files.
   std::vector<std::unique_ptr<WorkingFile>> files;
-  std::mutex files_mutex;  // Protects |files|.
+  InstrumentedMutex files_mutex{"working_files"};  // Protects |files|.
+
+ private:
+  using FileMap = std::unordered_map<std::string, WorkingFile*>;
+
+  // Rebuilds |file_map_| from |files|, under the lock.
+  void UpdateFileMapNoLock();
+
+  // The files of |files| by filename. The map is immutable and replaced when
+  // a file is opened or closed, so it can be read without the lock; use
+  // std::atomic_load and std::atomic_store.
+  std::shared_ptr<const FileMap> file_map_ = std::make_shared<FileMap>();
 };